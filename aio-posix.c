@@ -18,6 +18,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #ifdef CONFIG_EPOLL
 #include <sys/epoll.h>
 #endif
@@ -27,10 +28,18 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
     int deleted;
     void *opaque;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
+#ifdef CONFIG_LINUX_IO_URING
+    unsigned io_uring_flags;
+    int io_uring_events;        /* poll mask of the request in flight */
+    QSLIST_ENTRY(AioHandler) io_uring_next;
+#endif
 };
 
 #ifdef CONFIG_EPOLL
@@ -38,12 +47,29 @@ struct AioHandler
 /* The fd number threashold to switch to epoll */
 #define EPOLL_ENABLE_THRESHOLD 64
 
+/* Go back to letting the GSource poll each handler's fd */
+static void aio_epoll_g_source_detach(AioContext *ctx)
+{
+    AioHandler *node;
+
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_g_source = false;
+}
+
 static void aio_epoll_disable(AioContext *ctx)
 {
     ctx->epoll_available = false;
     if (!ctx->epoll_enabled) {
         return;
     }
+    if (ctx->epoll_g_source) {
+        aio_epoll_g_source_detach(ctx);
+    }
     ctx->epoll_enabled = false;
     close(ctx->epollfd);
 }
@@ -86,8 +112,9 @@ static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
         return;
     }
     if (!node->pfd.events) {
+        /* The fd may be closed already, which removed it from the set */
         r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
-        if (r) {
+        if (r && errno != EBADF && errno != ENOENT) {
             aio_epoll_disable(ctx);
         }
     } else {
@@ -107,38 +134,79 @@ static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
     }
 }
 
-static int aio_epoll(AioContext *ctx, GPollFD *pfds,
-                     unsigned npfd, int64_t timeout)
+/* Store the ready events of the epoll set in the handlers' revents */
+static int aio_epoll_get_events(AioContext *ctx, int timeout)
 {
     AioHandler *node;
-    int i, ret = 0;
+    int i, ret;
     struct epoll_event events[128];
 
+    ret = epoll_wait(ctx->epollfd, events,
+                     sizeof(events) / sizeof(events[0]),
+                     timeout);
+    for (i = 0; i < ret; i++) {
+        int ev = events[i].events;
+        node = events[i].data.ptr;
+        node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+            (ev & EPOLLOUT ? G_IO_OUT : 0) |
+            (ev & EPOLLHUP ? G_IO_HUP : 0) |
+            (ev & EPOLLERR ? G_IO_ERR : 0);
+    }
+    return ret;
+}
+
+static int aio_epoll(AioContext *ctx, GPollFD *pfds,
+                     unsigned npfd, int64_t timeout)
+{
+    int ret = 0;
+
     assert(npfd == 1);
     assert(pfds[0].fd == ctx->epollfd);
     if (timeout > 0) {
         ret = qemu_poll_ns(pfds, npfd, timeout);
     }
     if (timeout <= 0 || ret > 0) {
-        ret = epoll_wait(ctx->epollfd, events,
-                         sizeof(events) / sizeof(events[0]),
-                         timeout);
-        if (ret <= 0) {
-            goto out;
-        }
-        for (i = 0; i < ret; i++) {
-            int ev = events[i].events;
-            node = events[i].data.ptr;
-            node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
-                (ev & EPOLLOUT ? G_IO_OUT : 0) |
-                (ev & EPOLLHUP ? G_IO_HUP : 0) |
-                (ev & EPOLLERR ? G_IO_ERR : 0);
-        }
-    }
-out:
+        ret = aio_epoll_get_events(ctx, timeout);
+    }
     return ret;
 }
 
+/* When the context is dispatched from a glib main loop, hand glib the
+ * epoll fd alone instead of one GPollFD per handler.  The GSource then
+ * costs the same to prepare and poll however many fds the context has,
+ * and aio_pending() fetches the ready handlers from the epoll set.
+ */
+void aio_context_setup_g_source(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (ctx->epoll_g_source || !ctx->epoll_available) {
+        return;
+    }
+    if (!ctx->epoll_enabled && !aio_epoll_try_enable(ctx)) {
+        aio_epoll_disable(ctx);
+        return;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_g_source = true;
+}
+
+static void aio_epoll_g_source_check(AioContext *ctx)
+{
+    if (ctx->epoll_g_source && ctx->epoll_pfd.revents) {
+        ctx->epoll_pfd.revents = 0;
+        aio_epoll_get_events(ctx, 0);
+    }
+}
+
 static bool aio_epoll_enabled(AioContext *ctx)
 {
     /* Fall back to ppoll when external clients are disabled. */
@@ -187,6 +255,278 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
     return false;
 }
 
+void aio_context_setup_g_source(AioContext *ctx)
+{
+}
+
+static void aio_epoll_g_source_check(AioContext *ctx)
+{
+}
+
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+
+/* Like epoll, io_uring only pays off once ppoll has many fds to scan */
+#define IO_URING_ENABLE_THRESHOLD 64
+
+/* Submission queue size; the completion queue is twice as large */
+#define IO_URING_ENTRIES 128
+
+enum {
+    IO_URING_PENDING = 1,   /* on ctx->io_uring_submit_list */
+    IO_URING_ARMED   = 2,   /* a poll request for the node is in flight */
+    IO_URING_DELETE  = 4,   /* free once no request refers to the node */
+};
+
+/* Registration changes are not submitted right away: they are collected on
+ * ctx->io_uring_submit_list and go to the kernel together with the next
+ * wait, in a single io_uring_enter() call.
+ */
+static void aio_io_uring_queue(AioContext *ctx, AioHandler *node)
+{
+    if (!(node->io_uring_flags & IO_URING_PENDING)) {
+        node->io_uring_flags |= IO_URING_PENDING;
+        QSLIST_INSERT_HEAD(&ctx->io_uring_submit_list, node, io_uring_next);
+    }
+}
+
+static void aio_io_uring_update(AioContext *ctx, AioHandler *node)
+{
+    if (ctx->io_uring_enabled &&
+        (node->deleted || node->pfd.events != node->io_uring_events)) {
+        aio_io_uring_queue(ctx, node);
+    }
+}
+
+static void aio_free_handler(AioContext *ctx, AioHandler *node)
+{
+    /* The kernel may still hand the node back to us in a completion */
+    if (node->io_uring_flags & (IO_URING_PENDING | IO_URING_ARMED)) {
+        node->io_uring_flags |= IO_URING_DELETE;
+        aio_io_uring_queue(ctx, node);
+        return;
+    }
+    g_free(node);
+}
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    /* Fall back to ppoll when external clients are disabled. */
+    return !aio_external_disabled(ctx) && ctx->io_uring_enabled;
+}
+
+static struct io_uring_sqe *aio_io_uring_get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->io_uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    int ret;
+
+    /* The submission queue is full, push it to the kernel to make room */
+    while (!sqe) {
+        do {
+            ret = io_uring_submit(ring);
+        } while (ret == -EINTR);
+        assert(ret >= 0);
+        sqe = io_uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+/* Turn the pending registration changes into submission queue entries.
+ *
+ * Poll requests are one-shot and re-armed after the handlers ran, which
+ * keeps the level-triggered semantics that ppoll and epoll provide.  An
+ * armed node whose events changed is cancelled first; the completion of
+ * the cancelled request queues it again.
+ */
+static void aio_io_uring_fill_sq(AioContext *ctx)
+{
+    AioHandler *node;
+    struct io_uring_sqe *sqe;
+
+    while ((node = QSLIST_FIRST(&ctx->io_uring_submit_list))) {
+        QSLIST_REMOVE_HEAD(&ctx->io_uring_submit_list, io_uring_next);
+        node->io_uring_flags &= ~IO_URING_PENDING;
+
+        if (node->io_uring_flags & IO_URING_ARMED) {
+            if (!(node->io_uring_flags & IO_URING_DELETE) && !node->deleted &&
+                node->pfd.events == node->io_uring_events) {
+                continue;
+            }
+            sqe = aio_io_uring_get_sqe(ctx);
+            io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, NULL, 0, 0);
+            sqe->addr = (uintptr_t)node;
+            io_uring_sqe_set_data(sqe, NULL);
+        } else if (node->io_uring_flags & IO_URING_DELETE) {
+            g_free(node);
+        } else if (!node->deleted && node->pfd.events) {
+            sqe = aio_io_uring_get_sqe(ctx);
+            io_uring_prep_poll_add(sqe, node->pfd.fd, node->pfd.events);
+            io_uring_sqe_set_data(sqe, node);
+            node->io_uring_flags |= IO_URING_ARMED;
+            node->io_uring_events = node->pfd.events;
+        }
+    }
+}
+
+/* Move completions into node->pfd.revents for aio_dispatch() */
+static void aio_io_uring_reap(AioContext *ctx)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, n = 0;
+
+    io_uring_for_each_cqe(&ctx->io_uring, head, cqe) {
+        AioHandler *node = io_uring_cqe_get_data(cqe);
+
+        n++;
+        if (!node) {
+            continue;   /* poll removal or timeout */
+        }
+
+        node->io_uring_flags &= ~IO_URING_ARMED;
+        node->io_uring_events = 0;
+        if (cqe->res > 0 && !(node->io_uring_flags & IO_URING_DELETE)) {
+            node->pfd.revents |= cqe->res;
+        }
+        aio_io_uring_queue(ctx, node);
+    }
+    io_uring_cq_advance(&ctx->io_uring, n);
+}
+
+static bool aio_io_uring_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (io_uring_queue_init(IO_URING_ENTRIES, &ctx->io_uring, 0) < 0) {
+        return false;
+    }
+    ctx->io_uring_enabled = true;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        aio_io_uring_update(ctx, node);
+    }
+#ifdef CONFIG_EPOLL
+    aio_epoll_disable(ctx);
+#endif
+    return true;
+}
+
+/* Decide whether this iteration waits on the ring and, if so, prepare the
+ * submission queue.  Called with the AioContext acquired.
+ */
+static bool aio_io_uring_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->io_uring_available || aio_external_disabled(ctx)) {
+        return false;
+    }
+    if (!ctx->io_uring_enabled) {
+        if (npfd < IO_URING_ENABLE_THRESHOLD) {
+            return false;
+        }
+        if (!aio_io_uring_try_enable(ctx)) {
+            ctx->io_uring_available = false;
+            return false;
+        }
+    }
+    aio_io_uring_fill_sq(ctx);
+    return true;
+}
+
+/* Submit the queued changes and wait for a completion, all in one
+ * system call.  The ring is only touched by the polling thread, so this
+ * can run without the AioContext lock.
+ */
+static void aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    unsigned wait_nr = timeout ? 1 : 0;
+    int ret;
+
+    if (timeout > 0) {
+        struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+        /* Completes on expiry or as soon as any fd becomes ready */
+        ts.tv_sec = timeout / NANOSECONDS_PER_SECOND;
+        ts.tv_nsec = timeout % NANOSECONDS_PER_SECOND;
+        io_uring_prep_timeout(sqe, &ts, 1, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+
+    ret = io_uring_submit_and_wait(&ctx->io_uring, wait_nr);
+    assert(ret >= 0 || ret == -EINTR);
+}
+
+static void aio_io_uring_flush(AioContext *ctx)
+{
+    if (aio_io_uring_enabled(ctx)) {
+        aio_io_uring_reap(ctx);
+        aio_io_uring_fill_sq(ctx);
+        io_uring_submit(&ctx->io_uring);
+    }
+}
+
+static void aio_io_uring_destroy(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (!ctx->io_uring_enabled) {
+        return;
+    }
+    io_uring_queue_exit(&ctx->io_uring);
+    ctx->io_uring_enabled = false;
+
+    while ((node = QSLIST_FIRST(&ctx->io_uring_submit_list))) {
+        QSLIST_REMOVE_HEAD(&ctx->io_uring_submit_list, io_uring_next);
+        if (node->io_uring_flags & IO_URING_DELETE) {
+            g_free(node);
+        } else {
+            node->io_uring_flags = 0;
+        }
+    }
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        node->io_uring_flags = 0;
+    }
+}
+
+#else
+
+static void aio_io_uring_update(AioContext *ctx, AioHandler *node)
+{
+}
+
+static void aio_free_handler(AioContext *ctx, AioHandler *node)
+{
+    g_free(node);
+}
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_io_uring_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+static void aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    assert(false);
+}
+
+static void aio_io_uring_reap(AioContext *ctx)
+{
+    assert(false);
+}
+
+static void aio_io_uring_flush(AioContext *ctx)
+{
+}
+
+static void aio_io_uring_destroy(AioContext *ctx)
+{
+}
+
 #endif
 
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
@@ -217,22 +557,27 @@ void aio_set_fd_handler(AioContext *ctx,
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
-        if (node) {
+        if (node == NULL) {
+            return;
+        }
+        if (!ctx->epoll_g_source) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+        }
 
-            /* If the lock is held, just mark the node as deleted */
-            if (ctx->walking_handlers) {
-                node->deleted = 1;
-                node->pfd.revents = 0;
-            } else {
-                /* Otherwise, delete it for real.  We can't just mark it as
-                 * deleted because deleted nodes are only cleaned up after
-                 * releasing the walking_handlers lock.
-                 */
-                QLIST_REMOVE(node, node);
-                deleted = true;
-            }
+        /* If the lock is held, just mark the node as deleted */
+        if (ctx->walking_handlers) {
+            node->deleted = 1;
+            node->pfd.revents = 0;
+        } else {
+            /* Otherwise, delete it for real.  We can't just mark it as
+             * deleted because deleted nodes are only cleaned up after
+             * releasing the walking_handlers lock.
+             */
+            QLIST_REMOVE(node, node);
+            deleted = true;
         }
+        /* No longer monitored, this also drops it from the epoll set */
+        node->pfd.events = 0;
     } else {
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
@@ -240,7 +585,9 @@ void aio_set_fd_handler(AioContext *ctx,
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (!ctx->epoll_g_source) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
             is_new = true;
         }
         /* Update handler with latest information */
@@ -254,9 +601,10 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 
     aio_epoll_update(ctx, node, is_new);
+    aio_io_uring_update(ctx, node);
     aio_notify(ctx);
     if (deleted) {
-        g_free(node);
+        aio_free_handler(ctx, node);
     }
 }
 
@@ -269,8 +617,37 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+
+    if (node) {
+        node->io_poll = io_poll;
+        aio_notify(ctx);
+    }
+}
+
+void aio_set_event_notifier_poll_hooks(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       EventNotifierHandler *io_poll_begin,
+                                       EventNotifierHandler *io_poll_end)
+{
+    AioHandler *node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+
+    if (node) {
+        node->io_poll_begin = (IOHandler *)io_poll_begin;
+        node->io_poll_end = (IOHandler *)io_poll_end;
+    }
+}
+
 bool aio_prepare(AioContext *ctx)
 {
+    /* The glib main loop polls the fds itself, but registration changes
+     * must still reach the ring so that removed fds are released.
+     */
+    aio_io_uring_flush(ctx);
     return false;
 }
 
@@ -278,6 +655,8 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+    aio_epoll_g_source_check(ctx);
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -345,7 +724,7 @@ bool aio_dispatch(AioContext *ctx)
 
         if (!ctx->walking_handlers && tmp->deleted) {
             QLIST_REMOVE(tmp, node);
-            g_free(tmp);
+            aio_free_handler(ctx, tmp);
         }
     }
 
@@ -401,12 +780,123 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* When polling is initially enabled, or after it was shrunk to zero */
+#define POLL_NS_INITIAL 4000
+
+/* Run each polling callback once.  Returns true if any of them saw an event,
+ * and sets *progress unless that was just an aio_notify().
+ */
+static bool run_poll_handlers_once(AioContext *ctx, bool *progress)
+{
+    AioHandler *node;
+    bool fired = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            fired = true;
+            if (node->opaque != &ctx->notifier) {
+                *progress = true;
+            }
+        }
+    }
+    return fired;
+}
+
+static void poll_set_started(AioContext *ctx, bool started)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        IOHandler *fn = started ? node->io_poll_begin : node->io_poll_end;
+
+        if (!node->deleted && node->io_poll && fn &&
+            aio_node_check(ctx, node->is_external)) {
+            fn(node->opaque);
+        }
+    }
+}
+
+/* Busy-wait for up to @max_ns nanoseconds, or until a polling callback sees
+ * an event.  Called with walking_handlers incremented and the AioContext
+ * acquired; the polling callbacks may invoke completion callbacks.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns,
+                              bool *progress)
+{
+    AioHandler *node;
+    int64_t end_time;
+    bool fired = false;
+
+    /* Nothing to poll for but aio_notify()?  Just block. */
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->opaque != &ctx->notifier) {
+            break;
+        }
+    }
+    if (!node) {
+        return false;
+    }
+
+    poll_set_started(ctx, true);
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        fired = run_poll_handlers_once(ctx, progress);
+    } while (!fired && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+    poll_set_started(ctx, false);
+
+    /* Catch events that came in before ->io_poll_end() enabled signalling */
+    if (!fired) {
+        fired = run_poll_handlers_once(ctx, progress);
+    }
+
+    if (fired) {
+        ctx->poll_hits++;
+    } else {
+        ctx->poll_misses++;
+    }
+    return fired;
+}
+
+/* Adapt the polling time to the time that the last blocking aio_poll()
+ * spent waiting for an event, including the polling itself.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_INITIAL;
+        } else {
+            ctx->poll_ns *= grow;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int i, ret;
+    int i, ret = 0;
     bool progress;
+    bool use_io_uring;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -426,22 +916,40 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* poll for a while before going to sleep */
+    if (timeout && ctx->poll_max_ns) {
+        int64_t max_ns = MIN((uint64_t)timeout, (uint64_t)ctx->poll_ns);
+
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (max_ns && run_poll_handlers(ctx, max_ns, &progress)) {
+            timeout = 0;
+        }
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
             && !aio_epoll_enabled(ctx)
+            && !aio_io_uring_enabled(ctx)
             && aio_node_check(ctx, node->is_external)) {
             add_pollfd(node);
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    use_io_uring = aio_io_uring_check_poll(ctx, npfd);
+    if (use_io_uring) {
+        npfd = 0;
+    }
 
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
     }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+    if (use_io_uring) {
+        aio_io_uring_wait(ctx, timeout);
+    } else if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
         AioHandler epoll_handler;
 
         epoll_handler.pfd.fd = ctx->epollfd;
@@ -459,10 +967,16 @@ bool aio_poll(AioContext *ctx, bool blocking)
         aio_context_acquire(ctx);
     }
 
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     aio_notify_accept(ctx);
 
     /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    if (use_io_uring) {
+        aio_io_uring_reap(ctx);
+    } else if (ret > 0) {
         for (i = 0; i < npfd; i++) {
             nodes[i]->pfd.revents = pollfds[i].revents;
         }
@@ -492,4 +1006,29 @@ void aio_context_setup(AioContext *ctx, Error **errp)
         ctx->epoll_available = true;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* The ring itself is set up once the context has enough fds */
+    QSLIST_INIT(&ctx->io_uring_submit_list);
+    ctx->io_uring_available = true;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    aio_io_uring_destroy(ctx);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
 }
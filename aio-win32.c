@@ -20,6 +20,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -374,3 +375,34 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx, Error **errp)
 {
 }
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+void aio_context_setup_g_source(AioContext *ctx)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    /* Polling is not implemented, handlers only run when signaled */
+}
+
+void aio_set_event_notifier_poll_hooks(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       EventNotifierHandler *io_poll_begin,
+                                       EventNotifierHandler *io_poll_end)
+{
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
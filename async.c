@@ -28,6 +28,7 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -233,6 +234,102 @@ aio_ctx_dispatch(GSource     *source,
     return true;
 }
 
+/* Upper limit on the memory kept in each size class of the buffer pool */
+#define AIO_BUFFER_POOL_CLASS_BYTES (4 * 1024 * 1024)
+
+/* Return the buffer pool size class for @size, or -1 if it is too big */
+static int aio_buffer_pool_class(size_t size)
+{
+    int shift;
+
+    if (size <= (1 << AIO_BUFFER_POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    shift = 64 - clz64(size - 1);
+    if (shift > AIO_BUFFER_POOL_MAX_SHIFT) {
+        return -1;
+    }
+    return shift - AIO_BUFFER_POOL_MIN_SHIFT;
+}
+
+void *aio_buffer_pool_get(AioContext *ctx, size_t size, size_t align)
+{
+    AioBufferPool *pool = &ctx->buffer_pool;
+    int cls = aio_buffer_pool_class(size);
+    void *buf = NULL;
+
+    if (cls < 0) {
+        return qemu_try_memalign(align, size ? size : align);
+    }
+
+    /* Pooled buffers are page aligned, which is good enough for anything
+     * but unusual device requirements; those are only allocated here.
+     */
+    if (align <= (1 << AIO_BUFFER_POOL_MIN_SHIFT)) {
+        qemu_mutex_lock(&pool->lock);
+        buf = pool->free[cls];
+        if (buf) {
+            pool->free[cls] = *(void **)buf;
+            pool->nb_free[cls]--;
+        }
+        qemu_mutex_unlock(&pool->lock);
+        if (buf) {
+            return buf;
+        }
+        align = 1 << AIO_BUFFER_POOL_MIN_SHIFT;
+    }
+
+    /* Always allocate the full class size so that the buffer can be reused
+     * for any request of the same class.
+     */
+    size = (size_t)1 << (cls + AIO_BUFFER_POOL_MIN_SHIFT);
+    return qemu_try_memalign(align, size);
+}
+
+void aio_buffer_pool_put(AioContext *ctx, void *buf, size_t size)
+{
+    AioBufferPool *pool = &ctx->buffer_pool;
+    int cls = aio_buffer_pool_class(size);
+
+    if (!buf) {
+        return;
+    }
+    if (cls >= 0) {
+        unsigned int max = AIO_BUFFER_POOL_CLASS_BYTES >>
+                           (cls + AIO_BUFFER_POOL_MIN_SHIFT);
+
+        qemu_mutex_lock(&pool->lock);
+        if (pool->nb_free[cls] < max) {
+            *(void **)buf = pool->free[cls];
+            pool->free[cls] = buf;
+            pool->nb_free[cls]++;
+            buf = NULL;
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+    qemu_vfree(buf);
+}
+
+static void aio_buffer_pool_init(AioBufferPool *pool)
+{
+    qemu_mutex_init(&pool->lock);
+}
+
+static void aio_buffer_pool_cleanup(AioBufferPool *pool)
+{
+    int i;
+
+    for (i = 0; i < AIO_BUFFER_POOL_CLASSES; i++) {
+        while (pool->free[i]) {
+            void *buf = pool->free[i];
+            pool->free[i] = *(void **)buf;
+            qemu_vfree(buf);
+        }
+        pool->nb_free[i] = 0;
+    }
+    qemu_mutex_destroy(&pool->lock);
+}
+
 static void
 aio_ctx_finalize(GSource     *source)
 {
@@ -255,9 +352,11 @@ aio_ctx_finalize(GSource     *source)
 
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     timerlistgroup_deinit(&ctx->tlg);
+    aio_buffer_pool_cleanup(&ctx->buffer_pool);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -269,6 +368,7 @@ static GSourceFuncs aio_source_funcs = {
 
 GSource *aio_get_g_source(AioContext *ctx)
 {
+    aio_context_setup_g_source(ctx);
     g_source_ref(&ctx->source);
     return &ctx->source;
 }
@@ -281,6 +381,23 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
     return ctx->thread_pool;
 }
 
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp)
+{
+    if (min < 0 || min > max || max <= 0 || max > INT_MAX) {
+        error_setg(errp, "bad thread pool bounds (min %" PRId64
+                   ", max %" PRId64 ")", min, max);
+        return;
+    }
+
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+
+    if (ctx->thread_pool) {
+        thread_pool_update_params(ctx->thread_pool, ctx);
+    }
+}
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -322,6 +439,15 @@ static void event_notifier_dummy_cb(EventNotifier *e)
 {
 }
 
+/* Stop polling as soon as someone calls aio_notify() */
+static bool event_notifier_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    return atomic_read(&ctx->notified);
+}
+
 AioContext *aio_context_new(Error **errp)
 {
     int ret;
@@ -344,10 +470,14 @@ AioContext *aio_context_new(Error **errp)
                            false,
                            (EventNotifierHandler *)
                            event_notifier_dummy_cb);
+    aio_set_event_notifier_poll(ctx, &ctx->notifier, event_notifier_poll);
     ctx->thread_pool = NULL;
+    ctx->thread_pool_min = 0;
+    ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
     qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
+    aio_buffer_pool_init(&ctx->buffer_pool);
 
     ctx->notify_dummy_bh = aio_bh_new(ctx, notify_dummy_bh, NULL);
 
@@ -0,0 +1,286 @@
+/*
+ * Atomic helper templates
+ *
+ * Generate the helpers used by TCG for guest atomic operations, see
+ * tcg_gen_atomic_* in tcg/tcg-op.c.
+ *
+ * Included from cputlb.c and user-exec.c, which must define
+ * ATOMIC_MMU_LOOKUP, returning the host address of the access or NULL
+ * if it cannot be performed with host atomic instructions, as well as
+ * atomic_slow_ld() and atomic_slow_st(), which perform an ordinary
+ * access of the size and byte order given by the TCGMemOpIdx.  The
+ * slow path serialises the operations that take it with tcg_atomic_lock,
+ * so it is only suitable for I/O or when no other vCPU runs; the lookup
+ * leaves with EXCP_ATOMIC for anything else that host atomics cannot do.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if DATA_SIZE == 8
+# define SUFFIX     q
+# define DATA_TYPE  uint64_t
+# define BSWAP      bswap64
+#elif DATA_SIZE == 4
+# define SUFFIX     l
+# define DATA_TYPE  uint32_t
+# define BSWAP      bswap32
+#elif DATA_SIZE == 2
+# define SUFFIX     w
+# define DATA_TYPE  uint16_t
+# define BSWAP      bswap16
+#elif DATA_SIZE == 1
+# define SUFFIX     b
+# define DATA_TYPE  uint8_t
+# define BSWAP
+#else
+# error unsupported data size
+#endif
+
+#if DATA_SIZE >= 4
+# define ABI_TYPE  DATA_TYPE
+#else
+# define ABI_TYPE  uint32_t
+#endif
+
+/* Without 64-bit host atomics, 64-bit operations always take the slow
+   path.  */
+#if DATA_SIZE == 8 && !defined(CONFIG_ATOMIC64)
+# define ATOMIC_HOST_LOOKUP  NULL
+#else
+# define ATOMIC_HOST_LOOKUP  ATOMIC_MMU_LOOKUP
+#endif
+
+#define ATOMIC_NAME(X) \
+    HELPER(glue(glue(glue(atomic_ ## X, SUFFIX), END), _mmu))
+#define ATOMIC_HELPER(X) \
+    HELPER(glue(glue(atomic_ ## X, SUFFIX), END))
+
+/* The _mmu functions take the return address into the generated code,
+   the helpers called from TCG compute it themselves.  */
+#define GEN_ATOMIC_HELPER_WRAPPERS(X)                                   \
+ABI_TYPE ATOMIC_HELPER(X)(CPUArchState *env, target_ulong addr,         \
+                          ABI_TYPE val, TCGMemOpIdx oi)                 \
+{                                                                       \
+    return ATOMIC_NAME(X)(env, addr, val, oi, GETPC());                 \
+}
+
+#define GEN_CMPXCHG_WRAPPER                                             \
+ABI_TYPE ATOMIC_HELPER(cmpxchg)(CPUArchState *env, target_ulong addr,   \
+                                ABI_TYPE cmpv, ABI_TYPE newv,           \
+                                TCGMemOpIdx oi)                         \
+{                                                                       \
+    return ATOMIC_NAME(cmpxchg)(env, addr, cmpv, newv, oi, GETPC());    \
+}
+
+/* Slow path of an operation: an ordinary load and store, serialised
+   against the other operations taking the slow path.  */
+#define ATOMIC_SLOW_OP(OLD, NEW)                                        \
+    do {                                                                \
+        tcg_atomic_lock();                                              \
+        OLD = atomic_slow_ld(env, addr, oi, retaddr);                   \
+        atomic_slow_st(env, addr, NEW, oi, retaddr);                    \
+        tcg_atomic_unlock();                                            \
+    } while (0)
+
+/* First the accesses in host byte order, which map directly onto host
+   atomic operations.  */
+
+#if DATA_SIZE == 1
+# define END
+#elif defined(HOST_WORDS_BIGENDIAN)
+# define END  _be
+#else
+# define END  _le
+#endif
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv,
+                              TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;
+    DATA_TYPE ret;
+
+    if (likely(haddr)) {
+        return atomic_cmpxchg(haddr, (DATA_TYPE)cmpv, (DATA_TYPE)newv);
+    }
+    tcg_atomic_lock();
+    ret = atomic_slow_ld(env, addr, oi, retaddr);
+    if (ret == (DATA_TYPE)cmpv) {
+        atomic_slow_st(env, addr, newv, oi, retaddr);
+    }
+    tcg_atomic_unlock();
+    return ret;
+}
+
+GEN_CMPXCHG_WRAPPER
+
+ABI_TYPE ATOMIC_NAME(xchg)(CPUArchState *env, target_ulong addr,
+                           ABI_TYPE val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;
+    DATA_TYPE ret;
+
+    if (likely(haddr)) {
+        return atomic_xchg(haddr, (DATA_TYPE)val);
+    }
+    ATOMIC_SLOW_OP(ret, val);
+    return ret;
+}
+
+GEN_ATOMIC_HELPER_WRAPPERS(xchg)
+
+#define GEN_ATOMIC_HELPER(X, OP, NEW)                                   \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, TCGMemOpIdx oi, uintptr_t retaddr) \
+{                                                                       \
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;                              \
+    DATA_TYPE old;                                                      \
+                                                                        \
+    if (likely(haddr)) {                                                \
+        return atomic_##X(haddr, (DATA_TYPE)val);                       \
+    }                                                                   \
+    ATOMIC_SLOW_OP(old, old OP val);                                    \
+    return NEW ? (DATA_TYPE)(old OP val) : old;                         \
+}                                                                       \
+GEN_ATOMIC_HELPER_WRAPPERS(X)
+
+GEN_ATOMIC_HELPER(fetch_add, +, 0)
+GEN_ATOMIC_HELPER(fetch_and, &, 0)
+GEN_ATOMIC_HELPER(fetch_or, |, 0)
+GEN_ATOMIC_HELPER(fetch_xor, ^, 0)
+GEN_ATOMIC_HELPER(add_fetch, +, 1)
+GEN_ATOMIC_HELPER(and_fetch, &, 1)
+GEN_ATOMIC_HELPER(or_fetch, |, 1)
+GEN_ATOMIC_HELPER(xor_fetch, ^, 1)
+
+#undef GEN_ATOMIC_HELPER
+#undef END
+
+#if DATA_SIZE > 1
+
+/* Then the accesses in the opposite byte order.  Logical operations and
+   exchanges work on byte-swapped operands; additions need a
+   compare-and-swap loop.  */
+
+#ifdef HOST_WORDS_BIGENDIAN
+# define END  _le
+#else
+# define END  _be
+#endif
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv,
+                              TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;
+    DATA_TYPE ret;
+
+    if (likely(haddr)) {
+        return BSWAP(atomic_cmpxchg(haddr, BSWAP((DATA_TYPE)cmpv),
+                                    BSWAP((DATA_TYPE)newv)));
+    }
+    tcg_atomic_lock();
+    ret = atomic_slow_ld(env, addr, oi, retaddr);
+    if (ret == (DATA_TYPE)cmpv) {
+        atomic_slow_st(env, addr, newv, oi, retaddr);
+    }
+    tcg_atomic_unlock();
+    return ret;
+}
+
+GEN_CMPXCHG_WRAPPER
+
+ABI_TYPE ATOMIC_NAME(xchg)(CPUArchState *env, target_ulong addr,
+                           ABI_TYPE val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;
+    DATA_TYPE ret;
+
+    if (likely(haddr)) {
+        return BSWAP(atomic_xchg(haddr, BSWAP((DATA_TYPE)val)));
+    }
+    ATOMIC_SLOW_OP(ret, val);
+    return ret;
+}
+
+GEN_ATOMIC_HELPER_WRAPPERS(xchg)
+
+#define GEN_ATOMIC_HELPER(X, OP, NEW)                                   \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, TCGMemOpIdx oi, uintptr_t retaddr) \
+{                                                                       \
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;                              \
+    DATA_TYPE old;                                                      \
+                                                                        \
+    if (likely(haddr)) {                                                \
+        return BSWAP(atomic_##X(haddr, BSWAP((DATA_TYPE)val)));         \
+    }                                                                   \
+    ATOMIC_SLOW_OP(old, old OP val);                                    \
+    return NEW ? (DATA_TYPE)(old OP val) : old;                         \
+}                                                                       \
+GEN_ATOMIC_HELPER_WRAPPERS(X)
+
+GEN_ATOMIC_HELPER(fetch_and, &, 0)
+GEN_ATOMIC_HELPER(fetch_or, |, 0)
+GEN_ATOMIC_HELPER(fetch_xor, ^, 0)
+GEN_ATOMIC_HELPER(and_fetch, &, 1)
+GEN_ATOMIC_HELPER(or_fetch, |, 1)
+GEN_ATOMIC_HELPER(xor_fetch, ^, 1)
+
+#undef GEN_ATOMIC_HELPER
+
+#define GEN_ATOMIC_ADD_HELPER(X, NEW)                                   \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, TCGMemOpIdx oi, uintptr_t retaddr) \
+{                                                                       \
+    DATA_TYPE *haddr = ATOMIC_HOST_LOOKUP;                              \
+    DATA_TYPE old, ldo, ldn;                                            \
+                                                                        \
+    if (likely(haddr)) {                                                \
+        /* A torn read just makes the first compare-and-swap fail.  */  \
+        ldo = *(volatile DATA_TYPE *)haddr;                             \
+        for (;;) {                                                      \
+            old = BSWAP(ldo);                                           \
+            ldn = atomic_cmpxchg(haddr, ldo,                            \
+                                 BSWAP((DATA_TYPE)(old + val)));        \
+            if (ldn == ldo) {                                           \
+                break;                                                  \
+            }                                                           \
+            ldo = ldn;                                                  \
+        }                                                               \
+    } else {                                                            \
+        ATOMIC_SLOW_OP(old, old + val);                                 \
+    }                                                                   \
+    return NEW ? (DATA_TYPE)(old + val) : old;                          \
+}                                                                       \
+GEN_ATOMIC_HELPER_WRAPPERS(X)
+
+GEN_ATOMIC_ADD_HELPER(fetch_add, 0)
+GEN_ATOMIC_ADD_HELPER(add_fetch, 1)
+
+#undef GEN_ATOMIC_ADD_HELPER
+#undef END
+#endif /* DATA_SIZE > 1 */
+
+#undef ATOMIC_SLOW_OP
+#undef GEN_CMPXCHG_WRAPPER
+#undef GEN_ATOMIC_HELPER_WRAPPERS
+#undef ATOMIC_HELPER
+#undef ATOMIC_NAME
+#undef ATOMIC_HOST_LOOKUP
+#undef ABI_TYPE
+#undef BSWAP
+#undef DATA_TYPE
+#undef SUFFIX
+#undef DATA_SIZE
@@ -266,6 +266,141 @@ f_sample *mixeng_clip[2][2][2][3] = {
     }
 };
 
+#ifndef FLOAT_MIXENG
+static void mixeng_mix_int(struct st_sample *dst, const struct st_sample *src,
+                           int samples)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        dst[i].l += src[i].l;
+        dst[i].r += src[i].r;
+    }
+}
+
+/* Vector versions of the hottest paths: natural endian signed 16 bit
+ * stereo, which is what nearly every guest and backend uses, and mixing
+ * of voices running at the host rate.  They produce the same output as
+ * the generic code, which also handles the tails.
+ */
+#if defined(CONFIG_AVX2_OPT) && QEMU_GNUC_PREREQ(4, 9)
+#define MIXENG_AVX2
+#endif
+
+#ifdef MIXENG_AVX2
+#include <cpuid.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void conv_natural_int16_t_to_stereo_avx2(struct st_sample *dst,
+                                                const void *src, int samples)
+{
+    const int16_t *in = src;
+    __m256i *out = (__m256i *) dst;
+
+    /* 4 frames of 2 channels per iteration, each widened to 64 bits */
+    for (; samples >= 4; samples -= 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) in);
+
+        _mm256_storeu_si256(out++,
+                            _mm256_slli_epi64(_mm256_cvtepi16_epi64(v), 16));
+        _mm256_storeu_si256(out++,
+                            _mm256_slli_epi64(
+                                _mm256_cvtepi16_epi64(_mm_srli_si128(v, 8)),
+                                16));
+        in += 8;
+    }
+    conv_natural_int16_t_to_stereo((struct st_sample *) out, in, samples);
+}
+
+static void clip_natural_int16_t_from_stereo_avx2(void *dst,
+                                                  const struct st_sample *src,
+                                                  int samples)
+{
+    const __m256i *in = (const __m256i *) src;
+    int16_t *out = dst;
+    const __m256i max = _mm256_set1_epi64x(0x7f000000 - 1);
+    const __m256i min = _mm256_set1_epi64x(-2147483648LL);
+    const __m256i smax = _mm256_set1_epi64x(INT16_MAX);
+    const __m256i smin = _mm256_set1_epi64x(INT16_MIN);
+    /* Gather the low 16 bits of each 64-bit lane in the first dword of
+     * each 128-bit half, then bring the two dwords together.
+     */
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 8, 9, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 1, 8, 9, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+    /* 2 frames per iteration, clipped exactly as clip_natural_int16_t */
+    for (; samples >= 2; samples -= 2) {
+        __m256i v = _mm256_loadu_si256(in++);
+        __m256i s = _mm256_srli_epi64(v, 16);
+
+        s = _mm256_blendv_epi8(s, smax, _mm256_cmpgt_epi64(v, max));
+        s = _mm256_blendv_epi8(s, smin, _mm256_cmpgt_epi64(min, v));
+        s = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(s, shuf), perm);
+        _mm_storel_epi64((__m128i *) out, _mm256_castsi256_si128(s));
+        out += 4;
+    }
+    clip_natural_int16_t_from_stereo(out, (const struct st_sample *) in,
+                                     samples);
+}
+
+static void mixeng_mix_avx2(struct st_sample *dst, const struct st_sample *src,
+                            int samples)
+{
+    __m256i *d = (__m256i *) dst;
+    const __m256i *s = (const __m256i *) src;
+
+    for (; samples >= 2; samples -= 2) {
+        _mm256_storeu_si256(d, _mm256_add_epi64(_mm256_loadu_si256(d),
+                                                _mm256_loadu_si256(s)));
+        d++;
+        s++;
+    }
+    mixeng_mix_int((struct st_sample *) d, (const struct st_sample *) s,
+                   samples);
+}
+#pragma GCC pop_options
+
+static bool mixeng_has_avx2(void)
+{
+    unsigned max, a, b, c, d;
+    int bv;
+
+    max = __get_cpuid_max(0, NULL);
+    if (max < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* AVX must be usable, i.e. the OS must save the YMM registers */
+    __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+    __cpuid_count(7, 0, a, b, c, d);
+    return (bv & 6) == 6 && (b & bit_AVX2);
+}
+#endif /* MIXENG_AVX2 */
+
+static void (*mixeng_mix)(struct st_sample *dst, const struct st_sample *src,
+                          int samples) = mixeng_mix_int;
+
+static void __attribute__((constructor)) mixeng_init_accel(void)
+{
+#ifdef MIXENG_AVX2
+    if (mixeng_has_avx2()) {
+        mixeng_conv[1][1][0][1] = conv_natural_int16_t_to_stereo_avx2;
+        mixeng_clip[1][1][0][1] = clip_natural_int16_t_from_stereo_avx2;
+        mixeng_mix = mixeng_mix_avx2;
+    }
+#endif
+}
+#endif /* !FLOAT_MIXENG */
+
 /*
  * August 21, 1998
  * Copyright 1998 Fabrice Bellard.
@@ -331,6 +466,9 @@ void *st_rate_start (int inrate, int outrate)
 
 #define NAME st_rate_flow_mix
 #define OP(a, b) a += b
+#ifndef FLOAT_MIXENG
+#define MIX(dst, src, n) mixeng_mix(dst, src, n)
+#endif
 #include "rate_template.h"
 
 #define NAME st_rate_flow
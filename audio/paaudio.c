@@ -1,6 +1,8 @@
 /* public domain */
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "audio.h"
 
 #include <pulse/pulseaudio.h>
@@ -32,6 +34,9 @@ typedef struct {
     void *pcm_buf;
     struct audio_pt pt;
     paaudio *g;
+    QEMUBH *poll_bh;
+    QEMUTimer *poll_timer;
+    int64_t period_ns;
 } PAVoiceOut;
 
 typedef struct {
@@ -258,6 +263,11 @@ static void *qpa_thread_out (void *arg)
         pa->rpos = rpos;
         pa->live -= decr;
         pa->decr += decr;
+
+        /* In poll mode the end of each period drives the mixing */
+        if (hw->poll_mode) {
+            qemu_bh_schedule (pa->poll_bh);
+        }
     }
 
  exit:
@@ -265,6 +275,29 @@ static void *qpa_thread_out (void *arg)
     return NULL;
 }
 
+static void qpa_poll_out (void *opaque)
+{
+    PAVoiceOut *pa = opaque;
+    int idle;
+
+    audio_run ("pulseaudio poll");
+
+    /*
+     * When nothing was handed to the playback thread it will not kick us
+     * at the end of the next period, so look again after one period.
+     */
+    if (audio_pt_lock (&pa->pt, AUDIO_FUNC)) {
+        return;
+    }
+    idle = pa->hw.poll_mode && !pa->live;
+    audio_pt_unlock (&pa->pt, AUDIO_FUNC);
+
+    if (idle) {
+        timer_mod (pa->poll_timer,
+                   qemu_clock_get_ns (QEMU_CLOCK_VIRTUAL) + pa->period_ns);
+    }
+}
+
 static int qpa_run_out (HWVoiceOut *hw, int live)
 {
     int decr;
@@ -587,6 +620,11 @@ static int qpa_init_out(HWVoiceOut *hw, struct audsettings *as,
         goto fail2;
     }
 
+    pa->poll_bh = qemu_bh_new (qpa_poll_out, pa);
+    pa->poll_timer = timer_new_ns (QEMU_CLOCK_VIRTUAL, qpa_poll_out, pa);
+    pa->period_ns = muldiv64 (g->conf.samples >> 2, get_ticks_per_sec (),
+                              hw->info.freq);
+
     if (audio_pt_init (&pa->pt, qpa_thread_out, hw, AUDIO_CAP, AUDIO_FUNC)) {
         goto fail3;
     }
@@ -594,6 +632,10 @@ static int qpa_init_out(HWVoiceOut *hw, struct audsettings *as,
     return 0;
 
  fail3:
+    timer_free (pa->poll_timer);
+    pa->poll_timer = NULL;
+    qemu_bh_delete (pa->poll_bh);
+    pa->poll_bh = NULL;
     g_free (pa->pcm_buf);
     pa->pcm_buf = NULL;
  fail2:
@@ -677,6 +719,12 @@ static void qpa_fini_out (HWVoiceOut *hw)
         pa->stream = NULL;
     }
 
+    timer_del (pa->poll_timer);
+    timer_free (pa->poll_timer);
+    pa->poll_timer = NULL;
+    qemu_bh_delete (pa->poll_bh);
+    pa->poll_bh = NULL;
+
     audio_pt_fini (&pa->pt, AUDIO_FUNC);
     g_free (pa->pcm_buf);
     pa->pcm_buf = NULL;
@@ -750,6 +798,38 @@ static int qpa_ctl_out (HWVoiceOut *hw, int cmd, ...)
 
             pa_threaded_mainloop_unlock (g->mainloop);
         }
+        break;
+
+    case VOICE_ENABLE:
+        {
+            va_list ap;
+            int poll_mode;
+
+            va_start (ap, cmd);
+            poll_mode = va_arg (ap, int);
+            va_end (ap);
+
+            if (audio_pt_lock (&pa->pt, AUDIO_FUNC)) {
+                return -1;
+            }
+            hw->poll_mode = poll_mode;
+            audio_pt_unlock (&pa->pt, AUDIO_FUNC);
+
+            /* Without the audio timer, start the first period ourselves */
+            if (poll_mode) {
+                qemu_bh_schedule (pa->poll_bh);
+            }
+        }
+        break;
+
+    case VOICE_DISABLE:
+        if (audio_pt_lock (&pa->pt, AUDIO_FUNC)) {
+            return -1;
+        }
+        hw->poll_mode = 0;
+        audio_pt_unlock (&pa->pt, AUDIO_FUNC);
+        timer_del (pa->poll_timer);
+        break;
     }
     return 0;
 }
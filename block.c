@@ -1233,6 +1233,8 @@ void bdrv_set_backing_hd(BlockDriverState *bs, BlockDriverState *backing_hd)
         bdrv_ref(backing_hd);
     }
 
+    bdrv_block_status_invalidate_all();
+
     if (bs->backing) {
         assert(bs->backing_blocker);
         bdrv_op_unblock_all(bs->backing->bs, bs->backing_blocker);
@@ -2092,6 +2094,8 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     drv = reopen_state->bs->drv;
     assert(drv != NULL);
 
+    bdrv_block_status_invalidate_all();
+
     /* If there are any driver level actions to take */
     if (drv->bdrv_reopen_commit) {
         drv->bdrv_reopen_commit(reopen_state);
@@ -2143,9 +2147,7 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_drained_begin(bs); /* complete I/O */
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
-
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    bdrv_block_status_invalidate_all();
 
     if (bs->blk) {
         blk_dev_change_media_cb(bs->blk, false);
@@ -2190,6 +2192,10 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* The driver has stored the persistent bitmaps in bdrv_close() */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -2304,8 +2310,13 @@ static void swap_feature_fields(BlockDriverState *bs_top,
 
     assert(!bs_new->throttle_state);
     if (bs_top->throttle_state) {
+        unsigned weight;
+        int64_t latency_target_ns;
+
         assert(bs_top->io_limits_enabled);
+        throttle_group_get_share(bs_top, &weight, &latency_target_ns);
         bdrv_io_limits_enable(bs_new, throttle_group_get_name(bs_top));
+        throttle_group_set_share(bs_new, weight, latency_target_ns);
         bdrv_io_limits_disable(bs_top);
     }
 }
@@ -2495,6 +2506,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_block_status_invalidate_all();
         if (ret < 0) {
             goto ro_cleanup;
         }
@@ -2686,6 +2698,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
 
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_block_status_invalidate_all();
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dirty_bitmap_truncate(bs);
@@ -3110,6 +3123,25 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+/*
+ * Return a host file descriptor that contains the data of @bs at the same
+ * offsets, so that a caller can read from it without going through the
+ * block layer (e.g. with sendfile()).  This is only possible if nothing in
+ * the read path of @bs would change the result or needs to see the request.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || bs->io_limits_enabled || bs->copy_on_read) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3280,6 +3312,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
     bs->open_flags &= ~BDRV_O_INACTIVE;
+    bdrv_block_status_invalidate_all();
 
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
@@ -3799,10 +3832,14 @@ void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
 int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        BlockDriverAmendStatusCB *status_cb, void *cb_opaque)
 {
+    int ret;
+
     if (!bs->drv->bdrv_amend_options) {
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque);
+    bdrv_block_status_invalidate_all();
+    return ret;
 }
 
 /* This function will be called by the bdrv_recurse_is_first_non_filter method
@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,80 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+/* Replace the latency histogram for @type with an empty one that uses
+ * @boundaries, or disable it if @boundaries is NULL.
+ *
+ * Returns -EINVAL if the boundaries are not strictly increasing.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64List *entry;
+    uint64_t prev = 0;
+    int i, nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry != boundaries && entry->value <= prev) {
+            return -EINVAL;
+        }
+        prev = entry->value;
+        nbins++;
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    if (!boundaries) {
+        hist->nbins = 0;
+        hist->boundaries = NULL;
+        hist->bins = NULL;
+        return 0;
+    }
+
+    hist->nbins = nbins;
+    hist->boundaries = g_new(uint64_t, nbins - 1);
+    for (i = 0, entry = boundaries; entry; i++, entry = entry->next) {
+        hist->boundaries[i] = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, nbins);
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL);
+    }
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    int lo = 0, hi;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    /* Find the first boundary above latency_ns */
+    hi = hist->nbins - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -102,6 +177,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     stats->nr_ops[cookie->type]++;
     stats->total_time_ns[cookie->type] += latency_ns;
     stats->last_access_time_ns = time_ns;
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
@@ -125,6 +202,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 
         stats->total_time_ns[cookie->type] += latency_ns;
         stats->last_access_time_ns = time_ns;
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
 
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
@@ -23,6 +23,8 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS 64
+#define BACKUP_MAX_CHUNK (64 << 20)
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -45,9 +47,29 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     unsigned long *done_bitmap;
     int64_t cluster_size;
+    /* Cleared when bdrv_co_copy_range() fails, e.g. for -ENOTSUP */
+    bool use_copy_range;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Background copy requests: at most max_workers of them are in flight,
+     * each covering up to chunk_clusters clusters.  The first error is
+     * recorded for the job coroutine, which decides what to do about it.
+     */
+    int max_workers;
+    int64_t chunk_clusters;
+    int workers;
+    bool waiting_for_worker;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -91,6 +113,62 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy @nb_sectors starting at cluster @start by reading them into
+ * @bounce_buffer and writing them to the target */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t start,
+                                                      int nb_sectors,
+                                                      void *bounce_buffer,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int n = nb_sectors;
+    int ret;
+
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    if (is_write_notifier) {
+        ret = bdrv_co_readv_no_serialising(bs,
+                                       start * sectors_per_cluster,
+                                       n, &bounce_qiov);
+    } else {
+        ret = bdrv_co_readv(bs, start * sectors_per_cluster, n,
+                            &bounce_qiov);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        ret = bdrv_co_write_zeroes(job->target,
+                                   start * sectors_per_cluster,
+                                   n, BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = bdrv_co_writev(job->target,
+                             start * sectors_per_cluster, n,
+                             &bounce_qiov);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -98,12 +176,10 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
 {
     BackupBlockJob *job = (BackupBlockJob *)bs->job;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t start, end, run;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -116,59 +192,53 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += run) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            run = 1;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        /* Copy as many consecutive clusters as possible in one go */
+        for (run = 1; run < job->chunk_clusters && start + run < end; run++) {
+            if (test_bit(start + run, job->done_bitmap)) {
+                break;
+            }
+        }
+
+        n = MIN(run * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        if (is_write_notifier) {
-            ret = bdrv_co_readv_no_serialising(bs,
-                                           start * sectors_per_cluster,
-                                           n, &bounce_qiov);
-        } else {
-            ret = bdrv_co_readv(bs, start * sectors_per_cluster, n,
-                                &bounce_qiov);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        ret = -ENOTSUP;
+        if (job->use_copy_range) {
+            ret = bdrv_co_copy_range(bs, start * sectors_per_cluster,
+                                     job->target, start * sectors_per_cluster,
+                                     n, is_write_notifier ?
+                                        BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                /* Use a bounce buffer from now on, which also takes care of
+                 * reporting I/O errors with the right source/target flag */
+                job->use_copy_range = false;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * sectors_per_cluster,
-                                       n, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * sectors_per_cluster, n,
-                                 &bounce_qiov);
         }
         if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            if (!bounce_buffer) {
+                bounce_buffer = qemu_blockalign(bs, MIN(end - start,
+                                                        job->chunk_clusters) *
+                                                    job->cluster_size);
+            }
+            ret = backup_cow_with_bounce_buffer(job, start, n, bounce_buffer,
+                                                error_is_read,
+                                                is_write_notifier);
+            if (ret < 0) {
+                goto out;
             }
-            goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, run);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -318,6 +388,166 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+static void coroutine_fn backup_worker_co(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs, w->cluster * sectors_per_cluster,
+                        w->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0 && (job->worker_ret == 0 ||
+                    w->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = w->cluster;
+    }
+    g_free(w);
+
+    job->workers--;
+    if (job->waiting_for_worker) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+/* Wait until at most @max_workers background copy requests are in flight */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max_workers)
+{
+    while (job->workers > max_workers) {
+        job->waiting_for_worker = true;
+        qemu_coroutine_yield();
+        job->waiting_for_worker = false;
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster,
+                                             int64_t nb_clusters)
+{
+    BackupWorker *w;
+    Coroutine *co;
+
+    backup_wait_for_workers(job, job->max_workers - 1);
+
+    w = g_new(BackupWorker, 1);
+    w->job = job;
+    w->cluster = cluster;
+    w->nb_clusters = nb_clusters;
+
+    job->workers++;
+    co = qemu_coroutine_create(backup_worker_co);
+    qemu_coroutine_enter(co, w);
+}
+
+/* Returns whether @cluster has to be copied with sync=top */
+static bool coroutine_fn backup_cluster_is_allocated(BackupBlockJob *job,
+                                                     int64_t cluster)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    /* Check to see if these blocks are already in the backing file. */
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, cluster * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this backup. */
+    return alloced != 0;
+}
+
+/* Returns the number of clusters starting at @start that are copied or, if
+ * *@copy is set to false, skipped together.
+ */
+static int64_t coroutine_fn backup_next_chunk(BackupBlockJob *job,
+                                              int64_t start, int64_t end,
+                                              bool *copy)
+{
+    bool top = job->sync_mode == MIRROR_SYNC_MODE_TOP;
+    int64_t n;
+
+    if (top && !backup_cluster_is_allocated(job, start)) {
+        *copy = false;
+        return 1;
+    }
+
+    *copy = true;
+    for (n = 1; n < job->chunk_clusters && start + n < end; n++) {
+        if (top && !backup_cluster_is_allocated(job, start + n)) {
+            break;
+        }
+    }
+    return n;
+}
+
+/* Copy the whole drive (sync=full) or everything that is allocated in the
+ * topmost image (sync=top), with up to max_workers requests in flight.
+ * Guest writes keep going through the before-write notifier: it waits for
+ * overlapping copy requests and sets the bits in done_bitmap, so there is
+ * no difference in the copy-before-write ordering between the two paths.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int ret = 0;
+
+    while (true) {
+        if (start >= end || block_job_is_cancelled(&job->common)) {
+            backup_wait_for_workers(job, 0);
+            if (job->worker_ret == 0 ||
+                block_job_is_cancelled(&job->common)) {
+                break;
+            }
+        } else if (!yield_and_check(job)) {
+            bool copy;
+            int64_t n = backup_next_chunk(job, start, end, &copy);
+
+            if (copy) {
+                backup_start_worker(job, start, n);
+            }
+            start += n;
+        }
+
+        if (job->worker_ret < 0) {
+            /* Depending on error action, fail now or retry from the first
+             * failed cluster.  Clusters that were copied in the meantime
+             * are skipped thanks to done_bitmap. */
+            BlockErrorAction action;
+
+            backup_wait_for_workers(job, 0);
+            action = backup_error_action(job, job->worker_error_is_read,
+                                         -job->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            start = job->worker_error_cluster;
+            job->worker_ret = 0;
+        }
+    }
+
+    return ret;
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     bool error_is_read;
@@ -390,14 +620,12 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -422,58 +650,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -498,6 +675,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
+                  int64_t max_workers, int64_t max_chunk,
                   BlockCompletionFunc *cb, void *opaque,
                   BlockJobTxn *txn, Error **errp)
 {
@@ -521,6 +699,18 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and 64");
+        return;
+    }
+
+    if (max_chunk < 0 || max_chunk > BACKUP_MAX_CHUNK) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-chunk",
+                   "a value between 0 and 64 MiB");
+        return;
+    }
+
     if (!bdrv_is_inserted(bs)) {
         error_setg(errp, "Device is not inserted: %s",
                    bdrv_get_device_name(bs));
@@ -598,6 +788,10 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    job->use_copy_range = true;
+    job->max_workers = max_workers;
+    job->chunk_clusters = MAX(max_chunk / job->cluster_size, 1);
+
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
@@ -851,6 +851,28 @@ BlockAIOCB *blk_aio_ioctl(BlockBackend *blk, unsigned long int req, void *buf,
     return bdrv_aio_ioctl(blk->bs, req, buf, cb, opaque);
 }
 
+int coroutine_fn blk_co_readv(BlockBackend *blk, int64_t sector_num,
+                              int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_readv(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_writev(BlockBackend *blk, int64_t sector_num,
+                               int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_writev(blk->bs, sector_num, nb_sectors, qiov);
+}
+
 int blk_co_discard(BlockBackend *blk, int64_t sector_num, int nb_sectors)
 {
     int ret = blk_check_request(blk, sector_num, nb_sectors);
@@ -1205,6 +1227,23 @@ int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
     return bdrv_co_write_zeroes(blk->bs, sector_num, nb_sectors, flags);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t sector_in,
+                                   BlockBackend *blk_out, int64_t sector_out,
+                                   int nb_sectors, BdrvRequestFlags flags)
+{
+    int ret = blk_check_request(blk_in, sector_in, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_request(blk_out, sector_out, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range(blk_in->bs, sector_in, blk_out->bs, sector_out,
+                              nb_sectors, flags);
+}
+
 int blk_write_compressed(BlockBackend *blk, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors)
 {
@@ -1292,6 +1331,9 @@ void blk_update_root_state(BlockBackend *blk)
         const char *name = throttle_group_get_name(blk->bs);
         blk->root_state.throttle_group = g_strdup(name);
         blk->root_state.throttle_state = throttle_group_incref(name);
+        throttle_group_get_share(blk->bs,
+                                 &blk->root_state.throttle_weight,
+                                 &blk->root_state.throttle_latency_target_ns);
     } else {
         blk->root_state.throttle_group = NULL;
         blk->root_state.throttle_state = NULL;
@@ -1308,6 +1350,10 @@ void blk_apply_root_state(BlockBackend *blk, BlockDriverState *bs)
     bs->detect_zeroes = blk->root_state.detect_zeroes;
     if (blk->root_state.throttle_group) {
         bdrv_io_limits_enable(bs, blk->root_state.throttle_group);
+        if (blk->root_state.throttle_weight) {
+            throttle_group_set_share(bs, blk->root_state.throttle_weight,
+                                blk->root_state.throttle_latency_target_ns);
+        }
     }
 }
 
@@ -64,9 +64,12 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define READ_AHEAD_MAX_DEFAULT (4 * 1024 * 1024)
+#define CURL_CACHE_SIZE_DEFAULT (4 * 1024 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -76,6 +79,9 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 
 #define CURL_BLOCK_OPT_URL       "url"
 #define CURL_BLOCK_OPT_READAHEAD "readahead"
+#define CURL_BLOCK_OPT_READAHEAD_MAX "readahead-max"
+#define CURL_BLOCK_OPT_CONNECTIONS "connections"
+#define CURL_BLOCK_OPT_CACHE_SIZE "cache-size"
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
 #define CURL_BLOCK_OPT_TIMEOUT "timeout"
 #define CURL_BLOCK_OPT_COOKIE    "cookie"
@@ -113,13 +119,28 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/* Data of a finished transfer, kept for later reads */
+typedef struct CURLCacheEntry {
+    size_t start;
+    size_t len;
+    char *buf;
+    QTAILQ_ENTRY(CURLCacheEntry) next;
+} CURLCacheEntry;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     QEMUTimer timer;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
     size_t readahead_size;
+    size_t readahead_max;
+    size_t cur_readahead;   /* grows while the guest reads sequentially */
+    size_t next_seq;        /* end of the last read */
+    QTAILQ_HEAD(CURLCacheHead, CURLCacheEntry) cache; /* most recent first */
+    size_t cache_size;
+    size_t cache_used;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -235,13 +256,81 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+static void curl_cache_drop(BDRVCURLState *s, CURLCacheEntry *entry)
+{
+    QTAILQ_REMOVE(&s->cache, entry, next);
+    s->cache_used -= entry->len;
+    g_free(entry->buf);
+    g_free(entry);
+}
+
+/* Keep the data received by @state, which is not in use anymore, in the
+ * cache that is shared by all states.  The buffer is taken over by the cache
+ * or freed. */
+static void curl_cache_add(BDRVCURLState *s, CURLState *state)
+{
+    CURLCacheEntry *entry;
+
+    if (!state->orig_buf) {
+        return;
+    }
+    if (!state->buf_off || state->buf_off > s->cache_size) {
+        g_free(state->orig_buf);
+        state->orig_buf = NULL;
+        return;
+    }
+
+    while (s->cache_used + state->buf_off > s->cache_size) {
+        curl_cache_drop(s, QTAILQ_LAST(&s->cache, CURLCacheHead));
+    }
+
+    entry = g_new(CURLCacheEntry, 1);
+    entry->start = state->buf_start;
+    entry->len = state->buf_off;
+    entry->buf = state->orig_buf;
+    QTAILQ_INSERT_HEAD(&s->cache, entry, next);
+    s->cache_used += entry->len;
+
+    state->orig_buf = NULL;
+}
+
+static void curl_cache_clear(BDRVCURLState *s)
+{
+    while (!QTAILQ_EMPTY(&s->cache)) {
+        curl_cache_drop(s, QTAILQ_FIRST(&s->cache));
+    }
+}
+
+static bool curl_cache_find(BDRVCURLState *s, size_t start, size_t len,
+                            CURLAIOCB *acb)
+{
+    CURLCacheEntry *entry;
+
+    QTAILQ_FOREACH(entry, &s->cache, next) {
+        if (start >= entry->start &&
+            start + len <= entry->start + entry->len) {
+            qemu_iovec_from_buf(acb->qiov, 0,
+                                entry->buf + (start - entry->start), len);
+            QTAILQ_REMOVE(&s->cache, entry, next);
+            QTAILQ_INSERT_HEAD(&s->cache, entry, next);
+            return true;
+        }
+    }
+    return false;
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    if (curl_cache_find(s, start, len, acb)) {
+        acb->common.cb(acb->common.opaque, 0);
+        return FIND_RET_OK;
+    }
+
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -390,7 +479,7 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i = 0; i < s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
                 if (s->states[i].acb[j])
                     continue;
@@ -482,7 +571,7 @@ static void curl_detach_aio_context(BlockDriverState *bs)
     BDRVCURLState *s = bs->opaque;
     int i;
 
-    for (i = 0; i < CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use) {
             curl_clean_state(&s->states[i]);
         }
@@ -534,6 +623,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = CURL_BLOCK_OPT_READAHEAD_MAX,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum readahead size for sequential reads",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of concurrent requests to the server",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache for data that was already read",
+        },
         {
             .name = CURL_BLOCK_OPT_SSLVERIFY,
             .type = QEMU_OPT_BOOL,
@@ -608,6 +712,29 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->readahead_max = qemu_opt_get_size(opts, CURL_BLOCK_OPT_READAHEAD_MAX,
+                                         MAX(READ_AHEAD_MAX_DEFAULT,
+                                             s->readahead_size));
+    if ((s->readahead_max & 0x1ff) != 0 ||
+        s->readahead_max < s->readahead_size) {
+        error_setg(errp, "readahead-max must be a multiple of 512 and at "
+                   "least as large as readahead");
+        goto out_noclean;
+    }
+    s->cur_readahead = s->readahead_size;
+
+    s->num_states = qemu_opt_get_number(opts, CURL_BLOCK_OPT_CONNECTIONS,
+                                        CURL_NUM_STATES);
+    if (s->num_states < 1 || s->num_states > CURL_MAX_STATES) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   CURL_MAX_STATES);
+        goto out_noclean;
+    }
+
+    s->cache_size = qemu_opt_get_size(opts, CURL_BLOCK_OPT_CACHE_SIZE,
+                                      CURL_CACHE_SIZE_DEFAULT);
+    QTAILQ_INIT(&s->cache);
+
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
     if (s->timeout > CURL_TIMEOUT_MAX) {
@@ -652,6 +779,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     DPRINTF("CURL: Opening %s\n", file);
+    s->states = g_new0(CURLState, s->num_states);
     s->aio_context = bdrv_get_aio_context(bs);
     s->url = g_strdup(file);
     state = curl_init_state(bs, s);
@@ -695,6 +823,7 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(s->states);
     g_free(s->cookie);
     g_free(s->url);
     qemu_opts_del(opts);
@@ -719,6 +848,9 @@ static void curl_readv_bh_cb(void *p)
 
     size_t start = acb->sector_num * SECTOR_SIZE;
     size_t end;
+    bool sequential = start == s->next_seq;
+
+    s->next_seq = start + acb->nb_sectors * SECTOR_SIZE;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
@@ -743,10 +875,18 @@ static void curl_readv_bh_cb(void *p)
     acb->start = 0;
     acb->end = (acb->nb_sectors * SECTOR_SIZE);
 
+    /* Read ahead more while the guest reads sequentially, so that we need
+     * fewer round trips to the server */
+    if (sequential) {
+        s->cur_readahead = MIN(s->cur_readahead * 2, s->readahead_max);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
+
+    curl_cache_add(s, state);
     state->buf_off = 0;
-    g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = acb->end + s->cur_readahead;
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -791,7 +931,9 @@ static void curl_close(BlockDriverState *bs)
 
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
+    curl_cache_clear(s);
 
+    g_free(s->states);
     g_free(s->cookie);
     g_free(s->url);
 }
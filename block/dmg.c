@@ -27,6 +27,7 @@
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/module.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 #ifdef CONFIG_BZIP2
 #include <bzlib.h>
@@ -41,6 +42,15 @@ enum {
     DMG_SECTORCOUNTS_MAX = DMG_LENGTHS_MAX / 512,
 };
 
+/* Number of uncompressed chunks kept in memory */
+#define DMG_CHUNK_CACHE_SIZE 4
+
+typedef struct DMGChunkCacheEntry {
+    uint32_t chunk;
+    uint8_t *data;
+    uint64_t lru_counter;
+} DMGChunkCacheEntry;
+
 typedef struct BDRVDMGState {
     CoMutex lock;
     /* each chunk contains a certain number of sectors,
@@ -57,13 +67,8 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
-#ifdef CONFIG_BZIP2
-    bz_stream bzstream;
-#endif
+    DMGChunkCacheEntry chunk_cache[DMG_CHUNK_CACHE_SIZE];
+    uint64_t chunk_cache_counter;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -119,40 +124,6 @@ static inline uint32_t buff_read_uint32(const uint8_t *buffer, int64_t offset)
     return be32_to_cpu(*(uint32_t *)&buffer[offset]);
 }
 
-/* Increase max chunk sizes, if necessary.  This function is used to calculate
- * the buffer sizes needed for compressed/uncompressed chunk I/O.
- */
-static void update_max_chunk_size(BDRVDMGState *s, uint32_t chunk,
-                                  uint32_t *max_compressed_size,
-                                  uint32_t *max_sectors_per_chunk)
-{
-    uint32_t compressed_size = 0;
-    uint32_t uncompressed_sectors = 0;
-
-    switch (s->types[chunk]) {
-    case 0x80000005: /* zlib compressed */
-    case 0x80000006: /* bzip2 compressed */
-        compressed_size = s->lengths[chunk];
-        uncompressed_sectors = s->sectorcounts[chunk];
-        break;
-    case 1: /* copy */
-        uncompressed_sectors = (s->lengths[chunk] + 511) / 512;
-        break;
-    case 2: /* zero */
-        /* as the all-zeroes block may be large, it is treated specially: the
-         * sector is not copied from a large buffer, a simple memset is used
-         * instead. Therefore uncompressed_sectors does not need to be set. */
-        break;
-    }
-
-    if (compressed_size > *max_compressed_size) {
-        *max_compressed_size = compressed_size;
-    }
-    if (uncompressed_sectors > *max_sectors_per_chunk) {
-        *max_sectors_per_chunk = uncompressed_sectors;
-    }
-}
-
 static int64_t dmg_find_koly_offset(BlockDriverState *file_bs, Error **errp)
 {
     int64_t length;
@@ -198,9 +169,6 @@ typedef struct DmgHeaderState {
     /* used internally by dmg_read_mish_block to remember offsets of blocks
      * across calls */
     uint64_t data_fork_offset;
-    /* exported for dmg_open */
-    uint32_t max_compressed_size;
-    uint32_t max_sectors_per_chunk;
 } DmgHeaderState;
 
 static bool dmg_is_known_block_type(uint32_t entry_type)
@@ -296,8 +264,6 @@ static int dmg_read_mish_block(BDRVDMGState *s, DmgHeaderState *ds,
             goto fail;
         }
 
-        update_max_chunk_size(s, i, &ds->max_compressed_size,
-                              &ds->max_sectors_per_chunk);
         offset += 40;
     }
     s->n_chunks += chunk_count;
@@ -443,8 +409,6 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
     s->offsets = s->lengths = s->sectors = s->sectorcounts = NULL;
     /* used by dmg_read_mish_block to keep track of the current I/O position */
     ds.data_fork_offset = 0;
-    ds.max_compressed_size = 1;
-    ds.max_sectors_per_chunk = 1;
 
     /* locate the UDIF trailer */
     offset = dmg_find_koly_offset(bs->file->bs, errp);
@@ -514,23 +478,6 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = qemu_try_blockalign(bs->file->bs,
-                                              ds.max_compressed_size + 1);
-    s->uncompressed_chunk = qemu_try_blockalign(bs->file->bs,
-                                                512 * ds.max_sectors_per_chunk);
-    if (s->compressed_chunk == NULL || s->uncompressed_chunk == NULL) {
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    s->current_chunk = s->n_chunks;
-
     qemu_co_mutex_init(&s->lock);
     return 0;
 
@@ -540,22 +487,9 @@ fail:
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    qemu_vfree(s->compressed_chunk);
-    qemu_vfree(s->uncompressed_chunk);
     return ret;
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-                uint32_t chunk_num, uint64_t sector_num)
-{
-    if (chunk_num >= s->n_chunks || s->sectors[chunk_num] > sector_num ||
-            s->sectors[chunk_num] + s->sectorcounts[chunk_num] <= sector_num) {
-        return 0;
-    } else {
-        return -1;
-    }
-}
-
 static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
 {
     /* binary search */
@@ -573,112 +507,220 @@ static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, uint64_t sector_num)
+typedef struct DMGDecompressData {
+    uint32_t type;
+    uint8_t *out_buf;
+    uint64_t out_len;
+    uint8_t *buf;
+    uint64_t buf_len;
+} DMGDecompressData;
+
+static int dmg_decompress_worker(void *opaque)
 {
-    BDRVDMGState *s = bs->opaque;
+    DMGDecompressData *data = opaque;
+    int ret;
 
-    if (!is_sector_in_chunk(s, s->current_chunk, sector_num)) {
-        int ret;
-        uint32_t chunk = search_chunk(s, sector_num);
+    switch (data->type) {
+    case 0x80000005: { /* zlib compressed */
+        z_stream zstream;
+
+        memset(&zstream, 0, sizeof(zstream));
+        zstream.next_in = data->buf;
+        zstream.avail_in = data->buf_len;
+        zstream.next_out = data->out_buf;
+        zstream.avail_out = data->out_len;
+        if (inflateInit(&zstream) != Z_OK) {
+            return -1;
+        }
+        ret = inflate(&zstream, Z_FINISH);
+        inflateEnd(&zstream);
+        if (ret != Z_STREAM_END || zstream.total_out != data->out_len) {
+            return -1;
+        }
+        break; }
 #ifdef CONFIG_BZIP2
+    case 0x80000006: { /* bzip2 compressed */
+        bz_stream bzstream;
         uint64_t total_out;
-#endif
 
-        if (chunk >= s->n_chunks) {
+        memset(&bzstream, 0, sizeof(bzstream));
+        ret = BZ2_bzDecompressInit(&bzstream, 0, 0);
+        if (ret != BZ_OK) {
+            return -1;
+        }
+        bzstream.next_in = (char *)data->buf;
+        bzstream.avail_in = (unsigned int) data->buf_len;
+        bzstream.next_out = (char *)data->out_buf;
+        bzstream.avail_out = (unsigned int) data->out_len;
+        ret = BZ2_bzDecompress(&bzstream);
+        total_out = ((uint64_t)bzstream.total_out_hi32 << 32) +
+                    bzstream.total_out_lo32;
+        BZ2_bzDecompressEnd(&bzstream);
+        if (ret != BZ_STREAM_END || total_out != data->out_len) {
             return -1;
         }
+        break; }
+#endif /* CONFIG_BZIP2 */
+    default:
+        abort();
+    }
+    return 0;
+}
 
-        s->current_chunk = s->n_chunks;
-        switch (s->types[chunk]) { /* block entry type */
-        case 0x80000005: { /* zlib compressed */
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file->bs, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+static DMGChunkCacheEntry *dmg_chunk_cache_find(BDRVDMGState *s,
+                                                uint32_t chunk)
+{
+    int i;
 
-            s->zstream.next_in = s->compressed_chunk;
-            s->zstream.avail_in = s->lengths[chunk];
-            s->zstream.next_out = s->uncompressed_chunk;
-            s->zstream.avail_out = 512 * s->sectorcounts[chunk];
-            ret = inflateReset(&s->zstream);
-            if (ret != Z_OK) {
-                return -1;
-            }
-            ret = inflate(&s->zstream, Z_FINISH);
-            if (ret != Z_STREAM_END ||
-                s->zstream.total_out != 512 * s->sectorcounts[chunk]) {
-                return -1;
-            }
-            break; }
-#ifdef CONFIG_BZIP2
-        case 0x80000006: /* bzip2 compressed */
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file->bs, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+    for (i = 0; i < DMG_CHUNK_CACHE_SIZE; i++) {
+        DMGChunkCacheEntry *e = &s->chunk_cache[i];
+        if (e->data && e->chunk == chunk) {
+            e->lru_counter = ++s->chunk_cache_counter;
+            return e;
+        }
+    }
+    return NULL;
+}
 
-            ret = BZ2_bzDecompressInit(&s->bzstream, 0, 0);
-            if (ret != BZ_OK) {
-                return -1;
-            }
-            s->bzstream.next_in = (char *)s->compressed_chunk;
-            s->bzstream.avail_in = (unsigned int) s->lengths[chunk];
-            s->bzstream.next_out = (char *)s->uncompressed_chunk;
-            s->bzstream.avail_out = (unsigned int) 512 * s->sectorcounts[chunk];
-            ret = BZ2_bzDecompress(&s->bzstream);
-            total_out = ((uint64_t)s->bzstream.total_out_hi32 << 32) +
-                        s->bzstream.total_out_lo32;
-            BZ2_bzDecompressEnd(&s->bzstream);
-            if (ret != BZ_STREAM_END ||
-                total_out != 512 * s->sectorcounts[chunk]) {
-                return -1;
-            }
-            break;
-#endif /* CONFIG_BZIP2 */
-        case 1: /* copy */
-            ret = bdrv_pread(bs->file->bs, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+/* Takes ownership of @data */
+static DMGChunkCacheEntry *dmg_chunk_cache_insert(BDRVDMGState *s,
+                                                  uint32_t chunk,
+                                                  uint8_t *data)
+{
+    DMGChunkCacheEntry *e = dmg_chunk_cache_find(s, chunk);
+    int i;
+
+    if (e) {
+        /* another request read the same chunk meanwhile */
+        qemu_vfree(data);
+        return e;
+    }
+
+    e = &s->chunk_cache[0];
+    for (i = 1; i < DMG_CHUNK_CACHE_SIZE; i++) {
+        if (s->chunk_cache[i].lru_counter < e->lru_counter) {
+            e = &s->chunk_cache[i];
+        }
+    }
+
+    qemu_vfree(e->data);
+    e->chunk = chunk;
+    e->data = data;
+    e->lru_counter = ++s->chunk_cache_counter;
+    return e;
+}
+
+/*
+ * Sets *@data to the uncompressed data of @chunk, which is not a zero chunk.
+ * The pointer is valid until the next call.
+ *
+ * Called with s->lock held.  The lock is dropped while the chunk is read
+ * and decompressed, so that requests for several chunks can be decompressed
+ * in the thread pool at the same time.
+ */
+static int coroutine_fn dmg_read_chunk(BlockDriverState *bs, uint32_t chunk,
+                                       uint8_t **data_out)
+{
+    BDRVDMGState *s = bs->opaque;
+    DMGChunkCacheEntry *e;
+    DMGDecompressData data;
+    ThreadPool *pool;
+    uint8_t *compressed = NULL, *uncompressed;
+    uint64_t uncompressed_len;
+    int ret;
+
+    e = dmg_chunk_cache_find(s, chunk);
+    if (e) {
+        *data_out = e->data;
+        return 0;
+    }
+
+    /* a copied chunk that is shorter than its sector count reads as zeroes
+     * at the end */
+    uncompressed_len = MAX(512 * s->sectorcounts[chunk], s->lengths[chunk]);
+    uncompressed = qemu_try_blockalign0(bs->file->bs, uncompressed_len);
+    if (!uncompressed) {
+        return -1;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    switch (s->types[chunk]) { /* block entry type */
+    case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        compressed = qemu_try_blockalign(bs->file->bs, s->lengths[chunk]);
+        if (!compressed) {
+            ret = -1;
             break;
-        case 2: /* zero */
-            /* see dmg_read, it is treated specially. No buffer needs to be
-             * pre-filled, the zeroes can be set directly. */
+        }
+        ret = bdrv_pread(bs->file->bs, s->offsets[chunk],
+                         compressed, s->lengths[chunk]);
+        if (ret != s->lengths[chunk]) {
+            ret = -1;
             break;
         }
-        s->current_chunk = chunk;
+
+        data = (DMGDecompressData) {
+            .type       = s->types[chunk],
+            .out_buf    = uncompressed,
+            .out_len    = 512 * s->sectorcounts[chunk],
+            .buf        = compressed,
+            .buf_len    = s->lengths[chunk],
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, dmg_decompress_worker, &data);
+        break;
+    case 1: /* copy */
+        ret = bdrv_pread(bs->file->bs, s->offsets[chunk],
+                         uncompressed, s->lengths[chunk]);
+        ret = ret == s->lengths[chunk] ? 0 : -1;
+        break;
+    default:
+        abort();
     }
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(compressed);
+
+    if (ret < 0) {
+        qemu_vfree(uncompressed);
+        return -1;
+    }
+    *data_out = dmg_chunk_cache_insert(s, chunk, uncompressed)->data;
     return 0;
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn dmg_read(BlockDriverState *bs, int64_t sector_num,
+                                 uint8_t *buf, int nb_sectors)
 {
     BDRVDMGState *s = bs->opaque;
-    int i;
 
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_chunk;
-        if (dmg_read_chunk(bs, sector_num + i) != 0) {
+    while (nb_sectors > 0) {
+        uint32_t chunk = search_chunk(s, sector_num);
+        uint64_t sector_offset_in_chunk;
+        uint8_t *data;
+        int n;
+
+        if (chunk >= s->n_chunks) {
             return -1;
         }
-        /* Special case: current chunk is all zeroes. Do not perform a memcpy as
-         * s->uncompressed_chunk may be too small to cover the large all-zeroes
-         * section. dmg_read_chunk is called to find s->current_chunk */
-        if (s->types[s->current_chunk] == 2) { /* all zeroes block entry */
-            memset(buf + i * 512, 0, 512);
-            continue;
+        sector_offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_offset_in_chunk);
+
+        /* Special case: the chunk is all zeroes.  It may be too large to be
+         * buffered, and the zeroes can be set directly. */
+        if (s->types[chunk] == 2) { /* all zeroes block entry */
+            memset(buf, 0, n * 512);
+        } else {
+            if (dmg_read_chunk(bs, chunk, &data) != 0) {
+                return -1;
+            }
+            memcpy(buf, data + sector_offset_in_chunk * 512, n * 512);
         }
-        sector_offset_in_chunk = sector_num + i - s->sectors[s->current_chunk];
-        memcpy(buf + i * 512,
-               s->uncompressed_chunk + sector_offset_in_chunk * 512, 512);
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
     }
     return 0;
 }
@@ -697,16 +739,16 @@ static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
+    int i;
 
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    qemu_vfree(s->compressed_chunk);
-    qemu_vfree(s->uncompressed_chunk);
-
-    inflateEnd(&s->zstream);
+    for (i = 0; i < DMG_CHUNK_CACHE_SIZE; i++) {
+        qemu_vfree(s->chunk_cache[i].data);
+    }
 }
 
 static BlockDriver bdrv_dmg = {
@@ -362,9 +362,19 @@ static void tracked_request_end(BdrvTrackedRequest *req)
     }
 
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_tree, &req->tree_node);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Zero-length requests still get a one-byte node; the exact check is done by
+ * tracked_request_overlaps() */
+static void tracked_request_set_node(BdrvTrackedRequest *req)
+{
+    req->tree_node.start = req->overlap_offset;
+    req->tree_node.last = req->overlap_offset +
+                          MAX(req->overlap_bytes, 1) - 1;
+}
+
 /**
  * Add an active request to the tracked requests list
  */
@@ -388,6 +398,8 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_set_node(req);
+    interval_tree_insert(&bs->tracked_tree, &req->tree_node);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -401,8 +413,17 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    if (overlap_offset != req->overlap_offset ||
+        overlap_bytes != req->overlap_bytes) {
+        /* The position in the tree depends on the overlap range */
+        interval_tree_remove(&req->bs->tracked_tree, &req->tree_node);
+        req->overlap_offset = overlap_offset;
+        req->overlap_bytes = overlap_bytes;
+        tracked_request_set_node(req);
+        interval_tree_insert(&req->bs->tracked_tree, &req->tree_node);
+    }
 }
 
 /**
@@ -453,46 +474,55 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+/* Returns true if @self must wait for the request of @node */
+static bool tracked_request_must_wait(IntervalTreeNode *node, void *opaque)
+{
+    BdrvTrackedRequest *self = opaque;
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           tree_node);
+
+    if (req == self || (!req->serialising && !self->serialising)) {
+        return false;
+    }
+    if (!tracked_request_overlaps(req, self->overlap_offset,
+                                  self->overlap_bytes)) {
+        return false;
+    }
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
+}
+
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
     if (!bs->serialising_in_flight) {
         return false;
     }
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
-        }
-    } while (retry);
+    /* Only requests whose overlap range intersects ours are visited */
+    while ((node = interval_tree_find(&bs->tracked_tree,
+                                      self->tree_node.start,
+                                      self->tree_node.last,
+                                      tracked_request_must_wait, self))) {
+        req = container_of(node, BdrvTrackedRequest, tree_node);
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue);
+        self->waiting_for = NULL;
+        waited = true;
+    }
 
     return waited;
 }
@@ -801,7 +831,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                                    cluster_sector_num, cluster_nb_sectors);
 
     iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
-    iov.iov_base = bounce_buffer = qemu_try_blockalign(bs, iov.iov_len);
+    iov.iov_base = bounce_buffer = qemu_try_blockalign_pooled(bs, iov.iov_len);
     if (bounce_buffer == NULL) {
         ret = -ENOMEM;
         goto err;
@@ -840,7 +870,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                         nb_sectors * BDRV_SECTOR_SIZE);
 
 err:
-    qemu_vfree(bounce_buffer);
+    qemu_vfree_pooled(bs, bounce_buffer, cluster_nb_sectors * BDRV_SECTOR_SIZE);
     return ret;
 }
 
@@ -975,7 +1005,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     /* Align read if necessary by padding qiov */
     if (offset & (align - 1)) {
-        head_buf = qemu_blockalign(bs, align);
+        head_buf = qemu_blockalign_pooled(bs, align);
         qemu_iovec_init(&local_qiov, qiov->niov + 2);
         qemu_iovec_add(&local_qiov, head_buf, offset & (align - 1));
         qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
@@ -991,7 +1021,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
             qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
             use_local_qiov = true;
         }
-        tail_buf = qemu_blockalign(bs, align);
+        tail_buf = qemu_blockalign_pooled(bs, align);
         qemu_iovec_add(&local_qiov, tail_buf,
                        align - ((offset + bytes) & (align - 1)));
 
@@ -1006,8 +1036,8 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
-        qemu_vfree(head_buf);
-        qemu_vfree(tail_buf);
+        qemu_vfree_pooled(bs, head_buf, align);
+        qemu_vfree_pooled(bs, tail_buf, align);
     }
 
     return ret;
@@ -1059,6 +1089,7 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     BlockDriver *drv = bs->drv;
     QEMUIOVector qiov;
     struct iovec iov = {0};
+    size_t bounce_size = 0;
     int ret = 0;
 
     int max_write_zeroes = MIN_NON_ZERO(bs->bl.max_write_zeroes,
@@ -1102,12 +1133,13 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
             num = MIN(num, max_xfer_len);
             iov.iov_len = num * BDRV_SECTOR_SIZE;
             if (iov.iov_base == NULL) {
-                iov.iov_base = qemu_try_blockalign(bs, num * BDRV_SECTOR_SIZE);
+                bounce_size = num * BDRV_SECTOR_SIZE;
+                iov.iov_base = qemu_try_blockalign_pooled(bs, bounce_size);
                 if (iov.iov_base == NULL) {
                     ret = -ENOMEM;
                     goto fail;
                 }
-                memset(iov.iov_base, 0, num * BDRV_SECTOR_SIZE);
+                memset(iov.iov_base, 0, bounce_size);
             }
             qemu_iovec_init_external(&qiov, &iov, 1);
 
@@ -1117,7 +1149,7 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
              * all future requests.
              */
             if (num < max_xfer_len) {
-                qemu_vfree(iov.iov_base);
+                qemu_vfree_pooled(bs, iov.iov_base, bounce_size);
                 iov.iov_base = NULL;
             }
         }
@@ -1127,7 +1159,7 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     }
 
 fail:
-    qemu_vfree(iov.iov_base);
+    qemu_vfree_pooled(bs, iov.iov_base, bounce_size);
     return ret;
 }
 
@@ -1154,6 +1186,8 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->qiov = qiov;
+    req->flags = flags;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1181,6 +1215,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_block_status_invalidate(bs);
 
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
@@ -1212,7 +1247,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
 
     assert(flags & BDRV_REQ_ZERO_WRITE);
     if (head_padding_bytes || tail_padding_bytes) {
-        buf = qemu_blockalign(bs, align);
+        buf = qemu_blockalign_pooled(bs, align);
         iov = (struct iovec) {
             .iov_base   = buf,
             .iov_len    = align,
@@ -1276,7 +1311,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
                                    &local_qiov, flags & ~BDRV_REQ_ZERO_WRITE);
     }
 fail:
-    qemu_vfree(buf);
+    qemu_vfree_pooled(bs, buf, align);
     return ret;
 
 }
@@ -1334,7 +1369,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         mark_request_serialising(&req, align);
         wait_serialising_requests(&req);
 
-        head_buf = qemu_blockalign(bs, align);
+        head_buf = qemu_blockalign_pooled(bs, align);
         head_iov = (struct iovec) {
             .iov_base   = head_buf,
             .iov_len    = align,
@@ -1368,7 +1403,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         waited = wait_serialising_requests(&req);
         assert(!waited || !use_local_qiov);
 
-        tail_buf = qemu_blockalign(bs, align);
+        tail_buf = qemu_blockalign_pooled(bs, align);
         tail_iov = (struct iovec) {
             .iov_base   = tail_buf,
             .iov_len    = align,
@@ -1404,8 +1439,8 @@ fail:
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
     }
-    qemu_vfree(head_buf);
-    qemu_vfree(tail_buf);
+    qemu_vfree_pooled(bs, head_buf, align);
+    qemu_vfree_pooled(bs, tail_buf, align);
 out:
     tracked_request_end(&req);
     return ret;
@@ -1445,6 +1480,138 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE | flags);
 }
 
+/* Offloaded copies are only done for requests that need no padding */
+static bool bdrv_copy_range_is_aligned(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors)
+{
+    uint64_t align = MAX(BDRV_SECTOR_SIZE, bs->request_alignment);
+
+    return !(((sector_num | nb_sectors) << BDRV_SECTOR_BITS) & (align - 1));
+}
+
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+                                         int64_t src_sector,
+                                         BlockDriverState *dst,
+                                         int64_t dst_sector,
+                                         int nb_sectors,
+                                         BdrvRequestFlags flags)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    trace_bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                  nb_sectors, flags);
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+
+    ret = bdrv_check_request(src, src_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Copy-on-read needs the data in a buffer */
+    if (!src->drv->bdrv_co_copy_range_from || src->copy_on_read ||
+        !bdrv_copy_range_is_aligned(src, src_sector, nb_sectors)) {
+        return -ENOTSUP;
+    }
+
+    /* throttling disk I/O */
+    if (src->io_limits_enabled) {
+        throttle_group_co_io_limits_intercept(src,
+                                              nb_sectors << BDRV_SECTOR_BITS,
+                                              false);
+    }
+
+    tracked_request_begin(&req, src, src_sector << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, BDRV_TRACKED_READ);
+    if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+        wait_serialising_requests(&req);
+    }
+
+    ret = src->drv->bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                            nb_sectors, flags);
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+                                       int64_t src_sector,
+                                       BlockDriverState *dst,
+                                       int64_t dst_sector,
+                                       int nb_sectors,
+                                       BdrvRequestFlags flags)
+{
+    BdrvTrackedRequest req;
+    int64_t offset = dst_sector << BDRV_SECTOR_BITS;
+    unsigned int bytes = nb_sectors << BDRV_SECTOR_BITS;
+    int ret;
+
+    trace_bdrv_co_copy_range_to(src, src_sector, dst, dst_sector,
+                                nb_sectors, flags);
+
+    if (!dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst->open_flags & BDRV_O_INACTIVE));
+
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!dst->drv->bdrv_co_copy_range_to ||
+        !bdrv_copy_range_is_aligned(dst, dst_sector, nb_sectors)) {
+        return -ENOTSUP;
+    }
+
+    /* throttling disk I/O */
+    if (dst->io_limits_enabled) {
+        throttle_group_co_io_limits_intercept(dst, bytes, true);
+    }
+
+    /* Same bookkeeping as bdrv_aligned_pwritev(), but without a qiov; the
+     * before-write notifiers can tell from that that they cannot see the
+     * data that is written. */
+    tracked_request_begin(&req, dst, offset, bytes, BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+
+    ret = notifier_with_return_list_notify(&dst->before_write_notifiers, &req);
+    if (ret == 0) {
+        ret = dst->drv->bdrv_co_copy_range_to(src, src_sector, dst, dst_sector,
+                                              nb_sectors, flags);
+    }
+    if (ret == 0 && !dst->enable_write_cache) {
+        ret = bdrv_co_flush(dst);
+    }
+
+    bdrv_set_dirty(dst, dst_sector, nb_sectors);
+    bdrv_block_status_invalidate(dst);
+
+    if (dst->wr_highest_offset < offset + bytes) {
+        dst->wr_highest_offset = offset + bytes;
+    }
+    if (ret >= 0) {
+        dst->total_sectors = MAX(dst->total_sectors, dst_sector + nb_sectors);
+    }
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+                                    BlockDriverState *dst, int64_t dst_sector,
+                                    int nb_sectors, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors, flags);
+}
+
 int bdrv_flush_all(void)
 {
     BlockDriverState *bs = NULL;
@@ -1476,6 +1643,82 @@ typedef struct BdrvCoGetBlockStatusData {
     bool done;
 } BdrvCoGetBlockStatusData;
 
+/*
+ * Every node caches the results of its own bdrv_co_get_block_status() calls
+ * in bs->status_cache, and the top of a backing chain caches the status of
+ * the layer that owns a range in bs->status_above, so that repeated queries
+ * on a long chain neither call into the drivers nor walk every layer again.
+ *
+ * A write or discard changes the status of the node it is made to and of
+ * every chain that contains it, so it invalidates the entries of that node
+ * and all status_above entries.  Changes to the graph, the image size or the
+ * whole image content invalidate every entry.
+ */
+static uint64_t bdrv_status_write_gen = 1;
+static uint64_t bdrv_status_epoch = 1;
+
+void bdrv_block_status_invalidate(BlockDriverState *bs)
+{
+    bs->status_gen++;
+    atomic_inc(&bdrv_status_write_gen);
+}
+
+void bdrv_block_status_invalidate_all(void)
+{
+    atomic_inc(&bdrv_status_epoch);
+    atomic_inc(&bdrv_status_write_gen);
+}
+
+/* Returns -ENOENT if @sector_num is not covered by a valid entry */
+static int64_t bdrv_block_status_lookup(BdrvBlockStatusEntry *cache,
+                                        uint64_t gen, uint64_t epoch,
+                                        BlockDriverState *base,
+                                        int64_t sector_num, int nb_sectors,
+                                        int *pnum, BlockDriverState **file)
+{
+    int i;
+
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        BdrvBlockStatusEntry *e = &cache[i];
+        int64_t ret;
+
+        if (e->gen != gen || e->epoch != epoch || e->base != base ||
+            sector_num < e->sector_num ||
+            sector_num >= e->sector_num + e->nb_sectors) {
+            continue;
+        }
+
+        ret = e->ret;
+        if (ret & BDRV_BLOCK_OFFSET_VALID) {
+            ret += (sector_num - e->sector_num) << BDRV_SECTOR_BITS;
+        }
+        *pnum = MIN(nb_sectors, e->sector_num + e->nb_sectors - sector_num);
+        *file = e->file;
+        return ret;
+    }
+
+    return -ENOENT;
+}
+
+static void bdrv_block_status_insert(BdrvBlockStatusEntry *cache,
+                                     unsigned *next,
+                                     uint64_t gen, uint64_t epoch,
+                                     BlockDriverState *base,
+                                     int64_t sector_num, int nb_sectors,
+                                     int64_t ret, BlockDriverState *file)
+{
+    cache[*next] = (BdrvBlockStatusEntry) {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .ret        = ret,
+        .file       = file,
+        .base       = base,
+        .gen        = gen,
+        .epoch      = epoch,
+    };
+    *next = (*next + 1) % BDRV_BLOCK_STATUS_CACHE_SIZE;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -1502,6 +1745,7 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
     int64_t total_sectors;
     int64_t n;
     int64_t ret, ret2;
+    uint64_t gen, epoch;
 
     total_sectors = bdrv_nb_sectors(bs);
     if (total_sectors < 0) {
@@ -1521,12 +1765,24 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
     if (!bs->drv->bdrv_co_get_block_status) {
         *pnum = nb_sectors;
         ret = BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED;
+        *file = NULL;
         if (bs->drv->protocol_name) {
             ret |= BDRV_BLOCK_OFFSET_VALID | (sector_num * BDRV_SECTOR_SIZE);
+            *file = bs;
         }
         return ret;
     }
 
+    /* Sample the generation before calling the driver, so that the result
+     * is not cached if a write completes while we wait for it. */
+    gen = bs->status_gen;
+    epoch = atomic_read(&bdrv_status_epoch);
+    ret = bdrv_block_status_lookup(bs->status_cache, gen, epoch, NULL,
+                                   sector_num, nb_sectors, pnum, file);
+    if (ret >= 0) {
+        return ret;
+    }
+
     *file = NULL;
     ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum,
                                             file);
@@ -1537,8 +1793,9 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
 
     if (ret & BDRV_BLOCK_RAW) {
         assert(ret & BDRV_BLOCK_OFFSET_VALID);
-        return bdrv_get_block_status(bs->file->bs, ret >> BDRV_SECTOR_BITS,
-                                     *pnum, pnum, file);
+        ret = bdrv_get_block_status(bs->file->bs, ret >> BDRV_SECTOR_BITS,
+                                    *pnum, pnum, file);
+        goto out;
     }
 
     if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
@@ -1580,6 +1837,12 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
         }
     }
 
+out:
+    if (ret >= 0 && *pnum > 0) {
+        bdrv_block_status_insert(bs->status_cache, &bs->status_cache_next,
+                                 gen, epoch, NULL, sector_num, *pnum, ret,
+                                 *file);
+    }
     return ret;
 }
 
@@ -1592,8 +1855,23 @@ static int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *bs,
 {
     BlockDriverState *p;
     int64_t ret = 0;
+    uint64_t gen, epoch;
+    bool chain = backing_bs(bs) != base;
 
     assert(bs != base);
+
+    /* A single layer is covered by its own cache already */
+    gen = atomic_read(&bdrv_status_write_gen);
+    epoch = atomic_read(&bdrv_status_epoch);
+    if (chain && nb_sectors > 0) {
+        ret = bdrv_block_status_lookup(bs->status_above, gen, epoch, base,
+                                       sector_num, nb_sectors, pnum, file);
+        if (ret >= 0) {
+            return ret;
+        }
+        ret = 0;
+    }
+
     for (p = bs; p != base; p = backing_bs(p)) {
         ret = bdrv_co_get_block_status(p, sector_num, nb_sectors, pnum, file);
         if (ret < 0 || ret & BDRV_BLOCK_ALLOCATED) {
@@ -1603,6 +1881,12 @@ static int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *bs,
          * the first part of [sector_num, nb_sectors].  */
         nb_sectors = MIN(nb_sectors, *pnum);
     }
+
+    if (chain && ret >= 0 && *pnum > 0) {
+        bdrv_block_status_insert(bs->status_above, &bs->status_above_next,
+                                 gen, epoch, base, sector_num, *pnum, ret,
+                                 *file);
+    }
     return ret;
 }
 
@@ -1747,7 +2031,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bdrv_block_status_invalidate(bs);
+    return ret;
 }
 
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
@@ -2069,7 +2355,7 @@ static void bdrv_aio_bh_cb(void *opaque)
     if (!acb->is_write && acb->ret >= 0) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
-    qemu_vfree(acb->bounce);
+    qemu_vfree_pooled(acb->common.bs, acb->bounce, acb->qiov->size);
     acb->common.cb(acb->common.opaque, acb->ret);
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
@@ -2090,7 +2376,7 @@ static BlockAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb = qemu_aio_get(&bdrv_em_aiocb_info, bs, cb, opaque);
     acb->is_write = is_write;
     acb->qiov = qiov;
-    acb->bounce = qemu_try_blockalign(bs, qiov->size);
+    acb->bounce = qemu_try_blockalign_pooled(bs, qiov->size);
     acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (acb->bounce == NULL) {
@@ -2542,6 +2828,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
     ret = 0;
 out:
+    bdrv_block_status_invalidate(bs);
     tracked_request_end(&req);
     return ret;
 }
@@ -2701,6 +2988,31 @@ void *qemu_try_blockalign(BlockDriverState *bs, size_t size)
     return qemu_try_memalign(align, size);
 }
 
+/* Like qemu_try_blockalign(), but the buffer comes from the buffer pool of
+ * the AioContext of @bs.  It must be freed with qemu_vfree_pooled() and the
+ * same size.
+ */
+void *qemu_try_blockalign_pooled(BlockDriverState *bs, size_t size)
+{
+    return aio_buffer_pool_get(bdrv_get_aio_context(bs), size,
+                               bdrv_opt_mem_align(bs));
+}
+
+void *qemu_blockalign_pooled(BlockDriverState *bs, size_t size)
+{
+    void *buf = qemu_try_blockalign_pooled(bs, size);
+
+    if (!buf) {
+        abort();
+    }
+    return buf;
+}
+
+void qemu_vfree_pooled(BlockDriverState *bs, void *buf, size_t size)
+{
+    aio_buffer_pool_put(bdrv_get_aio_context(bs), buf, size);
+}
+
 void *qemu_try_blockalign0(BlockDriverState *bs, size_t size)
 {
     void *mem = qemu_try_blockalign(bs, size);
@@ -0,0 +1,377 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <liburing.h>
+#include <linux/falloc.h>
+
+/* Number of submission queue entries (per-device). */
+#define MAX_ENTRIES 128
+
+/* Idle time in milliseconds before the kernel submission thread sleeps. */
+#define SQPOLL_IDLE_MS 1000
+
+typedef struct LuringState LuringState;
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+
+    /* Remainder of a short read, resubmitted until EOF */
+    QEMUIOVector resubmit_qiov;
+    size_t total_read;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int n;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void luring_prep_sqe(struct io_uring_sqe *sqe, LuringAIOCB *acb)
+{
+    QEMUIOVector *qiov = acb->total_read ? &acb->resubmit_qiov : acb->qiov;
+
+    switch (acb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, acb->fd, qiov->iov, qiov->niov, acb->offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, acb->fd, qiov->iov, qiov->niov,
+                            acb->offset + acb->total_read);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, acb->fd, IORING_FSYNC_DATASYNC);
+        break;
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqe, acb->fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                acb->offset, acb->nbytes);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_data(sqe, acb);
+}
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *acb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, acb, next);
+    s->io_q.n++;
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB), or
+ * requeues the rest of a short read.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb,
+                                      int ret)
+{
+    size_t total;
+
+    if (ret < 0) {
+        if (acb->type == QEMU_AIO_DISCARD &&
+            (ret == -EINVAL || ret == -EOPNOTSUPP)) {
+            ret = -ENOTSUP;
+        }
+        goto done;
+    }
+
+    switch (acb->type) {
+    case QEMU_AIO_READ:
+        total = acb->total_read + ret;
+        if (ret > 0 && total < acb->nbytes) {
+            /* Short read in the middle of the file, read the rest */
+            acb->total_read = total;
+            if (acb->resubmit_qiov.iov) {
+                qemu_iovec_reset(&acb->resubmit_qiov);
+            } else {
+                qemu_iovec_init(&acb->resubmit_qiov, acb->qiov->niov);
+            }
+            qemu_iovec_concat(&acb->resubmit_qiov, acb->qiov, total,
+                              acb->nbytes - total);
+            luring_resubmit(s, acb);
+            return;
+        }
+        /* Short reads mean EOF, pad with zeros. */
+        if (total < acb->nbytes) {
+            qemu_iovec_memset(acb->qiov, total, 0, acb->nbytes - total);
+        }
+        ret = 0;
+        break;
+    case QEMU_AIO_WRITE:
+        ret = (ret == acb->nbytes) ? 0 : -EINVAL;
+        break;
+    default:
+        ret = 0;
+        break;
+    }
+
+done:
+    if (acb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&acb->resubmit_qiov);
+    }
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_unref(acb);
+}
+
+/* The completion BH reaps completion queue entries and invokes the request
+ * callbacks.  As in linux-aio.c, it reschedules itself before calling them so
+ * that nested event loops see the completions that are still pending; each
+ * entry is released before its callback runs, so a nested invocation never
+ * sees it again.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    if (io_uring_peek_cqe(&s->ring, &cqe) != 0 || !cqe) {
+        return; /* no more events */
+    }
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *acb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        luring_process_completion(s, acb, ret);
+    }
+
+    if (!s->io_q.plugged &&
+        (!QSIMPLEQ_EMPTY(&s->io_q.pending) || io_uring_sq_ready(&s->ring))) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->n = 0;
+    io_q->blocked = false;
+}
+
+/* Move as many pending requests as fit into the submission queue and hand
+ * them to the kernel with a single io_uring_enter() call.  With SQ polling
+ * the kernel thread picks them up by itself and io_uring_submit() only wakes
+ * it up if it went to sleep.
+ */
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *acb;
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    do {
+        while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+            sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            acb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            s->io_q.n--;
+            luring_prep_sqe(sqe, acb);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EAGAIN || ret == -EBUSY) {
+            /* Entries stay in the ring, retry after some completions */
+            break;
+        }
+        if (ret < 0) {
+            abort();
+        }
+    } while (ret > 0 && !QSIMPLEQ_EMPTY(&s->io_q.pending));
+    s->io_q.blocked = (ret < 0 || s->io_q.n > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+    case QEMU_AIO_DISCARD:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->fd = fd;
+    acb->type = type;
+    acb->offset = sector_num * 512;
+    acb->nbytes = (size_t)nb_sectors * 512;
+    acb->qiov = qiov;
+    acb->total_read = 0;
+    memset(&acb->resubmit_qiov, 0, sizeof(acb->resubmit_qiov));
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, acb, next);
+    s->io_q.n++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.n >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &acb->common;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+/* Returns NULL with errno set on failure. */
+void *luring_init(bool sqpoll)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int ret;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    ret = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (ret < 0) {
+        errno = -ret;
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        errno = -ret;
+        goto out_exit_ring;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    io_uring_unregister_eventfd(&s->ring);
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
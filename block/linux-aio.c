@@ -67,6 +67,36 @@ static inline ssize_t io_event_ret(struct io_event *ev)
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
 }
 
+/*
+ * The io_context_t handle points to the completion ring that the kernel
+ * shares with userspace.  Its header is not part of the libaio API, but it
+ * has been stable since Linux 2.6.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+/* Check for completed requests without entering the kernel. */
+static bool io_getevents_peek(io_context_t ctx)
+{
+    struct aio_ring *ring = (struct aio_ring *)ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
 /*
  * Completes an AIO request (calls the callback and frees the ACB).
  */
@@ -153,6 +183,20 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    if (s->event_idx == s->event_max && !io_getevents_peek(s->ctx)) {
+        return false;
+    }
+
+    /* The eventfd stays set, qemu_laio_completion_cb() will find nothing */
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -299,6 +343,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
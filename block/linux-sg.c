@@ -0,0 +1,189 @@
+/*
+ * Asynchronous SCSI passthrough through the Linux sg driver
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+
+#include <scsi/sg.h>
+
+/*
+ * The sg driver accepts an sg_io_hdr with write() and returns it, once the
+ * command has completed, with read().  Commands therefore stay in flight
+ * without a thread blocked in ioctl(SG_IO) for each of them; completions
+ * are collected when the file descriptor becomes readable.
+ *
+ * The driver queues at most SG_MAX_QUEUE commands per file descriptor and
+ * fails further writes with EDOM; those wait in @pending for a completion.
+ */
+#define SG_AIO_MAX_IN_FLIGHT 16
+
+typedef struct SgAIOCB {
+    BlockAIOCB common;
+    sg_io_hdr_t *hdr;
+    int ret;
+    QSIMPLEQ_ENTRY(SgAIOCB) next;
+} SgAIOCB;
+
+typedef struct SgAIOState {
+    int fd;
+    int in_flight;
+
+    /* not yet accepted by the driver */
+    QSIMPLEQ_HEAD(, SgAIOCB) pending;
+    /* rejected by the driver, completed from @completion_bh */
+    QSIMPLEQ_HEAD(, SgAIOCB) failed;
+    QEMUBH *completion_bh;
+} SgAIOState;
+
+static const AIOCBInfo sgaio_aiocb_info = {
+    .aiocb_size         = sizeof(SgAIOCB),
+};
+
+static void sgaio_complete(SgAIOCB *acb)
+{
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_unref(acb);
+}
+
+static void sgaio_submit_pending(SgAIOState *s)
+{
+    SgAIOCB *acb;
+    ssize_t ret;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->pending)) &&
+           s->in_flight < SG_AIO_MAX_IN_FLIGHT) {
+        ret = write(s->fd, acb->hdr, sizeof(*acb->hdr));
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EDOM || errno == EAGAIN) && s->in_flight) {
+            /* retried when an earlier command completes */
+            break;
+        }
+
+        QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+        if (ret < 0) {
+            acb->ret = -errno;
+            QSIMPLEQ_INSERT_TAIL(&s->failed, acb, next);
+            qemu_bh_schedule(s->completion_bh);
+            continue;
+        }
+        s->in_flight++;
+    }
+}
+
+static void sgaio_completion_bh(void *opaque)
+{
+    SgAIOState *s = opaque;
+    SgAIOCB *acb;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        sgaio_complete(acb);
+    }
+}
+
+static void sgaio_completion_cb(void *opaque)
+{
+    SgAIOState *s = opaque;
+    sg_io_hdr_t hdr;
+    SgAIOCB *acb;
+    ssize_t ret;
+
+    while (s->in_flight) {
+        ret = read(s->fd, &hdr, sizeof(hdr));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* EAGAIN: the remaining commands are still running */
+            break;
+        }
+
+        /* the driver returns the header as written, with its results */
+        acb = hdr.usr_ptr;
+        acb->hdr->status = hdr.status;
+        acb->hdr->masked_status = hdr.masked_status;
+        acb->hdr->msg_status = hdr.msg_status;
+        acb->hdr->sb_len_wr = hdr.sb_len_wr;
+        acb->hdr->host_status = hdr.host_status;
+        acb->hdr->driver_status = hdr.driver_status;
+        acb->hdr->resid = hdr.resid;
+        acb->hdr->duration = hdr.duration;
+        acb->hdr->info = hdr.info;
+        acb->ret = 0;
+
+        s->in_flight--;
+        sgaio_complete(acb);
+    }
+
+    sgaio_submit_pending(s);
+}
+
+BlockAIOCB *sgaio_submit(BlockDriverState *bs, void *aio_ctx, void *buf,
+                         BlockCompletionFunc *cb, void *opaque)
+{
+    SgAIOState *s = aio_ctx;
+    SgAIOCB *acb;
+
+    acb = qemu_aio_get(&sgaio_aiocb_info, bs, cb, opaque);
+    acb->hdr = buf;
+    acb->hdr->usr_ptr = acb;
+    acb->ret = -EINPROGRESS;
+
+    QSIMPLEQ_INSERT_TAIL(&s->pending, acb, next);
+    sgaio_submit_pending(s);
+    return &acb->common;
+}
+
+void sgaio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    SgAIOState *s = s_;
+
+    aio_set_fd_handler(old_context, s->fd, false, NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void sgaio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    SgAIOState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, sgaio_completion_bh, s);
+    aio_set_fd_handler(new_context, s->fd, false,
+                       sgaio_completion_cb, NULL, s);
+}
+
+void *sgaio_init(int fd)
+{
+    SgAIOState *s;
+    int flags;
+
+    /* Reads must not block once all completions have been collected;
+     * ioctl(SG_IO) waits for its command regardless of O_NONBLOCK. */
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return NULL;
+    }
+
+    s = g_new0(SgAIOState, 1);
+    s->fd = fd;
+    QSIMPLEQ_INIT(&s->pending);
+    QSIMPLEQ_INIT(&s->failed);
+    return s;
+}
+
+void sgaio_cleanup(void *s_)
+{
+    SgAIOState *s = s_;
+
+    assert(!s->in_flight && QSIMPLEQ_EMPTY(&s->pending));
+    g_free(s);
+}
@@ -65,6 +65,16 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Limit for in_flight, adapted to the latency of the target */
+    int max_in_flight;
+    int64_t min_write_latency_ns;
+
+    MirrorCopyMode copy_mode;
+    /* Chunks whose last write was copied by mirror_before_write_notify() */
+    unsigned long *active_bitmap;
+    NotifierWithReturn before_write;
+    int in_active_write;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -72,6 +82,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t write_start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -87,6 +98,32 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* While the target completes writes about as fast as it did at best, it
+ * keeps up and one more request may be in flight.  When its latency grows,
+ * requests are queueing up in the target and the limit is halved.
+ */
+static void mirror_update_in_flight_limit(MirrorBlockJob *s, MirrorOp *op)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t latency;
+
+    latency = (now - op->write_start_ns) /
+              MAX(op->nb_sectors / sectors_per_chunk, 1);
+    if (!s->min_write_latency_ns || latency < s->min_write_latency_ns) {
+        s->min_write_latency_ns = latency;
+    } else {
+        /* Follow slow changes in the speed of the target */
+        s->min_write_latency_ns += (latency - s->min_write_latency_ns) >> 6;
+    }
+
+    if (latency > 4 * s->min_write_latency_ns) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    } else if (s->max_in_flight < MAX_IN_FLIGHT) {
+        s->max_in_flight++;
+    }
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -114,6 +151,7 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        mirror_update_in_flight_limit(s, op);
     }
 
     qemu_iovec_destroy(&op->qiov);
@@ -156,6 +194,7 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
@@ -281,6 +320,7 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
@@ -312,6 +352,14 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(sector_num >= 0);
     }
 
+    if (s->active_bitmap &&
+        test_and_clear_bit(sector_num / sectors_per_chunk, s->active_bitmap)) {
+        /* The write that dirtied the chunk has been copied already */
+        bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
+                                sectors_per_chunk);
+        return 0;
+    }
+
     /* Find the number of consective dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
     while (nb_chunks * sectors_per_chunk < (s->buf_size >> BDRV_SECTOR_BITS)) {
@@ -343,6 +391,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
                             nb_chunks * sectors_per_chunk);
     bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
+    if (s->active_bitmap) {
+        bitmap_clear(s->active_bitmap, sector_num / sectors_per_chunk,
+                     nb_chunks);
+    }
     while (nb_chunks > 0 && sector_num < end) {
         int ret;
         int io_sectors;
@@ -422,6 +474,77 @@ static void mirror_drain(MirrorBlockJob *s)
     }
 }
 
+/*
+ * In write-blocking mode, copy guest writes to the target before they are
+ * made to the source, so that the job converges however fast the guest
+ * writes.  This is only done for chunks that are neither dirty nor being
+ * copied, i.e. that are already in sync with the target; these are marked
+ * in active_bitmap, so that mirror_iteration() does not copy them again
+ * when bdrv_set_dirty() marks them dirty after the write.
+ *
+ * A write that is not copied, e.g. because another write to the same
+ * chunk is in progress or the target returned an error, clears the bit and
+ * leaves the chunk to the background copy.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk, start_chunk, end_chunk;
+    /* Offloaded copies have no qiov, leave them to the dirty bitmap */
+    bool copy = s->ret >= 0 &&
+                (req->qiov || (req->flags & BDRV_REQ_ZERO_WRITE));
+    int ret;
+
+    assert(req->bs == s->common.bs);
+    assert((req->offset & (BDRV_SECTOR_SIZE - 1)) == 0);
+    assert((req->bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
+
+    if (req->offset + req->bytes > s->bdev_length || !nb_sectors) {
+        return 0;
+    }
+
+    start_chunk = sector_num / sectors_per_chunk;
+    end_chunk = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_chunk);
+    for (chunk = start_chunk; chunk < end_chunk && copy; chunk++) {
+        if (test_bit(chunk, s->in_flight_bitmap) ||
+            bdrv_get_dirty(s->common.bs, s->dirty_bitmap,
+                           chunk * sectors_per_chunk)) {
+            copy = false;
+        }
+    }
+    if (!copy) {
+        bitmap_clear(s->active_bitmap, start_chunk, end_chunk - start_chunk);
+        return 0;
+    }
+
+    bitmap_set(s->active_bitmap, start_chunk, end_chunk - start_chunk);
+    bitmap_set(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+    s->in_active_write++;
+
+    if (req->qiov) {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+    } else {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   req->flags & BDRV_REQ_MAY_UNMAP);
+    }
+
+    bitmap_clear(s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
+    if (ret < 0) {
+        bitmap_clear(s->active_bitmap, start_chunk, end_chunk - start_chunk);
+    }
+    s->in_active_write--;
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+    return 0;
+}
+
 typedef struct {
     int ret;
 } MirrorExitData;
@@ -577,6 +700,14 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    /* With copy-on-write in the target, a partial write could not simply be
+     * copied, so fall back to background mode. */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING && !s->cow_bitmap) {
+        s->active_bitmap = bitmap_new(length);
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+    }
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
         uint64_t delay_ns = 0;
@@ -603,7 +734,7 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 mirror_wait_for_io(s);
@@ -675,6 +806,12 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->active_bitmap) {
+        notifier_with_return_remove(&s->before_write);
+        while (s->in_active_write > 0) {
+            mirror_wait_for_io(s);
+        }
+    }
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -688,6 +825,7 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->active_bitmap);
     bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
     if (s->target->blk) {
         blk_iostatus_disable(s->target->blk);
@@ -785,7 +923,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              int64_t buf_size,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -845,6 +983,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    s->max_in_flight = MAX_IN_FLIGHT;
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -870,7 +1010,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -885,8 +1025,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(bs, target, replaces,
                      speed, granularity, buf_size,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp, &mirror_job_driver, is_none_mode, base);
 }
 
 void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
@@ -933,7 +1073,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 
     bdrv_ref(base);
     mirror_start_job(bs, base, NULL, speed, 0, 0,
-                     on_error, on_error, false, cb, opaque, &local_err,
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -32,7 +32,7 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
     int i;
 
@@ -43,10 +43,8 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdConnection *client)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -57,7 +55,8 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     nbd_recv_coroutines_enter_all(client);
 
-    nbd_client_detach_aio_context(bs);
+    aio_set_fd_handler(bdrv_get_aio_context(client->session->bs),
+                       client->sioc->fd, false, NULL, NULL, NULL);
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -66,8 +65,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -104,21 +102,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -141,10 +138,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->session->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,40 +157,153 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_read_payload(NbdConnection *s, void *buf, size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, 0, size, true) == size ? 0 : -EIO;
+}
+
+/* Check that the chunk range [@from, @from + @len) is within @request */
+static bool nbd_chunk_in_request(struct nbd_request *request,
+                                 uint64_t from, uint32_t len)
+{
+    return from >= request->from && len <= request->len &&
+           from - request->from <= request->len - len;
+}
+
+/* Process the payload of a chunk of a structured reply.  Data and holes are
+ * stored into @qiov, and the first block status descriptor into @extent.
+ * An error means that the payload could not be consumed.
+ */
+static int nbd_co_receive_chunk(NbdConnection *s,
+                                struct nbd_request *request,
+                                struct nbd_reply *chunk,
+                                QEMUIOVector *qiov, int offset,
+                                NBDExtent *extent)
+{
+    uint8_t buf[8 + 4];
+    uint64_t from;
+    uint32_t len;
+    ssize_t ret;
+
+    if (chunk->type & NBD_REPLY_TYPE_ERROR_BIT) {
+        /* Already consumed by nbd_receive_reply() */
+        return 0;
+    }
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length < 8) {
+            return -EIO;
+        }
+        if (nbd_co_read_payload(s, buf, 8) < 0) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = chunk->length - 8;
+        if (!nbd_chunk_in_request(request, from, len)) {
+            return -EIO;
+        }
+        ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                           offset + (from - request->from), len, 1);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != 8 + 4) {
+            return -EIO;
+        }
+        if (nbd_co_read_payload(s, buf, 8 + 4) < 0) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, from, len)) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + (from - request->from), 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || chunk->length < 4 + sizeof(*extent) ||
+            (chunk->length - 4) % sizeof(*extent)) {
+            return -EIO;
+        }
+        if (nbd_co_read_payload(s, buf, 4 + sizeof(*extent)) < 0) {
+            return -EIO;
+        }
+        if (ldl_be_p(buf) != s->meta_context_id) {
+            return -EIO;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        len = chunk->length - (4 + sizeof(*extent));
+        return nbd_drop(s->ioc, len) == len ? 0 : -EIO;
+
+    default:
+        /* Unknown informational chunks can be ignored */
+        return nbd_drop(s->ioc, chunk->length) == chunk->length ? 0 : -EIO;
+    }
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NBDExtent *extent)
 {
     int ret;
+    int error = 0;
+
+    /* A structured reply consists of several chunks, each of which is
+     * delivered by the read handler like a simple reply.
+     */
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
-                               offset, request->len, 1);
-            if (ret != request->len) {
-                reply->error = EIO;
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   offset, request->len, 1);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+        } else if (!s->session->ext.structured_reply ||
+                   nbd_co_receive_chunk(s, request, reply, qiov, offset,
+                                        extent) < 0) {
+            /* We cannot find the next reply in the stream anymore */
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            reply->error = EIO;
+            reply->flags |= NBD_REPLY_FLAG_DONE;
+        }
+        if (!error) {
+            error = reply->error;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
-    }
+    } while (!(reply->flags & NBD_REPLY_FLAG_DONE));
+
+    reply->error = error;
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdConnection *s,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
@@ -207,7 +317,7 @@ static void nbd_coroutine_start(NbdClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -217,11 +327,30 @@ static void nbd_coroutine_end(NbdClientSession *s,
     }
 }
 
+/* Pick the connection for the next request in round-robin order, skipping
+ * those that were closed after an error.
+ */
+static NbdConnection *nbd_next_connection(NbdClientSession *client)
+{
+    int i;
+
+    for (i = 0; i < client->nb_conns; i++) {
+        NbdConnection *c = &client->conns[client->next_conn];
+
+        client->next_conn = (client->next_conn + 1) % client->nb_conns;
+        if (c->ioc) {
+            return c;
+        }
+    }
+    return &client->conns[0];
+}
+
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -229,14 +358,16 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_next_connection(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset,
+                             NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -246,6 +377,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -258,14 +390,15 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    conn = nbd_next_connection(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -273,43 +406,106 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
-int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
+typedef struct NbdSplitRequest {
+    BlockDriverState *bs;
+    Coroutine *co;
+    QEMUIOVector *qiov;
+    bool is_write;
+    int in_flight;
+    int ret;
+} NbdSplitRequest;
+
+typedef struct NbdRequestPart {
+    NbdSplitRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    int offset;
+} NbdRequestPart;
+
+static void coroutine_fn nbd_co_request_part(void *opaque)
 {
-    int offset = 0;
+    NbdRequestPart *part = opaque;
+    NbdSplitRequest *req = part->req;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    if (req->is_write) {
+        ret = nbd_co_writev_1(req->bs, part->sector_num, part->nb_sectors,
+                              req->qiov, part->offset);
+    } else {
+        ret = nbd_co_readv_1(req->bs, part->sector_num, part->nb_sectors,
+                             req->qiov, part->offset);
+    }
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+    g_free(part);
+
+    if (--req->in_flight == 0) {
+        qemu_coroutine_enter(req->co, NULL);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
-int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
-                         int nb_sectors, QEMUIOVector *qiov)
+/* Split requests that are too large for the server.  The parts are sent
+ * in parallel, so that they are pipelined and spread over all connections;
+ * the data goes straight between the socket and @qiov.
+ */
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
 {
+    NbdSplitRequest req = {
+        .bs         = bs,
+        .co         = qemu_coroutine_self(),
+        .qiov       = qiov,
+        .is_write   = is_write,
+        .in_flight  = 1,
+    };
     int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        return is_write ? nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0)
+                        : nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
+    }
+
+    while (nb_sectors > 0) {
+        NbdRequestPart *part = g_new(NbdRequestPart, 1);
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
+
+        part->req = &req;
+        part->sector_num = sector_num;
+        part->nb_sectors = n;
+        part->offset = offset;
+
+        req.in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_request_part), part);
+
+        offset += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    /* Drop our own reference and wait for the parts still in flight */
+    if (--req.in_flight > 0) {
+        qemu_coroutine_yield();
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+    return req.ret;
+}
+
+int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -325,14 +521,15 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_next_connection(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -340,6 +537,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -350,30 +548,92 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_next_connection(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0 };
+    ssize_t ret;
+
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
+
+    conn = nbd_next_connection(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    *pnum = MIN(extent.length >> BDRV_SECTOR_BITS, nb_sectors);
+    if (*pnum == 0) {
+        /* No usable extent, e.g. one that is not sector-aligned */
+        *pnum = MIN(nb_sectors, 1);
+        return BDRV_BLOCK_DATA;
+    }
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_conns; i++) {
+        if (client->conns[i].ioc) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conns[i].sioc->fd,
+                               false, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_conns; i++) {
+        if (client->conns[i].ioc) {
+            aio_set_fd_handler(new_context, client->conns[i].sioc->fd,
+                               false, nbd_reply_ready, NULL,
+                               &client->conns[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -384,14 +644,45 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
+    for (i = 0; i < client->nb_conns; i++) {
+        NbdConnection *conn = &client->conns[i];
+
+        if (conn->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(conn->ioc, &request);
+
+        nbd_teardown_connection(conn);
     }
+}
 
-    nbd_send_request(client->ioc, &request);
+/* Set up @conn, on which the handshake has been completed, and start
+ * receiving replies on it.
+ */
+static void nbd_connection_start(NbdClientSession *client,
+                                 NbdConnection *conn,
+                                 QIOChannelSocket *sioc)
+{
+    conn->session = client;
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
+
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
+    }
+
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_teardown_connection(bs);
+    aio_set_fd_handler(bdrv_get_aio_context(client->bs), sioc->fd,
+                       false, nbd_reply_ready, NULL, conn);
 }
 
 int nbd_client_init(BlockDriverState *bs,
@@ -402,38 +693,84 @@ int nbd_client_init(BlockDriverState *bs,
                     Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn = &client->conns[0];
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    client->ext.structured_reply = true;
+    client->ext.base_allocation = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 &client->nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &conn->ioc,
+                                &client->size, &client->ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    client->bs = bs;
+    conn->meta_context_id = client->ext.meta_context_id;
+    nbd_connection_start(client, conn, sioc);
+    client->nb_conns = 1;
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
-    }
+    logout("Established connection with NBD server\n");
+    return 0;
+}
 
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+/* Open another connection to the same export.  The server must advertise
+ * NBD_FLAG_CAN_MULTI_CONN, so that a flush on any of the connections also
+ * covers the writes that completed on the others.
+ */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    NBDExtensions ext = {
+        .structured_reply = client->ext.structured_reply,
+        .base_allocation = client->ext.base_allocation,
+    };
+    uint32_t nbdflags;
+    off_t size;
+    int ret;
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    assert(client->nb_conns > 0 && client->nb_conns < MAX_NBD_CONNECTIONS);
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+    conn = &client->conns[client->nb_conns];
 
-    logout("Established connection with NBD server\n");
+    logout("adding connection %d to %s\n", client->nb_conns, export);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export, &nbdflags,
+                                tlscreds, hostname, &conn->ioc,
+                                &size, &ext, errp);
+    if (ret < 0) {
+        logout("Failed to negotiate with the NBD server\n");
+        return ret;
+    }
+
+    if (nbdflags != client->nbdflags || size != client->size ||
+        ext.structured_reply != client->ext.structured_reply ||
+        ext.base_allocation != client->ext.base_allocation) {
+        error_setg(errp, "NBD server changed the export parameters for "
+                   "an additional connection");
+        if (conn->ioc) {
+            object_unref(OBJECT(conn->ioc));
+            conn->ioc = NULL;
+        }
+        return -EINVAL;
+    }
+
+    conn->meta_context_id = ext.meta_context_id;
+    nbd_connection_start(client, conn, sioc);
+    client->nb_conns++;
     return 0;
 }
@@ -15,13 +15,20 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
+#define MAX_NBD_REQUESTS    64
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NbdClientSession {
+typedef struct NbdClientSession NbdClientSession;
+
+/* A socket connected to the server.  If the server allows it, a session
+ * has several of them and spreads its requests over them in round-robin
+ * order.
+ */
+typedef struct NbdConnection {
+    NbdClientSession *session;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint32_t nbdflags;
-    off_t size;
+    uint32_t meta_context_id;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,9 +37,20 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdConnection;
+
+struct NbdClientSession {
+    BlockDriverState *bs;
+    uint32_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+
+    NbdConnection conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+    int next_conn;
 
     bool is_unix;
-} NbdClientSession;
+};
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
@@ -42,6 +60,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -51,6 +75,10 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
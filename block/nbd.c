@@ -35,6 +35,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qint.h"
 #include "qapi/qmp/qstring.h"
+#include "qemu/error-report.h"
 
 
 #define EN_OPTSTR ":exportname="
@@ -233,6 +234,20 @@ static SocketAddress *nbd_config(BDRVNBDState *s, QDict *options, char **export,
     return saddr;
 }
 
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server "
+                    "(default: 1)",
+        },
+        { /* end of list */ }
+    },
+};
+
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -301,6 +316,9 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     const char *tlscredsid;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    QemuOpts *opts = NULL;
+    Error *local_err = NULL;
+    unsigned connections;
     int ret = -EINVAL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -309,6 +327,19 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         goto error;
     }
 
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto error;
+    }
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     tlscredsid = g_strdup(qdict_get_try_str(options, "tls-creds"));
     if (tlscredsid) {
         qdict_del(options, "tls-creds");
@@ -336,7 +367,34 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    if (connections > 1 && !(s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_report("warning: NBD server does not support multiple "
+                     "connections, using a single one");
+        connections = 1;
+    }
+
+    while (s->client.nb_conns < connections) {
+        object_unref(OBJECT(sioc));
+        sioc = nbd_establish_connection(saddr, errp);
+        if (!sioc) {
+            nbd_client_close(bs);
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+        ret = nbd_client_add_connection(bs, sioc, export,
+                                        tlscreds, hostname, errp);
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto error;
+        }
+    }
+
  error:
+    qemu_opts_del(opts);
     if (sioc) {
         object_unref(OBJECT(sioc));
     }
@@ -365,6 +423,15 @@ static int nbd_co_flush(BlockDriverState *bs)
     return nbd_client_co_flush(bs);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum,
+                                          file);
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
@@ -460,6 +527,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -478,6 +546,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -496,6 +565,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
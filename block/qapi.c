@@ -67,6 +67,8 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
     if (bs->throttle_state) {
         ThrottleConfig cfg;
+        unsigned weight;
+        int64_t latency_target_ns;
 
         throttle_group_get_config(bs, &cfg);
 
@@ -117,6 +119,12 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(bs));
+
+        throttle_group_get_share(bs, &weight, &latency_target_ns);
+        info->has_weight = true;
+        info->weight = weight;
+        info->has_latency_target = true;
+        info->latency_target = latency_target_ns / SCALE_MS;
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -359,6 +367,31 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries, **bins;
+    int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -396,6 +429,22 @@ static void bdrv_query_blk_stats(BlockStats *s, BlockBackend *blk)
     s->stats->account_invalid = stats->account_invalid;
     s->stats->account_failed = stats->account_failed;
 
+    if (stats->latency_histogram[BLOCK_ACCT_READ].nbins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram = bdrv_latency_histogram_stats(
+            &stats->latency_histogram[BLOCK_ACCT_READ]);
+    }
+    if (stats->latency_histogram[BLOCK_ACCT_WRITE].nbins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram = bdrv_latency_histogram_stats(
+            &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    }
+    if (stats->latency_histogram[BLOCK_ACCT_FLUSH].nbins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram = bdrv_latency_histogram_stats(
+            &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    }
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
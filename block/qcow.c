@@ -913,6 +913,17 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
+    /* Requests may span several clusters, compress them one by one */
+    while (nb_sectors > s->cluster_sectors) {
+        ret = qcow_write_compressed(bs, sector_num, buf, s->cluster_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += s->cluster_sectors;
+        buf += s->cluster_size;
+        nb_sectors -= s->cluster_sectors;
+    }
+
     if (nb_sectors != s->cluster_sectors) {
         ret = -EINVAL;
 
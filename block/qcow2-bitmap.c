@@ -0,0 +1,1044 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * The bitmaps extension is described in docs/specs/qcow2.txt.  Bitmaps are
+ * loaded when the image is opened and written back as a whole when it is
+ * closed or inactivated.  While the image is writable, the directory entries
+ * of the loaded bitmaps carry the in-use flag, so that bitmaps which were not
+ * stored back properly are recognised as inconsistent.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/* NOTICE: BME here means Bitmaps Extension and used as a namespace for
+ * _internal_ constants. Please do not use this _internal_ abbreviation for
+ * other needs and/or outside of this file. */
+
+/* Bitmap directory entry constraints */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_PHYS_SIZE 0x20000000 /* restrict BdrvDirtyBitmap size in RAM */
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE (1U << 2)
+
+/* bits [1, 8] U [56, 63] are reserved */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows  */
+    /* name follows  */
+} Qcow2BitmapDirEntry;
+
+typedef enum BitmapType {
+    BT_DIRTY_TRACKING_BITMAP = 1
+} BitmapType;
+
+/* In-memory copy of a bitmap directory entry */
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint32_t extra_data_size;
+    uint8_t *extra_data;
+    char *name;
+
+    /* The table and data clusters were allocated by the current store */
+    bool allocated;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline size_t calc_dir_entry_size(size_t name_size,
+                                         size_t extra_data_size)
+{
+    return QEMU_ALIGN_UP(sizeof(Qcow2BitmapDirEntry) +
+                         name_size + extra_data_size, 8);
+}
+
+/* Bitmaps of another type or with extra data that we do not understand must
+ * not be used, but they are kept in the image unchanged.
+ */
+static bool bitmap_is_supported(const Qcow2Bitmap *bm)
+{
+    return bm->type == BT_DIRTY_TRACKING_BITMAP &&
+           (bm->extra_data_size == 0 ||
+            (bm->flags & BME_FLAG_EXTRA_DATA_COMPATIBLE)) &&
+           bm->granularity_bits >= BME_MIN_GRANULARITY_BITS &&
+           bm->granularity_bits <= BME_MAX_GRANULARITY_BITS;
+}
+
+/* Number of sectors described by one cluster of bitmap data */
+static uint64_t sectors_covered_by_bitmap_cluster(const BDRVQcow2State *s,
+                                                  uint32_t granularity)
+{
+    return ((uint64_t)s->cluster_size * 8) *
+           (granularity >> BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(const BDRVQcow2State *s,
+                                  uint64_t nb_sectors, uint32_t granularity)
+{
+    uint64_t sectors_per_bit = granularity >> BDRV_SECTOR_BITS;
+    uint64_t bits = DIV_ROUND_UP(nb_sectors, sectors_per_bit);
+
+    return DIV_ROUND_UP(bits, (uint64_t)s->cluster_size * 8);
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    return bm_list;
+}
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm->extra_data);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2Bitmap *bitmap_list_find(Qcow2BitmapList *bm_list,
+                                     const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (!strcmp(bm->name, name)) {
+            return bm;
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t bitmap_list_count(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+    uint32_t nb = 0;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        nb++;
+    }
+
+    return nb;
+}
+
+/* Read the bitmap directory that the header extension points to */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    uint8_t *dir, *dir_end, *p;
+    uint32_t nb = 0;
+    int ret;
+
+    bm_list = bitmap_list_new();
+    if (s->nb_bitmaps == 0) {
+        return bm_list;
+    }
+
+    dir = g_malloc(s->bitmap_directory_size);
+    ret = bdrv_pread(bs->file->bs, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    dir_end = dir + s->bitmap_directory_size;
+    for (p = dir; p < dir_end; nb++) {
+        Qcow2BitmapDirEntry e;
+        Qcow2Bitmap *bm;
+        size_t entry_size;
+
+        if (dir_end - p < sizeof(e)) {
+            error_setg(errp, "Bitmap directory is truncated");
+            goto fail;
+        }
+
+        memcpy(&e, p, sizeof(e));
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        entry_size = calc_dir_entry_size(e.name_size, e.extra_data_size);
+        if (dir_end - p < entry_size) {
+            error_setg(errp, "Bitmap directory is truncated");
+            goto fail;
+        }
+
+        if (nb >= s->nb_bitmaps) {
+            error_setg(errp, "Bitmap directory has more entries than the "
+                       "header says");
+            goto fail;
+        }
+
+        if (e.flags & BME_RESERVED_FLAGS) {
+            error_setg(errp, "Bitmap directory entry has reserved flags set");
+            goto fail;
+        }
+
+        if (e.name_size == 0 || e.name_size > BME_MAX_NAME_SIZE) {
+            error_setg(errp, "Bitmap directory entry has an invalid name "
+                       "length");
+            goto fail;
+        }
+
+        if (e.bitmap_table_size > BME_MAX_TABLE_SIZE ||
+            offset_into_cluster(s, e.bitmap_table_offset) ||
+            (e.bitmap_table_size && !e.bitmap_table_offset)) {
+            error_setg(errp, "Bitmap directory entry has an invalid "
+                       "bitmap table");
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table_offset = e.bitmap_table_offset;
+        bm->table_size = e.bitmap_table_size;
+        bm->flags = e.flags;
+        bm->type = e.type;
+        bm->granularity_bits = e.granularity_bits;
+        bm->extra_data_size = e.extra_data_size;
+        bm->extra_data = g_memdup(p + sizeof(e), e.extra_data_size);
+        bm->name = g_strndup((char *)p + sizeof(e) + e.extra_data_size,
+                             e.name_size);
+
+        if (strlen(bm->name) != e.name_size ||
+            bitmap_list_find(bm_list, bm->name)) {
+            error_setg(errp, "Bitmap directory entry has an invalid or "
+                       "duplicate name");
+            bitmap_free(bm);
+            goto fail;
+        }
+
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+        p += entry_size;
+    }
+
+    if (nb != s->nb_bitmaps) {
+        error_setg(errp, "Bitmap directory has fewer entries than the "
+                   "header says");
+        goto fail;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+    return NULL;
+}
+
+/*
+ * Write the directory for @bm_list.  With @in_place set, the existing
+ * directory at *@offset is overwritten, which must have the same size;
+ * otherwise new clusters are allocated and returned in *@offset.
+ */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size, bool in_place)
+{
+    Qcow2Bitmap *bm;
+    uint8_t *dir, *p;
+    uint64_t dir_size = 0;
+    int64_t dir_offset;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += calc_dir_entry_size(strlen(bm->name),
+                                        bm->extra_data_size);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+        (in_place && dir_size != *size)) {
+        return -EINVAL;
+    }
+
+    dir = g_malloc0(dir_size);
+    p = dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        size_t name_size = strlen(bm->name);
+        Qcow2BitmapDirEntry e = {
+            .bitmap_table_offset    = cpu_to_be64(bm->table_offset),
+            .bitmap_table_size      = cpu_to_be32(bm->table_size),
+            .flags                  = cpu_to_be32(bm->flags),
+            .type                   = bm->type,
+            .granularity_bits       = bm->granularity_bits,
+            .name_size              = cpu_to_be16(name_size),
+            .extra_data_size        = cpu_to_be32(bm->extra_data_size),
+        };
+
+        memcpy(p, &e, sizeof(e));
+        memcpy(p + sizeof(e), bm->extra_data, bm->extra_data_size);
+        memcpy(p + sizeof(e) + bm->extra_data_size, bm->name, name_size);
+        p += calc_dir_entry_size(name_size, bm->extra_data_size);
+    }
+
+    if (in_place) {
+        dir_offset = *offset;
+    } else {
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            goto fail;
+        }
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(dir);
+    *offset = dir_offset;
+    *size = dir_size;
+    return 0;
+
+fail:
+    g_free(dir);
+    if (!in_place && dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+    return ret;
+}
+
+static int bitmap_table_load(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                             uint64_t **bitmap_table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    if (bm->table_size == 0) {
+        *bitmap_table = NULL;
+        return 0;
+    }
+
+    table = g_try_malloc(bm->table_size * sizeof(uint64_t));
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t entry = be64_to_cpu(table[i]);
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if ((entry & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            offset_into_cluster(s, offset) ||
+            (offset && (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES))) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        table[i] = entry;
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+/* Free the data clusters referenced by a bitmap table */
+static void bitmap_table_free_clusters(BlockDriverState *bs,
+                                       const uint64_t *bitmap_table,
+                                       uint32_t bitmap_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bitmap_table_size; i++) {
+        uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+}
+
+/* Free the table and the data clusters of a bitmap.  If the table cannot be
+ * read, the clusters are leaked; 'qemu-img check -r leaks' reclaims them.
+ */
+static void bitmap_free_clusters(BlockDriverState *bs, const Qcow2Bitmap *bm)
+{
+    uint64_t *bitmap_table;
+    int ret;
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        return;
+    }
+
+    bitmap_table_free_clusters(bs, bitmap_table, bm->table_size);
+    if (bm->table_size) {
+        qcow2_free_clusters(bs, bm->table_offset,
+                            bm->table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+    }
+    g_free(bitmap_table);
+}
+
+static int load_bitmap_data(BlockDriverState *bs,
+                            const uint64_t *bitmap_table,
+                            uint32_t tb_size,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s,
+                       bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sector = 0;
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    if (tb_size !=
+        bitmap_table_size(s, bm_size, bdrv_dirty_bitmap_granularity(bitmap))) {
+        return -EINVAL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < tb_size; i++, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t entry = bitmap_table[i];
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset != 0) {
+            ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        } else if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            bdrv_dirty_bitmap_deserialize_ones(bitmap, sector, count, false);
+        }
+        /* A new bitmap is clear, so all-zeroes clusters need no work */
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    g_free(buf);
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
+                                    const Qcow2Bitmap *bm, Error **errp)
+{
+    uint64_t *bitmap_table = NULL;
+    BdrvDirtyBitmap *bitmap;
+    int ret;
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap table of "
+                         "bitmap '%s'", bm->name);
+        return NULL;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                      bm->name, errp);
+    if (bitmap == NULL) {
+        goto out;
+    }
+
+    ret = load_bitmap_data(bs, bitmap_table, bm->table_size, bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+                         bm->name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        bitmap = NULL;
+    }
+
+out:
+    g_free(bitmap_table);
+    return bitmap;
+}
+
+/*
+ * Create the in-memory bitmaps for all usable bitmaps of the image.  Bitmaps
+ * that are still flagged as in use were not stored properly; they are not
+ * loaded and get removed from the image the next time the bitmaps are stored.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    GSList *created = NULL, *l;
+    bool need_in_use = false;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (!bitmap_is_supported(bm)) {
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("Ignoring bitmap '%s' of '%s': it was not stored "
+                         "properly and may be inconsistent", bm->name,
+                         bdrv_get_device_or_node_name(bs));
+            continue;
+        }
+
+        need_in_use = true;
+
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (bitmap) {
+            /* The image is reopened (e.g. by bdrv_invalidate_cache()) and
+             * the bitmap has been kept in memory */
+            if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+                error_report("Ignoring bitmap '%s' of '%s': a temporary "
+                             "bitmap with the same name exists", bm->name,
+                             bdrv_get_device_or_node_name(bs));
+            }
+            continue;
+        }
+
+        bitmap = load_bitmap(bs, bm, errp);
+        if (bitmap == NULL) {
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        created = g_slist_append(created, bitmap);
+    }
+
+    s->bitmaps_need_in_use = need_in_use && !bs->read_only;
+
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return 0;
+
+fail:
+    for (l = created; l; l = l->next) {
+        bdrv_release_dirty_bitmap(bs, l->data);
+    }
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return -EINVAL;
+}
+
+/*
+ * Set the in-use flag of the bitmaps in the image before it is first
+ * modified.  Called with s->lock held.
+ */
+int qcow2_mark_bitmaps_in_use(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    uint64_t offset, size;
+    bool changed = false;
+    int ret;
+
+    if (!s->bitmaps_need_in_use) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, &local_err);
+    if (bm_list == NULL) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bitmap_is_supported(bm) && !(bm->flags & BME_FLAG_IN_USE)) {
+            bm->flags |= BME_FLAG_IN_USE;
+            changed = true;
+        }
+    }
+
+    ret = 0;
+    if (changed) {
+        offset = s->bitmap_directory_offset;
+        size = s->bitmap_directory_size;
+        ret = bitmap_list_store(bs, bm_list, &offset, &size, true);
+        if (ret == 0) {
+            ret = bdrv_flush(bs->file->bs);
+        }
+    }
+
+    if (ret == 0) {
+        s->bitmaps_need_in_use = false;
+    }
+    bitmap_list_free(bm_list);
+    return ret;
+}
+
+/* Write the data and the bitmap table of @bitmap to newly allocated clusters
+ * and record them in @bm.
+ */
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, granularity);
+    uint64_t tb_size = bitmap_table_size(s, bm_size, granularity);
+    uint64_t *tb = NULL;
+    uint64_t sector = 0;
+    int64_t offset, table_offset = 0;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int ret;
+
+    if (tb_size > BME_MAX_TABLE_SIZE ||
+        tb_size * s->cluster_size > BME_MAX_PHYS_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too big", bm->name);
+        return -EINVAL;
+    }
+
+    if (tb_size == 0) {
+        goto done;
+    }
+
+    tb = g_try_malloc0(tb_size * sizeof(uint64_t));
+    if (tb == NULL) {
+        error_setg(errp, "Could not allocate the table of bitmap '%s'",
+                   bm->name);
+        return -ENOMEM;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < tb_size; i++, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t write_size =
+            bdrv_dirty_bitmap_serialization_size(bitmap, sector, count);
+
+        if (bdrv_dirty_bitmap_is_serialized_zero(bitmap, sector, count)) {
+            /* Leave the table entry zero, this part of the bitmap is clear */
+            continue;
+        }
+        memset(buf + write_size, 0, s->cluster_size - write_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            error_setg_errno(errp, -ret, "Could not allocate clusters for "
+                             "bitmap '%s'", bm->name);
+            goto fail;
+        }
+        tb[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret >= 0) {
+            ret = bdrv_pwrite(bs->file->bs, offset, buf, s->cluster_size);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        ret = table_offset;
+        error_setg_errno(errp, -ret, "Could not allocate the table of "
+                         "bitmap '%s'", bm->name);
+        goto fail;
+    }
+
+    for (i = 0; i < tb_size; i++) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, table_offset,
+                                        tb_size * sizeof(uint64_t));
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file->bs, table_offset, tb,
+                          tb_size * sizeof(uint64_t));
+    }
+    for (i = 0; i < tb_size; i++) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the table of "
+                         "bitmap '%s'", bm->name);
+        qcow2_free_clusters(bs, table_offset, tb_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+        goto fail;
+    }
+
+done:
+    bm->table_offset = table_offset;
+    bm->table_size = tb_size;
+    bm->allocated = true;
+    g_free(buf);
+    g_free(tb);
+    return 0;
+
+fail:
+    bitmap_table_free_clusters(bs, tb, tb_size);
+    g_free(buf);
+    g_free(tb);
+    return ret;
+}
+
+/*
+ * Write all persistent bitmaps of @bs to the image.  The new directory,
+ * tables and data are written to new clusters and the header is switched
+ * over to them; only then are the clusters of the old bitmaps freed, so
+ * that an interruption leaves either the old or the new bitmaps valid.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *old_list, *new_list;
+    Qcow2Bitmap *bm, *next;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t dir_offset = 0, dir_size = 0;
+    uint64_t old_dir_offset, old_dir_size, old_autoclear;
+    uint32_t nb_bitmaps, old_nb_bitmaps;
+    int ret;
+
+    if (s->nb_bitmaps == 0 && !bdrv_has_persistent_dirty_bitmaps(bs)) {
+        return 0;
+    }
+
+    old_list = bitmap_list_load(bs, errp);
+    if (old_list == NULL) {
+        return -EINVAL;
+    }
+    new_list = bitmap_list_new();
+
+    /* Bitmaps that we cannot use are kept as they are */
+    QSIMPLEQ_FOREACH_SAFE(bm, old_list, entry, next) {
+        if (!bitmap_is_supported(bm)) {
+            QSIMPLEQ_REMOVE(old_list, bm, Qcow2Bitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            error_setg(errp, "Cannot store bitmap '%s' while it is frozen",
+                       name);
+            ret = -EBUSY;
+            goto fail;
+        }
+
+        if (bitmap_list_find(new_list, name)) {
+            error_setg(errp, "Cannot store bitmap '%s': the image has another "
+                       "bitmap with the same name", name);
+            ret = -EEXIST;
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->type = BT_DIRTY_TRACKING_BITMAP;
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+
+        ret = store_bitmap(bs, bitmap, bm, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    nb_bitmaps = bitmap_list_count(new_list);
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many bitmaps");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (nb_bitmaps > 0) {
+        ret = bitmap_list_store(bs, new_list, &dir_offset, &dir_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write bitmap directory");
+            goto fail;
+        }
+    }
+
+    /* The new bitmaps must be on disk before the header points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush bitmaps");
+        goto fail_dir;
+    }
+
+    old_nb_bitmaps = s->nb_bitmaps;
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear = s->autoclear_features;
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps > 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear;
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto fail_dir;
+    }
+
+    s->bitmaps_need_in_use = false;
+
+    /* The old bitmaps are not referenced any more */
+    QSIMPLEQ_FOREACH(bm, old_list, entry) {
+        bitmap_free_clusters(bs, bm);
+    }
+    if (old_dir_size) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+    return 0;
+
+fail_dir:
+    if (dir_size) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+fail:
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        if (bm->allocated) {
+            bitmap_free_clusters(bs, bm);
+        }
+    }
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list = NULL;
+    BdrvDirtyBitmap *bitmap;
+    int granularity_bits = ctz32(granularity);
+    uint32_t nb_bitmaps = 0;
+    const char *reason = NULL;
+    Error *local_err = NULL;
+
+    if (s->qcow_version < 3) {
+        reason = "the image must be in qcow2 version 3 (compat=1.1) format";
+    } else if (bs->read_only) {
+        reason = "the image is read-only";
+    } else if (strlen(name) > BME_MAX_NAME_SIZE) {
+        reason = "the name is too long";
+    } else if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+               granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        reason = "the granularity must be between 512 bytes and 2 GiB";
+    } else if (bitmap_table_size(s, bdrv_nb_sectors(bs), granularity) >
+               BME_MAX_TABLE_SIZE) {
+        reason = "the bitmap would be too big";
+    }
+
+    if (reason) {
+        goto fail;
+    }
+
+    bm_list = bitmap_list_load(bs, &local_err);
+    if (bm_list == NULL) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+
+    if (bitmap_list_find(bm_list, name)) {
+        reason = "the image already contains a bitmap with this name";
+        goto fail;
+    }
+
+    nb_bitmaps = bitmap_list_count(bm_list);
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap) &&
+            !bitmap_list_find(bm_list, bdrv_dirty_bitmap_name(bitmap))) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        reason = "the image has too many bitmaps";
+        goto fail;
+    }
+
+    bitmap_list_free(bm_list);
+    return true;
+
+fail:
+    error_setg(errp, "Can't make bitmap '%s' persistent in '%s': %s",
+               name, bdrv_get_device_or_node_name(bs), reason);
+    bitmap_list_free(bm_list);
+    return false;
+}
+
+/* Account for the clusters used by the bitmaps in the refcount check */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, &local_err);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR bitmap directory: %s\n",
+                error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap '%s': invalid bitmap table\n",
+                    bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; i++) {
+            uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           offset, s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+        g_free(bitmap_table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
@@ -31,6 +31,8 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
 #include "qcow2.h"
 #include "trace.h"
 
@@ -39,8 +41,15 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+
+    /* Hash chain, only for entries with offset != 0 */
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    /* LRU list, only for entries with ref == 0 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
+typedef QLIST_HEAD(, Qcow2CachedTable) Qcow2CacheBucket;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -49,8 +58,51 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Index from table offset to entry; the number of buckets is a power
+     * of two no smaller than the number of entries. */
+    Qcow2CacheBucket       *buckets;
+    unsigned int            bucket_mask;
+
+    /* Unreferenced entries, least recently used first.  Free entries are
+     * kept at the head so that they are reused before any cached table. */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
+static inline Qcow2CacheBucket *qcow2_cache_bucket(BlockDriverState *bs,
+                                                   Qcow2Cache *c,
+                                                   uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t h = (offset >> s->cluster_bits) * 0x9e3779b97f4a7c15ULL;
+
+    return &c->buckets[(h >> 32) & c->bucket_mask];
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c,
+                                    int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    QLIST_INSERT_HEAD(qcow2_cache_bucket(bs, c, t->offset), t, hash_next);
+}
+
+/* Drop a table from the index, leaving a free entry behind */
+static void qcow2_cache_entry_invalidate(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->offset) {
+        QLIST_REMOVE(t, hash_next);
+        t->offset = 0;
+    }
+    t->lru_counter = 0;
+    if (t->ref == 0) {
+        QTAILQ_REMOVE(&c->lru, t, lru_next);
+        QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
+    }
+}
+
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
@@ -104,8 +156,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_invalidate(c, i);
             i++;
             to_clean++;
         }
@@ -122,18 +173,28 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned int nb_buckets = pow2ceil(num_tables);
+    int i;
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new0(Qcow2CacheBucket, nb_buckets);
+    c->bucket_mask = nb_buckets - 1;
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -148,6 +209,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -291,8 +353,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_invalidate(c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -306,39 +367,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
+    QLIST_FOREACH(t, qcow2_cache_bucket(bs, c, offset), hash_next) {
         if (t->offset == offset) {
+            i = t - c->entries;
             goto found;
         }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    }
 
-    if (min_lru_index == -1) {
+    t = QTAILQ_FIRST(&c->lru);
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write the least recently used table back and replace it */
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -349,7 +401,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_invalidate(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -364,10 +416,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_next);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -397,6 +452,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -28,6 +28,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -219,12 +220,34 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
     }
 
+    if ((old_l2_offset & L1E_OFFSET_MASK) &&
+        (s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2))
+    {
+        uint64_t refcount;
+
+        /* The data clusters of a shared L2 table were only referenced once;
+         * the copy needs a reference of its own */
+        ret = qcow2_get_refcount(bs, (old_l2_offset & L1E_OFFSET_MASK)
+                                     >> s->cluster_bits, &refcount);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (refcount > 1) {
+            ret = qcow2_update_l2_refcounts(bs,
+                                            old_l2_offset & L1E_OFFSET_MASK,
+                                            1);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+
     ret = qcow2_cache_flush(bs, s->refcount_block_cache);
     if (ret < 0) {
         goto fail;
@@ -242,7 +265,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -289,7 +312,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -302,12 +325,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -316,8 +339,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_NORMAL);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -325,14 +348,16 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_clusters_by_type(int nb_clusters,
-                                             uint64_t *l2_table,
+static int count_contiguous_clusters_by_type(BDRVQcow2State *s,
+                                             int nb_clusters,
+                                             uint64_t *l2_table, int l2_index,
                                              int wanted_type)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != wanted_type) {
             break;
@@ -342,6 +367,119 @@ static int count_contiguous_clusters_by_type(int nb_clusters,
     return i;
 }
 
+/*
+ * Returns the type of subcluster @sc_index of the cluster described by
+ * @l2_entry and @l2_bitmap (QCOW2_CLUSTER_*), or -EIO if the L2 entry is
+ * invalid.  Compressed clusters have no subclusters of their own, and
+ * subclusters that are neither allocated nor zero are read from the backing
+ * file even if the cluster has a host offset.
+ */
+static int qcow2_get_subcluster_type(uint64_t l2_entry, uint64_t l2_bitmap,
+                                     int sc_index)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    }
+
+    /* QCOW_OFLAG_ZERO is superseded by the bitmap and must be clear */
+    if ((l2_entry & QCOW_OFLAG_ZERO) || (l2_bitmap & (l2_bitmap >> 32))) {
+        return -EIO;
+    }
+    if ((l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) &&
+        !(l2_entry & L2E_OFFSET_MASK)) {
+        return -EIO;
+    }
+
+    if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
+/*
+ * Counts the subclusters starting at subcluster @sc_index of cluster
+ * @l2_index that have the same type, looking at no more than @nb_clusters
+ * clusters.  Allocated subclusters in different clusters are only counted
+ * together if the clusters are contiguous in the image file, and compressed
+ * clusters are always processed one by one.
+ *
+ * The type of the subclusters is stored in *type.  Returns the number of
+ * subclusters or -EIO if an invalid L2 entry was found.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                        int sc_index, uint64_t *l2_table,
+                                        int l2_index, int *type)
+{
+    uint64_t expected_offset = 0;
+    int i, count = 0;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+        uint32_t same_type;
+        int ret, n;
+
+        ret = qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index);
+        if (ret < 0) {
+            return ret;
+        }
+        if (i == 0) {
+            *type = ret;
+        } else if (ret != *type) {
+            break;
+        }
+
+        switch (ret) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            return s->subclusters_per_cluster - sc_index;
+        case QCOW2_CLUSTER_ZERO:
+            same_type = l2_bitmap >> 32;
+            break;
+        case QCOW2_CLUSTER_NORMAL:
+            if (i > 0 && (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+                return count;
+            }
+            expected_offset = (l2_entry & L2E_OFFSET_MASK) + s->cluster_size;
+            same_type = l2_bitmap;
+            break;
+        case QCOW2_CLUSTER_UNALLOCATED:
+            same_type = ~((uint32_t)l2_bitmap | (uint32_t)(l2_bitmap >> 32));
+            break;
+        default:
+            abort();
+        }
+
+        n = cto32(same_type >> sc_index);
+        count += n;
+        if (sc_index + n < s->subclusters_per_cluster) {
+            break;
+        }
+        sc_index = 0;
+    }
+
+    return count;
+}
+
+static int qcow2_crypt_sectors(QCryptoCipher *cipher, int64_t sector_num,
+                               uint8_t *out_buf, const uint8_t *in_buf,
+                               int nb_sectors, bool enc, Error **errp)
+{
+    size_t len = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+
+    if (enc) {
+        return qcrypto_cipher_encrypt_sectors(cipher, sector_num,
+                                              BDRV_SECTOR_SIZE,
+                                              in_buf, out_buf, len, errp);
+    } else {
+        return qcrypto_cipher_decrypt_sectors(cipher, sector_num,
+                                              BDRV_SECTOR_SIZE,
+                                              in_buf, out_buf, len, errp);
+    }
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -350,42 +488,114 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           int nb_sectors, bool enc,
                           Error **errp)
 {
-    union {
-        uint64_t ll[2];
-        uint8_t b[16];
-    } ivec;
-    int i;
+    return qcow2_crypt_sectors(s->cipher, sector_num, out_buf, in_buf,
+                               nb_sectors, enc, errp);
+}
+
+typedef struct Qcow2CryptRequest {
+    Coroutine *co;
+    int pending;
     int ret;
+} Qcow2CryptRequest;
+
+typedef struct Qcow2CryptJob {
+    Qcow2CryptRequest *req;
+    const uint8_t *key;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    bool enc;
+} Qcow2CryptJob;
+
+static int crypt_worker(void *opaque)
+{
+    Qcow2CryptJob *job = opaque;
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    int ret = 0;
+
+    /* The IV is part of the cipher state, so each job needs its own */
+    cipher = qcrypto_cipher_new(QCRYPTO_CIPHER_ALG_AES_128,
+                                QCRYPTO_CIPHER_MODE_CBC,
+                                job->key, QCOW2_CRYPT_KEY_SIZE, &err);
+    if (!cipher ||
+        qcow2_crypt_sectors(cipher, job->sector_num, job->buf, job->buf,
+                            job->nb_sectors, job->enc, &err) < 0) {
+        error_free(err);
+        ret = -EIO;
+    }
+    qcrypto_cipher_free(cipher);
+    return ret;
+}
 
-    for(i = 0; i < nb_sectors; i++) {
-        ivec.ll[0] = cpu_to_le64(sector_num);
-        ivec.ll[1] = 0;
-        if (qcrypto_cipher_setiv(s->cipher,
-                                 ivec.b, G_N_ELEMENTS(ivec.b),
-                                 errp) < 0) {
-            return -1;
-        }
-        if (enc) {
-            ret = qcrypto_cipher_encrypt(s->cipher,
-                                         in_buf,
-                                         out_buf,
-                                         512,
-                                         errp);
-        } else {
-            ret = qcrypto_cipher_decrypt(s->cipher,
-                                         in_buf,
-                                         out_buf,
-                                         512,
-                                         errp);
-        }
-        if (ret < 0) {
-            return -1;
+static void crypt_job_complete(void *opaque, int ret)
+{
+    Qcow2CryptRequest *req = opaque;
+
+    if (ret < 0) {
+        req->ret = ret;
+    }
+    if (--req->pending == 0) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+/* Encrypts or decrypts @buf in place.  Large buffers are split into
+ * chunks that are processed in parallel by the thread pool, leaving the
+ * AioContext free to run other requests; the caller should not hold
+ * s->lock.  Returns 0 or -errno.
+ */
+int coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                          int64_t sector_num, uint8_t *buf,
+                                          int nb_sectors, bool enc)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CryptRequest req;
+    Qcow2CryptJob *jobs;
+    ThreadPool *pool;
+    Error *err = NULL;
+    int i, n, njobs;
+
+    if (nb_sectors < QCOW2_CRYPT_OFFLOAD_SECTORS) {
+        if (qcow2_encrypt_sectors(s, sector_num, buf, buf, nb_sectors,
+                                  enc, &err) < 0) {
+            error_free(err);
+            return -EIO;
         }
-        sector_num++;
-        in_buf += 512;
-        out_buf += 512;
+        return 0;
     }
-    return 0;
+
+    njobs = DIV_ROUND_UP(nb_sectors, QCOW2_CRYPT_OFFLOAD_SECTORS);
+    jobs = g_new(Qcow2CryptJob, njobs);
+    req = (Qcow2CryptRequest) {
+        .co         = qemu_coroutine_self(),
+        .pending    = njobs,
+    };
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    for (i = 0; i < njobs; i++) {
+        n = MIN(nb_sectors, QCOW2_CRYPT_OFFLOAD_SECTORS);
+        jobs[i] = (Qcow2CryptJob) {
+            .req        = &req,
+            .key        = s->crypt_key,
+            .sector_num = sector_num,
+            .buf        = buf,
+            .nb_sectors = n,
+            .enc        = enc,
+        };
+        thread_pool_submit_aio(pool, crypt_worker, &jobs[i],
+                               crypt_job_complete, &req);
+        sector_num += n;
+        buf += n * BDRV_SECTOR_SIZE;
+        nb_sectors -= n;
+    }
+
+    /* Completions run in this AioContext, so none can happen before
+     * the coroutine yields */
+    qemu_coroutine_yield();
+
+    g_free(jobs);
+    return req.ret;
 }
 
 static int coroutine_fn copy_sectors(BlockDriverState *bs,
@@ -404,7 +614,7 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
     }
 
     iov.iov_len = n * BDRV_SECTOR_SIZE;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
+    iov.iov_base = qemu_try_blockalign_pooled(bs, iov.iov_len);
     if (iov.iov_base == NULL) {
         return -ENOMEM;
     }
@@ -454,7 +664,7 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
 
     ret = 0;
 out:
-    qemu_vfree(iov.iov_base);
+    qemu_vfree_pooled(bs, iov.iov_base, iov.iov_len);
     return ret;
 }
 
@@ -536,12 +746,47 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_index(s, offset);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* nb_needed <= INT_MAX, thus nb_clusters <= INT_MAX, too */
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
+    if (has_subclusters(s)) {
+        int sc_index = offset_to_sc_index(s, offset);
+
+        c = count_contiguous_subclusters(s, nb_clusters, sc_index, l2_table,
+                                         l2_index, &ret);
+        if (c < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid extended L2 "
+                                    "entry found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+
+        if (ret == QCOW2_CLUSTER_COMPRESSED) {
+            *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        } else if (ret == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+            if (offset_into_cluster(s, *cluster_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster "
+                                        "offset %#" PRIx64 " unaligned (L2 "
+                                        "offset: %#" PRIx64 ", L2 index: %#x)",
+                                        *cluster_offset, l2_offset, l2_index);
+                ret = -EIO;
+                goto fail;
+            }
+        } else {
+            *cluster_offset = 0;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+        nb_available = (uint64_t)(sc_index + c) * s->subcluster_sectors;
+        goto out;
+    }
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -557,20 +802,21 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_ZERO);
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index, QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index,
                                               QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -659,7 +905,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -704,7 +950,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -728,7 +974,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -743,14 +992,16 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
         return 0;
     }
 
-    qemu_co_mutex_unlock(&s->lock);
-    ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
-                       r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    qemu_co_mutex_lock(&s->lock);
+    if (!m->skip_cow) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
+                           r->offset / BDRV_SECTOR_SIZE,
+                           r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
+        qemu_co_mutex_lock(&s->lock);
 
-    if (ret < 0) {
-        return ret;
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /*
@@ -763,10 +1014,33 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the L2 bitmap of cluster @i of the allocation @m after the guest
+ * data and the COW regions have been written: the subclusters they cover
+ * are allocated, all others keep their state.
+ */
+static uint64_t l2meta_bitmap(BDRVQcow2State *s, QCowL2Meta *m, int i,
+                              uint64_t old_bitmap)
+{
+    uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+    uint64_t start = m->cow_start.offset;
+    uint64_t end = m->cow_end.offset
+                 + (m->cow_end.nb_sectors << BDRV_SECTOR_BITS);
+    int first_sc, last_sc;
+
+    start = MAX(start, cluster_start) - cluster_start;
+    end = MIN(end, cluster_start + s->cluster_size) - cluster_start;
+    first_sc = start >> s->subcluster_bits;
+    last_sc = DIV_ROUND_UP(end, s->subcluster_size);
+
+    return (old_bitmap & ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc))
+           | QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
+    int i, j = 0, n, l2_index, ret;
     uint64_t *old_cluster, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
 
@@ -813,11 +1087,19 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (old_entry != 0 && !m->keep_old_clusters) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_table, l2_index + i, (cluster_offset +
+                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        if (has_subclusters(s)) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          l2meta_bitmap(s, m, i, bitmap));
+        }
      }
 
 
@@ -828,12 +1110,26 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      *
      * Don't discard clusters that reach a refcount of 0 (e.g. compressed
      * clusters), the next write will reuse them anyway.
+     *
+     * Runs of contiguous normal clusters are freed with a single refcount
+     * update.
      */
-    if (j != 0) {
-        for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
-                                    QCOW2_DISCARD_NEVER);
+    for (i = 0; i < j; i += n) {
+        uint64_t l2_entry = old_cluster[i];
+
+        n = 1;
+        if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL) {
+            while (i + n < j) {
+                uint64_t next = old_cluster[i + n];
+                if (qcow2_get_cluster_type(next) != QCOW2_CLUSTER_NORMAL ||
+                    (next & L2E_OFFSET_MASK) !=
+                    (l2_entry & L2E_OFFSET_MASK) + (n << s->cluster_bits)) {
+                    break;
+                }
+                n++;
+            }
         }
+        qcow2_free_any_clusters(bs, l2_entry, n, QCOW2_DISCARD_NEVER);
     }
 
     ret = 0;
@@ -853,7 +1149,7 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -876,6 +1172,35 @@ out:
     return i;
 }
 
+/*
+ * Returns the number of clusters, out of the @nb_clusters clusters starting
+ * at @l2_index, in which all subclusters touched by the area [@start, @end)
+ * are allocated.  @start and @end are byte offsets from the start of the
+ * first cluster.
+ */
+static int count_allocated_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                       uint64_t *l2_table, int l2_index,
+                                       uint64_t start, uint64_t end)
+{
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_start = (uint64_t)i << s->cluster_bits;
+        uint64_t from = MAX(start, cluster_start) - cluster_start;
+        uint64_t to = MIN(end, cluster_start + s->cluster_size)
+                    - cluster_start;
+        uint64_t needed =
+            QCOW_OFLAG_SUB_ALLOC_RANGE(from >> s->subcluster_bits,
+                                       DIV_ROUND_UP(to, s->subcluster_size));
+
+        if ((get_l2_bitmap(s, l2_table, l2_index + i) & needed) != needed) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 /*
  * Check if there already is an AIO write request in flight which allocates
  * the same cluster. In this case we need to wait until the previous
@@ -904,6 +1229,16 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, the COW regions of a new allocation don't
+         * necessarily cover its clusters completely, but a second new
+         * allocation of the same cluster would still get a host cluster of
+         * its own.  Only writes to an existing cluster can run in parallel
+         * as long as they touch different subclusters. */
+        if (!old_alloc->keep_old_clusters) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -997,7 +1332,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1024,11 +1359,24 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
+        /* ...as long as the subclusters we write to are allocated */
+        if (has_subclusters(s)) {
+            uint64_t start = offset_into_cluster(s, guest_offset);
+
+            keep_clusters = count_allocated_subclusters(s, keep_clusters,
+                                                        l2_table, l2_index,
+                                                        start, start + *bytes);
+        }
+
+        if (keep_clusters == 0) {
+            ret = 0;
+            goto out;
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -1099,6 +1447,74 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * Shrinks the COW regions @cow_start and @cow_end of an allocation of
+ * @nb_clusters clusters at @guest_offset, which initially cover the whole
+ * clusters around the written area, to what has to be copied when the image
+ * has subclusters.  The written area does not change.
+ *
+ * A first or last cluster that had no host cluster yet only needs the
+ * partially written subclusters to be copied, and so do clusters that are
+ * filled in place (@keep_old), where allocated subclusters aren't copied at
+ * all.  Compressed clusters and clusters shared with a snapshot are still
+ * copied in full.
+ */
+static int calculate_subcluster_cow(BlockDriverState *bs,
+                                    uint64_t guest_offset, int nb_clusters,
+                                    bool keep_old, Qcow2COWRegion *cow_start,
+                                    Qcow2COWRegion *cow_end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t write_start = cow_start->offset
+                         + (cow_start->nb_sectors << BDRV_SECTOR_BITS);
+    uint64_t write_end = cow_end->offset;
+    uint64_t last_start = (uint64_t)(nb_clusters - 1) << s->cluster_bits;
+    uint64_t start, end, entry, bitmap, *l2_table;
+    int l2_index, sc, ret;
+
+    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    entry = get_l2_entry(s, l2_table, l2_index);
+    bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    sc = write_start >> s->subcluster_bits;
+    if (!keep_old &&
+        qcow2_get_cluster_type(entry) != QCOW2_CLUSTER_UNALLOCATED) {
+        start = 0;
+    } else if (keep_old && (bitmap & QCOW_OFLAG_SUB_ALLOC(sc))) {
+        start = write_start;
+    } else {
+        start = (uint64_t)sc << s->subcluster_bits;
+    }
+
+    entry = get_l2_entry(s, l2_table, l2_index + nb_clusters - 1);
+    bitmap = get_l2_bitmap(s, l2_table, l2_index + nb_clusters - 1);
+    sc = (write_end - last_start - 1) >> s->subcluster_bits;
+    if (!keep_old &&
+        qcow2_get_cluster_type(entry) != QCOW2_CLUSTER_UNALLOCATED) {
+        end = (uint64_t)nb_clusters << s->cluster_bits;
+    } else if (keep_old && (bitmap & QCOW_OFLAG_SUB_ALLOC(sc))) {
+        end = write_end;
+    } else {
+        end = last_start + ((uint64_t)(sc + 1) << s->subcluster_bits);
+    }
+
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    *cow_start = (Qcow2COWRegion) {
+        .offset     = start,
+        .nb_sectors = (write_start - start) >> BDRV_SECTOR_BITS,
+    };
+    *cow_end = (Qcow2COWRegion) {
+        .offset     = write_end,
+        .nb_sectors = (end - write_end) >> BDRV_SECTOR_BITS,
+    };
+
+    return 0;
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
@@ -1127,6 +1543,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     uint64_t nb_clusters;
+    bool keep_old_clusters = false;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1152,11 +1569,19 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
+    } else if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+               (entry & QCOW_OFLAG_COPIED)) {
+        /* With subclusters, handle_copied() leaves us clusters that we own
+         * but that have unallocated subclusters in the written area; fill
+         * these in place, one cluster at a time */
+        assert(has_subclusters(s));
+        keep_old_clusters = true;
+        nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
     }
@@ -1170,10 +1595,18 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+    if (keep_old_clusters) {
+        if (alloc_cluster_offset &&
+            alloc_cluster_offset != (entry & L2E_OFFSET_MASK)) {
+            nb_clusters = 0;
+        }
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+    } else {
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* Can't extend contiguous allocation */
@@ -1215,8 +1648,25 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    Qcow2COWRegion cow_start = {
+        .offset     = 0,
+        .nb_sectors = alloc_n_start,
+    };
+    Qcow2COWRegion cow_end = {
+        .offset     = nb_sectors * BDRV_SECTOR_SIZE,
+        .nb_sectors = avail_sectors - nb_sectors,
+    };
     QCowL2Meta *old_m = *m;
 
+    if (has_subclusters(s)) {
+        ret = calculate_subcluster_cow(bs, guest_offset, nb_clusters,
+                                       keep_old_clusters, &cow_start,
+                                       &cow_end);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1227,14 +1677,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
 
-        .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
-        },
-        .cow_end = {
-            .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
-        },
+        .cow_start          = cow_start,
+        .cow_end            = cow_end,
+        .keep_old_clusters  = keep_old_clusters,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
@@ -1407,9 +1852,27 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressData data;
+    ThreadPool *pool;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
 
@@ -1424,8 +1887,17 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+
+        /* Inflate in the thread pool so that the AioContext keeps
+         * processing other requests meanwhile */
+        data = (Qcow2DecompressData) {
+            .out_buf        = s->cluster_cache,
+            .out_buf_size   = s->cluster_size,
+            .buf            = s->cluster_data + sector_offset,
+            .buf_size       = csize,
+        };
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        if (thread_pool_submit_co(pool, decompress_worker, &data) < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
@@ -1433,14 +1905,63 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
     return 0;
 }
 
+/*
+ * Discards the subclusters of cluster @l2_index that intersect the guest area
+ * [@start, @end), which must be subcluster aligned and relative to the start
+ * of the cluster, but not cover the whole cluster.  The host cluster is freed
+ * once none of its subclusters is allocated any more.
+ *
+ * Compressed clusters can only be discarded as a whole and are left alone.
+ */
+static void discard_l2_subclusters(BlockDriverState *bs, uint64_t *l2_table,
+                                   int l2_index, uint64_t start, uint64_t end,
+                                   enum qcow2_discard_type type,
+                                   bool full_discard)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t new_bitmap;
+    int first_sc = start >> s->subcluster_bits;
+    int last_sc = end >> s->subcluster_bits;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return;
+    }
+
+    /* Like for whole clusters, what isn't allocated reads as zeroes anyway
+     * if there is no backing file */
+    new_bitmap = l2_bitmap & ~(QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc) |
+                               QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc));
+    if (!full_discard && bs->backing) {
+        new_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc);
+    }
+    if (new_bitmap == l2_bitmap) {
+        return;
+    }
+
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    set_l2_bitmap(s, l2_table, l2_index, new_bitmap);
+    if (!(new_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) &&
+        (l2_entry & L2E_OFFSET_MASK))
+    {
+        set_l2_entry(s, l2_table, l2_index, 0);
+        qcow2_free_any_clusters(bs, l2_entry, 1, type);
+    }
+}
+
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of discarded
  * clusters.
+ *
+ * Only images with subclusters can have an @offset or @end_offset that
+ * isn't cluster aligned; the first and last cluster are discarded partially
+ * then.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
-                             uint64_t nb_clusters, enum qcow2_discard_type type,
-                             bool full_discard)
+                             uint64_t nb_clusters, uint64_t end_offset,
+                             enum qcow2_discard_type type, bool full_discard)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table;
@@ -1460,7 +1981,35 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        /* With subclusters, the bitmap says how the cluster reads back */
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t new_bitmap = full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES;
+            uint64_t cluster_start = start_of_cluster(s, offset)
+                                   + ((uint64_t)i << s->cluster_bits);
+            uint64_t start = MAX(offset, cluster_start) - cluster_start;
+            uint64_t end = MIN(end_offset - cluster_start, s->cluster_size);
+
+            if (start != 0 || end != s->cluster_size) {
+                discard_l2_subclusters(bs, l2_table, l2_index + i, start, end,
+                                       type, full_discard);
+                continue;
+            }
+
+            if (old_l2_entry == 0 &&
+                (old_bitmap == new_bitmap || (!full_discard && !bs->backing)))
+            {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i, new_bitmap);
+            qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+            continue;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1499,9 +2048,9 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1523,27 +2072,29 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     end_offset = offset + (nb_sectors << BDRV_SECTOR_BITS);
 
-    /* Round start up and end down */
-    offset = align_offset(offset, s->cluster_size);
-    end_offset = start_of_cluster(s, end_offset);
+    /* Round start up and end down (to subclusters if the image has them) */
+    offset = align_offset(offset, s->subcluster_size);
+    end_offset &= ~((uint64_t)s->subcluster_size - 1);
 
-    if (offset > end_offset) {
+    if (offset >= end_offset) {
         return 0;
     }
 
-    nb_clusters = size_to_clusters(s, end_offset - offset);
+    nb_clusters = size_to_clusters(s, offset_into_cluster(s, offset)
+                                      + (end_offset - offset));
 
     s->cache_discards = true;
 
     /* Each L2 table is handled by its own loop iteration */
     while (nb_clusters > 0) {
-        ret = discard_single_l2(bs, offset, nb_clusters, type, full_discard);
+        ret = discard_single_l2(bs, offset, nb_clusters, end_offset, type,
+                                full_discard);
         if (ret < 0) {
             goto fail;
         }
 
         nb_clusters -= ret;
-        offset += (ret * s->cluster_size);
+        offset = start_of_cluster(s, offset) + (ret * s->cluster_size);
     }
 
     ret = 0;
@@ -1554,13 +2105,52 @@ fail:
     return ret;
 }
 
+/*
+ * Marks the subclusters of cluster @l2_index that intersect the guest area
+ * [@start, @end) as zero.  @start and @end are byte offsets relative to the
+ * start of the cluster and must be subcluster aligned.
+ *
+ * Compressed clusters can only be zeroed as a whole; returns -ENOTSUP if
+ * only part of one is to be zeroed.
+ */
+static int zero_l2_subclusters(BlockDriverState *bs, uint64_t *l2_table,
+                               int l2_index, uint64_t start, uint64_t end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    int first_sc = start >> s->subcluster_bits;
+    int last_sc = end >> s->subcluster_bits;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        if (first_sc != 0 || last_sc != s->subclusters_per_cluster) {
+            return -ENOTSUP;
+        }
+        set_l2_entry(s, l2_table, l2_index, 0);
+        qcow2_free_any_clusters(bs, l2_entry, 1, QCOW2_DISCARD_REQUEST);
+        l2_bitmap = 0;
+    }
+
+    /* Normal clusters stay allocated so that they can be overwritten in
+     * place later */
+    l2_bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+    l2_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc);
+    set_l2_bitmap(s, l2_table, l2_index, l2_bitmap);
+
+    return 0;
+}
+
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of zeroed
  * clusters.
+ *
+ * Only images with subclusters can have an @offset or @end_offset that
+ * isn't cluster aligned; the first and last cluster are zeroed partially
+ * then.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-                          uint64_t nb_clusters)
+                          uint64_t nb_clusters, uint64_t end_offset)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table;
@@ -1580,15 +2170,27 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            uint64_t cluster_start = start_of_cluster(s, offset)
+                                   + ((uint64_t)i << s->cluster_bits);
+
+            ret = zero_l2_subclusters(bs, l2_table, l2_index + i,
+                        MAX(offset, cluster_start) - cluster_start,
+                        MIN(end_offset - cluster_start, s->cluster_size));
+            if (ret < 0) {
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                return ret;
+            }
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1600,6 +2202,7 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
+    uint64_t end_offset;
     uint64_t nb_clusters;
     int ret;
 
@@ -1609,18 +2212,20 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
     }
 
     /* Each L2 table is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
+    end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
+    nb_clusters = size_to_clusters(s, offset_into_cluster(s, offset)
+                                      + (end_offset - offset));
 
     s->cache_discards = true;
 
     while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+        ret = zero_single_l2(bs, offset, nb_clusters, end_offset);
         if (ret < 0) {
             goto fail;
         }
 
         nb_clusters -= ret;
-        offset += (ret * s->cluster_size);
+        offset = start_of_cluster(s, offset) + (ret * s->cluster_size);
     }
 
     ret = 0;
@@ -29,6 +29,8 @@
 #include "qemu/range.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
+static void free_map_update(BDRVQcow2State *s, uint64_t cluster_index,
+                            uint64_t nb_clusters, bool free);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length, uint64_t addend,
                             bool decrease, enum qcow2_discard_type type);
@@ -119,6 +121,10 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    if (s->free_map) {
+        hbitmap_free(s->free_map);
+        s->free_map = NULL;
+    }
 }
 
 
@@ -584,6 +590,9 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    /* The new refcount structures were placed without allocating them */
+    qcow2_free_map_invalidate(bs);
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -753,6 +762,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        free_map_update(s, cluster_index, 1, refcount == 0);
         s->set_refcount(refcount_block, block_index, refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
@@ -818,10 +828,133 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 /* return < 0 if error */
+/*
+ * The free cluster map caches which clusters below s->free_map_end have a
+ * refcount of 0, so that allocations don't have to look up the refcount of
+ * every cluster they skip.  It is filled lazily, one refcount block at a
+ * time, starting at the free_cluster_index of the time it was (re)created.
+ *
+ * A set bit must always mean that the cluster is free; a clear bit for a free
+ * cluster only means that the cluster won't be reused until the next
+ * qcow2_free_map_invalidate().
+ */
+static void free_map_update(BDRVQcow2State *s, uint64_t cluster_index,
+                            uint64_t nb_clusters, bool free)
+{
+    if (cluster_index >= s->free_map_end) {
+        return;
+    }
+
+    nb_clusters = MIN(nb_clusters, s->free_map_end - cluster_index);
+    if (free) {
+        hbitmap_set(s->free_map, cluster_index, nb_clusters);
+    } else {
+        hbitmap_reset(s->free_map, cluster_index, nb_clusters);
+    }
+}
+
+/* Forget about all free clusters, for when the refcounts have been changed
+ * behind the back of update_refcount() */
+void qcow2_free_map_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_map) {
+        hbitmap_reset_all(s->free_map);
+        s->free_map_end = s->free_cluster_index;
+    }
+}
+
+/* Fill the free cluster map from the refcount blocks up to at least @end */
+static int free_map_extend(BlockDriverState *bs, uint64_t end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t index, refcount_table_index, block_index, i;
+    int64_t refcount_block_offset;
+    void *refcount_block;
+    int ret;
+
+    end = ROUND_UP(end, s->refcount_block_size);
+
+    if (!s->free_map) {
+        s->free_map_size = end;
+        s->free_map = hbitmap_alloc(s->free_map_size, 0);
+        s->free_map_end = s->free_cluster_index;
+    } else if (end > s->free_map_size) {
+        s->free_map_size = MAX(end, 2 * s->free_map_size);
+        hbitmap_truncate(s->free_map, s->free_map_size);
+    }
+
+    while (s->free_map_end < end) {
+        index = s->free_map_end;
+        refcount_table_index = index >> s->refcount_block_bits;
+        block_index = index & (s->refcount_block_size - 1);
+
+        refcount_block_offset = 0;
+        if (refcount_table_index < s->refcount_table_size) {
+            refcount_block_offset =
+                s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+        }
+
+        if (!refcount_block_offset) {
+            hbitmap_set(s->free_map, index,
+                        s->refcount_block_size - block_index);
+        } else {
+            if (offset_into_cluster(s, refcount_block_offset)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                        PRIx64 " unaligned (reftable index: %#"
+                                        PRIx64 ")", refcount_block_offset,
+                                        refcount_table_index);
+                return -EIO;
+            }
+
+            ret = qcow2_cache_get(bs, s->refcount_block_cache,
+                                  refcount_block_offset, &refcount_block);
+            if (ret < 0) {
+                return ret;
+            }
+            for (i = block_index; i < s->refcount_block_size; i++) {
+                if (s->get_refcount(refcount_block, i) == 0) {
+                    hbitmap_set(s->free_map, index + i - block_index, 1);
+                }
+            }
+            qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+        }
+
+        s->free_map_end = index + s->refcount_block_size - block_index;
+    }
+
+    return 0;
+}
+
+/* Put clusters back into the free cluster map if they were returned by
+ * alloc_clusters_noref() but their refcount couldn't be increased */
+static void free_map_return(BlockDriverState *bs, int64_t offset, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_index = offset >> s->cluster_bits;
+    uint64_t nb_clusters = size_to_clusters(s, size);
+    uint64_t i, refcount;
+
+    for (i = 0; i < nb_clusters; i++) {
+        if (qcow2_get_refcount(bs, cluster_index + i, &refcount) == 0 &&
+            refcount == 0)
+        {
+            free_map_update(s, cluster_index + i, 1, true);
+            if (cluster_index + i < s->free_cluster_index) {
+                s->free_cluster_index = cluster_index + i;
+            }
+        }
+    }
+}
+
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters, start, n;
+    uint64_t first_free = UINT64_MAX;
+    int64_t next;
+    HBitmapIter hbi;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -830,32 +963,66 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
+    if (nb_clusters == 0) {
+        return s->free_cluster_index << s->cluster_bits;
+    }
 
-        if (ret < 0) {
-            return ret;
-        } else if (refcount != 0) {
-            goto retry;
+    /* Find the first run of nb_clusters free clusters */
+    start = s->free_cluster_index;
+    for (;;) {
+        /* Make sure that all offsets in the "allocated" range are
+         * representable in an int64_t */
+        if (start + nb_clusters - 1 > (INT64_MAX >> s->cluster_bits)) {
+            return -EFBIG;
+        }
+
+        if (s->free_map_end < start + nb_clusters) {
+            ret = free_map_extend(bs, start + nb_clusters);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        hbitmap_iter_init(&hbi, s->free_map, start);
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0) {
+            start = s->free_map_end;
+            continue;
+        }
+        if (first_free == UINT64_MAX) {
+            first_free = next;
+        }
+
+        for (n = 1; n < nb_clusters && next + n < s->free_map_end; n++) {
+            if (!hbitmap_get(s->free_map, next + n)) {
+                break;
+            }
+        }
+        if (n == nb_clusters) {
+            break;
+        } else if (next + n == s->free_map_end) {
+            /* The run may continue beyond what we know so far */
+            start = next;
+        } else {
+            start = next + n + 1;
         }
     }
 
-    /* Make sure that all offsets in the "allocated" range are representable
-     * in an int64_t */
-    if (s->free_cluster_index > 0 &&
-        s->free_cluster_index - 1 > (INT64_MAX >> s->cluster_bits))
-    {
-        return -EFBIG;
+    hbitmap_reset(s->free_map, next, nb_clusters);
+
+    /* Smaller holes that were skipped remain available for later
+     * allocations */
+    if (first_free == next) {
+        s->free_cluster_index = next + nb_clusters;
+    } else {
+        s->free_cluster_index = first_free;
     }
 
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, next << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return next << s->cluster_bits;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
@@ -871,6 +1038,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
         }
 
         ret = update_refcount(bs, offset, size, 1, false, QCOW2_DISCARD_NEVER);
+        if (ret == -EAGAIN) {
+            free_map_return(bs, offset, size);
+        }
     } while (ret == -EAGAIN);
 
     if (ret < 0) {
@@ -1043,20 +1213,157 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 
 
 
+/*
+ * Adds @addend to the refcount of every data cluster referenced by the L2
+ * table at @l2_offset, and updates QCOW_OFLAG_COPIED in its entries.
+ */
+int qcow2_update_l2_refcounts(BlockDriverState *bs, uint64_t l2_offset,
+                              int64_t addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table, offset, old_offset, refcount;
+    uint64_t count = addend < 0 ? -addend : addend;
+    int64_t run_offset, run_length;
+    int j, nb_csectors, ret;
+
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+                          (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Adjacent data clusters have their refcounts increased with a
+     * single update_refcount() call, which keeps the refcount block
+     * at hand instead of looking it up for every cluster. */
+    run_offset = run_length = 0;
+
+    for (j = 0; j < s->l2_size; j++) {
+        uint64_t cluster_index;
+
+        offset = get_l2_entry(s, l2_table, j);
+        old_offset = offset;
+        offset &= ~QCOW_OFLAG_COPIED;
+
+        switch (qcow2_get_cluster_type(offset)) {
+        case QCOW2_CLUSTER_COMPRESSED:
+            nb_csectors = ((offset >> s->csize_shift) &
+                           s->csize_mask) + 1;
+            if (addend != 0) {
+                ret = update_refcount(bs,
+                    (offset & s->cluster_offset_mask) & ~511,
+                    nb_csectors * 512, count, addend < 0,
+                    QCOW2_DISCARD_SNAPSHOT);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            /* compressed clusters are never modified */
+            refcount = 2;
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_CLUSTER_ZERO:
+            if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Data "
+                                        "cluster offset %#llx "
+                                        "unaligned (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)",
+                                        offset & L2E_OFFSET_MASK,
+                                        l2_offset, j);
+                ret = -EIO;
+                goto fail;
+            }
+
+            cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+            if (!cluster_index) {
+                /* unallocated */
+                refcount = 0;
+                break;
+            }
+            if (addend > 0) {
+                /* the L2 entry is referenced at least twice now,
+                 * so QCOW_OFLAG_COPIED can be cleared right away */
+                if (run_offset + run_length !=
+                    (offset & L2E_OFFSET_MASK))
+                {
+                    ret = update_refcount(bs, run_offset,
+                                          run_length, addend,
+                                          false,
+                                          QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                    run_offset = offset & L2E_OFFSET_MASK;
+                    run_length = 0;
+                }
+                run_length += s->cluster_size;
+                refcount = 2;
+                break;
+            }
+            if (addend != 0) {
+                ret = qcow2_update_cluster_refcount(bs,
+                        cluster_index, count, addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+
+            ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+            if (ret < 0) {
+                goto fail;
+            }
+            break;
+
+        case QCOW2_CLUSTER_UNALLOCATED:
+            refcount = 0;
+            break;
+
+        default:
+            abort();
+        }
+
+        if (refcount == 1) {
+            offset |= QCOW_OFLAG_COPIED;
+        }
+        if (offset != old_offset) {
+            if (addend > 0) {
+                qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                    s->refcount_block_cache);
+            }
+            set_l2_entry(s, l2_table, j, offset);
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                         l2_table);
+        }
+    }
+
+    if (addend > 0) {
+        ret = update_refcount(bs, run_offset, run_length, addend, false,
+                              QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = 0;
+fail:
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
-    bool l1_allocated = false;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors;
+    uint64_t *l1_table, l2_offset, l1_size2, refcount;
+    bool l1_allocated = false, update_data;
+    int64_t old_l2_offset;
+    int i, l1_modified = 0;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1100,94 +1407,29 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
-
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
+            if (addend != 0 &&
+                (s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2))
+            {
+                /* An L2 table holds a single reference to its data clusters,
+                 * however many L1 tables point to it; that reference goes
+                 * away with the last of them */
+                ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                                         &refcount);
+                if (ret < 0) {
+                    goto fail;
                 }
+                update_data = addend < 0 && refcount == 1;
+            } else {
+                update_data = true;
+            }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
-                    }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
+            if (update_data) {
+                ret = qcow2_update_l2_refcounts(bs, l2_offset, addend);
+                if (ret < 0) {
+                    goto fail;
                 }
             }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
                                                         s->cluster_bits,
@@ -1213,10 +1455,6 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
@@ -1238,6 +1476,102 @@ fail:
     return ret;
 }
 
+/*
+ * Converts an image with QCOW2_INCOMPAT_SHARED_L2 back to the usual refcount
+ * scheme: the data clusters of every L2 table that is referenced by several
+ * L1 tables get one reference for each of them.  Afterwards the feature bit
+ * is cleared.
+ */
+int qcow2_unshare_l2_refcounts(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GHashTable *visited;
+    uint64_t *l1_table = NULL;
+    int i, j, ret = 0;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2)) {
+        return 0;
+    }
+
+    visited = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                    NULL);
+
+    /* The active L1 table (i = -1) and those of all snapshots */
+    for (i = -1; i < (int)s->nb_snapshots; i++) {
+        int l1_size;
+
+        if (i < 0) {
+            l1_table = s->l1_table;
+            l1_size = s->l1_size;
+        } else {
+            QCowSnapshot *sn = &s->snapshots[i];
+
+            l1_size = sn->l1_size;
+            l1_table = g_try_new(uint64_t, l1_size);
+            if (l1_size && l1_table == NULL) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+            ret = bdrv_pread(bs->file->bs, sn->l1_table_offset, l1_table,
+                             l1_size * sizeof(uint64_t));
+            if (ret < 0) {
+                goto fail;
+            }
+            for (j = 0; j < l1_size; j++) {
+                be64_to_cpus(&l1_table[j]);
+            }
+        }
+
+        for (j = 0; j < l1_size; j++) {
+            uint64_t l2_offset = l1_table[j] & L1E_OFFSET_MASK;
+            uint64_t refcount, *key;
+
+            if (!l2_offset || g_hash_table_lookup(visited, &l2_offset)) {
+                continue;
+            }
+            key = g_new(uint64_t, 1);
+            *key = l2_offset;
+            g_hash_table_insert(visited, key, key);
+
+            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
+                goto fail;
+            }
+            if (refcount > 1) {
+                ret = qcow2_update_l2_refcounts(bs, l2_offset, refcount - 1);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+        }
+
+        if (i >= 0) {
+            g_free(l1_table);
+        }
+        l1_table = NULL;
+    }
+
+    /* The new refcounts must be on disk before the bit goes away */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->incompatible_features &= ~QCOW2_INCOMPAT_SHARED_L2;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->incompatible_features |= QCOW2_INCOMPAT_SHARED_L2;
+    }
+
+fail:
+    if (l1_table != s->l1_table) {
+        g_free(l1_table);
+    }
+    g_hash_table_destroy(visited);
+    return ret;
+}
+
 
 
 
@@ -1314,11 +1648,11 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs,
+                             BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1379,13 +1713,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table, l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
+    int i, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
+    l2_table = g_malloc(s->cluster_size);
 
-    ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, l2_size);
+    ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, s->cluster_size);
     if (ret < 0) {
         fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
@@ -1394,7 +1727,24 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+            bool compressed = l2_entry & QCOW_OFLAG_COMPRESSED;
+
+            if ((l2_bitmap & (l2_bitmap >> 32)) ||
+                (compressed && l2_bitmap) ||
+                (!compressed && (l2_entry & QCOW_OFLAG_ZERO)) ||
+                (!compressed && !(l2_entry & L2E_OFFSET_MASK) &&
+                 (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)))
+            {
+                fprintf(stderr, "ERROR: L2 entry %#" PRIx64 " (bitmap %#"
+                        PRIx64 "): invalid extended L2 entry\n",
+                        l2_entry, l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1411,8 +1761,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
                 goto fail;
             }
@@ -1450,8 +1801,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1503,8 +1855,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res,
+                                   refcount_table, refcount_table_size,
+                                   l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1533,8 +1886,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_offset, s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1546,6 +1900,14 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            /* A shared L2 table references its data clusters only once */
+            if ((s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2) &&
+                s->get_refcount(*refcount_table,
+                                l2_offset >> s->cluster_bits) > 1)
+            {
+                continue;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
                                      refcount_table_size, l2_offset, flags);
@@ -1615,8 +1977,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file->bs, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1625,7 +1986,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1645,9 +2006,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1749,14 +2110,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res,
+                                               refcount_table, nb_clusters,
+                                               offset, s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1771,8 +2133,8 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1812,8 +2174,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   0, s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1834,16 +2196,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
     if (ret < 0) {
         return ret;
     }
@@ -2177,6 +2545,7 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_free_map_invalidate(bs);
 
     return 0;
 
@@ -2888,6 +3257,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     s->get_refcount = new_get_refcount;
     s->set_refcount = new_set_refcount;
 
+    qcow2_free_map_invalidate(bs);
+
     /* For cleaning up all old refblocks and the old reftable below the "done"
      * label */
     new_reftable        = old_reftable;
@@ -406,6 +406,28 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     g_free(l1_table);
     l1_table = NULL;
 
+    /*
+     * With lazy snapshot refcounts, the first snapshot switches the image to
+     * shared L2 tables, whose data clusters are only referenced once.  The
+     * snapshot then costs one refcount update per L2 table, and the data
+     * clusters of a table get their second reference when the table is
+     * copied on the next write.
+     */
+    if ((s->compatible_features & QCOW2_COMPAT_LAZY_SNAPSHOTS) &&
+        !(s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2) &&
+        s->nb_snapshots == 0)
+    {
+        s->incompatible_features |= QCOW2_INCOMPAT_SHARED_L2;
+        ret = qcow2_update_header(bs);
+        if (ret == 0) {
+            ret = bdrv_flush(bs->file->bs);
+        }
+        if (ret < 0) {
+            s->incompatible_features &= ~QCOW2_INCOMPAT_SHARED_L2;
+            goto fail;
+        }
+    }
+
     /*
      * Increase the refcounts of all clusters and make sure everything is
      * stable on disk before updating the snapshot table to contain a pointer
@@ -641,6 +663,20 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
         return ret;
     }
 
+    /* Without snapshots no L2 table is shared, and both refcount schemes
+     * agree */
+    if ((s->incompatible_features & QCOW2_INCOMPAT_SHARED_L2) &&
+        s->nb_snapshots == 0)
+    {
+        s->incompatible_features &= ~QCOW2_INCOMPAT_SHARED_L2;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            s->incompatible_features |= QCOW2_INCOMPAT_SHARED_L2;
+            error_setg_errno(errp, -ret, "Failed to update the image header");
+            return ret;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
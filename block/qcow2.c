@@ -36,6 +36,7 @@
 #include "qapi-event.h"
 #include "trace.h"
 #include "qemu/option_int.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -62,6 +63,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -91,6 +93,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     QCowExtension ext;
     uint64_t offset;
     int ret;
+    Qcow2BitmapHeaderExt bitmaps_ext;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -161,6 +164,70 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* The image was written by a program that does not know
+                 * about bitmaps, so they may be out of date */
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent. Some clusters may be "
+                             "leaked, run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file->bs, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid number of "
+                           "bitmaps: %" PRIu32, bitmaps_ext.nb_bitmaps);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size == 0 ||
+                bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid bitmap "
+                           "directory size (%" PRIu64 ")",
+                           bitmaps_ext.bitmap_directory_size);
+                return -EINVAL;
+            }
+
+            if (offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -829,6 +896,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t autoclear_features;
 
     ret = bdrv_pread(bs->file->bs, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -982,8 +1050,24 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        /* Each L2 entry takes 128 bits */
+        s->l2_bits = s->cluster_bits - 4;
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+        s->subclusters_per_cluster = 1;
+    }
     s->l2_size = 1 << s->l2_bits;
+    s->subcluster_bits = s->cluster_bits - ctz32(s->subclusters_per_cluster);
+    s->subcluster_size = 1 << s->subcluster_bits;
+    s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
     s->refcount_block_size = 1 << s->refcount_block_bits;
@@ -1141,9 +1225,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if there is
+     * no valid bitmaps extension */
+    autoclear_features = s->autoclear_features & QCOW2_AUTOCLEAR_MASK;
+    if (s->nb_bitmaps == 0) {
+        autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        s->autoclear_features != autoclear_features) {
+        s->autoclear_features = autoclear_features;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1166,6 +1256,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Persistent dirty bitmaps */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE))) {
+        ret = qcow2_load_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1198,20 +1297,20 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
 
-    bs->bl.write_zeroes_alignment = s->cluster_sectors;
+    bs->bl.write_zeroes_alignment = s->subcluster_sectors;
 }
 
 static int qcow2_set_key(BlockDriverState *bs, const char *key)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint8_t keybuf[16];
+    uint8_t keybuf[QCOW2_CRYPT_KEY_SIZE];
     int len, i;
     Error *err = NULL;
 
-    memset(keybuf, 0, 16);
+    memset(keybuf, 0, QCOW2_CRYPT_KEY_SIZE);
     len = strlen(key);
-    if (len > 16)
-        len = 16;
+    if (len > QCOW2_CRYPT_KEY_SIZE)
+        len = QCOW2_CRYPT_KEY_SIZE;
     /* XXX: we could compress the chars to 7 bits to increase
        entropy */
     for(i = 0;i < len;i++) {
@@ -1233,6 +1332,7 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
         error_free(err);
         return -1;
     }
+    memcpy(s->crypt_key, keybuf, QCOW2_CRYPT_KEY_SIZE);
     return 0;
 }
 
@@ -1262,6 +1362,16 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         if (ret < 0) {
             goto fail;
         }
+
+        /* Nothing can change the bitmaps in the image once it is
+         * read-only, so they must be stored now */
+        if (!state->bs->read_only &&
+            !(state->bs->open_flags & (BDRV_O_CHECK | BDRV_O_INACTIVE))) {
+            ret = qcow2_store_persistent_dirty_bitmaps(state->bs, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
     }
 
     return 0;
@@ -1274,14 +1384,29 @@ fail:
 
 static void qcow2_reopen_commit(BDRVReopenState *state)
 {
+    BDRVQcow2State *s = state->bs->opaque;
+
     qcow2_update_options_commit(state->bs, state->opaque);
     g_free(state->opaque);
+
+    /* Bitmaps that were loaded read-only are tracking writes from now on */
+    if (state->bs->read_only && (state->flags & BDRV_O_RDWR) &&
+        s->nb_bitmaps) {
+        s->bitmaps_need_in_use = true;
+    }
 }
 
 static void qcow2_reopen_abort(BDRVReopenState *state)
 {
+    BDRVQcow2State *s = state->bs->opaque;
+
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
+
+    /* qcow2_reopen_prepare() may have stored the bitmaps already */
+    if (!state->bs->read_only && s->nb_bitmaps) {
+        s->bitmaps_need_in_use = true;
+    }
 }
 
 static void qcow2_join_options(QDict *options, QDict *old_options)
@@ -1478,9 +1603,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                  */
                 if (!cluster_data) {
                     cluster_data =
-                        qemu_try_blockalign(bs->file->bs,
-                                            QCOW_MAX_CRYPT_CLUSTERS
-                                            * s->cluster_size);
+                        qemu_try_blockalign_pooled(bs->file->bs,
+                                                   QCOW_MAX_CRYPT_CLUSTERS
+                                                   * s->cluster_size);
                     if (cluster_data == NULL) {
                         ret = -ENOMEM;
                         goto fail;
@@ -1505,12 +1630,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
             if (bs->encrypted) {
                 assert(s->cipher);
-                Error *err = NULL;
-                if (qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                                          cluster_data, cur_nr_sectors, false,
-                                          &err) < 0) {
-                    error_free(err);
-                    ret = -EIO;
+                qemu_co_mutex_unlock(&s->lock);
+                ret = qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                               cur_nr_sectors, false);
+                qemu_co_mutex_lock(&s->lock);
+                if (ret < 0) {
                     goto fail;
                 }
                 qemu_iovec_from_buf(qiov, bytes_done,
@@ -1534,11 +1658,63 @@ fail:
     qemu_co_mutex_unlock(&s->lock);
 
     qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+    qemu_vfree_pooled(bs->file->bs, cluster_data,
+                      QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
 
     return ret;
 }
 
+/*
+ * Returns true if the COW regions of @m can be written together with the
+ * guest data at host offset @data_offset, i.e. if the request consists of
+ * this single allocation and the guest data fills exactly the space between
+ * the two regions.
+ */
+static bool qcow2_can_merge_cow(BlockDriverState *bs, QCowL2Meta *m,
+                                uint64_t data_offset, int nb_sectors)
+{
+    if (bs->encrypted || !m || m->next || m->nb_clusters == 0) {
+        return false;
+    }
+    if (m->cow_start.nb_sectors == 0 && m->cow_end.nb_sectors == 0) {
+        return false;
+    }
+
+    return m->alloc_offset + m->cow_start.offset
+           + m->cow_start.nb_sectors * BDRV_SECTOR_SIZE == data_offset &&
+           m->alloc_offset + m->cow_end.offset ==
+           data_offset + nb_sectors * BDRV_SECTOR_SIZE;
+}
+
+/* Read the guest data of a COW region into @buf.  Must be called without
+ * s->lock held. */
+static int coroutine_fn qcow2_read_cow_region(BlockDriverState *bs,
+                                              QCowL2Meta *m,
+                                              Qcow2COWRegion *r, void *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    if (r->nb_sectors == 0) {
+        return 0;
+    }
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = r->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+
+    /* As in copy_sectors(), bypass the block layer to avoid deadlocks with
+     * copy-on-read */
+    return bs->drv->bdrv_co_readv(bs,
+                                  (m->offset + r->offset) >> BDRV_SECTOR_BITS,
+                                  r->nb_sectors, &qiov);
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -1550,19 +1726,28 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     int cur_nr_sectors; /* number of sectors in current iteration */
     uint64_t cluster_offset;
     QEMUIOVector hd_qiov;
+    QEMUIOVector cow_qiov;
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
+    uint8_t *cow_buffer = NULL;
     QCowL2Meta *l2meta = NULL;
+    bool merge_cow;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
+    qemu_iovec_init(&cow_qiov, qiov->niov + 2);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
     qemu_co_mutex_lock(&s->lock);
 
+    ret = qcow2_mark_bitmaps_in_use(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1590,12 +1775,12 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             cur_nr_sectors * 512);
 
         if (bs->encrypted) {
-            Error *err = NULL;
             assert(s->cipher);
             if (!cluster_data) {
-                cluster_data = qemu_try_blockalign(bs->file->bs,
-                                                   QCOW_MAX_CRYPT_CLUSTERS
-                                                   * s->cluster_size);
+                cluster_data =
+                    qemu_try_blockalign_pooled(bs->file->bs,
+                                               QCOW_MAX_CRYPT_CLUSTERS
+                                               * s->cluster_size);
                 if (cluster_data == NULL) {
                     ret = -ENOMEM;
                     goto fail;
@@ -1606,11 +1791,13 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            if (qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                                      cluster_data, cur_nr_sectors,
-                                      true, &err) < 0) {
-                error_free(err);
-                ret = -EIO;
+            /* The clusters are allocated but not linked yet, so dropping
+             * the lock here is no different from doing it for the write */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                           cur_nr_sectors, true);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
                 goto fail;
             }
 
@@ -1619,24 +1806,80 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0,
+        /*
+         * If the data goes to newly allocated clusters, write their COW
+         * regions along with it.  This saves two writes, and the allocation
+         * doesn't have to take s->lock again for each region, which
+         * serialises concurrent allocating writes.
+         */
+        merge_cow = qcow2_can_merge_cow(bs, l2meta,
                 cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
-                cur_nr_sectors * BDRV_SECTOR_SIZE);
+                cur_nr_sectors);
+        if (merge_cow) {
+            ret = qcow2_pre_write_overlap_check(bs, 0, l2meta->alloc_offset,
+                    (uint64_t) l2meta->nb_clusters << s->cluster_bits);
+        } else {
+            ret = qcow2_pre_write_overlap_check(bs, 0,
+                    cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                    cur_nr_sectors * BDRV_SECTOR_SIZE);
+        }
         if (ret < 0) {
             goto fail;
         }
 
+        if (merge_cow && !cow_buffer) {
+            /* Each region is shorter than a cluster */
+            cow_buffer = qemu_try_blockalign_pooled(bs->file->bs,
+                                                    2 * s->cluster_size);
+            if (cow_buffer == NULL) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+        }
+
         qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file->bs,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
+        if (merge_cow) {
+            uint8_t *end_buffer = cow_buffer + s->cluster_size;
+
+            ret = qcow2_read_cow_region(bs, l2meta, &l2meta->cow_start,
+                                        cow_buffer);
+            if (ret >= 0) {
+                ret = qcow2_read_cow_region(bs, l2meta, &l2meta->cow_end,
+                                            end_buffer);
+            }
+            if (ret < 0) {
+                qemu_co_mutex_lock(&s->lock);
+                goto fail;
+            }
+
+            qemu_iovec_reset(&cow_qiov);
+            qemu_iovec_add(&cow_qiov, cow_buffer,
+                           l2meta->cow_start.nb_sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_concat(&cow_qiov, &hd_qiov, 0, hd_qiov.size);
+            qemu_iovec_add(&cow_qiov, end_buffer,
+                           l2meta->cow_end.nb_sectors * BDRV_SECTOR_SIZE);
+
+            BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                    (l2meta->alloc_offset + l2meta->cow_start.offset) >> 9);
+            ret = bdrv_co_writev(bs->file->bs,
+                    (l2meta->alloc_offset + l2meta->cow_start.offset) >> 9,
+                    cow_qiov.size >> BDRV_SECTOR_BITS, &cow_qiov);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    (cluster_offset >> 9) + index_in_cluster);
+            ret = bdrv_co_writev(bs->file->bs,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 cur_nr_sectors, &hd_qiov);
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
+        if (merge_cow) {
+            l2meta->skip_cow = true;
+        }
 
         while (l2meta != NULL) {
             QCowL2Meta *next;
@@ -1682,7 +1925,10 @@ fail:
     }
 
     qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+    qemu_iovec_destroy(&cow_qiov);
+    qemu_vfree_pooled(bs->file->bs, cluster_data,
+                      QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+    qemu_vfree_pooled(bs->file->bs, cow_buffer, 2 * s->cluster_size);
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
 
     return ret;
@@ -1692,6 +1938,17 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    if (!bs->read_only && !(s->flags & BDRV_O_CHECK)) {
+        ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            result = ret;
+            error_reportf_err(local_err, "Lost persistent bitmaps during "
+                              "inactivation of node '%s': ",
+                              bdrv_get_device_or_node_name(bs));
+        }
+    }
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1923,11 +2180,31 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_SHARED_L2_BITNR,
+                .name = "shared L2 tables",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_COMPATIBLE,
+                .bit  = QCOW2_COMPAT_LAZY_SNAPSHOTS_BITNR,
+                .name = "lazy snapshots",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1939,6 +2216,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->qcow_version >= 3 && s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2114,6 +2410,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         uint64_t nreftablee, nrefblocke, nl1e, nl2e;
         int64_t aligned_total_size = align_offset(total_size, cluster_size);
         int refblock_bits, refblock_size;
+        /* L2 entry size in bytes */
+        size_t l2es = (flags & BLOCK_FLAG_EXTL2) ? 2 * sizeof(uint64_t)
+                                                 : sizeof(uint64_t);
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
 
@@ -2126,11 +2425,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2209,6 +2508,14 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         header->compatible_features |=
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
+    if (flags & BLOCK_FLAG_LAZY_SNAPSHOTS) {
+        header->compatible_features |=
+            cpu_to_be64(QCOW2_COMPAT_LAZY_SNAPSHOTS);
+    }
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
 
     ret = blk_pwrite(blk, 0, header, cluster_size);
     g_free(header);
@@ -2368,6 +2675,12 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     if (qemu_opt_get_bool_del(opts, BLOCK_OPT_LAZY_REFCOUNTS, false)) {
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_LAZY_SNAPSHOTS, false)) {
+        flags |= BLOCK_FLAG_LAZY_SNAPSHOTS;
+    }
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTL2;
+    }
 
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
@@ -2383,6 +2696,29 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_LAZY_SNAPSHOTS)) {
+        error_setg(errp, "Lazy snapshots only supported with compatibility "
+                   "level 1.1 and above (use compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (version < 3 && (flags & BLOCK_FLAG_EXTL2)) {
+        error_setg(errp, "Extended L2 entries only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if ((flags & BLOCK_FLAG_EXTL2) &&
+        cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+        error_setg(errp, "Extended L2 entries require a cluster size of at "
+                   "least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2423,14 +2759,18 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
 
     /* Emulate misaligned zero writes */
-    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
+    if (sector_num % s->subcluster_sectors ||
+        nb_sectors % s->subcluster_sectors) {
         return -ENOTSUP;
     }
 
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+    ret = qcow2_mark_bitmaps_in_use(bs);
+    if (ret == 0) {
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -2443,8 +2783,11 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors, QCOW2_DISCARD_REQUEST, false);
+    ret = qcow2_mark_bitmaps_in_use(bs);
+    if (ret == 0) {
+        ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors, QCOW2_DISCARD_REQUEST, false);
+    }
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -2472,6 +2815,12 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     }
 
+    /* the bitmaps are resized too */
+    ret = qcow2_mark_bitmaps_in_use(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     new_l1_size = size_to_l1(s, offset);
     ret = qcow2_grow_l1_table(bs, new_l1_size, true);
     if (ret < 0) {
@@ -2490,16 +2839,135 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/* Maximum number of clusters that are compressed in parallel */
+#define QCOW2_COMPRESS_BATCH 64
+
+typedef struct Qcow2CompressBatch {
+    int in_flight;
+    Coroutine *co;
+} Qcow2CompressBatch;
+
+typedef struct Qcow2CompressJob {
+    Qcow2CompressBatch *batch;
+    const uint8_t *src;
+    uint8_t *dest;
+    int size;
+
+    /* Compressed length, -ENOSPC if the data doesn't compress or -errno */
+    int ret;
+} Qcow2CompressJob;
+
+/* Compress one cluster.  Runs in a worker thread, so it must not touch any
+ * state but the job. */
+static int qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = job->size;
+    strm.next_in = (uint8_t *)job->src;
+    strm.avail_out = job->size;
+    strm.next_out = job->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - job->dest;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || out_len >= job->size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+static void qcow2_compress_complete(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+    Qcow2CompressBatch *batch = job->batch;
+
+    job->ret = ret;
+    if (--batch->in_flight == 0 && batch->co) {
+        qemu_coroutine_enter(batch->co, NULL);
+    }
+}
+
+static void qcow2_compress_wait(BlockDriverState *bs, Qcow2CompressBatch *batch)
+{
+    if (qemu_in_coroutine()) {
+        batch->co = qemu_coroutine_self();
+        while (batch->in_flight > 0) {
+            qemu_coroutine_yield();
+        }
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        while (batch->in_flight > 0) {
+            aio_poll(aio_context, true);
+        }
+    }
+}
+
+static int qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          Qcow2CompressJob *job)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->ret == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, job->src, s->cluster_sectors);
+    } else if (job->ret < 0) {
+        return job->ret;
+    }
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, job->ret);
+    if (!cluster_offset) {
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, job->ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file->bs, cluster_offset, job->dest, job->ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressBatch batch;
+    Qcow2CompressJob *jobs;
     uint8_t *out_buf;
     uint64_t cluster_offset;
+    int nb_clusters, n, i;
+    int ret = 0;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2508,79 +2976,77 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return bdrv_truncate(bs->file->bs, cluster_offset);
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
-
-        /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
-        }
+    ret = qcow2_mark_bitmaps_in_use(bs);
+    if (ret < 0) {
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    if (nb_sectors % s->cluster_sectors) {
+        int aligned = QEMU_ALIGN_DOWN(nb_sectors, s->cluster_sectors);
+        uint8_t *pad_buf;
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+        /* Only the last write may end in the middle of a cluster, if the
+         * image size is not cluster aligned; zero-pad it */
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
+        }
+        if (aligned) {
+            ret = qcow2_write_compressed(bs, sector_num, buf, aligned);
+            if (ret < 0) {
+                return ret;
+            }
+        }
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+        pad_buf = qemu_blockalign(bs, s->cluster_size);
+        memset(pad_buf, 0, s->cluster_size);
+        memcpy(pad_buf, buf + aligned * BDRV_SECTOR_SIZE,
+               (nb_sectors - aligned) * BDRV_SECTOR_SIZE);
+        ret = qcow2_write_compressed(bs, sector_num + aligned,
+                                     pad_buf, s->cluster_sectors);
+        qemu_vfree(pad_buf);
+        return ret;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+    /* Compress up to QCOW2_COMPRESS_BATCH clusters at a time in the thread
+     * pool, then write them out in order so that the image layout stays the
+     * same as with sequential compression. */
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    n = MIN(nb_clusters, QCOW2_COMPRESS_BATCH);
+    jobs = g_new(Qcow2CompressJob, n);
+    out_buf = g_malloc((size_t) n * s->cluster_size);
+
+    while (nb_clusters > 0) {
+        n = MIN(nb_clusters, QCOW2_COMPRESS_BATCH);
+
+        batch = (Qcow2CompressBatch) { .in_flight = n };
+        for (i = 0; i < n; i++) {
+            jobs[i] = (Qcow2CompressJob) {
+                .batch  = &batch,
+                .src    = buf + (size_t) i * s->cluster_size,
+                .dest   = out_buf + (size_t) i * s->cluster_size,
+                .size   = s->cluster_size,
+            };
+            thread_pool_submit_aio(pool, qcow2_compress_worker, &jobs[i],
+                                   qcow2_compress_complete, &jobs[i]);
         }
-        cluster_offset &= s->cluster_offset_mask;
+        qcow2_compress_wait(bs, &batch);
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
+        for (i = 0; i < n; i++) {
+            ret = qcow2_write_compressed_cluster(bs, sector_num, &jobs[i]);
+            if (ret < 0) {
+                goto fail;
+            }
+            sector_num += s->cluster_sectors;
         }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+        buf += (size_t) n * s->cluster_size;
+        nb_clusters -= n;
     }
 
     ret = 0;
 fail:
     g_free(out_buf);
+    g_free(jobs);
     return ret;
 }
 
@@ -2694,6 +3160,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_free_map_invalidate(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -2830,6 +3297,12 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .corrupt            = s->incompatible_features &
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
+            .lazy_snapshots     = s->compatible_features &
+                                  QCOW2_COMPAT_LAZY_SNAPSHOTS,
+            .has_lazy_snapshots = s->compatible_features &
+                                  QCOW2_COMPAT_LAZY_SNAPSHOTS,
             .refcount_bits      = s->refcount_bits,
         };
     } else {
@@ -2922,6 +3395,16 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps || bdrv_has_persistent_dirty_bitmaps(bs)) {
+        error_report("Cannot downgrade an image with persistent bitmaps");
+        return -ENOTSUP;
+    }
+
+    if (has_subclusters(s)) {
+        error_report("Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2930,6 +3413,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         }
     }
 
+    ret = qcow2_unshare_l2_refcounts(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* with QCOW2_INCOMPAT_CORRUPT, it is pretty much impossible to get here in
      * the first place; if that happens nonetheless, returning -ENOTSUP is the
      * best thing to do anyway */
@@ -3039,6 +3527,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     uint64_t new_size = 0;
     const char *backing_file = NULL, *backing_format = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
+    bool lazy_snapshots = s->compatible_features & QCOW2_COMPAT_LAZY_SNAPSHOTS;
     const char *compat = NULL;
     uint64_t cluster_size = s->cluster_size;
     bool encrypt;
@@ -3090,9 +3579,19 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 error_report("Changing the cluster size is not supported");
                 return -ENOTSUP;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s))
+                != has_subclusters(s))
+            {
+                error_report("Changing extended L2 entries is not supported");
+                return -ENOTSUP;
+            }
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
+        } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_SNAPSHOTS)) {
+            lazy_snapshots = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_SNAPSHOTS,
+                                               lazy_snapshots);
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             refcount_bits = qemu_opt_get_number(opts, BLOCK_OPT_REFCOUNT_BITS,
                                                 refcount_bits);
@@ -3191,6 +3690,33 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    if (!(s->compatible_features & QCOW2_COMPAT_LAZY_SNAPSHOTS) !=
+        !lazy_snapshots)
+    {
+        uint64_t old_features = s->compatible_features;
+
+        if (lazy_snapshots) {
+            if (new_version < 3) {
+                error_report("Lazy snapshots only supported with compatibility "
+                             "level 1.1 and above (use compat=1.1 or greater)");
+                return -EINVAL;
+            }
+            s->compatible_features |= QCOW2_COMPAT_LAZY_SNAPSHOTS;
+        } else {
+            /* existing snapshots must get their references first */
+            ret = qcow2_unshare_l2_refcounts(bs);
+            if (ret < 0) {
+                return ret;
+            }
+            s->compatible_features &= ~QCOW2_COMPAT_LAZY_SNAPSHOTS;
+        }
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            s->compatible_features = old_features;
+            return ret;
+        }
+    }
+
     if (new_size) {
         ret = bdrv_truncate(bs, new_size);
         if (ret < 0) {
@@ -3309,6 +3835,17 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Postpone refcount updates",
             .def_value_str = "off"
         },
+        {
+            .name = BLOCK_OPT_LAZY_SNAPSHOTS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Postpone data cluster refcount updates of snapshots",
+        },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Split clusters into 32 subclusters that are allocated "
+                    "separately",
+        },
         {
             .name = BLOCK_OPT_REFCOUNT_BITS,
             .type = QEMU_OPT_NUMBER,
@@ -3368,6 +3905,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_detach_aio_context  = qcow2_detach_aio_context,
     .bdrv_attach_aio_context  = qcow2_attach_aio_context,
+
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
 };
 
 static void bdrv_qcow2_init(void)
@@ -27,6 +27,7 @@
 
 #include "crypto/cipher.h"
 #include "qemu/coroutine.h"
+#include "qemu/hbitmap.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -38,6 +39,11 @@
 #define QCOW_CRYPT_AES  1
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
+#define QCOW2_CRYPT_KEY_SIZE 16
+
+/* Requests of at least this size are encrypted by the thread pool, in
+ * chunks of this size */
+#define QCOW2_CRYPT_OFFLOAD_SECTORS 128
 #define QCOW_MAX_SNAPSHOTS 65536
 
 /* 8 MB refcount table is enough for 2 PB images at 64k cluster size
@@ -52,6 +58,10 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Bitmap header extension constraints */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -59,8 +69,24 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* With extended L2 entries, each cluster is split in 32 subclusters, and the
+ * second half of each L2 entry is a bitmap describing them: the low 32 bits
+ * say which subclusters are allocated, the high 32 bits which read as zeroes */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)      (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)       (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Bits for subclusters [X, Y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC     (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+#define QCOW_L2_BITMAP_ALL_ZEROES    (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
+/* Subclusters must not be smaller than 512 bytes */
+#define MIN_EXTL2_CLUSTER_BITS 14
 
 /* Must be at least 2 to cover COW */
 #define MIN_L2_CACHE_SIZE 2 /* clusters */
@@ -178,21 +204,38 @@ enum {
 
 /* Incompatible feature bits */
 enum {
-    QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
-    QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
-    QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
-    QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
-
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+    QCOW2_INCOMPAT_DIRTY_BITNR     = 0,
+    QCOW2_INCOMPAT_CORRUPT_BITNR   = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR     = 2,
+    QCOW2_INCOMPAT_SHARED_L2_BITNR = 3,
+    QCOW2_INCOMPAT_DIRTY           = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_CORRUPT         = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2           = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_SHARED_L2       = 1 << QCOW2_INCOMPAT_SHARED_L2_BITNR,
+
+    QCOW2_INCOMPAT_MASK            = QCOW2_INCOMPAT_DIRTY
+                                   | QCOW2_INCOMPAT_CORRUPT
+                                   | QCOW2_INCOMPAT_EXTL2
+                                   | QCOW2_INCOMPAT_SHARED_L2,
 };
 
 /* Compatible feature bits */
 enum {
     QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR = 0,
+    QCOW2_COMPAT_LAZY_SNAPSHOTS_BITNR = 1,
     QCOW2_COMPAT_LAZY_REFCOUNTS       = 1 << QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
+    QCOW2_COMPAT_LAZY_SNAPSHOTS       = 1 << QCOW2_COMPAT_LAZY_SNAPSHOTS_BITNR,
 
-    QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
+    QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS
+                                      | QCOW2_COMPAT_LAZY_SNAPSHOTS,
+};
+
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
 };
 
 enum qcow2_discard_type {
@@ -210,6 +253,13 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -228,6 +278,10 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subclusters_per_cluster;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -254,15 +308,27 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* One bit per cluster below free_map_end, set if its refcount is 0 */
+    HBitmap *free_map;
+    uint64_t free_map_end;
+    uint64_t free_map_size;
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
+    uint8_t crypt_key[QCOW2_CRYPT_KEY_SIZE]; /* for thread pool jobs */
     uint32_t crypt_method_header;
     uint64_t snapshots_offset;
     int snapshots_size;
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+    /* The loaded bitmaps must be marked in use before the first write */
+    bool bitmaps_need_in_use;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -345,6 +411,19 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The COW regions have already been written together with the guest
+     * data, so qcow2_alloc_cluster_link_l2() doesn't need to copy them.
+     */
+    bool skip_cow;
+
+    /**
+     * The request writes to subclusters of a single, already allocated
+     * cluster, which keeps its host offset; only the subclusters the
+     * request touches change their state in the L2 entry.
+     */
+    bool keep_old_clusters;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -429,6 +508,51 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in units of uint64_t */
+static inline int l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? 2 : 1;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx * l2_entry_size(s)]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        return be64_to_cpu(l2_table[idx * 2 + 1]);
+    } else {
+        return 0;
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx * l2_entry_size(s)] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) & (s->subclusters_per_cluster - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -498,6 +622,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_free_map_invalidate(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -516,8 +641,11 @@ void qcow2_free_clusters(BlockDriverState *bs,
 void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
                              int nb_clusters, enum qcow2_discard_type type);
 
+int qcow2_update_l2_refcounts(BlockDriverState *bs, uint64_t l2_offset,
+                              int64_t addend);
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_unshare_l2_refcounts(BlockDriverState *bs);
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
@@ -529,6 +657,11 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 int qcow2_pre_write_overlap_check(BlockDriverState *bs, int ign, int64_t offset,
                                   int64_t size);
 
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size);
+
 int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
                                 BlockDriverAmendStatusCB *status_cb,
                                 void *cb_opaque, Error **errp);
@@ -538,10 +671,14 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
+int coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                          int64_t sector_num, uint8_t *buf,
+                                          int nb_sectors, bool enc);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
@@ -576,6 +713,18 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_mark_bitmaps_in_use(BlockDriverState *bs);
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
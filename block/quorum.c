@@ -24,6 +24,7 @@
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
 #include "crypto/hash.h"
+#include "qemu/timed-average.h"
 
 #define HASH_LENGTH 32
 
@@ -31,6 +32,16 @@
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
+#define QUORUM_OPT_HEDGE_FACTOR   "hedge-factor"
+
+/* In the hedged read pattern a child gets hedge-factor percent of its
+ * average latency, but at least QUORUM_HEDGE_MIN_NS, before the read is
+ * also sent to the next child.  Latencies are averaged over
+ * QUORUM_LATENCY_PERIOD_NS.
+ */
+#define QUORUM_HEDGE_FACTOR_DEFAULT   200
+#define QUORUM_HEDGE_MIN_NS           (100 * SCALE_US)
+#define QUORUM_LATENCY_PERIOD_NS      (10 * NANOSECONDS_PER_SECOND)
 
 /* This union holds a vote hash value */
 typedef union QuorumVoteValue {
@@ -83,6 +94,10 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+
+    int hedge_factor;           /* hedged pattern deadline, in percent of
+                                 * the child's average latency */
+    TimedAverage *latency;      /* per child read latency in ns */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -98,6 +113,7 @@ typedef struct QuorumChildRequest {
     uint8_t *buf;
     int ret;
     QuorumAIOCB *parent;
+    int64_t start_ns;           /* when a hedged read was sent */
 } QuorumChildRequest;
 
 /* Quorum will use the following structure to track progress of each read/write
@@ -127,6 +143,13 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int child_iter;             /* which child to read in fifo pattern */
+
+    /* hedged pattern */
+    int *order;                 /* children, fastest first */
+    int issued;                 /* number of children the read was sent to */
+    int outstanding;            /* reads still running */
+    bool done;                  /* the caller got its completion */
+    QEMUTimer *hedge_timer;
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -265,6 +288,7 @@ static void quorum_rewrite_aio_cb(void *opaque, int ret)
 }
 
 static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb);
+static void quorum_hedged_aio_cb(void *opaque, int ret);
 
 static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
 {
@@ -680,6 +704,138 @@ static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
     return &acb->common;
 }
 
+static int64_t quorum_hedge_deadline(BDRVQuorumState *s, int i)
+{
+    uint64_t avg = timed_average_avg(&s->latency[i]);
+
+    return MAX(avg * s->hedge_factor / 100, QUORUM_HEDGE_MIN_NS);
+}
+
+static void read_hedged_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i = acb->order[acb->issued++];
+    QuorumChildRequest *qcr = &acb->qcrs[i];
+
+    qcr->buf = qemu_blockalign(s->children[i]->bs, acb->qiov->size);
+    qemu_iovec_init(&qcr->qiov, acb->qiov->niov);
+    qemu_iovec_clone(&qcr->qiov, acb->qiov, qcr->buf);
+
+    qcr->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (acb->issued < s->num_children) {
+        timer_mod(acb->hedge_timer,
+                  qcr->start_ns + quorum_hedge_deadline(s, i));
+    }
+
+    acb->outstanding++;
+    qcr->aiocb = bdrv_aio_readv(s->children[i]->bs, acb->sector_num,
+                                &qcr->qiov, acb->nb_sectors,
+                                quorum_hedged_aio_cb, qcr);
+}
+
+static void quorum_hedge_timer_cb(void *opaque)
+{
+    QuorumAIOCB *acb = opaque;
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
+    if (!acb->done && acb->issued < s->num_children) {
+        read_hedged_child(acb);
+    }
+}
+
+static void quorum_hedged_finish(QuorumAIOCB *acb, int ret)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i;
+
+    acb->done = true;
+    timer_del(acb->hedge_timer);
+    acb->common.cb(acb->common.opaque, ret);
+
+    /* the slower reads are not needed anymore */
+    for (i = 0; i < s->num_children; i++) {
+        if (acb->qcrs[i].aiocb) {
+            bdrv_aio_cancel_async(acb->qcrs[i].aiocb);
+        }
+    }
+}
+
+static void quorum_hedged_aio_cb(void *opaque, int ret)
+{
+    QuorumChildRequest *qcr = opaque;
+    QuorumAIOCB *acb = qcr->parent;
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i = qcr - acb->qcrs;
+
+    qcr->aiocb = NULL;
+    acb->outstanding--;
+
+    /* a cancelled read still tells that the child is at least this slow */
+    if (ret == 0 || ret == -ECANCELED) {
+        timed_average_account(&s->latency[i],
+                              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                              qcr->start_ns);
+    } else {
+        quorum_report_bad(QUORUM_OP_TYPE_READ, acb->sector_num,
+                          acb->nb_sectors, s->children[i]->bs->node_name, ret);
+    }
+
+    if (!acb->done) {
+        if (ret == 0) {
+            quorum_copy_qiov(acb->qiov, &qcr->qiov);
+            quorum_hedged_finish(acb, 0);
+        } else if (acb->issued < s->num_children) {
+            /* fall through to the next child at once */
+            read_hedged_child(acb);
+        } else if (!acb->outstanding) {
+            quorum_hedged_finish(acb, ret);
+        }
+    }
+
+    if (!acb->done || acb->outstanding) {
+        return;
+    }
+
+    for (i = 0; i < s->num_children; i++) {
+        if (acb->qcrs[i].buf) {
+            qemu_vfree(acb->qcrs[i].buf);
+            qemu_iovec_destroy(&acb->qcrs[i].qiov);
+        }
+    }
+    timer_free(acb->hedge_timer);
+    g_free(acb->order);
+    g_free(acb->qcrs);
+    qemu_aio_unref(acb);
+}
+
+static BlockAIOCB *read_hedged(QuorumAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQuorumState *s = bs->opaque;
+    uint64_t *avg = g_new(uint64_t, s->num_children);
+    int i, j;
+
+    /* children without samples come first, so that they get some */
+    acb->order = g_new(int, s->num_children);
+    for (i = 0; i < s->num_children; i++) {
+        uint64_t lat = timed_average_avg(&s->latency[i]);
+
+        for (j = i; j > 0 && avg[j - 1] > lat; j--) {
+            avg[j] = avg[j - 1];
+            acb->order[j] = acb->order[j - 1];
+        }
+        avg[j] = lat;
+        acb->order[j] = i;
+    }
+    g_free(avg);
+
+    acb->hedge_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                     QEMU_CLOCK_REALTIME, SCALE_NS,
+                                     quorum_hedge_timer_cb, acb);
+    read_hedged_child(acb);
+    return &acb->common;
+}
+
 static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
                                     int64_t sector_num,
                                     QEMUIOVector *qiov,
@@ -696,6 +852,9 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
         acb->child_iter = s->num_children - 1;
         return read_quorum_children(acb);
     }
+    if (s->read_pattern == QUORUM_READ_PATTERN_HEDGED) {
+        return read_hedged(acb);
+    }
 
     acb->child_iter = 0;
     return read_fifo_child(acb);
@@ -854,7 +1013,13 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, hedged. Quorum is default",
+        },
+        {
+            .name = QUORUM_OPT_HEDGE_FACTOR,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Hedged reads: percentage of a child's average latency "
+                    "to wait before also reading the next child",
         },
         { /* end of list */ }
     },
@@ -920,11 +1085,20 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err,
+                   "Please set read-pattern as fifo, quorum or hedged");
         goto exit;
     }
     s->read_pattern = ret;
 
+    s->hedge_factor = qemu_opt_get_number(opts, QUORUM_OPT_HEDGE_FACTOR,
+                                          QUORUM_HEDGE_FACTOR_DEFAULT);
+    if (s->hedge_factor <= 0) {
+        error_setg(&local_err, "hedge-factor must be positive");
+        ret = -EINVAL;
+        goto exit;
+    }
+
     if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         /* is the driver in blkverify mode */
         if (qemu_opt_get_bool(opts, QUORUM_OPT_BLKVERIFY, false) &&
@@ -949,6 +1123,12 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
     s->children = g_new0(BdrvChild *, s->num_children);
     opened = g_new0(bool, s->num_children);
 
+    s->latency = g_new(TimedAverage, s->num_children);
+    for (i = 0; i < s->num_children; i++) {
+        timed_average_init(&s->latency[i], QEMU_CLOCK_REALTIME,
+                           QUORUM_LATENCY_PERIOD_NS);
+    }
+
     for (i = 0; i < s->num_children; i++) {
         char indexstr[32];
         ret = snprintf(indexstr, 32, "children.%d", i);
@@ -976,6 +1156,7 @@ close_exit:
         bdrv_unref_child(bs, s->children[i]);
     }
     g_free(s->children);
+    g_free(s->latency);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -996,6 +1177,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->children);
+    g_free(s->latency);
 }
 
 static void quorum_detach_aio_context(BlockDriverState *bs)
@@ -65,6 +65,9 @@
 #ifndef FS_NOCOW_FL
 #define FS_NOCOW_FL                     0x00800000 /* Do not cow file */
 #endif
+#ifndef CONFIG_COPY_FILE_RANGE
+#include <sys/syscall.h>
+#endif
 #endif
 #if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
@@ -139,13 +142,23 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+    bool io_uring_sqpoll;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
+#endif
+#ifdef __linux__
+    /* non-NULL if SG_IO goes through the sg driver's read/write interface */
+    void *sg_aio_ctx;
 #endif
     bool has_discard:1;
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool has_fallocate;
+    bool has_copy_range;
     bool needs_alignment;
 } BDRVRawState;
 
@@ -155,6 +168,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -172,6 +188,9 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    /* Destination of QEMU_AIO_COPY_RANGE */
+    int aio_fd2;
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -374,25 +393,51 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING) || \
+    defined(__linux__)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#ifdef __linux__
+    if (s->sg_aio_ctx) {
+        sgaio_detach_aio_context(s->sg_aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING) || \
+    defined(__linux__)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
+#ifdef __linux__
+    if (s->sg_aio_ctx) {
+        sgaio_attach_aio_context(s->sg_aio_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -427,6 +472,29 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(BDRVRawState *s, bool *use_linux_io_uring,
+                            int bdrv_flags)
+{
+    /* Unlike Linux AIO, io_uring also works asynchronously for buffered I/O,
+     * so there is no need for O_DIRECT */
+    if (!(bdrv_flags & BDRV_O_IO_URING)) {
+        *use_linux_io_uring = false;
+        return 0;
+    }
+
+    /* if non-NULL, luring_init() has already been run */
+    if (s->io_uring_ctx == NULL) {
+        s->io_uring_ctx = luring_init(s->io_uring_sqpoll);
+        if (!s->io_uring_ctx) {
+            return -1;
+        }
+    }
+    *use_linux_io_uring = true;
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -447,6 +515,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "x-io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Let a kernel thread poll the io_uring submission queue "
+                    "(aio=io_uring only)",
+        },
         { /* end of list */ }
     },
 };
@@ -513,8 +587,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "x-io-uring-sqpoll", false);
+    if (raw_set_io_uring(s, &s->use_linux_io_uring, bdrv_flags)) {
+        qemu_close(fd);
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not set up io_uring");
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_copy_range = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
         s->needs_alignment = true;
     }
@@ -617,6 +709,12 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(s, &raw_s->use_linux_io_uring, state->flags)) {
+        error_setg(errp, "Could not set up io_uring");
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -698,11 +796,24 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#ifdef __linux__
+    /* requests were drained, switch to plain ioctls for the new fd */
+    if (s->sg_aio_ctx) {
+        sgaio_detach_aio_context(s->sg_aio_ctx,
+                                 bdrv_get_aio_context(state->bs));
+        sgaio_cleanup(s->sg_aio_ctx);
+        s->sg_aio_ctx = NULL;
+    }
+#endif
+
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = raw_s->use_linux_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -973,7 +1084,7 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
      */
-    buf = qemu_try_blockalign(aiocb->bs, aiocb->aio_nbytes);
+    buf = qemu_try_blockalign_pooled(aiocb->bs, aiocb->aio_nbytes);
     if (buf == NULL) {
         return -ENOMEM;
     }
@@ -1007,7 +1118,7 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
         }
         assert(count == 0);
     }
-    qemu_vfree(buf);
+    qemu_vfree_pooled(aiocb->bs, buf, aiocb->aio_nbytes);
 
     return nbytes;
 }
@@ -1198,6 +1309,57 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifndef CONFIG_COPY_FILE_RANGE
+static ssize_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                               off_t *out_off, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd,
+                   out_off, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+
+    while (bytes) {
+        ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                                      aiocb->aio_fd2, &out_off,
+                                      bytes, 0);
+        if (ret == 0) {
+            /* No progress, e.g. at the end of the source file; the caller
+             * reads the rest instead, which takes care of the padding. */
+            return -ENOTSUP;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case ENOSYS:
+                s->has_copy_range = false;
+                return -ENOTSUP;
+            case EINTR:
+                continue;
+            case EXDEV:
+            case EINVAL:
+            case EOPNOTSUPP:
+            case ENOTTY:
+                return -ENOTSUP;
+            default:
+                return -errno;
+            }
+        }
+        bytes -= ret;
+    }
+    return 0;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1238,6 +1400,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1313,15 +1478,18 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_aio) {
-            return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
-                               nb_sectors, cb, opaque, type);
+    } else if (s->needs_alignment && s->use_aio) {
+        return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
+                           nb_sectors, cb, opaque, type);
 #endif
-        }
     }
 
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
@@ -1330,32 +1498,53 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_plug(bs, s->io_uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1382,6 +1571,12 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1395,6 +1590,17 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_cleanup(s->io_uring_ctx);
+    }
+#endif
+#ifdef __linux__
+    if (s->sg_aio_ctx) {
+        sgaio_cleanup(s->sg_aio_ctx);
+        s->sg_aio_ctx = NULL;
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1871,6 +2077,17 @@ static coroutine_fn BlockAIOCB *raw_aio_discard(BlockDriverState *bs,
 {
     BDRVRawState *s = bs->opaque;
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    /* XFS has its own discard method, see handle_aiocb_discard() */
+    bool use_io_uring = s->use_linux_io_uring && s->has_discard;
+#ifdef CONFIG_XFS
+    use_io_uring = use_io_uring && !s->is_xfs;
+#endif
+    if (use_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, NULL,
+                             nb_sectors, cb, opaque, QEMU_AIO_DISCARD);
+    }
+#endif
     return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
@@ -1891,6 +2108,52 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(bs, sector_num, dst, dst_sector, nb_sectors,
+                                 flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *src,
+                                             int64_t src_sector,
+                                             BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    /* Both ends must be files for copy_file_range() */
+    if (src->drv != bs->drv) {
+        return -ENOTSUP;
+    }
+    src_s = src->opaque;
+    if (!s->has_copy_range || !src_s->has_copy_range) {
+        return -ENOTSUP;
+    }
+
+    acb = g_new(RawPosixAIOData, 1);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = sector_num * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(sector_num, nb_sectors, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1900,6 +2163,17 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_get_host_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Reads through the page cache are not coherent with O_DIRECT writes */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+
 static QemuOptsList raw_create_opts = {
     .name = "raw-create-opts",
     .head = QTAILQ_HEAD_INITIALIZER(raw_create_opts.head),
@@ -1939,6 +2213,8 @@ BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1952,6 +2228,7 @@ BlockDriver bdrv_file = {
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
@@ -2155,6 +2432,17 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
     /* Since this does ioctl the device must be already opened */
     bs->sg = hdev_is_sg(bs);
 
+#if defined(__linux__)
+    /* The sg driver only takes commands through write() on a read-write
+     * file descriptor; otherwise SG_IO stays on the thread pool. */
+    if (bs->sg && (flags & BDRV_O_RDWR)) {
+        s->sg_aio_ctx = sgaio_init(s->fd);
+        if (s->sg_aio_ctx) {
+            sgaio_attach_aio_context(s->sg_aio_ctx, bdrv_get_aio_context(bs));
+        }
+    }
+#endif
+
     if (flags & BDRV_O_RDWR) {
         ret = check_hdev_writable(s);
         if (ret < 0) {
@@ -2180,6 +2468,10 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (req == SG_IO && s->sg_aio_ctx) {
+        return sgaio_submit(bs, s->sg_aio_ctx, buf, cb, opaque);
+    }
+
     acb = g_new(RawPosixAIOData, 1);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -2315,6 +2607,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
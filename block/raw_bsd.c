@@ -137,6 +137,28 @@ static int coroutine_fn raw_co_discard(BlockDriverState *bs,
     return bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(bs->file->bs, sector_num, dst, dst_sector,
+                                   nb_sectors, flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *src,
+                                             int64_t src_sector,
+                                             BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_sector, bs->file->bs, sector_num,
+                                 nb_sectors, flags);
+}
+
 static int64_t raw_getlength(BlockDriverState *bs)
 {
     return bdrv_getlength(bs->file->bs);
@@ -147,6 +169,11 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return bdrv_get_info(bs->file->bs, bdi);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs)
+{
+    return bdrv_get_host_fd(bs->file->bs);
+}
+
 static void raw_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl = bs->file->bs->bl;
@@ -249,11 +276,14 @@ BlockDriver bdrv_raw = {
     .bdrv_co_writev       = &raw_co_writev,
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to   = &raw_co_copy_range_to,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
     .bdrv_get_info        = &raw_get_info,
+    .bdrv_get_host_fd     = &raw_get_host_fd,
     .bdrv_refresh_limits  = &raw_refresh_limits,
     .bdrv_probe_blocksizes = &raw_probe_blocksizes,
     .bdrv_probe_geometry  = &raw_probe_geometry,
@@ -52,6 +52,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* rbd_aio_readv/rbd_aio_writev let us do I/O without a bounce buffer */
+#ifdef LIBRBD_SUPPORTS_IOVEC
+#define LIBRBD_USE_IOVEC 1
+#else
+#define LIBRBD_USE_IOVEC 0
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -419,11 +426,19 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            if (LIBRBD_USE_IOVEC) {
+                qemu_iovec_memset(acb->qiov, 0, 0, acb->qiov->size);
+            } else {
+                memset(rcb->buf, 0, rcb->size);
+            }
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            if (LIBRBD_USE_IOVEC) {
+                qemu_iovec_memset(acb->qiov, r, 0, acb->qiov->size - r);
+            } else {
+                memset(rcb->buf + r, 0, rcb->size - r);
+            }
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -434,10 +449,12 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    if (!LIBRBD_USE_IOVEC) {
+        if (acb->cmd == RBD_AIO_READ) {
+            qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+        }
+        qemu_vfree(acb->bounce);
     }
-    qemu_vfree(acb->bounce);
     acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
 
     qemu_aio_unref(acb);
@@ -659,9 +676,9 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+    if (!LIBRBD_USE_IOVEC &&
+        (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE)) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
@@ -672,7 +689,7 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->s = s;
     acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (!LIBRBD_USE_IOVEC && cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -692,12 +709,21 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     }
 
     switch (cmd) {
+#ifdef LIBRBD_SUPPORTS_IOVEC
+    case RBD_AIO_WRITE:
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+        break;
+    case RBD_AIO_READ:
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+        break;
+#else
     case RBD_AIO_WRITE:
         r = rbd_aio_write(s->image, off, size, buf, c);
         break;
     case RBD_AIO_READ:
         r = rbd_aio_read(s->image, off, size, buf, c);
         break;
+#endif
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
         break;
@@ -29,6 +29,10 @@ enum {
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
+#define STREAM_MAX_IN_FLIGHT 16
+
+/* Back off when the guest sees more than twice its best latency */
+#define STREAM_LATENCY_FACTOR 2
 
 typedef struct StreamBlockJob {
     BlockJob common;
@@ -36,22 +40,175 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    int in_flight;
+    bool waiting_for_io;
+
+    /* First failed chunk of the requests in flight */
+    int error;
+    int64_t error_sector;
+    int error_nb_sectors;
+
+    /* Limit for in_flight; with @adaptive, it follows the guest latency
+     * and grows up to @in_flight_limit.
+     */
+    int max_in_flight;
+    int in_flight_limit;
+    bool adaptive;
+    int64_t min_guest_latency_ns;
+    uint64_t backoff_ns;
 } StreamBlockJob;
 
-static int coroutine_fn stream_populate(BlockDriverState *bs,
-                                        int64_t sector_num, int nb_sectors,
-                                        void *buf)
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint64_t guest_ops;
+    uint64_t guest_time_ns;
+} StreamOp;
+
+/* Total number and duration of the guest's reads and writes so far */
+static void stream_guest_stats(StreamBlockJob *s, uint64_t *ops,
+                               uint64_t *time_ns)
+{
+    BlockAcctStats *stats;
+
+    *ops = *time_ns = 0;
+    if (!s->common.bs->blk) {
+        return;
+    }
+    stats = blk_get_stats(s->common.bs->blk);
+    *ops = stats->nr_ops[BLOCK_ACCT_READ] + stats->nr_ops[BLOCK_ACCT_WRITE];
+    *time_ns = stats->total_time_ns[BLOCK_ACCT_READ] +
+               stats->total_time_ns[BLOCK_ACCT_WRITE];
+}
+
+/* As long as guest requests that complete during a chunk are about as fast
+ * as they were at best, allow one more chunk in flight.  When they get
+ * slower, halve the number of chunks, and once only one is left, also sleep
+ * between chunks for an exponentially growing time.
+ */
+static void stream_update_in_flight_limit(StreamBlockJob *s, StreamOp *op)
+{
+    uint64_t ops, time_ns;
+    int64_t latency;
+
+    stream_guest_stats(s, &ops, &time_ns);
+    if (ops == op->guest_ops) {
+        /* The guest is idle */
+        latency = 0;
+    } else {
+        latency = (time_ns - op->guest_time_ns) / (ops - op->guest_ops);
+        if (!s->min_guest_latency_ns || latency < s->min_guest_latency_ns) {
+            s->min_guest_latency_ns = latency;
+        } else {
+            /* Follow slow changes in the speed of the device */
+            s->min_guest_latency_ns +=
+                (latency - s->min_guest_latency_ns) >> 6;
+        }
+    }
+
+    if (latency > STREAM_LATENCY_FACTOR * s->min_guest_latency_ns) {
+        if (s->max_in_flight > 1) {
+            s->max_in_flight /= 2;
+        } else {
+            s->backoff_ns = MIN(MAX(s->backoff_ns * 2, SLICE_TIME / 100),
+                                SLICE_TIME);
+        }
+    } else if (s->backoff_ns) {
+        s->backoff_ns = s->backoff_ns > SLICE_TIME / 100 ?
+                        s->backoff_ns / 2 : 0;
+    } else if (s->max_in_flight < s->in_flight_limit) {
+        s->max_in_flight++;
+    }
+}
+
+static void coroutine_fn stream_populate(void *opaque)
 {
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+    size_t size = op->nb_sectors * BDRV_SECTOR_SIZE;
     struct iovec iov = {
-        .iov_base = buf,
-        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+        .iov_base = qemu_blockalign_pooled(bs, size),
+        .iov_len  = size,
     };
     QEMUIOVector qiov;
+    int ret;
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
     /* Copy-on-read the unallocated clusters */
-    return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
+    ret = bdrv_co_copy_on_readv(bs, op->sector_num, op->nb_sectors, &qiov);
+    qemu_vfree_pooled(bs, iov.iov_base, size);
+
+    s->in_flight--;
+    if (ret < 0) {
+        if (!s->error || op->sector_num < s->error_sector) {
+            s->error = ret;
+            s->error_sector = op->sector_num;
+            s->error_nb_sectors = op->nb_sectors;
+        }
+    } else if (s->adaptive) {
+        stream_update_in_flight_limit(s, op);
+    }
+    g_free(op);
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_start_op(StreamBlockJob *s, int64_t sector_num,
+                            int nb_sectors)
+{
+    StreamOp *op = g_new(StreamOp, 1);
+    Coroutine *co;
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    stream_guest_stats(s, &op->guest_ops, &op->guest_time_ns);
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_populate);
+    qemu_coroutine_enter(co, op);
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn stream_wait_all(StreamBlockJob *s)
+{
+    while (s->in_flight > 0) {
+        stream_wait_for_io(s);
+    }
+}
+
+/* If a chunk in flight failed, wait for the others and rewind to the first
+ * failed chunk.  Returns its error, or 0 if all chunks succeeded so far.
+ */
+static int coroutine_fn stream_collect_error(StreamBlockJob *s,
+                                             int64_t *sector_num, int *n)
+{
+    int ret;
+
+    if (!s->error) {
+        return 0;
+    }
+    stream_wait_all(s);
+
+    ret = s->error;
+    *sector_num = s->error_sector;
+    *n = s->error_nb_sectors;
+    s->common.offset = *sector_num * BDRV_SECTOR_SIZE;
+    s->error = 0;
+    return ret;
 }
 
 typedef struct {
@@ -93,7 +250,6 @@ static void coroutine_fn stream_run(void *opaque)
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing) {
         block_job_completed(&s->common, 0);
@@ -107,7 +263,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -118,10 +273,18 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
+    for (sector_num = 0; ; sector_num += n) {
+        uint64_t delay_ns = s->backoff_ns;
         bool copy;
 
+        if (sector_num >= end) {
+            /* The last chunks may still fail and have to be retried */
+            stream_wait_all(s);
+            if (!s->error) {
+                break;
+            }
+        }
+
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
@@ -131,24 +294,32 @@ wait:
             break;
         }
 
+        while (s->in_flight >= s->max_in_flight) {
+            stream_wait_for_io(s);
+        }
+
         copy = false;
 
-        ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_is_allocated_above(backing_bs(bs), base,
-                                          sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
+        /* A failed chunk is handled like a failure of the current one */
+        ret = stream_collect_error(s, &sector_num, &n);
+        if (ret == 0) {
+            ret = bdrv_is_allocated(bs, sector_num,
+                                    STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+            } else if (ret >= 0) {
+                /* Copy if allocated in the intermediate images.  Limit to the
+                 * known-unallocated area [sector_num, sector_num+n).  */
+                ret = bdrv_is_allocated_above(backing_bs(bs), base,
+                                              sector_num, n, &n);
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
 
-            copy = (ret == 1);
+                copy = (ret == 1);
+            }
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
         if (copy) {
@@ -158,7 +329,7 @@ wait:
                     goto wait;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            stream_start_op(s, sector_num, n);
         }
         if (ret < 0) {
             BlockErrorAction action =
@@ -181,6 +352,8 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
+    stream_wait_all(s);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -188,8 +361,6 @@ wait:
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -216,12 +387,19 @@ static const BlockJobDriver stream_job_driver = {
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   const char *backing_file_str, int64_t speed,
+                  int max_in_flight, bool adaptive,
                   BlockdevOnError on_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     StreamBlockJob *s;
 
+    if (max_in_flight < 1 || max_in_flight > STREAM_MAX_IN_FLIGHT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                   "an integer in range 1 to " stringify(STREAM_MAX_IN_FLIGHT));
+        return;
+    }
+
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         (!bs->blk || !blk_iostatus_is_enabled(bs->blk))) {
@@ -238,6 +416,9 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     s->backing_file_str = g_strdup(backing_file_str);
 
     s->on_error = on_error;
+    s->in_flight_limit = max_in_flight;
+    s->adaptive = adaptive;
+    s->max_in_flight = adaptive ? 1 : max_in_flight;
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
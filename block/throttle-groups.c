@@ -51,21 +51,37 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * When the group is over its limits, the next request to run is
+ * chosen with start-time fair queuing: every BDS has a virtual time
+ * that advances by the cost of each request it submits, divided by
+ * its weight, and the BDS with the lowest virtual time goes first.
+ * A BDS whose oldest queued request has waited for longer than its
+ * latency target takes precedence over that order. Requests that do
+ * not exceed the limits are never delayed, so a single busy member
+ * can still use the whole bandwidth of the group while the others
+ * are idle.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockDriverState) head;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
+    /* Virtual time of the last request that was allowed to run */
+    uint64_t vtime[2];
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* Every request is charged this many bytes on top of its size, so that
+ * small requests are not free when computing the share of a BDS. */
+#define THROTTLE_GROUP_REQUEST_COST 4096
+
 static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -166,8 +182,10 @@ static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
     return next;
 }
 
-/* Return the next BlockDriverState in the round-robin sequence with
- * pending I/O requests.
+/* Return the BlockDriverState with pending I/O requests that should
+ * run next: the one that has missed its latency target by the largest
+ * amount, or otherwise the one with the lowest virtual time. Ties are
+ * broken in round-robin order.
  *
  * This assumes that tg->lock is held.
  *
@@ -181,24 +199,73 @@ static BlockDriverState *next_throttle_token(BlockDriverState *bs,
 {
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
     BlockDriverState *token, *start;
+    BlockDriverState *best = NULL, *late = NULL;
+    int64_t now = 0, late_deadline = 0;
 
     start = token = tg->tokens[is_write];
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_bs(token);
-    while (token != start && !token->pending_reqs[is_write]) {
+    /* Visit every bs once, starting with the one after the current
+     * token and ending with the token itself */
+    do {
         token = throttle_group_next_bs(token);
+        if (!token->pending_reqs[is_write]) {
+            continue;
+        }
+
+        if (token->throttle_latency_target_ns) {
+            int64_t deadline = token->throttle_wait_start[is_write] +
+                               token->throttle_latency_target_ns;
+            if (!now) {
+                now = qemu_clock_get_ns(token->throttle_timers.clock_type);
+            }
+            if (deadline <= now && (!late || deadline < late_deadline)) {
+                late = token;
+                late_deadline = deadline;
+            }
+        }
+
+        if (!best ||
+            token->throttle_vtime[is_write] < best->throttle_vtime[is_write]) {
+            best = token;
+        }
+    } while (token != start);
+
+    if (late) {
+        return late;
     }
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current bs because chances are the current bs get the current
+     * request queued.
      */
-    if (token == start && !token->pending_reqs[is_write]) {
-        token = bs;
-    }
+    return best ? best : bs;
+}
 
-    return token;
+/* Charge a request that is about to run to the virtual time of its
+ * BlockDriverState.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the BlockDriverState that submitted the request
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_charge(BlockDriverState *bs, unsigned int bytes,
+                                  bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    uint64_t cost = (uint64_t)bytes + THROTTLE_GROUP_REQUEST_COST;
+
+    tg->vtime[is_write] = MAX(tg->vtime[is_write],
+                              bs->throttle_vtime[is_write]);
+    bs->throttle_vtime[is_write] += cost * THROTTLE_GROUP_WEIGHT_DEFAULT /
+                                    bs->throttle_weight;
+
+    /* The latency of the next queued request is measured from now */
+    if (bs->pending_reqs[is_write]) {
+        ThrottleTimers *tt = &bs->throttle_timers;
+        bs->throttle_wait_start[is_write] = qemu_clock_get_ns(tt->clock_type);
+    }
 }
 
 /* Check if the next I/O request for a BlockDriverState needs to be
@@ -259,8 +326,8 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current bs */
-        if (qemu_in_coroutine() &&
+        /* Run the request directly if it belongs to the current bs */
+        if (token == bs && qemu_in_coroutine() &&
             qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
             token = bs;
         } else {
@@ -274,8 +341,8 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
 }
 
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request according to the share
+ * of each member of the group.
  *
  * @bs:        the current BlockDriverState
  * @bytes:     the number of bytes for this I/O
@@ -291,6 +358,16 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
 
+    /* A bs that had no queued requests does not get credit for the
+     * time it was idle, so move it forward to the current virtual time
+     * of the group. */
+    if (!bs->pending_reqs[is_write]) {
+        ThrottleTimers *tt = &bs->throttle_timers;
+        bs->throttle_vtime[is_write] = MAX(bs->throttle_vtime[is_write],
+                                           tg->vtime[is_write]);
+        bs->throttle_wait_start[is_write] = qemu_clock_get_ns(tt->clock_type);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(bs, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -306,6 +383,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(bs->throttle_state, is_write, bytes);
+    throttle_group_charge(bs, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
@@ -353,6 +431,47 @@ void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the share of a BlockDriverState within its throttling group.
+ *
+ * @bs:                 a BlockDriverState that is member of a group
+ * @weight:             the weight of @bs, relative to the other members
+ *                      (between THROTTLE_GROUP_WEIGHT_MIN and
+ *                      THROTTLE_GROUP_WEIGHT_MAX)
+ * @latency_target_ns:  how long a request of @bs may wait before it
+ *                      takes precedence over the weights, 0 for none
+ */
+void throttle_group_set_share(BlockDriverState *bs, unsigned weight,
+                              int64_t latency_target_ns)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    assert(weight >= THROTTLE_GROUP_WEIGHT_MIN &&
+           weight <= THROTTLE_GROUP_WEIGHT_MAX);
+    assert(latency_target_ns >= 0);
+
+    qemu_mutex_lock(&tg->lock);
+    bs->throttle_weight = weight;
+    bs->throttle_latency_target_ns = latency_target_ns;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the share of a BlockDriverState within its throttling group.
+ *
+ * @bs:                 a BlockDriverState that is member of a group
+ * @weight:             the weight will be written here
+ * @latency_target_ns:  the latency target will be written here
+ */
+void throttle_group_get_share(BlockDriverState *bs, unsigned *weight,
+                              int64_t *latency_target_ns)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    *weight = bs->throttle_weight;
+    *latency_target_ns = bs->throttle_latency_target_ns;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -424,6 +543,15 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
 
     QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
 
+    /* Keep the share across changes of group, but start at the current
+     * virtual time of the new one */
+    if (!bs->throttle_weight) {
+        bs->throttle_weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
+    }
+    for (i = 0; i < 2; i++) {
+        bs->throttle_vtime[i] = tg->vtime[i];
+    }
+
     throttle_timers_init(&bs->throttle_timers,
                          bdrv_get_aio_context(bs),
                          clock_type,
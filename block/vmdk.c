@@ -31,6 +31,7 @@
 #include "qemu/error-report.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 #include <glib.h>
 
@@ -87,6 +88,7 @@ typedef struct {
 } QEMU_PACKED VMDK4Header;
 
 #define L2_CACHE_SIZE 16
+#define GRAIN_CACHE_SIZE 16
 
 typedef struct VmdkExtent {
     BdrvChild *file;
@@ -115,6 +117,15 @@ typedef struct VmdkExtent {
     char *type;
 } VmdkExtent;
 
+/* A decompressed grain of a compressed extent */
+typedef struct VmdkGrainCacheEntry {
+    VmdkExtent *extent;
+    int64_t cluster_offset;
+    uint8_t *data;
+    uLongf len;
+    uint64_t lru_counter;
+} VmdkGrainCacheEntry;
+
 typedef struct BDRVVmdkState {
     CoMutex lock;
     uint64_t desc_offset;
@@ -127,6 +138,8 @@ typedef struct BDRVVmdkState {
     VmdkExtent *extents;
     Error *migration_blocker;
     char *create_type;
+    VmdkGrainCacheEntry grain_cache[GRAIN_CACHE_SIZE];
+    uint64_t grain_cache_counter;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -217,6 +230,11 @@ static void vmdk_free_extents(BlockDriverState *bs)
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *e;
 
+    for (i = 0; i < GRAIN_CACHE_SIZE; i++) {
+        g_free(s->grain_cache[i].data);
+    }
+    memset(s->grain_cache, 0, sizeof(s->grain_cache));
+
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
         g_free(e->l1_table);
@@ -1371,17 +1389,104 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+static VmdkGrainCacheEntry *vmdk_grain_cache_find(BDRVVmdkState *s,
+                                                  VmdkExtent *extent,
+                                                  int64_t cluster_offset)
+{
+    int i;
+
+    for (i = 0; i < GRAIN_CACHE_SIZE; i++) {
+        VmdkGrainCacheEntry *e = &s->grain_cache[i];
+        if (e->data && e->extent == extent &&
+            e->cluster_offset == cluster_offset) {
+            e->lru_counter = ++s->grain_cache_counter;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Takes ownership of @data */
+static void vmdk_grain_cache_insert(BDRVVmdkState *s, VmdkExtent *extent,
+                                    int64_t cluster_offset, uint8_t *data,
+                                    uLongf len)
+{
+    VmdkGrainCacheEntry *e = &s->grain_cache[0];
+    int i;
+
+    if (vmdk_grain_cache_find(s, extent, cluster_offset)) {
+        /* another request decompressed the same grain meanwhile */
+        g_free(data);
+        return;
+    }
+
+    for (i = 1; i < GRAIN_CACHE_SIZE; i++) {
+        if (s->grain_cache[i].lru_counter < e->lru_counter) {
+            e = &s->grain_cache[i];
+        }
+    }
+
+    g_free(e->data);
+    *e = (VmdkGrainCacheEntry) {
+        .extent         = extent,
+        .cluster_offset = cluster_offset,
+        .data           = data,
+        .len            = len,
+        .lru_counter    = ++s->grain_cache_counter,
+    };
+}
+
+static void vmdk_grain_cache_drop(BDRVVmdkState *s, VmdkExtent *extent,
+                                  int64_t cluster_offset)
 {
+    VmdkGrainCacheEntry *e = vmdk_grain_cache_find(s, extent, cluster_offset);
+
+    if (e) {
+        g_free(e->data);
+        e->data = NULL;
+        e->lru_counter = 0;
+    }
+}
+
+typedef struct VmdkDecompressData {
+    uint8_t *out_buf;
+    uLongf out_len;
+    const uint8_t *buf;
+    uLong buf_len;
+} VmdkDecompressData;
+
+static int vmdk_decompress_worker(void *opaque)
+{
+    VmdkDecompressData *data = opaque;
+
+    if (uncompress(data->out_buf, &data->out_len,
+                   data->buf, data->buf_len) != Z_OK) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Called with s->lock held.  For compressed extents the lock is dropped while
+ * the grain is read and inflated, so that several grains can be decompressed
+ * in the thread pool at the same time.
+ */
+static int coroutine_fn vmdk_read_extent(BlockDriverState *bs,
+                                         VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         uint8_t *buf, int nb_sectors)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkGrainCacheEntry *entry;
+    VmdkDecompressData data;
+    ThreadPool *pool;
     int ret;
     int cluster_bytes, buf_bytes;
     uint8_t *cluster_buf, *compressed_data;
     uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
 
 
     if (!extent->compressed) {
@@ -1394,11 +1499,19 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
             return -EIO;
         }
     }
+
+    entry = vmdk_grain_cache_find(s, extent, cluster_offset);
+    if (entry) {
+        goto copy;
+    }
+
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
     buf_bytes = cluster_bytes * 2;
     cluster_buf = g_malloc(buf_bytes);
     uncomp_buf = g_malloc(cluster_bytes);
+
+    qemu_co_mutex_unlock(&s->lock);
     ret = bdrv_pread(extent->file->bs,
                 cluster_offset,
                 cluster_buf, buf_bytes);
@@ -1406,7 +1519,6 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         goto out;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
@@ -1417,28 +1529,39 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
 
-    }
-    if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
-        ret = -EINVAL;
-        goto out;
-    }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
-    ret = 0;
+    data = (VmdkDecompressData) {
+        .out_buf    = uncomp_buf,
+        .out_len    = cluster_bytes,
+        .buf        = compressed_data,
+        .buf_len    = data_len,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, vmdk_decompress_worker, &data);
 
  out:
-    g_free(uncomp_buf);
+    qemu_co_mutex_lock(&s->lock);
     g_free(cluster_buf);
-    return ret;
+    if (ret < 0) {
+        g_free(uncomp_buf);
+        return ret;
+    }
+
+    vmdk_grain_cache_insert(s, extent, cluster_offset, uncomp_buf,
+                            data.out_len);
+    entry = vmdk_grain_cache_find(s, extent, cluster_offset);
+
+ copy:
+    if (offset_in_cluster < 0 ||
+            offset_in_cluster + nb_sectors * 512 > entry->len) {
+        return -EINVAL;
+    }
+    memcpy(buf, entry->data + offset_in_cluster, nb_sectors * 512);
+    return 0;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1473,7 +1596,7 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else {
-            ret = vmdk_read_extent(extent,
+            ret = vmdk_read_extent(bs, extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n);
             if (ret) {
@@ -1572,6 +1695,9 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 return -ENOTSUP;
             }
         } else {
+            if (extent->compressed) {
+                vmdk_grain_cache_drop(s, extent, cluster_offset);
+            }
             ret = vmdk_write_extent(extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n, sector_num);
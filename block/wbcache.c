@@ -0,0 +1,520 @@
+/*
+ * Write-back cache filter in host memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qemu/coroutine.h"
+#include "qemu/host-utils.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qapi/error.h"
+
+/*
+ * The cache keeps the data of the child node in lines of a fixed size.  Reads
+ * and writes are served from the lines; dirty lines are written back when the
+ * guest flushes, when too many of them are dirty or when they are evicted to
+ * make room for other data.  Evicted lines are chosen in LRU order.
+ *
+ * Every line has a CoMutex that is held while the line is filled, written
+ * back or accessed, and a reference count that keeps it from being evicted
+ * while a request waits for it.
+ */
+
+#define WBCACHE_DEFAULT_SIZE        (64 * 1024 * 1024)
+#define WBCACHE_DEFAULT_LINE_SIZE   (64 * 1024)
+
+typedef struct WBCacheLine {
+    int64_t index;              /* in units of the line size */
+    uint8_t *data;
+    int nb_sectors;             /* shorter than a line at the end of image */
+    bool valid;
+    bool dirty;
+    int refcnt;
+    CoMutex lock;
+    QTAILQ_ENTRY(WBCacheLine) lru_next;     /* least recently used first */
+    QTAILQ_ENTRY(WBCacheLine) dirty_next;   /* oldest dirty line first */
+} WBCacheLine;
+
+typedef struct BDRVWBCacheState {
+    GHashTable *lines;
+    QTAILQ_HEAD(, WBCacheLine) lru;
+    QTAILQ_HEAD(, WBCacheLine) dirty;
+
+    int line_sectors;
+    int max_lines;
+    int max_dirty;
+
+    int nb_lines;
+    int nb_dirty;
+} BDRVWBCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "wbcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache (default: 64M)",
+        },
+        {
+            .name = "line-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache line, a power of two (default: 64k)",
+        },
+        {
+            .name = "max-dirty",
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of dirty data that is written back without "
+                    "waiting for a flush (default: half of the cache size)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int wbcache_open(BlockDriverState *bs, QDict *options, int flags,
+                        Error **errp)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t size, line_size, max_dirty;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, "size", WBCACHE_DEFAULT_SIZE);
+    line_size = qemu_opt_get_size(opts, "line-size",
+                                  WBCACHE_DEFAULT_LINE_SIZE);
+    max_dirty = qemu_opt_get_size(opts, "max-dirty", size / 2);
+
+    if (line_size < BDRV_SECTOR_SIZE || line_size > INT_MAX / 2 ||
+        !is_power_of_2(line_size)) {
+        error_setg(errp, "Cache line size must be a power of two between "
+                   "512 and 1G");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (size < line_size || size / line_size > INT_MAX) {
+        error_setg(errp, "Cache size must be at least one cache line and "
+                   "less than %" PRIu64 " lines", (uint64_t) INT_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (max_dirty > size) {
+        error_setg(errp, "max-dirty must not be larger than the cache size");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->line_sectors = line_size >> BDRV_SECTOR_BITS;
+    s->max_lines = size / line_size;
+    s->max_dirty = MAX(max_dirty / line_size, 1);
+
+    s->lines = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->dirty);
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void wbcache_free_line(BDRVWBCacheState *s, WBCacheLine *line)
+{
+    assert(line->refcnt == 0);
+    if (line->dirty) {
+        QTAILQ_REMOVE(&s->dirty, line, dirty_next);
+        s->nb_dirty--;
+    }
+    g_hash_table_remove(s->lines, &line->index);
+    QTAILQ_REMOVE(&s->lru, line, lru_next);
+    s->nb_lines--;
+    qemu_vfree(line->data);
+    g_free(line);
+}
+
+static void wbcache_close(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheLine *line, *next;
+
+    /* bdrv_close() has flushed the cache, dirty lines only remain if writing
+     * them back failed */
+    QTAILQ_FOREACH_SAFE(line, &s->lru, lru_next, next) {
+        wbcache_free_line(s, line);
+    }
+    g_hash_table_destroy(s->lines);
+}
+
+static int wbcache_reopen_prepare(BDRVReopenState *reopen_state,
+                                  BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t wbcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void wbcache_mark_dirty(BDRVWBCacheState *s, WBCacheLine *line)
+{
+    if (!line->dirty) {
+        line->dirty = true;
+        QTAILQ_INSERT_TAIL(&s->dirty, line, dirty_next);
+        s->nb_dirty++;
+    }
+}
+
+static void wbcache_mark_clean(BDRVWBCacheState *s, WBCacheLine *line)
+{
+    if (line->dirty) {
+        line->dirty = false;
+        QTAILQ_REMOVE(&s->dirty, line, dirty_next);
+        s->nb_dirty--;
+    }
+}
+
+static void wbcache_ref_line(BDRVWBCacheState *s, WBCacheLine *line)
+{
+    line->refcnt++;
+    QTAILQ_REMOVE(&s->lru, line, lru_next);
+    QTAILQ_INSERT_TAIL(&s->lru, line, lru_next);
+}
+
+/* Drop the lock and the reference taken by wbcache_get_line() */
+static void wbcache_put_line(BDRVWBCacheState *s, WBCacheLine *line)
+{
+    qemu_co_mutex_unlock(&line->lock);
+    if (--line->refcnt == 0 && !line->valid) {
+        wbcache_free_line(s, line);
+    }
+}
+
+/* Called with the line locked */
+static int coroutine_fn wbcache_write_back(BlockDriverState *bs,
+                                           WBCacheLine *line)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    if (!line->dirty) {
+        return 0;
+    }
+
+    iov.iov_base = line->data;
+    iov.iov_len = line->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_writev(bs->file->bs, line->index * s->line_sectors,
+                         line->nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    wbcache_mark_clean(s, line);
+    return 0;
+}
+
+/* Called with the line locked */
+static int coroutine_fn wbcache_fill(BlockDriverState *bs, WBCacheLine *line)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = line->data;
+    iov.iov_len = line->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs->file->bs, line->index * s->line_sectors,
+                        line->nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    line->valid = true;
+    return 0;
+}
+
+/* Write back the oldest dirty lines until at most @max_dirty are left */
+static int coroutine_fn wbcache_write_back_dirty(BlockDriverState *bs,
+                                                 int max_dirty)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheLine *line;
+    int ret;
+
+    while (s->nb_dirty > max_dirty) {
+        line = QTAILQ_FIRST(&s->dirty);
+        wbcache_ref_line(s, line);
+        qemu_co_mutex_lock(&line->lock);
+        ret = wbcache_write_back(bs, line);
+        wbcache_put_line(s, line);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Make room for a new line by evicting the least recently used line that is
+ * not in use.  Returns 1 if progress was made, 0 if all lines are in use, or
+ * a negative errno value if writing back a dirty line failed.
+ */
+static int coroutine_fn wbcache_evict(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheLine *line;
+    int ret;
+
+    QTAILQ_FOREACH(line, &s->lru, lru_next) {
+        if (line->refcnt == 0) {
+            break;
+        }
+    }
+    if (!line) {
+        return 0;
+    }
+
+    if (line->dirty) {
+        /* The line may be used again while we yield, so just write it back
+         * and let the caller try again */
+        wbcache_ref_line(s, line);
+        qemu_co_mutex_lock(&line->lock);
+        ret = wbcache_write_back(bs, line);
+        wbcache_put_line(s, line);
+        return ret < 0 ? ret : 1;
+    }
+
+    wbcache_free_line(s, line);
+    return 1;
+}
+
+/* Returns the line with the given index, referenced and locked */
+static int coroutine_fn wbcache_get_line(BlockDriverState *bs, int64_t index,
+                                         WBCacheLine **pline)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheLine *line;
+    int64_t nb_sectors;
+    int ret;
+
+    while (!(line = g_hash_table_lookup(s->lines, &index))) {
+        if (s->nb_lines >= s->max_lines) {
+            ret = wbcache_evict(bs);
+            if (ret < 0) {
+                return ret;
+            } else if (ret > 0) {
+                /* We may have yielded, look up the line again */
+                continue;
+            }
+            /* All lines are used by requests in flight; go above the limit
+             * until they complete */
+        }
+
+        nb_sectors = bdrv_nb_sectors(bs->file->bs);
+        if (nb_sectors < 0) {
+            return nb_sectors;
+        }
+
+        line = g_new0(WBCacheLine, 1);
+        line->index = index;
+        line->nb_sectors = MIN(s->line_sectors,
+                               nb_sectors - index * s->line_sectors);
+        line->data = qemu_blockalign(bs->file->bs,
+                                     s->line_sectors * BDRV_SECTOR_SIZE);
+        qemu_co_mutex_init(&line->lock);
+        g_hash_table_insert(s->lines, &line->index, line);
+        QTAILQ_INSERT_TAIL(&s->lru, line, lru_next);
+        s->nb_lines++;
+    }
+
+    wbcache_ref_line(s, line);
+    qemu_co_mutex_lock(&line->lock);
+    *pline = line;
+    return 0;
+}
+
+static int coroutine_fn wbcache_co_readv(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *qiov)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret;
+
+    while (nb_sectors > 0) {
+        int64_t index = sector_num / s->line_sectors;
+        int offset = sector_num % s->line_sectors;
+        int n = MIN(nb_sectors, s->line_sectors - offset);
+        WBCacheLine *line;
+
+        ret = wbcache_get_line(bs, index, &line);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = line->valid ? 0 : wbcache_fill(bs, line);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                line->data + offset * BDRV_SECTOR_SIZE,
+                                n * BDRV_SECTOR_SIZE);
+        }
+        wbcache_put_line(s, line);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn wbcache_co_writev(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret;
+
+    while (nb_sectors > 0) {
+        int64_t index = sector_num / s->line_sectors;
+        int offset = sector_num % s->line_sectors;
+        int n = MIN(nb_sectors, s->line_sectors - offset);
+        WBCacheLine *line;
+
+        ret = wbcache_get_line(bs, index, &line);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* Partial writes need the rest of the line first */
+        ret = 0;
+        if (!line->valid && (offset != 0 || n != line->nb_sectors)) {
+            ret = wbcache_fill(bs, line);
+        }
+        if (ret == 0) {
+            qemu_iovec_to_buf(qiov, qiov_offset,
+                              line->data + offset * BDRV_SECTOR_SIZE,
+                              n * BDRV_SECTOR_SIZE);
+            line->valid = true;
+            wbcache_mark_dirty(s, line);
+        }
+        wbcache_put_line(s, line);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    return wbcache_write_back_dirty(bs, s->max_dirty);
+}
+
+static int coroutine_fn wbcache_co_flush_to_os(BlockDriverState *bs)
+{
+    return wbcache_write_back_dirty(bs, 0);
+}
+
+static int coroutine_fn wbcache_co_discard(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    int64_t first = sector_num / s->line_sectors;
+    int64_t last = (sector_num + nb_sectors - 1) / s->line_sectors;
+    GPtrArray *lines = g_ptr_array_new();
+    WBCacheLine *line;
+    int ret = 0;
+    int i;
+
+    /* Collect the cached lines in the range before yielding */
+    QTAILQ_FOREACH(line, &s->lru, lru_next) {
+        if (line->index >= first && line->index <= last) {
+            g_ptr_array_add(lines, line);
+        }
+    }
+    for (i = 0; i < lines->len; i++) {
+        line = g_ptr_array_index(lines, i);
+        line->refcnt++;
+    }
+
+    /* Lines that are only partially discarded keep the rest of their data,
+     * all of them are dropped from the cache */
+    for (i = 0; i < lines->len; i++) {
+        int64_t start;
+
+        line = g_ptr_array_index(lines, i);
+        start = line->index * s->line_sectors;
+        qemu_co_mutex_lock(&line->lock);
+        if (ret == 0 && line->dirty &&
+            (start < sector_num ||
+             start + line->nb_sectors > sector_num + nb_sectors)) {
+            ret = wbcache_write_back(bs, line);
+        }
+        if (ret == 0) {
+            wbcache_mark_clean(s, line);
+            line->valid = false;
+        }
+        wbcache_put_line(s, line);
+    }
+    g_ptr_array_free(lines, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
+}
+
+static bool wbcache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_wbcache = {
+    .format_name                      = "wbcache",
+    .instance_size                    = sizeof(BDRVWBCacheState),
+
+    .bdrv_open                        = wbcache_open,
+    .bdrv_close                       = wbcache_close,
+    .bdrv_reopen_prepare              = wbcache_reopen_prepare,
+    .bdrv_getlength                   = wbcache_getlength,
+
+    .bdrv_co_readv                    = wbcache_co_readv,
+    .bdrv_co_writev                   = wbcache_co_writev,
+    .bdrv_co_flush_to_os              = wbcache_co_flush_to_os,
+    .bdrv_co_discard                  = wbcache_co_discard,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = wbcache_recurse_is_first_non_filter,
+};
+
+static void bdrv_wbcache_init(void)
+{
+    bdrv_register(&bdrv_wbcache);
+}
+
+block_init(bdrv_wbcache_init);
@@ -372,6 +372,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -478,6 +480,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
+    uint64_t throttling_latency_target;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -520,6 +524,21 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.weight",
+                                            THROTTLE_GROUP_WEIGHT_DEFAULT);
+    if (throttling_weight < THROTTLE_GROUP_WEIGHT_MIN ||
+        throttling_weight > THROTTLE_GROUP_WEIGHT_MAX) {
+        error_setg(errp, "throttling.weight must be between %d and %d",
+                   THROTTLE_GROUP_WEIGHT_MIN, THROTTLE_GROUP_WEIGHT_MAX);
+        goto early_err;
+    }
+    throttling_latency_target =
+        qemu_opt_get_number(opts, "throttling.latency-target", 0);
+    if (throttling_latency_target > INT64_MAX / SCALE_MS) {
+        error_setg(errp, "throttling.latency-target is too large");
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -578,6 +597,9 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             blk_rs->throttle_group = g_strdup(throttling_group);
             blk_rs->throttle_state = throttle_group_incref(throttling_group);
             blk_rs->throttle_state->cfg = cfg;
+            blk_rs->throttle_weight = throttling_weight;
+            blk_rs->throttle_latency_target_ns =
+                throttling_latency_target * SCALE_MS;
         }
 
         QDECREF(bs_opts);
@@ -613,6 +635,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             }
             bdrv_io_limits_enable(bs, throttling_group);
             bdrv_set_io_limits(bs, &cfg);
+            throttle_group_set_share(bs, throttling_weight,
+                                     throttling_latency_target * SCALE_MS);
         }
 
         if (bdrv_key_required(bs)) {
@@ -863,6 +887,8 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         { "iops_size",      "throttling.iops-size" },
 
         { "group",          "throttling.group" },
+        { "weight",         "throttling.weight" },
+        { "latency_target", "throttling.latency-target" },
 
         { "readonly",       "read-only" },
     };
@@ -1838,6 +1864,8 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
+                            bool has_max_chunk, int64_t max_chunk,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1876,6 +1904,8 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_workers, backup->max_workers,
+                    backup->has_max_chunk, backup->max_chunk,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1920,6 +1950,8 @@ static void do_blockdev_backup(const char *device, const char *target,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_workers, int64_t max_workers,
+                               bool has_max_chunk, int64_t max_chunk,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1965,6 +1997,8 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_workers, backup->max_workers,
+                       backup->has_max_chunk, backup->max_chunk,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2020,6 +2054,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2623,7 +2658,11 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_size,
                                int64_t iops_size,
                                bool has_group,
-                               const char *group, Error **errp)
+                               const char *group,
+                               bool has_weight,
+                               int64_t weight,
+                               bool has_latency_target,
+                               int64_t latency_target, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -2701,6 +2740,19 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         goto out;
     }
 
+    if (has_weight && (weight < THROTTLE_GROUP_WEIGHT_MIN ||
+                       weight > THROTTLE_GROUP_WEIGHT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "weight",
+                   "a value between 1 and 10000");
+        goto out;
+    }
+    if (has_latency_target &&
+        (latency_target < 0 || latency_target > INT64_MAX / SCALE_MS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "latency_target",
+                   "a non-negative value in milliseconds");
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2711,6 +2763,20 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         }
         /* Set the new throttling configuration */
         bdrv_set_io_limits(bs, &cfg);
+
+        if (has_weight || has_latency_target) {
+            unsigned cur_weight;
+            int64_t cur_latency_target_ns;
+
+            throttle_group_get_share(bs, &cur_weight, &cur_latency_target_ns);
+            if (has_weight) {
+                cur_weight = weight;
+            }
+            if (has_latency_target) {
+                cur_latency_target_ns = latency_target * SCALE_MS;
+            }
+            throttle_group_set_share(bs, cur_weight, cur_latency_target_ns);
+        }
     } else if (bs->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
@@ -2720,12 +2786,80 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    int ret;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    stats = blk_get_stats(blk);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    if (has_boundaries || has_boundaries_read) {
+        ret = block_latency_histogram_set(stats, BLOCK_ACCT_READ,
+                has_boundaries_read ? boundaries_read : boundaries);
+        if (ret) {
+            error_setg(errp, "Invalid read boundaries for device '%s'", device);
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_write) {
+        ret = block_latency_histogram_set(stats, BLOCK_ACCT_WRITE,
+                has_boundaries_write ? boundaries_write : boundaries);
+        if (ret) {
+            error_setg(errp, "Invalid write boundaries for device '%s'",
+                       device);
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_flush) {
+        ret = block_latency_histogram_set(stats, BLOCK_ACCT_FLUSH,
+                has_boundaries_flush ? boundaries_flush : boundaries);
+        if (ret) {
+            error_setg(errp, "Invalid flush boundaries for device '%s'",
+                       device);
+            goto out;
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2751,7 +2885,19 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2968,6 +3114,8 @@ void qmp_block_stream(const char *device,
                       bool has_base, const char *base,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_max_in_flight, int64_t max_in_flight,
+                      bool has_adaptive, bool adaptive,
                       bool has_on_error, BlockdevOnError on_error,
                       Error **errp)
 {
@@ -2981,6 +3129,12 @@ void qmp_block_stream(const char *device,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 1;
+    }
+    if (!has_adaptive) {
+        adaptive = false;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3024,7 +3178,8 @@ void qmp_block_stream(const char *device,
     base_name = has_backing_file ? backing_file : base_name;
 
     stream_start(bs, base_bs, base_name, has_speed ? speed : 0,
-                 on_error, block_job_cb, bs, &local_err);
+                 MIN(max_in_flight, INT_MAX), adaptive, on_error,
+                 block_job_cb, bs, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -3152,6 +3307,8 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
+                            bool has_max_chunk, int64_t max_chunk,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3178,6 +3335,12 @@ static void do_drive_backup(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
+    if (!has_max_chunk) {
+        max_chunk = 0;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3267,7 +3430,7 @@ static void do_drive_backup(const char *device, const char *target,
     }
 
     backup_start(bs, target_bs, speed, sync, bmap,
-                 on_source_error, on_target_error,
+                 on_source_error, on_target_error, max_workers, max_chunk,
                  block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -3287,6 +3450,8 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
+                      bool has_max_chunk, int64_t max_chunk,
                       Error **errp)
 {
     return do_drive_backup(device, target, has_format, format, sync,
@@ -3294,6 +3459,8 @@ void qmp_drive_backup(const char *device, const char *target,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_workers, max_workers,
+                           has_max_chunk, max_chunk,
                            NULL, errp);
 }
 
@@ -3309,6 +3476,8 @@ void do_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
+                         bool has_max_chunk, int64_t max_chunk,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk, *target_blk;
@@ -3326,6 +3495,12 @@ void do_blockdev_backup(const char *device, const char *target,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
+    if (!has_max_chunk) {
+        max_chunk = 0;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3357,7 +3532,8 @@ void do_blockdev_backup(const char *device, const char *target,
     bdrv_ref(target_bs);
     bdrv_set_aio_context(target_bs, aio_context);
     backup_start(bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+                 on_target_error, max_workers, max_chunk,
+                 block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -3373,11 +3549,15 @@ void qmp_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
+                         bool has_max_chunk, int64_t max_chunk,
                          Error **errp)
 {
     do_blockdev_backup(device, target, sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_workers, max_workers,
+                       has_max_chunk, max_chunk,
                        NULL, errp);
 }
 
@@ -3396,6 +3576,8 @@ static void blockdev_mirror_common(BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3417,6 +3599,9 @@ static void blockdev_mirror_common(BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3450,7 +3635,7 @@ static void blockdev_mirror_common(BlockDriverState *bs,
     mirror_start(bs, target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync,
-                 on_source_error, on_target_error, unmap,
+                 on_source_error, on_target_error, unmap, copy_mode,
                  block_job_cb, bs, errp);
 }
 
@@ -3466,6 +3651,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       bool has_unmap, bool unmap,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -3603,6 +3789,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            has_unmap, unmap,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3622,6 +3809,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3661,6 +3849,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -4099,7 +4288,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -4196,6 +4385,16 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group relative to its other "
+                    "members",
+        },{
+            .name = "throttling.latency-target",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time in milliseconds after which a throttled request "
+                    "is given precedence within the group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -4230,7 +4429,7 @@ static QemuOptsList qemu_root_bds_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "read-only",
             .type = QEMU_OPT_BOOL,
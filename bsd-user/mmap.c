@@ -69,6 +69,22 @@ void mmap_unlock(void)
 }
 #endif
 
+/* Translation is not done in parallel here, so the shared side of the
+   lock is just the exclusive one.  */
+void mmap_read_lock(void)
+{
+    mmap_lock();
+}
+
+void mmap_read_unlock(void)
+{
+    mmap_unlock();
+}
+
+void mmap_read_lock_reset(void)
+{
+}
+
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
 int target_mprotect(abi_ulong start, abi_ulong len, int prot)
 {
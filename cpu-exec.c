@@ -28,10 +28,12 @@
 #include "qemu/rcu.h"
 #include "exec/tb-hash.h"
 #include "exec/log.h"
+#include "exec/helper-proto.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
 #include "hw/i386/apic.h"
 #endif
 #include "sysemu/replay.h"
+#include "qemu/main-loop.h"
 
 /* -icount align implementation. */
 
@@ -157,6 +159,7 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, uint8_t *tb_ptr)
     cpu->can_do_io = !use_icount;
     next_tb = tcg_qemu_tb_exec(env, tb_ptr);
     cpu->can_do_io = 1;
+    cpu->tb_exit_count++;
     trace_exec_tb_exit((void *) (next_tb & ~TB_EXIT_MASK),
                        next_tb & TB_EXIT_MASK);
 
@@ -195,112 +198,173 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
+    tb_ctx.tb_invalidated_flag = 0;
     tb = tb_gen_code(cpu, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles | CF_NOCACHE
                          | (ignore_icount ? CF_IGNORE_ICOUNT : 0));
-    tb->orig_tb = tcg_ctx.tb_ctx.tb_invalidated_flag ? NULL : orig_tb;
+    tb->orig_tb = tb_ctx.tb_invalidated_flag ? NULL : orig_tb;
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
-static TranslationBlock *tb_find_physical(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint64_t flags)
+/* Execute the instruction that raised EXCP_ATOMIC on its own, translated
+ * with parallel_cpus cleared so that its atomic operations become plain
+ * loads and stores.  The caller must have stopped all other vCPUs.
+ * Exceptions raised by the instruction are left pending for cpu_exec().
+ */
+void cpu_exec_step_atomic(CPUState *cpu)
 {
+    CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb) {
-            return NULL;
-        }
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    break;
-                }
-            } else {
-                break;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    current_cpu = cpu;
+    rcu_read_lock();
+    parallel_cpus = false;
+
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        cc->cpu_exec_enter(cpu);
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+
+        mmap_lock();
+        tb_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags,
+                         1 | CF_NOCACHE | CF_IGNORE_ICOUNT);
+        tb->orig_tb = NULL;
+        tb_unlock();
+        mmap_unlock();
+
+        cpu->current_tb = tb;
+        trace_exec_tb_nocache(tb, tb->pc);
+        cpu_tb_exec(cpu, tb->tc_ptr);
+        cpu->current_tb = NULL;
+        cc->cpu_exec_exit(cpu);
+
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* The instruction faulted; cpu_loop_exit() already restored the
+           guest state, drop whatever locks it held.  */
+        tb_lock_reset();
+        tcg_atomic_lock_reset();
+        cc->cpu_exec_exit(cpu);
+    }
+
+    parallel_cpus = true;
+    rcu_read_unlock();
+}
+
+struct tb_desc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+};
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
+    return false;
+}
 
-    /* Move the TB to the head of the list */
-    *ptb1 = tb->phys_hash_next;
-    tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    return tb;
+/* Look up a TB in the physical hash table.  This is lock-free; the caller
+   must be in an RCU read-side critical section, which is always the case
+   for vCPU threads running cpu_exec().  */
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    tb_page_addr_t phys_pc;
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = (CPUArchState *)cpu->env_ptr;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.pc = pc;
+    phys_pc = get_page_addr_code(desc.env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags);
+    return qht_lookup(&tb_ctx.htable, tb_cmp, &desc, h);
 }
 
 static TranslationBlock *tb_find_slow(CPUState *cpu,
                                       target_ulong pc,
                                       target_ulong cs_base,
-                                      uint64_t flags)
+                                      uint64_t flags,
+                                      uintptr_t *next_tb)
 {
     TranslationBlock *tb;
 
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
+    tb = tb_htable_lookup(cpu, pc, cs_base, flags);
     if (tb) {
         goto found;
     }
 
-#ifdef CONFIG_USER_ONLY
     /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
+     * taken outside tb_lock.  Translation only needs the shared side,
+     * so that threads can translate in parallel.  Another vCPU may
+     * have translated the block while we were waiting for the locks,
+     * so look it up again.
      */
-    tb_unlock();
-    mmap_lock();
+    mmap_read_lock();
     tb_lock();
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb_ctx.tb_invalidated_flag = 0;
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        if (tb_ctx.tb_invalidated_flag) {
+            /* as some TB could have been invalidated because
+               of memory exceptions while generating the code, we
+               must not chain to the previous TB */
+            *next_tb = 0;
+        }
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
-#ifdef CONFIG_USER_ONLY
-    mmap_unlock();
-#endif
+    tb_unlock();
+    mmap_read_unlock();
 
 found:
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
-static inline TranslationBlock *tb_find_fast(CPUState *cpu)
+static inline TranslationBlock *tb_find_fast(CPUState *cpu,
+                                             uintptr_t *next_tb)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
     TranslationBlock *tb;
@@ -311,14 +375,101 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
-        tb = tb_find_slow(cpu, pc, cs_base, flags);
+        tb = tb_find_slow(cpu, pc, cs_base, flags, next_tb);
     }
     return tb;
 }
 
+#ifdef TARGET_HAS_HOT_TB
+/* Count one more entry into TB and, once it has reached TB_HOT_THRESHOLD,
+   replace it with a CF_HOT translation of the same code.  The target's
+   translator may then spend more effort on the block, e.g. by following
+   direct jumps so that the optimizer sees a longer stretch of code.  */
+static TranslationBlock *tb_check_hot(CPUState *cpu, TranslationBlock *tb,
+                                      uintptr_t *next_tb)
+{
+    TranslationBlock *hot_tb;
+    uint32_t count;
+
+    if (likely(tb->cflags & CF_HOT) || use_icount) {
+        return tb;
+    }
+    count = atomic_read(&tb->exec_count) + 1;
+    atomic_set(&tb->exec_count, count);
+    if (likely(count < TB_HOT_THRESHOLD)) {
+        return tb;
+    }
+
+    mmap_read_lock();
+    tb_lock();
+    if (tb->invalid) {
+        /* another vCPU got here first, or the code was modified */
+        tb_unlock();
+        mmap_read_unlock();
+        return tb_find_slow(cpu, tb->pc, tb->cs_base, tb->flags, next_tb);
+    }
+    tb_phys_invalidate(tb, -1);
+    tb_ctx.tb_invalidated_flag = 0;
+    hot_tb = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags, CF_HOT);
+    tb_ctx.tb_hot_count++;
+    /* the old TB may be the one we came from; never chain to it */
+    *next_tb = 0;
+    tb_unlock();
+    mmap_read_unlock();
+
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(hot_tb->pc)],
+               hot_tb);
+    return hot_tb;
+}
+#endif
+
+/* Called from generated code at the end of a TB that finished with an
+   indirect branch (see tcg_gen_lookup_and_goto_ptr).  Returns the host
+   address of the next TB, or the epilogue if the TB must be looked up or
+   translated by cpu_exec().  Never translates code, so it does not need
+   tb_lock.  */
+void *HELPER(lookup_tb_ptr)(void *opaque)
+{
+    CPUArchState *env = opaque;
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+        if (!tb) {
+            return tcg_ctx->code_gen_epilogue;
+        }
+        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    }
+    if (unlikely(atomic_read(&tb->invalid))) {
+        return tcg_ctx->code_gen_epilogue;
+    }
+#ifdef TARGET_HAS_HOT_TB
+    if (!(tb->cflags & CF_HOT) && !use_icount) {
+        uint32_t count = atomic_read(&tb->exec_count) + 1;
+
+        /* let cpu_exec() retranslate it */
+        if (unlikely(count >= TB_HOT_THRESHOLD)) {
+            return tcg_ctx->code_gen_epilogue;
+        }
+        atomic_set(&tb->exec_count, count);
+    }
+#endif
+    if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
+        qemu_log("Chain %p [" TARGET_FMT_lx "] %s\n",
+                 tb->tc_ptr, pc, lookup_symbol(pc));
+    }
+    return tb->tc_ptr;
+}
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -355,8 +506,14 @@ int cpu_exec(CPUState *cpu)
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
+            if (qemu_tcg_mttcg_enabled()) {
+                qemu_mutex_lock_iothread();
+            }
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            if (qemu_tcg_mttcg_enabled()) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -421,7 +578,7 @@ int cpu_exec(CPUState *cpu)
             } else if (replay_has_exception()
                        && cpu->icount_decr.u16.low + cpu->icount_extra == 0) {
                 /* try to cause an exception pending in the log */
-                cpu_exec_nocache(cpu, 1, tb_find_fast(cpu), true);
+                cpu_exec_nocache(cpu, 1, tb_find_fast(cpu, &next_tb), true);
                 ret = -1;
                 break;
             }
@@ -430,6 +587,14 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#ifndef CONFIG_USER_ONLY
+                    /* Interrupt controllers are protected by the BQL,
+                       which multi-threaded TCG does not hold while
+                       executing translated code.  */
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_lock_iothread();
+                    }
+#endif
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -482,6 +647,11 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#ifndef CONFIG_USER_ONLY
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_unlock_iothread();
+                    }
+#endif
                 }
                 if (unlikely(cpu->exit_request
                              || replay_has_interrupt())) {
@@ -489,17 +659,10 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                tb_lock();
-                tb = tb_find_fast(cpu);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-                }
+                tb = tb_find_fast(cpu, &next_tb);
+#ifdef TARGET_HAS_HOT_TB
+                tb = tb_check_hot(cpu, tb, &next_tb);
+#endif
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
@@ -509,10 +672,19 @@ int cpu_exec(CPUState *cpu)
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1
                     && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb;
+
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    tb_lock();
+                    /* either TB may have been invalidated since the
+                       lock-free lookup; never chain to or from it */
+                    if (!last_tb->invalid && !tb->invalid &&
+                        !last_tb->jmp_next[next_tb & TB_EXIT_MASK]) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                        tb_ctx.tb_chain_count++;
+                    }
+                    tb_unlock();
                 }
-                tb_unlock();
                 if (likely(!cpu->exit_request)) {
                     trace_exec_tb(tb, tb->pc);
                     tc_ptr = tb->tc_ptr;
@@ -591,6 +763,15 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            tcg_atomic_lock_reset();
+            mmap_read_lock_reset();
+#ifndef CONFIG_USER_ONLY
+            /* We may have longjmp'ed out of interrupt delivery or of a
+               device access with the BQL held.  */
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
+#endif
         }
     } /* for(;;) */
 
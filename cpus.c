@@ -43,6 +43,7 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "sysemu/numa.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -70,6 +71,38 @@ static CPUState *next_cpu;
 int64_t max_delay;
 int64_t max_advance;
 
+/* multi-threaded TCG: one host thread per vCPU */
+bool mttcg_enabled;
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t) {
+        return;
+    }
+    if (strcmp(t, "multi") == 0) {
+#ifdef TARGET_SUPPORTS_MTTCG
+        if (use_icount) {
+            error_setg(errp, "No icount under multi-threaded TCG");
+        } else if (replay_mode != REPLAY_MODE_NONE) {
+            error_setg(errp, "No record/replay under multi-threaded TCG");
+        } else {
+            mttcg_enabled = true;
+            parallel_cpus = true;
+        }
+#else
+        error_setg(errp, "Multi-threaded TCG is not supported for this "
+                   "guest on this host");
+#endif
+    } else if (strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+        parallel_cpus = false;
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
@@ -540,20 +573,30 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+int cpu_throttle_get_cpu_percentage(CPUState *cpu)
+{
+    return MAX(atomic_read(&throttle_percentage),
+               atomic_read(&cpu->throttle_percentage));
+}
+
 static void cpu_throttle_thread(void *opaque)
 {
     CPUState *cpu = opaque;
-    double pct;
-    double throttle_ratio;
+    double pct, max_pct;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_cpu_percentage(cpu)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* The timer ticks at the period of the most throttled vcpu; sleep
+     * for our own share of that period.  For the most throttled vcpu
+     * this is pct / (1 - pct) timeslices.
+     */
+    pct = (double)cpu_throttle_get_cpu_percentage(cpu) / 100;
+    max_pct = (double)cpu_throttle_get_percentage() / 100;
+    sleeptime_ns = (long)(pct * CPU_THROTTLE_TIMESLICE_NS / (1 - max_pct));
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -571,7 +614,8 @@ static void cpu_throttle_timer_tick(void *opaque)
         return;
     }
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_cpu_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
         }
     }
@@ -593,9 +637,32 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_cpu(CPUState *cpu, int new_throttle_pct)
+{
+    bool was_active = cpu_throttle_active();
+
+    /* 0 leaves the vcpu alone */
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (!was_active && new_throttle_pct) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -605,7 +672,13 @@ bool cpu_throttle_active(void)
 
 int cpu_throttle_get_percentage(void)
 {
-    return atomic_read(&throttle_percentage);
+    CPUState *cpu;
+    int pct = atomic_read(&throttle_percentage);
+
+    CPU_FOREACH(cpu) {
+        pct = MAX(pct, atomic_read(&cpu->throttle_percentage));
+    }
+    return pct;
 }
 
 void cpu_ticks_init(void)
@@ -888,12 +961,19 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* exclusive sections for multi-threaded TCG, protected by the BQL */
+static int pending_cpus;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
@@ -912,6 +992,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
+    wi.exclusive = false;
 
     qemu_mutex_lock(&cpu->work_mutex);
     if (cpu->queued_work_first == NULL) {
@@ -933,6 +1014,22 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+
+    qemu_cpu_kick(cpu);
+}
+
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item *wi;
@@ -947,18 +1044,83 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->data = data;
     wi->free = true;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
+    queue_work_on_cpu(cpu, wi);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+
+    queue_work_on_cpu(cpu, wi);
+}
+
+/* Wait for pending exclusive operations to complete.  The BQL must be
+ * held; it is released while waiting.
+ */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &qemu_global_mutex);
     }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+}
 
-    qemu_cpu_kick(cpu);
+/* Start an exclusive operation: kick every vCPU that is executing
+ * translated code and wait until all of them have left cpu_exec().
+ * Must be called with the BQL held and from outside cpu_exec().
+ */
+static void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    exclusive_idle();
+
+    pending_cpus = 1;
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            qemu_cpu_kick(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.
+ * Called with the BQL held.
+ */
+static void cpu_exec_start(CPUState *cpu)
+{
+    exclusive_idle();
+    cpu->running = true;
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.
+ * Called with the BQL held.
+ */
+static void cpu_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
 }
 
 static void flush_queued_work(CPUState *cpu)
@@ -977,7 +1139,13 @@ static void flush_queued_work(CPUState *cpu)
             cpu->queued_work_last = NULL;
         }
         qemu_mutex_unlock(&cpu->work_mutex);
-        wi->func(wi->data);
+        if (wi->exclusive) {
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
         qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
@@ -1015,6 +1183,15 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+static void qemu_tcg_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -1155,6 +1332,55 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUState *cpu);
+
+/* Multi-threaded TCG
+ *
+ * Each vCPU runs in its own host thread and executes translated code
+ * without holding the BQL.  The BQL is taken back for device accesses,
+ * interrupt delivery and while waiting for work; exclusive sections
+ * (e.g. flushing the translation cache) wait for every vCPU to leave
+ * cpu_exec() first.
+ */
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            cpu_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu);
+            qemu_mutex_lock_iothread();
+            cpu_exec_end(cpu);
+            current_cpu = cpu;
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            } else if (r == EXCP_ATOMIC) {
+                start_exclusive();
+                cpu_exec_step_atomic(cpu);
+                end_exclusive();
+            }
+        }
+        qemu_tcg_mttcg_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1190,7 +1416,9 @@ static void qemu_cpu_kick_no_halt(void)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (tcg_enabled()) {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        cpu_exit(cpu);
+    } else if (tcg_enabled()) {
         qemu_cpu_kick_no_halt();
     } else {
         qemu_cpu_kick_thread(cpu);
@@ -1220,20 +1448,20 @@ bool qemu_mutex_iothread_locked(void)
     return iothread_locked;
 }
 
-void qemu_mutex_lock_iothread(void)
+void qemu_mutex_lock_iothread_impl(QemuLockSite *site)
 {
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
      * TCG code execution.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
-        qemu_mutex_lock(&qemu_global_mutex);
+        qemu_mutex_lock_impl(&qemu_global_mutex, site);
         atomic_dec(&iothread_requesting_mutex);
     } else {
-        if (qemu_mutex_trylock(&qemu_global_mutex)) {
+        if (qemu_mutex_trylock_impl(&qemu_global_mutex, site)) {
             qemu_cpu_kick_no_halt();
-            qemu_mutex_lock(&qemu_global_mutex);
+            qemu_mutex_lock_impl(&qemu_global_mutex, site);
         }
         atomic_dec(&iothread_requesting_mutex);
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
@@ -1272,7 +1500,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1315,6 +1543,26 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     static QemuCond *tcg_halt_cond;
     static QemuThread *tcg_cpu_thread;
 
+    if (qemu_tcg_mttcg_enabled()) {
+        /* one thread per vCPU */
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+        numa_cpu_set_affinity(cpu);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1349,6 +1597,7 @@ static void qemu_kvm_start_vcpu(CPUState *cpu)
              cpu->cpu_index);
     qemu_thread_create(cpu->thread, thread_name, qemu_kvm_cpu_thread_fn,
                        cpu, QEMU_THREAD_JOINABLE);
+    numa_cpu_set_affinity(cpu);
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
@@ -1365,6 +1614,7 @@ static void qemu_dummy_start_vcpu(CPUState *cpu)
              cpu->cpu_index);
     qemu_thread_create(cpu->thread, thread_name, qemu_dummy_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
+    numa_cpu_set_affinity(cpu);
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
@@ -23,18 +23,297 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
 
 #include "exec/cputlb.h"
+#include "exec/tb-hash.h"
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+unsigned tlb_flush_remote_count;
+unsigned tlb_flush_batch_count;
+unsigned tlb_flush_batch_full_count;
+
+/* With multi-threaded TCG a vCPU's TLB may only be modified by the
+ * thread running that vCPU; flushes requested from elsewhere are
+ * queued as work for the owning vCPU.
+ */
+static inline bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu);
+}
+
+/* all the MMU modes, for the idxmap argument of the range flushes */
+#define ALL_MMUIDX_BITS ((1UL << NB_MMU_MODES) - 1)
+
+/* Flushes requested for a vCPU by other threads are collected here until
+ * the vCPU runs them, so that a burst of page flushes costs a single work
+ * item.  When the batch overflows it is turned into a full flush.
+ */
+#define TLB_FLUSH_BATCH_SIZE 16
+
+typedef struct TLBFlushBatch {
+    QemuMutex lock;
+    /* a work item to run the batch is queued on the vCPU */
+    bool queued;
+    bool flush_all;
+    int n_ranges;
+    struct {
+        target_ulong addr;
+        target_ulong len;
+    } ranges[TLB_FLUSH_BATCH_SIZE];
+} TLBFlushBatch;
+
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global);
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr);
+static void tlb_flush_range_nocheck(CPUState *cpu, target_ulong addr,
+                                    target_ulong len);
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The use of a TLB is measured over windows of this length; the TLB is
+ * shrunk only when it stayed underused for a whole window.
+ */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+static CPUTLBTables *tlb_tables_new(size_t n_entries)
+{
+    CPUTLBTables *t = g_new(CPUTLBTables, 1);
+
+    t->n_entries = n_entries;
+    t->table = g_new(CPUTLBEntry, n_entries);
+    t->iotlb = g_new(CPUIOTLBEntry, n_entries);
+    return t;
+}
+
+static void tlb_tables_free(CPUTLBTables *t)
+{
+    g_free(t->table);
+    g_free(t->iotlb);
+    g_free(t);
+}
+
+/* Point the fields of env that the fast path uses at the current tables;
+ * they are cleared when the CPU is reset.
+ */
+static void tlb_tables_load(CPUState *cpu, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBTables *t = cpu->tlb_tables[mmu_idx];
+
+    env->tlb_table[mmu_idx] = t->table;
+    env->iotlb[mmu_idx] = t->iotlb;
+    env->tlb_mask[mmu_idx] = (t->n_entries - 1) << CPU_TLB_ENTRY_BITS;
+}
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = 0;
+}
+
+/* Called before the TLB of MMU_IDX is flushed.  Grow the TLB when more
+ * than 70% of it was in use at some flush in the current window, shrink
+ * it when less than 30% was used during a whole window.  Shrinking is
+ * done lazily so that a guest that periodically flushes its TLB, e.g. on
+ * every context switch, does not see it shrink in between.
+ */
+static void tlb_mmu_resize(CPUState *cpu, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    CPUTLBTables *old = cpu->tlb_tables[mmu_idx];
+    size_t old_size = old->n_entries;
+    size_t new_size = old_size;
+    int64_t now = get_clock_realtime();
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+    size_t rate;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    desc->n_used_entries = 0;
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+
+        /* keep clear of the growth threshold after shrinking */
+        if (desc->window_max_entries * 100 / ceil > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size != old_size) {
+        atomic_rcu_set(&cpu->tlb_tables[mmu_idx], tlb_tables_new(new_size));
+        call_rcu(old, tlb_tables_free, rcu);
+        window_expired = true;
+    }
+    if (window_expired) {
+        tlb_window_reset(desc, now);
+    }
+    tlb_tables_load(cpu, mmu_idx);
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, int mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries++;
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, int mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries--;
+}
+
+static void tlb_dyn_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = get_clock_realtime();
+    int mmu_idx;
+
+    cpu->tlb_tables = g_new(CPUTLBTables *, NB_MMU_MODES);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+
+        tlb_window_reset(desc, now);
+        desc->n_used_entries = 0;
+        cpu->tlb_tables[mmu_idx] =
+            tlb_tables_new(1 << CPU_TLB_DYN_DEFAULT_BITS);
+        tlb_tables_load(cpu, mmu_idx);
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    }
+}
+#else
+static inline void tlb_mmu_resize(CPUState *cpu, int mmu_idx)
+{
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, int mmu_idx)
+{
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, int mmu_idx)
+{
+}
+
+static inline void tlb_dyn_init(CPUState *cpu)
+{
+}
+#endif
+
+void tlb_init(CPUState *cpu)
+{
+    tlb_dyn_init(cpu);
+
+    cpu->tlb_flush_batch = g_new0(TLBFlushBatch, 1);
+    qemu_mutex_init(&cpu->tlb_flush_batch->lock);
+}
+
+/* Flush the main and victim TLB of MMU_IDX.  */
+static void tlb_flush_one_mmuidx(CPUState *cpu, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+
+    tlb_mmu_resize(cpu, mmu_idx);
+    memset(env->tlb_table[mmu_idx], -1,
+           tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+}
+
+static void tlb_flush_batch_work(void *opaque)
+{
+    CPUState *cpu = opaque;
+    TLBFlushBatch *batch = cpu->tlb_flush_batch;
+    TLBFlushBatch todo;
+    int i;
+
+    /* Take the batch over, so that flushes requested from now on are
+       collected (and queued) anew.  */
+    qemu_mutex_lock(&batch->lock);
+    todo.flush_all = batch->flush_all;
+    todo.n_ranges = batch->n_ranges;
+    memcpy(todo.ranges, batch->ranges,
+           batch->n_ranges * sizeof(batch->ranges[0]));
+    batch->queued = false;
+    batch->flush_all = false;
+    batch->n_ranges = 0;
+    qemu_mutex_unlock(&batch->lock);
+
+    atomic_inc(&tlb_flush_batch_count);
+    if (todo.flush_all) {
+        atomic_inc(&tlb_flush_batch_full_count);
+        tlb_flush_nocheck(cpu, 1);
+        return;
+    }
+    for (i = 0; i < todo.n_ranges; i++) {
+        if (todo.ranges[i].len == TARGET_PAGE_SIZE) {
+            tlb_flush_page_nocheck(cpu, todo.ranges[i].addr);
+        } else {
+            tlb_flush_range_nocheck(cpu, todo.ranges[i].addr,
+                                    todo.ranges[i].len);
+        }
+    }
+}
+
+/* Add a flush of [ADDR, ADDR + LEN) to the batch of CPU, or a full flush
+ * if LEN is zero, and make sure that the batch will be run.
+ */
+static void tlb_flush_batch_add(CPUState *cpu, target_ulong addr,
+                                target_ulong len)
+{
+    TLBFlushBatch *batch = cpu->tlb_flush_batch;
+    bool queue;
+    int i;
+
+    atomic_inc(&tlb_flush_remote_count);
+
+    qemu_mutex_lock(&batch->lock);
+    if (len == 0 || len > TLB_FLUSH_BATCH_SIZE * TARGET_PAGE_SIZE) {
+        batch->flush_all = true;
+    } else if (!batch->flush_all) {
+        addr &= TARGET_PAGE_MASK;
+        for (i = 0; i < batch->n_ranges; i++) {
+            if (batch->ranges[i].addr == addr &&
+                batch->ranges[i].len >= len) {
+                break;
+            }
+        }
+        if (i == batch->n_ranges) {
+            if (i == TLB_FLUSH_BATCH_SIZE) {
+                batch->flush_all = true;
+            } else {
+                batch->ranges[i].addr = addr;
+                batch->ranges[i].len = len;
+                batch->n_ranges++;
+            }
+        }
+    }
+    queue = !batch->queued;
+    batch->queued = true;
+    qemu_mutex_unlock(&batch->lock);
+
+    if (queue) {
+        async_run_on_cpu(cpu, tlb_flush_batch_work, cpu);
+    }
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -48,9 +327,10 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx, i;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -59,20 +339,30 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(cpu, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    for (i = 0; i < CPU_TLB_LARGE_RANGES; i++) {
+        env->tlb_large[i].addr = -1;
+        env->tlb_large[i].mask = 0;
+    }
     tlb_flush_count++;
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+void tlb_flush(CPUState *cpu, int flush_global)
 {
-    CPUArchState *env = cpu->env_ptr;
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_batch_add(cpu, 0, 0);
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
+}
 
+static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+{
 #if defined(DEBUG_TLB)
     printf("tlb_flush_by_mmuidx:");
 #endif
@@ -91,8 +381,7 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
         printf(" %d", mmu_idx);
 #endif
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx(cpu, mmu_idx);
     }
 
 #if defined(DEBUG_TLB)
@@ -105,12 +394,20 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+
+    if (tlb_flush_is_remote(cpu)) {
+        /* Flushing more than requested is always allowed.  */
+        tlb_flush(cpu, 1);
+        return;
+    }
+
     va_start(argp, cpu);
     v_tlb_flush_by_mmuidx(cpu, argp);
     va_end(argp);
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Return true if the entry matched ADDR and was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -119,78 +416,193 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static inline void tlb_flush_main_entry(CPUArchState *env, int mmu_idx,
+                                        target_ulong addr)
+{
+    if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+        tlb_n_used_entries_dec(env, mmu_idx);
+    }
+}
+
+/* Return true if TLB_ADDR is a valid comparator for a page within
+ * [START, LAST], both page aligned.
+ */
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong start,
+                                 target_ulong last)
+{
+    target_ulong page = tlb_addr & TARGET_PAGE_MASK;
+
+    return !(tlb_addr & TLB_INVALID_MASK) && page >= start && page <= last;
+}
+
+static inline bool tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong start,
+                                         target_ulong last)
+{
+    if (tlb_hit_range(tlb_entry->addr_read, start, last) ||
+        tlb_hit_range(tlb_entry->addr_write, start, last) ||
+        tlb_hit_range(tlb_entry->addr_code, start, last)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+/* Flush the entries for the pages in [START, LAST] from the TLBs of the
+ * MMU modes in IDXMAP.  Small ranges are flushed page by page, larger
+ * ones by scanning the whole TLB, so that the cost is bounded by the
+ * size of the TLB.
+ */
+static void tlb_flush_range_by_mmuidx_nocheck(CPUState *cpu,
+                                              target_ulong start,
+                                              target_ulong last,
+                                              unsigned long idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
+    target_ulong npages = ((last - start) >> TARGET_PAGE_BITS) + 1;
+    target_ulong i;
+    int mmu_idx, k;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!test_bit(mmu_idx, &idxmap)) {
+            continue;
+        }
+        if (npages < tlb_n_entries(env, mmu_idx)) {
+            for (i = 0; i < npages; i++) {
+                tlb_flush_main_entry(env, mmu_idx,
+                                     start + (i << TARGET_PAGE_BITS));
+            }
+        } else {
+            for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
+                if (tlb_flush_entry_range(&env->tlb_table[mmu_idx][i],
+                                          start, last)) {
+                    tlb_n_used_entries_dec(env, mmu_idx);
+                }
+            }
+        }
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][k], start, last);
+        }
+    }
+
+    if (npages < TB_JMP_PAGE_SIZE) {
+        for (i = 0; i < npages; i++) {
+            tb_flush_jmp_cache(cpu, start + (i << TARGET_PAGE_BITS));
+        }
+    } else {
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    }
+}
+
+/* Flush [START, LAST] and, since a large page is held in the TLB as
+ * several TARGET_PAGE_SIZE entries, every recorded large page range that
+ * intersects it.  The records can be dropped only if all MMU modes are
+ * flushed.
+ */
+static void tlb_flush_range_large_nocheck(CPUState *cpu, target_ulong start,
+                                          target_ulong last,
+                                          unsigned long idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    bool all = idxmap == ALL_MMUIDX_BITS;
     int i;
-    int mmu_idx;
 
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (i = 0; i < CPU_TLB_LARGE_RANGES; i++) {
+        CPUTLBLargeRange *r = &env->tlb_large[i];
+        target_ulong r_last = r->addr | ~r->mask;
+
+        if (r->addr == -1 || r->addr > last || r_last < start) {
+            continue;
+        }
+#if defined(DEBUG_TLB)
+        printf("tlb_flush: large page range " TARGET_FMT_lx "/"
+               TARGET_FMT_lx "\n", r->addr, r->mask);
+#endif
+        tlb_flush_range_by_mmuidx_nocheck(cpu, r->addr,
+                                          r_last & TARGET_PAGE_MASK, idxmap);
+        if (all) {
+            r->addr = -1;
+            r->mask = 0;
+        }
+    }
+    tlb_flush_range_by_mmuidx_nocheck(cpu, start, last, idxmap);
+}
+
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
+{
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+    addr &= TARGET_PAGE_MASK;
+    tlb_flush_range_large_nocheck(cpu, addr, addr, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_batch_add(cpu, addr, TARGET_PAGE_SIZE);
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
+
+static void tlb_flush_range_nocheck(CPUState *cpu, target_ulong addr,
+                                    target_ulong len)
+{
+    target_ulong last;
+
 #if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+    printf("tlb_flush_range: " TARGET_FMT_lx "/" TARGET_FMT_lx "\n",
+           addr, len);
 #endif
-        tlb_flush(cpu, 1);
+    if (len == 0) {
         return;
     }
-    /* must reset current TB so that interrupts cannot modify the
-       links while we are modifying them */
-    cpu->current_tb = NULL;
-
+    last = (addr + len - 1) & TARGET_PAGE_MASK;
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+    if (last < addr) {
+        /* wraps around the end of the address space */
+        tlb_flush_range_large_nocheck(cpu, addr, -TARGET_PAGE_SIZE,
+                                      ALL_MMUIDX_BITS);
+        addr = 0;
     }
+    tlb_flush_range_large_nocheck(cpu, addr, last, ALL_MMUIDX_BITS);
+}
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        if (len != 0) {
+            tlb_flush_batch_add(cpu, addr, len);
         }
+    } else {
+        tlb_flush_range_nocheck(cpu, addr, len);
     }
-
-    tb_flush_jmp_cache(cpu, addr);
 }
 
 void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
+    unsigned long idxmap = 0;
     va_list argp;
 
-    va_start(argp, addr);
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_page(cpu, addr);
+        return;
+    }
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page_by_mmu_idx: " TARGET_FMT_lx, addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf(" forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
-#endif
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
-        return;
-    }
-    /* must reset current TB so that interrupts cannot modify the
-       links while we are modifying them */
-    cpu->current_tb = NULL;
-
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
+    va_start(argp, addr);
     for (;;) {
         int mmu_idx = va_arg(argp, int);
 
@@ -201,13 +613,7 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 #if defined(DEBUG_TLB)
         printf(" %d", mmu_idx);
 #endif
-
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        set_bit(mmu_idx, &idxmap);
     }
     va_end(argp);
 
@@ -215,7 +621,8 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     printf("\n");
 #endif
 
-    tb_flush_jmp_cache(cpu, addr);
+    addr &= TARGET_PAGE_MASK;
+    tlb_flush_range_large_nocheck(cpu, addr, addr, idxmap);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -262,6 +669,9 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/* Called from an RCU critical section; with MTTCG the vCPU may be
+ * flushing and resizing its TLB at the same time.
+ */
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
@@ -270,11 +680,18 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 
     env = cpu->env_ptr;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        unsigned int i;
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        CPUTLBTables *t = atomic_rcu_read(&cpu->tlb_tables[mmu_idx]);
+        CPUTLBEntry *table = t->table;
+        size_t n = t->n_entries;
+#else
+        CPUTLBEntry *table = env->tlb_table[mmu_idx];
+        size_t n = CPU_TLB_SIZE;
+#endif
+        size_t i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
-            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                  start1, length);
+        for (i = 0; i < n; i++) {
+            tlb_reset_dirty_range(&table[i], start1, length);
         }
 
         for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -296,13 +713,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -313,27 +728,47 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
     }
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
+/* Our TLB does not support large pages, so remember the areas covered by
+   large pages, so that flushing any page within one flushes all of it.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
                                target_ulong size)
 {
     target_ulong mask = ~(size - 1);
+    target_ulong best_mask = 0;
+    CPUTLBLargeRange *best = NULL;
+    int i;
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
-        return;
+    for (i = 0; i < CPU_TLB_LARGE_RANGES; i++) {
+        CPUTLBLargeRange *r = &env->tlb_large[i];
+
+        if (r->addr == (target_ulong)-1) {
+            r->addr = vaddr & mask;
+            r->mask = mask;
+            return;
+        }
+        if ((vaddr & r->mask) == r->addr && (r->mask & ~mask) == 0) {
+            /* already covered */
+            return;
+        }
     }
-    /* Extend the existing region to include the new page.
-       This is a compromise between unnecessary flushes and the cost
-       of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
-        mask <<= 1;
+
+    /* All the ranges are in use.  Extend the one that grows the least to
+       include the new page.  This is a compromise between unnecessary
+       flushes and the cost of maintaining a full variable size TLB.  */
+    for (i = 0; i < CPU_TLB_LARGE_RANGES; i++) {
+        CPUTLBLargeRange *r = &env->tlb_large[i];
+        target_ulong m = mask & r->mask;
+
+        while (((r->addr ^ vaddr) & m) != 0) {
+            m <<= 1;
+        }
+        if (!best || m > best_mask) {
+            best = r;
+            best_mask = m;
+        }
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    best->addr &= best_mask;
+    best->mask = best_mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -385,13 +820,16 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     }
 
     code_address = address;
-    iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
-                                            prot, &address);
+    iotlb = memory_region_section_get_iotlb(cpu, asidx, section, vaddr, paddr,
+                                            xlat, prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
+    if (tlb_entry_is_empty(te)) {
+        tlb_n_used_entries_inc(env, mmu_idx);
+    }
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
 
@@ -451,11 +889,13 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        /* the fill may have flushed and resized the TLB */
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     iotlbentry = &env1->iotlb[mmu_idx][page_index];
     pd = iotlbentry->addr & ~TARGET_PAGE_MASK;
@@ -489,6 +929,141 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #include "softmmu_template.h"
 #undef MMUSUFFIX
 
+/* Probe for an atomic read-modify-write access at ADDR, as described by
+ * OI, and return its host address.  Return NULL for I/O, which takes the
+ * slow path under tcg_atomic_lock.  Accesses to RAM that host atomics
+ * cannot perform, i.e. unaligned ones and those hitting a watchpoint, are
+ * instead emulated with the other vCPUs stopped, see EXCP_ATOMIC.
+ */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    unsigned mmu_idx = get_mmuidx(oi);
+    TCGMemOp mop = get_memop(oi);
+    int size = 1 << (mop & MO_SIZE);
+    uintptr_t index = tlb_index(env, mmu_idx, addr);
+    target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    void *haddr;
+
+    /* Adjust the given return address.  */
+    retaddr -= GETPC_ADJ;
+
+    if (unlikely(addr & (size - 1))) {
+        if ((mop & MO_AMASK) == MO_ALIGN) {
+            cpu_unaligned_access(cpu, addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        }
+        goto stop_the_world;
+    }
+
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(cpu, addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        /* the fill may have flushed and resized the TLB */
+        index = tlb_index(env, mmu_idx, addr);
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+    haddr = (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
+
+    /* Clean RAM: do what io_mem_notdirty does for a store, i.e. invalidate
+       the TBs it overlaps and mark the page dirty, then let the operation
+       go to the host page.  */
+    if ((tlb_addr & ~TARGET_PAGE_MASK) == TLB_NOTDIRTY) {
+        CPUIOTLBEntry *iotlbentry = &env->iotlb[mmu_idx][index];
+        ram_addr_t ram_addr = (iotlbentry->addr & TARGET_PAGE_MASK) + addr;
+
+        cpu->mem_io_vaddr = addr;
+        cpu->mem_io_pc = retaddr;
+        notdirty_write_begin(ram_addr, size);
+        notdirty_write_end(cpu, ram_addr, size);
+        return haddr;
+    }
+
+    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+        /* Watchpoints are only checked by the ordinary slow path.  */
+        if (!QTAILQ_EMPTY(&cpu->watchpoints)) {
+            goto stop_the_world;
+        }
+        return NULL;
+    }
+    return haddr;
+
+ stop_the_world:
+    if (parallel_cpus) {
+        cpu_loop_exit_atomic(cpu, retaddr);
+    }
+    return NULL;
+}
+
+static uint64_t atomic_slow_ld(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        return helper_ret_ldub_mmu(env, addr, oi, retaddr);
+    case MO_LEUW:
+        return helper_le_lduw_mmu(env, addr, oi, retaddr);
+    case MO_LEUL:
+        return helper_le_ldul_mmu(env, addr, oi, retaddr);
+    case MO_LEQ:
+        return helper_le_ldq_mmu(env, addr, oi, retaddr);
+    case MO_BEUW:
+        return helper_be_lduw_mmu(env, addr, oi, retaddr);
+    case MO_BEUL:
+        return helper_be_ldul_mmu(env, addr, oi, retaddr);
+    case MO_BEQ:
+        return helper_be_ldq_mmu(env, addr, oi, retaddr);
+    default:
+        tcg_abort();
+    }
+}
+
+static void atomic_slow_st(CPUArchState *env, target_ulong addr,
+                           uint64_t val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        helper_ret_stb_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUW:
+        helper_le_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUL:
+        helper_le_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEQ:
+        helper_le_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUW:
+        helper_be_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUL:
+        helper_be_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEQ:
+        helper_be_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+#define ATOMIC_MMU_LOOKUP  atomic_mmu_lookup(env, addr, oi, retaddr)
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+
+#undef ATOMIC_MMU_LOOKUP
+
 #define MMUSUFFIX _cmmu
 #undef GETPC_ADJ
 #define GETPC_ADJ 0
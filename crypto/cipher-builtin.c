@@ -21,11 +21,13 @@
 #include "qemu/osdep.h"
 #include "crypto/aes.h"
 #include "crypto/desrfb.h"
+#include "crypto/xts.h"
 
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
     AES_KEY encrypt_key;
     AES_KEY decrypt_key;
+    AES_KEY tweak_key; /* XTS only, encryption direction */
     uint8_t iv[AES_BLOCK_SIZE];
 };
 typedef struct QCryptoCipherBuiltinDESRFB QCryptoCipherBuiltinDESRFB;
@@ -67,6 +69,32 @@ static void qcrypto_cipher_free_aes(QCryptoCipher *cipher)
 }
 
 
+static void qcrypto_cipher_aes_ecb_encrypt(const void *ctx,
+                                           size_t length,
+                                           uint8_t *dst,
+                                           const uint8_t *src)
+{
+    size_t i;
+
+    for (i = 0; i < length; i += AES_BLOCK_SIZE) {
+        AES_encrypt(src + i, dst + i, ctx);
+    }
+}
+
+
+static void qcrypto_cipher_aes_ecb_decrypt(const void *ctx,
+                                           size_t length,
+                                           uint8_t *dst,
+                                           const uint8_t *src)
+{
+    size_t i;
+
+    for (i = 0; i < length; i += AES_BLOCK_SIZE) {
+        AES_decrypt(src + i, dst + i, ctx);
+    }
+}
+
+
 static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                                       const void *in,
                                       void *out,
@@ -94,6 +122,13 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                 len = 0;
             }
         }
+    } else if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        xts_encrypt(&ctxt->state.aes.encrypt_key,
+                    &ctxt->state.aes.tweak_key,
+                    qcrypto_cipher_aes_ecb_encrypt,
+                    qcrypto_cipher_aes_ecb_decrypt,
+                    ctxt->state.aes.iv,
+                    len, out, in);
     } else {
         AES_cbc_encrypt(in, out, len,
                         &ctxt->state.aes.encrypt_key,
@@ -131,6 +166,13 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
                 len = 0;
             }
         }
+    } else if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        xts_decrypt(&ctxt->state.aes.decrypt_key,
+                    &ctxt->state.aes.tweak_key,
+                    qcrypto_cipher_aes_ecb_encrypt,
+                    qcrypto_cipher_aes_ecb_decrypt,
+                    ctxt->state.aes.iv,
+                    len, out, in);
     } else {
         AES_cbc_encrypt(in, out, len,
                         &ctxt->state.aes.decrypt_key,
@@ -166,13 +208,23 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
     QCryptoCipherBuiltin *ctxt;
 
     if (cipher->mode != QCRYPTO_CIPHER_MODE_CBC &&
-        cipher->mode != QCRYPTO_CIPHER_MODE_ECB) {
+        cipher->mode != QCRYPTO_CIPHER_MODE_ECB &&
+        cipher->mode != QCRYPTO_CIPHER_MODE_XTS) {
         error_setg(errp, "Unsupported cipher mode %d", cipher->mode);
         return -1;
     }
 
     ctxt = g_new0(QCryptoCipherBuiltin, 1);
 
+    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey /= 2;
+        if (AES_set_encrypt_key(key + nkey, nkey * 8,
+                                &ctxt->state.aes.tweak_key) != 0) {
+            error_setg(errp, "Failed to set tweak key");
+            goto error;
+        }
+    }
+
     if (AES_set_encrypt_key(key, nkey * 8, &ctxt->state.aes.encrypt_key) != 0) {
         error_setg(errp, "Failed to set encryption key");
         goto error;
@@ -322,7 +374,7 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
     cipher->alg = alg;
     cipher->mode = mode;
 
-    if (!qcrypto_cipher_validate_key_length(alg, nkey, errp)) {
+    if (!qcrypto_cipher_validate_key_length(alg, mode, nkey, errp)) {
         goto error;
     }
 
@@ -19,6 +19,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "crypto/xts.h"
 #include <gcrypt.h>
 
 
@@ -38,9 +39,36 @@ bool qcrypto_cipher_supports(QCryptoCipherAlgorithm alg)
 typedef struct QCryptoCipherGcrypt QCryptoCipherGcrypt;
 struct QCryptoCipherGcrypt {
     gcry_cipher_hd_t handle;
+    gcry_cipher_hd_t tweakhandle; /* XTS only */
     size_t blocksize;
+    uint8_t *iv; /* XTS only */
 };
 
+/* XTS runs on top of two ECB handles, one for data and one for tweaks */
+static void qcrypto_gcrypt_xts_encrypt(const void *ctx,
+                                       size_t length,
+                                       uint8_t *dst,
+                                       const uint8_t *src)
+{
+    gcry_error_t err;
+
+    err = gcry_cipher_encrypt(*(gcry_cipher_hd_t *)ctx,
+                              dst, length, src, length);
+    g_assert(err == 0);
+}
+
+static void qcrypto_gcrypt_xts_decrypt(const void *ctx,
+                                       size_t length,
+                                       uint8_t *dst,
+                                       const uint8_t *src)
+{
+    gcry_error_t err;
+
+    err = gcry_cipher_decrypt(*(gcry_cipher_hd_t *)ctx,
+                              dst, length, src, length);
+    g_assert(err == 0);
+}
+
 QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
                                   QCryptoCipherMode mode,
                                   const uint8_t *key, size_t nkey,
@@ -53,6 +81,7 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
 
     switch (mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
+    case QCRYPTO_CIPHER_MODE_XTS:
         gcrymode = GCRY_CIPHER_MODE_ECB;
         break;
     case QCRYPTO_CIPHER_MODE_CBC:
@@ -63,7 +92,7 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
         return NULL;
     }
 
-    if (!qcrypto_cipher_validate_key_length(alg, nkey, errp)) {
+    if (!qcrypto_cipher_validate_key_length(alg, mode, nkey, errp)) {
         return NULL;
     }
 
@@ -101,6 +130,22 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
                    gcry_strerror(err));
         goto error;
     }
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        err = gcry_cipher_open(&ctx->tweakhandle, gcryalg, gcrymode, 0);
+        if (err != 0) {
+            error_setg(errp, "Cannot initialize cipher: %s",
+                       gcry_strerror(err));
+            goto error;
+        }
+        nkey /= 2;
+        err = gcry_cipher_setkey(ctx->tweakhandle, key + nkey, nkey);
+        if (err != 0) {
+            error_setg(errp, "Cannot set key: %s",
+                       gcry_strerror(err));
+            goto error;
+        }
+        ctx->iv = g_new0(uint8_t, XTS_BLOCK_SIZE);
+    }
 
     if (cipher->alg == QCRYPTO_CIPHER_ALG_DES_RFB) {
         /* We're using standard DES cipher from gcrypt, so we need
@@ -126,6 +171,8 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
 
  error:
     gcry_cipher_close(ctx->handle);
+    gcry_cipher_close(ctx->tweakhandle);
+    g_free(ctx->iv);
     g_free(ctx);
     g_free(cipher);
     return NULL;
@@ -140,6 +187,8 @@ void qcrypto_cipher_free(QCryptoCipher *cipher)
     }
     ctx = cipher->opaque;
     gcry_cipher_close(ctx->handle);
+    gcry_cipher_close(ctx->tweakhandle);
+    g_free(ctx->iv);
     g_free(ctx);
     g_free(cipher);
 }
@@ -160,6 +209,14 @@ int qcrypto_cipher_encrypt(QCryptoCipher *cipher,
         return -1;
     }
 
+    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        xts_encrypt(&ctx->handle, &ctx->tweakhandle,
+                    qcrypto_gcrypt_xts_encrypt,
+                    qcrypto_gcrypt_xts_decrypt,
+                    ctx->iv, len, out, in);
+        return 0;
+    }
+
     err = gcry_cipher_encrypt(ctx->handle,
                               out, len,
                               in, len);
@@ -188,6 +245,14 @@ int qcrypto_cipher_decrypt(QCryptoCipher *cipher,
         return -1;
     }
 
+    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        xts_decrypt(&ctx->handle, &ctx->tweakhandle,
+                    qcrypto_gcrypt_xts_encrypt,
+                    qcrypto_gcrypt_xts_decrypt,
+                    ctx->iv, len, out, in);
+        return 0;
+    }
+
     err = gcry_cipher_decrypt(ctx->handle,
                               out, len,
                               in, len);
@@ -213,6 +278,11 @@ int qcrypto_cipher_setiv(QCryptoCipher *cipher,
         return -1;
     }
 
+    if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        memcpy(ctx->iv, iv, niv);
+        return 0;
+    }
+
     gcry_cipher_reset(ctx->handle);
     err = gcry_cipher_setiv(ctx->handle, iv, niv);
     if (err != 0) {
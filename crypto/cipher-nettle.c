@@ -19,6 +19,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "crypto/xts.h"
 #include <nettle/nettle-types.h>
 #include <nettle/aes.h>
 #include <nettle/des.h>
@@ -63,10 +64,26 @@ static void des_decrypt_wrapper(cipher_ctx_t ctx, cipher_length_t length,
     des_decrypt(ctx, length, dst, src);
 }
 
+static xts_cipher_func aes_xts_encrypt_wrapper;
+static xts_cipher_func aes_xts_decrypt_wrapper;
+
+static void aes_xts_encrypt_wrapper(const void *ctx, size_t length,
+                                    uint8_t *dst, const uint8_t *src)
+{
+    aes_encrypt((void *)ctx, length, dst, src);
+}
+
+static void aes_xts_decrypt_wrapper(const void *ctx, size_t length,
+                                    uint8_t *dst, const uint8_t *src)
+{
+    aes_decrypt((void *)ctx, length, dst, src);
+}
+
 typedef struct QCryptoCipherNettle QCryptoCipherNettle;
 struct QCryptoCipherNettle {
     void *ctx_encrypt;
     void *ctx_decrypt;
+    void *ctx_tweak; /* XTS only */
     nettle_cipher_func *alg_encrypt;
     nettle_cipher_func *alg_decrypt;
     uint8_t *iv;
@@ -99,13 +116,14 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
     switch (mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
     case QCRYPTO_CIPHER_MODE_CBC:
+    case QCRYPTO_CIPHER_MODE_XTS:
         break;
     default:
         error_setg(errp, "Unsupported cipher mode %d", mode);
         return NULL;
     }
 
-    if (!qcrypto_cipher_validate_key_length(alg, nkey, errp)) {
+    if (!qcrypto_cipher_validate_key_length(alg, mode, nkey, errp)) {
         return NULL;
     }
 
@@ -135,6 +153,12 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
         ctx->ctx_encrypt = g_new0(struct aes_ctx, 1);
         ctx->ctx_decrypt = g_new0(struct aes_ctx, 1);
 
+        if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+            nkey /= 2;
+            ctx->ctx_tweak = g_new0(struct aes_ctx, 1);
+            aes_set_encrypt_key(ctx->ctx_tweak, nkey, key + nkey);
+        }
+
         aes_set_encrypt_key(ctx->ctx_encrypt, nkey, key);
         aes_set_decrypt_key(ctx->ctx_decrypt, nkey, key);
 
@@ -172,6 +196,7 @@ void qcrypto_cipher_free(QCryptoCipher *cipher)
     g_free(ctx->iv);
     g_free(ctx->ctx_encrypt);
     g_free(ctx->ctx_decrypt);
+    g_free(ctx->ctx_tweak);
     g_free(ctx);
     g_free(cipher);
 }
@@ -201,6 +226,12 @@ int qcrypto_cipher_encrypt(QCryptoCipher *cipher,
                     ctx->blocksize, ctx->iv,
                     len, out, in);
         break;
+
+    case QCRYPTO_CIPHER_MODE_XTS:
+        xts_encrypt(ctx->ctx_encrypt, ctx->ctx_tweak,
+                    aes_xts_encrypt_wrapper, aes_xts_decrypt_wrapper,
+                    ctx->iv, len, out, in);
+        break;
     default:
         error_setg(errp, "Unsupported cipher algorithm %d",
                    cipher->alg);
@@ -235,6 +266,12 @@ int qcrypto_cipher_decrypt(QCryptoCipher *cipher,
                     ctx->alg_decrypt, ctx->blocksize, ctx->iv,
                     len, out, in);
         break;
+
+    case QCRYPTO_CIPHER_MODE_XTS:
+        xts_decrypt(ctx->ctx_decrypt, ctx->ctx_tweak,
+                    aes_xts_encrypt_wrapper, aes_xts_decrypt_wrapper,
+                    ctx->iv, len, out, in);
+        break;
     default:
         error_setg(errp, "Unsupported cipher algorithm %d",
                    cipher->alg);
@@ -39,6 +39,7 @@ static size_t alg_block_len[QCRYPTO_CIPHER_ALG__MAX] = {
 static bool mode_need_iv[QCRYPTO_CIPHER_MODE__MAX] = {
     [QCRYPTO_CIPHER_MODE_ECB] = false,
     [QCRYPTO_CIPHER_MODE_CBC] = true,
+    [QCRYPTO_CIPHER_MODE_XTS] = true,
 };
 
 
@@ -79,6 +80,7 @@ size_t qcrypto_cipher_get_iv_len(QCryptoCipherAlgorithm alg,
 
 static bool
 qcrypto_cipher_validate_key_length(QCryptoCipherAlgorithm alg,
+                                   QCryptoCipherMode mode,
                                    size_t nkey,
                                    Error **errp)
 {
@@ -88,6 +90,20 @@ qcrypto_cipher_validate_key_length(QCryptoCipherAlgorithm alg,
         return false;
     }
 
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        if (alg == QCRYPTO_CIPHER_ALG_DES_RFB) {
+            error_setg(errp, "XTS mode not compatible with DES-RFB");
+            return false;
+        }
+        /* The data key is followed by the tweak key */
+        if (alg_key_len[alg] * 2 != nkey) {
+            error_setg(errp, "Cipher key length %zu should be %zu",
+                       nkey, alg_key_len[alg] * 2);
+            return false;
+        }
+        return true;
+    }
+
     if (alg_key_len[alg] != nkey) {
         error_setg(errp, "Cipher key length %zu should be %zu",
                    nkey, alg_key_len[alg]);
@@ -121,3 +137,77 @@ qcrypto_cipher_munge_des_rfb_key(const uint8_t *key,
 #else
 #include "crypto/cipher-builtin.c"
 #endif
+
+
+static int
+qcrypto_cipher_crypt_sectors(QCryptoCipher *cipher,
+                             uint64_t sector,
+                             size_t sector_size,
+                             const void *in,
+                             void *out,
+                             size_t len,
+                             bool enc,
+                             Error **errp)
+{
+    size_t niv = qcrypto_cipher_get_iv_len(cipher->alg, cipher->mode);
+    uint8_t iv[16];
+    size_t i;
+    int ret;
+
+    if (niv < sizeof(uint64_t) || niv > sizeof(iv)) {
+        error_setg(errp, "Cipher mode %d cannot use per-sector IVs",
+                   cipher->mode);
+        return -1;
+    }
+    if (sector_size == 0 || len % sector_size) {
+        error_setg(errp, "Length %zu must be a multiple of sector size %zu",
+                   len, sector_size);
+        return -1;
+    }
+
+    /* "plain64" IVs: the little endian sector number, zero padded */
+    memset(iv, 0, niv);
+    for (i = 0; i < len; i += sector_size, sector++) {
+        stq_le_p(iv, sector);
+        if (qcrypto_cipher_setiv(cipher, iv, niv, errp) < 0) {
+            return -1;
+        }
+        if (enc) {
+            ret = qcrypto_cipher_encrypt(cipher, in + i, out + i,
+                                         sector_size, errp);
+        } else {
+            ret = qcrypto_cipher_decrypt(cipher, in + i, out + i,
+                                         sector_size, errp);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int qcrypto_cipher_encrypt_sectors(QCryptoCipher *cipher,
+                                   uint64_t sector,
+                                   size_t sector_size,
+                                   const void *in,
+                                   void *out,
+                                   size_t len,
+                                   Error **errp)
+{
+    return qcrypto_cipher_crypt_sectors(cipher, sector, sector_size,
+                                        in, out, len, true, errp);
+}
+
+
+int qcrypto_cipher_decrypt_sectors(QCryptoCipher *cipher,
+                                   uint64_t sector,
+                                   size_t sector_size,
+                                   const void *in,
+                                   void *out,
+                                   size_t len,
+                                   Error **errp)
+{
+    return qcrypto_cipher_crypt_sectors(cipher, sector, sector_size,
+                                        in, out, len, false, errp);
+}
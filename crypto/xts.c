@@ -0,0 +1,97 @@
+/*
+ * QEMU Crypto XTS cipher mode
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "crypto/xts.h"
+
+/* Multiply the tweak by the primitive element alpha of GF(2^128),
+ * the tweak being stored as a little endian 128-bit number */
+static void xts_mult_x(uint8_t *t)
+{
+    uint64_t lo = ldq_le_p(t);
+    uint64_t hi = ldq_le_p(t + 8);
+    uint64_t carry = hi >> 63;
+
+    hi = (hi << 1) | (lo >> 63);
+    lo = (lo << 1) ^ (carry * 0x87);
+
+    stq_le_p(t, lo);
+    stq_le_p(t + 8, hi);
+}
+
+static void xts_xor(uint8_t *dst, const uint8_t *a, const uint8_t *b)
+{
+    uint64_t x[2], y[2];
+
+    memcpy(x, a, XTS_BLOCK_SIZE);
+    memcpy(y, b, XTS_BLOCK_SIZE);
+    x[0] ^= y[0];
+    x[1] ^= y[1];
+    memcpy(dst, x, XTS_BLOCK_SIZE);
+}
+
+static void xts_crypt(const void *datactx,
+                      const void *tweakctx,
+                      xts_cipher_func *encfunc,
+                      xts_cipher_func *func,
+                      const uint8_t *iv,
+                      size_t length,
+                      uint8_t *dst,
+                      const uint8_t *src)
+{
+    uint8_t t[XTS_BLOCK_SIZE];
+    uint8_t b[XTS_BLOCK_SIZE];
+    size_t i;
+
+    g_assert(length % XTS_BLOCK_SIZE == 0);
+
+    encfunc(tweakctx, XTS_BLOCK_SIZE, t, iv);
+
+    for (i = 0; i < length; i += XTS_BLOCK_SIZE) {
+        xts_xor(b, src + i, t);
+        func(datactx, XTS_BLOCK_SIZE, b, b);
+        xts_xor(dst + i, b, t);
+        xts_mult_x(t);
+    }
+}
+
+void xts_decrypt(const void *datactx,
+                 const void *tweakctx,
+                 xts_cipher_func *encfunc,
+                 xts_cipher_func *decfunc,
+                 const uint8_t *iv,
+                 size_t length,
+                 uint8_t *dst,
+                 const uint8_t *src)
+{
+    xts_crypt(datactx, tweakctx, encfunc, decfunc, iv, length, dst, src);
+}
+
+void xts_encrypt(const void *datactx,
+                 const void *tweakctx,
+                 xts_cipher_func *encfunc,
+                 xts_cipher_func *decfunc,
+                 const uint8_t *iv,
+                 size_t length,
+                 uint8_t *dst,
+                 const uint8_t *src)
+{
+    xts_crypt(datactx, tweakctx, encfunc, encfunc, iv, length, dst, src);
+}
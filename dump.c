@@ -26,6 +26,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
 #include "qapi-event.h"
+#include "qemu/thread.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -1183,20 +1184,211 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Pages are compressed by a pool of worker threads, DUMP_BATCH_PAGES at a
+ * time.  The dumping thread fills the batches in guest physical order and
+ * writes them out in the same order, so the file is identical to the one
+ * produced by compressing page by page.
+ */
+#define DUMP_BATCH_PAGES    256
+#define DUMP_MAX_THREADS    8
+
+enum {
+    DUMP_BATCH_FREE,
+    DUMP_BATCH_QUEUED,
+    DUMP_BATCH_RUNNING,
+    DUMP_BATCH_DONE,
+};
+
+typedef struct DumpBatch {
+    int state;
+    int nr_pages;
+    uint8_t *pages[DUMP_BATCH_PAGES];   /* host address of each page */
+    /* filled in by the worker */
+    uint8_t *data;                      /* page data, back to back */
+    uint32_t size[DUMP_BATCH_PAGES];    /* 0 for a zero page */
+    uint32_t flags[DUMP_BATCH_PAGES];
+} DumpBatch;
+
+typedef struct DumpCompressPool {
+    DumpState *s;
+    size_t len_buf_out;
+    QemuMutex lock;
+    QemuCond work_cond;     /* a batch was queued, or quit was set */
+    QemuCond done_cond;     /* a batch was compressed */
+    bool quit;
+    int nr_batches;
+    DumpBatch *batches;
+    int nr_threads;
+    QemuThread *threads;
+} DumpCompressPool;
+
+/*
+ * Compress one page into @out, which must hold a whole page.  Only one
+ * compression format will be used here, for s->flag_compress is set.  But
+ * when compression fails to work, we fall back to save in plaintext.
+ */
+static uint32_t dump_compress_page(DumpState *s, const uint8_t *buf,
+                                   uint8_t *out, uint8_t *buf_out,
+                                   size_t len_buf_out, void *wrkmem,
+                                   uint32_t *flags)
+{
+    size_t size_out = len_buf_out;
+
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(buf_out, (uLongf *)&size_out, buf,
+                       s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
+            (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)buf, s->dump_info.page_size,
+            (char *)buf_out, &size_out) == SNAPPY_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        *flags = 0;
+        memcpy(out, buf, s->dump_info.page_size);
+        return s->dump_info.page_size;
+    }
+
+    memcpy(out, buf_out, size_out);
+    return size_out;
+}
+
+static void dump_compress_batch(DumpCompressPool *pool, DumpBatch *b,
+                                uint8_t *buf_out, void *wrkmem)
+{
+    DumpState *s = pool->s;
+    uint8_t *out = b->data;
+    int i;
+
+    for (i = 0; i < b->nr_pages; i++) {
+        if (is_zero_page(b->pages[i], s->dump_info.page_size)) {
+            b->size[i] = 0;
+            continue;
+        }
+        b->size[i] = dump_compress_page(s, b->pages[i], out, buf_out,
+                                        pool->len_buf_out, wrkmem,
+                                        &b->flags[i]);
+        out += b->size[i];
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressPool *pool = opaque;
+    uint8_t *buf_out = g_malloc(pool->len_buf_out);
+    void *wrkmem = NULL;
+    DumpBatch *b;
+    int i;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        b = NULL;
+        for (i = 0; i < pool->nr_batches; i++) {
+            if (pool->batches[i].state == DUMP_BATCH_QUEUED) {
+                b = &pool->batches[i];
+                break;
+            }
+        }
+        if (!b) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+
+        b->state = DUMP_BATCH_RUNNING;
+        qemu_mutex_unlock(&pool->lock);
+        dump_compress_batch(pool, b, buf_out, wrkmem);
+        qemu_mutex_lock(&pool->lock);
+        b->state = DUMP_BATCH_DONE;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(wrkmem);
+    g_free(buf_out);
+    return NULL;
+}
+
+static void dump_compress_pool_start(DumpCompressPool *pool, DumpState *s,
+                                     size_t len_buf_out)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    pool->s = s;
+    pool->len_buf_out = len_buf_out;
+    pool->quit = false;
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    pool->nr_threads = MAX(1, MIN(host_procs, DUMP_MAX_THREADS));
+    /* Twice as many batches, so that workers never wait for the writer */
+    pool->nr_batches = 2 * pool->nr_threads;
+    pool->batches = g_new0(DumpBatch, pool->nr_batches);
+    for (i = 0; i < pool->nr_batches; i++) {
+        pool->batches[i].data = g_malloc(DUMP_BATCH_PAGES *
+                                         s->dump_info.page_size);
+    }
+
+    pool->threads = g_new0(QemuThread, pool->nr_threads);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "dump_compress",
+                           dump_compress_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_pool_stop(DumpCompressPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    for (i = 0; i < pool->nr_batches; i++) {
+        g_free(pool->batches[i].data);
+    }
+    g_free(pool->threads);
+    g_free(pool->batches);
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
+    DumpCompressPool pool;
+    DumpBatch *b;
+    uint64_t next_fill = 0, next_write = 0;
+    bool more_pages = true;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
-    uint8_t *buf;
+    uint8_t *buf, *data;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1209,11 +1401,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_pool_start(&pool, s, len_buf_out);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1237,97 +1425,75 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    for (;;) {
+        /* queue as many batches as there are free slots */
+        while (more_pages && next_fill - next_write < pool.nr_batches) {
+            b = &pool.batches[next_fill % pool.nr_batches];
+            b->nr_pages = 0;
+            while (b->nr_pages < DUMP_BATCH_PAGES &&
+                   (more_pages = get_next_page(&block_iter, &pfn_iter,
+                                               &buf, s))) {
+                b->pages[b->nr_pages++] = buf;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
+            if (!b->nr_pages) {
+                break;
+            }
+
+            qemu_mutex_lock(&pool.lock);
+            b->state = DUMP_BATCH_QUEUED;
+            qemu_cond_signal(&pool.work_cond);
+            qemu_mutex_unlock(&pool.lock);
+            next_fill++;
+        }
+
+        if (next_write == next_fill) {
+            break;
+        }
+
+        /* write out the oldest batch */
+        b = &pool.batches[next_write % pool.nr_batches];
+        qemu_mutex_lock(&pool.lock);
+        while (b->state != DUMP_BATCH_DONE) {
+            qemu_cond_wait(&pool.done_cond, &pool.lock);
+        }
+        qemu_mutex_unlock(&pool.lock);
+
+        data = b->data;
+        for (i = 0; i < b->nr_pages; i++) {
+            if (!b->size[i]) {
+                ret = write_cache(&page_desc, &pd_zero,
+                                  sizeof(PageDescriptor), false);
                 if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
+                    error_setg(errp, "dump: failed to write page desc");
                     goto out;
                 }
+                s->written_size += s->dump_info.page_size;
+                continue;
+            }
+
+            ret = write_cache(&page_data, data, b->size[i], false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                goto out;
             }
 
             /* get and write page desc here */
+            pd.flags = cpu_to_dump32(s, b->flags[i]);
+            pd.size = cpu_to_dump32(s, b->size[i]);
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += b->size[i];
+            data += b->size[i];
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
                 error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
+        b->state = DUMP_BATCH_FREE;
+        next_write++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1342,14 +1508,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    dump_compress_pool_stop(&pool);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
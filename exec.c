@@ -19,6 +19,9 @@
 #include "qemu/osdep.h"
 #ifndef _WIN32
 #include <sys/mman.h>
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 #endif
 
 #include "qemu-common.h"
@@ -132,22 +135,22 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* The dispatch tree of a FlatView, shared by every address space that
+ * currently uses that view.  It is freed together with the view.
+ */
 struct AddressSpaceDispatch {
-    struct rcu_head rcu;
-
     MemoryRegionSection *mru_section;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
-    AddressSpace *as;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
-    AddressSpace *as;
+    AddressSpaceDispatch *d;
     hwaddr base;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
@@ -160,6 +163,15 @@ typedef struct subpage_t {
 static void io_mem_init(void);
 static void memory_map_init(void);
 static void tcg_commit(MemoryListener *listener);
+static MemTxResult address_space_dispatch_read(AddressSpaceDispatch *d,
+                                               hwaddr addr, MemTxAttrs attrs,
+                                               uint8_t *buf, int len);
+static MemTxResult address_space_dispatch_write(AddressSpaceDispatch *d,
+                                                hwaddr addr, MemTxAttrs attrs,
+                                                const uint8_t *buf, int len);
+static bool address_space_dispatch_access_valid(AddressSpaceDispatch *d,
+                                                hwaddr addr, int len,
+                                                bool is_write);
 
 static MemoryRegion io_mem_watch;
 
@@ -411,16 +423,17 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
 }
 
 /* Called from RCU critical section */
-MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
-                                      hwaddr *xlat, hwaddr *plen,
-                                      bool is_write)
+static MemoryRegion *address_space_dispatch_translate(AddressSpaceDispatch *d,
+                                                      hwaddr addr,
+                                                      hwaddr *xlat,
+                                                      hwaddr *plen,
+                                                      bool is_write)
 {
     IOMMUTLBEntry iotlb;
     MemoryRegionSection *section;
     MemoryRegion *mr;
 
     for (;;) {
-        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
         section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
@@ -437,7 +450,7 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
             break;
         }
 
-        as = iotlb.target_as;
+        d = atomic_rcu_read(&iotlb.target_as->dispatch);
     }
 
     if (xen_enabled() && memory_access_is_direct(mr, is_write)) {
@@ -449,6 +462,15 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     return mr;
 }
 
+/* Called from RCU critical section */
+MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
+                                      hwaddr *xlat, hwaddr *plen,
+                                      bool is_write)
+{
+    return address_space_dispatch_translate(atomic_rcu_read(&as->dispatch),
+                                            addr, xlat, plen, is_write);
+}
+
 /* Called from RCU critical section */
 MemoryRegionSection *
 address_space_translate_for_iotlb(CPUState *cpu, int asidx, hwaddr addr,
@@ -662,6 +684,7 @@ void cpu_exec_init(CPUState *cpu, Error **errp)
                              &error_abort);
     cpu->memory = system_memory;
     object_ref(OBJECT(cpu->memory));
+    tlb_init(cpu);
 #endif
 
 #if defined(CONFIG_USER_ONLY)
@@ -1030,7 +1053,7 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
 }
 
 /* Called from RCU critical section */
-hwaddr memory_region_section_get_iotlb(CPUState *cpu,
+hwaddr memory_region_section_get_iotlb(CPUState *cpu, int asidx,
                                        MemoryRegionSection *section,
                                        target_ulong vaddr,
                                        hwaddr paddr, hwaddr xlat,
@@ -1052,7 +1075,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
     } else {
         AddressSpaceDispatch *d;
 
-        d = atomic_rcu_read(&section->address_space->dispatch);
+        d = cpu->cpu_ases[asidx].memory_dispatch;
         iotlb = section - d->map.sections;
         iotlb += xlat;
     }
@@ -1078,7 +1101,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
 
 static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
                              uint16_t section);
-static subpage_t *subpage_init(AddressSpace *as, hwaddr base);
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base);
 
 static void *(*phys_mem_alloc)(size_t size, uint64_t *align) =
                                qemu_anon_ram_alloc;
@@ -1151,8 +1174,7 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(d->as, base);
-        subsection.address_space = d->as;
+        subpage = subpage_init(d, base);
         subsection.mr = &subpage->iomem;
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
                       phys_section_add(&d->map, &subsection));
@@ -1178,10 +1200,9 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
-static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
+void address_space_dispatch_add(AddressSpaceDispatch *d,
+                                MemoryRegionSection *section)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
@@ -1248,7 +1269,10 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     for (;;) {
-        fd = open(path, O_RDWR);
+        /* qemu_open() also takes /dev/fdset/ paths, for fds passed over
+         * the monitor, e.g. the guest RAM of another QEMU on this host.
+         */
+        fd = qemu_open(path, O_RDWR);
         if (fd >= 0) {
             /* @path names an existing file, use it */
             break;
@@ -1295,6 +1319,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     page_size = qemu_fd_getpagesize(fd);
+    block->page_size = page_size;
     block->mr->align = page_size;
 
     if (memory < page_size) {
@@ -1426,6 +1451,71 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+/* The size of the host pages backing the block; hugetlbfs pages are
+ * bigger than qemu_host_page_size.
+ */
+size_t qemu_ram_pagesize(RAMBlock *rb)
+{
+    return rb->page_size;
+}
+
+bool qemu_ram_is_shared(RAMBlock *rb)
+{
+    return rb->flags & RAM_SHARED;
+}
+
+size_t qemu_ram_pagesize_largest(void)
+{
+    RAMBlock *block;
+    size_t largest = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        largest = MAX(largest, block->page_size);
+    }
+    rcu_read_unlock();
+
+    return largest;
+}
+
+/*
+ * Throw away the contents of part of a RAMBlock, so that the next access
+ * sees zeroes (or a userfault).  Hugetlbfs pages can't be dropped with
+ * MADV_DONTNEED, so their backing is punched out of the file instead.
+ *
+ * Returns 0 on success.
+ */
+int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
+{
+    uint8_t *host_startaddr = rb->host + start;
+    int ret;
+
+    if (rb->page_size == qemu_host_page_size) {
+        ret = qemu_madvise(host_startaddr, length, QEMU_MADV_DONTNEED);
+        if (ret) {
+            error_report("ram_block_discard_range: MADV_DONTNEED failed on "
+                         "'%s' +%" PRIx64 " %zx: %s",
+                         rb->idstr, start, length, strerror(errno));
+        }
+        return ret;
+    }
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    ret = fallocate(rb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    start, length);
+    if (ret) {
+        error_report("ram_block_discard_range: failed to punch a hole in "
+                     "'%s' +%" PRIx64 " %zx: %s",
+                     rb->idstr, start, length, strerror(errno));
+    }
+    return ret;
+#else
+    error_report("ram_block_discard_range: can't discard '%s', "
+                 "no fallocate hole punching support", rb->idstr);
+    return -1;
+#endif
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
 {
@@ -1716,6 +1806,7 @@ RAMBlock *qemu_ram_alloc_internal(ram_addr_t size, ram_addr_t max_size,
     new_block->max_length = max_size;
     assert(max_size >= size);
     new_block->fd = -1;
+    new_block->page_size = qemu_host_page_size;
     new_block->host = host;
     if (host) {
         new_block->flags |= RAM_PREALLOC;
@@ -2028,13 +2119,43 @@ MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return block->mr;
 }
 
-/* Called within RCU critical section.  */
-static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
-                               uint64_t val, unsigned size)
+/* Invalidate the TBs covering a store to a page that may hold code.  The
+ * page's code bitmap limits this to stores that actually overlap a TB.
+ * Called within RCU critical section.
+ */
+void notdirty_write_begin(ram_addr_t ram_addr, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
+    }
+}
+
+/* Called once the store has been done */
+void notdirty_write_end(CPUState *cpu, ram_addr_t ram_addr, unsigned size)
+{
+    /* Account the page to the vcpu for migration auto-converge */
+    if (cpu &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&cpu->dirty_pages);
+    }
+    /* Set both VGA and migration bits for simplicity and to remove
+     * the notdirty callback faster.
+     */
+    cpu_physical_memory_set_dirty_range(ram_addr, size,
+                                        DIRTY_CLIENTS_NOCODE);
+    /* we remove the notdirty callback only if the code has been
+       flushed */
+    if (!cpu_physical_memory_is_clean(ram_addr)) {
+        tlb_set_dirty(cpu, cpu->mem_io_vaddr);
     }
+}
+
+static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
+                               uint64_t val, unsigned size)
+{
+    notdirty_write_begin(ram_addr, size);
     switch (size) {
     case 1:
         stb_p(qemu_get_ram_ptr(NULL, ram_addr), val);
@@ -2048,16 +2169,7 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    /* Set both VGA and migration bits for simplicity and to remove
-     * the notdirty callback faster.
-     */
-    cpu_physical_memory_set_dirty_range(ram_addr, size,
-                                        DIRTY_CLIENTS_NOCODE);
-    /* we remove the notdirty callback only if the code has been
-       flushed */
-    if (!cpu_physical_memory_is_clean(ram_addr)) {
-        tlb_set_dirty(current_cpu, current_cpu->mem_io_vaddr);
-    }
+    notdirty_write_end(current_cpu, ram_addr, size);
 }
 
 static bool notdirty_mem_accepts(void *opaque, hwaddr addr,
@@ -2108,6 +2220,12 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
                     continue;
                 }
                 cpu->watchpoint_hit = wp;
+
+                /* The tb_lock is released by tb_lock_reset() once
+                 * cpu_loop_exit or cpu_resume_from_signal longjmp back
+                 * into cpu_exec.
+                 */
+                tb_lock();
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2193,8 +2311,8 @@ static MemTxResult subpage_read(void *opaque, hwaddr addr, uint64_t *data,
     printf("%s: subpage %p len %u addr " TARGET_FMT_plx "\n", __func__,
            subpage, len, addr);
 #endif
-    res = address_space_read(subpage->as, addr + subpage->base,
-                             attrs, buf, len);
+    res = address_space_dispatch_read(subpage->d, addr + subpage->base,
+                                      attrs, buf, len);
     if (res) {
         return res;
     }
@@ -2243,8 +2361,8 @@ static MemTxResult subpage_write(void *opaque, hwaddr addr,
     default:
         abort();
     }
-    return address_space_write(subpage->as, addr + subpage->base,
-                               attrs, buf, len);
+    return address_space_dispatch_write(subpage->d, addr + subpage->base,
+                                        attrs, buf, len);
 }
 
 static bool subpage_accepts(void *opaque, hwaddr addr,
@@ -2256,8 +2374,9 @@ static bool subpage_accepts(void *opaque, hwaddr addr,
            __func__, subpage, is_write ? 'w' : 'r', len, addr);
 #endif
 
-    return address_space_access_valid(subpage->as, addr + subpage->base,
-                                      len, is_write);
+    return address_space_dispatch_access_valid(subpage->d,
+                                               addr + subpage->base,
+                                               len, is_write);
 }
 
 static const MemoryRegionOps subpage_ops = {
@@ -2291,13 +2410,13 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     return 0;
 }
 
-static subpage_t *subpage_init(AddressSpace *as, hwaddr base)
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base)
 {
     subpage_t *mmio;
 
     mmio = g_malloc0(sizeof(subpage_t));
 
-    mmio->as = as;
+    mmio->d = d;
     mmio->base = base;
     memory_region_init_io(&mmio->iomem, NULL, &subpage_ops, mmio,
                           NULL, TARGET_PAGE_SIZE);
@@ -2311,12 +2430,9 @@ static subpage_t *subpage_init(AddressSpace *as, hwaddr base)
     return mmio;
 }
 
-static uint16_t dummy_section(PhysPageMap *map, AddressSpace *as,
-                              MemoryRegion *mr)
+static uint16_t dummy_section(PhysPageMap *map, MemoryRegion *mr)
 {
-    assert(as);
     MemoryRegionSection section = {
-        .address_space = as,
         .mr = mr,
         .offset_within_address_space = 0,
         .offset_within_region = 0,
@@ -2343,48 +2459,41 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
     memory_region_init_io(&io_mem_notdirty, NULL, &notdirty_mem_ops, NULL,
                           NULL, UINT64_MAX);
+    /* notdirty writes only touch RAM and the TB structures (protected
+     * by tb_lock), so vCPU threads need not take the BQL for them.
+     */
+    memory_region_clear_global_locking(&io_mem_notdirty);
     memory_region_init_io(&io_mem_watch, NULL, &watch_mem_ops, NULL,
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+AddressSpaceDispatch *address_space_dispatch_new(void)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
-    n = dummy_section(&d->map, as, &io_mem_unassigned);
+    n = dummy_section(&d->map, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
-    n = dummy_section(&d->map, as, &io_mem_notdirty);
+    n = dummy_section(&d->map, &io_mem_notdirty);
     assert(n == PHYS_SECTION_NOTDIRTY);
-    n = dummy_section(&d->map, as, &io_mem_rom);
+    n = dummy_section(&d->map, &io_mem_rom);
     assert(n == PHYS_SECTION_ROM);
-    n = dummy_section(&d->map, as, &io_mem_watch);
+    n = dummy_section(&d->map, &io_mem_watch);
     assert(n == PHYS_SECTION_WATCH);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
-    d->as = as;
-    as->next_dispatch = d;
+    return d;
 }
 
-static void address_space_dispatch_free(AddressSpaceDispatch *d)
+void address_space_dispatch_compact(AddressSpaceDispatch *d)
 {
-    phys_sections_free(&d->map);
-    g_free(d);
+    phys_page_compact_all(d, d->map.nodes_nb);
 }
 
-static void mem_commit(MemoryListener *listener)
+void address_space_dispatch_free(AddressSpaceDispatch *d)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *cur = as->dispatch;
-    AddressSpaceDispatch *next = as->next_dispatch;
-
-    phys_page_compact_all(next, next->map.nodes_nb);
-
-    atomic_rcu_set(&as->dispatch, next);
-    if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
-    }
+    phys_sections_free(&d->map);
+    g_free(d);
 }
 
 static void tcg_commit(MemoryListener *listener)
@@ -2405,34 +2514,6 @@ static void tcg_commit(MemoryListener *listener)
     tlb_flush(cpuas->cpu, 1);
 }
 
-void address_space_init_dispatch(AddressSpace *as)
-{
-    as->dispatch = NULL;
-    as->dispatch_listener = (MemoryListener) {
-        .begin = mem_begin,
-        .commit = mem_commit,
-        .region_add = mem_add,
-        .region_nop = mem_add,
-        .priority = 0,
-    };
-    memory_listener_register(&as->dispatch_listener, as);
-}
-
-void address_space_unregister(AddressSpace *as)
-{
-    memory_listener_unregister(&as->dispatch_listener);
-}
-
-void address_space_destroy_dispatch(AddressSpace *as)
-{
-    AddressSpaceDispatch *d = as->dispatch;
-
-    atomic_rcu_set(&as->dispatch, NULL);
-    if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
-    }
-}
-
 static void memory_map_init(void)
 {
     system_memory = g_malloc(sizeof(*system_memory));
@@ -2514,7 +2595,9 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
             cpu_physical_memory_range_includes_clean(addr, length, dirty_log_mask);
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
+        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -2571,7 +2654,8 @@ static bool prepare_mmio_access(MemoryRegion *mr)
 }
 
 /* Called within RCU critical section.  */
-static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
+static MemTxResult address_space_write_continue(AddressSpaceDispatch *d,
+                                                hwaddr addr,
                                                 MemTxAttrs attrs,
                                                 const uint8_t *buf,
                                                 int len, hwaddr addr1,
@@ -2638,37 +2722,51 @@ static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
         }
 
         l = len;
-        mr = address_space_translate(as, addr, &addr1, &l, true);
+        mr = address_space_dispatch_translate(d, addr, &addr1, &l, true);
     }
 
     return result;
 }
 
-MemTxResult address_space_write(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
-                                const uint8_t *buf, int len)
+/* Called within RCU critical section.  */
+static MemTxResult address_space_dispatch_write(AddressSpaceDispatch *d,
+                                                hwaddr addr, MemTxAttrs attrs,
+                                                const uint8_t *buf, int len)
 {
     hwaddr l;
     hwaddr addr1;
     MemoryRegion *mr;
-    MemTxResult result = MEMTX_OK;
 
-    if (len > 0) {
-        rcu_read_lock();
-        l = len;
-        mr = address_space_translate(as, addr, &addr1, &l, true);
-        result = address_space_write_continue(as, addr, attrs, buf, len,
-                                              addr1, l, mr);
-        rcu_read_unlock();
+    if (len <= 0) {
+        return MEMTX_OK;
     }
+    l = len;
+    mr = address_space_dispatch_translate(d, addr, &addr1, &l, true);
+    return address_space_write_continue(d, addr, attrs, buf, len,
+                                        addr1, l, mr);
+}
+
+MemTxResult address_space_write(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
+                                const uint8_t *buf, int len)
+{
+    MemTxResult result;
+
+    rcu_read_lock();
+    result = address_space_dispatch_write(atomic_rcu_read(&as->dispatch),
+                                          addr, attrs, buf, len);
+    rcu_read_unlock();
 
     return result;
 }
 
 /* Called within RCU critical section.  */
-MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
-                                        MemTxAttrs attrs, uint8_t *buf,
-                                        int len, hwaddr addr1, hwaddr l,
-                                        MemoryRegion *mr)
+static MemTxResult address_space_dispatch_read_continue(AddressSpaceDispatch *d,
+                                                        hwaddr addr,
+                                                        MemTxAttrs attrs,
+                                                        uint8_t *buf,
+                                                        int len, hwaddr addr1,
+                                                        hwaddr l,
+                                                        MemoryRegion *mr)
 {
     uint8_t *ptr;
     uint64_t val;
@@ -2729,28 +2827,50 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
         }
 
         l = len;
-        mr = address_space_translate(as, addr, &addr1, &l, false);
+        mr = address_space_dispatch_translate(d, addr, &addr1, &l, false);
     }
 
     return result;
 }
 
-MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
-                                    MemTxAttrs attrs, uint8_t *buf, int len)
+/* Called within RCU critical section.  */
+MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
+                                        MemTxAttrs attrs, uint8_t *buf,
+                                        int len, hwaddr addr1, hwaddr l,
+                                        MemoryRegion *mr)
+{
+    return address_space_dispatch_read_continue(atomic_rcu_read(&as->dispatch),
+                                                addr, attrs, buf, len,
+                                                addr1, l, mr);
+}
+
+/* Called within RCU critical section.  */
+static MemTxResult address_space_dispatch_read(AddressSpaceDispatch *d,
+                                               hwaddr addr, MemTxAttrs attrs,
+                                               uint8_t *buf, int len)
 {
     hwaddr l;
     hwaddr addr1;
     MemoryRegion *mr;
-    MemTxResult result = MEMTX_OK;
 
-    if (len > 0) {
-        rcu_read_lock();
-        l = len;
-        mr = address_space_translate(as, addr, &addr1, &l, false);
-        result = address_space_read_continue(as, addr, attrs, buf, len,
-                                             addr1, l, mr);
-        rcu_read_unlock();
+    if (len <= 0) {
+        return MEMTX_OK;
     }
+    l = len;
+    mr = address_space_dispatch_translate(d, addr, &addr1, &l, false);
+    return address_space_dispatch_read_continue(d, addr, attrs, buf, len,
+                                                addr1, l, mr);
+}
+
+MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
+                                    MemTxAttrs attrs, uint8_t *buf, int len)
+{
+    MemTxResult result;
+
+    rcu_read_lock();
+    result = address_space_dispatch_read(atomic_rcu_read(&as->dispatch),
+                                         addr, attrs, buf, len);
+    rcu_read_unlock();
 
     return result;
 }
@@ -2837,53 +2957,38 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    QLIST_ENTRY(BounceBuffer) link;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
-    QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+/* Called with as->bounce_lock held.  */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    QLIST_REMOVE(client, link);
-    g_free(client);
-}
-
-static void cpu_notify_map_clients_locked(void)
-{
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        QLIST_REMOVE(client, link);
+        g_free(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    if (!as->bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -2891,39 +2996,34 @@ void cpu_exec_init_all(void)
     qemu_mutex_init(&ram_list.mutex);
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            QLIST_REMOVE(client, link);
+            g_free(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-static void cpu_notify_map_clients(void)
-{
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
-}
-
-bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
+/* Called within RCU critical section.  */
+static bool address_space_dispatch_access_valid(AddressSpaceDispatch *d,
+                                                hwaddr addr, int len,
+                                                bool is_write)
 {
     MemoryRegion *mr;
     hwaddr l, xlat;
 
-    rcu_read_lock();
     while (len > 0) {
         l = len;
-        mr = address_space_translate(as, addr, &xlat, &l, is_write);
+        mr = address_space_dispatch_translate(d, addr, &xlat, &l, is_write);
         if (!memory_access_is_direct(mr, is_write)) {
             l = memory_access_size(mr, l, addr);
             if (!memory_region_access_valid(mr, xlat, l, is_write)) {
@@ -2934,16 +3034,26 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
         len -= l;
         addr += l;
     }
-    rcu_read_unlock();
     return true;
 }
 
+bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
+{
+    bool ret;
+
+    rcu_read_lock();
+    ret = address_space_dispatch_access_valid(atomic_rcu_read(&as->dispatch),
+                                              addr, len, is_write);
+    rcu_read_unlock();
+    return ret;
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2966,26 +3076,36 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        l = MIN(l, TARGET_PAGE_SIZE);
+
+        qemu_mutex_lock(&as->bounce_lock);
+        if (as->bounce_buffer_size + l > as->max_bounce_buffer_size) {
+            as->bounce_map_failures++;
+            qemu_mutex_unlock(&as->bounce_lock);
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        as->bounce_buffer_size += l;
+        as->bounce_maps++;
+        bounce = g_malloc(sizeof(*bounce) + l);
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_lock);
 
+        bounce->addr = addr;
+        bounce->len = l;
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -3021,7 +3141,20 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = NULL;
+
+    if (atomic_read(&as->bounce_buffer_size)) {
+        qemu_mutex_lock(&as->bounce_lock);
+        QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+            if (bounce->buffer == buffer) {
+                QLIST_REMOVE(bounce, link);
+                break;
+            }
+        }
+        qemu_mutex_unlock(&as->bounce_lock);
+    }
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3037,14 +3170,60 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    as->bounce_buffer_size -= bounce->len;
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
+}
+
+int64_t address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                                 hwaddr addr, hwaddr len, bool is_write)
+{
+    hwaddr l = len;
+    hwaddr xlat;
+    MemoryRegion *mr;
+
+    cache->as = as;
+    cache->addr = addr;
+    cache->ptr = NULL;
+    cache->len = 0;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    memory_region_ref(mr);
+    cache->mr = mr;
+    if (len && memory_access_is_direct(mr, is_write)) {
+        cache->ram_addr = memory_region_get_ram_addr(mr) + xlat;
+        cache->ptr = qemu_get_ram_ptr(mr->ram_block, cache->ram_addr);
+        cache->len = l;
+    }
+    rcu_read_unlock();
+
+    return cache->len;
+}
+
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len)
+{
+    assert(cache->ptr);
+    invalidate_and_set_dirty(cache->mr, cache->ram_addr + addr, access_len);
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (!cache->mr) {
+        return;
+    }
+    memory_region_unref(cache->mr);
+    cache->mr = NULL;
+    cache->ptr = NULL;
+    cache->len = 0;
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <float.h>
+#include <math.h>
 
 #include "fpu/softfloat.h"
 
@@ -2158,6 +2160,103 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Host floating-point fast path.  Once the inexact flag has been raised, and
+| while rounding to nearest-even, the result of adding, subtracting,
+| multiplying or dividing zero or normal operands, or of taking the square
+| root of a non-negative zero or normal operand, only differs from what the
+| host FPU computes if the operation overflows or underflows.  In that case,
+| as for all other operands, the result is computed again in software so that
+| the remaining exception flags are raised.
+|   The fast path cannot be used if the host evaluates `float' and `double'
+| expressions with extra precision (e.g. x87) or with -ffast-math.
+*----------------------------------------------------------------------------*/
+
+#if defined(__FAST_MATH__) || !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD != 0
+# define QEMU_HARDFLOAT 0
+#else
+# define QEMU_HARDFLOAT 1
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline flag float32_is_zero_or_normal(float32 a)
+{
+    int exp = extractFloat32Exp(a);
+
+    return exp ? exp != 0xFF : extractFloat32Frac(a) == 0;
+}
+
+static inline flag float64_is_zero_or_normal(float64 a)
+{
+    int exp = extractFloat64Exp(a);
+
+    return exp ? exp != 0x7FF : extractFloat64Frac(a) == 0;
+}
+
+/*----------------------------------------------------------------------------
+| Returns 1 if the fast path may be taken for operands `a' and `b' (pass the
+| same value twice for unary operations).
+*----------------------------------------------------------------------------*/
+
+static inline flag float32_can_use_host_fpu(float32 a, float32 b,
+                                            float_status *status)
+{
+    return QEMU_HARDFLOAT
+        && (status->float_exception_flags & float_flag_inexact)
+        && status->float_rounding_mode == float_round_nearest_even
+        && float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+static inline flag float64_can_use_host_fpu(float64 a, float64 b,
+                                            float_status *status)
+{
+    return QEMU_HARDFLOAT
+        && (status->float_exception_flags & float_flag_inexact)
+        && status->float_rounding_mode == float_round_nearest_even
+        && float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+/*----------------------------------------------------------------------------
+| Returns 1 if the single-precision result `r' computed by the host FPU can
+| be used, i.e. if it is neither infinite nor tiny.  A zero result is only
+| accepted if `zero_ok' says that it is exact.
+*----------------------------------------------------------------------------*/
+
+static inline flag float32_host_result_ok(float32 r, flag zero_ok)
+{
+    uint32_t mag = float32_val(r) & 0x7FFFFFFF;
+
+    if (mag >= 0x7F800000) {
+        return 0;
+    }
+    if (mag <= 0x00800000) {
+        return zero_ok && mag == 0;
+    }
+    return 1;
+}
+
+static inline flag float64_host_result_ok(float64 r, flag zero_ok)
+{
+    uint64_t mag = float64_val(r) & LIT64(0x7FFFFFFFFFFFFFFF);
+
+    if (mag >= LIT64(0x7FF0000000000000)) {
+        return 0;
+    }
+    if (mag <= LIT64(0x0010000000000000)) {
+        return zero_ok && mag == 0;
+    }
+    return 1;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2167,6 +2266,19 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 float32 float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (float32_can_use_host_fpu(a, b, status)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float32_host_result_ok(ur.s,
+                                   float32_is_zero(a) && float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2190,6 +2302,19 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 float32 float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (float32_can_use_host_fpu(a, b, status)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float32_host_result_ok(ur.s,
+                                   float32_is_zero(a) && float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2218,6 +2343,18 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (float32_can_use_host_fpu(a, b, status)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float32_host_result_ok(ur.s,
+                                   float32_is_zero(a) || float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2280,6 +2417,18 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+
+    if (float32_can_use_host_fpu(a, b, status) && !float32_is_zero(b)) {
+        union_float32 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float32_host_result_ok(ur.s, float32_is_zero(a))) {
+            return ur.s;
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2679,6 +2828,18 @@ float32 float32_sqrt(float32 a, float_status *status)
     int aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+
+    if (float32_can_use_host_fpu(a, a, status)
+        && (!extractFloat32Sign(a) || float32_is_zero(a))) {
+        union_float32 ua, ur;
+
+        ua.s = a;
+        ur.h = sqrtf(ua.h);
+        if (float32_host_result_ok(ur.s, float32_is_zero(a))) {
+            return ur.s;
+        }
+    }
+
     a = float32_squash_input_denormal(a, status);
 
     aSig = extractFloat32Frac( a );
@@ -3958,6 +4119,19 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 float64 float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (float64_can_use_host_fpu(a, b, status)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float64_host_result_ok(ur.s,
+                                   float64_is_zero(a) && float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3981,6 +4155,19 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 float64 float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+
+    if (float64_can_use_host_fpu(a, b, status)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float64_host_result_ok(ur.s,
+                                   float64_is_zero(a) && float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4007,6 +4194,18 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
     int aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (float64_can_use_host_fpu(a, b, status)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float64_host_result_ok(ur.s,
+                                   float64_is_zero(a) || float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4071,6 +4270,18 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+
+    if (float64_can_use_host_fpu(a, b, status) && !float64_is_zero(b)) {
+        union_float64 ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float64_host_result_ok(ur.s, float64_is_zero(a))) {
+            return ur.s;
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4483,6 +4694,18 @@ float64 float64_sqrt(float64 a, float_status *status)
     int aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+
+    if (float64_can_use_host_fpu(a, a, status)
+        && (!extractFloat64Sign(a) || float64_is_zero(a))) {
+        union_float64 ua, ur;
+
+        ua.s = a;
+        ur.h = sqrt(ua.h);
+        if (float64_host_result_ok(ur.s, float64_is_zero(a))) {
+            return ur.s;
+        }
+    }
+
     a = float64_squash_input_denormal(a, status);
 
     aSig = extractFloat64Frac( a );
@@ -60,6 +60,10 @@ typedef struct extended_ops {
 #define V9FS_RDONLY                 0x00000040
 #define V9FS_PROXY_SOCK_FD          0x00000080
 #define V9FS_PROXY_SOCK_NAME        0x00000100
+/*
+ * Nobody but the guest changes the export, metadata may be cached
+ */
+#define V9FS_CACHE_LOOSE            0x00000200
 
 #define V9FS_SEC_MASK               0x0000003C
 
@@ -27,6 +27,9 @@ static QemuOptsList qemu_fsdev_opts = {
         }, {
             .name = "writeout",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
         }, {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
@@ -63,6 +66,9 @@ static QemuOptsList qemu_virtfs_opts = {
         }, {
             .name = "writeout",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
         }, {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
@@ -36,6 +36,7 @@ int qemu_fsdev_add(QemuOpts *opts)
     const char *fsdev_id = qemu_opts_id(opts);
     const char *fsdriver = qemu_opt_get(opts, "fsdriver");
     const char *writeout = qemu_opt_get(opts, "writeout");
+    const char *cache = qemu_opt_get(opts, "cache");
     bool ro = qemu_opt_get_bool(opts, "readonly", 0);
 
     if (!fsdev_id) {
@@ -59,6 +60,11 @@ int qemu_fsdev_add(QemuOpts *opts)
         return -1;
     }
 
+    if (cache && strcmp(cache, "none") && strcmp(cache, "loose")) {
+        error_report("fsdev: Invalid cache mode %s", cache);
+        return -1;
+    }
+
     fsle = g_malloc0(sizeof(*fsle));
     fsle->fse.fsdev_id = g_strdup(fsdev_id);
     fsle->fse.ops = FsDrivers[i].ops;
@@ -67,6 +73,9 @@ int qemu_fsdev_add(QemuOpts *opts)
             fsle->fse.export_flags |= V9FS_IMMEDIATE_WRITEOUT;
         }
     }
+    if (cache && !strcmp(cache, "loose")) {
+        fsle->fse.export_flags |= V9FS_CACHE_LOOSE;
+    }
     if (ro) {
         fsle->fse.export_flags |= V9FS_RDONLY;
     } else {
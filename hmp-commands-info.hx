@@ -264,16 +264,17 @@ ETEXI
 
     {
         .name       = "mtree",
-        .args_type  = "",
-        .params     = "",
-        .help       = "show memory tree",
+        .args_type  = "profile:-p",
+        .params     = "[-p]",
+        .help       = "show memory tree (-p: with access counts)",
         .mhandler.cmd = hmp_info_mtree,
     },
 
 STEXI
-@item info mtree
+@item info mtree [-p]
 @findex mtree
-Show memory tree.
+Show memory tree.  With @option{-p}, show the accesses counted for each
+region since @code{mtree-profile on}.
 ETEXI
 
     {
@@ -712,6 +713,21 @@ STEXI
 @item info iothreads
 @findex iothreads
 Show iothread's identifiers.
+ETEXI
+
+    {
+        .name       = "sync-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show lock contention statistics",
+        .mhandler.cmd = hmp_info_sync_profile,
+    },
+
+STEXI
+@item info sync-profile
+@findex sync-profile
+Show the lock contention statistics collected with @code{sync-profile on},
+sorted by the total time spent waiting.
 ETEXI
 
     {
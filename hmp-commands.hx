@@ -281,9 +281,11 @@ ETEXI
 
     {
         .name       = "trace-event",
-        .args_type  = "name:s,option:b",
-        .params     = "name on|off",
-        .help       = "changes status of a specific trace event",
+        .args_type  = "name:s,option:b,sample:i?,rate:i?",
+        .params     = "name on|off [sample [rate]]",
+        .help       = "changes status of a specific trace event, optionally "
+                      "recording only 1 in 'sample' occurrences and at most "
+                      "'rate' records per second",
         .mhandler.cmd = hmp_trace_event,
         .command_completion = trace_event_completion,
     },
@@ -291,7 +293,41 @@ ETEXI
 STEXI
 @item trace-event
 @findex trace-event
-changes status of a trace event
+changes status of a trace event.  With @var{sample}, only one in
+@var{sample} occurrences of the event is recorded; with @var{rate}, at most
+@var{rate} occurrences are recorded each second.  0 lifts either limit.
+ETEXI
+
+    {
+        .name       = "sync-profile",
+        .args_type  = "action:s",
+        .params     = "on|off|reset",
+        .help       = "enable, disable or reset lock contention profiling",
+        .mhandler.cmd = hmp_sync_profile,
+    },
+
+STEXI
+@item sync-profile on|off|reset
+@findex sync-profile
+Enable or disable the accounting of lock waits and hold times for each call
+site of a QemuMutex or the big QEMU lock, or clear the statistics collected
+so far.  The statistics are shown by @code{info sync-profile}.
+ETEXI
+
+    {
+        .name       = "mtree-profile",
+        .args_type  = "action:s",
+        .params     = "on|off|reset",
+        .help       = "enable, disable or reset memory region profiling",
+        .mhandler.cmd = hmp_mtree_profile,
+    },
+
+STEXI
+@item mtree-profile on|off|reset
+@findex mtree-profile
+Enable or disable counting the reads and writes handled by each memory
+region and the time spent in its callbacks, or clear the counts.  The counts
+are shown by @code{info mtree -p}.
 ETEXI
 
 #if defined(CONFIG_TRACE_SIMPLE)
@@ -1008,7 +1044,7 @@ ETEXI
 
     {
         .name       = "migrate_set_parameter",
-        .args_type  = "parameter:s,value:i",
+        .args_type  = "parameter:s,value:s",
         .params     = "parameter value",
         .help       = "Set the parameter for migration",
         .mhandler.cmd = hmp_migrate_set_parameter,
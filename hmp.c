@@ -230,6 +230,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
@@ -239,6 +243,24 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->x_cpu_throttle_percentage);
     }
 
+    if (info->has_x_timings) {
+        MigrationTimings *t = info->x_timings;
+        MigrationSectionTimeList *entry;
+
+        monitor_printf(mon, "bitmap sync: %" PRId64 " us\n", t->bitmap_sync);
+        monitor_printf(mon, "page scan: %" PRId64 " us\n", t->page_scan);
+        monitor_printf(mon, "compression: %" PRId64 " us\n", t->compression);
+        monitor_printf(mon, "xbzrle: %" PRId64 " us\n", t->xbzrle);
+        monitor_printf(mon, "socket write: %" PRId64 " us\n",
+                       t->socket_write);
+        monitor_printf(mon, "throttled: %" PRId64 " us\n", t->throttled);
+        for (entry = t->stop_copy; entry; entry = entry->next) {
+            monitor_printf(mon, "stop-copy %s.%" PRId64 ": %" PRId64 " us\n",
+                           entry->value->idstr, entry->value->instance_id,
+                           entry->value->time);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -285,6 +307,36 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES],
+            params->x_postcopy_prefetch_pages);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE],
+            params->x_rdma_chunk_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE],
+            params->x_rdma_reg_cache_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_IOV_BATCH],
+            params->x_iov_batch);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE],
+            params->x_block_chunk_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT],
+            params->x_block_inflight);
+        monitor_printf(mon, " %s: '%s'",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_CREDS],
+            params->has_tls_creds ? params->tls_creds : "");
+        monitor_printf(mon, " %s: '%s'",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
+            params->has_tls_hostname ? params->tls_hostname : "");
         monitor_printf(mon, "\n");
     }
 
@@ -1082,7 +1134,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
                      false, NULL, false, NULL,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, false, true, &err);
+                     false, 0, false, 0, false, true, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1111,7 +1163,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1234,17 +1286,44 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int64_t value = 0;
+    int compress_method = 0;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
+    bool has_compress_method = false;
+    bool has_x_postcopy_prefetch_pages = false;
+    bool has_x_rdma_chunk_size = false;
+    bool has_x_rdma_reg_cache_size = false;
+    bool has_x_iov_batch = false;
+    bool has_x_block_chunk_size = false;
+    bool has_x_block_inflight = false;
+    bool has_tls_creds = false;
+    bool has_tls_hostname = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
         if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            if (i == MIGRATION_PARAMETER_COMPRESS_METHOD) {
+                compress_method = qapi_enum_parse(MigrationCompressMethod_lookup,
+                                                  valuestr,
+                                                  MIGRATION_COMPRESS_METHOD__MAX,
+                                                  -1, &err);
+            } else if (i == MIGRATION_PARAMETER_TLS_CREDS ||
+                       i == MIGRATION_PARAMETER_TLS_HOSTNAME) {
+                /* strings, taken as they are */
+            } else if (qemu_strtoll(valuestr, NULL, 10, &value) < 0) {
+                error_setg(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                           "an integer");
+            }
+            if (err) {
+                break;
+            }
             switch (i) {
             case MIGRATION_PARAMETER_COMPRESS_LEVEL:
                 has_compress_level = true;
@@ -1261,12 +1340,52 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES:
+                has_x_postcopy_prefetch_pages = true;
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE:
+                has_x_rdma_chunk_size = true;
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE:
+                has_x_rdma_reg_cache_size = true;
+                break;
+            case MIGRATION_PARAMETER_X_IOV_BATCH:
+                has_x_iov_batch = true;
+                break;
+            case MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE:
+                has_x_block_chunk_size = true;
+                break;
+            case MIGRATION_PARAMETER_X_BLOCK_INFLIGHT:
+                has_x_block_inflight = true;
+                break;
+            case MIGRATION_PARAMETER_TLS_CREDS:
+                has_tls_creds = true;
+                break;
+            case MIGRATION_PARAMETER_TLS_HOSTNAME:
+                has_tls_hostname = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
+                                       has_compress_method, compress_method,
+                                       has_x_postcopy_prefetch_pages, value,
+                                       has_x_rdma_chunk_size, value,
+                                       has_x_rdma_reg_cache_size, value,
+                                       has_x_iov_batch, value,
+                                       has_x_block_chunk_size, value,
+                                       has_x_block_inflight, value,
+                                       has_tls_creds, valuestr,
+                                       has_tls_hostname, valuestr,
                                        &err);
             break;
         }
@@ -1429,7 +1548,11 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false, /* No default I/O size */
                               0,
                               false,
-                              NULL, &err);
+                              NULL,
+                              false, /* No group share via HMP */
+                              0,
+                              false,
+                              0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1442,6 +1565,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(device, base != NULL, base, false, NULL,
                      qdict_haskey(qdict, "speed"), speed,
+                     false, 0, false, false,
                      true, BLOCKDEV_ON_ERROR_REPORT, &error);
 
     hmp_handle_error(mon, &error);
@@ -2007,13 +2131,100 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s:\n", value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-hits=%" PRId64 "\n", value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRId64 "\n",
+                       value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
 }
 
+static int sync_profile_cmp(const void *a, const void *b)
+{
+    const SyncProfileInfo *x = *(SyncProfileInfo * const *)a;
+    const SyncProfileInfo *y = *(SyncProfileInfo * const *)b;
+
+    if (x->wait_ns != y->wait_ns) {
+        return x->wait_ns > y->wait_ns ? -1 : 1;
+    }
+    return x->hold_ns > y->hold_ns ? -1 : x->hold_ns < y->hold_ns;
+}
+
+void hmp_info_sync_profile(Monitor *mon, const QDict *qdict)
+{
+    SyncProfileInfoList *info_list = qmp_query_sync_profile(NULL);
+    SyncProfileInfoList *info;
+    SyncProfileInfo **sites;
+    size_t i, n = 0;
+
+    for (info = info_list; info; info = info->next) {
+        n++;
+    }
+    sites = g_new(SyncProfileInfo *, n);
+    for (i = 0, info = info_list; info; info = info->next) {
+        sites[i++] = info->value;
+    }
+    qsort(sites, n, sizeof(*sites), sync_profile_cmp);
+
+    monitor_printf(mon, "%-40s %5s %12s %10s %14s %12s %14s\n",
+                   "site", "type", "acquired", "contended", "wait-ns",
+                   "max-wait-ns", "hold-ns");
+    for (i = 0; i < n; i++) {
+        SyncProfileInfo *value = sites[i];
+        char *where = g_strdup_printf("%s:%" PRId64, value->file,
+                                      value->line);
+
+        monitor_printf(mon, "%-40s %5s %12" PRId64 " %10" PRId64 " %14" PRId64
+                       " %12" PRId64 " %14" PRId64 "\n",
+                       where, value->bql ? "bql" : "mutex",
+                       value->acquisitions, value->contended, value->wait_ns,
+                       value->max_wait_ns, value->hold_ns);
+        g_free(where);
+    }
+
+    g_free(sites);
+    qapi_free_SyncProfileInfoList(info_list);
+}
+
+void hmp_sync_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *action = qdict_get_str(qdict, "action");
+    Error *err = NULL;
+    int val;
+
+    val = qapi_enum_parse(SyncProfileAction_lookup, action,
+                          SYNC_PROFILE_ACTION__MAX, -1, &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+    qmp_sync_profile(val, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_mtree_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *action = qdict_get_str(qdict, "action");
+    Error *err = NULL;
+    int val;
+
+    val = qapi_enum_parse(MtreeProfileAction_lookup, action,
+                          MTREE_PROFILE_ACTION__MAX, -1, &err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+    qmp_mtree_profile(val, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
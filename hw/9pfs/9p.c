@@ -198,6 +198,98 @@ int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
     return err;
 }
 
+void v9fs_dir_cache_free(V9fsDirCache *cache)
+{
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    for (i = 0; i < cache->count; i++) {
+        g_free(cache->ent[i].name);
+    }
+    g_free(cache);
+}
+
+/* Bounds the stat cache, it is emptied when it grows past this */
+#define V9FS_STAT_CACHE_MAX 4096
+
+/* Paths are opaque handles for some fs drivers, hash all of their bytes */
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint h = 5381;
+    int i;
+
+    for (i = 0; i < path->size; i++) {
+        h = h * 33 + (uint8_t)path->data[i];
+    }
+    return h;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *pa = a, *pb = b;
+
+    return pa->size == pb->size && !memcmp(pa->data, pb->data, pa->size);
+}
+
+static void v9fs_path_destroy(gpointer data)
+{
+    v9fs_path_free(data);
+    g_free(data);
+}
+
+bool v9fs_stat_cache_lookup(V9fsState *s, V9fsPath *path, struct stat *stbuf)
+{
+    struct stat *st;
+
+    if (!s->stat_cache) {
+        return false;
+    }
+    st = g_hash_table_lookup(s->stat_cache, path);
+    if (!st) {
+        return false;
+    }
+    *stbuf = *st;
+    return true;
+}
+
+/* @gen is the value of stat_cache_gen before @stbuf was read */
+void v9fs_stat_cache_insert(V9fsState *s, V9fsPath *path,
+                            const struct stat *stbuf, uint64_t gen)
+{
+    V9fsPath *key;
+
+    if (!s->stat_cache || gen != s->stat_cache_gen) {
+        return;
+    }
+    if (g_hash_table_size(s->stat_cache) >= V9FS_STAT_CACHE_MAX) {
+        g_hash_table_remove_all(s->stat_cache);
+    }
+    key = g_new0(V9fsPath, 1);
+    v9fs_path_copy(key, path);
+    g_hash_table_replace(s->stat_cache, key, g_memdup(stbuf, sizeof(*stbuf)));
+}
+
+/*
+ * Called after an operation changed the attributes of @path.  Operations
+ * that add, remove or rename directory entries also change their parent
+ * directory and may move whole subtrees: they pass NULL to drop everything.
+ */
+void v9fs_stat_cache_invalidate(V9fsState *s, V9fsPath *path)
+{
+    if (!s->stat_cache) {
+        return;
+    }
+    s->stat_cache_gen++;
+    if (path) {
+        g_hash_table_remove(s->stat_cache, path);
+    } else {
+        g_hash_table_remove_all(s->stat_cache);
+    }
+}
+
 /*
  * Return TRUE if s1 is an ancestor of s2.
  *
@@ -351,6 +443,7 @@ static int free_fid(V9fsPDU *pdu, V9fsFidState *fidp)
     } else if (fidp->fid_type == P9_FID_XATTR) {
         retval = v9fs_xattr_fid_clunk(pdu, fidp);
     }
+    v9fs_dir_cache_free(fidp->dir_cache);
     v9fs_path_free(&fidp->path);
     g_free(fidp);
     return retval;
@@ -1795,69 +1888,87 @@ static size_t v9fs_readdir_data_size(V9fsString *name)
     return 24 + v9fs_string_size(name);
 }
 
-static int v9fs_do_readdir(V9fsPDU *pdu,
-                           V9fsFidState *fidp, int32_t max_count)
+/* Index of the cached entry that starts at @offset, or -1 */
+static int v9fs_dir_cache_find(V9fsDirCache *cache, off_t offset)
 {
-    size_t size;
+    int i;
+
+    if (cache->start == offset) {
+        return 0;
+    }
+    for (i = 0; i < cache->count; i++) {
+        if (cache->ent[i].off == offset) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+static int v9fs_do_readdir(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset,
+                           int32_t max_count)
+{
+    V9fsDirCache *cache;
+    V9fsDirEnt *ent;
     V9fsQID qid;
     V9fsString name;
-    int len, err = 0;
+    int i, len, err;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    /*
+     * Offset 0 means the guest rewound the directory, and expects to see
+     * its current contents: do not serve it from what was read before.
+     */
+    if (offset == 0) {
+        v9fs_dir_cache_free(fidp->dir_cache);
+        fidp->dir_cache = NULL;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
     while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
+        cache = fidp->dir_cache;
+        i = cache ? v9fs_dir_cache_find(cache, offset) : -1;
+        if (i < 0 || (i == cache->count && !cache->eof)) {
+            err = v9fs_co_readdir_cache(pdu, fidp, offset);
+            if (err < 0) {
+                return err;
+            }
+            continue;
         }
-        v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
+        if (i == cache->count) {
+            /* end of directory */
             return count;
         }
-        /*
-         * Fill up just the path field of qid because the client uses
-         * only that. To fill the entire qid structure we will have
-         * to stat each dirent found, which is expensive
-         */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
-        /* Fill the other fields with dummy values */
-        qid.type = 0;
-        qid.version = 0;
 
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-        if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+        for (; i < cache->count; i++) {
+            ent = &cache->ent[i];
+            v9fs_string_init(&name);
+            v9fs_string_sprintf(&name, "%s", ent->name);
+            if ((count + v9fs_readdir_data_size(&name)) > max_count) {
+                /* Ran out of buffer, the rest stays cached for next time */
+                v9fs_string_free(&name);
+                return count;
+            }
+            /*
+             * Fill up just the path field of qid because the client uses
+             * only that. To fill the entire qid structure we will have
+             * to stat each dirent found, which is expensive
+             */
+            qid.path = ent->ino;
+            /* Fill the other fields with dummy values */
+            qid.type = 0;
+            qid.version = 0;
+
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "Qqbs",
+                              &qid, ent->off,
+                              ent->type, &name);
             v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            if (len < 0) {
+                return len;
+            }
+            count += len;
+            offset = ent->off;
         }
-        count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
-    if (err < 0) {
-        return err;
     }
-    return count;
 }
 
 static void v9fs_readdir(void *opaque)
@@ -1887,12 +1998,7 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
-    }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_do_readdir(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -3326,6 +3432,11 @@ int v9fs_device_realize_common(V9fsState *s, Error **errp)
     s->fid_list = NULL;
     qemu_co_rwlock_init(&s->rename_lock);
 
+    if (s->ctx.export_flags & V9FS_CACHE_LOOSE) {
+        s->stat_cache = g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                              v9fs_path_destroy, g_free);
+    }
+
     if (s->ops->init(&s->ctx) < 0) {
         error_setg(errp, "9pfs Failed to initialize fs-driver with id:%s"
                    " and export path:%s", s->fsconf.fsdev_id, s->ctx.fs_root);
@@ -3354,6 +3465,10 @@ int v9fs_device_realize_common(V9fsState *s, Error **errp)
     rc = 0;
 out:
     if (rc) {
+        if (s->stat_cache) {
+            g_hash_table_destroy(s->stat_cache);
+            s->stat_cache = NULL;
+        }
         g_free(s->ctx.fs_root);
         g_free(s->tag);
         v9fs_path_free(&path);
@@ -3363,6 +3478,10 @@ out:
 
 void v9fs_device_unrealize_common(V9fsState *s, Error **errp)
 {
+    if (s->stat_cache) {
+        g_hash_table_destroy(s->stat_cache);
+        s->stat_cache = NULL;
+    }
     g_free(s->ctx.fs_root);
     g_free(s->tag);
 }
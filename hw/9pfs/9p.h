@@ -185,6 +185,27 @@ union V9fsFidOpenState {
     void *private;
 };
 
+/*
+ * Directory entries read ahead by Treaddir, so that a whole batch costs a
+ * single trip to a worker thread.  Entry i starts at the offset returned
+ * with entry i - 1, or at @start for the first one.
+ */
+#define V9FS_DIR_CACHE_ENTRIES 128
+
+typedef struct V9fsDirEnt {
+    uint64_t ino;
+    off_t off;
+    uint8_t type;
+    char *name;
+} V9fsDirEnt;
+
+typedef struct V9fsDirCache {
+    off_t start;
+    int count;
+    bool eof;
+    V9fsDirEnt ent[V9FS_DIR_CACHE_ENTRIES];
+} V9fsDirCache;
+
 struct V9fsFidState
 {
     int fid_type;
@@ -199,6 +220,7 @@ struct V9fsFidState
     int clunked;
     V9fsFidState *next;
     V9fsFidState *rclm_lst;
+    V9fsDirCache *dir_cache;
 };
 
 typedef struct V9fsState
@@ -219,6 +241,13 @@ typedef struct V9fsState
     int32_t root_fid;
     Error *migration_blocker;
     V9fsConf fsconf;
+    /*
+     * lstat results of cache=loose exports, keyed by V9fsPath.  Every
+     * invalidation bumps stat_cache_gen, so that a lookup that raced
+     * with a modification does not insert a stale result.
+     */
+    GHashTable *stat_cache;
+    uint64_t stat_cache_gen;
 } V9fsState;
 
 /* 9p2000.L open flags */
@@ -312,6 +341,12 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern void v9fs_dir_cache_free(V9fsDirCache *cache);
+extern bool v9fs_stat_cache_lookup(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf);
+extern void v9fs_stat_cache_insert(V9fsState *s, V9fsPath *path,
+                                   const struct stat *stbuf, uint64_t gen);
+extern void v9fs_stat_cache_invalidate(V9fsState *s, V9fsPath *path);
 extern int v9fs_device_realize_common(V9fsState *s, Error **errp);
 extern void v9fs_device_unrealize_common(V9fsState *s, Error **errp);
 
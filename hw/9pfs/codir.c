@@ -40,6 +40,61 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Replace the directory cache of @fidp with up to V9FS_DIR_CACHE_ENTRIES
+ * entries read from @offset, in a single trip to a worker thread.
+ */
+int v9fs_co_readdir_cache(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset)
+{
+    int err;
+    V9fsState *s = pdu->s;
+    V9fsDirCache *cache;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    cache = g_new0(V9fsDirCache, 1);
+    v9fs_co_run_in_worker(
+        {
+            struct dirent dent;
+            struct dirent *result;
+
+            if (offset == 0) {
+                s->ops->rewinddir(&s->ctx, &fidp->fs);
+            } else {
+                s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+            }
+            cache->start = offset;
+            err = 0;
+            while (cache->count < V9FS_DIR_CACHE_ENTRIES) {
+                V9fsDirEnt *ent = &cache->ent[cache->count];
+
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, &dent, &result);
+                if (!result) {
+                    if (errno) {
+                        err = -errno;
+                    } else {
+                        cache->eof = true;
+                    }
+                    break;
+                }
+                ent->ino = dent.d_ino;
+                ent->off = dent.d_off;
+                ent->type = dent.d_type;
+                ent->name = g_strdup(dent.d_name);
+                cache->count++;
+            }
+        });
+    if (err < 0) {
+        v9fs_dir_cache_free(cache);
+        return err;
+    }
+    v9fs_dir_cache_free(fidp->dir_cache);
+    fidp->dir_cache = cache;
+    return 0;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -115,6 +170,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
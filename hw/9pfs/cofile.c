@@ -45,11 +45,16 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    uint64_t gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    if (v9fs_stat_cache_lookup(s, path, stbuf)) {
+        return 0;
+    }
+    gen = s->stat_cache_gen;
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -58,6 +63,9 @@ int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
                 err = -errno;
             }
         });
+    if (!err) {
+        v9fs_stat_cache_insert(s, path, stbuf, gen);
+    }
     v9fs_path_unlock(s);
     return err;
 }
@@ -112,6 +120,9 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
                 err = 0;
             }
         });
+    if (flags & O_TRUNC) {
+        v9fs_stat_cache_invalidate(s, &fidp->path);
+    }
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -166,6 +177,7 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -233,6 +245,7 @@ int v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
@@ -253,6 +266,7 @@ int v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, &fidp->path);
     return err;
 }
 
@@ -109,6 +109,7 @@ int v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -130,6 +131,7 @@ int v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -154,6 +156,7 @@ int v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid, gid_t gid)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -174,6 +177,7 @@ int v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -212,6 +216,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
@@ -233,6 +238,7 @@ int v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
@@ -253,6 +259,7 @@ int v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path, V9fsString *name, int flags)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
@@ -273,6 +280,7 @@ int v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath, V9fsPath *newpath)
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     return err;
 }
 
@@ -293,6 +301,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     return err;
 }
 
@@ -330,6 +339,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_stat_cache_invalidate(s, NULL);
     v9fs_path_unlock(s);
     return err;
 }
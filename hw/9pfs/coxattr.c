@@ -82,6 +82,7 @@ int v9fs_co_lsetxattr(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -103,6 +104,7 @@ int v9fs_co_lremovexattr(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_stat_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -17,7 +17,15 @@
 /**
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
- *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
+ *              cmb_size_mb=<cmb_size_mb[optional]>, \
+ *              iothread=<iothread_id[optional]>
+ *
+ * cmb_size_mb is the size of the Controller Memory Buffer in MBs, a power of
+ * two.  Submission queues and data may be placed there by the guest.
+ *
+ * With iothread, all queues are processed in that IOThread instead of the
+ * main loop.
  */
 
 #include "qemu/osdep.h"
@@ -28,11 +36,58 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
 
 #include "nvme.h"
 
+#define NVME_CMB_BIR 2
+
 static void nvme_process_sq(void *opaque);
 
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr, int size)
+{
+    pcibus_t base;
+
+    if (!n->cmbuf) {
+        return false;
+    }
+    base = pci_get_bar_addr(&n->parent_obj, NVME_CMB_BIR);
+    return base != PCI_BAR_UNMAPPED && addr >= base &&
+           addr - base + size <= memory_region_size(&n->ctrl_mem);
+}
+
+static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+    if (nvme_addr_is_cmb(n, addr, size)) {
+        pcibus_t base = pci_get_bar_addr(&n->parent_obj, NVME_CMB_BIR);
+
+        memcpy(buf, n->cmbuf + (addr - base), size);
+        return;
+    }
+    pci_dma_read(&n->parent_obj, addr, buf, size);
+}
+
+static uint32_t nvme_read_dbbuf(NvmeCtrl *n, uint64_t addr)
+{
+    uint32_t val;
+
+    pci_dma_read(&n->parent_obj, addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void nvme_write_dbbuf(NvmeCtrl *n, uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    pci_dma_write(&n->parent_obj, addr, &val, sizeof(val));
+}
+
+static QEMUTimer *nvme_timer_new(NvmeCtrl *n, QEMUTimerCB *cb, void *opaque)
+{
+    return aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, cb, opaque);
+}
+
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
     return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
@@ -67,17 +122,88 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_notify_vector(NvmeCtrl *n, uint32_t vector)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+/* Raises the interrupts requested by the IOThread, under the BQL */
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    for (i = 0; i < BITS_TO_LONGS(n->num_queues + 1); i++) {
+        unsigned long bits = atomic_xchg(&n->irq_pending[i], 0);
+
+        while (bits) {
+            nvme_notify_vector(n, i * BITS_PER_LONG + ctzl(bits));
+            bits &= bits - 1;
+        }
+    }
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
+        if (n->iothread) {
+            atomic_or(&n->irq_pending[BIT_WORD(cq->vector)],
+                      BIT_MASK(cq->vector));
+            qemu_bh_schedule(n->irq_bh);
         } else {
-            pci_irq_pulse(&n->parent_obj);
+            nvme_notify_vector(n, cq->vector);
+        }
+    }
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    if (cq->db_addr) {
+        head = nvme_read_dbbuf(cq->ctrl, cq->db_addr);
+        if (head < cq->size) {
+            cq->head = head;
+        }
+    }
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    if (sq->db_addr) {
+        tail = nvme_read_dbbuf(sq->ctrl, sq->db_addr);
+        if (tail < sq->size) {
+            sq->tail = tail;
         }
     }
 }
 
+/* With shadow doorbells the guest only writes the CQ head doorbell register
+ * once the head moves past the event index.  Before giving up on a full
+ * queue, point the event index at the current head so that the guest rings
+ * the doorbell on its next update, and look again for an update that raced
+ * with it.
+ */
+static bool nvme_cq_check_full(NvmeCQueue *cq)
+{
+    if (!nvme_cq_full(cq)) {
+        return false;
+    }
+    if (!cq->db_addr) {
+        return true;
+    }
+    nvme_write_dbbuf(cq->ctrl, cq->ei_addr, cq->head);
+    smp_mb();
+    nvme_update_cq_head(cq);
+    return nvme_cq_full(cq);
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -165,11 +291,13 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
+    nvme_update_cq_head(cq);
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (nvme_cq_full(cq)) {
+        if (nvme_cq_check_full(cq)) {
             break;
         }
 
@@ -330,6 +458,26 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+/* Shadow doorbells are laid out like the doorbell registers, with a stride
+ * of 4 bytes.  The guest owns them, but they must start out in sync with
+ * the queue.
+ */
+static void nvme_sq_set_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_write_dbbuf(n, sq->db_addr, sq->tail);
+    nvme_write_dbbuf(n, sq->ei_addr, sq->tail);
+}
+
+static void nvme_cq_set_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_write_dbbuf(n, cq->db_addr, cq->head);
+    nvme_write_dbbuf(n, cq->ei_addr, cq->head);
+}
+
 static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t sqid, uint16_t cqid, uint16_t size)
 {
@@ -342,6 +490,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -350,12 +499,16 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->timer = nvme_timer_new(n, nvme_process_sq, sq);
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (n->dbbuf_enabled && sqid) {
+        nvme_sq_set_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -429,11 +582,16 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->timer = nvme_timer_new(n, nvme_post_cqes, cq);
+
+    if (n->dbbuf_enabled && cqid) {
+        nvme_cq_set_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -529,6 +687,37 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+/* Doorbell Buffer Config: PRP1 points to the shadow doorbells, which the
+ * guest updates instead of (or before) the doorbell registers, and PRP2 to
+ * the event indexes, which tell it when it must write the registers too.
+ * Like Linux, only I/O queues use them.
+ */
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr ||
+        (dbs_addr & (n->page_size - 1)) || (eis_addr & (n->page_size - 1))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_set_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_set_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -546,6 +735,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -562,9 +753,12 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    nvme_update_sq_tail(sq);
+
+again:
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
@@ -580,6 +774,21 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
     }
+
+    /* Ask for a doorbell write when the guest submits past what we have
+     * seen, and pick up submissions that raced with the event index update.
+     * The admin command above may also have deleted the queue.
+     */
+    if (sq->db_addr && n->sq[sq->sqid] == sq) {
+        uint32_t tail = sq->tail;
+
+        nvme_write_dbbuf(n, sq->ei_addr, tail);
+        smp_mb();
+        nvme_update_sq_tail(sq);
+        if (sq->tail != tail && !QTAILQ_EMPTY(&sq->req_list)) {
+            goto again;
+        }
+    }
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
@@ -599,6 +808,8 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -758,14 +969,60 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
     }
 }
 
+/* Hand a doorbell write over to the IOThread, which owns the queues */
+static void nvme_queue_db(NvmeCtrl *n, hwaddr addr, int val)
+{
+    hwaddr idx = (addr - 0x1000) >> 2;
+
+    if (addr & ((1 << 2) - 1) || idx >= 2 * n->num_queues) {
+        return;
+    }
+
+    atomic_set(&n->db_values[idx], val);
+    atomic_or(&n->db_pending[BIT_WORD(idx)], BIT_MASK(idx));
+    event_notifier_set(&n->db_notifier);
+}
+
+static void nvme_db_notifier_cb(EventNotifier *e)
+{
+    NvmeCtrl *n = container_of(e, NvmeCtrl, db_notifier);
+    int i;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    for (i = 0; i < BITS_TO_LONGS(2 * n->num_queues); i++) {
+        unsigned long bits = atomic_xchg(&n->db_pending[i], 0);
+
+        while (bits) {
+            int idx = i * BITS_PER_LONG + ctzl(bits);
+
+            nvme_process_db(n, 0x1000 + (idx << 2),
+                            atomic_read(&n->db_values[idx]));
+            bits &= bits - 1;
+        }
+    }
+}
+
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     if (addr < sizeof(n->bar)) {
-        nvme_write_bar(n, addr, data, size);
+        if (n->iothread) {
+            aio_context_acquire(n->ctx);
+            nvme_write_bar(n, addr, data, size);
+            aio_context_release(n->ctx);
+        } else {
+            nvme_write_bar(n, addr, data, size);
+        }
     } else if (addr >= 0x1000) {
-        nvme_process_db(n, addr, data);
+        if (n->iothread) {
+            nvme_queue_db(n, addr, data);
+        } else {
+            nvme_process_db(n, addr, data);
+        }
     }
 }
 
@@ -779,6 +1036,79 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static void nvme_set_up_op_blockers(NvmeCtrl *n)
+{
+    BlockBackend *blk = n->conf.blk;
+
+    assert(!n->blocker);
+    error_setg(&n->blocker, "block device is in use by an NVMe IOThread");
+    blk_op_block_all(blk, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_RESIZE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_DRIVE_DEL, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_BACKUP_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_TARGET, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT_DELETE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_MIRROR_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_STREAM, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_REPLACE, n->blocker);
+}
+
+static void nvme_remove_op_blockers(NvmeCtrl *n)
+{
+    if (n->blocker) {
+        blk_op_unblock_all(n->conf.blk, n->blocker);
+        error_free(n->blocker);
+        n->blocker = NULL;
+    }
+}
+
+/* Moves the queues and the BlockBackend to the IOThread.  Doorbell writes
+ * are forwarded to it through db_notifier, interrupts come back through
+ * irq_bh because MSI-X must be raised under the BQL.
+ */
+static int nvme_start_iothread(NvmeCtrl *n)
+{
+    if (blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE, NULL)) {
+        return -1;
+    }
+    if (event_notifier_init(&n->db_notifier, 0) < 0) {
+        return -1;
+    }
+
+    n->ctx = iothread_get_aio_context(n->iothread);
+    n->db_values = g_new0(uint32_t, 2 * n->num_queues);
+    n->db_pending = bitmap_new(2 * n->num_queues);
+    n->irq_pending = bitmap_new(n->num_queues + 1);
+    n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+    nvme_set_up_op_blockers(n);
+
+    blk_set_aio_context(n->conf.blk, n->ctx);
+    aio_context_acquire(n->ctx);
+    aio_set_event_notifier(n->ctx, &n->db_notifier, false,
+                           nvme_db_notifier_cb);
+    aio_context_release(n->ctx);
+    return 0;
+}
+
+static void nvme_stop_iothread(NvmeCtrl *n)
+{
+    aio_context_acquire(n->ctx);
+    aio_set_event_notifier(n->ctx, &n->db_notifier, false, NULL);
+    nvme_clear_ctrl(n);
+    blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    aio_context_release(n->ctx);
+
+    nvme_remove_op_blockers(n);
+    event_notifier_cleanup(&n->db_notifier);
+    qemu_bh_delete(n->irq_bh);
+    g_free(n->irq_pending);
+    g_free(n->db_pending);
+    g_free(n->db_values);
+}
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
@@ -803,6 +1133,10 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    if (n->cmb_size_mb && !is_power_of_2(n->cmb_size_mb)) {
+        return -1;
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -825,6 +1159,14 @@ static int nvme_init(PCIDevice *pci_dev)
         &n->iomem);
     msix_init_exclusive_bar(&n->parent_obj, n->num_queues, 4);
 
+    if (n->iothread) {
+        if (nvme_start_iothread(n) < 0) {
+            return -1;
+        }
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     id->vid = cpu_to_le16(pci_get_word(pci_conf + PCI_VENDOR_ID));
     id->ssvid = cpu_to_le16(pci_get_word(pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
     strpadcpy((char *)id->mn, sizeof(id->mn), "QEMU NVMe Ctrl", ' ');
@@ -834,7 +1176,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -858,6 +1200,31 @@ static int nvme_init(PCIDevice *pci_dev)
     n->bar.vs = 0x00010100;
     n->bar.intmc = n->bar.intms = 0;
 
+    if (n->cmb_size_mb) {
+        NVME_CMBLOC_SET_BIR(n->bar.cmbloc, NVME_CMB_BIR);
+        NVME_CMBLOC_SET_OFST(n->bar.cmbloc, 0);
+
+        NVME_CMBSZ_SET_SQS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_CQS(n->bar.cmbsz, 0);
+        NVME_CMBSZ_SET_LISTS(n->bar.cmbsz, 0);
+        NVME_CMBSZ_SET_RDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_WDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_SZU(n->bar.cmbsz, 2); /* MBs */
+        NVME_CMBSZ_SET_SZ(n->bar.cmbsz, n->cmb_size_mb);
+
+        /* The CMB is plain RAM: the guest writes submission queue entries
+         * and data there without trapping, and nvme_addr_read() copies
+         * them out directly.  It was introduced in NVMe 1.2.
+         */
+        memory_region_init_ram(&n->ctrl_mem, OBJECT(n), "nvme-cmb",
+                               (uint64_t)n->cmb_size_mb << 20, &error_fatal);
+        n->cmbuf = memory_region_get_ram_ptr(&n->ctrl_mem);
+        pci_register_bar(&n->parent_obj, NVME_CMB_BIR,
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, &n->ctrl_mem);
+        n->bar.vs = 0x00010200;
+    }
+
     for (i = 0; i < n->num_namespaces; i++) {
         NvmeNamespace *ns = &n->namespaces[i];
         NvmeIdNs *id_ns = &ns->id_ns;
@@ -879,7 +1246,11 @@ static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
 
-    nvme_clear_ctrl(n);
+    if (n->iothread) {
+        nvme_stop_iothread(n);
+    } else {
+        nvme_clear_ctrl(n);
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -889,6 +1260,7 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -923,6 +1295,10 @@ static void nvme_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
 static const TypeInfo nvme_info = {
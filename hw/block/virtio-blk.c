@@ -28,9 +28,11 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req)
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req)
 {
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->in_len = 0;
     req->next = NULL;
@@ -40,7 +42,7 @@ void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req)
 void virtio_blk_free_request(VirtIOBlockReq *req)
 {
     if (req) {
-        g_free(req);
+        virtqueue_free_element(req->vq, req);
     }
 }
 
@@ -52,11 +54,11 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
+    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane) {
-        virtio_blk_data_plane_notify(s->dataplane);
+        virtio_blk_data_plane_notify(s->dataplane, req->vq);
     } else {
-        virtio_notify(vdev, s->vq);
+        virtio_notify(vdev, req->vq);
     }
 }
 
@@ -186,15 +188,8 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtqueue_pop(s->vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, req);
-    }
-    return req;
-}
+/* Requests popped from the ring per virtqueue_pop_batch() call */
+#define VIRTIO_BLK_POP_BATCH 32
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
@@ -577,11 +572,57 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     }
 }
 
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->held_mrb.num_reqs) {
+        trace_virtio_blk_merge_window_expired(s, s->held_mrb.num_reqs);
+        blk_io_plug(s->blk);
+        virtio_blk_submit_multireq(s->blk, &s->held_mrb);
+        blk_io_unplug(s->blk);
+    }
+}
+
+/* Submit the requests held back for merging and drop the timer, which
+ * belongs to the current AioContext of the BlockBackend.  Must be called
+ * before the BlockBackend is drained or moved to another AioContext.
+ */
+void virtio_blk_flush_merge_window(VirtIOBlock *s)
+{
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    if (s->merge_timer) {
+        timer_del(s->merge_timer);
+        timer_free(s->merge_timer);
+        s->merge_timer = NULL;
+    }
+    virtio_blk_merge_timer_cb(s);
+    aio_context_release(ctx);
+}
+
+static void virtio_blk_arm_merge_window(VirtIOBlock *s)
+{
+    if (!s->merge_timer) {
+        s->merge_timer = aio_timer_new(blk_get_aio_context(s->blk),
+                                       QEMU_CLOCK_REALTIME, SCALE_US,
+                                       virtio_blk_merge_timer_cb, s);
+    }
+    /* The window starts with the oldest held request */
+    if (!timer_pending(s->merge_timer)) {
+        timer_mod(s->merge_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                  s->conf.merge_window_us);
+    }
+}
+
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = &local_mrb;
+    unsigned int n;
 
     /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
      * dataplane here instead of waiting for .set_status().
@@ -591,14 +632,30 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
 
+    if (s->conf.merge_window_us && s->conf.request_merging) {
+        mrb = &s->held_mrb;
+    }
+
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
-    }
+    do {
+        VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+        unsigned int i;
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+        n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                                ARRAY_SIZE(reqs));
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            virtio_blk_handle_request(reqs[i], mrb);
+        }
+    } while (n == VIRTIO_BLK_POP_BATCH);
+
+    if (mrb->num_reqs) {
+        if (mrb == &s->held_mrb) {
+            virtio_blk_arm_merge_window(s);
+        } else {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
     }
 
     blk_io_unplug(s->blk);
@@ -632,6 +689,8 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtIOBlock *s = opaque;
 
     if (!running) {
+        /* Submit held requests before vm_stop() drains the device */
+        virtio_blk_flush_merge_window(s);
         return;
     }
 
@@ -653,6 +712,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
      */
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
     blk_drain(s->blk);
 
     if (s->dataplane) {
@@ -681,6 +741,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     virtio_stl_p(vdev, &blkcfg.blk_size, blk_size);
     virtio_stw_p(vdev, &blkcfg.min_io_size, conf->min_io_size / blk_size);
     virtio_stw_p(vdev, &blkcfg.opt_io_size, conf->opt_io_size / blk_size);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
     blkcfg.geometry.heads = conf->heads;
     /*
      * We must ensure that the block device capacity is a multiple of
@@ -745,6 +806,9 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     if (blk_is_read_only(s->blk)) {
         virtio_add_feature(&features, VIRTIO_BLK_F_RO);
     }
+    if (s->conf.num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
 
     return features;
 }
@@ -805,6 +869,12 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+
+        /* Single-queue devices keep the original stream format */
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
+
         qemu_put_virtqueue_element(f, &req->elem);
         req = req->next;
     }
@@ -828,9 +898,22 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
+        unsigned nvqs = s->conf.num_queues;
+        unsigned vq_idx = 0;
         VirtIOBlockReq *req;
+
+        if (nvqs > 1) {
+            vq_idx = qemu_get_be32(f);
+
+            if (vq_idx >= nvqs) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             vq_idx);
+                return -EINVAL;
+            }
+        }
+
         req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
-        virtio_blk_init_request(s, req);
+        virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
     }
@@ -856,6 +939,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -865,6 +949,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Device needs media, but drive is empty");
         return;
     }
+    if (!conf->num_queues || conf->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be between 1 and %d",
+                   VIRTIO_QUEUE_MAX);
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     s->original_wce = blk_enable_write_cache(conf->conf.blk);
@@ -882,7 +971,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
@@ -904,6 +995,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
 
+    virtio_blk_flush_merge_window(s);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
@@ -933,8 +1025,10 @@ static Property virtio_blk_properties[] = {
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOBlock, conf.scsi, 0, false),
 #endif
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT32("merge-window", VirtIOBlock, conf.merge_window_us, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -29,6 +29,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "sysemu/replay.h"
 
 //#define DEBUG_SERIAL
 
@@ -220,18 +221,52 @@ static void serial_update_msl(SerialState *s)
         timer_mod(s->modem_status_poll, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + get_ticks_per_sec() / 100);
 }
 
+/* Send the contents of the transmit FIFO to the chardev in as few writes
+ * as its ring buffer allows, stopping at the first byte that is not taken.
+ * Returns true if the FIFO has been emptied.
+ */
+static bool serial_xmit_burst(SerialState *s)
+{
+    const uint8_t *buf;
+    uint32_t len, num;
+    int ret;
+
+    while (!fifo8_is_empty(&s->xmit_fifo)) {
+        buf = fifo8_peek_buf(&s->xmit_fifo, fifo8_num_used(&s->xmit_fifo),
+                             &len);
+        ret = qemu_chr_fe_write(s->chr, buf, len);
+        if (ret <= 0) {
+            return false;
+        }
+        s->tsr = buf[ret - 1];
+        fifo8_pop_buf(&s->xmit_fifo, ret, &num);
+        if (ret < len) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static gboolean serial_xmit(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     SerialState *s = opaque;
+    bool sent;
 
     do {
         assert(!(s->lsr & UART_LSR_TEMT));
+        sent = false;
         if (s->tsr_retry <= 0) {
             assert(!(s->lsr & UART_LSR_THRE));
 
             if (s->fcr & UART_FCR_FE) {
                 assert(!fifo8_is_empty(&s->xmit_fifo));
-                s->tsr = fifo8_pop(&s->xmit_fifo);
+                if (!(s->mcr & UART_MCR_LOOP)) {
+                    sent = serial_xmit_burst(s);
+                }
+                if (!sent) {
+                    /* the byte that did not go out is retried below */
+                    s->tsr = fifo8_pop(&s->xmit_fifo);
+                }
                 if (!s->xmit_fifo.num) {
                     s->lsr |= UART_LSR_THRE;
                 }
@@ -245,7 +280,9 @@ static gboolean serial_xmit(GIOChannel *chan, GIOCondition cond, void *opaque)
             }
         }
 
-        if (s->mcr & UART_MCR_LOOP) {
+        if (sent) {
+            s->tsr_retry = 0;
+        } else if (s->mcr & UART_MCR_LOOP) {
             /* in loopback mode, say that we just received a char */
             serial_receive1(s, &s->tsr, 1);
         } else if (qemu_chr_fe_write(s->chr, &s->tsr, 1) != 1) {
@@ -270,6 +307,20 @@ static gboolean serial_xmit(GIOChannel *chan, GIOCondition cond, void *opaque)
     return FALSE;
 }
 
+/* A transmission is waiting for serial_xmit_bh */
+static bool serial_xmit_pending(SerialState *s)
+{
+    return !(s->lsr & UART_LSR_TEMT) && s->tsr_retry <= 0;
+}
+
+static void serial_xmit_bh(void *opaque)
+{
+    SerialState *s = opaque;
+
+    if (serial_xmit_pending(s)) {
+        serial_xmit(NULL, G_IO_OUT, s);
+    }
+}
 
 /* Setter for FCR.
    is_load flag means, that value is set while loading VM state
@@ -328,7 +379,18 @@ static void serial_ioport_write(void *opaque, hwaddr addr, uint64_t val,
             s->lsr &= ~UART_LSR_TEMT;
             serial_update_irq(s);
             if (s->tsr_retry <= 0) {
-                serial_xmit(NULL, G_IO_OUT, s);
+                /* Interrupt driven guests fill the FIFO before waiting
+                   for THRE; send its contents when they are done, or
+                   when it fills up.  Polling guests look at LSR, which
+                   sends the FIFO right away.  */
+                if ((s->fcr & UART_FCR_FE) &&
+                    !fifo8_is_full(&s->xmit_fifo) &&
+                    replay_mode == REPLAY_MODE_NONE) {
+                    qemu_bh_schedule(s->xmit_bh);
+                } else {
+                    qemu_bh_cancel(s->xmit_bh);
+                    serial_xmit(NULL, G_IO_OUT, s);
+                }
             }
         }
         break;
@@ -392,6 +454,10 @@ static void serial_ioport_write(void *opaque, hwaddr addr, uint64_t val,
         }
 
         if (val & UART_FCR_XFR) {
+            if (serial_xmit_pending(s)) {
+                qemu_bh_cancel(s->xmit_bh);
+                s->lsr |= UART_LSR_TEMT;
+            }
             s->lsr |= UART_LSR_THRE;
             s->thr_ipending = 1;
             fifo8_reset(&s->xmit_fifo);
@@ -502,6 +568,10 @@ static uint64_t serial_ioport_read(void *opaque, hwaddr addr, unsigned size)
         ret = s->mcr;
         break;
     case 5:
+        if (serial_xmit_pending(s)) {
+            qemu_bh_cancel(s->xmit_bh);
+            serial_xmit(NULL, G_IO_OUT, s);
+        }
         ret = s->lsr;
         /* Clear break and overrun interrupts */
         if (s->lsr & (UART_LSR_BI|UART_LSR_OE)) {
@@ -640,6 +710,9 @@ static int serial_post_load(void *opaque, int version_id)
     /* Initialize fcr via setter to perform essential side-effects */
     serial_write_fcr(s, s->fcr_vmstate);
     serial_update_parameters(s);
+    if (serial_xmit_pending(s)) {
+        qemu_bh_schedule(s->xmit_bh);
+    }
     return 0;
 }
 
@@ -829,6 +902,7 @@ static void serial_reset(void *opaque)
     s->timeout_ipending = 0;
     timer_del(s->fifo_timeout_timer);
     timer_del(s->modem_status_poll);
+    qemu_bh_cancel(s->xmit_bh);
 
     fifo8_reset(&s->recv_fifo);
     fifo8_reset(&s->xmit_fifo);
@@ -853,6 +927,7 @@ void serial_realize_core(SerialState *s, Error **errp)
     s->modem_status_poll = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *) serial_update_msl, s);
 
     s->fifo_timeout_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *) fifo_timeout_int, s);
+    s->xmit_bh = qemu_bh_new(serial_xmit_bh, s);
     qemu_register_reset(serial_reset, s);
 
     qemu_chr_add_handlers(s->chr, serial_can_receive1, serial_receive1,
@@ -866,6 +941,7 @@ void serial_exit_core(SerialState *s)
 {
     qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
     qemu_unregister_reset(serial_reset, s);
+    qemu_bh_delete(s->xmit_bh);
 }
 
 /* Change the main reference oscillator frequency. */
@@ -131,6 +131,89 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/*
+ * Elements smaller than this are copied together into port->flush_buf
+ * and handed to the port with a single have_data call; larger ones are
+ * passed an iov entry at a time.
+ */
+#define VIRTIO_SERIAL_FLUSH_BUF_SIZE    65536
+#define VIRTIO_SERIAL_FLUSH_MAX_ELEMS   64
+
+/*
+ * Coalesce the freshly popped port->elem with the small elements queued
+ * behind it.  If the port only takes part of the data, the element where
+ * it stopped becomes port->elem again and those behind it go back to
+ * the virtqueue, as if they had never been popped.
+ */
+static void flush_queued_data_batch(VirtIOSerialPort *port, VirtQueue *vq,
+                                    VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elems[VIRTIO_SERIAL_FLUSH_MAX_ELEMS];
+    size_t sizes[VIRTIO_SERIAL_FLUSH_MAX_ELEMS];
+    VirtQueueElement *elem = port->elem;
+    size_t len = 0, size;
+    unsigned int n = 0, i;
+    ssize_t ret;
+
+    if (!port->flush_buf) {
+        port->flush_buf = g_malloc(VIRTIO_SERIAL_FLUSH_BUF_SIZE);
+    }
+    port->elem = NULL;
+
+    size = iov_size(elem->out_sg, elem->out_num);
+    for (;;) {
+        iov_to_buf(elem->out_sg, elem->out_num, 0, port->flush_buf + len,
+                   size);
+        elems[n] = elem;
+        sizes[n++] = size;
+        len += size;
+
+        if (n == VIRTIO_SERIAL_FLUSH_MAX_ELEMS) {
+            break;
+        }
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        size = iov_size(elem->out_sg, elem->out_num);
+        if (len + size > VIRTIO_SERIAL_FLUSH_BUF_SIZE) {
+            virtqueue_discard(vq, elem, 0);
+            g_free(elem);
+            break;
+        }
+    }
+
+    ret = vsc->have_data(port, port->flush_buf, len);
+    if (!port->throttled) {
+        /* whatever the port did not take is dropped, as below */
+        ret = len;
+    } else if (ret < 0) {
+        ret = 0;
+    }
+
+    for (i = 0; i < n && ret >= sizes[i]; i++) {
+        ret -= sizes[i];
+        virtqueue_push(vq, elems[i], 0);
+        g_free(elems[i]);
+    }
+    if (i == n) {
+        return;
+    }
+
+    port->elem = elems[i];
+    port->iov_idx = 0;
+    while (ret >= port->elem->out_sg[port->iov_idx].iov_len) {
+        ret -= port->elem->out_sg[port->iov_idx++].iov_len;
+    }
+    port->iov_offset = ret;
+
+    /* in the reverse order of virtqueue_pop */
+    while (--n > i) {
+        virtqueue_discard(vq, elems[n], 0);
+        g_free(elems[n]);
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -152,6 +235,12 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             }
             port->iov_idx = 0;
             port->iov_offset = 0;
+
+            if (iov_size(port->elem->out_sg, port->elem->out_num) <
+                VIRTIO_SERIAL_FLUSH_BUF_SIZE) {
+                flush_queued_data_batch(port, vq, vsc);
+                continue;
+            }
         }
 
         for (i = port->iov_idx; i < port->elem->out_num; i++) {
@@ -969,6 +1058,7 @@ static void virtser_port_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOSerial *vser = port->vser;
 
     qemu_bh_delete(port->bh);
+    g_free(port->flush_buf);
     remove_port(port->vser, port->id);
 
     QTAILQ_REMOVE(&vser->ports, port, next);
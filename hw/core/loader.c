@@ -773,6 +773,8 @@ struct Rom {
     size_t romsize;
     size_t datasize;
 
+    /* "data" is a private mapping of the file rather than a heap copy */
+    bool mapped;
     uint8_t *data;
     MemoryRegion *mr;
     int isrom;
@@ -786,6 +788,51 @@ struct Rom {
 static FWCfgState *fw_cfg;
 static QTAILQ_HEAD(, Rom) roms = QTAILQ_HEAD_INITIALIZER(roms);
 
+/* Read the contents of a ROM file into rom->data.  Where possible the file
+ * is mapped copy-on-write, so that it is paged in on demand and shared with
+ * the page cache (and thus with other guests using the same firmware)
+ * instead of being duplicated on the heap.
+ */
+static int rom_read_file(Rom *rom, int fd)
+{
+    ssize_t rc;
+
+#ifdef CONFIG_POSIX
+    if (rom->datasize) {
+        void *ptr = mmap(NULL, rom->datasize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            rom->data = ptr;
+            rom->mapped = true;
+            return 0;
+        }
+    }
+#endif
+
+    rom->data = g_malloc0(rom->datasize);
+    lseek(fd, 0, SEEK_SET);
+    rc = read(fd, rom->data, rom->datasize);
+    if (rc != rom->datasize) {
+        fprintf(stderr, "rom: file %-20s: read error: rc=%zd (expected %zd)\n",
+                rom->name, rc, rom->datasize);
+        return -1;
+    }
+    return 0;
+}
+
+static void rom_free_data(Rom *rom)
+{
+    if (rom->mapped) {
+#ifdef CONFIG_POSIX
+        munmap(rom->data, rom->datasize);
+#endif
+    } else {
+        g_free(rom->data);
+    }
+    rom->data = NULL;
+    rom->mapped = false;
+}
+
 static void rom_insert(Rom *rom)
 {
     Rom *item;
@@ -811,11 +858,93 @@ static void fw_cfg_resized(const char *id, uint64_t length, void *host)
     }
 }
 
+/* Map the first @size bytes of @path copy-on-write, padded with zeroes
+ * when the file is shorter.  Returns NULL with errno set on failure.
+ */
+static void *rom_map_file(const char *path, uint64_t size)
+{
+#ifdef CONFIG_POSIX
+    size_t map_size = ROUND_UP(size, getpagesize());
+    void *ptr;
+    off_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return NULL;
+    }
+    len = lseek(fd, 0, SEEK_END);
+    if (len < 0) {
+        goto fail;
+    }
+
+    /* reserve the whole region, then put the file over its start */
+    ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        goto fail;
+    }
+    if (len > 0 &&
+        mmap(ptr, MIN(len, size), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(ptr, map_size);
+        goto fail;
+    }
+    close(fd);
+    return ptr;
+
+fail:
+    close(fd);
+    return NULL;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+void *rom_init_mr_from_file(MemoryRegion *mr, Object *owner, const char *name,
+                            const char *path, uint64_t size, Error **errp)
+{
+    Error *local_err = NULL;
+    void *ptr;
+
+    if (!machine_share_rom(MACHINE(qdev_get_machine()))) {
+        memory_region_init_ram(mr, owner, name, size, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return NULL;
+        }
+        ptr = memory_region_get_ram_ptr(mr);
+        if (load_image_size(path, ptr, size) < 0) {
+            error_setg(errp, "could not load '%s'", path);
+            return NULL;
+        }
+        return ptr;
+    }
+
+    ptr = rom_map_file(path, size);
+    if (!ptr) {
+        error_setg_errno(errp, errno, "could not map '%s'", path);
+        return NULL;
+    }
+    memory_region_init_ram_ptr(mr, owner, name, size, ptr);
+    return ptr;
+}
+
 static void *rom_set_mr(Rom *rom, Object *owner, const char *name)
 {
     void *data;
 
     rom->mr = g_malloc(sizeof(*rom->mr));
+    if (rom->mapped &&
+        machine_share_rom(MACHINE(qdev_get_machine()))) {
+        /* hand the private mapping of the file over to the region */
+        memory_region_init_ram_ptr(rom->mr, owner, name, rom->datasize,
+                                   rom->data);
+        memory_region_set_readonly(rom->mr, true);
+        vmstate_register_ram_global(rom->mr);
+        return rom->data;
+    }
     memory_region_init_resizeable_ram(rom->mr, owner, name,
                                       rom->datasize, rom->romsize,
                                       fw_cfg_resized,
@@ -835,7 +964,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 {
     MachineClass *mc = MACHINE_GET_CLASS(qdev_get_machine());
     Rom *rom;
-    int rc, fd = -1;
+    int fd = -1;
     char devpath[100];
 
     rom = g_malloc0(sizeof(*rom));
@@ -865,12 +994,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
 
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
+    if (rom_read_file(rom, fd) < 0) {
         goto err;
     }
     close(fd);
@@ -912,7 +1036,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -996,6 +1120,19 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+        /*
+         * An incoming migration brings the contents of guest memory,
+         * ROMs included, so there is nothing to fill in; when RAM is
+         * shared with the source, writing it would even corrupt the
+         * running guest.
+         */
+        if (runstate_check(RUN_STATE_INMIGRATE)) {
+            if (rom->isrom) {
+                /* Don't let a later reset overwrite the migrated rom */
+                rom_free_data(rom);
+            }
+            continue;
+        }
         if (rom->mr) {
             void *host = memory_region_get_ram_ptr(rom->mr);
             memcpy(host, rom->data, rom->datasize);
@@ -1005,8 +1142,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
         /*
          * The rom loader is really on the same level as firmware in the guest
@@ -240,6 +240,20 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_share_rom(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->share_rom;
+}
+
+static void machine_set_share_rom(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->share_rom = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -452,6 +466,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "mem-merge",
                                     "Enable/disable memory merge support",
                                     NULL);
+    object_property_add_bool(obj, "share-rom",
+                             machine_get_share_rom,
+                             machine_set_share_rom, NULL);
+    object_property_set_description(obj, "share-rom",
+                                    "Map firmware files copy-on-write instead "
+                                    "of copying them to guest memory",
+                                    NULL);
     object_property_add_bool(obj, "usb",
                              machine_get_usb,
                              machine_set_usb, NULL);
@@ -548,6 +569,11 @@ bool machine_mem_merge(MachineState *machine)
     return machine->mem_merge;
 }
 
+bool machine_share_rom(MachineState *machine)
+{
+    return machine->share_rom;
+}
+
 static const TypeInfo machine_info = {
     .name = TYPE_MACHINE,
     .parent = TYPE_OBJECT,
@@ -226,6 +226,14 @@ typedef struct CirrusVGAState {
     int last_hw_cursor_y;
     int last_hw_cursor_y_start;
     int last_hw_cursor_y_end;
+    /* hwcursor passed to the UI instead of being drawn into a shadow */
+    bool hw_cursor_ui;          /* the UI currently shows our cursor */
+    bool ui_cursor_ok;          /* ui_cursor_pattern has no XOR pixels */
+    int ui_cursor_size;         /* 0 if ui_cursor_pattern is not valid */
+    int ui_cursor_x;
+    int ui_cursor_y;
+    uint8_t ui_cursor_pattern[64 * 16];
+    uint8_t ui_cursor_colors[6];
     int real_vram_size; /* XXX: suppress that */
     int device_id;
     int bustype;
@@ -325,6 +333,30 @@ static void cirrus_bitblt_fill_nop(CirrusVGAState *s,
 {
 }
 
+/*
+ * Merge 8 bytes of transparent blit output @p into @d: every @bits wide
+ * pixel of @p that differs from the matching one in @key replaces the
+ * pixel of @d, the others are left alone.
+ */
+static inline uint64_t cirrus_transp_merge(uint64_t d, uint64_t p,
+                                           uint64_t key, int bits)
+{
+    uint64_t lsb = 0x0101010101010101ULL;
+    uint64_t high, low, x, mask;
+
+    if (bits == 16) {
+        lsb = 0x0001000100010001ULL;
+    }
+    high = lsb << (bits - 1);
+    low = ~high;
+
+    /* The top bit of each pixel of x is set iff the pixel is non-zero */
+    x = p ^ key;
+    x = (((x & low) + low) | x) & high;
+    mask = (x >> (bits - 1)) * ((1ULL << bits) - 1);
+    return (p & mask) | (d & ~mask);
+}
+
 #define ROP_NAME 0
 #define ROP_FN(d, s) 0
 #include "cirrus_vga_rop.h"
@@ -1374,7 +1406,7 @@ static void cirrus_vga_write_sr(CirrusVGAState * s, uint32_t val)
 	break;
     case 0x12:			// Graphics Cursor Attribute
 	s->vga.sr[0x12] = val;
-        s->vga.force_shadow = !!(val & CIRRUS_CURSOR_SHOW);
+        s->vga.force_shadow = !!(val & CIRRUS_CURSOR_SHOW) && !s->hw_cursor_ui;
 #ifdef DEBUG_CIRRUS
         printf("cirrus: cursor ctl SR12=%02x (force shadow: %d)\n",
                val, s->vga.force_shadow);
@@ -2181,8 +2213,120 @@ static inline void cirrus_cursor_compute_yrange(CirrusVGAState *s)
     }
 }
 
-/* NOTE: we do not currently handle the cursor bitmap change, so we
-   update the cursor only if it moves. */
+static const uint8_t *cirrus_cursor_pattern(CirrusVGAState *s, int size,
+                                            int *len)
+{
+    const uint8_t *src = s->vga.vram_ptr + s->real_vram_size - 16 * 1024;
+
+    if (size == 64) {
+        *len = 64 * 16;
+        return src + (s->vga.sr[0x13] & 0x3c) * 256;
+    }
+    *len = 256;
+    return src + (s->vga.sr[0x13] & 0x3f) * 256;
+}
+
+/* Returns NULL if the pattern uses XOR pixels, which the UI cannot show */
+static QEMUCursor *cirrus_cursor_to_ui(CirrusVGAState *s, int size)
+{
+    const uint8_t *src, *plane0, *plane1;
+    uint32_t color0, color1;
+    QEMUCursor *c;
+    int len, x, y, b;
+
+    src = cirrus_cursor_pattern(s, size, &len);
+    color0 = 0xff000000 | rgb_to_pixel32(c6_to_8(s->ui_cursor_colors[0]),
+                                         c6_to_8(s->ui_cursor_colors[1]),
+                                         c6_to_8(s->ui_cursor_colors[2]));
+    color1 = 0xff000000 | rgb_to_pixel32(c6_to_8(s->ui_cursor_colors[3]),
+                                         c6_to_8(s->ui_cursor_colors[4]),
+                                         c6_to_8(s->ui_cursor_colors[5]));
+    c = cursor_alloc(size, size);
+    for (y = 0; y < size; y++) {
+        if (size == 64) {
+            plane0 = src + y * 16;
+            plane1 = plane0 + 8;
+        } else {
+            plane0 = src + y * 4;
+            plane1 = plane0 + 128;
+        }
+        for (x = 0; x < size; x++) {
+            b = ((plane0[x >> 3] >> (7 - (x & 7))) & 1) |
+                (((plane1[x >> 3] >> (7 - (x & 7))) & 1) << 1);
+            switch (b) {
+            case 0:
+                c->data[y * size + x] = 0;
+                break;
+            case 1:
+                cursor_put(c);
+                return NULL;
+            case 2:
+                c->data[y * size + x] = color0;
+                break;
+            case 3:
+                c->data[y * size + x] = color1;
+                break;
+            }
+        }
+    }
+    return c;
+}
+
+/*
+ * Let the UI draw the cursor when it can, so that the guest framebuffer
+ * does not need a shadow copy to draw it into.  Returns whether the UI
+ * shows the cursor.
+ */
+static bool cirrus_cursor_update_ui(CirrusVGAState *s, int size)
+{
+    QemuConsole *con = s->vga.con;
+    const uint8_t *pattern;
+    uint8_t colors[6];
+    bool ok;
+    int len;
+
+    ok = size && dpy_cursor_define_supported(con);
+    if (ok) {
+        pattern = cirrus_cursor_pattern(s, size, &len);
+        memcpy(colors, &s->cirrus_hidden_palette[0x0 * 3], 3);
+        memcpy(colors + 3, &s->cirrus_hidden_palette[0xf * 3], 3);
+        if (size != s->ui_cursor_size ||
+            memcmp(pattern, s->ui_cursor_pattern, len) ||
+            memcmp(colors, s->ui_cursor_colors, sizeof(colors))) {
+            QEMUCursor *c;
+
+            s->ui_cursor_size = size;
+            memcpy(s->ui_cursor_pattern, pattern, len);
+            memcpy(s->ui_cursor_colors, colors, sizeof(colors));
+            c = cirrus_cursor_to_ui(s, size);
+            s->ui_cursor_ok = c != NULL;
+            if (c) {
+                dpy_cursor_define(con, c);
+                cursor_put(c);
+                s->hw_cursor_ui = false; /* resend the position */
+            }
+        }
+        ok = s->ui_cursor_ok;
+    }
+
+    if (ok) {
+        if (!s->hw_cursor_ui ||
+            s->ui_cursor_x != s->vga.hw_cursor_x ||
+            s->ui_cursor_y != s->vga.hw_cursor_y) {
+            s->ui_cursor_x = s->vga.hw_cursor_x;
+            s->ui_cursor_y = s->vga.hw_cursor_y;
+            dpy_mouse_set(con, s->ui_cursor_x, s->ui_cursor_y, 1);
+            s->hw_cursor_ui = true;
+        }
+    } else if (s->hw_cursor_ui) {
+        dpy_mouse_set(con, s->ui_cursor_x, s->ui_cursor_y, 0);
+        s->hw_cursor_ui = false;
+    }
+    return ok;
+}
+
+/* NOTE: when the cursor is drawn into the shadow surface we do not handle
+   the cursor bitmap change, so we update the cursor only if it moves. */
 static void cirrus_cursor_invalidate(VGACommonState *s1)
 {
     CirrusVGAState *s = container_of(s1, CirrusVGAState, vga);
@@ -2196,6 +2340,15 @@ static void cirrus_cursor_invalidate(VGACommonState *s1)
         else
             size = 32;
     }
+
+    if (cirrus_cursor_update_ui(s, size)) {
+        /* erase a cursor previously drawn into the shadow surface */
+        invalidate_cursor1(s);
+        s->last_hw_cursor_size = 0;
+        s->vga.force_shadow = false;
+        return;
+    }
+    s->vga.force_shadow = size != 0;
     /* invalidate last cursor and new cursor if any change */
     if (s->last_hw_cursor_size != size ||
         s->last_hw_cursor_x != s->vga.hw_cursor_x ||
@@ -2254,7 +2407,7 @@ static void cirrus_cursor_draw_line(VGACommonState *s1, uint8_t *d1, int scr_y)
     const uint8_t *palette, *src;
     uint32_t content;
 
-    if (!(s->vga.sr[0x12] & CIRRUS_CURSOR_SHOW))
+    if (!(s->vga.sr[0x12] & CIRRUS_CURSOR_SHOW) || s->hw_cursor_ui)
         return;
     /* fast test to see if the cursor intersects with the scan line */
     if (s->vga.sr[0x12] & CIRRUS_CURSOR_LARGE) {
@@ -2746,6 +2899,8 @@ static int cirrus_post_load(void *opaque, int version_id)
     cirrus_update_memory_access(s);
     /* force refresh */
     s->vga.graphic_mode = -1;
+    s->ui_cursor_size = 0;
+    s->hw_cursor_ui = false;
     cirrus_update_bank_ptr(s, 0);
     cirrus_update_bank_ptr(s, 1);
     return 0;
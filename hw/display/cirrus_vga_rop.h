@@ -37,9 +37,16 @@ static inline void glue(rop_32_,ROP_NAME)(uint32_t *dst, uint32_t src)
     *dst = ROP_FN(*dst, src);
 }
 
+/* All raster operations are bitwise, so they apply to 8 bytes at once */
+static inline uint64_t glue(rop_64_,ROP_NAME)(uint64_t dst, uint64_t src)
+{
+    return ROP_FN(dst, src);
+}
+
 #define ROP_OP(d, s) glue(rop_8_,ROP_NAME)(d, s)
 #define ROP_OP_16(d, s) glue(rop_16_,ROP_NAME)(d, s)
 #define ROP_OP_32(d, s) glue(rop_32_,ROP_NAME)(d, s)
+#define ROP_OP_64(d, s) glue(rop_64_,ROP_NAME)(d, s)
 #undef ROP_FN
 
 static void
@@ -57,7 +64,19 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     }
 
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        /*
+         * Going 8 bytes at a time gives the same result as going byte by
+         * byte, unless the destination overlaps the source from above.
+         */
+        if (dst <= src || dst >= src + bltwidth) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                stq_he_p(dst, ROP_OP_64(ldq_he_p(dst), ldq_he_p(src)));
+                dst += 8;
+                src += 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst++;
             src++;
@@ -77,7 +96,18 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        /* As above, with the destination overlapping from below */
+        if (dst >= src || dst + bltwidth <= src) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                dst -= 7;
+                src -= 7;
+                stq_he_p(dst, ROP_OP_64(ldq_he_p(dst), ldq_he_p(src)));
+                dst--;
+                src--;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst--;
             src--;
@@ -95,10 +125,21 @@ glue(glue(cirrus_bitblt_rop_fwd_transp_, ROP_NAME),_8)(CirrusVGAState *s,
 {
     int x,y;
     uint8_t p;
+    uint64_t key = s->vga.gr[0x34] * 0x0101010101010101ULL;
     dstpitch -= bltwidth;
     srcpitch -= bltwidth;
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        if (dst <= src || dst >= src + bltwidth) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                uint64_t d = ldq_he_p(dst);
+                uint64_t p64 = ROP_OP_64(d, ldq_he_p(src));
+                stq_he_p(dst, cirrus_transp_merge(d, p64, key, 8));
+                dst += 8;
+                src += 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
 	    p = *dst;
             ROP_OP(&p, *src);
 	    if (p != s->vga.gr[0x34]) *dst = p;
@@ -141,10 +182,22 @@ glue(glue(cirrus_bitblt_rop_fwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 {
     int x,y;
     uint8_t p1, p2;
+    uint64_t key = (s->vga.gr[0x34] | (s->vga.gr[0x35] << 8)) *
+                   0x0001000100010001ULL;
     dstpitch -= bltwidth;
     srcpitch -= bltwidth;
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x+=2) {
+        x = 0;
+        if (dst <= src || dst >= src + bltwidth) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                uint64_t d = ldq_le_p(dst);
+                uint64_t p64 = ROP_OP_64(d, ldq_le_p(src));
+                stq_le_p(dst, cirrus_transp_merge(d, p64, key, 16));
+                dst += 8;
+                src += 8;
+            }
+        }
+        for (; x < bltwidth; x+=2) {
 	    p1 = *dst;
 	    p2 = *(dst+1);
             ROP_OP(&p1, *src);
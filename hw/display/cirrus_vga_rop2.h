@@ -65,7 +65,27 @@ glue(glue(glue(cirrus_patternfill_, ROP_NAME), _),DEPTH)
         pattern_x = skipleft;
         d = dst + skipleft;
         src1 = src + pattern_y * pattern_pitch;
-        for (x = skipleft; x < bltwidth; x += (DEPTH / 8)) {
+        x = skipleft;
+#if DEPTH != 24
+        /*
+         * The pattern row repeats every pattern_pitch bytes, so unless the
+         * row being written overwrites the pattern itself, 8 bytes of it
+         * can be combined with the destination at once.
+         */
+        if (src1 + pattern_pitch <= dst || src1 >= dst + bltwidth) {
+            uint8_t row[2 * 32];
+
+            memcpy(row, src1, pattern_pitch);
+            memcpy(row + pattern_pitch, src1, pattern_pitch);
+            for (; x + 8 <= bltwidth; x += 8) {
+                stq_he_p(d, ROP_OP_64(ldq_he_p(d),
+                                      ldq_he_p(row + (x & (pattern_pitch - 1)))));
+                d += 8;
+            }
+            pattern_x = x & (pattern_pitch - 1);
+        }
+#endif
+        for (; x < bltwidth; x += (DEPTH / 8)) {
 #if DEPTH == 8
             col = src1[pattern_x];
             pattern_x = (pattern_x + 1) & 7;
@@ -263,13 +283,31 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
     uint8_t *d, *d1;
     uint32_t col;
     int x, y;
+#if DEPTH != 24
+    uint64_t col64;
+#endif
 
     col = s->cirrus_blt_fgcol;
+#if DEPTH == 8
+    col64 = (uint8_t)col * 0x0101010101010101ULL;
+#elif DEPTH == 16
+    col64 = (uint16_t)col * 0x0001000100010001ULL;
+#elif DEPTH == 32
+    col64 = col * 0x0000000100000001ULL;
+#endif
 
     d1 = dst;
     for(y = 0; y < height; y++) {
         d = d1;
-        for(x = 0; x < width; x += (DEPTH / 8)) {
+        x = 0;
+#if DEPTH != 24
+        /* The fill is made of whole pixels, repeat them 8 bytes at a time */
+        for (; x + 8 <= width; x += 8) {
+            stq_he_p(d, ROP_OP_64(ldq_he_p(d), col64));
+            d += 8;
+        }
+#endif
+        for (; x < width; x += (DEPTH / 8)) {
             PUTPIXEL();
             d += (DEPTH / 8);
         }
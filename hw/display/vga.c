@@ -1423,6 +1423,18 @@ void vga_dirty_log_stop(VGACommonState *s)
     memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
 }
 
+static bool vga_lines_invalidated(VGACommonState *s, int height)
+{
+    int i;
+
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * graphic modes
  */
@@ -1486,12 +1498,18 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
      * Check whether we can share the surface with the backend
      * or whether we need a shadow surface. We share native
      * endian surfaces for 15bpp and above and byteswapped
-     * surfaces for 24bpp and above.
+     * surfaces for 24bpp and above.  The guest framebuffer must also be
+     * a plain linear image: no scan line doubling, split screen or CGA
+     * addressing, and a stride pixman can use.
      */
     format = qemu_default_pixman_format(depth, !byteswap);
     if (format) {
         share_surface = dpy_gfx_check_format(s->con, format)
-            && !s->force_shadow;
+            && !s->force_shadow
+            && !multi_scan
+            && s->line_compare >= height
+            && (s->cr[VGA_CRTC_MODE] & 3) == 3
+            && (s->line_offset & 3) == 0;
     } else {
         share_surface = false;
     }
@@ -1586,7 +1604,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
     vga_draw_line = vga_draw_line_table[v];
 
-    if (!is_buffer_shared(surface) && s->cursor_invalidate) {
+    if (s->cursor_invalidate) {
         s->cursor_invalidate(s);
     }
 
@@ -1598,6 +1616,19 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+
+    /*
+     * A shared surface is a linear image, so an idle frame can be detected
+     * with a single lookup in the dirty bitmap instead of one per line.
+     */
+    if (is_buffer_shared(surface) && !full_update && height > 0 &&
+        !vga_lines_invalidated(s, height) &&
+        !memory_region_get_dirty(&s->vram, addr1,
+                                 line_offset * (height - 1) + bwidth,
+                                 DIRTY_MEMORY_VGA)) {
+        return;
+    }
+
     y_start = -1;
     page_min = -1;
     page_max = 0;
@@ -14,6 +14,8 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-gpu.h"
@@ -21,6 +23,9 @@
 #ifdef CONFIG_VIRGL
 
 #include "virglrenderer.h"
+#ifdef CONFIG_OPENGL_DMABUF
+#include "ui/egl-helpers.h"
+#endif
 
 static struct virgl_renderer_callbacks virtio_gpu_3d_cbs;
 
@@ -72,14 +77,77 @@ static void virgl_cmd_create_resource_3d(VirtIOGPU *g,
     virgl_renderer_resource_create(&args, NULL, 0);
 }
 
+static void virgl_release_dmabuf(struct virtio_gpu_scanout *s,
+                                 QemuDmaBuf *dmabuf)
+{
+    if (dmabuf->fd < 0) {
+        return;
+    }
+    dpy_gl_release_dmabuf(s->con, dmabuf);
+    close(dmabuf->fd);
+    dmabuf->fd = -1;
+}
+
+/*
+ * Hand the render target to the UI as a dmabuf if it can import one, so
+ * the display reads the guest's frames in place from its own EGL context.
+ * Returns false if the texture has to be scanned out instead.
+ */
+static bool virgl_scanout_dmabuf(struct virtio_gpu_scanout *s,
+                                 struct virgl_renderer_resource_info *info,
+                                 uint32_t width, uint32_t height)
+{
+#ifdef CONFIG_OPENGL_DMABUF
+    QemuDmaBuf old = s->dmabuf;
+    EGLint stride = 0, fourcc = 0;
+    int fd;
+
+    if (!dpy_gl_has_dmabuf(s->con)) {
+        return false;
+    }
+    fd = egl_get_fd_for_texture(info->tex_id, &stride, &fourcc);
+    if (fd < 0) {
+        return false;
+    }
+
+    s->dmabuf.fd = fd;
+    s->dmabuf.width = width;
+    s->dmabuf.height = height;
+    s->dmabuf.stride = stride;
+    s->dmabuf.fourcc = fourcc;
+    s->dmabuf.y0_top = info->flags & 1 /* FIXME: Y_0_TOP */;
+    s->dmabuf.texture = 0;
+    if (!dpy_gl_scanout_dmabuf(s->con, &s->dmabuf)) {
+        close(fd);
+        s->dmabuf = old;
+        return false;
+    }
+
+    /* The UI switched to the new buffer, it is done with the old one */
+    virgl_release_dmabuf(s, &old);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void virgl_cmd_resource_unref(VirtIOGPU *g,
                                      struct virtio_gpu_ctrl_command *cmd)
 {
     struct virtio_gpu_resource_unref unref;
+    int i;
 
     VIRTIO_GPU_FILL_CMD(unref);
     trace_virtio_gpu_cmd_res_unref(unref.resource_id);
 
+    /* The texture may be reused, set the next scanout again */
+    for (i = 0; i < VIRTIO_GPU_MAX_SCANOUT; i++) {
+        if (g->scanout[i].resource_id == unref.resource_id) {
+            g->scanout[i].tex_id = 0;
+            virgl_release_dmabuf(&g->scanout[i], &g->scanout[i].dmabuf);
+        }
+    }
+
     virgl_renderer_resource_unref(unref.resource_id);
 }
 
@@ -140,6 +208,7 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
 {
     struct virtio_gpu_set_scanout ss;
     struct virgl_renderer_resource_info info;
+    struct virtio_gpu_scanout *s;
     int ret;
 
     VIRTIO_GPU_FILL_CMD(ss);
@@ -155,6 +224,7 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
     g->enable = 1;
 
     memset(&info, 0, sizeof(info));
+    s = &g->scanout[ss.scanout_id];
 
     if (ss.resource_id && ss.r.width && ss.r.height) {
         ret = virgl_renderer_resource_get_info(ss.resource_id, &info);
@@ -165,20 +235,38 @@ static void virgl_cmd_set_scanout(VirtIOGPU *g,
             cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
             return;
         }
-        qemu_console_resize(g->scanout[ss.scanout_id].con,
-                            ss.r.width, ss.r.height);
+        /*
+         * Guests commonly set the same scanout again on every page flip.
+         * The UI already shows that texture, so there is no need to
+         * attach it to a framebuffer or export a dmabuf for it again;
+         * the following resource flush presents the new contents.
+         */
+        if (s->resource_id == ss.resource_id && s->tex_id == info.tex_id &&
+            s->x == ss.r.x && s->y == ss.r.y &&
+            s->width == ss.r.width && s->height == ss.r.height) {
+            return;
+        }
+        qemu_console_resize(s->con, ss.r.width, ss.r.height);
         virgl_renderer_force_ctx_0();
-        dpy_gl_scanout(g->scanout[ss.scanout_id].con, info.tex_id,
-                       info.flags & 1 /* FIXME: Y_0_TOP */,
-                       ss.r.x, ss.r.y, ss.r.width, ss.r.height);
+        if (!virgl_scanout_dmabuf(s, &info, ss.r.width, ss.r.height)) {
+            dpy_gl_scanout(s->con, info.tex_id,
+                           info.flags & 1 /* FIXME: Y_0_TOP */,
+                           ss.r.x, ss.r.y, ss.r.width, ss.r.height);
+            virgl_release_dmabuf(s, &s->dmabuf);
+        }
     } else {
         if (ss.scanout_id != 0) {
-            dpy_gfx_replace_surface(g->scanout[ss.scanout_id].con, NULL);
+            dpy_gfx_replace_surface(s->con, NULL);
         }
-        dpy_gl_scanout(g->scanout[ss.scanout_id].con, 0, false,
-                       0, 0, 0, 0);
+        dpy_gl_scanout(s->con, 0, false, 0, 0, 0, 0);
+        virgl_release_dmabuf(s, &s->dmabuf);
     }
-    g->scanout[ss.scanout_id].resource_id = ss.resource_id;
+    s->resource_id = ss.resource_id;
+    s->tex_id = info.tex_id;
+    s->x = ss.r.x;
+    s->y = ss.r.y;
+    s->width = ss.r.width;
+    s->height = ss.r.height;
 }
 
 static void virgl_cmd_submit_3d(VirtIOGPU *g,
@@ -378,9 +466,32 @@ static void virgl_cmd_get_capset(VirtIOGPU *g,
     g_free(resp);
 }
 
+/*
+ * Commands that only involve virgl and the guest memory it already maps.
+ * In the render thread they run without the BQL, which is where the time
+ * goes for heavy GL workloads.  Everything else calls into the display
+ * or touches device state, and keeps the BQL.
+ */
+static bool virgl_cmd_is_render_only(uint32_t type)
+{
+    switch (type) {
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+    case VIRTIO_GPU_CMD_SUBMIT_3D:
+    case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+    case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+    case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void virtio_gpu_virgl_process_cmd(VirtIOGPU *g,
                                       struct virtio_gpu_ctrl_command *cmd)
 {
+    bool unlocked;
+
     VIRTIO_GPU_FILL_CMD(cmd->cmd_hdr);
 
     cmd->waiting = g->renderer_blocked;
@@ -389,6 +500,11 @@ void virtio_gpu_virgl_process_cmd(VirtIOGPU *g,
     }
 
     virgl_renderer_force_ctx_0();
+    unlocked = g->render_thread_running &&
+               virgl_cmd_is_render_only(cmd->cmd_hdr.type);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
     switch (cmd->cmd_hdr.type) {
     case VIRTIO_GPU_CMD_CTX_CREATE:
         virgl_cmd_context_create(g, cmd);
@@ -451,6 +567,9 @@ void virtio_gpu_virgl_process_cmd(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         break;
     }
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
 
     if (cmd->finished) {
         return;
@@ -580,10 +699,12 @@ void virtio_gpu_virgl_reset(VirtIOGPU *g)
             dpy_gfx_replace_surface(g->scanout[i].con, NULL);
         }
         dpy_gl_scanout(g->scanout[i].con, 0, false, 0, 0, 0, 0);
+        virgl_release_dmabuf(&g->scanout[i], &g->scanout[i].dmabuf);
+        g->scanout[i].tex_id = 0;
     }
 }
 
-int virtio_gpu_virgl_init(VirtIOGPU *g)
+static int virtio_gpu_virgl_init_renderer(VirtIOGPU *g)
 {
     int ret;
 
@@ -592,8 +713,10 @@ int virtio_gpu_virgl_init(VirtIOGPU *g)
         return ret;
     }
 
-    g->fence_poll = timer_new_ms(QEMU_CLOCK_VIRTUAL,
-                                 virtio_gpu_fence_poll, g);
+    if (!g->render_thread_running) {
+        g->fence_poll = timer_new_ms(QEMU_CLOCK_VIRTUAL,
+                                     virtio_gpu_fence_poll, g);
+    }
 
     if (virtio_gpu_stats_enabled(g->conf)) {
         g->print_stats = timer_new_ms(QEMU_CLOCK_VIRTUAL,
@@ -603,4 +726,55 @@ int virtio_gpu_virgl_init(VirtIOGPU *g)
     return 0;
 }
 
+/*
+ * All virgl calls, including the GL context callbacks, happen in this
+ * thread.  It holds the BQL except while waiting and while running the
+ * render-only commands, so the display callbacks run under the BQL as
+ * they do in the main loop.  Display callbacks make the UI's own GL
+ * context current; it is released by switching back to virgl's context
+ * before the BQL is dropped, so the UI can use it in the main thread.
+ */
+static void *virtio_gpu_render_thread(void *opaque)
+{
+    VirtIOGPU *g = opaque;
+    bool pending;
+
+    rcu_register_thread();
+    qemu_mutex_lock_iothread();
+    if (virtio_gpu_virgl_init_renderer(g) != 0) {
+        fprintf(stderr, "%s: virgl_renderer_init failed\n", __func__);
+    }
+
+    for (;;) {
+        virtio_gpu_process_cmdq(g);
+        virtio_gpu_process_cursorq(g);
+        virgl_renderer_poll();
+        virgl_renderer_force_ctx_0();
+
+        /* Fences complete without notification, poll while there are any */
+        pending = !QTAILQ_EMPTY(&g->cmdq) || !QTAILQ_EMPTY(&g->fenceq);
+        qemu_mutex_unlock_iothread();
+        if (pending) {
+            qemu_sem_timedwait(&g->render_sem, 10);
+        } else {
+            qemu_sem_wait(&g->render_sem);
+        }
+        qemu_mutex_lock_iothread();
+    }
+
+    return NULL;
+}
+
+int virtio_gpu_virgl_init(VirtIOGPU *g)
+{
+    if (virtio_gpu_thread_enabled(g->conf)) {
+        qemu_sem_init(&g->render_sem, 0);
+        g->render_thread_running = true;
+        qemu_thread_create(&g->render_thread, "virtio-gpu-render",
+                           virtio_gpu_render_thread, g, QEMU_THREAD_DETACHED);
+        return 0;
+    }
+    return virtio_gpu_virgl_init_renderer(g);
+}
+
 #endif /* CONFIG_VIRGL */
@@ -814,6 +814,11 @@ static void virtio_gpu_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         cmd = virtqueue_pop(vq, sizeof(struct virtio_gpu_ctrl_command));
     }
 
+    if (g->render_thread_running) {
+        qemu_sem_post(&g->render_sem);
+        return;
+    }
+
     virtio_gpu_process_cmdq(g);
 
 #ifdef CONFIG_VIRGL
@@ -860,10 +865,21 @@ static void virtio_gpu_handle_cursor(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+void virtio_gpu_process_cursorq(VirtIOGPU *g)
+{
+    virtio_gpu_handle_cursor(&g->parent_obj, g->cursor_vq);
+}
+
 static void virtio_gpu_cursor_bh(void *opaque)
 {
     VirtIOGPU *g = opaque;
-    virtio_gpu_handle_cursor(&g->parent_obj, g->cursor_vq);
+
+    /* Cursor data of virgl resources is read with GL, in the render thread */
+    if (g->render_thread_running) {
+        qemu_sem_post(&g->render_sem);
+        return;
+    }
+    virtio_gpu_process_cursorq(g);
 }
 
 static void virtio_gpu_invalidate_display(void *opaque)
@@ -908,7 +924,11 @@ static void virtio_gpu_gl_block(void *opaque, bool block)
 
     g->renderer_blocked = block;
     if (!block) {
-        virtio_gpu_process_cmdq(g);
+        if (g->render_thread_running) {
+            qemu_sem_post(&g->render_sem);
+        } else {
+            virtio_gpu_process_cmdq(g);
+        }
     }
 }
 
@@ -967,6 +987,7 @@ static void virtio_gpu_device_realize(DeviceState *qdev, Error **errp)
     for (i = 0; i < g->conf.max_outputs; i++) {
         g->scanout[i].con =
             graphic_console_init(DEVICE(g), i, &virtio_gpu_ops, g);
+        g->scanout[i].dmabuf.fd = -1;
         if (i > 0) {
             dpy_gfx_replace_surface(g->scanout[i].con, NULL);
         }
@@ -1024,6 +1045,8 @@ static Property virtio_gpu_properties[] = {
                     VIRTIO_GPU_FLAG_VIRGL_ENABLED, true),
     DEFINE_PROP_BIT("stats", VirtIOGPU, conf.flags,
                     VIRTIO_GPU_FLAG_STATS_ENABLED, false),
+    DEFINE_PROP_BIT("render-thread", VirtIOGPU, conf.flags,
+                    VIRTIO_GPU_FLAG_THREAD_ENABLED, false),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -194,12 +194,20 @@ static void old_pc_system_rom_init(MemoryRegion *rom_memory, bool isapc_ram_fw)
         goto bios_error;
     }
     bios = g_malloc(sizeof(*bios));
-    memory_region_init_ram(bios, NULL, "pc.bios", bios_size, &error_fatal);
+    if (!isapc_ram_fw && machine_share_rom(MACHINE(qdev_get_machine()))) {
+        /* read-only, so there is no need to reinstate it on reset */
+        rom_init_mr_from_file(bios, NULL, "pc.bios", filename, bios_size,
+                              &error_fatal);
+        ret = 0;
+    } else {
+        memory_region_init_ram(bios, NULL, "pc.bios", bios_size,
+                               &error_fatal);
+        ret = rom_add_file_fixed(bios_name, (uint32_t)(-bios_size), -1);
+    }
     vmstate_register_ram_global(bios);
     if (!isapc_ram_fw) {
         memory_region_set_readonly(bios, true);
     }
-    ret = rom_add_file_fixed(bios_name, (uint32_t)(-bios_size), -1);
     if (ret != 0) {
     bios_error:
         fprintf(stderr, "qemu: could not load PC BIOS '%s'\n", bios_name);
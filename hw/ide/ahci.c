@@ -28,6 +28,7 @@
 #include <hw/pci/pci.h>
 
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
 #include "internal.h"
@@ -151,6 +152,12 @@ static void ahci_check_irq(AHCIState *s)
 {
     int i;
 
+    if (s->iothread && !qemu_mutex_iothread_locked()) {
+        /* Interrupts can only be delivered with the iothread mutex held */
+        qemu_bh_schedule(s->irq_bh);
+        return;
+    }
+
     DPRINTF(-1, "check irq %#x\n", s->control_regs.irqstatus);
 
     s->control_regs.irqstatus = 0;
@@ -169,6 +176,15 @@ static void ahci_check_irq(AHCIState *s)
     }
 }
 
+static void ahci_irq_bh(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    ahci_check_irq(s);
+    aio_context_release(s->ctx);
+}
+
 static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
                              int irq_type)
 {
@@ -236,6 +252,36 @@ static int ahci_cond_start_engines(AHCIDevice *ad)
     return 0;
 }
 
+static void ahci_check_cmd_bh(void *opaque);
+
+/* Move the BlockBackend of the port to the IOThread on first use */
+static void ahci_port_set_aio_context(AHCIState *s, AHCIDevice *ad)
+{
+    BlockBackend *blk = ad->port.ifs[0].blk;
+
+    if (s->iothread && blk && blk_get_aio_context(blk) != s->ctx) {
+        blk_set_aio_context(blk, s->ctx);
+    }
+}
+
+/* With an IOThread, the command list is processed there; doorbell writes
+ * that arrive before the bottom half runs are handled as one batch. */
+static void ahci_kick_port(AHCIState *s, int port)
+{
+    AHCIDevice *ad = &s->dev[port];
+
+    if (!s->iothread) {
+        check_cmd(s, port);
+        return;
+    }
+
+    ahci_port_set_aio_context(s, ad);
+    if (!ad->check_bh) {
+        ad->check_bh = aio_bh_new(s->ctx, ahci_check_cmd_bh, ad);
+        qemu_bh_schedule(ad->check_bh);
+    }
+}
+
 static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
@@ -284,7 +330,7 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
                 ahci_init_d2h(&s->dev[port]);
             }
 
-            check_cmd(s, port);
+            ahci_kick_port(s, port);
             break;
         case PORT_TFDATA:
             /* Read Only. */
@@ -311,7 +357,7 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
             break;
         case PORT_CMD_ISSUE:
             pr->cmd_issue |= val;
-            check_cmd(s, port);
+            ahci_kick_port(s, port);
             break;
         default:
             break;
@@ -354,6 +400,21 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
 }
 
 
+/* The port state is shared with the IOThread, if there is one */
+static void ahci_lock(AHCIState *s)
+{
+    if (s->iothread) {
+        aio_context_acquire(s->ctx);
+    }
+}
+
+static void ahci_unlock(AHCIState *s)
+{
+    if (s->iothread) {
+        aio_context_release(s->ctx);
+    }
+}
+
 /**
  * AHCI 1.3 section 3 ("HBA Memory Registers")
  * Support unaligned 8/16/32 bit reads, and 64 bit aligned reads.
@@ -361,12 +422,16 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
  */
 static uint64_t ahci_mem_read(void *opaque, hwaddr addr, unsigned size)
 {
+    AHCIState *s = opaque;
     hwaddr aligned = addr & ~0x3;
     int ofst = addr - aligned;
-    uint64_t lo = ahci_mem_read_32(opaque, aligned);
+    uint64_t lo;
     uint64_t hi;
     uint64_t val;
 
+    ahci_lock(s);
+    lo = ahci_mem_read_32(opaque, aligned);
+
     /* if < 8 byte read does not cross 4 byte boundary */
     if (ofst + size <= 4) {
         val = lo >> (ofst * 8);
@@ -378,6 +443,7 @@ static uint64_t ahci_mem_read(void *opaque, hwaddr addr, unsigned size)
         hi = ahci_mem_read_32(opaque, aligned + 4);
         val = (hi << 32 | lo) >> (ofst * 8);
     }
+    ahci_unlock(s);
 
     DPRINTF(-1, "addr=0x%" HWADDR_PRIx " val=0x%" PRIx64 ", size=%d\n",
             addr, val, size);
@@ -400,6 +466,7 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
         return;
     }
 
+    ahci_lock(s);
     if (addr < AHCI_GENERIC_HOST_CONTROL_REGS_MAX_ADDR) {
         DPRINTF(-1, "(addr 0x%08X), val 0x%08"PRIX64"\n", (unsigned) addr, val);
 
@@ -435,7 +502,7 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
         ahci_port_write(s, (addr - AHCI_PORT_REGS_START_ADDR) >> 7,
                         addr & AHCI_PORT_ADDR_OFFSET_MASK, val);
     }
-
+    ahci_unlock(s);
 }
 
 static const MemoryRegionOps ahci_mem_ops = {
@@ -502,15 +569,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockBackend *blk = s->dev[port].port.ifs[0].blk;
     uint8_t slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* Submit all NCQ commands of this doorbell write as one batch */
+        if (blk) {
+            blk_io_plug(blk);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        if (blk) {
+            blk_io_unplug(blk);
+        }
     }
 }
 
@@ -581,6 +656,7 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->sig = 0xFFFFFFFF;
     d->busy_slot = -1;
     d->init_d2h_sent = false;
+    qemu_bh_cancel(d->sdb_bh);
 
     ide_state = &s->dev[port].port.ifs[0];
     if (!ide_state->blk) {
@@ -691,9 +767,8 @@ static void ahci_unmap_clb_address(AHCIDevice *ad)
     ad->lst = NULL;
 }
 
-static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
+static void ahci_write_fis_sdb(AHCIState *s, AHCIDevice *ad)
 {
-    AHCIDevice *ad = ncq_tfs->drive;
     AHCIPortRegs *pr = &ad->port_regs;
     IDEState *ide_state;
     SDBFIS *sdb_fis;
@@ -727,6 +802,15 @@ static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
     }
 }
 
+static void ahci_sdb_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    if (ad->finished) {
+        ahci_write_fis_sdb(ad->hba, ad);
+    }
+}
+
 static void ahci_write_fis_pio(AHCIDevice *ad, uint16_t len)
 {
     AHCIPortRegs *pr = &ad->port_regs;
@@ -929,10 +1013,14 @@ static void ncq_finish(NCQTransferState *ncq_tfs)
      * clear the outstanding bit in scr_act (PxSACT). */
     if (!(ncq_tfs->drive->port_regs.scr_err & (1 << ncq_tfs->tag))) {
         ncq_tfs->drive->finished |= (1 << ncq_tfs->tag);
+        /* Successful completions of the same batch share one SDB FIS
+         * and interrupt; errors are reported at once, so the status
+         * in the FIS still shows them. */
+        qemu_bh_schedule(ncq_tfs->drive->sdb_bh);
+    } else {
+        ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive);
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs);
-
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
@@ -1413,6 +1501,11 @@ static int ahci_dma_rw_buf(IDEDMA *dma, int is_write)
     return 1;
 }
 
+static AioContext *ahci_get_aio_context(AHCIState *s)
+{
+    return s->iothread ? s->ctx : qemu_get_aio_context();
+}
+
 static void ahci_cmd_done(IDEDMA *dma)
 {
     AHCIDevice *ad = DO_UPCAST(AHCIDevice, dma, dma);
@@ -1424,7 +1517,8 @@ static void ahci_cmd_done(IDEDMA *dma)
 
     if (!ad->check_bh) {
         /* maybe we still have something to process, check later */
-        ad->check_bh = qemu_bh_new(ahci_check_cmd_bh, ad);
+        ad->check_bh = aio_bh_new(ahci_get_aio_context(ad->hba),
+                                  ahci_check_cmd_bh, ad);
         qemu_bh_schedule(ad->check_bh);
     }
 }
@@ -1447,6 +1541,10 @@ static const IDEDMAOps ahci_dma_ops = {
 void ahci_init(AHCIState *s, DeviceState *qdev)
 {
     s->container = qdev;
+    object_property_add_link(OBJECT(qdev), "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     /* XXX BAR size should be 1k, but that breaks, so bump it to 4k for now */
     memory_region_init_io(&s->mem, OBJECT(qdev), &ahci_mem_ops, s,
                           "ahci", AHCI_MEM_BAR_SIZE);
@@ -1461,6 +1559,10 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
 
     s->as = as;
     s->ports = ports;
+    if (s->iothread) {
+        s->ctx = iothread_get_aio_context(s->iothread);
+        s->irq_bh = qemu_bh_new(ahci_irq_bh, s);
+    }
     s->dev = g_new0(AHCIDevice, ports);
     ahci_reg_init(s);
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
@@ -1474,12 +1576,24 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->sdb_bh = aio_bh_new(ahci_get_aio_context(s), ahci_sdb_bh, ad);
         ide_register_restart_cb(&ad->port);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        if (s->dev[i].check_bh) {
+            qemu_bh_delete(s->dev[i].check_bh);
+        }
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
+    if (s->irq_bh) {
+        qemu_bh_delete(s->irq_bh);
+    }
     g_free(s->dev);
 }
 
@@ -1488,6 +1602,7 @@ void ahci_reset(AHCIState *s)
     AHCIPortRegs *pr;
     int i;
 
+    ahci_lock(s);
     s->control_regs.irqstatus = 0;
     /* AHCI Enable (AE)
      * The implementation of this bit is dependent upon the value of the
@@ -1507,6 +1622,7 @@ void ahci_reset(AHCIState *s)
         pr->cmd = PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON;
         ahci_reset_port(s, i);
     }
+    ahci_unlock(s);
 }
 
 static const VMStateDescription vmstate_ncq_tfs = {
@@ -1555,17 +1671,17 @@ static const VMStateDescription vmstate_ahci_device = {
     },
 };
 
-static int ahci_state_post_load(void *opaque, int version_id)
+static int ahci_do_post_load(AHCIState *s)
 {
     int i, j;
     struct AHCIDevice *ad;
     NCQTransferState *ncq_tfs;
     AHCIPortRegs *pr;
-    AHCIState *s = opaque;
 
     for (i = 0; i < s->ports; i++) {
         ad = &s->dev[i];
         pr = &ad->port_regs;
+        ahci_port_set_aio_context(s, ad);
 
         if (!(pr->cmd & PORT_CMD_START) && (pr->cmd & PORT_CMD_LIST_ON)) {
             error_report("AHCI: DMA engine should be off, but status bit "
@@ -1615,6 +1731,10 @@ static int ahci_state_post_load(void *opaque, int version_id)
             }
         }
 
+        /* Completions may have been waiting for their SDB FIS */
+        if (ad->finished) {
+            qemu_bh_schedule(ad->sdb_bh);
+        }
 
         /*
          * If an error is present, ad->busy_slot will be valid and not -1.
@@ -1639,6 +1759,17 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static int ahci_state_post_load(void *opaque, int version_id)
+{
+    AHCIState *s = opaque;
+    int ret;
+
+    ahci_lock(s);
+    ret = ahci_do_post_load(s);
+    ahci_unlock(s);
+    return ret;
+}
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
@@ -25,6 +25,7 @@
 #define HW_IDE_AHCI_H
 
 #include <hw/sysbus.h>
+#include "sysemu/iothread.h"
 
 #define AHCI_MEM_BAR_SIZE         0x1000
 #define AHCI_MAX_PORTS            32
@@ -277,6 +278,7 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *sdb_bh;         /* reports the commands in @finished */
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_atapi_packet;
@@ -298,6 +300,9 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     AddressSpace *as;
+    IOThread *iothread;     /* processes the command lists, if set */
+    AioContext *ctx;        /* AioContext of @iothread */
+    QEMUBH *irq_bh;         /* updates the interrupt line from the main loop */
 } AHCIState;
 
 typedef struct AHCIPCIState {
@@ -449,7 +449,7 @@ BlockAIOCB *ide_issue_trim(BlockBackend *blk,
 
     iocb = blk_aio_get(&trim_aiocb_info, blk, cb, opaque);
     iocb->blk = blk;
-    iocb->bh = qemu_bh_new(ide_trim_bh_cb, iocb);
+    iocb->bh = aio_bh_new(blk_get_aio_context(blk), ide_trim_bh_cb, iocb);
     iocb->ret = 0;
     iocb->qiov = qiov;
     iocb->i = -1;
@@ -2500,6 +2500,7 @@ static void ide_restart_bh(void *opaque)
 {
     IDEBus *bus = opaque;
     IDEState *s;
+    AioContext *ctx;
     bool is_read;
     int error_status;
 
@@ -2514,6 +2515,10 @@ static void ide_restart_bh(void *opaque)
     s = idebus_active_if(bus);
     is_read = (bus->error_status & IDE_RETRY_READ) != 0;
 
+    /* The BlockBackend may have been moved to an IOThread by the HBA */
+    ctx = blk_get_aio_context(s->blk);
+    aio_context_acquire(ctx);
+
     /* The error status must be cleared before resubmitting the request: The
      * request may fail again, and this case can only be distinguished if the
      * called function can set a new error status. */
@@ -2550,6 +2555,7 @@ static void ide_restart_bh(void *opaque)
             ide_atapi_dma_restart(s);
         }
     }
+    aio_context_release(ctx);
 }
 
 static void ide_restart_cb(void *opaque, int running, RunState state)
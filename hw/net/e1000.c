@@ -30,6 +30,7 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/tap.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
@@ -71,6 +72,9 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 
 #define MAXIMUM_ETHERNET_HDR_LEN (14+4)
 
+/* Descriptors fetched from a ring with a single DMA read */
+#define E1000_DESC_BATCH  32
+
 /*
  * HW models:
  *  E1000_DEV_ID_82540EM works with Windows, Linux, and OS X <= 10.8
@@ -135,14 +139,27 @@ typedef struct E1000State_st {
     bool mit_irq_level;        /* Tracks interrupt pin level. */
     uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
 
+    /* RX descriptors from rx_desc_head on, prefetched up to RDT.  Entries
+     * rx_desc_dirty.. are consumed by the current frame and not yet
+     * written back; nothing stays dirty between frames.
+     */
+    struct e1000_rx_desc rx_desc_cache[E1000_DESC_BATCH];
+    uint32_t rx_desc_head;
+    uint32_t rx_desc_count;
+    uint32_t rx_desc_dirty;
+    uint32_t rx_desc_ndirty;
+
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
 #define E1000_FLAG_MAC_BIT 2
+#define E1000_FLAG_VNET_BIT 3
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
 #define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
 #define E1000_FLAG_MAC (1 << E1000_FLAG_MAC_BIT)
+#define E1000_FLAG_VNET (1 << E1000_FLAG_VNET_BIT)
     uint32_t compat_flags;
+    bool has_vnet_hdr;  /* packets to and from the peer carry a vnet header */
 } E1000State;
 
 #define chkflag(x)     (s->compat_flags & E1000_FLAG_##x)
@@ -442,6 +459,7 @@ static void e1000_reset(void *opaque)
     memset(d->mac_reg, 0, sizeof d->mac_reg);
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
+    d->rx_desc_count = 0;
     memset(&d->tx, 0, sizeof d->tx);
 
     if (qemu_get_queue(d->nic)->link_down) {
@@ -476,6 +494,7 @@ set_rx_control(E1000State *s, int index, uint32_t val)
     s->mac_reg[RCTL] = val;
     s->rxbuf_size = rxbufsize(val);
     s->rxbuf_min_shift = ((val / E1000_RCTL_RDMTS_QUAT) & 3) + 1;
+    s->rx_desc_count = 0;
     DBGOUT(RX, "RCTL: %d, mac_reg[RCTL] = 0x%x\n", s->mac_reg[RDT],
            s->mac_reg[RCTL]);
     qemu_flush_queued_packets(qemu_get_queue(s->nic));
@@ -678,28 +697,143 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static inline bool
+e1000_loopback(E1000State *s)
+{
+    return (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) != 0;
+}
+
+/* Checksums and segmentation can be left to the peer */
+static inline bool
+e1000_tx_offload(E1000State *s)
+{
+    return s->has_vnet_hdr && !e1000_loopback(s);
+}
+
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_send_packet(E1000State *s, struct virtio_net_hdr *vhdr,
+                  const uint8_t *buf, int size)
 {
     static const int PTCregs[6] = { PTC64, PTC127, PTC255, PTC511,
                                     PTC1023, PTC1522 };
 
     NetClientState *nc = qemu_get_queue(s->nic);
-    if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+    struct virtio_net_hdr zero_hdr = {};
+    struct iovec iov[2] = {
+        { .iov_base = vhdr ? vhdr : &zero_hdr, .iov_len = sizeof(*vhdr) },
+        { .iov_base = (void *)buf, .iov_len = size },
+    };
+
+    if (!s->has_vnet_hdr) {
+        if (e1000_loopback(s)) {
+            nc->info->receive(nc, buf, size);
+        } else {
+            qemu_send_packet(nc, buf, size);
+        }
+    } else if (e1000_loopback(s)) {
+        nc->info->receive_iov(nc, iov, 2);
     } else {
-        qemu_send_packet(nc, buf, size);
+        qemu_sendv_packet(nc, iov, 2);
     }
     inc_tx_bcast_or_mcast_count(s, buf);
     increase_size_stats(s, PTCregs, size);
 }
 
+/*
+ * Whether the TSO packet being gathered goes to the peer as a single GSO
+ * frame.  A packet that was partly segmented already (tso_frames != 0)
+ * continues to be segmented; one that grew past a segment can only have
+ * been gathered for GSO, e.g. before migration.
+ */
+static bool
+e1000_tx_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    if (!(tp->tse && tp->cptse)) {
+        return false;
+    }
+    if (tp->size > tp->hdr_len + tp->mss) {
+        return true;
+    }
+    return e1000_tx_offload(s) && tp->tso_frames == 0 && tp->tcp &&
+           tp->mss && (tp->sum_needed & E1000_TXD_POPTS_TXSM) &&
+           tp->hdr_len + tp->paylen <= sizeof(tp->data);
+}
+
+static void
+xmit_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr vhdr = {};
+    unsigned int css, len, segs, phsum, i;
+    uint16_t *sp;
+
+    if (!e1000_tx_offload(s) || tp->size <= tp->hdr_len) {
+        DBGOUT(TXERR, "dropping GSO frame, %d bytes\n", tp->size);
+        return;
+    }
+
+    css = tp->ipcss;
+    if (tp->ip) {    /* IPv4 */
+        stw_be_p(tp->data + css + 2, tp->size - css);
+    } else {         /* IPv6 */
+        stw_be_p(tp->data + css + 4, tp->size - css - 40);
+    }
+
+    /* Like the hardware, add the TCP length to the pseudo-header sum */
+    len = tp->size - tp->tucss;
+    sp = (uint16_t *)(tp->data + tp->tucso);
+    phsum = be16_to_cpup(sp) + len;
+    phsum = (phsum >> 16) + (phsum & 0xffff);
+    stw_be_p(sp, phsum);
+    if (tp->sum_needed & E1000_TXD_POPTS_IXSM) {
+        putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
+    }
+
+    vhdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vhdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4
+                           : VIRTIO_NET_HDR_GSO_TCPV6;
+    if (tp->data[tp->tucss + 13] & 0x80) {    /* CWR */
+        vhdr.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+    }
+    vhdr.gso_size = tp->mss;
+    vhdr.hdr_len = tp->hdr_len;
+    vhdr.csum_start = tp->tucss;
+    vhdr.csum_offset = tp->tucso - tp->tucss;
+
+    if (tp->vlan_needed) {
+        vhdr.hdr_len += 4;
+        vhdr.csum_start += 4;
+        memmove(tp->vlan, tp->data, 4);
+        memmove(tp->data, tp->data + 4, 8);
+        memcpy(tp->data + 8, tp->vlan_header, 4);
+        e1000_send_packet(s, &vhdr, tp->vlan, tp->size + 4);
+    } else {
+        e1000_send_packet(s, &vhdr, tp->data, tp->size);
+    }
+
+    /* Account for the segments the peer will send */
+    segs = DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss);
+    for (i = 0; i < segs; i++) {
+        inc_reg_if_not_full(s, TPT);
+    }
+    if (segs > 1) {
+        inc_reg_if_not_full(s, TSCTC);
+    }
+    grow_8reg_if_not_full(s, TOTL, tp->size + (segs - 1) * tp->hdr_len);
+    s->mac_reg[GPTC] = s->mac_reg[TPT];
+    s->mac_reg[GOTCL] = s->mac_reg[TOTL];
+    s->mac_reg[GOTCH] = s->mac_reg[TOTH];
+}
+
 static void
 xmit_seg(E1000State *s)
 {
     uint16_t len, *sp;
     unsigned int frames = s->tx.tso_frames, css, sofar;
     struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr vhdr = {};
 
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
@@ -736,17 +870,26 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
-        putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (e1000_tx_offload(s) && !tp->tucse && tp->tucso > tp->tucss &&
+            tp->tucso + 2 <= tp->size) {
+            /* The peer sums from tucss to the end, as the hardware does */
+            vhdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            vhdr.csum_start = tp->tucss + (tp->vlan_needed ? 4 : 0);
+            vhdr.csum_offset = tp->tucso - tp->tucss;
+        } else {
+            putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+        }
+    }
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
     if (tp->vlan_needed) {
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
-        e1000_send_packet(s, tp->vlan, tp->size + 4);
+        e1000_send_packet(s, &vhdr, tp->vlan, tp->size + 4);
     } else {
-        e1000_send_packet(s, tp->data, tp->size);
+        e1000_send_packet(s, &vhdr, tp->data, tp->size);
     }
 
     inc_reg_if_not_full(s, TPT);
@@ -810,7 +953,16 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
 
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (e1000_tx_gso(s)) {
+        /* Gather the whole packet, the peer segments it */
+        bytes = MIN(sizeof(tp->data) - tp->size, split_size);
+        pci_dma_read(d, addr, tp->data + tp->size, bytes);
+        sz = tp->size + bytes;
+        if (sz >= tp->hdr_len && tp->size < tp->hdr_len) {
+            memmove(tp->header, tp->data, tp->hdr_len);
+        }
+        tp->size = sz;
+    } else if (tp->tse && tp->cptse) {
         msh = tp->hdr_len + tp->mss;
         do {
             bytes = split_size;
@@ -843,7 +995,9 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 
     if (!(txd_lower & E1000_TXD_CMD_EOP))
         return;
-    if (!(tp->tse && tp->cptse && tp->size < tp->hdr_len)) {
+    if (e1000_tx_gso(s)) {
+        xmit_gso(s);
+    } else if (!(tp->tse && tp->cptse && tp->size < tp->hdr_len)) {
         xmit_seg(s);
     }
     tp->tso_frames = 0;
@@ -853,10 +1007,27 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Number of descriptors from @head that can be fetched at once: up to the
+ * tail or the end of the ring, whichever comes first.
+ */
+static unsigned int
+desc_batch(uint32_t head, uint32_t tail, uint32_t len)
+{
+    uint32_t ring = len / sizeof(struct e1000_tx_desc);
+    uint32_t n;
+
+    if (head >= ring || head == tail) {
+        /* bogus values, or only a null descriptor is being skipped */
+        return 1;
+    }
+    n = (tail > head && tail <= ring) ? tail - head : ring - head;
+    return MIN(n, E1000_DESC_BATCH);
+}
+
+/* Updates the status in @dp; the caller writes the descriptor back */
 static uint32_t
-txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, struct e1000_tx_desc *dp)
 {
-    PCIDevice *d = PCI_DEVICE(s);
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
     if (!(txd_lower & (E1000_TXD_CMD_RS|E1000_TXD_CMD_RPS)))
@@ -864,8 +1035,6 @@ txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(d, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -882,38 +1051,58 @@ start_xmit(E1000State *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_DESC_BATCH], *dp;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    unsigned int i, n, wb_first, wb_last;
+    bool wrapped = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+    while (!wrapped && s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        n = desc_batch(s->mac_reg[TDH], s->mac_reg[TDT], s->mac_reg[TDLEN]);
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        pci_dma_read(d, base, descs, n * sizeof(descs[0]));
+
+        wb_first = n;
+        wb_last = 0;
+        for (i = 0; i < n && !wrapped; i++) {
+            dp = &descs[i];
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)dp->buffer_addr, dp->lower.data,
+                   dp->upper.data);
+
+            process_tx_desc(s, dp);
+            if (txdesc_writeback(s, dp)) {
+                cause |= E1000_ICR_TXDW;
+                wb_first = MIN(wb_first, i);
+                wb_last = i;
+            }
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            if (++s->mac_reg[TDH] * sizeof(*dp) >= s->mac_reg[TDLEN]) {
+                s->mac_reg[TDH] = 0;
+            }
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start ||
+                tdh_start >= s->mac_reg[TDLEN] / sizeof(*dp)) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = true;
+            }
+        }
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start ||
-            tdh_start >= s->mac_reg[TDLEN] / sizeof(desc)) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        /* Descriptors in between are written back unchanged */
+        if (wb_first < n) {
+            pci_dma_write(d, base + wb_first * sizeof(descs[0]),
+                          &descs[wb_first],
+                          (wb_last - wb_first + 1) * sizeof(descs[0]));
         }
     }
     set_ics(s, 0, cause);
@@ -1039,13 +1228,58 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+static void
+rx_desc_flush(E1000State *s)
+{
+    uint32_t first = s->rx_desc_head + s->rx_desc_dirty;
+
+    if (!s->rx_desc_ndirty) {
+        return;
+    }
+    pci_dma_write(PCI_DEVICE(s),
+                  rx_desc_base(s) + sizeof(struct e1000_rx_desc) * first,
+                  &s->rx_desc_cache[s->rx_desc_dirty],
+                  s->rx_desc_ndirty * sizeof(struct e1000_rx_desc));
+    s->rx_desc_ndirty = 0;
+}
+
+/* Returns the descriptor at RDH, prefetching a block when it is not cached.
+ * The caller may modify it and must then pass it to rx_desc_done().
+ */
+static struct e1000_rx_desc *
+rx_desc_get(E1000State *s)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+    uint32_t idx = rdh - s->rx_desc_head;
+
+    if (idx >= s->rx_desc_count) {
+        rx_desc_flush(s);
+        s->rx_desc_head = rdh;
+        s->rx_desc_count = desc_batch(rdh, s->mac_reg[RDT],
+                                      s->mac_reg[RDLEN]);
+        pci_dma_read(PCI_DEVICE(s),
+                     rx_desc_base(s) + sizeof(struct e1000_rx_desc) * rdh,
+                     s->rx_desc_cache,
+                     s->rx_desc_count * sizeof(struct e1000_rx_desc));
+        idx = 0;
+    }
+    return &s->rx_desc_cache[idx];
+}
+
+static void
+rx_desc_done(E1000State *s, struct e1000_rx_desc *desc)
+{
+    if (!s->rx_desc_ndirty) {
+        s->rx_desc_dirty = desc - s->rx_desc_cache;
+    }
+    s->rx_desc_ndirty++;
+}
+
 static ssize_t
-e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+e1000_receive_frame(E1000State *s, const struct iovec *iov, int iovcnt)
 {
-    E1000State *s = qemu_get_nic_opaque(nc);
     PCIDevice *d = PCI_DEVICE(s);
-    struct e1000_rx_desc desc;
-    dma_addr_t base;
+    struct e1000_rx_desc *desc;
     unsigned int n, rdt;
     uint32_t rdh_start;
     uint16_t vlan_special = 0;
@@ -1126,14 +1360,13 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         if (desc_size > s->rxbuf_size) {
             desc_size = s->rxbuf_size;
         }
-        base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
-        desc.special = vlan_special;
-        desc.status |= (vlan_status | E1000_RXD_STAT_DD);
-        if (desc.buffer_addr) {
+        desc = rx_desc_get(s);
+        desc->special = vlan_special;
+        desc->status |= (vlan_status | E1000_RXD_STAT_DD);
+        if (desc->buffer_addr) {
             if (desc_offset < size) {
                 size_t iov_copy;
-                hwaddr ba = le64_to_cpu(desc.buffer_addr);
+                hwaddr ba = le64_to_cpu(desc->buffer_addr);
                 size_t copy_size = size - desc_offset;
                 if (copy_size > s->rxbuf_size) {
                     copy_size = s->rxbuf_size;
@@ -1151,30 +1384,33 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
                 } while (copy_size);
             }
             desc_offset += desc_size;
-            desc.length = cpu_to_le16(desc_size);
+            desc->length = cpu_to_le16(desc_size);
             if (desc_offset >= total_size) {
-                desc.status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
+                desc->status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
             } else {
                 /* Guest zeroing out status is not a hardware requirement.
                    Clear EOP in case guest didn't do it. */
-                desc.status &= ~E1000_RXD_STAT_EOP;
+                desc->status &= ~E1000_RXD_STAT_EOP;
             }
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(d, base, &desc, sizeof(desc));
+        rx_desc_done(s, desc);
 
-        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
+        if (++s->mac_reg[RDH] * sizeof(*desc) >= s->mac_reg[RDLEN]) {
             s->mac_reg[RDH] = 0;
+        }
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start ||
-            rdh_start >= s->mac_reg[RDLEN] / sizeof(desc)) {
+            rdh_start >= s->mac_reg[RDLEN] / sizeof(*desc)) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
+            rx_desc_flush(s);
             set_ics(s, 0, E1000_ICS_RXO);
             return -1;
         }
     } while (desc_offset < total_size);
+    rx_desc_flush(s);
 
     increase_size_stats(s, PRCregs, total_size);
     inc_reg_if_not_full(s, TPR);
@@ -1190,8 +1426,8 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
 
     n = E1000_ICS_RXT0;
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
-        rdt += s->mac_reg[RDLEN] / sizeof(desc);
-    if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
+        rdt += s->mac_reg[RDLEN] / sizeof(*desc);
+    if (((rdt - s->mac_reg[RDH]) * sizeof(*desc)) <= s->mac_reg[RDLEN] >>
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
@@ -1200,6 +1436,34 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return size;
 }
 
+/*
+ * The peer's offloads stay disabled, the guest can neither take GSO frames
+ * nor packets with a partial checksum, so the vnet header is just dropped.
+ */
+static ssize_t
+e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct iovec *frame;
+    int frame_cnt;
+
+    if (!s->has_vnet_hdr) {
+        return e1000_receive_frame(s, iov, iovcnt);
+    }
+    if (size <= sizeof(struct virtio_net_hdr)) {
+        return size;
+    }
+
+    frame = alloca(sizeof(*frame) * iovcnt);
+    frame_cnt = iov_copy(frame, iovcnt, iov, iovcnt,
+                         sizeof(struct virtio_net_hdr), -1);
+    if (e1000_receive_frame(s, frame, frame_cnt) < 0) {
+        return -1;
+    }
+    return size;
+}
+
 static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -1305,6 +1569,20 @@ set_dlen(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xfff80;
 }
 
+static void
+set_rx_ring(E1000State *s, int index, uint32_t val)
+{
+    if (index == RDLEN) {
+        set_dlen(s, index, val);
+    } else if (index == RDH) {
+        set_16bit(s, index, val);
+    } else {
+        s->mac_reg[index] = val;
+    }
+    /* the prefetched descriptors no longer match the ring */
+    s->rx_desc_count = 0;
+}
+
 static void
 set_tctl(E1000State *s, int index, uint32_t val)
 {
@@ -1392,16 +1670,16 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)    [x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),      putreg(EERD),     putreg(SWSM),     putreg(WUFC),
-    putreg(TDBAL),    putreg(TDBAH),    putreg(TXDCTL),   putreg(RDBAH),
-    putreg(RDBAL),    putreg(LEDCTL),   putreg(VET),      putreg(FCRUC),
-    putreg(TDFH),     putreg(TDFT),     putreg(TDFHS),    putreg(TDFTS),
-    putreg(TDFPC),    putreg(RDFH),     putreg(RDFT),     putreg(RDFHS),
-    putreg(RDFTS),    putreg(RDFPC),    putreg(IPAV),     putreg(WUC),
-    putreg(WUS),      putreg(AIT),
-
-    [TDLEN]  = set_dlen,   [RDLEN]  = set_dlen,       [TCTL] = set_tctl,
+    putreg(TDBAL),    putreg(TDBAH),    putreg(TXDCTL),   putreg(LEDCTL),
+    putreg(VET),      putreg(FCRUC),    putreg(TDFH),     putreg(TDFT),
+    putreg(TDFHS),    putreg(TDFTS),    putreg(TDFPC),    putreg(RDFH),
+    putreg(RDFT),     putreg(RDFHS),    putreg(RDFTS),    putreg(RDFPC),
+    putreg(IPAV),     putreg(WUC),      putreg(WUS),      putreg(AIT),
+
+    [TDLEN]  = set_dlen,   [RDLEN]  = set_rx_ring,    [TCTL] = set_tctl,
     [TDT]    = set_tctl,   [MDIC]   = set_mdic,       [ICS]  = set_ics,
-    [TDH]    = set_16bit,  [RDH]    = set_16bit,      [RDT]  = set_rdt,
+    [TDH]    = set_16bit,  [RDH]    = set_rx_ring,    [RDT]  = set_rdt,
+    [RDBAL]  = set_rx_ring, [RDBAH] = set_rx_ring,
     [IMC]    = set_imc,    [IMS]    = set_ims,        [ICR]  = set_icr,
     [EECD]   = set_eecd,   [RCTL]   = set_rx_control, [CTRL] = set_ctrl,
     [RDTR]   = set_16bit,  [RADV]   = set_16bit,      [TADV] = set_16bit,
@@ -1594,6 +1872,7 @@ static int e1000_post_load(void *opaque, int version_id)
     }
     s->mit_ide = 0;
     s->mit_timer_on = false;
+    s->rx_desc_count = 0;
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS].
@@ -1813,6 +2092,7 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
     uint16_t checksum = 0;
     int i;
     uint8_t *macaddr;
+    NetClientState *peer;
 
     pci_dev->config_write = e1000_write_config;
 
@@ -1844,6 +2124,15 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           object_get_typename(OBJECT(d)), dev->id, d);
 
+    peer = qemu_get_queue(d->nic)->peer;
+    if ((d->compat_flags & E1000_FLAG_VNET) && qemu_has_vnet_hdr(peer) &&
+        qemu_has_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr))) {
+        qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+        qemu_using_vnet_hdr(peer, true);
+        qemu_set_offload(peer, 0, 0, 0, 0, 0);
+        d->has_vnet_hdr = true;
+    }
+
     qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
@@ -1864,6 +2153,8 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_BIT("extra_mac_registers", E1000State,
                     compat_flags, E1000_FLAG_MAC_BIT, true),
+    DEFINE_PROP_BIT("vnet_offload", E1000State,
+                    compat_flags, E1000_FLAG_VNET_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
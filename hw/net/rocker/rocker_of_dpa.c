@@ -31,9 +31,13 @@
 static const MACAddr zero_mac = { .a = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
 static const MACAddr ff_mac =   { .a = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
 
+/* Max number of cached flow lookups before the cache starts over */
+#define OF_DPA_FLOW_CACHE_SIZE 4096
+
 typedef struct of_dpa {
     World *world;
     GHashTable *flow_tbl;
+    GHashTable *flow_cache;          /* match key -> best flow or NULL */
     GHashTable *group_tbl;
     unsigned int flow_tbl_max_size;
     unsigned int group_tbl_max_size;
@@ -336,13 +340,63 @@ static void _of_dpa_flow_match(void *key, void *value, void *user_data)
     }
 }
 
+/* Match keys only count up to their width, see _of_dpa_flow_match() */
+static guint of_dpa_flow_key_hash(gconstpointer v)
+{
+    const OfDpaFlowKey *key = v;
+    const uint64_t *k = (const uint64_t *)key;
+    uint64_t hash = key->width;
+    int i;
+
+    for (i = 0; i < key->width; i++) {
+        hash = (hash ^ k[i]) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static gboolean of_dpa_flow_key_equal(gconstpointer v1, gconstpointer v2)
+{
+    const OfDpaFlowKey *key1 = v1;
+    const OfDpaFlowKey *key2 = v2;
+
+    return key1->width == key2->width &&
+           !memcmp(key1, key2, key1->width * sizeof(uint64_t));
+}
+
+/* Flows changed, forget all cached lookups */
+static void of_dpa_flow_cache_flush(OfDpa *of_dpa)
+{
+    g_hash_table_remove_all(of_dpa->flow_cache);
+}
+
+/*
+ * The best flow only depends on the match key and the installed flows,
+ * so remember it, or the lack of one, per exact key: the scan of every
+ * flow then only runs once per new kind of packet after a flow change.
+ */
 static OfDpaFlow *of_dpa_flow_match(OfDpa *of_dpa, OfDpaFlowMatch *match)
 {
+    gpointer best;
+
+    if (g_hash_table_lookup_extended(of_dpa->flow_cache, &match->value,
+                                     NULL, &best)) {
+        match->best = best;
+        return match->best;
+    }
+
     DPRINTF("\nnew search\n");
     of_dpa_flow_key_dump(&match->value, NULL);
 
     g_hash_table_foreach(of_dpa->flow_tbl, _of_dpa_flow_match, match);
 
+    if (g_hash_table_size(of_dpa->flow_cache) >= OF_DPA_FLOW_CACHE_SIZE) {
+        of_dpa_flow_cache_flush(of_dpa);
+    }
+    g_hash_table_insert(of_dpa->flow_cache,
+                        g_memdup(&match->value, sizeof(match->value)),
+                        match->best);
+
     return match->best;
 }
 
@@ -354,12 +408,14 @@ static OfDpaFlow *of_dpa_flow_find(OfDpa *of_dpa, uint64_t cookie)
 static int of_dpa_flow_add(OfDpa *of_dpa, OfDpaFlow *flow)
 {
     g_hash_table_insert(of_dpa->flow_tbl, &flow->cookie, flow);
+    of_dpa_flow_cache_flush(of_dpa);
 
     return ROCKER_OK;
 }
 
 static void of_dpa_flow_del(OfDpa *of_dpa, OfDpaFlow *flow)
 {
+    of_dpa_flow_cache_flush(of_dpa);
     g_hash_table_remove(of_dpa->flow_tbl, &flow->cookie);
 }
 
@@ -1890,6 +1946,7 @@ static int of_dpa_cmd_flow_mod(OfDpa *of_dpa, uint64_t cookie,
         return -ROCKER_ENOENT;
     }
 
+    of_dpa_flow_cache_flush(of_dpa);
     return of_dpa_cmd_flow_add_mod(of_dpa, flow, flow_tlvs);
 }
 
@@ -2280,6 +2337,13 @@ static int of_dpa_init(World *world)
         return -ENOMEM;
     }
 
+    of_dpa->flow_cache = g_hash_table_new_full(of_dpa_flow_key_hash,
+                                               of_dpa_flow_key_equal,
+                                               g_free, NULL);
+    if (!of_dpa->flow_cache) {
+        goto err_flow_cache;
+    }
+
     of_dpa->group_tbl = g_hash_table_new_full(g_int_hash, g_int_equal,
                                               NULL, g_free);
     if (!of_dpa->group_tbl) {
@@ -2293,6 +2357,8 @@ static int of_dpa_init(World *world)
     return 0;
 
 err_group_tbl:
+    g_hash_table_destroy(of_dpa->flow_cache);
+err_flow_cache:
     g_hash_table_destroy(of_dpa->flow_tbl);
     return -ENOMEM;
 }
@@ -2302,6 +2368,7 @@ static void of_dpa_uninit(World *world)
     OfDpa *of_dpa = world_private(world);
 
     g_hash_table_destroy(of_dpa->group_tbl);
+    g_hash_table_destroy(of_dpa->flow_cache);
     g_hash_table_destroy(of_dpa->flow_tbl);
 }
 
@@ -23,8 +23,10 @@
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -213,6 +215,262 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/*
+ * Dataplane: with iothread= the queue pairs and the netdevs behind them
+ * are processed in IOThreads rather than the main loop.  Queue pair i
+ * runs in the i-th IOThread of the list (wrapping around); the control
+ * queue stays in the main loop, which takes the AioContext locks
+ * whenever it touches the data path.
+ */
+
+static void virtio_net_tx_bh(void *opaque);
+
+static void virtio_net_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads && i < n->max_queues; i++) {
+        aio_context_acquire(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_release(VirtIONet *n)
+{
+    int i = MIN(n->num_iothreads, n->max_queues);
+
+    while (--i >= 0) {
+        aio_context_release(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_notify_queue(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started && !n->dataplane_disabled) {
+        /* Raise the irqfd directly, this may run in an IOThread */
+        if (virtio_should_notify(vdev, vq)) {
+            event_notifier_set(virtio_queue_get_guest_notifier(vq));
+        }
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+/* Move queue pair @index, its TX bottom half and its netdev to @ctx */
+static void virtio_net_queue_set_aio_context(VirtIONet *n, int index,
+                                             AioContext *ctx)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    qemu_bh_delete(q->tx_bh);
+    q->tx_bh = aio_bh_new(ctx ? ctx : qemu_get_aio_context(),
+                          virtio_net_tx_bh, q);
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+    qemu_set_aio_context(qemu_get_subqueue(n->nic, index), ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    if (n->dataplane_started || n->dataplane_starting) {
+        return;
+    }
+
+    n->dataplane_starting = true;
+
+    /* Set up guest notifier (irq).  Masking needs vhost, so the irqfds are
+     * released rather than masked while the guest masks a vector.
+     */
+    vdev->use_guest_notifier_mask = false;
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r != 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            goto fail_host_notifier;
+        }
+    }
+
+    n->dataplane_starting = false;
+    n->dataplane_started = true;
+    trace_virtio_net_data_plane_start(n, queues);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        virtio_net_queue_set_aio_context(n, i, q->ctx);
+
+        /* Kick right away to pick up buffers already in the vrings */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                                                   true, true);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                                                   true, true);
+        aio_context_release(q->ctx);
+    }
+    return;
+
+  fail_host_notifier:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+  fail_guest_notifiers:
+    vdev->use_guest_notifier_mask = true;
+    n->dataplane_disabled = true;
+    n->dataplane_starting = false;
+    n->dataplane_started = true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    /* Better luck next time. */
+    if (n->dataplane_disabled) {
+        n->dataplane_disabled = false;
+        n->dataplane_started = false;
+        return;
+    }
+    trace_virtio_net_data_plane_stop(n);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                                                   false, false);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                                                   false, false);
+        virtio_net_queue_set_aio_context(n, i, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    vdev->use_guest_notifier_mask = true;
+
+    n->dataplane_started = false;
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (!n->num_iothreads) {
+        return;
+    }
+
+    if ((status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running) {
+        virtio_net_dataplane_start(n);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
+static void virtio_net_dataplane_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->num_iothreads = 0;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_init(VirtIONet *n, Error **errp)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    gchar **ids;
+    int i;
+
+    if (!n->net_conf.iothread || !*n->net_conf.iothread) {
+        return;
+    }
+
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp, "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    if (n->net_conf.tx && strcmp(n->net_conf.tx, "bh")) {
+        error_setg(errp, "iothread requires tx=bh");
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (peer && (get_vhost_net(peer) || !peer->info->set_aio_context)) {
+            error_setg(errp, "netdev '%s' can't be used with iothread",
+                       peer->name);
+            return;
+        }
+    }
+
+    ids = g_strsplit(n->net_conf.iothread, ",", -1);
+    n->iothreads = g_new0(IOThread *, g_strv_length(ids));
+    for (i = 0; ids[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread = obj ? (IOThread *)
+                             object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+
+        if (!iothread) {
+            error_setg(errp, "No IOThread with id '%s'", ids[i]);
+            g_strfreev(ids);
+            virtio_net_dataplane_cleanup(n);
+            return;
+        }
+        object_ref(obj);
+        n->iothreads[n->num_iothreads++] = iothread;
+    }
+    g_strfreev(ids);
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].ctx =
+            iothread_get_aio_context(n->iothreads[i % n->num_iothreads]);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -220,8 +478,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_acquire(n);
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
@@ -257,8 +517,12 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             } else {
                 qemu_bh_cancel(q->tx_bh);
             }
+            if (q->tx_adaptive_timer) {
+                timer_del(q->tx_adaptive_timer);
+            }
         }
     }
+    virtio_net_release(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -885,6 +1149,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    virtio_net_acquire(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -924,6 +1189,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_release(n);
 }
 
 /* RX */
@@ -1167,13 +1433,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_discard(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1184,35 +1450,60 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify_queue(n, q->rx_vq);
+    }
 
     return size;
 }
 
+/* Notify the guest once per batch of received packets */
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (start) {
+        q->rx_batch++;
+        return;
+    }
+
+    assert(q->rx_batch > 0);
+    if (--q->rx_batch == 0 && q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify_queue(n, q->rx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify_queue(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
+/* Packets popped from the TX ring per virtqueue_pop_batch() call */
+#define VIRTIO_NET_TX_BATCH 32
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elem, *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i = 0, popped = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1224,16 +1515,25 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    q->tx_stats.flushes++;
     for (;;) {
         ssize_t ret;
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (i == popped) {
+            /* Never pop past the burst, so that nothing is left over */
+            popped = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                         (void **)elems,
+                                         MIN(VIRTIO_NET_TX_BATCH,
+                                             q->tx_burst - num_packets));
+            i = 0;
+            if (!popped) {
+                break;
+            }
         }
+        elem = elems[i++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
@@ -1284,15 +1584,22 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            /* Give back the rest of the batch, last popped first */
+            while (popped > i) {
+                elem = elems[--popped];
+                virtqueue_discard(q->tx_vq, elem, 0);
+                virtqueue_free_element(q->tx_vq, elem);
+            }
             return -EBUSY;
         }
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_notify_queue(n, q->tx_vq);
+        virtqueue_free_element(q->tx_vq, elem);
+        q->tx_stats.packets++;
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
@@ -1304,6 +1611,7 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    q->tx_stats.kicks++;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
         q->tx_waiting = 1;
@@ -1328,6 +1636,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    q->tx_stats.kicks++;
     if (unlikely(q->tx_waiting)) {
         return;
     }
@@ -1337,7 +1646,12 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(q->tx_bh);
+    if (q->tx_adaptive_delay) {
+        timer_mod(q->tx_adaptive_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->tx_adaptive_delay);
+    } else {
+        qemu_bh_schedule(q->tx_bh);
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
@@ -1363,12 +1677,48 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
+/*
+ * tx=adaptive: tune the burst size and kick coalescing of @q from the
+ * @packets sent by the last run of the bottom half.
+ *
+ * A full burst means the queue has a backlog, so the burst grows and the
+ * bottom half runs again at once.  Kicks that keep coming at a high rate
+ * with only a few packets each are coalesced: the next flush is delayed
+ * so that more packets pile up, which backs off guest notifications.
+ * When the guest goes quiet the burst shrinks and the delay decays, to
+ * keep latency low.
+ */
+static void virtio_net_tx_adapt(VirtIONetQueue *q, int32_t packets)
+{
+    VirtIONet *n = q->n;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t interval = now - q->tx_last_flush;
+    int64_t max_delay = n->tx_timeout / 2;
+
+    q->tx_last_flush = now;
+    if (packets >= q->tx_burst) {
+        q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst);
+        q->tx_adaptive_delay = 0;
+    } else if (interval >= n->tx_timeout) {
+        q->tx_burst = MAX(q->tx_burst / 2, TX_ADAPTIVE_MIN_BURST);
+        q->tx_adaptive_delay /= 2;
+        if (q->tx_adaptive_delay < TX_ADAPTIVE_MIN_DELAY) {
+            q->tx_adaptive_delay = 0;
+        }
+    } else if (packets < TX_ADAPTIVE_MIN_BURST / 4) {
+        q->tx_adaptive_delay = MAX(q->tx_adaptive_delay * 2,
+                                   TX_ADAPTIVE_MIN_DELAY);
+        q->tx_adaptive_delay = MIN(q->tx_adaptive_delay, max_delay);
+    }
+    trace_virtio_net_tx_adapt(q, packets, q->tx_burst, q->tx_adaptive_delay);
+}
+
 static void virtio_net_tx_bh(void *opaque)
 {
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    int32_t ret;
+    int32_t ret, ret2;
 
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
@@ -1391,7 +1741,10 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= q->tx_burst) {
+        if (n->tx_adaptive) {
+            virtio_net_tx_adapt(q, ret);
+        }
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1401,13 +1754,24 @@ static void virtio_net_tx_bh(void *opaque)
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
     virtio_queue_set_notification(q->tx_vq, 1);
-    if (virtio_net_flush_tx(q) > 0) {
+    ret2 = virtio_net_flush_tx(q);
+    if (n->tx_adaptive && ret2 != -EBUSY) {
+        virtio_net_tx_adapt(q, ret + ret2);
+    }
+    if (ret2 > 0) {
         virtio_queue_set_notification(q->tx_vq, 0);
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
     }
 }
 
+static void virtio_net_tx_adaptive_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_tx_bh(q);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1423,9 +1787,15 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
+        if (n->tx_adaptive) {
+            n->vqs[index].tx_adaptive_timer =
+                timer_new_ns(QEMU_CLOCK_VIRTUAL, virtio_net_tx_adaptive_timer,
+                             &n->vqs[index]);
+        }
     }
 
     n->vqs[index].tx_waiting = 0;
+    n->vqs[index].tx_burst = n->tx_burst;
     n->vqs[index].n = n;
 }
 
@@ -1444,6 +1814,11 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     } else {
         qemu_bh_delete(q->tx_bh);
     }
+    if (q->tx_adaptive_timer) {
+        timer_del(q->tx_adaptive_timer);
+        timer_free(q->tx_adaptive_timer);
+        q->tx_adaptive_timer = NULL;
+    }
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -1690,6 +2065,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1743,6 +2119,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
     virtio_net_set_config_size(n, n->host_features);
@@ -1758,15 +2135,27 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
+
+    virtio_net_dataplane_init(n, &err);
+    if (err) {
+        error_propagate(errp, err);
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->tx_timeout = n->net_conf.txtimer;
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
-                       && strcmp(n->net_conf.tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+                       && strcmp(n->net_conf.tx, "bh")
+                       && strcmp(n->net_conf.tx, "adaptive")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"adaptive\"",
                      n->net_conf.tx);
         error_report("Defaulting to \"bh\"");
     }
+    n->tx_adaptive = n->net_conf.tx && !strcmp(n->net_conf.tx, "adaptive");
+    n->tx_burst = n->net_conf.txburst;
 
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
@@ -1803,7 +2192,6 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
     n->vqs[0].tx_waiting = 0;
-    n->tx_burst = n->net_conf.txburst;
     virtio_net_set_mrg_rx_bufs(n, 0, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1846,10 +2234,58 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
     g_free(n->vqs);
+    virtio_net_dataplane_cleanup(n);
     qemu_del_nic(n->nic);
     virtio_cleanup(vdev);
 }
 
+/* Per queue pair TX counters, e.g. qom-get /machine/peripheral/net0 tx-stats */
+static void virtio_net_get_tx_stats(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+    Error *err = NULL;
+    int i;
+
+    visit_start_struct(v, name, NULL, 0, &err);
+    if (err) {
+        goto out;
+    }
+    for (i = 0; n->vqs && i < n->max_queues && !err; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        char *qname = g_strdup_printf("queue%d", i);
+        uint64_t burst = q->tx_burst;
+        int64_t delay = q->tx_adaptive_delay;
+
+        visit_start_struct(v, qname, NULL, 0, &err);
+        g_free(qname);
+        if (err) {
+            break;
+        }
+        visit_type_uint64(v, "flushes", &q->tx_stats.flushes, &err);
+        if (!err) {
+            visit_type_uint64(v, "packets", &q->tx_stats.packets, &err);
+        }
+        if (!err) {
+            visit_type_uint64(v, "notifications", &q->tx_stats.kicks, &err);
+        }
+        if (!err) {
+            visit_type_uint64(v, "burst", &burst, &err);
+        }
+        if (!err) {
+            visit_type_int(v, "coalesce-ns", &delay, &err);
+        }
+        error_propagate(errp, err);
+        err = NULL;
+        visit_end_struct(v, &err);
+    }
+    error_propagate(errp, err);
+    err = NULL;
+    visit_end_struct(v, &err);
+out:
+    error_propagate(errp, err);
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -1862,6 +2298,8 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add(obj, "tx-stats", "virtio-net TX statistics",
+                        virtio_net_get_tx_stats, NULL, NULL, n, NULL);
 }
 
 static Property virtio_net_properties[] = {
@@ -1909,6 +2347,7 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_STRING("iothread", VirtIONet, net_conf.iothread),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -313,6 +313,10 @@ typedef struct {
 
         bool peer_has_vhdr;
 
+        /* RSS configuration of the guest, valid if rss_enabled */
+        bool rss_enabled;
+        struct UPT1_RSSConf rss_conf;
+
         /* TX packets to QEMU interface */
         struct VmxnetTxPkt *tx_pkt;
         uint32_t offload_mode;
@@ -704,6 +708,13 @@ vmxnet3_pop_next_tx_descr(VMXNET3State *s,
     return false;
 }
 
+/* Queue pairs map one-to-one onto the queues of the peer */
+static NetClientState *
+vmxnet3_get_queue(VMXNET3State *s, int qidx)
+{
+    return qemu_get_subqueue(s->nic, qidx % MAX(s->conf.peers.queues, 1));
+}
+
 static bool
 vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
 {
@@ -718,7 +729,7 @@ vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
     vmxnet3_dump_virt_hdr(vmxnet_tx_pkt_get_vhdr(s->tx_pkt));
     vmxnet_tx_pkt_dump(s->tx_pkt);
 
-    if (!vmxnet_tx_pkt_send(s->tx_pkt, qemu_get_queue(s->nic))) {
+    if (!vmxnet_tx_pkt_send(s->tx_pkt, vmxnet3_get_queue(s, qidx))) {
         status = VMXNET3_PKT_STATUS_DISCARD;
         goto func_exit;
     }
@@ -820,23 +831,22 @@ vmxnet3_revert_rxc_descr(VMXNET3State *s, int qidx)
     vmxnet3_dec_rx_completion_counter(s, qidx);
 }
 
-#define RXQ_IDX      (0)
 #define RX_HEAD_BODY_RING (0)
 #define RX_BODY_ONLY_RING (1)
 
 static bool
-vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_head_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *descr_buf,
                                uint32_t *descr_idx,
                                uint32_t *ridx)
 {
     for (;;) {
         uint32_t ring_gen;
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* If no more free descriptors - return */
-        ring_gen = vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        ring_gen = vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING);
         if (descr_buf->gen != ring_gen) {
             return false;
         }
@@ -844,11 +854,11 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* Mark current descriptor as used/skipped */
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
 
         /* If this is what we are looking for - return */
         if (descr_buf->btype == VMXNET3_RXD_BTYPE_HEAD) {
@@ -859,21 +869,21 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
 }
 
 static bool
-vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_body_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *d,
                                uint32_t *didx,
                                uint32_t *ridx)
 {
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
 
     /* Try to find corresponding descriptor in head/body ring */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
         if (d->btype == VMXNET3_RXD_BTYPE_BODY) {
-            vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+            vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
             *ridx = RX_HEAD_BODY_RING;
             return true;
         }
@@ -883,17 +893,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
      * If there is no free descriptors on head/body ring or next free
      * descriptor is a head descriptor switch to body only ring
      */
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
 
     /* If no more free descriptors - return */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_BODY_ONLY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_BODY_ONLY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
         assert(d->btype == VMXNET3_RXD_BTYPE_BODY);
         *ridx = RX_BODY_ONLY_RING;
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_BODY_ONLY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_BODY_ONLY_RING);
         return true;
     }
 
@@ -901,15 +911,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
 }
 
 static inline bool
-vmxnet3_get_next_rx_descr(VMXNET3State *s, bool is_head,
+vmxnet3_get_next_rx_descr(VMXNET3State *s, int qidx, bool is_head,
                           struct Vmxnet3_RxDesc *descr_buf,
                           uint32_t *descr_idx,
                           uint32_t *ridx)
 {
     if (is_head || !s->rx_packets_compound) {
-        return vmxnet3_get_next_head_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_head_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     } else {
-        return vmxnet3_get_next_body_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_body_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     }
 }
 
@@ -1052,7 +1064,8 @@ vmxnet3_physical_memory_writev(const struct iovec *iov,
 }
 
 static bool
-vmxnet3_indicate_packet(VMXNET3State *s)
+vmxnet3_indicate_packet(VMXNET3State *s, int qidx,
+                        uint8_t rss_type, uint32_t rss_hash)
 {
     struct Vmxnet3_RxDesc rxd;
     bool is_head = true;
@@ -1078,12 +1091,13 @@ vmxnet3_indicate_packet(VMXNET3State *s)
             break;
         }
 
-        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, RXQ_IDX, &new_rxcd_gen);
+        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, qidx, &new_rxcd_gen);
         if (!new_rxcd_pa) {
             break;
         }
 
-        if (!vmxnet3_get_next_rx_descr(s, is_head, &rxd, &rxd_idx, &rx_ridx)) {
+        if (!vmxnet3_get_next_rx_descr(s, qidx, is_head, &rxd, &rxd_idx,
+                                       &rx_ridx)) {
             break;
         }
 
@@ -1104,10 +1118,12 @@ vmxnet3_indicate_packet(VMXNET3State *s)
         rxcd.len = chunk_size;
         rxcd.sop = is_head;
         rxcd.gen = new_rxcd_gen;
-        rxcd.rqID = RXQ_IDX + rx_ridx * s->rxq_num;
+        rxcd.rqID = qidx + rx_ridx * s->rxq_num;
 
         if (bytes_left == 0) {
             vmxnet3_rx_update_descr(s->rx_pkt, &rxcd);
+            rxcd.rssType = rss_type;
+            rxcd.rssHash = cpu_to_le32(rss_hash);
         }
 
         VMW_RIPRN("RX Completion descriptor: rxRing: %lu rxIdx %lu len %lu "
@@ -1134,19 +1150,19 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     }
 
     if (new_rxcd_pa != 0) {
-        vmxnet3_revert_rxc_descr(s, RXQ_IDX);
+        vmxnet3_revert_rxc_descr(s, qidx);
     }
 
-    vmxnet3_trigger_interrupt(s, s->rxq_descr[RXQ_IDX].intr_idx);
+    vmxnet3_trigger_interrupt(s, s->rxq_descr[qidx].intr_idx);
 
     if (bytes_left == 0) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_OK);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_OK);
         return true;
     } else if (num_frags == s->max_rx_frags) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_ERROR);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_ERROR);
         return false;
     } else {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX,
+        vmxnet3_on_rx_done_update_stats(s, qidx,
                                         VMXNET3_PKT_STATUS_OUT_OF_BUF);
         return false;
     }
@@ -1375,6 +1391,51 @@ static void vmxnet3_update_pm_state(VMXNET3State *s)
     vmxnet3_dump_conf_descr("PM State", &pm_descr);
 }
 
+static void vmxnet3_update_rss(VMXNET3State *s)
+{
+    struct UPT1_RSSConf *rss = &s->rss_conf;
+    uint32_t guest_features;
+    uint32_t conf_len;
+    hwaddr conf_pa;
+
+    s->rss_enabled = false;
+    guest_features = VMXNET3_READ_DRV_SHARED32(s->drv_shmem,
+                                               devRead.misc.uptFeatures);
+    if (!VMXNET_FLAG_IS_SET(guest_features, UPT1_F_RSS) || s->rxq_num < 2) {
+        return;
+    }
+
+    conf_pa = VMXNET3_READ_DRV_SHARED64(s->drv_shmem,
+                                        devRead.rssConfDesc.confPA);
+    conf_len = VMXNET3_READ_DRV_SHARED32(s->drv_shmem,
+                                         devRead.rssConfDesc.confLen);
+    if (!conf_pa || conf_len < sizeof(*rss)) {
+        VMW_WRPRN("RSS enabled without a configuration");
+        return;
+    }
+
+    cpu_physical_memory_read(conf_pa, rss, sizeof(*rss));
+    rss->hashType = le16_to_cpu(rss->hashType);
+    rss->hashFunc = le16_to_cpu(rss->hashFunc);
+    rss->hashKeySize = le16_to_cpu(rss->hashKeySize);
+    rss->indTableSize = le16_to_cpu(rss->indTableSize);
+
+    VMW_CFPRN("RSS: hash type 0x%x, function %d, key size %d, table size %d",
+              rss->hashType, rss->hashFunc, rss->hashKeySize,
+              rss->indTableSize);
+    if (rss->hashFunc != UPT1_RSS_HASH_FUNC_TOEPLITZ ||
+        rss->hashKeySize > UPT1_RSS_MAX_KEY_SIZE ||
+        !rss->indTableSize ||
+        rss->indTableSize > UPT1_RSS_MAX_IND_TABLE_SIZE) {
+        VMW_WRPRN("Unsupported RSS configuration");
+        return;
+    }
+    /* Key bytes past hashKeySize take no part in the hash */
+    memset(rss->hashKey + rss->hashKeySize, 0,
+           UPT1_RSS_MAX_KEY_SIZE - rss->hashKeySize);
+    s->rss_enabled = true;
+}
+
 static void vmxnet3_update_features(VMXNET3State *s)
 {
     uint32_t guest_features;
@@ -1391,13 +1452,18 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
-        qemu_set_offload(qemu_get_queue(s->nic)->peer,
-                         rxcso_supported,
-                         s->lro_supported,
-                         s->lro_supported,
-                         0,
-                         0);
+        int i;
+
+        for (i = 0; i < MAX(s->conf.peers.queues, 1); i++) {
+            qemu_set_offload(qemu_get_subqueue(s->nic, i)->peer,
+                             rxcso_supported,
+                             s->lro_supported,
+                             s->lro_supported,
+                             0,
+                             0);
+        }
     }
+    vmxnet3_update_rss(s);
 }
 
 static bool vmxnet3_verify_intx(VMXNET3State *s, int intx)
@@ -1657,6 +1723,11 @@ static void vmxnet3_handle_command(VMXNET3State *s, uint64_t cmd)
         vmxnet3_update_pm_state(s);
         break;
 
+    case VMXNET3_CMD_UPDATE_RSSIDT:
+        VMW_CBPRN("Set: Update RSS indirection table");
+        vmxnet3_update_rss(s);
+        break;
+
     case VMXNET3_CMD_GET_LINK:
         VMW_CBPRN("Set: Get link");
         break;
@@ -2000,12 +2071,113 @@ vmxnet3_rx_filter_may_indicate(VMXNET3State *s, const void *data,
     return true;
 }
 
+static uint32_t
+vmxnet3_toeplitz_hash(const uint8_t *key, const uint8_t *input, int len)
+{
+    uint32_t hash = 0;
+    uint32_t v = ldl_be_p(key);
+    int i, b;
+
+    for (i = 0; i < len; i++) {
+        for (b = 0; b < 8; b++) {
+            if (input[i] & (0x80 >> b)) {
+                hash ^= v;
+            }
+            v = (v << 1) | ((key[i + 4] >> (7 - b)) & 1);
+        }
+    }
+    return hash;
+}
+
+/*
+ * Pick the RX queue for the frame in @buf from the guest's RSS hash type,
+ * key and indirection table, and return the hash and its type for the
+ * completion descriptor.
+ */
+static int
+vmxnet3_rss_get_queue(VMXNET3State *s, const uint8_t *buf, size_t size,
+                      uint8_t *rss_type, uint32_t *rss_hash)
+{
+    const struct UPT1_RSSConf *rss = &s->rss_conf;
+    size_t l2hdr_len = eth_get_l2_hdr_length(buf);
+    const uint8_t *l3 = buf + l2hdr_len;
+    uint8_t input[36];
+    int len = 0;
+
+    *rss_type = VMXNET3_RCD_RSS_TYPE_NONE;
+    *rss_hash = 0;
+    if (!s->rss_enabled) {
+        return 0;
+    }
+
+    switch (eth_get_l3_proto(buf, l2hdr_len)) {
+    case ETH_P_IP:
+    {
+        size_t ihl;
+        bool frag;
+
+        if (size < l2hdr_len + sizeof(struct ip_header) ||
+            (l3[0] >> 4) != IP_HEADER_VERSION_4) {
+            break;
+        }
+        ihl = (l3[0] & 0xf) * 4;
+        frag = lduw_be_p(l3 + 6) & 0x3fff;    /* MF or fragment offset */
+        if ((rss->hashType & UPT1_RSS_HASH_TYPE_TCP_IPV4) &&
+            l3[9] == IP_PROTO_TCP && !frag && ihl >= sizeof(struct ip_header) &&
+            size >= l2hdr_len + ihl + 4) {
+            memcpy(input, l3 + 12, 8);
+            memcpy(input + 8, l3 + ihl, 4);
+            len = 12;
+            *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV4;
+        } else if (rss->hashType & UPT1_RSS_HASH_TYPE_IPV4) {
+            memcpy(input, l3 + 12, 8);
+            len = 8;
+            *rss_type = VMXNET3_RCD_RSS_TYPE_IPV4;
+        }
+        break;
+    }
+    case ETH_P_IPV6:
+    {
+        struct iovec vec = { .iov_base = (void *)buf, .iov_len = size };
+        size_t full_hdr_len;
+        uint8_t l4proto;
+
+        if (size < l2hdr_len + sizeof(struct ip6_header)) {
+            break;
+        }
+        if ((rss->hashType & UPT1_RSS_HASH_TYPE_TCP_IPV6) &&
+            eth_parse_ipv6_hdr(&vec, 1, l2hdr_len, &l4proto, &full_hdr_len) &&
+            l4proto == IP_PROTO_TCP &&
+            size >= l2hdr_len + full_hdr_len + 4) {
+            memcpy(input, l3 + 8, 32);
+            memcpy(input + 32, l3 + full_hdr_len, 4);
+            len = 36;
+            *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV6;
+        } else if (rss->hashType & UPT1_RSS_HASH_TYPE_IPV6) {
+            memcpy(input, l3 + 8, 32);
+            len = 32;
+            *rss_type = VMXNET3_RCD_RSS_TYPE_IPV6;
+        }
+        break;
+    }
+    }
+
+    if (!len) {
+        return 0;
+    }
+    *rss_hash = vmxnet3_toeplitz_hash(rss->hashKey, input, len);
+    return rss->indTable[*rss_hash % rss->indTableSize] % s->rxq_num;
+}
+
 static ssize_t
 vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VMXNET3State *s = qemu_get_nic_opaque(nc);
     size_t bytes_indicated;
     uint8_t min_buf[MIN_BUF_SIZE];
+    uint8_t rss_type;
+    uint32_t rss_hash;
+    int qidx;
 
     if (!vmxnet3_can_receive(nc)) {
         VMW_PKPRN("Cannot receive now");
@@ -2030,10 +2202,12 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         get_eth_packet_type(PKT_GET_ETH_HDR(buf)));
 
     if (vmxnet3_rx_filter_may_indicate(s, buf, size)) {
+        qidx = vmxnet3_rss_get_queue(s, buf, size, &rss_type, &rss_hash);
         vmxnet_rx_pkt_set_protocols(s->rx_pkt, buf, size);
         vmxnet3_rx_need_csum_calculate(s->rx_pkt, buf, size);
         vmxnet_rx_pkt_attach_data(s->rx_pkt, buf, size, s->rx_vlan_stripping);
-        bytes_indicated = vmxnet3_indicate_packet(s) ? size : -1;
+        bytes_indicated = vmxnet3_indicate_packet(s, qidx, rss_type, rss_hash) ?
+                          size : -1;
         if (bytes_indicated < size) {
             VMW_PKPRN("RX: %zu of %zu bytes indicated", bytes_indicated, size);
         }
@@ -2117,10 +2291,14 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->lro_supported = false;
 
     if (s->peer_has_vhdr) {
-        qemu_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
-            sizeof(struct virtio_net_hdr));
+        int i;
+
+        for (i = 0; i < MAX(s->conf.peers.queues, 1); i++) {
+            NetClientState *peer = qemu_get_subqueue(s->nic, i)->peer;
 
-        qemu_using_vnet_hdr(qemu_get_queue(s->nic)->peer, 1);
+            qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+            qemu_using_vnet_hdr(peer, 1);
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
@@ -2552,6 +2730,9 @@ static int vmxnet3_post_load(void *opaque, int version_id)
 
     vmxnet3_validate_queues(s);
     vmxnet3_validate_interrupts(s);
+    if (s->device_active) {
+        vmxnet3_update_rss(s);
+    }
 
     return 0;
 }
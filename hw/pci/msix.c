@@ -20,6 +20,8 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
 #include "hw/xen/xen.h"
+#include "sysemu/kvm.h"
+#include "qemu/event_notifier.h"
 #include "qemu/range.h"
 
 #define MSIX_CAP_LENGTH 12
@@ -238,6 +240,125 @@ static void msix_mask_all(struct PCIDevice *dev, unsigned nentries)
     }
 }
 
+/* With an in-kernel irqchip, msix_notify() gives each vector that fires
+ * its own KVM MSI route with an irqfd attached, so that later notifications
+ * are a plain eventfd write rather than a KVM_SIGNAL_MSI ioctl or a write
+ * to the interrupt controller's MSI region.  The route follows changes to
+ * the vector's message and is dropped when the vector is no longer used.
+ */
+typedef struct MSIXVectorRoute {
+    EventNotifier notifier;
+    MSIMessage msg;
+    int virq;
+    bool failed;
+} MSIXVectorRoute;
+
+static void msix_init_routes(PCIDevice *dev, unsigned short nentries)
+{
+    int vector;
+
+    if (!kvm_msi_via_irqfd_enabled()) {
+        return;
+    }
+    dev->msix_routes = g_new0(MSIXVectorRoute, nentries);
+    for (vector = 0; vector < nentries; vector++) {
+        dev->msix_routes[vector].virq = -1;
+    }
+}
+
+static void msix_release_route(PCIDevice *dev, unsigned vector)
+{
+    MSIXVectorRoute *route;
+
+    if (!dev->msix_routes) {
+        return;
+    }
+    route = &dev->msix_routes[vector];
+    route->failed = false;
+    if (route->virq < 0) {
+        return;
+    }
+    kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &route->notifier,
+                                          route->virq);
+    kvm_irqchip_release_virq(kvm_state, route->virq);
+    event_notifier_cleanup(&route->notifier);
+    route->virq = -1;
+}
+
+static void msix_release_all_routes(PCIDevice *dev)
+{
+    int vector;
+
+    for (vector = 0; vector < dev->msix_entries_nr; vector++) {
+        msix_release_route(dev, vector);
+    }
+}
+
+static int msix_setup_route(PCIDevice *dev, MSIXVectorRoute *route,
+                            MSIMessage msg)
+{
+    int virq;
+
+    if (event_notifier_init(&route->notifier, 0) < 0) {
+        return -1;
+    }
+    virq = kvm_irqchip_add_msi_route(kvm_state, msg, dev);
+    if (virq < 0) {
+        goto fail;
+    }
+    if (kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &route->notifier,
+                                           NULL, virq) < 0) {
+        kvm_irqchip_release_virq(kvm_state, virq);
+        goto fail;
+    }
+    route->virq = virq;
+    route->msg = msg;
+    return 0;
+
+fail:
+    event_notifier_cleanup(&route->notifier);
+    return -1;
+}
+
+/* Deliver @msg through the vector's irqfd; return false if the caller must
+ * send the message itself.
+ */
+static bool msix_notify_irqfd(PCIDevice *dev, unsigned vector, MSIMessage msg)
+{
+    MSIXVectorRoute *route;
+
+    /* Devices with vector notifiers (vhost) manage their own irqfds, and
+     * the MSI write of a device that is not a bus master goes nowhere.
+     */
+    if (!dev->msix_routes || dev->msix_vector_use_notifier ||
+        !(pci_get_word(dev->config + PCI_COMMAND) & PCI_COMMAND_MASTER)) {
+        return false;
+    }
+
+    route = &dev->msix_routes[vector];
+    if (route->virq < 0) {
+        if (route->failed) {
+            return false;
+        }
+        if (msix_setup_route(dev, route, msg) < 0) {
+            /* Most likely out of GSIs, do not retry on every interrupt */
+            route->failed = true;
+            return false;
+        }
+    } else if (route->msg.address != msg.address ||
+               route->msg.data != msg.data) {
+        if (kvm_irqchip_update_msi_route(kvm_state, route->virq,
+                                         msg, dev) < 0) {
+            msix_release_route(dev, vector);
+            return false;
+        }
+        route->msg = msg;
+    }
+
+    event_notifier_set(&route->notifier);
+    return true;
+}
+
 /* Initialize the MSI-X structures */
 int msix_init(struct PCIDevice *dev, unsigned short nentries,
               MemoryRegion *table_bar, uint8_t table_bar_nr,
@@ -292,6 +413,7 @@ int msix_init(struct PCIDevice *dev, unsigned short nentries,
     dev->msix_table = g_malloc0(table_size);
     dev->msix_pba = g_malloc0(pba_size);
     dev->msix_entry_used = g_malloc0(nentries * sizeof *dev->msix_entry_used);
+    msix_init_routes(dev, nentries);
 
     msix_mask_all(dev, nentries);
 
@@ -356,6 +478,7 @@ static void msix_free_irq_entries(PCIDevice *dev)
     for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
         dev->msix_entry_used[vector] = 0;
         msix_clr_pending(dev, vector);
+        msix_release_route(dev, vector);
     }
 }
 
@@ -386,6 +509,8 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     dev->msix_table = NULL;
     g_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
+    g_free(dev->msix_routes);
+    dev->msix_routes = NULL;
     dev->cap_present &= ~QEMU_PCI_CAP_MSIX;
 }
 
@@ -456,7 +581,9 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
-    msi_send_message(dev, msg);
+    if (!msix_notify_irqfd(dev, vector, msg)) {
+        msi_send_message(dev, msg);
+    }
 }
 
 void msix_reset(PCIDevice *dev)
@@ -465,6 +592,7 @@ void msix_reset(PCIDevice *dev)
         return;
     }
     msix_clear_all_vectors(dev);
+    msix_release_all_routes(dev);
     dev->config[dev->msix_cap + MSIX_CONTROL_OFFSET] &=
 	    ~dev->wmask[dev->msix_cap + MSIX_CONTROL_OFFSET];
     memset(dev->msix_table, 0, dev->msix_entries_nr * PCI_MSIX_ENTRY_SIZE);
@@ -499,6 +627,7 @@ void msix_vector_unuse(PCIDevice *dev, unsigned vector)
         return;
     }
     msix_clr_pending(dev, vector);
+    msix_release_route(dev, vector);
 }
 
 void msix_unuse_all_vectors(PCIDevice *dev)
@@ -542,6 +671,7 @@ int msix_set_vector_notifiers(PCIDevice *dev,
 
     assert(use_notifier && release_notifier);
 
+    msix_release_all_routes(dev);
     dev->msix_vector_use_notifier = use_notifier;
     dev->msix_vector_release_notifier = release_notifier;
     dev->msix_vector_poll_notifier = poll_notifier;
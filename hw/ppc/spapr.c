@@ -1803,6 +1803,7 @@ static void ppc_spapr_init(MachineState *machine)
         /* Enable H_LOGICAL_CI_* so SLOF can talk to in-kernel devices */
         kvmppc_enable_logical_ci_hcalls();
         kvmppc_enable_set_mode_hcall();
+        kvmppc_enable_multitce_hcalls();
     }
 
     /* allocate RAM */
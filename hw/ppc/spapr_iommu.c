@@ -261,10 +261,83 @@ static void spapr_tce_reset(DeviceState *dev)
     memset(tcet->table, 0, table_size);
 }
 
+/*
+ * TCE updates of one hypercall are collected into runs of pages with the
+ * same permissions that are adjacent in both the bus and the guest physical
+ * address space.  Each run is passed to the IOMMU notifiers in as few
+ * naturally aligned blocks as possible, so that e.g. VFIO maps or unmaps
+ * a run with a handful of ioctls rather than one per page.
+ */
+typedef struct sPAPRTCENotify {
+    hwaddr iova;
+    hwaddr translated_addr;
+    hwaddr len;
+    IOMMUAccessFlags perm;
+} sPAPRTCENotify;
+
+static void spapr_tce_notify_flush(sPAPRTCETable *tcet, sPAPRTCENotify *n)
+{
+    hwaddr page_size = IOMMU_PAGE_SIZE(tcet->page_shift);
+
+    while (n->len) {
+        IOMMUTLBEntry entry;
+        hwaddr size = pow2floor(n->len);
+        hwaddr align = n->iova;
+
+        if (n->perm != IOMMU_NONE) {
+            hwaddr xlat, len = n->len;
+
+            /* A block must not cross into another memory region */
+            rcu_read_lock();
+            address_space_translate(&address_space_memory, n->translated_addr,
+                                    &xlat, &len, false);
+            rcu_read_unlock();
+            size = MIN(size, pow2floor(MAX(len, page_size)));
+            align |= n->translated_addr;
+        }
+        if (align) {
+            size = MIN(size, align & -align);
+        }
+
+        entry.target_as = &address_space_memory;
+        entry.iova = n->iova;
+        entry.translated_addr = n->translated_addr;
+        entry.addr_mask = size - 1;
+        entry.perm = n->perm;
+        memory_region_notify_iommu(&tcet->iommu, entry);
+
+        n->iova += size;
+        n->translated_addr += size;
+        n->len -= size;
+    }
+}
+
+static void spapr_tce_notify_add(sPAPRTCETable *tcet, sPAPRTCENotify *n,
+                                 hwaddr iova, uint64_t tce)
+{
+    hwaddr page_mask = IOMMU_PAGE_MASK(tcet->page_shift);
+    hwaddr page_size = IOMMU_PAGE_SIZE(tcet->page_shift);
+    hwaddr translated_addr = tce & page_mask;
+    IOMMUAccessFlags perm = spapr_tce_iommu_access_flags(tce);
+
+    /* the target of unmapped pages does not matter */
+    if (n->len && n->iova + n->len == iova && n->perm == perm &&
+        (perm == IOMMU_NONE ||
+         n->translated_addr + n->len == translated_addr)) {
+        n->len += page_size;
+        return;
+    }
+
+    spapr_tce_notify_flush(tcet, n);
+    n->iova = iova;
+    n->translated_addr = translated_addr;
+    n->len = page_size;
+    n->perm = perm;
+}
+
 static target_ulong put_tce_emu(sPAPRTCETable *tcet, target_ulong ioba,
-                                target_ulong tce)
+                                target_ulong tce, sPAPRTCENotify *n)
 {
-    IOMMUTLBEntry entry;
     hwaddr page_mask = IOMMU_PAGE_MASK(tcet->page_shift);
     unsigned long index = (ioba - tcet->bus_offset) >> tcet->page_shift;
 
@@ -275,13 +348,7 @@ static target_ulong put_tce_emu(sPAPRTCETable *tcet, target_ulong ioba,
     }
 
     tcet->table[index] = tce;
-
-    entry.target_as = &address_space_memory,
-    entry.iova = ioba & page_mask;
-    entry.translated_addr = tce & page_mask;
-    entry.addr_mask = ~page_mask;
-    entry.perm = spapr_tce_iommu_access_flags(tce);
-    memory_region_notify_iommu(&tcet->iommu, entry);
+    spapr_tce_notify_add(tcet, n, ioba & page_mask, tce);
 
     return H_SUCCESS;
 }
@@ -300,6 +367,8 @@ static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
     sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
     CPUState *cs = CPU(cpu);
     hwaddr page_mask, page_size;
+    sPAPRTCENotify n = { .len = 0 };
+    uint64_t tces[512];
 
     if (!tcet) {
         return H_PARAMETER;
@@ -313,14 +382,19 @@ static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
     page_size = IOMMU_PAGE_SIZE(tcet->page_shift);
     ioba &= page_mask;
 
+    /* The list is within one 4K page, fetch it at once */
+    address_space_read(cs->as, tce_list, MEMTXATTRS_UNSPECIFIED,
+                       (uint8_t *)tces, npages * sizeof(tces[0]));
+
     for (i = 0; i < npages; ++i, ioba += page_size) {
-        tce = ldq_be_phys(cs->as, tce_list + i * sizeof(target_ulong));
+        tce = be64_to_cpu(tces[i]);
 
-        ret = put_tce_emu(tcet, ioba, tce);
+        ret = put_tce_emu(tcet, ioba, tce, &n);
         if (ret) {
             break;
         }
     }
+    spapr_tce_notify_flush(tcet, &n);
 
     /* Trace last successful or the first problematic entry */
     i = i ? (i - 1) : 0;
@@ -343,6 +417,7 @@ static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPRMachineState *spapr,
     target_ulong ret = H_PARAMETER;
     sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
     hwaddr page_mask, page_size;
+    sPAPRTCENotify n = { .len = 0 };
 
     if (!tcet) {
         return H_PARAMETER;
@@ -357,11 +432,12 @@ static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPRMachineState *spapr,
     ioba &= page_mask;
 
     for (i = 0; i < npages; ++i, ioba += page_size) {
-        ret = put_tce_emu(tcet, ioba, tce_value);
+        ret = put_tce_emu(tcet, ioba, tce_value, &n);
         if (ret) {
             break;
         }
     }
+    spapr_tce_notify_flush(tcet, &n);
     if (SPAPR_IS_PCI_LIOBN(liobn)) {
         trace_spapr_iommu_pci_stuff(liobn, ioba, tce_value, npages, ret);
     } else {
@@ -382,10 +458,12 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPRMachineState *spapr,
 
     if (tcet) {
         hwaddr page_mask = IOMMU_PAGE_MASK(tcet->page_shift);
+        sPAPRTCENotify n = { .len = 0 };
 
         ioba &= page_mask;
 
-        ret = put_tce_emu(tcet, ioba, tce);
+        ret = put_tce_emu(tcet, ioba, tce, &n);
+        spapr_tce_notify_flush(tcet, &n);
     }
     if (SPAPR_IS_PCI_LIOBN(liobn)) {
         trace_spapr_iommu_pci_put(liobn, ioba, tce, ret);
@@ -1583,51 +1583,43 @@ static inline bool check_lba_range(SCSIDiskState *s,
             sector_num + nb_sectors <= s->qdev.max_lba + 1);
 }
 
+typedef struct UnmapRange {
+    uint64_t lba;
+    uint64_t nb_blocks;
+} UnmapRange;
+
+/* All descriptors of an UNMAP are discarded at the same time; r->req.aiocb
+ * stays NULL, so that a cancellation completes at once and the discards
+ * that are still running only drop their reference when they finish.
+ */
 typedef struct UnmapCBData {
     SCSIDiskReq *r;
-    uint8_t *inbuf;
-    int count;
+    int in_flight;
+    int ret;
 } UnmapCBData;
 
-static void scsi_unmap_complete(void *opaque, int ret);
-
-static void scsi_unmap_complete_noio(UnmapCBData *data, int ret)
+static void scsi_unmap_complete(void *opaque, int ret)
 {
+    UnmapCBData *data = opaque;
     SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-    uint64_t sector_num;
-    uint32_t nb_sectors;
 
-    assert(r->req.aiocb == NULL);
+    if (ret < 0 && data->ret == 0) {
+        data->ret = ret;
+    }
+    if (--data->in_flight > 0) {
+        return;
+    }
 
     if (r->req.io_canceled) {
-        scsi_req_cancel_complete(&r->req);
         goto done;
     }
 
-    if (ret < 0) {
-        if (scsi_handle_rw_error(r, -ret, false)) {
+    if (data->ret < 0) {
+        if (scsi_handle_rw_error(r, -data->ret, false)) {
             goto done;
         }
     }
 
-    if (data->count > 0) {
-        sector_num = ldq_be_p(&data->inbuf[0]);
-        nb_sectors = ldl_be_p(&data->inbuf[8]) & 0xffffffffULL;
-        if (!check_lba_range(s, sector_num, nb_sectors)) {
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
-        }
-
-        r->req.aiocb = blk_aio_discard(s->qdev.conf.blk,
-                                       sector_num * (s->qdev.blocksize / 512),
-                                       nb_sectors * (s->qdev.blocksize / 512),
-                                       scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
-        return;
-    }
-
     scsi_req_complete(&r->req, GOOD);
 
 done:
@@ -1635,15 +1627,11 @@ done:
     g_free(data);
 }
 
-static void scsi_unmap_complete(void *opaque, int ret)
+static int unmap_range_cmp(const void *a, const void *b)
 {
-    UnmapCBData *data = opaque;
-    SCSIDiskReq *r = data->r;
-
-    assert(r->req.aiocb != NULL);
-    r->req.aiocb = NULL;
+    const UnmapRange *ra = a, *rb = b;
 
-    scsi_unmap_complete_noio(data, ret);
+    return ra->lba < rb->lba ? -1 : ra->lba > rb->lba;
 }
 
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
@@ -1651,7 +1639,11 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
+    int sectors_per_block = s->qdev.blocksize / 512;
+    uint64_t max_blocks;
     UnmapCBData *data;
+    UnmapRange *ranges;
+    int count, n, i;
 
     /* Reject ANCHOR=1.  */
     if (r->req.cmd.buf[1] & 0x1) {
@@ -1676,14 +1668,68 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
+    /* Check every descriptor before discarding anything */
+    count = lduw_be_p(&p[2]) >> 4;
+    ranges = g_new(UnmapRange, count);
+    for (i = n = 0; i < count; i++) {
+        uint8_t *desc = &p[8 + i * 16];
+        uint64_t lba = ldq_be_p(&desc[0]);
+        uint32_t nb_blocks = ldl_be_p(&desc[8]);
+
+        if (!check_lba_range(s, lba, nb_blocks)) {
+            g_free(ranges);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        if (nb_blocks) {
+            ranges[n].lba = lba;
+            ranges[n].nb_blocks = nb_blocks;
+            n++;
+        }
+    }
+
+    /* Merge overlapping and adjacent descriptors */
+    qsort(ranges, n, sizeof(*ranges), unmap_range_cmp);
+    for (i = 1, count = MIN(n, 1); i < n; i++) {
+        UnmapRange *last = &ranges[count - 1];
+
+        if (ranges[i].lba <= last->lba + last->nb_blocks) {
+            last->nb_blocks = MAX(last->nb_blocks,
+                                  ranges[i].lba + ranges[i].nb_blocks -
+                                  last->lba);
+        } else {
+            ranges[count++] = ranges[i];
+        }
+    }
+
+    /* Merged ranges are split again at the advertised limit */
+    max_blocks = MIN(s->max_unmap_size / s->qdev.blocksize,
+                     BDRV_REQUEST_MAX_SECTORS / sectors_per_block);
+    max_blocks = MAX(max_blocks, 1);
+
     data = g_new0(UnmapCBData, 1);
     data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    data->in_flight = 1;
 
     /* The matching unref is in scsi_unmap_complete, before data is freed.  */
     scsi_req_ref(&r->req);
-    scsi_unmap_complete_noio(data, 0);
+    for (i = 0; i < count; i++) {
+        uint64_t lba = ranges[i].lba;
+        uint64_t nb_blocks = ranges[i].nb_blocks;
+
+        while (nb_blocks) {
+            uint64_t chunk = MIN(nb_blocks, max_blocks);
+
+            data->in_flight++;
+            blk_aio_discard(s->qdev.conf.blk, lba * sectors_per_block,
+                            chunk * sectors_per_block,
+                            scsi_unmap_complete, data);
+            lba += chunk;
+            nb_blocks -= chunk;
+        }
+    }
+    g_free(ranges);
+    scsi_unmap_complete(data, 0);
     return;
 
 invalid_param_len:
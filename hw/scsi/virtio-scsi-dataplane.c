@@ -19,17 +19,195 @@
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
 #include "hw/virtio/virtio-access.h"
+#include "qapi/error.h"
 #include "stdio.h"
 
+static bool virtio_scsi_mailbox_run(VirtIOSCSIMailbox *mbox)
+{
+    VirtIOSCSI *s = mbox->s;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) submit = QTAILQ_HEAD_INITIALIZER(submit);
+    QTAILQ_HEAD(, VirtIOSCSIReq) complete = QTAILQ_HEAD_INITIALIZER(complete);
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+
+    qemu_mutex_lock(&mbox->lock);
+    while ((req = QTAILQ_FIRST(&mbox->submit))) {
+        QTAILQ_REMOVE(&mbox->submit, req, next);
+        QTAILQ_INSERT_TAIL(&submit, req, next);
+    }
+    while ((req = QTAILQ_FIRST(&mbox->complete))) {
+        QTAILQ_REMOVE(&mbox->complete, req, next);
+        QTAILQ_INSERT_TAIL(&complete, req, next);
+    }
+    qemu_mutex_unlock(&mbox->lock);
+
+    if (QTAILQ_EMPTY(&submit) && QTAILQ_EMPTY(&complete)) {
+        return false;
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &complete, next, next) {
+        QTAILQ_REMOVE(&complete, req, next);
+        virtio_scsi_push_req(req);
+    }
+
+    /* Same two-stage submission as virtio_scsi_handle_cmd, so that the
+     * requests for a LUN are batched between blk_io_plug and unplug.
+     */
+    QTAILQ_FOREACH_SAFE(req, &submit, next, next) {
+        QTAILQ_REMOVE(&submit, req, next);
+        if (virtio_scsi_handle_cmd_req_lun(s, req)) {
+            QTAILQ_INSERT_TAIL(&reqs, req, next);
+        }
+    }
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
+    return true;
+}
+
+static void virtio_scsi_mailbox_bh(void *opaque)
+{
+    virtio_scsi_mailbox_run(opaque);
+}
+
+static void virtio_scsi_mailbox_post(VirtIOSCSIMailbox *mbox,
+                                     VirtIOSCSIReq *req, bool complete)
+{
+    qemu_mutex_lock(&mbox->lock);
+    if (complete) {
+        QTAILQ_INSERT_TAIL(&mbox->complete, req, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&mbox->submit, req, next);
+    }
+    qemu_mutex_unlock(&mbox->lock);
+    qemu_bh_schedule(mbox->bh);
+}
+
+static VirtIOSCSIMailbox *virtio_scsi_vq_mailbox(VirtIOSCSI *s, VirtQueue *vq)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    int n = virtio_get_queue_index(vq);
+
+    if (n < 2) {
+        return &s->mailboxes[0];
+    }
+    assert(n - 2 < vs->conf.num_queues);
+    return s->cmd_vq_mailbox[n - 2];
+}
+
+static VirtIOSCSIMailbox *virtio_scsi_ctx_mailbox(VirtIOSCSI *s,
+                                                  AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < s->nr_mailboxes; i++) {
+        if (s->mailboxes[i].ctx == ctx) {
+            return &s->mailboxes[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the mailbox through which a request from @vq for @d must be
+ * completed, or NULL if both run in the same AioContext.
+ */
+VirtIOSCSIMailbox *virtio_scsi_dataplane_reply_to(VirtIOSCSI *s,
+                                                  VirtQueue *vq,
+                                                  SCSIDevice *d)
+{
+    VirtIOSCSIMailbox *mbox, *lun_mbox;
+
+    if (s->nr_mailboxes < 2) {
+        return NULL;
+    }
+    mbox = virtio_scsi_vq_mailbox(s, vq);
+    lun_mbox = virtio_scsi_ctx_mailbox(s, blk_get_aio_context(d->conf.blk));
+    return lun_mbox && lun_mbox != mbox ? mbox : NULL;
+}
+
+/* Context: the AioContext of req->vq */
+void virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   SCSIDevice *d)
+{
+    VirtIOSCSIMailbox *lun_mbox;
+
+    lun_mbox = virtio_scsi_ctx_mailbox(s, blk_get_aio_context(d->conf.blk));
+    req->reply_to = virtio_scsi_vq_mailbox(s, req->vq);
+    virtio_scsi_mailbox_post(lun_mbox, req, false);
+}
+
+void virtio_scsi_dataplane_reply(VirtIOSCSIReq *req)
+{
+    virtio_scsi_mailbox_post(req->reply_to, req, true);
+}
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+AioContext *virtio_scsi_dataplane_next_lun_ctx(VirtIOSCSI *s)
+{
+    return s->mailboxes[s->next_lun_mailbox++ % s->nr_mailboxes].ctx;
+}
+
+static void virtio_scsi_mailbox_init(VirtIOSCSI *s, VirtIOSCSIMailbox *mbox,
+                                     IOThread *iothread)
+{
+    mbox->s = s;
+    mbox->ctx = iothread_get_aio_context(iothread);
+    mbox->bh = aio_bh_new(mbox->ctx, virtio_scsi_mailbox_bh, mbox);
+    qemu_mutex_init(&mbox->lock);
+    QTAILQ_INIT(&mbox->submit);
+    QTAILQ_INIT(&mbox->complete);
+}
+
+/* Context: QEMU global mutex held
+ *
+ * conf.iothreads is a colon-separated list of further IOThreads.  Command
+ * queue i is then handled by IOThread i modulo their count, starting with
+ * conf.iothread.
+ */
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    char **ids = NULL;
+    int i, n = 0;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
+
+    if (vs->conf.iothreads) {
+        ids = g_strsplit(vs->conf.iothreads, ":", -1);
+        n = g_strv_length(ids);
+    }
+    s->iothreads = g_new0(IOThread *, n + 1);
+    s->iothreads[0] = iothread;
+    for (i = 0; i < n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        s->iothreads[i + 1] = (IOThread *)object_dynamic_cast(obj,
+                                                              TYPE_IOTHREAD);
+        if (!s->iothreads[i + 1]) {
+            error_setg(errp, "'%s' is not an IOThread", ids[i]);
+            g_strfreev(ids);
+            g_free(s->iothreads);
+            s->iothreads = NULL;
+            return;
+        }
+    }
+    g_strfreev(ids);
+
+    s->nr_mailboxes = n + 1;
+    s->mailboxes = g_new0(VirtIOSCSIMailbox, s->nr_mailboxes);
+    for (i = 0; i < s->nr_mailboxes; i++) {
+        object_ref(OBJECT(s->iothreads[i]));
+        virtio_scsi_mailbox_init(s, &s->mailboxes[i], s->iothreads[i]);
+    }
+    s->cmd_vq_mailbox = g_new(VirtIOSCSIMailbox *, vs->conf.num_queues);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        s->cmd_vq_mailbox[i] = &s->mailboxes[i % s->nr_mailboxes];
+    }
+    s->ctx = s->mailboxes[0].ctx;
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
@@ -39,7 +217,44 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
     }
 }
 
-static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_mailboxes; i++) {
+        qemu_bh_delete(s->mailboxes[i].bh);
+        qemu_mutex_destroy(&s->mailboxes[i].lock);
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->cmd_vq_mailbox);
+    g_free(s->mailboxes);
+    g_free(s->iothreads);
+    s->nr_mailboxes = 0;
+    s->ctx = NULL;
+}
+
+/* Lower indexes first, as the control queue takes LUN contexts */
+static void virtio_scsi_acquire_all(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_mailboxes; i++) {
+        aio_context_acquire(s->mailboxes[i].ctx);
+    }
+}
+
+static void virtio_scsi_release_all(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = s->nr_mailboxes - 1; i >= 0; i--) {
+        aio_context_release(s->mailboxes[i].ctx);
+    }
+}
+
+static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
+                                  AioContext *ctx)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
@@ -54,7 +269,7 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n)
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, true, true);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, true, true);
     return 0;
 }
 
@@ -65,7 +280,7 @@ void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req)
     }
 }
 
-/* assumes s->ctx held */
+/* assumes all mailbox contexts held */
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
@@ -74,7 +289,9 @@ static void virtio_scsi_clear_aio(VirtIOSCSI *s)
     virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, false, false);
     virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, false, false);
     for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, false, false);
+        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i],
+                                                   s->cmd_vq_mailbox[i]->ctx,
+                                                   false, false);
     }
 }
 
@@ -104,17 +321,21 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
-    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0);
+    /* Hold every context until dataplane_started is set, so that no queue
+     * handler runs before the others are attached.
+     */
+    virtio_scsi_acquire_all(s);
+    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0, s->ctx);
     if (rc) {
         goto fail_vrings;
     }
-    rc = virtio_scsi_vring_init(s, vs->event_vq, 1);
+    rc = virtio_scsi_vring_init(s, vs->event_vq, 1, s->ctx);
     if (rc) {
         goto fail_vrings;
     }
     for (i = 0; i < vs->conf.num_queues; i++) {
-        rc = virtio_scsi_vring_init(s, vs->cmd_vqs[i], i + 2);
+        rc = virtio_scsi_vring_init(s, vs->cmd_vqs[i], i + 2,
+                                    s->cmd_vq_mailbox[i]->ctx);
         if (rc) {
             goto fail_vrings;
         }
@@ -122,12 +343,12 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
     }
@@ -144,6 +365,7 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    bool progress;
     int i;
 
     if (!s->dataplane_started || s->dataplane_stopping) {
@@ -159,13 +381,22 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
+    virtio_scsi_acquire_all(s);
 
     virtio_scsi_clear_aio(s);
 
-    blk_drain_all(); /* ensure there are no in-flight requests */
+    /* ensure there are no in-flight requests, including those still
+     * travelling between contexts
+     */
+    do {
+        blk_drain_all();
+        progress = false;
+        for (i = 0; i < s->nr_mailboxes; i++) {
+            progress |= virtio_scsi_mailbox_run(&s->mailboxes[i]);
+        }
+    } while (progress);
 
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
 
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
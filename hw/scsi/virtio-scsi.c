@@ -59,25 +59,38 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req)
     g_free(req);
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+/* Context: the AioContext of req->vq */
+void virtio_scsi_push_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
     virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
     if (s->dataplane_started) {
         virtio_scsi_dataplane_notify(vdev, req);
     } else {
         virtio_notify(vdev, vq);
     }
+    virtio_scsi_free_req(req);
+}
 
+static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+{
+    qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
+
+    /* The SCSIRequest belongs to the LUN's AioContext, drop it here */
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
+        req->sreq = NULL;
+    }
+
+    if (req->reply_to) {
+        virtio_scsi_dataplane_reply(req);
+    } else {
+        virtio_scsi_push_req(req);
     }
-    virtio_scsi_free_req(req);
 }
 
 static void virtio_scsi_bad_req(void)
@@ -212,6 +225,7 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     scsi_req_ref(sreq);
     req->sreq = sreq;
+    req->reply_to = virtio_scsi_dataplane_reply_to(s, req->vq, sreq->dev);
     if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
         assert(req->sreq->cmd.mode == req->mode);
     }
@@ -243,11 +257,17 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf.lun);
     SCSIRequest *r, *next;
     BusChild *kid;
+    AioContext *ctx = NULL;
     int target;
     int ret = 0;
 
+    /* The LUN may live in another IOThread; asynchronous cancellation then
+     * completes the TMF there, so route its reply back through a mailbox.
+     */
     if (s->dataplane_started && d) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        ctx = blk_get_aio_context(d->conf.blk);
+        aio_context_acquire(ctx);
+        req->reply_to = virtio_scsi_dataplane_reply_to(s, req->vq, d);
     }
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
@@ -348,9 +368,18 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         target = req->req.tmf.lun[1];
         s->resetting++;
         QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
-             d = SCSI_DEVICE(kid->child);
-             if (d->channel == 0 && d->id == target) {
-                qdev_reset_all(&d->qdev);
+             SCSIDevice *td = SCSI_DEVICE(kid->child);
+             if (td->channel == 0 && td->id == target) {
+                AioContext *td_ctx = NULL;
+
+                if (s->dataplane_started) {
+                    td_ctx = blk_get_aio_context(td->conf.blk);
+                    aio_context_acquire(td_ctx);
+                }
+                qdev_reset_all(&td->qdev);
+                if (td_ctx) {
+                    aio_context_release(td_ctx);
+                }
              }
         }
         s->resetting--;
@@ -362,15 +391,19 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         break;
     }
 
+out:
+    if (ctx) {
+        aio_context_release(ctx);
+    }
     return ret;
 
 incorrect_lun:
     req->resp.tmf.response = VIRTIO_SCSI_S_INCORRECT_LUN;
-    return ret;
+    goto out;
 
 fail:
     req->resp.tmf.response = VIRTIO_SCSI_S_BAD_TARGET;
-    return ret;
+    goto out;
 }
 
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
@@ -507,6 +540,26 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_cmd_req(req);
 }
 
+/* Context: the AioContext of d */
+static bool virtio_scsi_handle_cmd_req_new(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                           SCSIDevice *d)
+{
+    req->sreq = scsi_req_new(d, req->req.cmd.tag,
+                             virtio_scsi_get_lun(req->req.cmd.lun),
+                             req->req.cmd.cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE
+        && (req->sreq->cmd.mode != req->mode ||
+            req->sreq->cmd.xfer > req->qsgl.size)) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+        virtio_scsi_complete_cmd_req(req);
+        return false;
+    }
+    scsi_req_ref(req->sreq);
+    blk_io_plug(d->conf.blk);
+    return true;
+}
+
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     VirtIOSCSICommon *vs = &s->parent_obj;
@@ -530,23 +583,31 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+
+    /* SCSI devices are only ever used from the AioContext of their
+     * BlockBackend; requests for a LUN in another IOThread go there.
+     */
+    if (s->dataplane_started &&
+        virtio_scsi_dataplane_reply_to(s, req->vq, d)) {
+        virtio_scsi_dataplane_forward(s, req, d);
+        return false;
     }
-    req->sreq = scsi_req_new(d, req->req.cmd.tag,
-                             virtio_scsi_get_lun(req->req.cmd.lun),
-                             req->req.cmd.cdb, req);
+    return virtio_scsi_handle_cmd_req_new(s, req, d);
+}
 
-    if (req->sreq->cmd.mode != SCSI_XFER_NONE
-        && (req->sreq->cmd.mode != req->mode ||
-            req->sreq->cmd.xfer > req->qsgl.size)) {
-        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+/* Like virtio_scsi_handle_cmd_req_prepare, for a request that was
+ * forwarded to the AioContext of its LUN.
+ */
+bool virtio_scsi_handle_cmd_req_lun(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.cmd.lun);
+
+    if (!d) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_BAD_TARGET;
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    scsi_req_ref(req->sreq);
-    blk_io_plug(d->conf.blk);
-    return true;
+    return virtio_scsi_handle_cmd_req_new(s, req, d);
 }
 
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
@@ -778,10 +839,12 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
+        AioContext *ctx = virtio_scsi_dataplane_next_lun_ctx(s);
+
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
 
         insert_notifier = g_new0(VirtIOSCSIBlkChangeNotifier, 1);
         insert_notifier->n.notify = virtio_scsi_blk_insert_notifier;
@@ -892,7 +955,20 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
     }
 
     if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
+        Error *err = NULL;
+
+        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread, &err);
+        if (err) {
+            error_propagate(errp, err);
+            g_free(s->cmd_vqs);
+            virtio_cleanup(vdev);
+            return;
+        }
+    } else if (s->conf.iothreads) {
+        error_setg(errp, "iothreads requires the iothread property");
+        g_free(s->cmd_vqs);
+        virtio_cleanup(vdev);
+        return;
     }
 }
 
@@ -956,6 +1032,9 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
+    if (s->ctx) {
+        virtio_scsi_dataplane_cleanup(s);
+    }
     error_free(s->blocker);
 
     unregister_savevm(dev, "virtio-scsi", s);
@@ -972,6 +1051,7 @@ static Property virtio_scsi_properties[] = {
                                            VIRTIO_SCSI_F_HOTPLUG, true),
     DEFINE_PROP_BIT("param_change", VirtIOSCSI, host_features,
                                                 VIRTIO_SCSI_F_CHANGE, true),
+    DEFINE_PROP_STRING("iothreads", VirtIOSCSI, parent_obj.conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -138,6 +138,9 @@
 
 #define ERDP_EHB        (1<<3)
 
+#define IMOD_IMODI_MASK 0xffff
+#define IMOD_IMODI_NS   250     /* unit of the moderation interval */
+
 #define TRB_SIZE 16
 typedef struct XHCITRB {
     uint64_t parameter;
@@ -440,6 +443,10 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation */
+    int64_t imod_deadline;      /* QEMU_CLOCK_VIRTUAL, in ns */
+    bool imod_pending;
+
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -480,6 +487,7 @@ struct XHCIState {
     /* Runtime Registers */
     int64_t mfindex_start;
     QEMUTimer *mfwrap_timer;
+    QEMUTimer *imod_timer;
     XHCIInterrupter intr[MAXINTRS];
 
     XHCIRing cmd_ring;
@@ -783,9 +791,52 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
+/* Whether the event ring holds events that the driver has not been
+ * interrupted for: it handles all events up to the enqueue pointer
+ * before it clears EHB.
+ */
+static bool xhci_intr_events_unseen(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    dma_addr_t erdp = xhci_addr64(intr->erdp_low, intr->erdp_high);
+
+    if (intr->erdp_low & ERDP_EHB || !intr->er_size) {
+        return false;
+    }
+    if (erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE * intr->er_size)) {
+        return false;
+    }
+    return (erdp - intr->er_start) / TRB_SIZE != intr->er_ep_idx;
+}
+
 static void xhci_intr_raise(XHCIState *xhci, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
+    XHCIInterrupter *intr = &xhci->intr[v];
+    uint32_t imodi = intr->imod & IMOD_IMODI_MASK;
+
+    /* The driver is still handling the last interrupt, and looks at the
+     * ring again when it clears EHB.
+     */
+    if (intr->erdp_low & ERDP_EHB) {
+        return;
+    }
+
+    if (imodi) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+        if (now < intr->imod_deadline) {
+            if (!intr->imod_pending) {
+                intr->imod_pending = true;
+                trace_usb_xhci_irq_moderated(v);
+                timer_mod_anticipate(xhci->imod_timer, intr->imod_deadline);
+            }
+            return;
+        }
+        intr->imod_deadline = now + (int64_t)imodi * IMOD_IMODI_NS;
+    }
+    intr->imod_pending = false;
 
     xhci->intr[v].erdp_low |= ERDP_EHB;
     xhci->intr[v].iman |= IMAN_IP;
@@ -817,6 +868,27 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIState *xhci = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int v;
+
+    for (v = 0; v < xhci->numintrs; v++) {
+        XHCIInterrupter *intr = &xhci->intr[v];
+
+        if (!intr->imod_pending) {
+            continue;
+        }
+        if (now < intr->imod_deadline) {
+            timer_mod_anticipate(xhci->imod_timer, intr->imod_deadline);
+            continue;
+        }
+        intr->imod_pending = false;
+        xhci_intr_raise(xhci, v);
+    }
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -2940,7 +3012,10 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+        xhci->intr[i].imod_deadline = 0;
+        xhci->intr[i].imod_pending = false;
     }
+    timer_del(xhci->imod_timer);
 
     xhci->mfindex_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     xhci_mfwrap_update(xhci);
@@ -3315,6 +3390,9 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
             intr->erdp_low &= ~ERDP_EHB;
         }
         intr->erdp_low = (val & ~ERDP_EHB) | (intr->erdp_low & ERDP_EHB);
+        if (val & ERDP_EHB && xhci_intr_events_unseen(xhci, v)) {
+            xhci_intr_raise(xhci, v);
+        }
         break;
     case 0x1c: /* ERDP high */
         intr->erdp_high = val;
@@ -3608,6 +3686,7 @@ static void usb_xhci_realize(struct PCIDevice *dev, Error **errp)
     }
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
+    xhci->imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_imod_timer, xhci);
 
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
@@ -3670,6 +3749,11 @@ static void usb_xhci_exit(PCIDevice *dev)
         timer_free(xhci->mfwrap_timer);
         xhci->mfwrap_timer = NULL;
     }
+    if (xhci->imod_timer) {
+        timer_del(xhci->imod_timer);
+        timer_free(xhci->imod_timer);
+        xhci->imod_timer = NULL;
+    }
 
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
@@ -3745,6 +3829,12 @@ static int usb_xhci_post_load(void *opaque, int version_id)
         } else {
             msix_vector_unuse(pci_dev, intr);
         }
+        /* a moderated interrupt may have been pending on the source */
+        if (xhci_intr_events_unseen(xhci, intr)) {
+            xhci->intr[intr].imod_deadline = 0;
+            xhci->intr[intr].imod_pending = true;
+            timer_mod(xhci->imod_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        }
     }
 
     return 0;
@@ -131,6 +131,7 @@ struct USBHostIsoRing {
     QTAILQ_HEAD(, USBHostIsoXfer)    unused;
     QTAILQ_HEAD(, USBHostIsoXfer)    inflight;
     QTAILQ_HEAD(, USBHostIsoXfer)    copy;
+    QEMUBH                           *wakeup_bh;
     QTAILQ_ENTRY(USBHostIsoRing)     next;
 };
 
@@ -452,12 +453,20 @@ static void usb_host_req_complete_iso(struct libusb_transfer *transfer)
     }
     if (xfer->ring->ep->pid == USB_TOKEN_IN) {
         QTAILQ_INSERT_TAIL(&xfer->ring->copy, xfer, next);
-        usb_wakeup(xfer->ring->ep, 0);
+        /* one wakeup for all transfers completed by this libusb pass */
+        qemu_bh_schedule(xfer->ring->wakeup_bh);
     } else {
         QTAILQ_INSERT_TAIL(&xfer->ring->unused, xfer, next);
     }
 }
 
+static void usb_host_iso_wakeup(void *opaque)
+{
+    USBHostIsoRing *ring = opaque;
+
+    usb_wakeup(ring->ep, 0);
+}
+
 static USBHostIsoRing *usb_host_iso_alloc(USBHostDevice *s, USBEndpoint *ep)
 {
     USBHostIsoRing *ring = g_new0(USBHostIsoRing, 1);
@@ -471,6 +480,7 @@ static USBHostIsoRing *usb_host_iso_alloc(USBHostDevice *s, USBEndpoint *ep)
     QTAILQ_INIT(&ring->unused);
     QTAILQ_INIT(&ring->inflight);
     QTAILQ_INIT(&ring->copy);
+    ring->wakeup_bh = qemu_bh_new(usb_host_iso_wakeup, ring);
     QTAILQ_INSERT_TAIL(&s->isorings, ring, next);
 
     for (i = 0; i < s->iso_urb_count; i++) {
@@ -545,6 +555,7 @@ static void usb_host_iso_free(USBHostIsoRing *ring)
         usb_host_iso_free_xfer(xfer, false);
     }
 
+    qemu_bh_delete(ring->wakeup_bh);
     QTAILQ_REMOVE(&ring->host->isorings, ring, next);
     g_free(ring);
 }
@@ -978,6 +989,10 @@ static void usb_host_realize(USBDevice *udev, Error **errp)
         error_setg(errp, "hostaddr out of range");
         return;
     }
+    if (!s->iso_urb_count || !s->iso_urb_frames) {
+        error_setg(errp, "isobufs and isobsize must be positive");
+        return;
+    }
 
     loglevel = s->loglevel;
     udev->flags |= (1 << USB_DEV_FLAG_IS_HOST);
@@ -239,6 +239,215 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * Mappings are tracked per container so that guest memory that is
+ * contiguous in both IOVA and host virtual address space can share a
+ * single host mapping: sections added within a memory transaction, or
+ * entries replayed from a guest IOMMU, are queued and only mapped once
+ * the transaction commits.  Ranges in the tree never overlap, so the
+ * comparison treats overlapping ranges as equal and a lookup finds any
+ * mapping that intersects the key.
+ */
+static gint vfio_dma_range_cmp(gconstpointer a, gconstpointer b,
+                               gpointer opaque)
+{
+    const VFIODMARange *ra = a, *rb = b;
+
+    if (ra->iova >= rb->iova + rb->size) {
+        return 1;
+    }
+    if (ra->iova + ra->size <= rb->iova) {
+        return -1;
+    }
+    return 0;
+}
+
+static bool vfio_dma_range_extends(VFIODMARange *r, hwaddr iova,
+                                   void *vaddr, bool readonly)
+{
+    return r->iova + r->size == iova && r->vaddr + r->size == vaddr &&
+           r->readonly == readonly;
+}
+
+static VFIODMARange *vfio_dma_range_new(hwaddr iova, hwaddr size,
+                                        void *vaddr, bool readonly)
+{
+    VFIODMARange *r = g_new0(VFIODMARange, 1);
+
+    r->iova = iova;
+    r->size = size;
+    r->vaddr = vaddr;
+    r->readonly = readonly;
+    return r;
+}
+
+static void vfio_dma_range_queue(VFIOContainer *container, hwaddr iova,
+                                 hwaddr size, void *vaddr, bool readonly)
+{
+    VFIODMARange *prev;
+
+    /* Mappings mostly arrive in address order, search from the end */
+    QTAILQ_FOREACH_REVERSE(prev, &container->dma_pending,
+                           VFIODMARangeList, next) {
+        if (prev->iova < iova) {
+            break;
+        }
+    }
+
+    if (prev && vfio_dma_range_extends(prev, iova, vaddr, readonly)) {
+        prev->size += size;
+    } else if (prev) {
+        QTAILQ_INSERT_AFTER(&container->dma_pending, prev,
+                            vfio_dma_range_new(iova, size, vaddr, readonly),
+                            next);
+    } else {
+        QTAILQ_INSERT_HEAD(&container->dma_pending,
+                           vfio_dma_range_new(iova, size, vaddr, readonly),
+                           next);
+    }
+}
+
+static int vfio_dma_range_flush(VFIOContainer *container)
+{
+    VFIODMARange *r, *next, *stale;
+    int ret = 0, err;
+
+    while ((r = QTAILQ_FIRST(&container->dma_pending))) {
+        QTAILQ_REMOVE(&container->dma_pending, r, next);
+
+        while ((next = QTAILQ_FIRST(&container->dma_pending)) &&
+               vfio_dma_range_extends(r, next->iova, next->vaddr,
+                                      next->readonly)) {
+            r->size += next->size;
+            QTAILQ_REMOVE(&container->dma_pending, next, next);
+            g_free(next);
+        }
+
+        /* vfio_dma_map() unmaps whatever is in the way, forget about it */
+        while ((stale = g_tree_lookup(container->dma_ranges, r))) {
+            g_tree_remove(container->dma_ranges, stale);
+        }
+
+        trace_vfio_dma_range_map(r->iova, r->iova + r->size - 1, r->vaddr);
+
+        err = vfio_dma_map(container, r->iova, r->size, r->vaddr,
+                           r->readonly);
+        if (err) {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
+                         container, r->iova, r->size, r->vaddr, err);
+            ret = ret ? ret : err;
+            g_free(r);
+            continue;
+        }
+
+        g_tree_insert(container->dma_ranges, r, r);
+    }
+
+    return ret;
+}
+
+static void vfio_dma_range_trim_pending(VFIOContainer *container,
+                                        hwaddr iova, hwaddr end)
+{
+    VFIODMARange *r, *tmp;
+
+    QTAILQ_FOREACH_SAFE(r, &container->dma_pending, next, tmp) {
+        hwaddr r_end = r->iova + r->size;
+
+        if (r->iova >= end || r_end <= iova) {
+            continue;
+        }
+
+        if (r_end > end) {
+            VFIODMARange *back = vfio_dma_range_new(end, r_end - end,
+                                                    r->vaddr + end - r->iova,
+                                                    r->readonly);
+
+            QTAILQ_INSERT_AFTER(&container->dma_pending, r, back, next);
+        }
+
+        if (r->iova < iova) {
+            r->size = iova - r->iova;
+        } else {
+            QTAILQ_REMOVE(&container->dma_pending, r, next);
+            g_free(r);
+        }
+    }
+}
+
+static int vfio_dma_range_del(VFIOContainer *container,
+                              hwaddr iova, hwaddr size)
+{
+    VFIODMARange key = { .iova = iova, .size = size };
+    VFIODMARange *r;
+    hwaddr start = iova, end = iova + size;
+    int ret;
+
+    vfio_dma_range_trim_pending(container, start, end);
+
+    /*
+     * Remove every mapping the range touches.  Where the host IOMMU can
+     * split mappings, the parts outside the range simply stay mapped.
+     * Otherwise the whole mappings are unmapped and those parts are
+     * mapped again on their own.
+     */
+    while ((r = g_tree_lookup(container->dma_ranges, &key))) {
+        hwaddr r_end = r->iova + r->size;
+
+        g_tree_steal(container->dma_ranges, r);
+
+        if (container->dma_split_unmap) {
+            VFIODMARange *part;
+
+            if (r->iova < iova) {
+                part = vfio_dma_range_new(r->iova, iova - r->iova,
+                                          r->vaddr, r->readonly);
+                g_tree_insert(container->dma_ranges, part, part);
+            }
+            if (r_end > iova + size) {
+                part = vfio_dma_range_new(iova + size, r_end - iova - size,
+                                          r->vaddr + iova + size - r->iova,
+                                          r->readonly);
+                g_tree_insert(container->dma_ranges, part, part);
+            }
+        } else {
+            if (r->iova < iova) {
+                vfio_dma_range_queue(container, r->iova, iova - r->iova,
+                                     r->vaddr, r->readonly);
+            }
+            if (r_end > iova + size) {
+                vfio_dma_range_queue(container, iova + size,
+                                     r_end - iova - size,
+                                     r->vaddr + iova + size - r->iova,
+                                     r->readonly);
+            }
+            start = MIN(start, r->iova);
+            end = MAX(end, r_end);
+        }
+        g_free(r);
+    }
+
+    ret = vfio_dma_unmap(container, start, end - start);
+
+    if (!container->dma_batch) {
+        vfio_dma_range_flush(container);
+    }
+
+    return ret;
+}
+
+static void vfio_dma_range_free_all(VFIOContainer *container)
+{
+    VFIODMARange *r;
+
+    while ((r = QTAILQ_FIRST(&container->dma_pending))) {
+        QTAILQ_REMOVE(&container->dma_pending, r, next);
+        g_free(r);
+    }
+    g_tree_destroy(container->dma_ranges);
+}
+
 static bool vfio_listener_skipped_section(MemoryRegionSection *section)
 {
     return (!memory_region_is_ram(section->mr) &&
@@ -289,19 +498,22 @@ static void vfio_iommu_map_notify(Notifier *n, void *data)
         goto out;
     }
 
+    /*
+     * Entries replayed while the guest IOMMU region is added are batched
+     * with the rest of the memory transaction; any other update is
+     * applied right away.
+     */
     if ((iotlb->perm & IOMMU_RW) != IOMMU_NONE) {
         vaddr = memory_region_get_ram_ptr(mr) + xlat;
-        ret = vfio_dma_map(container, iotlb->iova,
-                           iotlb->addr_mask + 1, vaddr,
-                           !(iotlb->perm & IOMMU_WO) || mr->readonly);
-        if (ret) {
-            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                         container, iotlb->iova,
-                         iotlb->addr_mask + 1, vaddr, ret);
+        vfio_dma_range_queue(container, iotlb->iova,
+                             iotlb->addr_mask + 1, vaddr,
+                             !(iotlb->perm & IOMMU_WO) || mr->readonly);
+        if (!container->dma_batch) {
+            vfio_dma_range_flush(container);
         }
     } else {
-        ret = vfio_dma_unmap(container, iotlb->iova, iotlb->addr_mask + 1);
+        ret = vfio_dma_range_del(container, iotlb->iova,
+                                 iotlb->addr_mask + 1);
         if (ret) {
             error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
                          "0x%"HWADDR_PRIx") = %d (%m)",
@@ -318,6 +530,42 @@ static hwaddr vfio_container_granularity(VFIOContainer *container)
     return (hwaddr)1 << ctz64(container->iova_pgsizes);
 }
 
+static void vfio_listener_fail(VFIOContainer *container, int ret)
+{
+    /*
+     * On the initfn path, store the first error in the container so we
+     * can gracefully fail.  Runtime, there's not much we can do other
+     * than throw a hardware error.
+     */
+    if (!container->initialized) {
+        if (!container->error) {
+            container->error = ret;
+        }
+    } else {
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
+static void vfio_listener_begin(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+
+    container->dma_batch = true;
+}
+
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    int ret;
+
+    container->dma_batch = false;
+
+    ret = vfio_dma_range_flush(container);
+    if (ret) {
+        vfio_listener_fail(container, ret);
+    }
+}
+
 static void vfio_listener_region_add(MemoryListener *listener,
                                      MemoryRegionSection *section)
 {
@@ -325,7 +573,6 @@ static void vfio_listener_region_add(MemoryListener *listener,
     hwaddr iova, end;
     Int128 llend;
     void *vaddr;
-    int ret;
 
     if (vfio_listener_skipped_section(section)) {
         trace_vfio_listener_region_add_skip(
@@ -355,8 +602,8 @@ static void vfio_listener_region_add(MemoryListener *listener,
         error_report("vfio: IOMMU container %p can't map guest IOVA region"
                      " 0x%"HWADDR_PRIx"..0x%"HWADDR_PRIx,
                      container, iova, end - 1);
-        ret = -EFAULT;
-        goto fail;
+        vfio_listener_fail(container, -EFAULT);
+        return;
     }
 
     memory_region_ref(section->mr);
@@ -397,29 +644,9 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     trace_vfio_listener_region_add_ram(iova, end - 1, vaddr);
 
-    ret = vfio_dma_map(container, iova, end - iova, vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                     container, iova, end - iova, vaddr, ret);
-        goto fail;
-    }
-
-    return;
-
-fail:
-    /*
-     * On the initfn path, store the first error in the container so we
-     * can gracefully fail.  Runtime, there's not much we can do other
-     * than throw a hardware error.
-     */
-    if (!container->initialized) {
-        if (!container->error) {
-            container->error = ret;
-        }
-    } else {
-        hw_error("vfio: DMA mapping failed, unable to continue");
-    }
+    /* Mapped, together with its neighbours, when the transaction commits */
+    vfio_dma_range_queue(container, iova, end - iova, vaddr,
+                         section->readonly);
 }
 
 static void vfio_listener_region_del(MemoryListener *listener,
@@ -474,7 +701,7 @@ static void vfio_listener_region_del(MemoryListener *listener,
 
     trace_vfio_listener_region_del(iova, end - 1);
 
-    ret = vfio_dma_unmap(container, iova, end - iova);
+    ret = vfio_dma_range_del(container, iova, end - iova);
     memory_region_unref(section->mr);
     if (ret) {
         error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
@@ -484,6 +711,8 @@ static void vfio_listener_region_del(MemoryListener *listener,
 }
 
 static const MemoryListener vfio_memory_listener = {
+    .begin = vfio_listener_begin,
+    .commit = vfio_listener_commit,
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
 };
@@ -491,6 +720,47 @@ static const MemoryListener vfio_memory_listener = {
 static void vfio_listener_release(VFIOContainer *container)
 {
     memory_listener_unregister(&container->listener);
+    vfio_dma_range_free_all(container);
+}
+
+static int vfio_setup_region_sparse_mmaps(VFIORegion *region,
+                                          struct vfio_region_info *info)
+{
+    struct vfio_info_cap_header *hdr;
+    struct vfio_region_info_cap_sparse_mmap *sparse;
+    int i, j;
+
+    hdr = vfio_get_region_info_cap(info, VFIO_REGION_INFO_CAP_SPARSE_MMAP);
+    if (!hdr) {
+        return -ENODEV;
+    }
+
+    sparse = container_of(hdr, struct vfio_region_info_cap_sparse_mmap, header);
+
+    trace_vfio_region_sparse_mmap_header(region->vbasedev->name,
+                                         region->nr, sparse->nr_areas);
+
+    region->mmaps = g_new0(VFIOMmap, sparse->nr_areas);
+
+    for (i = 0, j = 0; i < sparse->nr_areas; i++) {
+        trace_vfio_region_sparse_mmap_entry(i, sparse->areas[i].offset,
+                                            sparse->areas[i].offset +
+                                            sparse->areas[i].size);
+
+        /* Areas are only usable if both ends are host page aligned */
+        if (sparse->areas[i].size &&
+            !(sparse->areas[i].offset & ~qemu_real_host_page_mask) &&
+            !(sparse->areas[i].size & ~qemu_real_host_page_mask)) {
+            region->mmaps[j].offset = sparse->areas[i].offset;
+            region->mmaps[j].size = sparse->areas[i].size;
+            j++;
+        }
+    }
+
+    region->nr_mmaps = j;
+    region->mmaps = g_realloc(region->mmaps, j * sizeof(VFIOMmap));
+
+    return 0;
 }
 
 int vfio_region_setup(Object *obj, VFIODevice *vbasedev, VFIORegion *region,
@@ -519,11 +789,15 @@ int vfio_region_setup(Object *obj, VFIODevice *vbasedev, VFIORegion *region,
             region->flags & VFIO_REGION_INFO_FLAG_MMAP &&
             !(region->size & ~qemu_real_host_page_mask)) {
 
-            region->nr_mmaps = 1;
-            region->mmaps = g_new0(VFIOMmap, region->nr_mmaps);
+            ret = vfio_setup_region_sparse_mmaps(region, info);
+
+            if (ret) {
+                region->nr_mmaps = 1;
+                region->mmaps = g_new0(VFIOMmap, region->nr_mmaps);
 
-            region->mmaps[0].offset = 0;
-            region->mmaps[0].size = region->size;
+                region->mmaps[0].offset = 0;
+                region->mmaps[0].size = region->size;
+            }
         }
     }
 
@@ -791,6 +1065,9 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
         bool v2 = !!ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1v2_IOMMU);
         struct vfio_iommu_type1_info info;
 
+        /* Only the original type1 interface can bisect a mapping */
+        container->dma_split_unmap = !v2;
+
         ret = ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &fd);
         if (ret) {
             error_report("vfio: failed to set group container: %m");
@@ -869,12 +1146,18 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
 
         /* Assume just 4K IOVA pages for now */
         container->iova_pgsizes = 0x1000;
+
+        /* TCE entries are unmapped one by one anyway */
+        container->dma_split_unmap = true;
     } else {
         error_report("vfio: No available IOMMU models");
         ret = -EINVAL;
         goto free_container_exit;
     }
 
+    container->dma_ranges = g_tree_new_full(vfio_dma_range_cmp, NULL,
+                                            g_free, NULL);
+    QTAILQ_INIT(&container->dma_pending);
     container->listener = vfio_memory_listener;
 
     memory_listener_register(&container->listener, container->space->as);
@@ -1083,16 +1366,60 @@ int vfio_get_region_info(VFIODevice *vbasedev, int index,
     *info = g_malloc0(argsz);
 
     (*info)->index = index;
+retry:
     (*info)->argsz = argsz;
 
     if (ioctl(vbasedev->fd, VFIO_DEVICE_GET_REGION_INFO, *info)) {
         g_free(*info);
+        *info = NULL;
         return -errno;
     }
 
+    /* The kernel tells us how much room its capability chain needs */
+    if ((*info)->argsz > argsz) {
+        argsz = (*info)->argsz;
+        *info = g_realloc(*info, argsz);
+
+        goto retry;
+    }
+
     return 0;
 }
 
+struct vfio_info_cap_header *
+vfio_get_region_info_cap(struct vfio_region_info *info, uint16_t id)
+{
+    struct vfio_info_cap_header *hdr;
+    void *ptr = info;
+
+    if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS)) {
+        return NULL;
+    }
+
+    for (hdr = ptr + info->cap_offset; hdr != ptr; hdr = ptr + hdr->next) {
+        if (hdr->id == id) {
+            return hdr;
+        }
+    }
+
+    return NULL;
+}
+
+bool vfio_has_region_cap(VFIODevice *vbasedev, int region, uint16_t cap_type)
+{
+    struct vfio_region_info *info = NULL;
+    bool ret = false;
+
+    if (!vfio_get_region_info(vbasedev, region, &info)) {
+        if (vfio_get_region_info_cap(info, cap_type)) {
+            ret = true;
+        }
+        g_free(info);
+    }
+
+    return ret;
+}
+
 /*
  * Interfaces for IBM EEH (Enhanced Error Handling)
  */
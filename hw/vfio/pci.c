@@ -1202,9 +1202,23 @@ static void vfio_pci_fixup_msix_region(VFIOPCIDevice *vdev)
     off_t start, end;
     VFIORegion *region = &vdev->bars[vdev->msix->table_bar].region;
 
+    /*
+     * If the host allows the MSI-X table to be mapped, keep the whole BAR
+     * mmap'd.  The emulated table registered by msix_init() overlays it,
+     * so only the table itself traps and any registers sharing its pages
+     * are still accessed directly.
+     */
+    if (vfio_has_region_cap(&vdev->vbasedev, region->nr,
+                            VFIO_REGION_INFO_CAP_MSIX_MAPPABLE)) {
+        trace_vfio_msix_fixup_mappable(vdev->vbasedev.name,
+                                       vdev->msix->table_bar);
+        return;
+    }
+
     /*
      * We expect to find a single mmap covering the whole BAR, anything else
-     * means it's either unsupported or already setup.
+     * means it's either unsupported or already setup, e.g. by the sparse
+     * mmap areas the host reported for the region.
      */
     if (region->nr_mmaps != 1 || region->mmaps[0].offset ||
         region->size != region->mmaps[0].size) {
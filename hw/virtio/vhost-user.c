@@ -31,6 +31,8 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_MQ = 0,
     VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
     VHOST_USER_PROTOCOL_F_RARP = 2,
+    VHOST_USER_PROTOCOL_F_MEM_REGIONS = 3,
+    VHOST_USER_PROTOCOL_F_CONFIG = 4,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
@@ -58,6 +60,9 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_ADD_MEM_REG = 20,
+    VHOST_USER_REM_MEM_REG = 21,
+    VHOST_USER_GET_CONFIG = 22,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -79,6 +84,17 @@ typedef struct VhostUserLog {
     uint64_t mmap_offset;
 } VhostUserLog;
 
+#define VHOST_USER_MAX_CONFIG_SIZE  256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+#define VHOST_USER_CONFIG_HDR_SIZE  offsetof(VhostUserConfig, region)
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -93,7 +109,9 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemoryRegion region;
         VhostUserLog log;
+        VhostUserConfig config;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -164,6 +182,8 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
     case VHOST_USER_SET_OWNER:
     case VHOST_USER_RESET_OWNER:
     case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_ADD_MEM_REG:
+    case VHOST_USER_REM_MEM_REG:
     case VHOST_USER_GET_QUEUE_NUM:
         return true;
     default:
@@ -280,6 +300,100 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
     return 0;
 }
 
+static bool vhost_user_has_mem_region(struct vhost_memory *mem,
+                                      struct vhost_memory_region *reg)
+{
+    int i;
+
+    for (i = 0; i < mem->nregions; ++i) {
+        if (mem->regions[i].guest_phys_addr == reg->guest_phys_addr &&
+            mem->regions[i].memory_size == reg->memory_size &&
+            mem->regions[i].userspace_addr == reg->userspace_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int vhost_user_add_mem_region(struct vhost_dev *dev,
+                                     struct vhost_memory_region *reg)
+{
+    ram_addr_t ram_addr;
+    int fd;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_ADD_MEM_REG,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(msg.payload.region),
+    };
+
+    assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
+    qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                            &ram_addr);
+    fd = qemu_get_ram_fd(ram_addr);
+    if (fd <= 0) {
+        /* Not shareable, left out of the table like in SET_MEM_TABLE */
+        return 0;
+    }
+
+    msg.payload.region.guest_phys_addr = reg->guest_phys_addr;
+    msg.payload.region.memory_size = reg->memory_size;
+    msg.payload.region.userspace_addr = reg->userspace_addr;
+    msg.payload.region.mmap_offset = reg->userspace_addr -
+        (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
+
+    return vhost_user_write(dev, &msg, &fd, 1);
+}
+
+static int vhost_user_rem_mem_region(struct vhost_dev *dev,
+                                     struct vhost_memory_region *reg)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_REM_MEM_REG,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(msg.payload.region),
+    };
+
+    /* The RAM may already be gone, the slave only needs the addresses */
+    msg.payload.region.guest_phys_addr = reg->guest_phys_addr;
+    msg.payload.region.memory_size = reg->memory_size;
+    msg.payload.region.userspace_addr = reg->userspace_addr;
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
+static int vhost_user_update_mem_table(struct vhost_dev *dev,
+                                       struct vhost_memory *old,
+                                       struct vhost_memory *mem)
+{
+    int i, r;
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_MEM_REGIONS)) {
+        return -ENOTSUP;
+    }
+
+    /* Removals first, so that the slave never holds overlapping regions */
+    for (i = 0; i < old->nregions; ++i) {
+        if (!vhost_user_has_mem_region(mem, old->regions + i)) {
+            r = vhost_user_rem_mem_region(dev, old->regions + i);
+            if (r < 0) {
+                return r;
+            }
+        }
+    }
+
+    for (i = 0; i < mem->nregions; ++i) {
+        if (!vhost_user_has_mem_region(old, mem->regions + i)) {
+            r = vhost_user_add_mem_region(dev, mem->regions + i);
+            if (r < 0) {
+                return r;
+            }
+        }
+    }
+
+    return 0;
+}
+
 static int vhost_user_set_vring_addr(struct vhost_dev *dev,
                                      struct vhost_vring_addr *addr)
 {
@@ -611,6 +725,47 @@ static int vhost_user_migration_done(struct vhost_dev *dev, char* mac_addr)
     return -1;
 }
 
+static int vhost_user_get_config(struct vhost_dev *dev, uint8_t *config,
+                                 uint32_t config_len)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_CONFIG,
+        .flags = VHOST_USER_VERSION,
+        .size = VHOST_USER_CONFIG_HDR_SIZE + config_len,
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_CONFIG)) {
+        return -1;
+    }
+    assert(config_len <= VHOST_USER_MAX_CONFIG_SIZE);
+
+    msg.payload.config.offset = 0;
+    msg.payload.config.size = config_len;
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != VHOST_USER_GET_CONFIG) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     VHOST_USER_GET_CONFIG, msg.request);
+        return -1;
+    }
+
+    if (msg.size != VHOST_USER_CONFIG_HDR_SIZE + config_len ||
+        msg.payload.config.size != config_len) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    memcpy(config, msg.payload.config.region, config_len);
+    return 0;
+}
+
 static bool vhost_user_can_merge(struct vhost_dev *dev,
                                  uint64_t start1, uint64_t size1,
                                  uint64_t start2, uint64_t size2)
@@ -637,6 +792,7 @@ const VhostOps user_ops = {
         .vhost_backend_memslots_limit = vhost_user_memslots_limit,
         .vhost_set_log_base = vhost_user_set_log_base,
         .vhost_set_mem_table = vhost_user_set_mem_table,
+        .vhost_update_mem_table = vhost_user_update_mem_table,
         .vhost_set_vring_addr = vhost_user_set_vring_addr,
         .vhost_set_vring_endian = vhost_user_set_vring_endian,
         .vhost_set_vring_num = vhost_user_set_vring_num,
@@ -653,4 +809,5 @@ const VhostOps user_ops = {
         .vhost_requires_shm_log = vhost_user_requires_shm_log,
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
+        .vhost_get_config = vhost_user_get_config,
 };
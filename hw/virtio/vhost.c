@@ -535,6 +535,41 @@ static void vhost_begin(MemoryListener *listener)
     dev->mem_changed_start_addr = -1;
 }
 
+static size_t vhost_memory_size(struct vhost_memory *mem)
+{
+    return offsetof(struct vhost_memory, regions) +
+           mem->nregions * sizeof mem->regions[0];
+}
+
+/* Pass the current memory table to the backend.  Unless @full, only
+ * send what changed since the last update, if the backend can do so.
+ */
+static int vhost_dev_set_mem_table(struct vhost_dev *dev, bool full)
+{
+    struct vhost_memory *old = dev->backend_mem;
+    int r = -ENOTSUP;
+
+    if (!full && old) {
+        if (old->nregions == dev->mem->nregions &&
+            !memcmp(old->regions, dev->mem->regions,
+                    old->nregions * sizeof old->regions[0])) {
+            /* Sections came and went but the backend sees the same map */
+            return 0;
+        }
+        if (dev->vhost_ops->vhost_update_mem_table) {
+            r = dev->vhost_ops->vhost_update_mem_table(dev, old, dev->mem);
+        }
+    }
+    if (r == -ENOTSUP) {
+        r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    }
+    if (r >= 0) {
+        g_free(dev->backend_mem);
+        dev->backend_mem = g_memdup(dev->mem, vhost_memory_size(dev->mem));
+    }
+    return r;
+}
+
 static void vhost_commit(MemoryListener *listener)
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
@@ -563,7 +598,7 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+        r = vhost_dev_set_mem_table(dev, false);
         assert(r >= 0);
         dev->memory_changed = false;
         return;
@@ -576,7 +611,7 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    r = vhost_dev_set_mem_table(dev, false);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -1067,6 +1102,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     hdev->mem = g_malloc0(offsetof(struct vhost_memory, regions));
+    hdev->backend_mem = NULL;
     hdev->n_mem_sections = 0;
     hdev->mem_sections = NULL;
     hdev->log = NULL;
@@ -1099,6 +1135,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         error_free(hdev->migration_blocker);
     }
     g_free(hdev->mem);
+    g_free(hdev->backend_mem);
     g_free(hdev->mem_sections);
     hdev->vhost_ops->vhost_backend_cleanup(hdev);
     QLIST_REMOVE(hdev, entry);
@@ -1220,6 +1257,19 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
     }
 }
 
+/* Fetch the device config space from backends that own it */
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len)
+{
+    assert(hdev->vhost_ops);
+
+    if (!hdev->vhost_ops->vhost_get_config) {
+        return -ENOTSUP;
+    }
+    return hdev->vhost_ops->vhost_get_config(hdev, config, config_len) < 0 ?
+           -EIO : 0;
+}
+
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
@@ -1231,7 +1281,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = hdev->vhost_ops->vhost_set_mem_table(hdev, hdev->mem);
+    r = vhost_dev_set_mem_table(hdev, true);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
@@ -26,6 +26,7 @@
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
 #include "trace.h"
 
 #if defined(__linux__)
@@ -35,15 +36,85 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-static void balloon_page(void *addr, int deflate)
+#define BALLOON_PAGE_SIZE  (1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+static void balloon_flush_run(VirtIOBalloon *s)
 {
+    VirtIOBalloonRun *run = &s->run;
+
+    if (!run->len) {
+        return;
+    }
+
 #if defined(__linux__)
     if (!qemu_balloon_is_inhibited() && (!kvm_enabled() ||
                                          kvm_has_sync_mmu())) {
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+        trace_virtio_balloon_flush_run(run->offset, run->len, run->deflate);
+        if (run->deflate) {
+            qemu_madvise(run->host, run->len, QEMU_MADV_WILLNEED);
+        } else {
+            ram_block_discard_range(run->rb, run->offset, run->len);
+        }
     }
 #endif
+    run->len = 0;
+}
+
+static void balloon_add_run(VirtIOBalloon *s, RAMBlock *rb, void *host,
+                            ram_addr_t offset, ram_addr_t len, bool deflate)
+{
+    VirtIOBalloonRun *run = &s->run;
+
+    if (run->len && (run->rb != rb || run->deflate != deflate ||
+                     run->offset + run->len != offset)) {
+        balloon_flush_run(s);
+    }
+    if (!run->len) {
+        run->rb = rb;
+        run->host = host;
+        run->offset = offset;
+        run->deflate = deflate;
+    }
+    run->len += len;
+}
+
+static void balloon_page(VirtIOBalloon *s, MemoryRegion *mr,
+                         ram_addr_t offset, bool deflate)
+{
+    RAMBlock *rb = mr->ram_block;
+    size_t page_size = qemu_ram_pagesize(rb);
+    ram_addr_t base;
+
+    if (page_size <= BALLOON_PAGE_SIZE) {
+        balloon_add_run(s, rb, memory_region_get_ram_ptr(mr) + offset,
+                        offset, BALLOON_PAGE_SIZE, deflate);
+        return;
+    }
+
+    /* A larger host page can only go once the guest gave up all of it */
+    base = QEMU_ALIGN_DOWN(offset, page_size);
+    if (s->pbp_rb != rb || s->pbp_base != base) {
+        if (deflate) {
+            return;
+        }
+        s->pbp_nr = page_size / BALLOON_PAGE_SIZE;
+        g_free(s->pbp_bitmap);
+        s->pbp_bitmap = bitmap_new(s->pbp_nr);
+        s->pbp_rb = rb;
+        s->pbp_base = base;
+    }
+
+    if (deflate) {
+        clear_bit((offset - base) / BALLOON_PAGE_SIZE, s->pbp_bitmap);
+        return;
+    }
+
+    set_bit((offset - base) / BALLOON_PAGE_SIZE, s->pbp_bitmap);
+    if (bitmap_full(s->pbp_bitmap, s->pbp_nr)) {
+        balloon_add_run(s, rb, memory_region_get_ram_ptr(mr) + base,
+                        base, page_size, false);
+        s->pbp_rb = NULL;
+    }
 }
 
 static const char *balloon_stat_names[] = {
@@ -213,13 +284,14 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
     MemoryRegionSection section;
+    bool pushed = false;
 
     for (;;) {
         size_t offset = 0;
         uint32_t pfn;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
         while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
@@ -240,14 +312,20 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
                should be OK because we only want a single page.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            balloon_page(s, section.mr, addr, vq == s->dvq);
             memory_region_unref(section.mr);
         }
 
         virtqueue_push(vq, elem, offset);
-        virtio_notify(vdev, vq);
         g_free(elem);
+        pushed = true;
+    }
+
+    /* Pages of consecutive elements are released together; the guest
+     * only sees them as processed after the notification. */
+    balloon_flush_run(s);
+    if (pushed) {
+        virtio_notify(vdev, vq);
     }
 }
 
@@ -303,16 +381,158 @@ out:
     }
 }
 
+static bool virtio_balloon_free_page_hint_support(const VirtIOBalloon *s)
+{
+    return virtio_has_feature(s->host_features,
+                              VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+/*
+ * Free page hinting
+ *
+ * During migration the guest is asked, through a new command id in the
+ * config space, to report its free pages.  It acknowledges the request by
+ * sending the command id on free_page_vq, then sends the free pages
+ * themselves as device-writable buffers; the device never writes to them,
+ * it only tells the migration code that they needn't be sent.  A stop
+ * command ends the request before each dirty bitmap sync, and "done" lets
+ * the guest reuse the pages it reported once migration is over.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    unsigned int i;
+
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            return;
+        }
+
+        if (elem->out_num) {
+            uint32_t id;
+
+            if (iov_to_buf(elem->out_sg, elem->out_num, 0, &id,
+                           sizeof(id)) == sizeof(id)) {
+                id = virtio_ldl_p(vdev, &id);
+                if (id == s->free_page_hint_cmd_id) {
+                    if (s->free_page_hint_status ==
+                        FREE_PAGE_HINT_S_REQUESTED) {
+                        s->free_page_hint_status = FREE_PAGE_HINT_S_START;
+                    }
+                } else if (s->free_page_hint_status ==
+                           FREE_PAGE_HINT_S_START) {
+                    /* The guest has reported all it had for this request */
+                    s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+                }
+                trace_virtio_balloon_free_page_cmd(id,
+                                                   s->free_page_hint_status);
+            }
+        }
+
+        /* Hints for a stale request may predate the last bitmap sync */
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        /* Nothing was written to the pages, don't dirty them */
+        virtqueue_push(vq, elem, 0);
+        virtio_notify(vdev, vq);
+        g_free(elem);
+    }
+}
+
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    if (s->free_page_hint_cmd_id < VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN ||
+        s->free_page_hint_cmd_id == VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MAX) {
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+    } else {
+        s->free_page_hint_cmd_id++;
+    }
+    s->free_page_hint_status = FREE_PAGE_HINT_S_REQUESTED;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_stop(VirtIOBalloon *s)
+{
+    if (s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED ||
+        s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+        s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+static void virtio_balloon_free_page_done(VirtIOBalloon *s)
+{
+    s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_hint_notify(Notifier *notifier,
+                                                 void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_notify);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    PrecopyNotifyReason *reason = data;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT) ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    switch (*reason) {
+    case PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC:
+    case PRECOPY_NOTIFY_COMPLETE:
+        virtio_balloon_free_page_stop(s);
+        break;
+    case PRECOPY_NOTIFY_AFTER_BITMAP_SYNC:
+        virtio_balloon_free_page_start(s);
+        break;
+    case PRECOPY_NOTIFY_CLEANUP:
+        /* Only matters if the migration failed and the guest runs on */
+        virtio_balloon_free_page_done(s);
+        break;
+    }
+}
+
+static size_t virtio_balloon_config_size(const VirtIOBalloon *s)
+{
+    if (virtio_balloon_free_page_hint_support(s)) {
+        return sizeof(struct virtio_balloon_config);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_hint_cmd_id);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    struct virtio_balloon_config config;
+    struct virtio_balloon_config config = {};
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
 
+    switch (dev->free_page_hint_status) {
+    case FREE_PAGE_HINT_S_REQUESTED:
+    case FREE_PAGE_HINT_S_START:
+        config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
+        break;
+    case FREE_PAGE_HINT_S_STOP:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    case FREE_PAGE_HINT_S_DONE:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    }
+
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -356,7 +576,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -426,9 +646,29 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+
+    /*
+     * The guest may still hold pages it reported on the source; they can
+     * be used again on this side, tell it so once it runs.
+     */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+        s->free_page_hint_done_pending = true;
+    }
     return 0;
 }
 
+static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
+    if (s->free_page_hint_done_pending && vdev->vm_running &&
+        (status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        s->free_page_hint_done_pending = false;
+        virtio_notify_config(vdev);
+    }
+}
+
 static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -436,7 +676,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -451,6 +691,14 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (virtio_balloon_free_page_hint_support(s)) {
+        s->free_page_vq = virtio_add_queue(vdev, 128,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+        s->free_page_hint_notify.notify = virtio_balloon_free_page_hint_notify;
+        precopy_add_notifier(&s->free_page_hint_notify);
+    }
+
     reset_stats(s);
 
     register_savevm(dev, "virtio-balloon", -1, 1,
@@ -463,7 +711,11 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
     balloon_stats_destroy_timer(s);
+    if (virtio_balloon_free_page_hint_support(s)) {
+        precopy_remove_notifier(&s->free_page_hint_notify);
+    }
     qemu_remove_balloon_handler(s);
+    g_free(s->pbp_bitmap);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
 }
@@ -476,6 +728,9 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
     }
+    s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+    s->free_page_hint_done_pending = false;
+    s->pbp_rb = NULL;
 }
 
 static void virtio_balloon_instance_init(Object *obj)
@@ -494,6 +749,8 @@ static void virtio_balloon_instance_init(Object *obj)
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -510,6 +767,7 @@ static void virtio_balloon_class_init(ObjectClass *klass, void *data)
     vdc->get_config = virtio_balloon_get_config;
     vdc->set_config = virtio_balloon_set_config;
     vdc->get_features = virtio_balloon_get_features;
+    vdc->set_status = virtio_balloon_set_status;
     vdc->save = virtio_balloon_save_device;
     vdc->load = virtio_balloon_load_device;
 }
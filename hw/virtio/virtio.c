@@ -57,6 +57,44 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* Popped elements with at most this many in and out segments each are
+ * recycled through a per-queue cache of this many elements.
+ */
+#define VIRTQUEUE_ELEM_CACHE_SG     16
+#define VIRTQUEUE_ELEM_CACHE_SIZE   32
+
+typedef struct VirtQueueElementCache {
+    size_t sz;
+    unsigned int len;
+    VirtQueueElement *elems[VIRTQUEUE_ELEM_CACHE_SIZE];
+} VirtQueueElementCache;
+
+/* A buffer filled but not yet flushed to a packed ring */
+typedef struct VirtQueueUsedElem {
+    unsigned int index;
+    unsigned int len;
+    unsigned int ndescs;
+} VirtQueueUsedElem;
+
+typedef struct VRingMemoryRegionCaches {
+    struct rcu_head rcu;
+    MemoryRegionCache desc;
+    MemoryRegionCache avail;
+    MemoryRegionCache used;
+} VRingMemoryRegionCaches;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -65,6 +103,7 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    VRingMemoryRegionCaches *caches;
 } VRing;
 
 struct VirtQueue
@@ -88,6 +127,18 @@ struct VirtQueue
     /* Notification enabled? */
     bool notification;
 
+    /* Packed ring wrap counters, matching last_avail_idx, shadow_avail_idx
+     * and used_idx.  The indices never reach vring.num in a packed ring.
+     */
+    bool last_avail_wrap_counter;
+    bool shadow_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed rings write used descriptors at flush time */
+    VirtQueueUsedElem *used_elems;
+
+    VirtQueueElementCache *elem_cache;
+
     uint16_t queue_index;
 
     int inuse;
@@ -101,6 +152,80 @@ struct VirtQueue
 };
 
 /* virt queue functions */
+static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
+{
+    address_space_cache_destroy(&caches->desc);
+    address_space_cache_destroy(&caches->avail);
+    address_space_cache_destroy(&caches->used);
+    g_free(caches);
+}
+
+/* Translate the rings of queue @n again; called whenever their address or
+ * size changes, and when the memory map changes.  Queues that do not exist
+ * have no caches.
+ */
+static void virtio_init_region_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    VRingMemoryRegionCaches *old = vq->vring.caches;
+    VRingMemoryRegionCaches *new = NULL;
+    unsigned int num = vq->vring.num;
+
+    if (num && virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        /* The device writes used descriptors back into the ring, and
+         * the avail and used areas only hold event suppression data.
+         */
+        new = g_new0(VRingMemoryRegionCaches, 1);
+        address_space_cache_init(&new->desc, &address_space_memory,
+                                 vq->vring.desc,
+                                 num * sizeof(VRingPackedDesc), true);
+        address_space_cache_init(&new->avail, &address_space_memory,
+                                 vq->vring.avail,
+                                 sizeof(VRingPackedDescEvent), false);
+        address_space_cache_init(&new->used, &address_space_memory,
+                                 vq->vring.used,
+                                 sizeof(VRingPackedDescEvent), true);
+    } else if (num) {
+        new = g_new0(VRingMemoryRegionCaches, 1);
+        address_space_cache_init(&new->desc, &address_space_memory,
+                                 vq->vring.desc, num * sizeof(VRingDesc),
+                                 false);
+        address_space_cache_init(&new->avail, &address_space_memory,
+                                 vq->vring.avail,
+                                 offsetof(VRingAvail, ring[num + 1]), false);
+        address_space_cache_init(&new->used, &address_space_memory,
+                                 vq->vring.used,
+                                 offsetof(VRingUsed, ring[num]) +
+                                 sizeof(uint16_t), true);
+    }
+
+    atomic_rcu_set(&vq->vring.caches, new);
+    if (old) {
+        call_rcu(old, virtio_free_region_cache, rcu);
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtio_init_region_cache(vdev, i);
+        }
+    }
+}
+
+/* Called within rcu_read_lock().  */
+static inline VRingMemoryRegionCaches *vring_get_region_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+
+    assert(caches != NULL);
+    return caches;
+}
+
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
@@ -113,13 +238,14 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_init_region_cache(vdev, n);
 }
 
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            MemoryRegionCache *cache, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    address_space_read_cached(cache, i * sizeof(VRingDesc),
+                              desc, sizeof(VRingDesc));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
@@ -128,24 +254,40 @@ static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingAvail, flags);
+    uint16_t val;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    val = virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
+    rcu_read_unlock();
+    return val;
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingAvail, idx);
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    vq->shadow_avail_idx = virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
+    rcu_read_unlock();
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingAvail, ring[i]);
+    uint16_t val;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    val = virtio_lduw_phys_cached(vq->vdev, &caches->avail, pa);
+    rcu_read_unlock();
+    return val;
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -156,59 +298,206 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingUsed, ring[i]);
+
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    address_space_write_cached(&caches->used, pa, uelem, sizeof(VRingUsedElem));
+    rcu_read_unlock();
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingUsed, idx);
+    uint16_t val;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    val = virtio_lduw_phys_cached(vq->vdev, &caches->used, pa);
+    rcu_read_unlock();
+    return val;
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    VRingMemoryRegionCaches *caches;
+    hwaddr pa = offsetof(VRingUsed, idx);
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
+    rcu_read_unlock();
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches;
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    flags = virtio_lduw_phys_cached(vdev, &caches->used, pa);
+    virtio_stw_phys_cached(vdev, &caches->used, pa, flags | mask);
+    rcu_read_unlock();
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
+    VRingMemoryRegionCaches *caches;
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr pa = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    flags = virtio_lduw_phys_cached(vdev, &caches->used, pa);
+    virtio_stw_phys_cached(vdev, &caches->used, pa, flags & ~mask);
+    rcu_read_unlock();
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
+    VRingMemoryRegionCaches *caches;
     hwaddr pa;
+
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    pa = offsetof(VRingUsed, ring[vq->vring.num]);
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
+    rcu_read_unlock();
+}
+
+/* Packed ring.  Descriptors are made available and used in place, with the
+ * AVAIL and USED flag bits compared against a wrap counter that flips each
+ * time an index goes round the ring, so popping a buffer touches a single
+ * cache line in the common case.
+ */
+static inline bool vring_packed_desc_is_avail(uint16_t flags, bool wrap)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap;
+}
+
+static uint16_t vring_packed_desc_flags(VirtIODevice *vdev,
+                                        MemoryRegionCache *cache, int i)
+{
+    return virtio_lduw_phys_cached(vdev, cache,
+                                   i * sizeof(VRingPackedDesc) +
+                                   offsetof(VRingPackedDesc, flags));
+}
+
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i)
+{
+    address_space_read_cached(cache, i * sizeof(VRingPackedDesc),
+                              desc, sizeof(VRingPackedDesc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+/* Write a used descriptor @pos slots past used_idx.  The flags go last, as
+ * they hand the descriptor to the driver.
+ */
+static void vring_packed_used_write(VirtQueue *vq, MemoryRegionCache *cache,
+                                    const VirtQueueUsedElem *uelem,
+                                    unsigned int pos)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int head = vq->used_idx + pos;
+    bool wrap = vq->used_wrap_counter;
+    hwaddr pa;
+    uint16_t flags = 0;
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap = !wrap;
+    }
+    pa = head * sizeof(VRingPackedDesc);
+
+    if (wrap) {
+        flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+                 (1 << VRING_PACKED_DESC_F_USED);
+    }
+    if (uelem->len) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    virtio_stw_phys_cached(vdev, cache, pa + offsetof(VRingPackedDesc, id),
+                           uelem->index);
+    virtio_stl_phys_cached(vdev, cache, pa + offsetof(VRingPackedDesc, len),
+                           uelem->len);
+    smp_wmb();
+    virtio_stw_phys_cached(vdev, cache, pa + offsetof(VRingPackedDesc, flags),
+                           flags);
+}
+
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    e->flags = virtio_lduw_phys_cached(vdev, cache,
+                                       offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is seen before off_wrap */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache,
+                                          offsetof(VRingPackedDescEvent,
+                                                   off_wrap));
+}
+
+static void vring_packed_event_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache,
+                                     const VRingPackedDescEvent *e)
+{
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, off_wrap),
+                           e->off_wrap);
+    /* Make sure off_wrap is written before flags */
+    smp_wmb();
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, flags), e->flags);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches;
+    VRingPackedDescEvent e = {
+        .flags = VRING_PACKED_EVENT_FLAG_DISABLE,
+    };
+
+    if (enable && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        e.off_wrap = vq->shadow_avail_idx |
+                     vq->shadow_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        e.flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else if (enable) {
+        e.flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    vring_packed_event_write(vq->vdev, &caches->used, &e);
+    rcu_read_unlock();
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -226,10 +515,28 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+    uint16_t flags;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    flags = vring_packed_desc_flags(vq->vdev, &caches->desc,
+                                    vq->last_avail_idx);
+    rcu_read_unlock();
+
+    return !vring_packed_desc_is_avail(flags, vq->last_avail_wrap_counter);
+}
+
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -263,7 +570,16 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -276,6 +592,13 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->used_elems[idx].index = elem->index;
+        vq->used_elems[idx].len = len;
+        vq->used_elems[idx].ndescs = elem->ndescs;
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -283,9 +606,48 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+/* Used descriptors after the first may be written in any order; the first
+ * one's flags publish them all to the driver.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int i, pos;
+
+    if (!count) {
+        return;
+    }
+    /* Make sure buffer is written before we hand it back. */
+    smp_wmb();
+    trace_virtqueue_flush(vq, count);
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    pos = vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        vring_packed_used_write(vq, &caches->desc, &vq->used_elems[i], pos);
+        pos += vq->used_elems[i].ndescs;
+    }
+    vring_packed_used_write(vq, &caches->desc, &vq->used_elems[0], 0);
+    rcu_read_unlock();
+
+    vq->inuse -= count;
+    vq->used_idx += pos;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -341,7 +703,8 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 }
 
 static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                         hwaddr desc_pa, unsigned int max)
+                                         MemoryRegionCache *desc_cache,
+                                         unsigned int max)
 {
     unsigned int next;
 
@@ -360,32 +723,155 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vdev, desc, desc_cache, next);
     return next;
 }
 
+/* Step to the next descriptor of a packed ring chain, which is either the
+ * next slot of the ring or, in an indirect table, the next entry until the
+ * end of the table.  Returns @max when the chain is done.
+ */
+static unsigned virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                                VRingPackedDesc *desc,
+                                                MemoryRegionCache *desc_cache,
+                                                unsigned int max,
+                                                unsigned int i, bool indirect)
+{
+    if (indirect) {
+        if (++i >= max) {
+            return max;
+        }
+    } else {
+        if (!(desc->flags & VRING_DESC_F_NEXT)) {
+            return max;
+        }
+        if (++i == vq->vring.num) {
+            i = 0;
+        }
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, i);
+    return i;
+}
+
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap = vq->last_avail_wrap_counter;
+    unsigned int total_bufs, in_total, out_total;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    total_bufs = in_total = out_total = 0;
+    while (total_bufs < vq->vring.num &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vdev,
+                                                              &caches->desc,
+                                                              idx), wrap)) {
+        MemoryRegionCache *desc_cache = &caches->desc;
+        unsigned int max, num_bufs = 0;
+        bool indirect = false;
+        VRingPackedDesc desc;
+        unsigned int i;
+
+        /* Read the descriptor only after seeing it available */
+        smp_rmb();
+        max = vq->vring.num;
+        i = idx;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+        } while ((i = virtqueue_packed_read_next_desc(vq, &desc, desc_cache,
+                                                      max, i, indirect))
+                 != max);
+
+        address_space_cache_destroy(&indirect_desc_cache);
+        num_bufs = indirect ? 1 : num_bufs;
+        total_bufs += num_bufs;
+        idx += num_bufs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap = !wrap;
+        }
+    }
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
 {
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    VRingMemoryRegionCaches *caches;
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
+        MemoryRegionCache *desc_cache = &caches->desc;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
-        hwaddr desc_pa;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_cache, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -402,9 +888,12 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             /* loop over the indirect descriptor table */
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
-            desc_pa = desc.addr;
+            address_space_cache_init(&indirect_desc_cache,
+                                     &address_space_memory,
+                                     desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, desc_cache, i);
         }
 
         do {
@@ -422,14 +911,18 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                               max)) != max);
 
+        address_space_cache_destroy(&indirect_desc_cache);
         if (!indirect)
             total_bufs = num_bufs;
         else
             total_bufs++;
     }
 done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -526,6 +1019,8 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
 
     assert(sz >= sizeof(VirtQueueElement));
     elem = g_malloc(out_sg_end);
+    elem->ndescs = 1;
+    elem->pooled = false;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -535,35 +1030,190 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+/* Elements that fit the recycled layout come from the queue's cache.  The
+ * cache holds one request size, the first one popped with it.
+ */
+static VirtQueueElement *virtqueue_get_element(VirtQueue *vq, size_t sz,
+                                               unsigned out_num,
+                                               unsigned in_num)
 {
-    unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    VirtQueueElementCache *cache = vq->elem_cache;
+    VirtQueueElement *elem;
+
+    if (!cache || (cache->sz && cache->sz != sz) ||
+        out_num > VIRTQUEUE_ELEM_CACHE_SG || in_num > VIRTQUEUE_ELEM_CACHE_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    cache->sz = sz;
+    if (cache->len) {
+        elem = cache->elems[--cache->len];
+    } else {
+        elem = virtqueue_alloc_element(sz, VIRTQUEUE_ELEM_CACHE_SG,
+                                       VIRTQUEUE_ELEM_CACHE_SG);
+        elem->pooled = true;
+    }
+    elem->ndescs = 1;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    return elem;
+}
+
+void virtqueue_free_element(VirtQueue *vq, void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+    VirtQueueElementCache *cache = vq->elem_cache;
+
+    if (elem && elem->pooled && cache &&
+        cache->len < VIRTQUEUE_ELEM_CACHE_SIZE) {
+        cache->elems[cache->len++] = elem;
+        return;
+    }
+    g_free(elem);
+}
+
+static void virtqueue_free_element_cache(VirtQueue *vq)
+{
+    VirtQueueElementCache *cache = vq->elem_cache;
+
+    if (cache) {
+        while (cache->len) {
+            g_free(cache->elems[--cache->len]);
+        }
+        g_free(cache);
+        vq->elem_cache = NULL;
+    }
+}
+
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max, ndescs;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    VRingMemoryRegionCaches *caches;
     VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
 
-    if (virtio_queue_empty(vq)) {
+    if (virtio_queue_packed_empty(vq)) {
         return NULL;
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
+    /* Read the descriptor only after seeing it available */
     smp_rmb();
 
+    out_num = in_num = ndescs = 0;
+    max = vq->vring.num;
+    i = vq->last_avail_idx;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++ndescs > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        /* The buffer ID is in the last descriptor of a chain */
+        if (!indirect) {
+            id = desc.id;
+        }
+    } while ((i = virtqueue_packed_read_next_desc(vq, &desc, desc_cache,
+                                                  max, i, indirect)) != max);
+
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_get_element(vq, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+/* Pop the head at last_avail_idx, which the caller has seen available.
+ * The avail event is left to the caller.
+ */
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, head, max;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
 
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    desc_cache = &caches->desc;
+    vring_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -572,9 +1222,11 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
 
         /* loop over the indirect descriptor table */
         max = desc.len / sizeof(VRingDesc);
-        desc_pa = desc.addr;
+        address_space_cache_init(&indirect_desc_cache, &address_space_memory,
+                                 desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_cache, i);
     }
 
     /* Collect all the descriptors */
@@ -596,10 +1248,14 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                           max)) != max);
+
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_get_element(vq, sz, out_num, in_num);
     elem->index = head;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
@@ -616,6 +1272,57 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElement *elem;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    elem = virtqueue_split_pop(vq, sz);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+/* Like virtqueue_pop, but pop up to @max elements into @elems and return
+ * how many there were.  A split ring's avail index is read and its avail
+ * event written once for the whole batch.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int i, num;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        for (i = 0; i < max; i++) {
+            elems[i] = virtqueue_packed_pop(vq, sz);
+            if (!elems[i]) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    num = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    for (i = 0; i < num; i++) {
+        elems[i] = virtqueue_split_pop(vq, sz);
+    }
+    if (num && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return num;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -642,7 +1349,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     qemu_get_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
-    elem->index = data.index;
+    elem->index = data.index & 0xffff;
+    elem->ndescs = (data.index >> 16) ?: 1;
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -674,7 +1382,14 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
     int i;
 
     memset(&data, 0, sizeof(data));
+    /* Split ring heads and packed ring buffer IDs fit in 16 bits; the
+     * slots a packed ring buffer takes go in the top half, which older
+     * streams leave zero.
+     */
     data.index = elem->index;
+    if (elem->ndescs > 1) {
+        data.index |= elem->ndescs << 16;
+    }
     data.in_num = elem->in_num;
     data.out_num = elem->out_num;
 
@@ -806,7 +1521,11 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        virtio_init_region_cache(vdev, i);
     }
 }
 
@@ -1016,6 +1735,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_init_region_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1029,6 +1749,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_init_region_cache(vdev, n);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1141,6 +1862,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num_default = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].used_elems = g_new0(VirtQueueUsedElem, VIRTQUEUE_MAX_SIZE);
+    vdev->vq[i].elem_cache = g_new0(VirtQueueElementCache, 1);
+    virtio_init_region_cache(vdev, i);
 
     return &vdev->vq[i];
 }
@@ -1153,6 +1877,10 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtqueue_free_element_cache(&vdev->vq[n]);
+    virtio_init_region_cache(vdev, n);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1162,6 +1890,47 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    /* An event offset from the previous lap is behind used_idx */
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    vring_packed_event_read(vdev, &caches->avail, &e);
+    rcu_read_unlock();
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1174,6 +1943,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1232,6 +2005,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1278,6 +2058,35 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+/* Unlike a split ring, the used index of a packed ring cannot be read back
+ * from guest memory.
+ */
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(signalled_used, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1383,6 +2192,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -1581,7 +2391,15 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        /* The subsections may have changed the ring addresses.  */
+        virtio_init_region_cache(vdev, i);
+        if (vdev->vq[i].vring.desc &&
+            virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+            /* The packed ring state came with the subsection */
+            vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+            vdev->vq[i].shadow_avail_wrap_counter =
+                vdev->vq[i].last_avail_wrap_counter;
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1603,7 +2421,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        g_free(vdev->vq[i].used_elems);
+        virtqueue_free_element_cache(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1665,6 +2489,9 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1702,17 +2529,26 @@ hwaddr virtio_queue_get_ring_addr(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDesc) * vdev->vq[n].vring.num;
+    }
     return sizeof(VRingDesc) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1723,15 +2559,40 @@ hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 	    virtio_queue_get_used_size(vdev, n);
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/* For a packed ring the vhost ring base carries the wrap counters in bit
+ * 15 of each half, with the avail state in the low 16 bits and the used
+ * state in the high 16 bits.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        unsigned int avail = vq->last_avail_idx |
+                             vq->last_avail_wrap_counter << 15;
+        unsigned int used = vq->used_idx | vq->used_wrap_counter << 15;
+
+        return avail | used << 16;
+    }
+    return vq->last_avail_idx;
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vq->last_avail_idx = idx & 0x7fff;
+        vq->last_avail_wrap_counter = !!(idx & 0x8000);
+        vq->used_idx = (idx >> 16) & 0x7fff;
+        vq->used_wrap_counter = !!(idx & 0x80000000);
+        vq->shadow_avail_idx = vq->last_avail_idx;
+        vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+        return;
+    }
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1786,12 +2647,52 @@ static void virtio_queue_host_notifier_read(EventNotifier *n)
     }
 }
 
+/* Busy polling the avail ring saves the guest's notification, and the wakeup
+ * that it causes, when requests arrive back to back.
+ */
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_vq(vq);
+    return true;
+}
+
+/* The avail ring is being polled, so spare the guest its kicks */
+static void virtio_queue_host_notifier_aio_poll_begin(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (vq->vring.desc) {
+        virtio_queue_set_notification(vq, 0);
+    }
+}
+
+static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (vq->vring.desc) {
+        virtio_queue_set_notification(vq, 1);
+    }
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 bool assign, bool set_handler)
 {
     if (assign && set_handler) {
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
+        aio_set_event_notifier_poll_hooks(ctx, &vq->host_notifier,
+                                          virtio_queue_host_notifier_aio_poll_begin,
+                                          virtio_queue_host_notifier_aio_poll_end);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
     }
@@ -1848,6 +2749,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1855,7 +2759,9 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
+    int i;
 
+    memory_listener_unregister(&vdev->listener);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -1866,6 +2772,15 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
         }
     }
 
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VRingMemoryRegionCaches *caches = vdev->vq[i].vring.caches;
+
+        if (caches) {
+            atomic_rcu_set(&vdev->vq[i].vring.caches, NULL);
+            call_rcu(caches, virtio_free_region_cache, rcu);
+        }
+    }
+
     g_free(vdev->bus_name);
     vdev->bus_name = NULL;
 }
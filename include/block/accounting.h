@@ -28,6 +28,7 @@
 
 #include "qemu/typedefs.h"
 #include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -44,6 +45,16 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+/* A latency histogram with @nbins bins. With n = @nbins - 1 boundaries
+ * b[0] < ... < b[n - 1], bin 0 counts the requests whose latency is
+ * below b[0], bin i those in [b[i - 1], b[i]) and bin n those at or
+ * above b[n - 1]. It is disabled if @nbins is 0. */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries; /* in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -53,6 +64,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -79,5 +91,8 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
 
 #endif
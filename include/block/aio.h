@@ -21,6 +21,9 @@
 #include "qemu/thread.h"
 #include "qemu/rfifolock.h"
 #include "qemu/timer.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -48,6 +51,22 @@ typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
 
+/* Aligned buffers are pooled in power-of-two size classes from 4 KB to 1 MB.
+ * Free buffers of a class are chained through their first word.
+ */
+#define AIO_BUFFER_POOL_MIN_SHIFT   12
+#define AIO_BUFFER_POOL_MAX_SHIFT   20
+#define AIO_BUFFER_POOL_CLASSES     \
+    (AIO_BUFFER_POOL_MAX_SHIFT - AIO_BUFFER_POOL_MIN_SHIFT + 1)
+
+typedef struct AioBufferPool {
+    /* Buffers are also returned from thread pool workers */
+    QemuMutex lock;
+    void *free[AIO_BUFFER_POOL_CLASSES];
+    unsigned int nb_free[AIO_BUFFER_POOL_CLASSES];
+} AioBufferPool;
+typedef bool AioPollFn(void *opaque);
+
 struct AioContext {
     GSource source;
 
@@ -120,6 +139,10 @@ struct AioContext {
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
+    /* Worker thread bounds, see aio_context_set_thread_pool_params() */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
@@ -129,6 +152,27 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+    bool epoll_g_source;    /* the GSource polls epollfd, see below */
+    GPollFD epoll_pfd;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring(7) fd monitoring, preferred over epoll when available */
+    struct io_uring io_uring;
+    QSLIST_HEAD(, AioHandler) io_uring_submit_list;
+    bool io_uring_enabled;
+    bool io_uring_available;
+#endif
+
+    /* Adaptive polling, see aio_context_set_poll_params() */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+    uint64_t poll_hits;     /* polls that saw an event before timing out */
+    uint64_t poll_misses;   /* polls that timed out and had to block */
+
+    /* Recycled bounce buffers, see aio_buffer_pool_get() */
+    AioBufferPool buffer_pool;
 };
 
 /**
@@ -328,11 +372,61 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Set a polling callback for an event notifier that was registered with
+ * aio_set_event_notifier().  Before blocking, aio_poll() can busy-wait
+ * for a while calling @io_poll with the notifier as argument; @io_poll
+ * checks for new work without system calls (for example by looking at a
+ * ring shared with the kernel or with the guest), processes it and returns
+ * true, or returns false if there is nothing to do yet.
+ *
+ * The callback is dropped together with the handler.  Pass NULL to remove
+ * it.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/* Set callbacks for when aio_poll() starts and stops busy-waiting on an
+ * event notifier with a polling callback.  While polling, @io_poll_begin
+ * can tell the other side not to signal the notifier, since @io_poll will
+ * find the work anyway; @io_poll_end turns signalling back on.  aio_poll()
+ * calls the polling callback once more after @io_poll_end, so that work
+ * that was queued in between is not missed.
+ *
+ * Pass NULL to remove them.
+ */
+void aio_set_event_notifier_poll_hooks(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       EventNotifierHandler *io_poll_begin,
+                                       EventNotifierHandler *io_poll_end);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
 GSource *aio_get_g_source(AioContext *ctx);
 
+/**
+ * aio_buffer_pool_get:
+ * @ctx: the AioContext whose pool is used
+ * @size: size of the buffer in bytes
+ * @align: required alignment of the buffer
+ *
+ * Return a buffer of at least @size bytes aligned to @align, reusing one
+ * that was released with aio_buffer_pool_put() if possible.  Returns NULL
+ * if memory could not be allocated.  May be called from any thread.
+ */
+void *aio_buffer_pool_get(AioContext *ctx, size_t size, size_t align);
+
+/**
+ * aio_buffer_pool_put:
+ * @ctx: the AioContext that @buf was taken from
+ * @buf: the buffer, or NULL
+ * @size: the size that was passed to aio_buffer_pool_get()
+ *
+ * Release a buffer returned by aio_buffer_pool_get().
+ */
+void aio_buffer_pool_put(AioContext *ctx, void *buf, size_t size);
+
 /* Return the ThreadPool bound to this AioContext */
 struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 
@@ -442,4 +536,53 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_setup_g_source:
+ * @ctx: the aio context
+ *
+ * Prepare @ctx to be dispatched through its GSource.  Where the host
+ * supports it, the GSource then polls a single fd for all the handlers
+ * of @ctx instead of adding one GPollFD per handler.
+ */
+void aio_context_setup_g_source(AioContext *ctx);
+
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Release the resources acquired by aio_context_setup().
+ */
+void aio_context_destroy(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds, or 0 to disable
+ * @grow: polling time growth factor, or 0 for the default
+ * @shrink: polling time shrink factor, or 0 for the default
+ *
+ * Blocking aio_poll() calls first poll the handlers registered with
+ * aio_set_event_notifier_poll() for up to @max_ns nanoseconds.  The actual
+ * polling time adapts to how long aio_poll() ended up waiting: it grows by
+ * @grow when events arrive shortly after polling stopped and shrinks by
+ * @shrink (the default drops it to zero) when waits are longer than
+ * @max_ns, so that idle contexts do not burn CPU time.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads kept alive even when idle
+ * @max: maximum number of worker threads
+ *
+ * Bound the size of the thread pool returned by aio_get_thread_pool().
+ * Idle workers above @min exit after a while; they are spawned from the
+ * AioContext's own thread and so share its CPU affinity.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
 #endif
@@ -93,6 +93,7 @@ typedef struct HDGeometry {
 #define BDRV_O_PROTOCOL    0x8000  /* if no block driver is explicitly given:
                                       select an appropriate protocol driver,
                                       ignoring the format layer */
+#define BDRV_O_IO_URING    0x10000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -263,6 +264,21 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, BdrvRequestFlags flags);
+/*
+ * Copy a range from @src to @dst without passing the data through a QEMU
+ * buffer, for example with copy_file_range() on the host.  Returns -ENOTSUP
+ * if the drivers involved cannot offload the copy, in which case the caller
+ * must fall back to reading and writing the data itself.
+ */
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors,
+    BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -429,6 +445,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+int bdrv_get_host_fd(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t sector_num, int nb_sectors,
                             int64_t *cluster_sector_num,
@@ -472,6 +489,9 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size);
 void *qemu_blockalign0(BlockDriverState *bs, size_t size);
 void *qemu_try_blockalign(BlockDriverState *bs, size_t size);
 void *qemu_try_blockalign0(BlockDriverState *bs, size_t size);
+void *qemu_blockalign_pooled(BlockDriverState *bs, size_t size);
+void *qemu_try_blockalign_pooled(BlockDriverState *bs, size_t size);
+void qemu_vfree_pooled(BlockDriverState *bs, void *buf, size_t size);
 bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov);
 
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
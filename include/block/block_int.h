@@ -33,6 +33,7 @@
 #include "qemu/timer.h"
 #include "qapi-types.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -40,6 +41,8 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
+#define BLOCK_FLAG_LAZY_SNAPSHOTS   32
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -52,6 +55,8 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_LAZY_SNAPSHOTS    "lazy_snapshots"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 #define BLOCK_OPT_NOCOW             "nocow"
@@ -74,11 +79,16 @@ typedef struct BdrvTrackedRequest {
     unsigned int bytes;
     enum BdrvTrackedRequestType type;
 
+    /* Data and flags of a write, for before_write_notifiers */
+    QEMUIOVector *qiov;
+    int flags;
+
     bool serialising;
     int64_t overlap_offset;
     unsigned int overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode tree_node; /* covers [overlap_offset, overlap_bytes) */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
@@ -165,6 +175,21 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
+    /*
+     * Offloaded copies.  bdrv_co_copy_range_from() is called on the source
+     * node; a format driver hands the request to the child that holds the
+     * data, a protocol driver calls bdrv_co_copy_range_to() on @dst.
+     * bdrv_co_copy_range_to() is then called on the destination node and
+     * either passes the request further down or copies the data from the
+     * protocol node @src.  Both may be NULL, and -ENOTSUP means that the
+     * caller has to read and write the data itself.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        int64_t sector_num, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *src,
+        int64_t src_sector, BlockDriverState *bs, int64_t sector_num,
+        int nb_sectors, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -214,6 +239,9 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    /* Returns a host file descriptor from which the guest-visible data can
+     * be read directly at the same offsets, or a negative errno value. */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -305,6 +333,16 @@ struct BlockDriver {
      */
     void (*bdrv_drain)(BlockDriverState *bs);
 
+    /**
+     * Check whether a new persistent dirty bitmap @name with @granularity
+     * could be stored in the image.  Drivers that implement this store all
+     * persistent bitmaps of the node when it is closed or inactivated.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -364,6 +402,24 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+#define BDRV_BLOCK_STATUS_CACHE_SIZE 16
+
+/*
+ * A cached bdrv_co_get_block_status() result for the @nb_sectors sectors
+ * starting at @sector_num, or, in the status_above cache, the result of
+ * bdrv_co_get_block_status_above() down to @base, i.e. the status of the
+ * layer that owns the range.  Entries with @nb_sectors == 0 are unused.
+ */
+typedef struct BdrvBlockStatusEntry {
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t ret;
+    BlockDriverState *file;
+    BlockDriverState *base;
+    uint64_t gen;
+    uint64_t epoch;
+} BdrvBlockStatusEntry;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -422,6 +478,10 @@ struct BlockDriverState {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockDriverState) round_robin;
+    unsigned       throttle_weight;
+    int64_t        throttle_latency_target_ns;
+    uint64_t       throttle_vtime[2];
+    int64_t        throttle_wait_start[2];
 
     /* Offset after the highest byte written to */
     uint64_t wr_highest_offset;
@@ -452,6 +512,7 @@ struct BlockDriverState {
     int refcnt;
 
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_tree; /* the same requests, by overlap range */
 
     /* operation blockers */
     QLIST_HEAD(, BdrvOpBlocker) op_blockers[BLOCK_OP_TYPE_MAX];
@@ -478,6 +539,13 @@ struct BlockDriverState {
     NotifierWithReturn write_threshold_notifier;
 
     int quiesce_counter;
+
+    /* block status caches, see bdrv_block_status_invalidate() */
+    BdrvBlockStatusEntry status_cache[BDRV_BLOCK_STATUS_CACHE_SIZE];
+    BdrvBlockStatusEntry status_above[BDRV_BLOCK_STATUS_CACHE_SIZE];
+    unsigned status_cache_next;
+    unsigned status_above_next;
+    uint64_t status_gen;
 };
 
 struct BlockBackendRootState {
@@ -487,6 +555,8 @@ struct BlockBackendRootState {
 
     char *throttle_group;
     ThrottleState *throttle_state;
+    unsigned throttle_weight;
+    int64_t throttle_latency_target_ns;
 };
 
 static inline BlockDriverState *backing_bs(BlockDriverState *bs)
@@ -590,6 +660,8 @@ int is_windows_drive(const char *filename);
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of chunks copied in parallel.
+ * @adaptive: Whether to reduce parallelism when guest I/O gets slower.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -602,7 +674,8 @@ int is_windows_drive(const char *filename);
  * @base_id in the written image and to @base in the live BlockDriverState.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
+                  const char *base_id, int64_t speed,
+                  int max_in_flight, bool adaptive, BlockdevOnError on_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -652,6 +725,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: Whether guest writes are also copied to @target synchronously.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -666,7 +740,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -679,6 +753,9 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
+ * @max_workers: The maximum number of copy requests in flight.
+ * @max_chunk: The maximum size of a copy request in bytes, or 0 to copy
+ * one cluster per request.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @txn: Transaction that this job is part of (may be NULL).
@@ -691,6 +768,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
+                  int64_t max_workers, int64_t max_chunk,
                   BlockCompletionFunc *cb, void *opaque,
                   BlockJobTxn *txn, Error **errp);
 
@@ -707,6 +785,8 @@ bool blk_dev_is_medium_locked(BlockBackend *blk);
 void blk_dev_resize_cb(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
+void bdrv_block_status_invalidate(BlockDriverState *bs);
+void bdrv_block_status_invalidate_all(void);
 bool bdrv_requests_pending(BlockDriverState *bs);
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
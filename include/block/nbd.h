@@ -37,14 +37,39 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* The remaining fields describe a chunk of a structured reply.  Simple
+     * replies are returned as a single chunk with NBD_REPLY_FLAG_DONE set.
+     */
+    bool structured;
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* A block status descriptor for the "base:allocation" metadata context */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;                 /* NBD_STATE_* */
+} NBDExtent;
+
+/* Protocol extensions that nbd_receive_negotiate() asks the server for.
+ * Those that the server does not support are cleared on return.
+ */
+typedef struct NBDExtensions {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t meta_context_id;       /* valid if base_allocation is set */
+} NBDExtensions;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_DF        (1 << 7)        /* Send DF (don't fragment) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections are
+                                                   consistent with each other */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -55,23 +80,44 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Metadata context. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_POLICY      ((UINT32_C(1) << 31) | 2) /* Server denied */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 #define NBD_REP_ERR_TLS_REQD    ((UINT32_C(1) << 31) | 5) /* TLS required */
+#define NBD_REP_ERR_UNKNOWN     ((UINT32_C(1) << 31) | 6) /* Unknown export */
 
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_DF		(1 << 18)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply flags and chunk types. */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply */
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR_BIT    (1 << 15)
+#define NBD_REPLY_TYPE_ERROR        (NBD_REPLY_TYPE_ERROR_BIT | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET (NBD_REPLY_TYPE_ERROR_BIT | 2)
+
+/* Flags of the "base:allocation" metadata context. */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -83,10 +129,11 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
                      size_t offset,
                      size_t length,
                      bool do_read);
+ssize_t nbd_drop(QIOChannel *ioc, size_t size);
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDExtensions *ext, Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint32_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply);
@@ -28,6 +28,11 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+/* Relative weight of a BlockDriverState within its throttling group */
+#define THROTTLE_GROUP_WEIGHT_MIN       1
+#define THROTTLE_GROUP_WEIGHT_DEFAULT   100
+#define THROTTLE_GROUP_WEIGHT_MAX       10000
+
 const char *throttle_group_get_name(BlockDriverState *bs);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -36,6 +41,11 @@ void throttle_group_unref(ThrottleState *ts);
 void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
 
+void throttle_group_set_share(BlockDriverState *bs, unsigned weight,
+                              int64_t latency_target_ns);
+void throttle_group_get_share(BlockDriverState *bs, unsigned *weight,
+                              int64_t *latency_target_ns);
+
 void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
 void throttle_group_unregister_bs(BlockDriverState *bs);
 
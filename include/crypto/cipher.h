@@ -230,4 +230,57 @@ int qcrypto_cipher_setiv(QCryptoCipher *cipher,
                          const uint8_t *iv, size_t niv,
                          Error **errp);
 
+/**
+ * qcrypto_cipher_encrypt_sectors:
+ * @cipher: the cipher object
+ * @sector: the number of the first sector
+ * @sector_size: the size of each sector in bytes
+ * @in: buffer holding the plain text input data
+ * @out: buffer to fill with the cipher text output data
+ * @len: the length of @in and @out buffers
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Encrypts consecutive sectors of @sector_size bytes each,
+ * starting at sector number @sector, as disk encryption
+ * formats do.  Every sector is encrypted on its own, with
+ * the "plain64" initialization vector, i.e. its sector
+ * number in little endian, padded with zeroes.  @cipher
+ * must use a mode that requires initialization vectors,
+ * such as CBC or XTS, and @len must be a multiple of
+ * @sector_size.  This replaces one qcrypto_cipher_setiv()
+ * and one qcrypto_cipher_encrypt() call per sector.
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_encrypt_sectors(QCryptoCipher *cipher,
+                                   uint64_t sector,
+                                   size_t sector_size,
+                                   const void *in,
+                                   void *out,
+                                   size_t len,
+                                   Error **errp);
+
+/**
+ * qcrypto_cipher_decrypt_sectors:
+ * @cipher: the cipher object
+ * @sector: the number of the first sector
+ * @sector_size: the size of each sector in bytes
+ * @in: buffer holding the cipher text input data
+ * @out: buffer to fill with the plain text output data
+ * @len: the length of @in and @out buffers
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Decrypts consecutive sectors that were encrypted with
+ * qcrypto_cipher_encrypt_sectors().
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_decrypt_sectors(QCryptoCipher *cipher,
+                                   uint64_t sector,
+                                   size_t sector_size,
+                                   const void *in,
+                                   void *out,
+                                   size_t len,
+                                   Error **errp);
+
 #endif /* QCRYPTO_CIPHER_H__ */
@@ -27,6 +27,7 @@
 #include "tcg-target.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "qemu/rcu.h"
 #endif
 #include "exec/memattrs.h"
 
@@ -63,6 +64,16 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The main TLB of each MMU mode is resized between these bounds whenever
+ * it is flushed, depending on how many of its entries were in use.  The
+ * TCG backend finds the table and its size through env->tlb_table and
+ * env->tlb_mask, so there is no displacement limit to respect.
+ */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 16
+#else
 /* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_BITS to ensure that
  * the TLB is not unnecessarily small, but still small enough for the
  * TLB lookup instruction sequence used by the TCG target.
@@ -94,6 +105,7 @@ typedef uint64_t target_ulong;
          NB_MMU_MODES <= 8 ? 3 : 4))
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif
 
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
@@ -128,16 +140,66 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* The TLB holds large pages as several TARGET_PAGE_SIZE entries, so the
+ * areas covered by large pages are remembered in order to flush all of a
+ * large page when any part of it is flushed.  An addr of -1 marks an
+ * unused range.
+ */
+#define CPU_TLB_LARGE_RANGES 4
+
+typedef struct CPUTLBLargeRange {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargeRange;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The main TLB and IOTLB of one MMU mode, owned by CPUState::tlb_tables.
+ * Other threads may walk the tables (see tlb_reset_dirty), so a resize
+ * replaces the whole structure and frees the old one after an RCU grace
+ * period.
+ */
+typedef struct CPUTLBTables {
+    struct rcu_head rcu;
+    size_t n_entries;
+    CPUTLBEntry *table;
+    CPUIOTLBEntry *iotlb;
+} CPUTLBTables;
+
+typedef struct CPUTLBDesc {
+    /* start of the current measurement window and the largest number
+       of entries used at a flush within it */
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    /* entries filled since the last flush */
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+#define CPU_COMMON_TLB \
+    /* The meaning of the MMU modes is defined in the target code. */   \
+    /* tlb_mask is (number of entries - 1) << CPU_TLB_ENTRY_BITS; it */ \
+    /* and tlb_table are read by the TCG fast path.  These fields are */ \
+    /* copied from cpu->tlb_tables again on every TLB flush.  */        \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
+    CPUTLBLargeRange tlb_large[CPU_TLB_LARGE_RANGES];                   \
+    target_ulong vtlb_index;                                            \
+
+#else
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;                                        \
+    CPUTLBLargeRange tlb_large[CPU_TLB_LARGE_RANGES];                   \
     target_ulong vtlb_index;                                            \
 
+#endif
+
 #else
 
 #define CPU_COMMON_TLB
@@ -26,6 +26,11 @@ void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length);
 extern int tlb_flush_count;
+/* flushes requested for other vCPUs, the batches they were collected in
+   and the batches that overflowed into a full flush */
+extern unsigned tlb_flush_remote_count;
+extern unsigned tlb_flush_batch_count;
+extern unsigned tlb_flush_batch_full_count;
 
 #endif
 #endif
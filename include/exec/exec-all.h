@@ -78,9 +78,13 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags);
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
+void QEMU_NORETURN cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc);
+void cpu_exec_step_atomic(CPUState *cpu);
 
 #if !defined(CONFIG_USER_ONLY)
 void cpu_reloading_memory_map(void);
@@ -122,6 +126,25 @@ AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx);
  * MMU indexes.
  */
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Flush all the pages that overlap [@addr, @addr + @len) from the TLB of
+ * the specified CPU, for all MMU indexes.  Unlike a series of
+ * tlb_flush_page calls, this scans the TLB at most once.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the softmmu TLB of @cpu, if its size is not fixed at compile
+ * time, and the batch that collects flushes requested by other threads.
+ */
+void tlb_init(CPUState *cpu);
 /**
  * tlb_flush:
  * @cpu: CPU whose TLB should be flushed
@@ -191,10 +214,19 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
 
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
+
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
@@ -211,8 +243,20 @@ static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
+
+/* The code buffer is split into up to CODE_GEN_MAX_REGIONS regions of at
+   least CODE_GEN_MIN_REGION_SIZE bytes each.  In user mode every guest
+   thread generates code into a region of its own, so there are more of
+   them.  */
+#if defined(CONFIG_USER_ONLY)
+#define CODE_GEN_MAX_REGIONS     64
+#define CODE_GEN_MIN_REGION_SIZE (512 * 1024)
+#else
+#define CODE_GEN_MAX_REGIONS     8
+#define CODE_GEN_MIN_REGION_SIZE (2 * 1024 * 1024)
+#endif
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -245,11 +289,20 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_HOT         0x80000 /* Retranslated after becoming hot */
+
+    /* number of times the TB was entered from cpu_exec() or from an
+       indirect branch lookup; the block is retranslated with CF_HOT once
+       this reaches TB_HOT_THRESHOLD.  Updated without a lock, so it is
+       only an estimate. */
+    uint32_t exec_count;
+
+    /* set once the TB has been removed from the hash table; lock-free
+       readers must not chain to an invalid TB */
+    bool invalid;
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -274,24 +327,71 @@ struct TranslationBlock {
 };
 
 #include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
+typedef struct TBRegion TBRegion;
+
+/* A slice of the code buffer together with the TBs translated into it.
+   Regions are filled in turn; TBs within a region are sorted by tc_ptr. */
+struct TBRegion {
+    void *start;
+    void *end;
+    /* end of the generated code */
+    void *ptr;
+    TranslationBlock *tbs;
+    int nb_tbs;
+    /* the translation context generating code into the region, if any */
+    struct TCGContext *owner;
+    /* set while the owner generates code without holding tb_lock */
+    bool translating;
+};
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* physical PC hash table; lookups are lock-free, updates need tb_lock */
+    struct qht htable;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int nb_regions;
+    /* the region entered last */
+    int cur_region;
+    size_t region_size;
+    int region_max_tbs;
+
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_region_evict_count;
+    int tb_hot_count;
+    /* bytes of host code generated since the last full flush */
+    uint64_t code_gen_bytes;
+    /* TBs translated since startup and the time spent translating them */
+    uint64_t tb_gen_count;
+    int64_t tb_gen_time;
+    /* direct jumps patched from one TB to another */
+    uint64_t tb_chain_count;
+    /* helper calls in the generated code */
+    uint64_t helper_call_count;
+    /* guest writes to pages containing code, those of them that the code
+       bitmap showed not to hit any TB, and the TBs they invalidated */
+    uint64_t smc_write_count;
+    uint64_t smc_write_skip_count;
+    uint64_t smc_invalidate_count;
 
     int tb_invalidated_flag;
 };
 
+extern TBContext tb_ctx;
+
+/* Targets that define TARGET_HAS_HOT_TB translate a block again with
+   CF_HOT after it has been looked up this many times.  */
+#define TB_HOT_THRESHOLD 1024
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
@@ -422,6 +522,9 @@ void tlb_fill(CPUState *cpu, target_ulong addr, int is_write, int mmu_idx,
 #if defined(CONFIG_USER_ONLY)
 void mmap_lock(void);
 void mmap_unlock(void);
+void mmap_read_lock(void);
+void mmap_read_unlock(void);
+void mmap_read_lock_reset(void);
 
 static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 {
@@ -430,6 +533,9 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong
 #else
 static inline void mmap_lock(void) {}
 static inline void mmap_unlock(void) {}
+static inline void mmap_read_lock(void) {}
+static inline void mmap_read_unlock(void) {}
+static inline void mmap_read_lock_reset(void) {}
 
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
@@ -439,11 +545,13 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr);
 
 /* exec.c */
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
+void notdirty_write_begin(ram_addr_t ram_addr, unsigned size);
+void notdirty_write_end(CPUState *cpu, ram_addr_t ram_addr, unsigned size);
 
 MemoryRegionSection *
 address_space_translate_for_iotlb(CPUState *cpu, int asidx, hwaddr addr,
                                   hwaddr *xlat, hwaddr *plen);
-hwaddr memory_region_section_get_iotlb(CPUState *cpu,
+hwaddr memory_region_section_get_iotlb(CPUState *cpu, int asidx,
                                        MemoryRegionSection *section,
                                        target_ulong vaddr,
                                        hwaddr paddr, hwaddr xlat,
@@ -34,9 +34,9 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_movi_i32(imm, 0xdeadbeef);
 
     /* This is a horrid hack to allow fixing up the value later.  */
-    i = tcg_ctx.gen_last_op_idx;
-    i = tcg_ctx.gen_op_buf[i].args;
-    icount_arg = &tcg_ctx.gen_opparam_buf[i + 1];
+    i = tcg_ctx->gen_last_op_idx;
+    i = tcg_ctx->gen_op_buf[i].args;
+    icount_arg = tcg_ctx->gen_opparam_buf[i + 1];
 
     tcg_gen_sub_i32(count, count, imm);
     tcg_temp_free_i32(imm);
@@ -59,7 +59,7 @@ static void gen_tb_end(TranslationBlock *tb, int num_insns)
     }
 
     /* Terminate the linked list.  */
-    tcg_ctx.gen_op_buf[tcg_ctx.gen_last_op_idx].next = -1;
+    tcg_ctx->gen_op_buf[tcg_ctx->gen_last_op_idx].next = -1;
 }
 
 static inline void gen_io_start(void)
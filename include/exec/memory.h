@@ -155,6 +155,18 @@ struct MemoryRegionIOMMUOps {
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
 typedef struct MemoryRegionIoeventfd MemoryRegionIoeventfd;
 
+/* Accesses dispatched to a region while memory_region_profile_enable()
+ * is in effect.  Times are in nanoseconds and include the callbacks.
+ */
+typedef struct MemoryRegionProfile {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t read_ns;
+    uint64_t write_ns;
+} MemoryRegionProfile;
+
 struct MemoryRegion {
     Object parent_obj;
 
@@ -196,6 +208,7 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+    MemoryRegionProfile profile;
 };
 
 /**
@@ -234,6 +247,16 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+typedef struct AddressSpaceMapClient {
+    QEMUBH *bh;
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
+
+/* Default limit on the bounce buffers an address space may have mapped at
+ * the same time, in bytes.
+ */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (64 * 1024)
+
 struct AddressSpace {
     /* All fields are private. */
     struct rcu_head rcu;
@@ -244,12 +267,29 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    /* During memory_region_transaction_commit(), the new map if it
+     * differs from current_map, NULL otherwise.
+     */
+    struct FlatView *next_map;
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
+    /* The dispatch tree of current_map, accessed via RCU.  */
     struct AddressSpaceDispatch *dispatch;
-    struct AddressSpaceDispatch *next_dispatch;
-    MemoryListener dispatch_listener;
+
+    /* Bounce buffers used by address_space_map() for accesses that cannot
+     * be done directly.  bounce_buffer_size is the total size of the
+     * buffers currently mapped, which may not exceed
+     * max_bounce_buffer_size.  bounce_lock protects the buffer list and
+     * map_client_list.
+     */
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    unsigned bounce_maps;
+    unsigned bounce_map_failures;
+    QemuMutex bounce_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
@@ -1140,7 +1180,32 @@ void memory_global_dirty_log_start(void);
  */
 void memory_global_dirty_log_stop(void);
 
-void mtree_info(fprintf_function mon_printf, void *f);
+void mtree_info(fprintf_function mon_printf, void *f, bool profile);
+
+/**
+ * memory_region_profile_enable: start or stop counting the accesses that
+ * memory_region_dispatch_read() and memory_region_dispatch_write() pass
+ * to each region, and the time spent handling them.
+ *
+ * @enable: true to start counting, false to stop
+ */
+void memory_region_profile_enable(bool enable);
+
+/**
+ * memory_region_profile_reset: clear the counters of all the regions
+ * reachable from an address space.
+ */
+void memory_region_profile_reset(void);
+
+/**
+ * memory_region_profile_foreach: call @fn for each region reachable from an
+ * address space that has been accessed while profiling was enabled.
+ *
+ * @fn: the function to call
+ * @opaque: passed to @fn
+ */
+void memory_region_profile_foreach(void (*fn)(MemoryRegion *mr, void *opaque),
+                                   void *opaque);
 
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
@@ -1348,8 +1413,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1373,6 +1438,199 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: ask to be told when mapping may succeed
+ *
+ * Schedules @bh once address_space_map() on @as is likely to succeed
+ * again, that is when one of its bounce buffers is released, or right away
+ * if none is in use.
+ *
+ * @as: #AddressSpace whose mappings failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/**
+ * MemoryRegionCache: the translation of a guest-physical range, done once
+ * and reused by frequent accesses to the range, for example a virtqueue.
+ *
+ * When the whole range is RAM, accesses through the cache go straight to
+ * host memory; otherwise they fall back to the address_space_* functions.
+ * The cache holds a reference to the memory region it points into, but it
+ * is not updated when the memory map changes: users must initialize it
+ * again from a #MemoryListener commit callback.
+ */
+typedef struct MemoryRegionCache {
+    uint8_t *ptr;
+    hwaddr addr;
+    hwaddr len;
+    hwaddr ram_addr;
+    AddressSpace *as;
+    MemoryRegion *mr;
+} MemoryRegionCache;
+
+#define MEMORY_REGION_CACHE_INVALID ((MemoryRegionCache) { .mr = NULL })
+
+/* address_space_cache_init: translate a guest-physical range into a cache
+ *
+ * Returns the number of bytes from @addr that can be accessed directly,
+ * which may be less than @len or 0; the rest of the range is still
+ * accessible through the slow path.
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the range
+ * @is_write: whether the cache will be used for stores
+ */
+int64_t address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                                 hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_invalidate: mark a range written through the cache dirty
+ *
+ * Called by the store accessors below; users that write through
+ * cache->ptr themselves must call it too.
+ *
+ * @cache: the #MemoryRegionCache that was written to
+ * @addr: offset of the write within the cached range
+ * @access_len: length of the write
+ */
+void address_space_cache_invalidate(MemoryRegionCache *cache, hwaddr addr,
+                                    hwaddr access_len);
+
+/* address_space_cache_destroy: drop the reference held by a cache
+ *
+ * @cache: the #MemoryRegionCache to be released
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
+static inline bool address_space_cache_is_direct(MemoryRegionCache *cache,
+                                                 hwaddr addr, hwaddr len)
+{
+    return likely(cache->ptr && addr <= cache->len && len <= cache->len - addr);
+}
+
+/* Accessors for a range described by a #MemoryRegionCache; @addr is
+ * relative to the start of the range.
+ */
+static inline uint32_t address_space_lduw_le_cached(MemoryRegionCache *cache,
+                                                    hwaddr addr)
+{
+    if (address_space_cache_is_direct(cache, addr, 2)) {
+        return lduw_le_p(cache->ptr + addr);
+    }
+    return address_space_lduw_le(cache->as, cache->addr + addr,
+                                 MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline uint32_t address_space_lduw_be_cached(MemoryRegionCache *cache,
+                                                    hwaddr addr)
+{
+    if (address_space_cache_is_direct(cache, addr, 2)) {
+        return lduw_be_p(cache->ptr + addr);
+    }
+    return address_space_lduw_be(cache->as, cache->addr + addr,
+                                 MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline uint32_t address_space_ldl_le_cached(MemoryRegionCache *cache,
+                                                   hwaddr addr)
+{
+    if (address_space_cache_is_direct(cache, addr, 4)) {
+        return ldl_le_p(cache->ptr + addr);
+    }
+    return address_space_ldl_le(cache->as, cache->addr + addr,
+                                MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline uint32_t address_space_ldl_be_cached(MemoryRegionCache *cache,
+                                                   hwaddr addr)
+{
+    if (address_space_cache_is_direct(cache, addr, 4)) {
+        return ldl_be_p(cache->ptr + addr);
+    }
+    return address_space_ldl_be(cache->as, cache->addr + addr,
+                                MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline void address_space_stw_le_cached(MemoryRegionCache *cache,
+                                               hwaddr addr, uint32_t val)
+{
+    if (address_space_cache_is_direct(cache, addr, 2)) {
+        stw_le_p(cache->ptr + addr, val);
+        address_space_cache_invalidate(cache, addr, 2);
+        return;
+    }
+    address_space_stw_le(cache->as, cache->addr + addr, val,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline void address_space_stw_be_cached(MemoryRegionCache *cache,
+                                               hwaddr addr, uint32_t val)
+{
+    if (address_space_cache_is_direct(cache, addr, 2)) {
+        stw_be_p(cache->ptr + addr, val);
+        address_space_cache_invalidate(cache, addr, 2);
+        return;
+    }
+    address_space_stw_be(cache->as, cache->addr + addr, val,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline void address_space_stl_le_cached(MemoryRegionCache *cache,
+                                               hwaddr addr, uint32_t val)
+{
+    if (address_space_cache_is_direct(cache, addr, 4)) {
+        stl_le_p(cache->ptr + addr, val);
+        address_space_cache_invalidate(cache, addr, 4);
+        return;
+    }
+    address_space_stl_le(cache->as, cache->addr + addr, val,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline void address_space_stl_be_cached(MemoryRegionCache *cache,
+                                               hwaddr addr, uint32_t val)
+{
+    if (address_space_cache_is_direct(cache, addr, 4)) {
+        stl_be_p(cache->ptr + addr, val);
+        address_space_cache_invalidate(cache, addr, 4);
+        return;
+    }
+    address_space_stl_be(cache->as, cache->addr + addr, val,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static inline void address_space_read_cached(MemoryRegionCache *cache,
+                                             hwaddr addr, void *buf, int len)
+{
+    if (address_space_cache_is_direct(cache, addr, len)) {
+        memcpy(buf, cache->ptr + addr, len);
+        return;
+    }
+    address_space_rw(cache->as, cache->addr + addr, MEMTXATTRS_UNSPECIFIED,
+                     buf, len, false);
+}
+
+static inline void address_space_write_cached(MemoryRegionCache *cache,
+                                              hwaddr addr, const void *buf,
+                                              int len)
+{
+    if (address_space_cache_is_direct(cache, addr, len)) {
+        memcpy(cache->ptr + addr, buf, len);
+        address_space_cache_invalidate(cache, addr, len);
+        return;
+    }
+    address_space_write(cache->as, cache->addr + addr, MEMTXATTRS_UNSPECIFIED,
+                        buf, len);
+}
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
@@ -36,6 +36,13 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    size_t page_size;
+    /* x-mapped-ram: pages present in the file, and where the bitmap and
+     * the pages are stored in it.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -327,10 +334,7 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         unsigned long offset;
         long k;
         long nr = BITS_TO_LONGS(pages);
-
-        idx = (start >> TARGET_PAGE_BITS) / DIRTY_MEMORY_BLOCK_SIZE;
-        offset = BIT_WORD((start >> TARGET_PAGE_BITS) %
-                          DIRTY_MEMORY_BLOCK_SIZE);
+        bool code = tcg_enabled();
 
         rcu_read_lock();
 
@@ -338,21 +342,32 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
             blocks[i] = atomic_rcu_read(&ram_list.dirty_memory[i])->blocks;
         }
 
-        for (k = 0; k < nr; k++) {
+        k = 0;
+        while (k < nr) {
+            unsigned long temp;
+
+            /* Most of the bitmap is usually clean: skip it 64 words at
+             * a time.
+             */
+            if (!(k & 63) && nr - k >= 64 &&
+                buffer_is_zero(bitmap + k, 64 * sizeof(unsigned long))) {
+                k += 64;
+                continue;
+            }
+
             if (bitmap[k]) {
-                unsigned long temp = leul_to_cpu(bitmap[k]);
+                temp = leul_to_cpu(bitmap[k]);
+                page = (start >> TARGET_PAGE_BITS) + k * BITS_PER_LONG;
+                idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+                offset = BIT_WORD(page % DIRTY_MEMORY_BLOCK_SIZE);
 
                 atomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset], temp);
                 atomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
-                if (tcg_enabled()) {
+                if (code) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
                 }
             }
-
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
+            k++;
         }
 
         rcu_read_unlock();
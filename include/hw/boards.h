@@ -41,6 +41,7 @@ int machine_kvm_shadow_mem(MachineState *machine);
 int machine_phandle_start(MachineState *machine);
 bool machine_dump_guest_core(MachineState *machine);
 bool machine_mem_merge(MachineState *machine);
+bool machine_share_rom(MachineState *machine);
 
 /**
  * CPUArchId:
@@ -147,6 +148,7 @@ struct MachineState {
     char *dt_compatible;
     bool dump_guest_core;
     bool mem_merge;
+    bool share_rom;
     bool usb;
     bool usb_disabled;
     bool igd_gfx_passthru;
@@ -72,6 +72,8 @@ struct SerialState {
     int poll_msl;
 
     QEMUTimer *modem_status_poll;
+    /* sends the transmit FIFO once the guest has filled it */
+    QEMUBH *xmit_bh;
     MemoryRegion io;
 };
 
@@ -124,6 +124,24 @@ MemoryRegion *rom_add_blob(const char *name, const void *blob, size_t len,
                            const char *fw_file_name,
                            FWCfgReadCallback fw_callback,
                            void *callback_opaque);
+/**
+ * rom_init_mr_from_file: create a RAM region holding a firmware file
+ * @mr: the #MemoryRegion to initialize
+ * @owner: the object that owns the region
+ * @name: the name of the region
+ * @path: path to the firmware file
+ * @size: size of the region; the part not covered by the file is zero
+ * @errp: pointer to Error*, to store an error if it happens
+ *
+ * With the share-rom machine property the region is a copy-on-write
+ * mapping of the file, so that guests using the same firmware share its
+ * pages; otherwise the file is read into a newly allocated RAM region.
+ * Unlike load_image_mr() the file is not registered as a ROM and is not
+ * reinstated on reset, so the region should be read-only for the guest.
+ * Returns a pointer to the contents of the region, or NULL on failure.
+ */
+void *rom_init_mr_from_file(MemoryRegion *mr, Object *owner, const char *name,
+                            const char *path, uint64_t size, Error **errp);
 int rom_add_elf_program(const char *name, void *data, size_t datasize,
                         size_t romsize, hwaddr addr);
 int rom_check_and_register_reset(void);
@@ -280,6 +280,8 @@ struct PCIDevice {
     MemoryRegion msix_pba_mmio;
     /* Reference-count for entries actually in use by driver. */
     unsigned *msix_entry_used;
+    /* KVM routes and irqfds used by msix_notify(), one per entry */
+    struct MSIXVectorRoute *msix_routes;
     /* MSIX function mask set or MSIX disabled */
     bool msix_function_masked;
     /* Version id needed for VMState */
@@ -300,6 +302,9 @@ struct PCIDevice {
     MemoryRegion rom;
     uint32_t rom_bar;
 
+    /* Limit on the DMA bounce buffers of bus_master_as */
+    uint64_t max_bounce_buffer_size;
+
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
 
@@ -69,6 +69,14 @@ typedef struct VFIOAddressSpace {
 
 struct VFIOGroup;
 
+typedef struct VFIODMARange {
+    hwaddr iova;
+    hwaddr size;
+    void *vaddr;
+    bool readonly;
+    QTAILQ_ENTRY(VFIODMARange) next;
+} VFIODMARange;
+
 typedef struct VFIOContainer {
     VFIOAddressSpace *space;
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
@@ -82,6 +90,16 @@ typedef struct VFIOContainer {
      */
     hwaddr min_iova, max_iova;
     uint64_t iova_pgsizes;
+    /*
+     * Host DMA mappings, coalesced where guest memory is contiguous, and
+     * the ones queued until the end of the current memory transaction.
+     * Unless @dma_split_unmap, the host IOMMU refuses to unmap part of a
+     * mapping.
+     */
+    GTree *dma_ranges;
+    QTAILQ_HEAD(VFIODMARangeList, VFIODMARange) dma_pending;
+    bool dma_batch;
+    bool dma_split_unmap;
     QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
     QLIST_HEAD(, VFIOGroup) group_list;
     QLIST_ENTRY(VFIOContainer) next;
@@ -154,5 +172,8 @@ extern QLIST_HEAD(vfio_as_head, VFIOAddressSpace) vfio_address_spaces;
 #ifdef CONFIG_LINUX
 int vfio_get_region_info(VFIODevice *vbasedev, int index,
                          struct vfio_region_info **info);
+struct vfio_info_cap_header *
+vfio_get_region_info_cap(struct vfio_region_info *info, uint16_t id);
+bool vfio_has_region_cap(VFIODevice *vbasedev, int region, uint16_t cap_type);
 #endif
 #endif /* !HW_VFIO_VFIO_COMMON_H */
@@ -39,6 +39,8 @@ struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
     struct vhost_memory *mem;
+    /* the table the backend last got, NULL until the device starts */
+    struct vhost_memory *backend_mem;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
@@ -84,5 +86,7 @@ uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
                             uint64_t features);
 void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
                         uint64_t features);
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len);
 bool vhost_has_free_slot(void);
 #endif
@@ -40,6 +40,16 @@ static inline uint16_t virtio_lduw_phys(VirtIODevice *vdev, hwaddr pa)
     return lduw_le_phys(&address_space_memory, pa);
 }
 
+static inline uint16_t virtio_lduw_phys_cached(VirtIODevice *vdev,
+                                               MemoryRegionCache *cache,
+                                               hwaddr pa)
+{
+    if (virtio_access_is_big_endian(vdev)) {
+        return address_space_lduw_be_cached(cache, pa);
+    }
+    return address_space_lduw_le_cached(cache, pa);
+}
+
 static inline uint32_t virtio_ldl_phys(VirtIODevice *vdev, hwaddr pa)
 {
     if (virtio_access_is_big_endian(vdev)) {
@@ -66,6 +76,17 @@ static inline void virtio_stw_phys(VirtIODevice *vdev, hwaddr pa,
     }
 }
 
+static inline void virtio_stw_phys_cached(VirtIODevice *vdev,
+                                          MemoryRegionCache *cache,
+                                          hwaddr pa, uint16_t value)
+{
+    if (virtio_access_is_big_endian(vdev)) {
+        address_space_stw_be_cached(cache, pa, value);
+    } else {
+        address_space_stw_le_cached(cache, pa, value);
+    }
+}
+
 static inline void virtio_stl_phys(VirtIODevice *vdev, hwaddr pa,
                                    uint32_t value)
 {
@@ -76,6 +97,17 @@ static inline void virtio_stl_phys(VirtIODevice *vdev, hwaddr pa,
     }
 }
 
+static inline void virtio_stl_phys_cached(VirtIODevice *vdev,
+                                          MemoryRegionCache *cache,
+                                          hwaddr pa, uint32_t value)
+{
+    if (virtio_access_is_big_endian(vdev)) {
+        address_space_stl_be_cached(cache, pa, value);
+    } else {
+        address_space_stl_le_cached(cache, pa, value);
+    }
+}
+
 static inline void virtio_stw_p(VirtIODevice *vdev, void *ptr, uint16_t v)
 {
     if (virtio_access_is_big_endian(vdev)) {
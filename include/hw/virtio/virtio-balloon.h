@@ -31,9 +31,28 @@ typedef struct virtio_balloon_stat_modern {
        uint64_t val;
 } VirtIOBalloonStatModern;
 
+#define VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN 0x80000000
+#define VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MAX 0xffffffff
+
+enum virtio_balloon_free_page_hint_status {
+    FREE_PAGE_HINT_S_STOP = 0,
+    FREE_PAGE_HINT_S_REQUESTED = 1,
+    FREE_PAGE_HINT_S_START = 2,
+    FREE_PAGE_HINT_S_DONE = 3,
+};
+
+/* Contiguous balloon pages of one RAM block, released with one call */
+typedef struct VirtIOBalloonRun {
+    RAMBlock *rb;
+    void *host;
+    ram_addr_t offset;
+    ram_addr_t len;
+    bool deflate;
+} VirtIOBalloonRun;
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -43,6 +62,18 @@ typedef struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    uint32_t free_page_hint_cmd_id;
+    uint32_t free_page_hint_status;
+    /* Tell the guest to release its hints once the VM runs again */
+    bool free_page_hint_done_pending;
+    Notifier free_page_hint_notify;
+    VirtIOBalloonRun run;
+    /* Host page of a RAM block with large pages that is only partly in
+     * the balloon; it is released when all of its pages are. */
+    RAMBlock *pbp_rb;
+    ram_addr_t pbp_base;
+    long pbp_nr;
+    unsigned long *pbp_bitmap;
 } VirtIOBalloon;
 
 #endif
@@ -38,15 +38,25 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t request_merging;
+    uint32_t merge_window_us;
+    uint16_t num_queues;
 };
 
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
+typedef struct MultiReqBuffer {
+    struct VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int num_reqs;
+    bool is_write;
+} MultiReqBuffer;
+
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
@@ -55,12 +65,18 @@ typedef struct VirtIOBlock {
     VMChangeStateEntry *change;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+
+    /* Requests held back for up to conf.merge_window_us so that they can be
+     * merged with requests from later notifications */
+    MultiReqBuffer held_mrb;
+    QEMUTimer *merge_timer;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
     VirtQueueElement elem;
     int64_t sector_num;
     VirtIOBlock *dev;
+    VirtQueue *vq;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
     QEMUIOVector qiov;
@@ -70,19 +86,14 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
-
-typedef struct MultiReqBuffer {
-    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
-    unsigned int num_reqs;
-    bool is_write;
-} MultiReqBuffer;
-
-void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req);
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req);
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
 void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb);
 
 void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb);
 
+void virtio_blk_flush_merge_window(VirtIOBlock *s);
+
 #endif
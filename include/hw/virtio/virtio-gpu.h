@@ -48,6 +48,8 @@ struct virtio_gpu_scanout {
     int x, y;
     int invalidate;
     uint32_t resource_id;
+    uint32_t tex_id;            /* virgl texture handed to the UI, or 0 */
+    QemuDmaBuf dmabuf;          /* @tex_id exported to the UI, fd -1 if not */
     QEMUCursor *current_cursor;
 };
 
@@ -59,12 +61,15 @@ struct virtio_gpu_requested_state {
 enum virtio_gpu_conf_flags {
     VIRTIO_GPU_FLAG_VIRGL_ENABLED = 1,
     VIRTIO_GPU_FLAG_STATS_ENABLED,
+    VIRTIO_GPU_FLAG_THREAD_ENABLED,
 };
 
 #define virtio_gpu_virgl_enabled(_cfg) \
     (_cfg.flags & (1 << VIRTIO_GPU_FLAG_VIRGL_ENABLED))
 #define virtio_gpu_stats_enabled(_cfg) \
     (_cfg.flags & (1 << VIRTIO_GPU_FLAG_STATS_ENABLED))
+#define virtio_gpu_thread_enabled(_cfg) \
+    (_cfg.flags & (1 << VIRTIO_GPU_FLAG_THREAD_ENABLED))
 
 struct virtio_gpu_conf {
     uint32_t max_outputs;
@@ -111,6 +116,11 @@ typedef struct VirtIOGPU {
     QEMUTimer *fence_poll;
     QEMUTimer *print_stats;
 
+    /* virgl runs here instead of the main loop with render-thread=on */
+    bool render_thread_running;
+    QemuThread render_thread;
+    QemuSemaphore render_sem;
+
     uint32_t inflight;
     struct {
         uint32_t max_inflight;
@@ -155,6 +165,7 @@ int virtio_gpu_create_mapping_iov(struct virtio_gpu_resource_attach_backing *ab,
                                   struct iovec **iov);
 void virtio_gpu_cleanup_mapping_iov(struct iovec *iov, uint32_t count);
 void virtio_gpu_process_cmdq(VirtIOGPU *g);
+void virtio_gpu_process_cursorq(VirtIOGPU *g);
 
 /* virtio-gpu-3d.c */
 void virtio_gpu_virgl_process_cmd(VirtIOGPU *g,
@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -30,11 +31,18 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Bounds for tx=adaptive: the burst shrinks to TX_ADAPTIVE_MIN_BURST when
+ * the guest sends little, and kicks are delayed by at least
+ * TX_ADAPTIVE_MIN_DELAY and at most half of x-txtimer when coalesced. */
+#define TX_ADAPTIVE_MIN_BURST 16
+#define TX_ADAPTIVE_MIN_DELAY 5000 /* 5 us */
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    char *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -46,10 +54,22 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;               /* current flush limit */
+    QEMUTimer *tx_adaptive_timer;   /* tx=adaptive: delays coalesced kicks */
+    int64_t tx_adaptive_delay;
+    int64_t tx_last_flush;
+    struct {
+        uint64_t flushes;
+        uint64_t packets;
+        uint64_t kicks;
+    } tx_stats;
     struct {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    AioContext *ctx;    /* IOThread running the queue pair, or NULL */
+    int rx_batch;       /* nesting depth of receive batches */
+    bool rx_notify_pending;
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -61,6 +81,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    bool tx_adaptive;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -95,6 +116,11 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    IOThread **iothreads;
+    int num_iothreads;
+    bool dataplane_starting;
+    bool dataplane_started;
+    bool dataplane_disabled;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
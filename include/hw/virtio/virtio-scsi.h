@@ -53,9 +53,23 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
+
+/* Requests handed over between the AioContext that runs a command queue
+ * and the one that owns the LUN's BlockBackend.
+ */
+typedef struct VirtIOSCSIMailbox {
+    struct VirtIOSCSI *s;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QemuMutex lock;
+    QTAILQ_HEAD(, VirtIOSCSIReq) submit;   /* to be run on a LUN */
+    QTAILQ_HEAD(, VirtIOSCSIReq) complete; /* to be pushed to a virtqueue */
+} VirtIOSCSIMailbox;
 
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
@@ -83,7 +97,16 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* control, event and first command queue */
+
+    /* One mailbox per IOThread, mailboxes[0] is for ctx.  Command queues
+     * and LUNs are distributed round-robin across them.
+     */
+    int nr_mailboxes;
+    VirtIOSCSIMailbox *mailboxes;
+    IOThread **iothreads;
+    VirtIOSCSIMailbox **cmd_vq_mailbox;
+    unsigned next_lun_mailbox;
 
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) insert_notifiers;
     QTAILQ_HEAD(, VirtIOSCSIBlkChangeNotifier) remove_notifiers;
@@ -118,6 +141,8 @@ typedef struct VirtIOSCSIReq {
     };
 
     SCSIRequest *sreq;
+    /* Set if the request completes outside the virtqueue's AioContext */
+    VirtIOSCSIMailbox *reply_to;
     size_t resp_size;
     enum SCSIXferMode mode;
     union {
@@ -145,10 +170,21 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
+void virtio_scsi_push_req(VirtIOSCSIReq *req);
+bool virtio_scsi_handle_cmd_req_lun(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+AioContext *virtio_scsi_dataplane_next_lun_ctx(VirtIOSCSI *s);
+VirtIOSCSIMailbox *virtio_scsi_dataplane_reply_to(VirtIOSCSI *s,
+                                                  VirtQueue *vq,
+                                                  SCSIDevice *d);
+void virtio_scsi_dataplane_forward(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                   SCSIDevice *d);
+void virtio_scsi_dataplane_reply(VirtIOSCSIReq *req);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req);
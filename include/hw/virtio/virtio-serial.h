@@ -131,6 +131,9 @@ struct VirtIOSerialPort {
     uint32_t iov_idx;
     uint64_t iov_offset;
 
+    /* Small elements are coalesced here before they reach have_data */
+    uint8_t *flush_buf;
+
     /*
      * When unthrottling we use a bottom-half to call flush_queued_data.
      */
@@ -20,6 +20,7 @@ enum xen_mode {
 
 extern uint32_t xen_domid;
 extern enum xen_mode xen_mode;
+extern uint64_t xen_mapcache_bucket_size;
 
 extern bool xen_allowed;
 
@@ -21,6 +21,7 @@
 #include "migration/vmstate.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
+#include "io/channel-tls.h"
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
 #define QEMU_VM_FILE_VERSION_COMPAT  0x00000002
@@ -50,6 +51,8 @@ enum mig_rp_message_type {
 
     MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+    /* Like REQ_PAGES, but only sent once no page request is waiting */
+    MIG_RP_MSG_REQ_PAGES_PREFETCH, /* data (start: be64, len: be32) */
 
     MIG_RP_MSG_MAX
 };
@@ -103,6 +106,9 @@ struct MigrationIncomingState {
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
+    /* Zeroes, for hugepages which can't be placed with UFFDIO_ZEROPAGE */
+    void     *postcopy_tmp_zero_page;
+    size_t    postcopy_tmp_page_size;
 
     QEMUBH *bh;
 
@@ -136,6 +142,9 @@ struct MigrationState
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
     int parameters[MIGRATION_PARAMETER__MAX];
+    /* tls-creds and tls-hostname, the string parameters */
+    char *tls_creds;
+    char *tls_hostname;
 
     int state;
     MigrationParams params;
@@ -157,6 +166,12 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Nanoseconds spent sleeping for the bandwidth limit */
+    int64_t throttle_time;
+    /* Nanoseconds spent writing to_dst_file, saved when it's closed */
+    int64_t socket_write_time;
+    /* Time taken by each section saved with the guest stopped */
+    MigrationSectionTimeList *stop_copy_times;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
@@ -171,6 +186,17 @@ struct MigrationState
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+    /* Prefetch requests from the destination, served when src_page_requests
+     * is empty; also protected by src_page_req_mutex
+     */
+    QSIMPLEQ_HEAD(src_prefetch_requests, MigrationSrcPageRequest)
+        src_prefetch_requests;
+    int src_prefetch_count;
+
+    /* Destination address used to open the x-multifd RAM channels, and
+     * the default TLS hostname; only set for tcp: migrations
+     */
+    char *multifd_host_port;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -201,6 +227,9 @@ void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+QIOChannelTLS *migration_tls_channel_new(int fd, bool is_client, Error **errp);
+int migration_tls_handshake_sync(QIOChannelTLS *tioc, Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -223,6 +252,10 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_send_threads_join(void);
+void multifd_send_shutdown(void);
+void multifd_recv_start(int listen_fd);
+void multifd_recv_threads_join(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -239,7 +272,25 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+int64_t ram_bitmap_sync_time(void);
+int64_t ram_page_scan_time(void);
+int64_t ram_compress_time(void);
+int64_t ram_xbzrle_time(void);
+
+typedef enum PrecopyNotifyReason {
+    PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC,
+    PRECOPY_NOTIFY_AFTER_BITMAP_SYNC,
+    PRECOPY_NOTIFY_COMPLETE,
+    PRECOPY_NOTIFY_CLEANUP,
+} PrecopyNotifyReason;
+
+/* The notifier data points to a PrecopyNotifyReason */
+void precopy_add_notifier(Notifier *n);
+void precopy_remove_notifier(Notifier *n);
+void qemu_guest_free_page_hint(void *addr, size_t len);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_cache_evictions(void);
 double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
@@ -250,6 +301,10 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+/* For background snapshots */
+void ram_save_freeze_bitmap(void);
+int ram_snapshot_fork_prepare(Error **errp);
+void ram_snapshot_fork_cleanup(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -273,6 +328,7 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool test_xbzrle_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -281,8 +337,21 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
+bool migrate_compress_method_supported(MigrationCompressMethod method);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+bool migrate_ignore_shared(void);
+bool migrate_mapped_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_zerocopy_send(void);
+bool migrate_background_snapshot(void);
+bool migrate_use_tls(void);
+int migrate_multifd_channels(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_block_chunk_size(void);
+int migrate_block_inflight(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -295,6 +364,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char* rbname,
                               ram_addr_t start, size_t len);
+void migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                    ram_addr_t start, size_t len);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
@@ -324,7 +395,7 @@ void global_state_store_running(void);
 
 void flush_page_queue(MigrationState *ms);
 int ram_save_queue_pages(MigrationState *ms, const char *rbname,
-                         ram_addr_t start, ram_addr_t len);
+                         ram_addr_t start, ram_addr_t len, bool prefetch);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is N-way set associative, sets are selected by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -60,9 +60,12 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet, it replaces the least hit page of its
+ * set that was not used recently.
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another page
+ * was evicted to make room for it and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -35,11 +35,11 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages);
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 
 /*
- * Discard the contents of 'length' bytes from 'start'
+ * Discard the contents of 'length' bytes from 'start' in the RAMBlock 'rb'
  * We can assume that if we've been called postcopy_ram_hosttest returned true
  */
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length);
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length);
 
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
@@ -79,21 +79,35 @@ void postcopy_discard_send_finish(MigrationState *ms,
  * Place a page (from) at (host) efficiently
  *    There are restrictions on how 'from' must be mapped, in general best
  *    to use other postcopy_ routines to allocate.
+ *    'pagesize' is the host page size of the RAMBlock holding 'host'.
  * returns 0 on success
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t pagesize);
 
 /*
  * Place a zero page at (host) atomically
  * returns 0 on success
  */
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t pagesize);
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page; it is big enough for the largest host page
+ * size of any RAMBlock.
  * Returns: Pointer to allocated page
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Lazy restore of the RAM of an x-mapped-ram file: the pages of each block
+ * given to lazy_restore_add_block (which takes ownership of @bitmap, the
+ * present target pages) are read from the file @fd when they are first
+ * touched, or in the background, once lazy_restore_start is called.
+ */
+void lazy_restore_add_block(RAMBlock *rb, void *host, size_t length,
+                            unsigned long *bitmap, off_t pages_offset);
+int lazy_restore_start(int fd);
+
 #endif
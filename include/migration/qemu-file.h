@@ -24,6 +24,7 @@
 #ifndef QEMU_FILE_H
 #define QEMU_FILE_H 1
 #include "exec/cpu-common.h"
+#include "io/channel.h"
 
 
 /* This function writes a chunk of data to a file at the given position.
@@ -59,6 +60,23 @@ typedef int (QEMUFileGetFD)(void *opaque);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Same as writev_buffer, but the elements of iov whose bit is set in
+ * 'zerocopy' were queued with qemu_put_buffer_async() and may be sent
+ * without copying them.  The other ones must be copied before returning.
+ * The iovec array itself may be modified.
+ */
+typedef ssize_t (QEMUFileWritevZerocopyFunc)(void *opaque, struct iovec *iov,
+                                             int iovcnt,
+                                             const unsigned long *zerocopy,
+                                             int64_t pos);
+
+/*
+ * Wait until all the data sent without copying has left the host.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileZerocopyFlushFunc)(void *opaque);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -112,6 +130,8 @@ typedef struct QEMUFileOps {
     QEMURamSaveFunc *save_page;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileWritevZerocopyFunc *writev_zerocopy;
+    QEMUFileZerocopyFlushFunc *zerocopy_flush;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -125,12 +145,14 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd, const char *mode);
+QEMUFile *qemu_fopen_channel(QIOChannel *ioc, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 QEMUFile *qemu_bufopen(const char *mode, QEMUSizedBuffer *input);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int64_t qemu_file_get_write_time(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size);
 void qemu_put_byte(QEMUFile *f, int v);
 /*
@@ -182,6 +204,16 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, size_t size);
+void qemu_file_set_iov_batch(QEMUFile *f, unsigned int iovcnt);
+void qemu_file_set_zerocopy(QEMUFile *f, bool enable);
+int qemu_file_zerocopy_flush(QEMUFile *f);
+off_t qemu_get_offset(QEMUFile *f);
+int qemu_set_offset(QEMUFile *f, off_t offset);
+ssize_t qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                           off_t offset);
+ssize_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                           off_t offset);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -78,6 +78,17 @@ int register_savevm_live(DeviceState *dev,
 
 void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque);
 
+typedef struct SaveVMIterBuffer SaveVMIterBuffer;
+
+SaveVMIterBuffer *register_savevm_iter_buffer(DeviceState *dev,
+                                              const char *idstr,
+                                              int instance_id,
+                                              void *buf, uint64_t size);
+void unregister_savevm_iter_buffer(DeviceState *dev, const char *idstr,
+                                   SaveVMIterBuffer *ib);
+void savevm_iter_buffer_set_dirty(SaveVMIterBuffer *ib, uint64_t offset,
+                                  uint64_t len);
+
 typedef struct VMStateInfo VMStateInfo;
 typedef struct VMStateDescription VMStateDescription;
 
@@ -928,6 +939,7 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
+uint64_t vmstate_estimate_size(const VMStateDescription *vmsd, void *opaque);
 
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
@@ -28,6 +28,7 @@
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
+typedef struct NetPacketBuf NetPacketBuf;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
@@ -56,6 +57,9 @@ void qemu_net_queue_append_iov(NetQueue *queue,
 
 void qemu_del_net_queue(NetQueue *queue);
 
+NetPacketBuf *qemu_net_packet_buf_new(const struct iovec *iov, int iovcnt);
+void qemu_net_packet_buf_unref(NetPacketBuf *buf);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -70,6 +74,14 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_buf(NetQueue *queue,
+                                NetClientState *sender,
+                                unsigned flags,
+                                NetPacketBuf **pbuf,
+                                const struct iovec *iov,
+                                int iovcnt,
+                                NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -24,4 +24,11 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+/* Serialize @obj, passing the text to @flush a few kilobytes at a time
+ * instead of building it as a single string.
+ */
+typedef void QJSONFlushFunc(void *opaque, const char *str);
+void qobject_to_json_stream(const QObject *obj, bool pretty,
+                            QJSONFlushFunc *flush, void *opaque);
+
 #endif /* QJSON_H */
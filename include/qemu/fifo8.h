@@ -94,6 +94,19 @@ uint8_t fifo8_pop(Fifo8 *fifo);
  */
 const uint8_t *fifo8_pop_buf(Fifo8 *fifo, uint32_t max, uint32_t *num);
 
+/**
+ * fifo8_peek_buf:
+ * @fifo: FIFO to peek into
+ * @max: maximum number of bytes to peek
+ * @num: actual number of returned bytes
+ *
+ * Like fifo8_pop_buf(), but the data stays in the FIFO.  Clients can then
+ * use fifo8_pop_buf() to drop the part of it they have consumed.
+ *
+ * Returns: A pointer to the data at the head of the FIFO.
+ */
+const uint8_t *fifo8_peek_buf(Fifo8 *fifo, uint32_t max, uint32_t *num);
+
 /**
  * fifo8_reset:
  * @fifo: FIFO to reset
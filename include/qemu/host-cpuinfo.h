@@ -0,0 +1,30 @@
+/*
+ * Host CPU features for selecting accelerated code at run time
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_HOST_CPUINFO_H
+#define QEMU_HOST_CPUINFO_H
+
+/*
+ * GCC before version 4.9 has a bug which will cause the target
+ * attribute work incorrectly and failed to compile in some case,
+ * restrict the gcc version to 4.9+ to prevent the failure.
+ */
+#if defined(CONFIG_AVX2_OPT) && QEMU_GNUC_PREREQ(4, 9)
+#define CPUINFO_AVX2_OPT
+#endif
+
+#define CPUINFO_SSE2    (1u << 0)
+#define CPUINFO_AVX2    (1u << 1)
+
+/*
+ * Returns the CPUINFO_* flags of the host.  CPUINFO_AVX2 is only reported
+ * if CPUINFO_AVX2_OPT is defined, and only if the OS saves the YMM
+ * registers.
+ */
+unsigned host_cpuinfo(void);
+
+#endif
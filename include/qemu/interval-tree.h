@@ -0,0 +1,69 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An AVL tree of closed intervals [start, last], sorted by start and
+ * augmented with the largest @last of every subtree, so that all intervals
+ * overlapping a given range are found in O(log n + k).
+ *
+ * Nodes are embedded in the user's data structure, use container_of() to
+ * get from the node to the containing object.  Several nodes may have the
+ * same interval.
+ */
+
+typedef struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;
+
+    /* private */
+    uint64_t subtree_last;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+    int height;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+/**
+ * interval_tree_insert:
+ * @root: The tree.
+ * @node: The node to insert; @node->start and @node->last must be set and
+ * must not be changed while @node is in the tree.
+ */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ * @root: The tree.
+ * @node: A node that is in @root.
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ * @root: The tree.
+ * @start: First point of the range to look for.
+ * @last: Last point of the range to look for.
+ * @match: Called for each node that overlaps [@start, @last], in order of
+ * increasing start, until it returns true.  If NULL, all nodes match.
+ * @opaque: Passed to @match.
+ *
+ * Returns the first node that overlaps [@start, @last] and for which @match
+ * returns true, or NULL.  @match must not modify the tree.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     bool (*match)(IntervalTreeNode *node,
+                                                   void *opaque),
+                                     void *opaque);
+
+#endif
@@ -245,8 +245,13 @@ bool qemu_mutex_iothread_locked(void);
  *
  * NOTE: tools currently are single-threaded and qemu_mutex_lock_iothread
  * is a no-op there.
+ *
+ * While lock profiling is enabled, waits and hold times are accounted
+ * to the call site as for qemu_mutex_lock(); see "info sync-profile".
  */
-void qemu_mutex_lock_iothread(void);
+void qemu_mutex_lock_iothread_impl(QemuLockSite *site);
+#define qemu_mutex_lock_iothread() \
+    qemu_mutex_lock_iothread_impl(QEMU_LOCK_SITE(true))
 
 /**
  * qemu_mutex_unlock_iothread: Unlock the main loop mutex.
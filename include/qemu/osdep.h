@@ -171,6 +171,11 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #else
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
 #endif
+#ifdef MADV_DOFORK
+#define QEMU_MADV_DOFORK    MADV_DOFORK
+#else
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
+#endif
 #ifdef MADV_MERGEABLE
 #define QEMU_MADV_MERGEABLE MADV_MERGEABLE
 #else
@@ -207,6 +212,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_WILLNEED  POSIX_MADV_WILLNEED
 #define QEMU_MADV_DONTNEED  POSIX_MADV_DONTNEED
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_DODUMP QEMU_MADV_INVALID
@@ -219,6 +225,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_WILLNEED  QEMU_MADV_INVALID
 #define QEMU_MADV_DONTNEED  QEMU_MADV_INVALID
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_DODUMP QEMU_MADV_INVALID
@@ -322,6 +329,25 @@ void qemu_set_tty_echo(int fd, bool echo);
 
 void os_mem_prealloc(int fd, char *area, size_t sz);
 
+/**
+ * os_mem_prealloc_defer:
+ *
+ * Let the following calls to os_mem_prealloc() return as soon as the
+ * pages start being touched, so that other initialization can overlap
+ * with the preallocation.  Nothing may access the memory until
+ * os_mem_prealloc_wait() returns.
+ */
+void os_mem_prealloc_defer(void);
+
+/**
+ * os_mem_prealloc_wait:
+ *
+ * Wait for the preallocations started since os_mem_prealloc_defer(),
+ * and make os_mem_prealloc() synchronous again.  Exits if there was not
+ * enough host memory, like os_mem_prealloc().
+ */
+void os_mem_prealloc_wait(void);
+
 int qemu_read_password(char *buf, int buf_size);
 
 /**
@@ -66,6 +66,9 @@ struct rcu_reader_data {
 
     /* Data used for registry, protected by rcu_registry_lock */
     QLIST_ENTRY(rcu_reader_data) node;
+
+    /* call_rcu1() callbacks queued by this thread */
+    struct rcu_cb_queue *cb_queue;
 };
 
 extern __thread struct rcu_reader_data rcu_reader;
@@ -101,6 +104,23 @@ static inline void rcu_read_unlock(void)
 
 extern void synchronize_rcu(void);
 
+/*
+ * Like synchronize_rcu(), but busy-wait for a while instead of sleeping
+ * until readers leave their critical sections.  This cuts the latency of
+ * the grace period at the cost of CPU time in the caller.
+ */
+extern void synchronize_rcu_expedited(void);
+
+typedef struct RCUStats {
+    uint64_t gp_count;          /* grace periods completed */
+    uint64_t gp_expedited;      /* ... of which were expedited */
+    uint64_t gp_total_ns;       /* time spent waiting for readers */
+    uint64_t gp_max_ns;         /* longest grace period */
+    uint64_t callbacks;         /* call_rcu1() callbacks invoked */
+} RCUStats;
+
+extern void rcu_get_stats(RCUStats *stats);
+
 /*
  * Reader thread registration.
  */
@@ -5,6 +5,8 @@
 
 struct QemuMutex {
     pthread_mutex_t lock;
+    QemuLockSite *site;     /* profiled holder, protected by @lock */
+    int64_t locked_ns;
 };
 
 struct QemuCond {
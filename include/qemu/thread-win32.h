@@ -5,6 +5,8 @@
 struct QemuMutex {
     CRITICAL_SECTION lock;
     LONG owner;
+    QemuLockSite *site;     /* profiled holder, protected by @lock */
+    int64_t locked_ns;
 };
 
 struct QemuCond {
@@ -7,6 +7,7 @@ typedef struct QemuCond QemuCond;
 typedef struct QemuSemaphore QemuSemaphore;
 typedef struct QemuEvent QemuEvent;
 typedef struct QemuThread QemuThread;
+typedef struct QemuLockSite QemuLockSite;
 
 #ifdef _WIN32
 #include "qemu/thread-win32.h"
@@ -17,12 +18,57 @@ typedef struct QemuThread QemuThread;
 #define QEMU_THREAD_JOINABLE 0
 #define QEMU_THREAD_DETACHED 1
 
+/*
+ * Lock contention profiling.  Every call site of qemu_mutex_lock(),
+ * qemu_mutex_trylock() and qemu_mutex_lock_iothread() owns a static
+ * QemuLockSite; while profiling is enabled, the lock functions account
+ * the acquisitions, the time spent waiting and the time the lock was held
+ * to the site that took it.  When profiling is disabled the only cost is
+ * a load of qemu_sync_profile_enabled.
+ */
+struct QemuLockSite {
+    const char *file;
+    int line;
+    bool bql;
+    bool registered;
+    QemuLockSite *next;
+
+    /* Updated with atomic operations */
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_ns;
+};
+
+extern bool qemu_sync_profile_enabled;
+
+#define QEMU_LOCK_SITE(is_bql) ({                                      \
+    static QemuLockSite qemu_lock_site_ = {                            \
+        .file = __FILE__, .line = __LINE__, .bql = is_bql,             \
+    };                                                                 \
+    &qemu_lock_site_;                                                  \
+})
+
+void qemu_sync_profile_enable(bool enable);
+void qemu_sync_profile_reset(void);
+void qemu_sync_profile_foreach(void (*fn)(QemuLockSite *site, void *opaque),
+                               void *opaque);
+void qemu_sync_profile_acquired(QemuLockSite *site, int64_t wait_ns);
+void qemu_sync_profile_released(QemuLockSite *site, int64_t hold_ns);
+int64_t qemu_sync_profile_clock(void);
+
 void qemu_mutex_init(QemuMutex *mutex);
 void qemu_mutex_destroy(QemuMutex *mutex);
-void qemu_mutex_lock(QemuMutex *mutex);
-int qemu_mutex_trylock(QemuMutex *mutex);
+void qemu_mutex_lock_impl(QemuMutex *mutex, QemuLockSite *site);
+int qemu_mutex_trylock_impl(QemuMutex *mutex, QemuLockSite *site);
 void qemu_mutex_unlock(QemuMutex *mutex);
 
+#define qemu_mutex_lock(mutex) \
+    qemu_mutex_lock_impl(mutex, QEMU_LOCK_SITE(false))
+#define qemu_mutex_trylock(mutex) \
+    qemu_mutex_trylock_impl(mutex, QEMU_LOCK_SITE(false))
+
 void qemu_cond_init(QemuCond *cond);
 void qemu_cond_destroy(QemuCond *cond);
 
@@ -56,6 +102,24 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/* Size of the host CPU masks used by the affinity functions */
+#define QEMU_THREAD_MAX_CPUS 1024
+
+/*
+ * Restricts @thread to the host CPUs set in the bitmap @host_cpus, which
+ * has @nbits bits.  Threads created by @thread afterwards inherit the mask.
+ * Returns 0 or a negative errno value.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *host_cpus,
+                             unsigned long nbits);
+
+/*
+ * Sets the bits of the CPUs of host NUMA node @node in @host_cpus, which has
+ * @nbits bits.  Returns 0 or a negative errno value.
+ */
+int qemu_host_node_get_cpus(unsigned int node, unsigned long *host_cpus,
+                            unsigned long nbits);
+
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
 void qemu_thread_atexit_remove(struct Notifier *notifier);
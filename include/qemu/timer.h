@@ -70,7 +70,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    size_t heap_index;          /* position in the timer list's heap */
+    uint64_t heap_seq;          /* arming order, breaks expire time ties */
     int scale;
 };
 
@@ -69,6 +69,8 @@ typedef void (*CPUUnassignedAccess)(CPUState *cpu, hwaddr addr,
                                     unsigned size);
 
 struct TranslationBlock;
+struct CPUTLBTables;
+struct TLBFlushBatch;
 
 /**
  * CPUClass:
@@ -231,7 +233,8 @@ struct kvm_run;
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
- * @running: #true if CPU is currently running (usermode).
+ * @running: #true if CPU is currently running (usermode, or executing
+ *   translated code with multi-threaded TCG).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
@@ -255,6 +258,12 @@ struct kvm_run;
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tlb_tables: Softmmu TLB of each MMU mode, if it is dynamically sized.
+ *   Kept here rather than in CPUArchState so that it survives CPU reset.
+ * @tlb_flush_batch: TLB flushes requested by other threads and not yet run.
+ * @tb_exit_count: Number of returns from translated code to cpu_exec().
+ * @tlb_miss_count: Number of softmmu TLB misses.
+ * @tlb_victim_hit_count: Number of TLB misses resolved from the victim TLB.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -307,6 +316,12 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct CPUTLBTables **tlb_tables;
+    struct TLBFlushBatch *tlb_flush_batch;
+    /* only updated by the thread running the vCPU */
+    uint64_t tb_exit_count;
+    uint64_t tlb_miss_count;
+    uint64_t tlb_victim_hit_count;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -345,6 +360,10 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle of this vcpu alone, see cpu_throttle_set_cpu() */
+    int throttle_percentage;
+    /* Pages this vcpu dirtied for migration; only counted by TCG */
+    uint32_t dirty_pages;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -574,6 +593,26 @@ static inline bool cpu_has_work(CPUState *cpu)
  */
 bool qemu_cpu_is_self(CPUState *cpu);
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ *
+ * Checks whether TCG runs each vCPU in its own host thread
+ * (-accel tcg,thread=multi).
+ *
+ * Returns: %true in multi-threaded TCG mode, %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
+/**
+ * parallel_cpus:
+ *
+ * True if other vCPUs may run while one executes translated code, as in
+ * multi-threaded TCG or with several threads in user mode.  Guest atomic
+ * operations must then be atomic on the host too.
+ */
+extern bool parallel_cpus;
+
 /**
  * qemu_cpu_kick:
  * @cpu: The vCPU to kick.
@@ -613,6 +652,20 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * with no other vCPU executing translated code while @func runs.  This is
+ * needed for operations, such as flushing the translation cache, which must
+ * not race with other vCPU threads under multi-threaded TCG.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -647,10 +700,30 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_cpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99, or 0
+ * to only apply the throttle set with cpu_throttle_set.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  The vcpu sleeps according
+ * to the higher of the two percentages.
+ */
+void cpu_throttle_set_cpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_cpu_percentage:
+ * @cpu: The vcpu to check.
+ *
+ * Returns: The throttle percentage applied to @cpu, 0 if it is not throttled.
+ */
+int cpu_throttle_get_cpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_cpu.
  */
 void cpu_throttle_stop(void);
 
@@ -665,6 +738,8 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * With per-vcpu throttling, this is the percentage of the most throttled
+ * vcpu.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
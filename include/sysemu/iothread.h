@@ -16,6 +16,7 @@
 
 #include "block/aio.h"
 #include "qemu/thread.h"
+#include "qemu/bitmap.h"
 
 #define TYPE_IOTHREAD "iothread"
 
@@ -28,6 +29,19 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Thread pool bounds */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* Host CPUs to run on, empty and -1 respectively if not restricted */
+    DECLARE_BITMAP(cpu_affinity, QEMU_THREAD_MAX_CPUS);
+    int64_t numa_node;
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -26,6 +26,14 @@ typedef struct KVMMemoryListener {
     MemoryListener listener;
     KVMSlot *slots;
     int as_id;
+    /* MemoryRegionSections added and removed by the current transaction,
+     * applied to the slots at commit time.
+     */
+    GArray *pending_add;
+    GArray *pending_del;
+    /* Buffer for KVM_GET_DIRTY_LOG, kept across dirty log syncs */
+    unsigned long *dirty_bitmap;
+    size_t dirty_bitmap_size;
 } KVMMemoryListener;
 
 #define TYPE_KVM_ACCEL ACCEL_CLASS_NAME("kvm")
@@ -3,6 +3,7 @@
 
 #include "qemu/bitmap.h"
 #include "qemu/option.h"
+#include "qemu/thread.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/hostmem.h"
 #include "hw/boards.h"
@@ -19,6 +20,9 @@ typedef struct node_info {
     uint64_t node_mem;
     DECLARE_BITMAP(node_cpu, MAX_CPUMASK_BITS);
     struct HostMemoryBackend *node_memdev;
+    /* host CPUs that the VCPUs of the node run on, if has_host_cpus */
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_CPUS);
+    bool has_host_cpus;
     bool present;
     QLIST_HEAD(, numa_addr_range) addr; /* List to store address ranges */
 } NodeInfo;
@@ -31,5 +35,6 @@ extern QemuOptsList qemu_numa_opts;
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
+void numa_cpu_set_affinity(CPUState *cpu);
 
 #endif
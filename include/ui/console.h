@@ -179,6 +179,16 @@ struct QEMUGLParams {
     int minor_ver;
 };
 
+typedef struct QemuDmaBuf {
+    int       fd;
+    uint32_t  width;
+    uint32_t  height;
+    uint32_t  stride;
+    uint32_t  fourcc;
+    bool      y0_top;
+    uint32_t  texture;          /* imported by the UI, or 0 */
+} QemuDmaBuf;
+
 typedef struct DisplayChangeListenerOps {
     const char *dpy_name;
 
@@ -219,6 +229,11 @@ typedef struct DisplayChangeListenerOps {
                            uint32_t x, uint32_t y, uint32_t w, uint32_t h);
     void (*dpy_gl_update)(DisplayChangeListener *dcl,
                           uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+    /* returns false if the UI cannot import the buffer */
+    bool (*dpy_gl_scanout_dmabuf)(DisplayChangeListener *dcl,
+                                  QemuDmaBuf *dmabuf);
+    void (*dpy_gl_release_dmabuf)(DisplayChangeListener *dcl,
+                                  QemuDmaBuf *dmabuf);
 
 } DisplayChangeListenerOps;
 
@@ -286,6 +301,9 @@ void dpy_gl_scanout(QemuConsole *con,
                     uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 void dpy_gl_update(QemuConsole *con,
                    uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+bool dpy_gl_has_dmabuf(QemuConsole *con);
+bool dpy_gl_scanout_dmabuf(QemuConsole *con, QemuDmaBuf *dmabuf);
+void dpy_gl_release_dmabuf(QemuConsole *con, QemuDmaBuf *dmabuf);
 
 QEMUGLContext dpy_gl_ctx_create(QemuConsole *con,
                                 QEMUGLParams *params);
@@ -4,6 +4,7 @@
 #include <epoxy/gl.h>
 #include <epoxy/egl.h>
 #include <gbm.h>
+#include "ui/console.h"
 
 extern EGLDisplay *qemu_egl_display;
 extern EGLConfig qemu_egl_config;
@@ -17,6 +18,8 @@ extern EGLContext qemu_egl_rn_ctx;
 int qemu_egl_rendernode_open(void);
 int egl_rendernode_init(void);
 int egl_get_fd_for_texture(uint32_t tex_id, EGLint *stride, EGLint *fourcc);
+void egl_dmabuf_import_texture(QemuDmaBuf *dmabuf);
+void egl_dmabuf_release_texture(QemuDmaBuf *dmabuf);
 
 #endif
 
@@ -105,6 +105,12 @@ void gd_egl_scanout(DisplayChangeListener *dcl,
                     uint32_t w, uint32_t h);
 void gd_egl_scanout_flush(DisplayChangeListener *dcl,
                           uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+#ifdef CONFIG_OPENGL_DMABUF
+bool gd_egl_scanout_dmabuf(DisplayChangeListener *dcl,
+                           QemuDmaBuf *dmabuf);
+void gd_egl_release_dmabuf(DisplayChangeListener *dcl,
+                           QemuDmaBuf *dmabuf);
+#endif
 void gtk_egl_init(void);
 int gd_egl_make_current(DisplayChangeListener *dcl,
                         QEMUGLContext ctx);
@@ -12,6 +12,9 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
@@ -20,6 +23,7 @@
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "block/thread-pool.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -28,6 +32,11 @@ typedef ObjectClass IOThreadClass;
 #define IOTHREAD_CLASS(klass) \
    OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
 
+/* On NVMe drives, maximum polling times of 16-32 microseconds improve IOPS
+ * both for iodepth=1 and for iodepth=32 workloads.
+ */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -54,6 +63,64 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    iothread->numa_node = -1;
+}
+
+/*
+ * Computes the host CPUs from the cpu-affinity and numa-node properties;
+ * with both, only CPUs of the node that are also in cpu-affinity are used.
+ * Returns false if the thread is not restricted or on error.
+ */
+static bool iothread_get_host_cpus(IOThread *iothread,
+                                   unsigned long *host_cpus, Error **errp)
+{
+    bool has_cpus = !bitmap_empty(iothread->cpu_affinity,
+                                  QEMU_THREAD_MAX_CPUS);
+    int ret;
+
+    if (iothread->numa_node < 0) {
+        bitmap_copy(host_cpus, iothread->cpu_affinity, QEMU_THREAD_MAX_CPUS);
+        return has_cpus;
+    }
+
+    bitmap_zero(host_cpus, QEMU_THREAD_MAX_CPUS);
+    ret = qemu_host_node_get_cpus(iothread->numa_node, host_cpus,
+                                  QEMU_THREAD_MAX_CPUS);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot get the CPUs of host NUMA "
+                         "node %" PRId64, iothread->numa_node);
+        return false;
+    }
+    if (has_cpus) {
+        bitmap_and(host_cpus, host_cpus, iothread->cpu_affinity,
+                   QEMU_THREAD_MAX_CPUS);
+    }
+    if (bitmap_empty(host_cpus, QEMU_THREAD_MAX_CPUS)) {
+        error_setg(errp, "No host CPU left for the IOThread");
+        return false;
+    }
+    return true;
+}
+
+static void iothread_set_affinity(IOThread *iothread,
+                                  const unsigned long *host_cpus, Error **errp)
+{
+    int ret;
+
+    ret = qemu_thread_set_affinity(&iothread->thread, host_cpus,
+                                   QEMU_THREAD_MAX_CPUS);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set the CPU affinity of the "
+                         "IOThread");
+    }
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -73,8 +140,16 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     Error *local_error = NULL;
     IOThread *iothread = IOTHREAD(obj);
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_CPUS);
+    bool has_affinity;
     char *name, *thread_name;
 
+    has_affinity = iothread_get_host_cpus(iothread, host_cpus, &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        return;
+    }
+
     iothread->stopping = false;
     iothread->thread_id = -1;
     iothread->ctx = aio_context_new(&local_error);
@@ -83,11 +158,29 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_poll_params(iothread->ctx,
+                                iothread->poll_max_ns,
+                                iothread->poll_grow,
+                                iothread->poll_shrink,
+                                &local_error);
+    if (!local_error) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_error);
+    }
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+    /* Without cpu-affinity or numa-node, this assumes we are called from a
+     * thread with useful CPU affinity for us to inherit.
      */
     name = object_get_canonical_path_component(OBJECT(obj));
     thread_name = g_strdup_printf("IO %s", name);
@@ -103,12 +196,241 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    /* Thread pool workers are spawned by the IOThread and inherit this */
+    if (has_affinity) {
+        iothread_set_affinity(iothread, host_cpus, errp);
+    }
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} IOThreadParamInfo;
+
+static IOThreadParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static IOThreadParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static IOThreadParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+
+static void iothread_get_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, name, field, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx,
+                                    iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink,
+                                    &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
+static IOThreadParamInfo numa_node_info = {
+    "numa-node", offsetof(IOThread, numa_node),
+};
+
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0 || value > INT_MAX) {
+        error_setg(&local_err, "%s value must be in range [0, %d]",
+                   info->name, INT_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    /* min and max are checked against each other once both are known */
+    if (iothread->ctx) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_cpu_affinity(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **cpu = &host_cpus;
+    unsigned long value;
+
+    for (value = find_first_bit(iothread->cpu_affinity, QEMU_THREAD_MAX_CPUS);
+         value < QEMU_THREAD_MAX_CPUS;
+         value = find_next_bit(iothread->cpu_affinity, QEMU_THREAD_MAX_CPUS,
+                               value + 1)) {
+        *cpu = g_malloc0(sizeof(**cpu));
+        (*cpu)->value = value;
+        cpu = &(*cpu)->next;
+    }
+
+    visit_type_uint16List(v, name, &host_cpus, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+/* Changes take effect immediately if the thread is running already */
+static void iothread_update_affinity(IOThread *iothread, Error **errp)
+{
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_CPUS);
+    Error *local_err = NULL;
+
+    if (!iothread->ctx) {
+        return;
+    }
+    if (iothread_get_host_cpus(iothread, host_cpus, &local_err)) {
+        iothread_set_affinity(iothread, host_cpus, &local_err);
+    }
+    error_propagate(errp, local_err);
+}
+
+static void iothread_set_cpu_affinity(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_CPUS);
+    Error *local_err = NULL;
+    uint16List *l, *list = NULL;
+
+    visit_type_uint16List(v, name, &list, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    bitmap_zero(host_cpus, QEMU_THREAD_MAX_CPUS);
+    for (l = list; l; l = l->next) {
+        if (l->value >= QEMU_THREAD_MAX_CPUS) {
+            error_setg(&local_err, "Host CPU %" PRIu16 " exceeds the "
+                       "maximum of %d", l->value, QEMU_THREAD_MAX_CPUS - 1);
+            goto out;
+        }
+        set_bit(l->value, host_cpus);
+    }
+
+    bitmap_copy(iothread->cpu_affinity, host_cpus, QEMU_THREAD_MAX_CPUS);
+    iothread_update_affinity(iothread, &local_err);
+
+out:
+    qapi_free_uint16List(list);
+    error_propagate(errp, local_err);
+}
+
+static void iothread_set_numa_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < -1 || value > INT_MAX) {
+        error_setg(&local_err, "numa-node value must be in range [-1, %d]",
+                   INT_MAX);
+        goto out;
+    }
+
+    iothread->numa_node = value;
+    iothread_update_affinity(iothread, &local_err);
+
+out:
+    error_propagate(errp, local_err);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
+
+    object_class_property_add(klass, "poll-max-ns", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_max_ns_info, &error_abort);
+    object_class_property_add(klass, "poll-grow", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_grow_info, &error_abort);
+    object_class_property_add(klass, "poll-shrink", "int",
+                              iothread_get_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add(klass, "cpu-affinity", "int",
+                              iothread_get_cpu_affinity,
+                              iothread_set_cpu_affinity,
+                              NULL, NULL, &error_abort);
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_param,
+                              iothread_set_numa_node,
+                              NULL, &numa_node_info, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -116,6 +438,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -155,6 +478,14 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_grow = iothread->poll_grow;
+    info->poll_shrink = iothread->poll_shrink;
+    info->thread_pool_min = iothread->thread_pool_min;
+    info->thread_pool_max = iothread->thread_pool_max;
+    /* Updated by the iothread without locking, good enough for statistics */
+    info->poll_hits = iothread->ctx->poll_hits;
+    info->poll_misses = iothread->ctx->poll_misses;
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -389,14 +389,13 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -417,13 +416,18 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+
+        /* The buffer is reused by every sync, and aligned so that the
+         * vectorized search in cpu_physical_memory_set_dirty_lebitmap()
+         * can skip its clean parts.  The kernel writes all of it, so it
+         * need not be cleared.
+         */
+        if (size > kml->dirty_bitmap_size) {
+            qemu_vfree(kml->dirty_bitmap);
+            kml->dirty_bitmap = qemu_memalign(64, size);
+            kml->dirty_bitmap_size = size;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
+        d.dirty_bitmap = kml->dirty_bitmap;
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -435,7 +439,6 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -795,7 +798,7 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
-    kvm_set_phys_mem(kml, section, true);
+    g_array_append_val(kml->pending_add, *section);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -803,8 +806,55 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
-    kvm_set_phys_mem(kml, section, false);
-    memory_region_unref(section->mr);
+    g_array_append_val(kml->pending_del, *section);
+}
+
+/* Return true if adding @add replaces the slot of @del by itself, that is
+ * if it covers exactly the same guest range with RAM.
+ */
+static bool kvm_section_replaces(MemoryRegionSection *add,
+                                 MemoryRegionSection *del)
+{
+    return memory_region_is_ram(add->mr) &&
+           add->offset_within_address_space ==
+               del->offset_within_address_space &&
+           int128_eq(add->size, del->size);
+}
+
+/* Apply the slot changes of a whole transaction.  A removed section that
+ * is replaced by an added one covering the same range is not unregistered
+ * first: kvm_set_phys_mem() then only updates the flags of the existing
+ * slot when the backing memory did not change, or replaces it otherwise.
+ * The remaining removals are done before any addition, so the new slots
+ * never overlap stale ones.
+ */
+static void kvm_region_commit(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    MemoryRegionSection *add, *del;
+    int i, j;
+
+    for (i = 0; i < kml->pending_del->len; i++) {
+        del = &g_array_index(kml->pending_del, MemoryRegionSection, i);
+        for (j = 0; j < kml->pending_add->len; j++) {
+            add = &g_array_index(kml->pending_add, MemoryRegionSection, j);
+            if (kvm_section_replaces(add, del)) {
+                break;
+            }
+        }
+        if (j == kml->pending_add->len) {
+            kvm_set_phys_mem(kml, del, false);
+        }
+        memory_region_unref(del->mr);
+    }
+
+    for (j = 0; j < kml->pending_add->len; j++) {
+        add = &g_array_index(kml->pending_add, MemoryRegionSection, j);
+        kvm_set_phys_mem(kml, add, true);
+    }
+
+    g_array_set_size(kml->pending_del, 0);
+    g_array_set_size(kml->pending_add, 0);
 }
 
 static void kvm_log_sync(MemoryListener *listener,
@@ -900,8 +950,12 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
         kml->slots[i].slot = i;
     }
 
+    kml->pending_add = g_array_new(false, false, sizeof(MemoryRegionSection));
+    kml->pending_del = g_array_new(false, false, sizeof(MemoryRegionSection));
+
     kml->listener.region_add = kvm_region_add;
     kml->listener.region_del = kvm_region_del;
+    kml->listener.commit = kvm_region_commit;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
@@ -27,37 +27,70 @@
 
 //#define DEBUG_MMAP
 
-static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* mmap_lock() takes the exclusive side, for changes to the guest memory
+   map and the page flags.  Translation only needs the map to stay the
+   same, so it takes the shared side with mmap_read_lock().  Both nest,
+   and a thread holding the exclusive side may take the shared one; the
+   opposite would deadlock.  */
+static pthread_rwlock_t mmap_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 static __thread int mmap_lock_count;
+static __thread int mmap_read_lock_count;
 
 void mmap_lock(void)
 {
+    assert(mmap_read_lock_count == 0);
     if (mmap_lock_count++ == 0) {
-        pthread_mutex_lock(&mmap_mutex);
+        pthread_rwlock_wrlock(&mmap_rwlock);
     }
 }
 
 void mmap_unlock(void)
 {
     if (--mmap_lock_count == 0) {
-        pthread_mutex_unlock(&mmap_mutex);
+        pthread_rwlock_unlock(&mmap_rwlock);
+    }
+}
+
+void mmap_read_lock(void)
+{
+    if (mmap_lock_count == 0 && mmap_read_lock_count == 0) {
+        pthread_rwlock_rdlock(&mmap_rwlock);
+    }
+    mmap_read_lock_count++;
+}
+
+void mmap_read_unlock(void)
+{
+    if (--mmap_read_lock_count == 0 && mmap_lock_count == 0) {
+        pthread_rwlock_unlock(&mmap_rwlock);
+    }
+}
+
+/* Called when an exception longjmps out of translation.  */
+void mmap_read_lock_reset(void)
+{
+    if (mmap_read_lock_count) {
+        mmap_read_lock_count = 1;
+        mmap_read_unlock();
     }
 }
 
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
-    if (mmap_lock_count)
+    if (mmap_lock_count || mmap_read_lock_count) {
         abort();
-    pthread_mutex_lock(&mmap_mutex);
+    }
+    pthread_rwlock_wrlock(&mmap_rwlock);
 }
 
 void mmap_fork_end(int child)
 {
-    if (child)
-        pthread_mutex_init(&mmap_mutex, NULL);
-    else
-        pthread_mutex_unlock(&mmap_mutex);
+    if (child) {
+        pthread_rwlock_init(&mmap_rwlock, NULL);
+    } else {
+        pthread_rwlock_unlock(&mmap_rwlock);
+    }
 }
 
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
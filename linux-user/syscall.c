@@ -103,6 +103,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "uname.h"
 
 #include "qemu.h"
+#include "tcg.h"
 
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
     CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)
@@ -4616,6 +4617,7 @@ static void *clone_func(void *arg)
     TaskState *ts;
 
     rcu_register_thread();
+    tcg_register_thread();
     env = info->env;
     cpu = ENV_GET_CPU(env);
     thread_cpu = cpu;
@@ -4664,6 +4666,13 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
         new_thread_info info;
         pthread_attr_t attr;
 
+        /* From now on guest atomic operations must be atomic on the
+           host.  The code translated so far assumed a single thread.  */
+        if (!parallel_cpus) {
+            parallel_cpus = true;
+            tb_flush(cpu);
+        }
+
         ts = g_new0(TaskState, 1);
         init_task_state(ts);
         /* we create a new CPU instance. */
@@ -5845,6 +5854,56 @@ static target_timer_t get_timer_id(abi_long arg)
     return timerid;
 }
 
+/* Answer the time queries that language runtimes issue at a high rate
+ * directly from the TCG helper of the syscall instruction, without the
+ * exit to cpu_loop().  Only syscalls that neither block nor affect signals
+ * or the memory map may be handled here.  Returns false if @num must go
+ * through do_syscall(), including when -strace is logging syscalls.
+ */
+bool do_fast_syscall(void *cpu_env, int num, abi_long arg1, abi_long arg2,
+                     abi_long *ret)
+{
+    if (do_strace) {
+        return false;
+    }
+
+    switch (num) {
+#ifdef TARGET_NR_clock_gettime
+    case TARGET_NR_clock_gettime:
+    {
+        struct timespec ts;
+        *ret = get_errno(clock_gettime(arg1, &ts));
+        if (!is_error(*ret) && host_to_target_timespec(arg2, &ts)) {
+            *ret = -TARGET_EFAULT;
+        }
+        return true;
+    }
+#endif
+    case TARGET_NR_gettimeofday:
+    {
+        struct timeval tv;
+        *ret = get_errno(gettimeofday(&tv, NULL));
+        if (!is_error(*ret) && arg1 && copy_to_user_timeval(arg1, &tv)) {
+            *ret = -TARGET_EFAULT;
+        }
+        return true;
+    }
+#ifdef TARGET_NR_time
+    case TARGET_NR_time:
+    {
+        time_t host_time;
+        *ret = get_errno(time(&host_time));
+        if (!is_error(*ret) && arg1 && put_user_sal(host_time, arg1)) {
+            *ret = -TARGET_EFAULT;
+        }
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5889,6 +5948,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             thread_cpu = NULL;
             object_unref(OBJECT(cpu));
             g_free(ts);
+            tcg_unregister_thread();
             rcu_unregister_thread();
             pthread_exit(NULL);
         }
@@ -20,6 +20,8 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -128,6 +130,24 @@ static bool memory_listener_match(MemoryListener *listener,
         }                                                               \
     } while (0)
 
+/* Like MEMORY_LISTENER_CALL_GLOBAL, but skip listeners for a single
+ * address space whose map does not change in this commit.
+ */
+#define MEMORY_LISTENER_CALL_CHANGED(_callback)                         \
+    do {                                                                \
+        MemoryListener *_listener;                                      \
+                                                                        \
+        QTAILQ_FOREACH(_listener, &memory_listeners, link) {            \
+            if (_listener->address_space_filter                         \
+                && !_listener->address_space_filter->next_map) {        \
+                continue;                                               \
+            }                                                           \
+            if (_listener->_callback) {                                 \
+                _listener->_callback(_listener);                        \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
 #define MEMORY_LISTENER_CALL(_callback, _direction, _section, _args...) \
     do {                                                                \
         MemoryListener *_listener;                                      \
@@ -229,7 +249,8 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  A view can be shared by several address spaces, together with its
+ * dispatch tree, which is built when the view is first used.
  */
 struct FlatView {
     struct rcu_head rcu;
@@ -237,6 +258,7 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    struct AddressSpaceDispatch *dispatch;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -253,12 +275,29 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->dispatch = NULL;
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -282,6 +321,9 @@ static void flatview_destroy(FlatView *view)
 {
     int i;
 
+    if (view->dispatch) {
+        address_space_dispatch_free(view->dispatch);
+    }
     for (i = 0; i < view->nr; i++) {
         memory_region_unref(view->ranges[i].mr);
     }
@@ -713,6 +755,119 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Find the region that renders into the same flat view as @mr, looking
+ * through aliases and containers that just map one other region in its
+ * entirety at the same address.  Address spaces whose roots lead to the
+ * same region can then share the view.  Return NULL if nothing would be
+ * rendered at all.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    while (mr && mr->enabled) {
+        if (mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (mr->alias_offset || mr->addr != mr->alias->addr
+                || int128_lt(mr->size, mr->alias->size)) {
+                return mr;
+            }
+            mr = mr->alias;
+        } else if (!mr->terminates && !mr->addr) {
+            MemoryRegion *child, *next = NULL;
+            unsigned found = 0;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (child->enabled) {
+                    next = child;
+                    found++;
+                }
+            }
+            if (!found) {
+                return NULL;
+            }
+            if (found > 1
+                || int128_gt(int128_add(int128_make64(next->addr),
+                                        next->size), mr->size)) {
+                return mr;
+            }
+            mr = next;
+        } else {
+            return mr;
+        }
+    }
+    return NULL;
+}
+
+/* Build the dispatch tree of @view, unless it already has one.  */
+static void flatview_init_dispatch(FlatView *view)
+{
+    FlatRange *fr;
+
+    if (view->dispatch) {
+        return;
+    }
+
+    view->dispatch = address_space_dispatch_new();
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MemoryRegionSection section = {
+            .mr = fr->mr,
+            .offset_within_region = fr->offset_in_region,
+            .size = fr->addr.size,
+            .offset_within_address_space = int128_get64(fr->addr.start),
+            .readonly = fr->readonly,
+        };
+        address_space_dispatch_add(view->dispatch, &section);
+    }
+    address_space_dispatch_compact(view->dispatch);
+}
+
+/* Render the new map of every address space into as->next_map, leaving it
+ * NULL if the map did not change.  Each distinct root is rendered once,
+ * and address spaces with the same root end up sharing one view: if the
+ * rendering matches the current view of one of them, that view is reused
+ * by the others.  Return whether any map changed.
+ */
+static bool address_spaces_generate_topology(void)
+{
+    GHashTable *views = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                              NULL,
+                                              (GDestroyNotify)flatview_unref);
+    AddressSpace *as;
+    bool changed = false;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *root = memory_region_get_flatview_root(as->root);
+        FlatView *view = g_hash_table_lookup(views, root);
+
+        if (!view) {
+            view = generate_memory_topology(root);
+            g_hash_table_insert(views, root, view);
+        }
+        /* Views that are in use already have a dispatch tree.  */
+        if (!view->dispatch && flatview_equal(view, as->current_map)) {
+            flatview_ref(as->current_map);
+            g_hash_table_insert(views, root, as->current_map);
+        }
+    }
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *root = memory_region_get_flatview_root(as->root);
+        FlatView *view = g_hash_table_lookup(views, root);
+
+        if (view == as->current_map || flatview_equal(view, as->current_map)) {
+            as->next_map = NULL;
+        } else {
+            flatview_ref(view);
+            as->next_map = view;
+            changed = true;
+        }
+    }
+
+    g_hash_table_destroy(views);
+    return changed;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -878,13 +1033,16 @@ static void address_space_update_topology_pass(AddressSpace *as,
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = as->next_map;
+
+    flatview_init_dispatch(new_view);
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
+    atomic_rcu_set(&as->dispatch, new_view->dispatch);
     call_rcu(old_view, flatview_unref, rcu);
 
     /* Note that all the old MemoryRegions are still alive up to this
@@ -917,14 +1075,26 @@ void memory_region_transaction_commit(void)
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
-        if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+        if (memory_region_update_pending
+            && address_spaces_generate_topology()) {
+            /* Only address spaces whose map changed are updated, and
+             * only their listeners hear about the commit.
+             */
+            MEMORY_LISTENER_CALL_CHANGED(begin);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                if (as->next_map) {
+                    address_space_update_topology(as);
+                } else if (ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            MEMORY_LISTENER_CALL_CHANGED(commit);
+
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->next_map = NULL;
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1206,6 +1376,13 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+static bool memory_region_profiling;
+
+void memory_region_profile_enable(bool enable)
+{
+    atomic_set(&memory_region_profiling, enable);
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
@@ -1213,14 +1390,25 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         MemTxAttrs attrs)
 {
     MemTxResult r;
+    int64_t start = 0;
+    bool profile;
 
     if (!memory_region_access_valid(mr, addr, size, false)) {
         *pval = unassigned_mem_read(mr, addr, size);
         return MEMTX_DECODE_ERROR;
     }
 
+    profile = unlikely(atomic_read(&memory_region_profiling));
+    if (profile) {
+        start = get_clock();
+    }
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
     adjust_endianness(mr, pval, size);
+    if (profile) {
+        atomic_inc(&mr->profile.reads);
+        atomic_add(&mr->profile.read_bytes, size);
+        atomic_add(&mr->profile.read_ns, get_clock() - start);
+    }
     return r;
 }
 
@@ -1250,17 +1438,12 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
-MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
-                                         hwaddr addr,
-                                         uint64_t data,
-                                         unsigned size,
-                                         MemTxAttrs attrs)
+static MemTxResult memory_region_dispatch_write1(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 uint64_t data,
+                                                 unsigned size,
+                                                 MemTxAttrs attrs)
 {
-    if (!memory_region_access_valid(mr, addr, size, true)) {
-        unassigned_mem_write(mr, addr, data, size);
-        return MEMTX_DECODE_ERROR;
-    }
-
     adjust_endianness(mr, &data, size);
 
     if ((!kvm_eventfds_enabled()) &&
@@ -1288,6 +1471,32 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
     }
 }
 
+MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint64_t data,
+                                         unsigned size,
+                                         MemTxAttrs attrs)
+{
+    MemTxResult r;
+    int64_t start;
+
+    if (!memory_region_access_valid(mr, addr, size, true)) {
+        unassigned_mem_write(mr, addr, data, size);
+        return MEMTX_DECODE_ERROR;
+    }
+
+    if (likely(!atomic_read(&memory_region_profiling))) {
+        return memory_region_dispatch_write1(mr, addr, data, size, attrs);
+    }
+
+    start = get_clock();
+    r = memory_region_dispatch_write1(mr, addr, data, size, attrs);
+    atomic_inc(&mr->profile.writes);
+    atomic_add(&mr->profile.write_bytes, size);
+    atomic_add(&mr->profile.write_ns, get_clock() - start);
+    return r;
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            Object *owner,
                            const MemoryRegionOps *ops,
@@ -2222,11 +2431,20 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->malloced = false;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    flatview_init_dispatch(as->current_map);
+    as->dispatch = as->current_map->dispatch;
+    as->next_map = NULL;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    as->bounce_maps = 0;
+    as->bounce_map_failures = 0;
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
-    address_space_init_dispatch(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
 }
@@ -2236,12 +2454,18 @@ static void do_address_space_destroy(AddressSpace *as)
     MemoryListener *listener;
     bool do_free = as->malloced;
 
-    address_space_destroy_dispatch(as);
-
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
         assert(listener->address_space_filter != as);
     }
 
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        AddressSpaceMapClient *client = QLIST_FIRST(&as->map_client_list);
+        QLIST_REMOVE(client, link);
+        g_free(client);
+    }
+    qemu_mutex_destroy(&as->bounce_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2281,7 +2505,6 @@ void address_space_destroy(AddressSpace *as)
     as->root = NULL;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
-    address_space_unregister(as);
 
     /* At this point, as->dispatch and as->current_map are dummy
      * entries that the guest should never use.  Wait for the old
@@ -2300,10 +2523,28 @@ struct MemoryRegionList {
 
 typedef QTAILQ_HEAD(queue, MemoryRegionList) MemoryRegionListHead;
 
+static void mtree_print_profile(fprintf_function mon_printf, void *f,
+                                const MemoryRegion *mr)
+{
+    const MemoryRegionProfile *p = &mr->profile;
+    uint64_t reads = atomic_read(&p->reads);
+    uint64_t writes = atomic_read(&p->writes);
+
+    if (!reads && !writes) {
+        return;
+    }
+    mon_printf(f, " [reads %" PRIu64 " (%" PRIu64 " bytes, %" PRIu64 " ns)"
+               " writes %" PRIu64 " (%" PRIu64 " bytes, %" PRIu64 " ns)]",
+               reads, atomic_read(&p->read_bytes), atomic_read(&p->read_ns),
+               writes, atomic_read(&p->write_bytes),
+               atomic_read(&p->write_ns));
+}
+
 static void mtree_print_mr(fprintf_function mon_printf, void *f,
                            const MemoryRegion *mr, unsigned int level,
                            hwaddr base,
-                           MemoryRegionListHead *alias_print_queue)
+                           MemoryRegionListHead *alias_print_queue,
+                           bool profile)
 {
     MemoryRegionList *new_ml, *ml, *next_ml;
     MemoryRegionListHead submr_print_queue;
@@ -2336,7 +2577,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
         }
         mon_printf(f, TARGET_FMT_plx "-" TARGET_FMT_plx
                    " (prio %d, %c%c): alias %s @%s " TARGET_FMT_plx
-                   "-" TARGET_FMT_plx "%s\n",
+                   "-" TARGET_FMT_plx "%s",
                    base + mr->addr,
                    base + mr->addr
                    + (int128_nz(mr->size) ?
@@ -2356,7 +2597,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                    mr->enabled ? "" : " [disabled]");
     } else {
         mon_printf(f,
-                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s%s\n",
+                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s%s",
                    base + mr->addr,
                    base + mr->addr
                    + (int128_nz(mr->size) ?
@@ -2369,6 +2610,10 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                    memory_region_name(mr),
                    mr->enabled ? "" : " [disabled]");
     }
+    if (profile) {
+        mtree_print_profile(mon_printf, f, mr);
+    }
+    mon_printf(f, "\n");
 
     QTAILQ_INIT(&submr_print_queue);
 
@@ -2391,7 +2636,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
 
     QTAILQ_FOREACH(ml, &submr_print_queue, queue) {
         mtree_print_mr(mon_printf, f, ml->mr, level + 1, base + mr->addr,
-                       alias_print_queue);
+                       alias_print_queue, profile);
     }
 
     QTAILQ_FOREACH_SAFE(ml, &submr_print_queue, queue, next_ml) {
@@ -2399,7 +2644,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
     }
 }
 
-void mtree_info(fprintf_function mon_printf, void *f)
+void mtree_info(fprintf_function mon_printf, void *f, bool profile)
 {
     MemoryRegionListHead ml_head;
     MemoryRegionList *ml, *ml2;
@@ -2409,14 +2654,20 @@ void mtree_info(fprintf_function mon_printf, void *f)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         mon_printf(f, "address-space: %s\n", as->name);
-        mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head);
+        if (as->bounce_maps || as->bounce_map_failures) {
+            mon_printf(f, "  bounce buffers: %u mapped, %u failed, "
+                       "%zu of %zu bytes in use\n",
+                       as->bounce_maps, as->bounce_map_failures,
+                       as->bounce_buffer_size, as->max_bounce_buffer_size);
+        }
+        mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head, profile);
         mon_printf(f, "\n");
     }
 
     /* print aliased regions */
     QTAILQ_FOREACH(ml, &ml_head, queue) {
         mon_printf(f, "memory-region: %s\n", memory_region_name(ml->mr));
-        mtree_print_mr(mon_printf, f, ml->mr, 1, 0, &ml_head);
+        mtree_print_mr(mon_printf, f, ml->mr, 1, 0, &ml_head, profile);
         mon_printf(f, "\n");
     }
 
@@ -2425,6 +2676,68 @@ void mtree_info(fprintf_function mon_printf, void *f)
     }
 }
 
+static void memory_region_profile_walk(MemoryRegion *mr, GHashTable *visited)
+{
+    MemoryRegion *submr;
+
+    while (mr && !g_hash_table_lookup(visited, mr)) {
+        g_hash_table_insert(visited, mr, mr);
+        QTAILQ_FOREACH(submr, &mr->subregions, subregions_link) {
+            memory_region_profile_walk(submr, visited);
+        }
+        mr = mr->alias;
+    }
+}
+
+/* Regions have no global list; collect those reachable from an address
+ * space, each of them once even if it is aliased or shared.
+ */
+static GHashTable *memory_region_profile_regions(void)
+{
+    GHashTable *visited = g_hash_table_new(NULL, NULL);
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        memory_region_profile_walk(as->root, visited);
+    }
+    return visited;
+}
+
+void memory_region_profile_reset(void)
+{
+    GHashTable *regions = memory_region_profile_regions();
+    GHashTableIter iter;
+    MemoryRegion *mr;
+
+    g_hash_table_iter_init(&iter, regions);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&mr, NULL)) {
+        atomic_set(&mr->profile.reads, 0);
+        atomic_set(&mr->profile.writes, 0);
+        atomic_set(&mr->profile.read_bytes, 0);
+        atomic_set(&mr->profile.write_bytes, 0);
+        atomic_set(&mr->profile.read_ns, 0);
+        atomic_set(&mr->profile.write_ns, 0);
+    }
+    g_hash_table_destroy(regions);
+}
+
+void memory_region_profile_foreach(void (*fn)(MemoryRegion *mr, void *opaque),
+                                   void *opaque)
+{
+    GHashTable *regions = memory_region_profile_regions();
+    GHashTableIter iter;
+    MemoryRegion *mr;
+
+    g_hash_table_iter_init(&iter, regions);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&mr, NULL)) {
+        if (atomic_read(&mr->profile.reads) ||
+            atomic_read(&mr->profile.writes)) {
+            fn(mr, opaque);
+        }
+    }
+    g_hash_table_destroy(regions);
+}
+
 static const TypeInfo memory_region_info = {
     .parent             = TYPE_OBJECT,
     .name               = TYPE_MEMORY_REGION,
@@ -16,6 +16,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "block/block.h"
+#include "qemu/hbitmap.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "hw/hw.h"
@@ -26,6 +27,9 @@
 #include "sysemu/blockdev.h"
 #include "sysemu/block-backend.h"
 
+/* Default chunk size (x-block-chunk-size), implied by streams that don't
+ * carry BLK_MIG_FLAG_CHUNK_SIZE
+ */
 #define BLOCK_SIZE                       (1 << 20)
 #define BDRV_SECTORS_PER_DIRTY_CHUNK     (BLOCK_SIZE >> BDRV_SECTOR_BITS)
 
@@ -33,10 +37,12 @@
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_CHUNK_SIZE         0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
-#define MAX_INFLIGHT_IO 512
+/* Chunks read but not sent yet, for all devices */
+#define MAX_INFLIGHT_BYTES (512 * BLOCK_SIZE)
 
 //#define DEBUG_BLK_MIGRATION
 
@@ -68,6 +74,7 @@ typedef struct BlkMigDevState {
 
     /* Protected by block migration lock.  */
     int64_t completed_sectors;
+    int inflight;
 
     /* During migration this is protected by iothread lock / AioContext.
      * Allocation and free happen during setup and cleanup respectively.
@@ -97,6 +104,9 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    int chunk_size;
+    int chunk_sectors;
+    int max_inflight;
 
     /* Protected by lock.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
@@ -107,6 +117,11 @@ typedef struct BlkMigState {
     int transferred;
     int prev_progress;
     int bulk_completed;
+    /* Device whose bulk phase goes next */
+    BlkMigDevState *bulk_cursor;
+
+    /* Chunk size of the incoming stream */
+    int load_chunk_sectors;
 
     /* Lock must be taken _inside_ the iothread lock and any AioContexts.  */
     QemuMutex lock;
@@ -133,8 +148,10 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+    /* chunks without a buffer were found to be zero by block status */
+    if (!blk->buf || (block_mig_state.zero_blocks &&
+                      buffer_is_zero(blk->buf,
+                                     blk->nr_sectors << BDRV_SECTOR_BITS))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -155,7 +172,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         return;
     }
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    qemu_put_buffer(f, blk->buf, block_mig_state.chunk_size);
 }
 
 int blk_mig_active(void)
@@ -197,7 +214,7 @@ uint64_t blk_mig_bytes_total(void)
 
 static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
+    int64_t chunk = sector / block_mig_state.chunk_sectors;
 
     if (sector < bdrv_nb_sectors(bmds->bs)) {
         return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
@@ -215,8 +232,8 @@ static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
     int64_t start, end;
     unsigned long val, idx, bit;
 
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
+    start = sector_num / block_mig_state.chunk_sectors;
+    end = (sector_num + nb_sectors - 1) / block_mig_state.chunk_sectors;
 
     for (; start <= end; start++) {
         idx = start / (sizeof(unsigned long) * 8);
@@ -236,8 +253,8 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     BlockDriverState *bs = bmds->bs;
     int64_t bitmap_size;
 
-    bitmap_size = bdrv_nb_sectors(bs) + BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
+    bitmap_size = bdrv_nb_sectors(bs) + block_mig_state.chunk_sectors * 8 - 1;
+    bitmap_size /= block_mig_state.chunk_sectors * 8;
 
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
@@ -254,12 +271,34 @@ static void blk_mig_read_cb(void *opaque, int ret)
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
+    blk->bmds->inflight--;
     block_mig_state.submitted--;
     block_mig_state.read_done++;
     assert(block_mig_state.submitted >= 0);
     blk_mig_unlock();
 }
 
+/* Called with iothread lock and AioContext taken.  */
+
+static bool blk_mig_chunk_is_zero(BlockDriverState *bs, int64_t sector,
+                                  int nr_sectors)
+{
+    BlockDriverState *file;
+    int64_t ret;
+    int pnum;
+
+    while (nr_sectors > 0) {
+        ret = bdrv_get_block_status_above(bs, NULL, sector, nr_sectors,
+                                          &pnum, &file);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || !pnum) {
+            return false;
+        }
+        sector += pnum;
+        nr_sectors -= pnum;
+    }
+    return true;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -289,29 +328,20 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     bmds->completed_sectors = cur_sector;
 
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    cur_sector &= ~((int64_t)block_mig_state.chunk_sectors - 1);
 
     /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    nr_sectors = block_mig_state.chunk_sectors;
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+    if (total_sectors - cur_sector < block_mig_state.chunk_sectors) {
         nr_sectors = total_sectors - cur_sector;
     }
 
     blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
-
     /* We do not know if bs is under the main thread (and thus does
      * not acquire the AioContext when doing AIO) or rather under
      * dataplane.  Thus acquire both the iothread mutex and the
@@ -322,8 +352,29 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
      */
     qemu_mutex_lock_iothread();
     aio_context_acquire(bdrv_get_aio_context(bmds->bs));
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
+    if (block_mig_state.zero_blocks &&
+        blk_mig_chunk_is_zero(bs, cur_sector, nr_sectors)) {
+        /* Nothing to read, the chunk is sent as a zero block */
+        blk->buf = NULL;
+        blk->ret = 0;
+        blk_mig_lock();
+        QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+        block_mig_state.read_done++;
+        blk_mig_unlock();
+    } else {
+        blk->buf = g_malloc(block_mig_state.chunk_size);
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds->inflight++;
+        blk_mig_unlock();
+
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+    }
 
     bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
     aio_context_release(bdrv_get_aio_context(bmds->bs));
@@ -338,11 +389,12 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 static int set_dirty_tracking(void)
 {
     BlkMigDevState *bmds;
+    uint32_t granularity = block_mig_state.chunk_size;
     int ret;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         aio_context_acquire(bdrv_get_aio_context(bmds->bs));
-        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, BLOCK_SIZE,
+        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, granularity,
                                                       NULL, NULL);
         aio_context_release(bdrv_get_aio_context(bmds->bs));
         if (!bmds->dirty_bitmap) {
@@ -389,6 +441,11 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.chunk_size = migrate_block_chunk_size();
+    block_mig_state.chunk_sectors =
+        block_mig_state.chunk_size >> BDRV_SECTOR_BITS;
+    block_mig_state.max_inflight = migrate_block_inflight();
+    block_mig_state.bulk_cursor = NULL;
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
         if (bdrv_is_read_only(bs)) {
@@ -424,29 +481,58 @@ static void init_blk_migration(QEMUFile *f)
     }
 }
 
-/* Called with no lock taken.  */
-
+/* Called with no lock taken.
+ *
+ * The devices still in their bulk phase take turns, so that they are all
+ * read concurrently, each with up to x-block-inflight chunk reads.
+ *
+ * return value:
+ * 0: bulk phase completed on all devices
+ * 1: a chunk was submitted
+ * 2: all devices have as many reads in flight as they may
+ */
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
     int64_t completed_sector_sum = 0;
-    BlkMigDevState *bmds;
+    BlkMigDevState *bmds, *start;
     int progress;
     int ret = 0;
+    bool busy;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+    start = block_mig_state.bulk_cursor;
+    if (!start) {
+        start = QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+    }
+    bmds = start;
+    while (bmds) {
         if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
-                /* completed bulk section for this device */
-                bmds->bulk_completed = 1;
+            blk_mig_lock();
+            busy = bmds->inflight >= block_mig_state.max_inflight;
+            blk_mig_unlock();
+            ret = 2;
+            if (!busy) {
+                if (mig_save_device_bulk(f, bmds) == 1) {
+                    /* completed bulk section for this device */
+                    bmds->bulk_completed = 1;
+                }
+                block_mig_state.bulk_cursor = QSIMPLEQ_NEXT(bmds, entry);
+                ret = 1;
+                break;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
+        }
+        bmds = QSIMPLEQ_NEXT(bmds, entry);
+        if (!bmds) {
+            bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+        }
+        if (bmds == start) {
             break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
     }
 
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        completed_sector_sum += bmds->completed_sectors;
+    }
+
     if (block_mig_state.total_sector_sum != 0) {
         progress = completed_sector_sum * 100 /
                    block_mig_state.total_sector_sum;
@@ -478,62 +564,67 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
+    HBitmapIter hbi;
     int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
-            blk_mig_unlock();
-            bdrv_drain(bmds->bs);
-        } else {
-            blk_mig_unlock();
-        }
-        if (bdrv_get_dirty(bmds->bs, bmds->dirty_bitmap, sector)) {
+    /* Small chunks make for a big bitmap, so skip straight to dirty ones */
+    bdrv_dirty_iter_init(bmds->dirty_bitmap, &hbi);
+    bdrv_set_dirty_iter(&hbi, bmds->cur_dirty);
+    sector = hbitmap_iter_next(&hbi);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_new(BlkMigBlock, 1);
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        bdrv_drain(bmds->bs);
+    } else {
+        blk_mig_unlock();
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (total_sectors - sector < block_mig_state.chunk_sectors) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = block_mig_state.chunk_sectors;
+    }
+    blk = g_new(BlkMigBlock, 1);
+    blk->buf = g_malloc(block_mig_state.chunk_size);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-            bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
-            break;
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds->inflight++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
+    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
+    bmds->cur_dirty = sector + nr_sectors;
+
     return (bmds->cur_dirty >= bmds->total_sectors);
 
 error:
@@ -678,6 +769,11 @@ static int block_save_setup(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    if (block_mig_state.chunk_size != BLOCK_SIZE) {
+        qemu_put_be64(f, ((uint64_t)block_mig_state.chunk_sectors
+                          << BDRV_SECTOR_BITS) | BLK_MIG_FLAG_CHUNK_SIZE);
+    }
+
     ret = flush_blks(f);
     blk_mig_reset_dirty_cursor();
     qemu_put_be64(f, BLK_MIG_FLAG_EOS);
@@ -704,19 +800,21 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     /* control the rate of transfer */
     blk_mig_lock();
     while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
+            block_mig_state.read_done) * block_mig_state.chunk_size <
            qemu_file_get_rate_limit(f) &&
            (block_mig_state.submitted +
-            block_mig_state.read_done) <
-           MAX_INFLIGHT_IO) {
+            block_mig_state.read_done) * block_mig_state.chunk_size <
+           MAX_INFLIGHT_BYTES) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f);
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
             }
-            ret = 0;
+            /* stop here if every device waits for its reads */
+            ret = (ret == 2);
         } else {
             /* Always called with iothread lock taken for
              * simplicity, block_save_complete also calls it.
@@ -803,13 +901,13 @@ static void block_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     qemu_mutex_unlock_iothread();
 
     blk_mig_lock();
-    pending += block_mig_state.submitted * BLOCK_SIZE +
-               block_mig_state.read_done * BLOCK_SIZE;
+    pending += block_mig_state.submitted * block_mig_state.chunk_size +
+               block_mig_state.read_done * block_mig_state.chunk_size;
     blk_mig_unlock();
 
     /* Report at least one block pending during bulk phase */
     if (pending <= max_size && !block_mig_state.bulk_completed) {
-        pending = max_size + BLOCK_SIZE;
+        pending = max_size + block_mig_state.chunk_size;
     }
 
     DPRINTF("Enter save live pending  %" PRIu64 "\n", pending);
@@ -828,7 +926,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
     Error *local_err = NULL;
     uint8_t *buf;
     int64_t total_sectors = 0;
-    int nr_sectors;
+    int nr_sectors, chunk_sectors;
     int ret;
 
     do {
@@ -872,18 +970,19 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 }
             }
 
-            if (total_sectors - addr < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            chunk_sectors = block_mig_state.load_chunk_sectors;
+            if (total_sectors - addr < chunk_sectors) {
                 nr_sectors = total_sectors - addr;
             } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+                nr_sectors = chunk_sectors;
             }
 
             if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
                 ret = bdrv_write_zeroes(bs, addr, nr_sectors,
                                         BDRV_REQ_MAY_UNMAP);
             } else {
-                buf = g_malloc(BLOCK_SIZE);
-                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                buf = g_malloc(chunk_sectors << BDRV_SECTOR_BITS);
+                qemu_get_buffer(f, buf, chunk_sectors << BDRV_SECTOR_BITS);
                 ret = bdrv_write(bs, addr, buf, nr_sectors);
                 g_free(buf);
             }
@@ -899,6 +998,14 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             printf("Completed %d %%%c", (int)addr,
                    (addr == 100) ? '\n' : '\r');
             fflush(stdout);
+        } else if (flags & BLK_MIG_FLAG_CHUNK_SIZE) {
+            if (addr < (4096 >> BDRV_SECTOR_BITS) ||
+                addr > BDRV_SECTORS_PER_DIRTY_CHUNK || !is_power_of_2(addr)) {
+                error_report("Invalid block migration chunk size: %" PRId64
+                             " sectors", addr);
+                return -EINVAL;
+            }
+            block_mig_state.load_chunk_sectors = addr;
         } else if (!(flags & BLK_MIG_FLAG_EOS)) {
             fprintf(stderr, "Unknown block migration flags: %#x\n", flags);
             return -EINVAL;
@@ -942,6 +1049,7 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
     qemu_mutex_init(&block_mig_state.lock);
+    block_mig_state.load_chunk_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
     register_savevm_live(NULL, "block", 0, 1, &savevm_block_handlers,
                          &block_mig_state);
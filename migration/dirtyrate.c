@@ -0,0 +1,198 @@
+/*
+ * Guest dirty page rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The dirty rate is estimated without touching the dirty log, so that it
+ * can run alongside anything else that uses it (VGA, a migration, ...):
+ * a few random pages of every RAM block are hashed, and hashed again
+ * after the measurement period.  The fraction of changed samples, applied
+ * to the whole guest RAM, gives the number of bytes dirtied per second.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/cpu-common.h"
+#include "trace.h"
+
+/* Granularity of the samples, independent of the target page size */
+#define DIRTYRATE_SAMPLE_SIZE           4096
+/* Number of samples taken per GiB of guest RAM */
+#define DIRTYRATE_SAMPLES_PER_GIB       512
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    ram_addr_t length;
+    uint64_t nr_samples;
+    uint64_t *offsets;
+    uint32_t *hashes;
+} DirtyRateBlock;
+
+typedef struct DirtyRateSampling {
+    DirtyRateBlock *blocks;
+    int nr_blocks;
+    uint64_t total_samples;
+    uint64_t dirty_samples;
+    uint64_t total_bytes;
+} DirtyRateSampling;
+
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t dirty_rate;
+} dirty_rate_state;
+
+static uint32_t dirtyrate_hash(void *host, uint64_t offset)
+{
+    return crc32(0, (Bytef *)host + offset, DIRTYRATE_SAMPLE_SIZE);
+}
+
+static int dirtyrate_sample_block(const char *block_name, void *host_addr,
+                                  ram_addr_t offset, ram_addr_t length,
+                                  void *opaque)
+{
+    DirtyRateSampling *s = opaque;
+    DirtyRateBlock *b;
+    uint64_t nr_pages = length / DIRTYRATE_SAMPLE_SIZE;
+    uint64_t i;
+
+    if (!nr_pages) {
+        return 0;
+    }
+
+    s->blocks = g_renew(DirtyRateBlock, s->blocks, s->nr_blocks + 1);
+    b = &s->blocks[s->nr_blocks++];
+    pstrcpy(b->idstr, sizeof(b->idstr), block_name);
+    b->length = length;
+    b->nr_samples = MIN(nr_pages,
+                        MAX(1, (length >> 30) * DIRTYRATE_SAMPLES_PER_GIB));
+    b->offsets = g_new(uint64_t, b->nr_samples);
+    b->hashes = g_new(uint32_t, b->nr_samples);
+    for (i = 0; i < b->nr_samples; i++) {
+        uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+        b->offsets[i] = (r % nr_pages) * DIRTYRATE_SAMPLE_SIZE;
+        b->hashes[i] = dirtyrate_hash(host_addr, b->offsets[i]);
+    }
+    s->total_bytes += length;
+    return 0;
+}
+
+/* Blocks are found again by name, since they may have gone away while we
+ * were sleeping; blocks that vanished or were resized are not counted.
+ */
+static int dirtyrate_compare_block(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    DirtyRateSampling *s = opaque;
+    int i;
+    uint64_t j;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        DirtyRateBlock *b = &s->blocks[i];
+
+        if (strcmp(b->idstr, block_name) || b->length != length) {
+            continue;
+        }
+        for (j = 0; j < b->nr_samples; j++) {
+            if (dirtyrate_hash(host_addr, b->offsets[j]) != b->hashes[j]) {
+                s->dirty_samples++;
+            }
+        }
+        s->total_samples += b->nr_samples;
+        break;
+    }
+    return 0;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateSampling s = { };
+    int64_t calc_time = dirty_rate_state.calc_time;
+    int64_t start_ms, elapsed_ms;
+    int64_t dirty_rate = 0;
+    int i;
+
+    rcu_register_thread();
+
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_ram_foreach_block(dirtyrate_sample_block, &s);
+    g_usleep(calc_time * G_USEC_PER_SEC);
+    qemu_ram_foreach_block(dirtyrate_compare_block, &s);
+    elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms;
+
+    if (s.total_samples && elapsed_ms) {
+        /* MiB/s of guest RAM that was dirtied */
+        dirty_rate = (double)s.dirty_samples / s.total_samples *
+                     s.total_bytes / (1024 * 1024) * 1000 / elapsed_ms;
+    }
+    trace_dirtyrate_measured(s.total_samples, s.dirty_samples, elapsed_ms,
+                             dirty_rate);
+
+    for (i = 0; i < s.nr_blocks; i++) {
+        g_free(s.blocks[i].offsets);
+        g_free(s.blocks[i].hashes);
+    }
+    g_free(s.blocks);
+
+    dirty_rate_state.dirty_rate = dirty_rate;
+    atomic_mb_set(&dirty_rate_state.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    QemuThread thread;
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer between 1 and 60");
+        return;
+    }
+    if (atomic_mb_read(&dirty_rate_state.status) ==
+        DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+
+    dirty_rate_state.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate_state.calc_time = calc_time;
+    dirty_rate_state.dirty_rate = 0;
+    atomic_mb_set(&dirty_rate_state.status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = atomic_mb_read(&dirty_rate_state.status);
+    info->start_time = dirty_rate_state.start_time;
+    info->calc_time = dirty_rate_state.calc_time;
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirty_rate_state.dirty_rate;
+    }
+    return info;
+}
@@ -52,6 +52,16 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define MAX_MIGRATE_POSTCOPY_PREFETCH_PAGES 1024
+#define DEFAULT_MIGRATE_RDMA_CHUNK_SIZE 1
+#define MAX_MIGRATE_RDMA_CHUNK_SIZE 1024
+#define DEFAULT_MIGRATE_IOV_BATCH 64
+#define MAX_MIGRATE_IOV_BATCH 1024
+#define DEFAULT_MIGRATE_BLOCK_CHUNK_SIZE 1024
+#define MAX_MIGRATE_BLOCK_CHUNK_SIZE 1024
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT 16
+#define MAX_MIGRATE_BLOCK_INFLIGHT 512
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,6 +101,20 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] =
+                MIGRATION_COMPRESS_METHOD_ZLIB,
+        .parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES] = 0,
+        .parameters[MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE] =
+                DEFAULT_MIGRATE_RDMA_CHUNK_SIZE,
+        .parameters[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE] = 0,
+        .parameters[MIGRATION_PARAMETER_X_IOV_BATCH] =
+                DEFAULT_MIGRATE_IOV_BATCH,
+        .parameters[MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE] =
+                DEFAULT_MIGRATE_BLOCK_CHUNK_SIZE,
+        .parameters[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT] =
+                DEFAULT_MIGRATE_BLOCK_INFLIGHT,
     };
 
     if (!once) {
@@ -297,12 +321,29 @@ void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
     }
 }
 
+/* Request pages that the guest has not asked for yet, but is likely to;
+ * they are relative to the RAMBlock of the last page request.
+ */
+void migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                    ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12]; /* start (8), len (4) */
+
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
+    migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES_PREFETCH, sizeof(bufc),
+                            bufc);
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
-    if (!strcmp(uri, "defer")) {
+    if (migrate_use_tls() && !strstart(uri, "tcp:", NULL) &&
+        strcmp(uri, "defer")) {
+        error_setg(errp, "tls-creds is only supported by tcp: migration");
+    } else if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
     } else if (strstart(uri, "tcp:", &p)) {
         tcp_start_incoming_migration(p, errp);
@@ -335,6 +376,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -359,6 +401,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    multifd_recv_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -412,6 +455,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -525,6 +569,26 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->compress_method =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+    params->x_postcopy_prefetch_pages =
+            s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES];
+    params->x_rdma_chunk_size =
+            s->parameters[MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE];
+    params->x_rdma_reg_cache_size =
+            s->parameters[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE];
+    params->x_iov_batch =
+            s->parameters[MIGRATION_PARAMETER_X_IOV_BATCH];
+    params->x_block_chunk_size =
+            s->parameters[MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE];
+    params->x_block_inflight =
+            s->parameters[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT];
+    params->has_tls_creds = !!s->tls_creds;
+    params->tls_creds = g_strdup(s->tls_creds);
+    params->has_tls_hostname = !!s->tls_hostname;
+    params->tls_hostname = g_strdup(s->tls_hostname);
 
     return params;
 }
@@ -556,11 +620,41 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_evictions = xbzrle_mig_cache_evictions();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_migration_timings(MigrationInfo *info, MigrationState *s)
+{
+    MigrationTimings *t = g_new0(MigrationTimings, 1);
+    MigrationSectionTimeList *entry, **tail = &t->stop_copy;
+
+    t->bitmap_sync = ram_bitmap_sync_time() / 1000;
+    t->page_scan = ram_page_scan_time() / 1000;
+    t->compression = ram_compress_time() / 1000;
+    t->xbzrle = ram_xbzrle_time() / 1000;
+    t->socket_write = (s->to_dst_file ?
+                       qemu_file_get_write_time(s->to_dst_file) :
+                       s->socket_write_time) / 1000;
+    t->throttled = s->throttle_time / 1000;
+
+    for (entry = s->stop_copy_times; entry; entry = entry->next) {
+        *tail = g_new0(MigrationSectionTimeList, 1);
+        (*tail)->value = g_new0(MigrationSectionTime, 1);
+        (*tail)->value->idstr = g_strdup(entry->value->idstr);
+        (*tail)->value->instance_id = entry->value->instance_id;
+        (*tail)->value->time = entry->value->time;
+        tail = &(*tail)->next;
+    }
+    t->has_stop_copy = t->stop_copy != NULL;
+
+    info->has_x_timings = true;
+    info->x_timings = t;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -612,6 +706,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_migration_timings(info, s);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
         /* Mostly the same as active; TODO add some postcopy stats */
@@ -646,9 +741,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_migration_timings(info, s);
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_migration_timings(info, s);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -710,6 +807,66 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Pages sent on the extra channels are read from guest memory by
+         * the channel threads, so they need each page to be sent whole,
+         * and the destination places them without the postcopy protocol.
+         */
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression()) {
+            error_report("x-multifd is not currently compatible with "
+                         "postcopy-ram, xbzrle or compress");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_ignore_shared() && migrate_postcopy_ram()) {
+        /* The postcopy destination discards all of RAM when advised,
+         * which would wipe the memory it shares with the source.
+         */
+        error_report("x-ignore-shared is not compatible with postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED] = false;
+    }
+
+    if (migrate_mapped_ram()) {
+        /* Pages are written straight from guest memory to their place in
+         * the file, with no stream left to carry anything else.
+         */
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression() || migrate_use_multifd()) {
+            error_report("x-mapped-ram is not compatible with postcopy-ram, "
+                         "xbzrle, compress or x-multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] = false;
+        }
+    }
+
+    if (migrate_zerocopy_send() && migrate_use_xbzrle()) {
+        /* Pages go out some time after they were queued, while the XBZRLE
+         * cache keeps what they held when they were queued.
+         */
+        error_report("x-zerocopy-send is not compatible with xbzrle");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZEROCOPY_SEND] = false;
+    }
+
+    if (migrate_background_snapshot()) {
+        /* The child process that writes the snapshot only has the thread
+         * that forked it.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_multifd() || migrate_zerocopy_send()) {
+            error_report("x-background-snapshot is not compatible with "
+                         "postcopy-ram, compress, x-multifd or "
+                         "x-zerocopy-send");
+            s->enabled_capabilities[
+                MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT] = false;
+        }
+    }
+
+    if (migrate_lazy_restore() && !migrate_mapped_ram()) {
+        error_report("x-lazy-restore requires x-mapped-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] = false;
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +878,28 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_x_postcopy_prefetch_pages,
+                                int64_t x_postcopy_prefetch_pages,
+                                bool has_x_rdma_chunk_size,
+                                int64_t x_rdma_chunk_size,
+                                bool has_x_rdma_reg_cache_size,
+                                int64_t x_rdma_reg_cache_size,
+                                bool has_x_iov_batch,
+                                int64_t x_iov_batch,
+                                bool has_x_block_chunk_size,
+                                int64_t x_block_chunk_size,
+                                bool has_x_block_inflight,
+                                int64_t x_block_inflight,
+                                bool has_tls_creds,
+                                const char *tls_creds,
+                                bool has_tls_hostname,
+                                const char *tls_hostname,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -756,6 +934,68 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_postcopy_prefetch_pages &&
+            (x_postcopy_prefetch_pages < 0 ||
+             x_postcopy_prefetch_pages > MAX_MIGRATE_POSTCOPY_PREFETCH_PAGES)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_prefetch_pages",
+                   "an integer in the range of 0 to 1024");
+        return;
+    }
+    if (has_x_rdma_chunk_size &&
+            (x_rdma_chunk_size < 1 ||
+             x_rdma_chunk_size > MAX_MIGRATE_RDMA_CHUNK_SIZE ||
+             !is_power_of_2(x_rdma_chunk_size))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_rdma_chunk_size",
+                   "a power of two in the range of 1 to 1024");
+        return;
+    }
+    if (has_x_rdma_reg_cache_size &&
+            (x_rdma_reg_cache_size < 0 || x_rdma_reg_cache_size > INT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_rdma_reg_cache_size",
+                   "a positive integer, or 0 for no limit");
+        return;
+    }
+    if (has_compress_method && !migrate_compress_method_supported(
+                                    compress_method)) {
+        error_setg(errp, "compress-method '%s' is not supported by this "
+                   "QEMU build",
+                   MigrationCompressMethod_lookup[compress_method]);
+        return;
+    }
+    if (has_x_iov_batch &&
+            (x_iov_batch < 1 || x_iov_batch > MAX_MIGRATE_IOV_BATCH)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_iov_batch",
+                   "an integer in the range of 1 to 1024");
+        return;
+    }
+    if (has_x_block_chunk_size &&
+            (x_block_chunk_size < 4 ||
+             x_block_chunk_size > MAX_MIGRATE_BLOCK_CHUNK_SIZE ||
+             !is_power_of_2(x_block_chunk_size))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_block_chunk_size",
+                   "a power of two in the range of 4 to 1024");
+        return;
+    }
+    if (has_x_block_inflight &&
+            (x_block_inflight < 1 ||
+             x_block_inflight > MAX_MIGRATE_BLOCK_INFLIGHT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_block_inflight",
+                   "an integer in the range of 1 to 512");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -776,6 +1016,44 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] = compress_method;
+    }
+    if (has_x_postcopy_prefetch_pages) {
+        s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES] =
+                                                    x_postcopy_prefetch_pages;
+    }
+    if (has_x_rdma_chunk_size) {
+        s->parameters[MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE] =
+                                                    x_rdma_chunk_size;
+    }
+    if (has_x_rdma_reg_cache_size) {
+        s->parameters[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE] =
+                                                    x_rdma_reg_cache_size;
+    }
+    if (has_x_iov_batch) {
+        s->parameters[MIGRATION_PARAMETER_X_IOV_BATCH] = x_iov_batch;
+    }
+    if (has_x_block_chunk_size) {
+        s->parameters[MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE] =
+                                                    x_block_chunk_size;
+    }
+    if (has_x_block_inflight) {
+        s->parameters[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT] =
+                                                    x_block_inflight;
+    }
+    if (has_tls_creds) {
+        g_free(s->tls_creds);
+        s->tls_creds = g_strdup(tls_creds);
+    }
+    if (has_tls_hostname) {
+        g_free(s->tls_hostname);
+        s->tls_hostname = g_strdup(tls_hostname);
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -829,6 +1107,8 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_send_threads_join();
+        s->socket_write_time = qemu_file_get_write_time(s->to_dst_file);
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -881,6 +1161,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_send_shutdown();
     }
 }
 
@@ -944,6 +1225,10 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->dirty_bytes_rate = 0;
     s->setup_time = 0;
     s->dirty_sync_count = 0;
+    s->throttle_time = 0;
+    s->socket_write_time = 0;
+    qapi_free_MigrationSectionTimeList(s->stop_copy_times);
+    s->stop_copy_times = NULL;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
@@ -952,6 +1237,8 @@ MigrationState *migrate_init(const MigrationParams *params)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_prefetch_requests);
+    s->src_prefetch_count = 0;
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1023,7 +1310,29 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_tls() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "tls-creds is only supported by tcp: migration");
+        return;
+    }
+
+    if (migrate_background_snapshot()) {
+#ifdef _WIN32
+        error_setg(errp, "x-background-snapshot is not supported on this "
+                   "host");
+        return;
+#else
+        if (params.blk || params.shared || migrate_use_tls() ||
+            strstart(uri, "rdma:", NULL)) {
+            error_setg(errp, "x-background-snapshot is not compatible with "
+                       "block migration, TLS or RDMA");
+            return;
+        }
+#endif
+    }
+
     s = migrate_init(&params);
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = NULL;
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -1164,6 +1473,15 @@ int migrate_compress_level(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1182,6 +1500,107 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_zerocopy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZEROCOPY_SEND];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_use_tls(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->tls_creds && *s->tls_creds;
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES];
+}
+
+/* In bytes */
+int migrate_block_chunk_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_BLOCK_CHUNK_SIZE] * 1024;
+}
+
+int migrate_block_inflight(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_BLOCK_INFLIGHT];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1228,6 +1647,8 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_PONG]           = { .len =  4, .name = "PONG" },
     [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_REQ_PAGES_PREFETCH] = { .len = 12,
+                                        .name = "REQ_PAGES_PREFETCH" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -1237,7 +1658,8 @@ static struct rp_cmd_args {
  * and we don't need to send pages that have already been sent.
  */
 static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
-                                       ram_addr_t start, size_t len)
+                                       ram_addr_t start, size_t len,
+                                       bool prefetch)
 {
     long our_host_ps = getpagesize();
 
@@ -1255,7 +1677,7 @@ static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
         return;
     }
 
-    if (ram_save_queue_pages(ms, rbname, start, len)) {
+    if (ram_save_queue_pages(ms, rbname, start, len, prefetch)) {
         mark_source_rp_bad(ms);
     }
 }
@@ -1335,7 +1757,13 @@ static void *source_return_path_thread(void *opaque)
         case MIG_RP_MSG_REQ_PAGES:
             start = be64_to_cpup((uint64_t *)buf);
             len = be32_to_cpup((uint32_t *)(buf + 8));
-            migrate_handle_rp_req_pages(ms, NULL, start, len);
+            migrate_handle_rp_req_pages(ms, NULL, start, len, false);
+            break;
+
+        case MIG_RP_MSG_REQ_PAGES_PREFETCH:
+            start = be64_to_cpup((uint64_t *)buf);
+            len = be32_to_cpup((uint32_t *)(buf + 8));
+            migrate_handle_rp_req_pages(ms, NULL, start, len, true);
             break;
 
         case MIG_RP_MSG_REQ_PAGES_ID:
@@ -1355,7 +1783,8 @@ static void *source_return_path_thread(void *opaque)
                 mark_source_rp_bad(ms);
                 goto out;
             }
-            migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
+            migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len,
+                                        false);
             break;
 
         default:
@@ -1615,6 +2044,142 @@ fail:
                       MIGRATION_STATUS_FAILED);
 }
 
+#ifndef _WIN32
+/*
+ * Writes the rest of a background snapshot from a child process, whose
+ * copy of guest RAM is the one of the instant it was forked: all of RAM,
+ * once, then the device state that was saved before forking.
+ */
+static void QEMU_NORETURN background_snapshot_child(MigrationState *s,
+                                                   QEMUFile *fb)
+{
+    const QEMUSizedBuffer *qsb = qemu_buf_get(fb);
+    QEMUFile *f = s->to_dst_file;
+    int64_t window_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t pend_nonpost, pend_post;
+    size_t len;
+    uint8_t *buf;
+
+    ram_save_freeze_bitmap();
+
+    while (!qemu_file_get_error(f)) {
+        int64_t now;
+
+        /* with max_size 0 nothing is synchronized */
+        qemu_savevm_state_pending(f, 0, &pend_nonpost, &pend_post);
+        if (!pend_nonpost && !pend_post) {
+            break;
+        }
+        if (!qemu_file_rate_limit(f)) {
+            qemu_savevm_state_iterate(f, false);
+            continue;
+        }
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (now < window_start + BUFFER_DELAY) {
+            g_usleep((window_start + BUFFER_DELAY - now) * 1000);
+        }
+        qemu_file_reset_rate_limit(f);
+        window_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
+    qemu_savevm_state_complete_precopy(f, true);
+
+    len = qsb_get_length(qsb);
+    buf = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, buf);
+    qemu_put_buffer(f, buf, len);
+    qemu_fflush(f);
+
+    _exit(qemu_file_get_error(f) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Background snapshot: stop the guest just long enough to save its device
+ * state and to fork a child with a copy-on-write view of guest RAM, which
+ * writes the stream while the guest runs again.
+ */
+static void background_snapshot(MigrationState *s, bool *old_vm_running,
+                                int64_t *start_time)
+{
+    Error *local_err = NULL;
+    QEMUFile *fb;
+    pid_t pid = -1;
+    int ret, status;
+
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+        goto fail;
+    }
+
+    qemu_mutex_lock_iothread();
+    *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    *old_vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret && *old_vm_running) {
+        /* a stopped guest keeps its run state */
+        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    if (!ret) {
+        qemu_savevm_state_complete_devices(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret) {
+        ret = ram_snapshot_fork_prepare(&local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+        }
+    }
+    if (!ret) {
+        /* the child must not write what is still buffered a second time */
+        qemu_fflush(s->to_dst_file);
+        pid = fork();
+        if (pid == 0) {
+            background_snapshot_child(s, fb);
+        } else if (pid < 0) {
+            error_report("Cannot fork the snapshot process: %s",
+                         strerror(errno));
+            ret = -1;
+        }
+        ram_snapshot_fork_cleanup();
+    }
+
+    if (*old_vm_running) {
+        vm_start();
+        *old_vm_running = false;
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - *start_time;
+    qemu_mutex_unlock_iothread();
+    qemu_fclose(fb);
+
+    if (ret) {
+        goto fail;
+    }
+
+    trace_migration_background_snapshot(pid, s->downtime);
+    do {
+        if (atomic_read(&s->state) == MIGRATION_STATUS_CANCELLING) {
+            kill(pid, SIGKILL);
+        }
+        g_usleep(BUFFER_DELAY * 1000);
+        ret = waitpid(pid, &status, WNOHANG);
+    } while (ret == 0 || (ret < 0 && errno == EINTR));
+
+    if (ret == pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == EXIT_SUCCESS) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_COMPLETED);
+        return;
+    }
+    if (atomic_read(&s->state) != MIGRATION_STATUS_CANCELLING) {
+        error_report("Background snapshot process failed");
+    }
+
+fail:
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_FAILED);
+}
+#endif
+
 /*
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
@@ -1662,6 +2227,12 @@ static void *migration_thread(void *opaque)
 
     trace_migration_thread_setup_complete();
 
+#ifndef _WIN32
+    if (migrate_background_snapshot()) {
+        background_snapshot(s, &old_vm_running, &start_time);
+    }
+#endif
+
     while (s->state == MIGRATION_STATUS_ACTIVE ||
            s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
@@ -1722,7 +2293,9 @@ static void *migration_thread(void *opaque)
             /* if we haven't sent anything, we don't want to recalculate
                10000 is a small enough number for our purposes */
             if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                s->expected_downtime = (s->dirty_bytes_rate +
+                                        qemu_savevm_device_state_size()) /
+                                       bandwidth;
             }
 
             qemu_file_reset_rate_limit(s->to_dst_file);
@@ -1730,12 +2303,23 @@ static void *migration_thread(void *opaque)
             initial_bytes = qemu_ftell(s->to_dst_file);
         }
         if (qemu_file_rate_limit(s->to_dst_file)) {
+            int64_t sleep_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             /* usleep expects microseconds */
             g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            s->throttle_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                sleep_start;
         }
     }
 
     trace_migration_thread_after_loop();
+    trace_migration_thread_timings(ram_bitmap_sync_time() / 1000,
+                                   ram_page_scan_time() / 1000,
+                                   ram_compress_time() / 1000,
+                                   ram_xbzrle_time() / 1000,
+                                   qemu_file_get_write_time(s->to_dst_file) /
+                                   1000,
+                                   s->throttle_time / 1000);
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -1745,14 +2329,16 @@ static void *migration_thread(void *opaque)
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
         s->total_time = end_time - s->total_time;
-        if (!entered_postcopy) {
+        if (!entered_postcopy && !migrate_background_snapshot()) {
             s->downtime = end_time - start_time;
         }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (!migrate_background_snapshot()) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
         if (old_vm_running && !entered_postcopy) {
             vm_start();
@@ -1773,6 +2359,9 @@ void migrate_fd_connect(MigrationState *s)
 
     qemu_file_set_rate_limit(s->to_dst_file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
+    qemu_file_set_iov_batch(s->to_dst_file,
+                            s->parameters[MIGRATION_PARAMETER_X_IOV_BATCH]);
+    qemu_file_set_zerocopy(s->to_dst_file, migrate_zerocopy_send());
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
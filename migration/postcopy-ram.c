@@ -25,6 +25,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -183,20 +185,17 @@ out:
  * We can assume that if we've been called postcopy_ram_hosttest returned true.
  *
  * @mis: Current incoming migration state.
- * @start, @length: range of memory to discard.
+ * @rb: RAMBlock holding the range.
+ * @start, @length: range of memory to discard, as offsets in @rb.
  *
  * returns: 0 on success.
  */
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length)
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length)
 {
-    trace_postcopy_ram_discard_range(start, length);
-    if (madvise(start, length, MADV_DONTNEED)) {
-        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
-        return -1;
-    }
+    trace_postcopy_ram_discard_range(qemu_ram_get_idstr(rb), start, length);
 
-    return 0;
+    return ram_block_discard_range(rb, start, length);
 }
 
 /*
@@ -208,6 +207,7 @@ static int init_range(const char *block_name, void *host_addr,
                       ram_addr_t offset, ram_addr_t length, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    RAMBlock *rb = qemu_ram_block_by_name(block_name);
 
     trace_postcopy_init_range(block_name, host_addr, offset, length);
 
@@ -217,7 +217,7 @@ static int init_range(const char *block_name, void *host_addr,
      * - we're going to get the copy from the source anyway.
      * (Precopy will just overwrite this data, so doesn't need the discard)
      */
-    if (postcopy_ram_discard_range(mis, host_addr, length)) {
+    if (postcopy_ram_discard_range(mis, rb, 0, length)) {
         return -1;
     }
 
@@ -320,9 +320,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     migrate_send_rp_shut(mis, qemu_file_get_error(mis->from_src_file) != 0);
 
     if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, getpagesize());
+        munmap(mis->postcopy_tmp_page, mis->postcopy_tmp_page_size);
         mis->postcopy_tmp_page = NULL;
     }
+    if (mis->postcopy_tmp_zero_page) {
+        munmap(mis->postcopy_tmp_zero_page, mis->postcopy_tmp_page_size);
+        mis->postcopy_tmp_zero_page = NULL;
+    }
     trace_postcopy_ram_incoming_cleanup_exit();
     return 0;
 }
@@ -361,6 +365,35 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
     return 0;
 }
 
+/* Register the area with the userfault fd @ufd; returns 0 on success */
+static int ufd_register_range(int ufd, const char *block_name,
+                              void *host_addr, ram_addr_t length)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    /*
+     * Now tell our userfault_fd that it's responsible for this area;
+     * hugetlbfs backed blocks fail here on kernels that can only do
+     * userfaults on anonymous memory.
+     */
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register on '%s': %s", __func__,
+                     block_name, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+        error_report("%s: userfault on '%s' can't place pages", __func__,
+                     block_name);
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Mark the given area of RAM as requiring notification to unwritten areas
  * Used as a  callback on qemu_ram_foreach_block.
@@ -375,40 +408,40 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
                                    void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    struct uffdio_register reg_struct;
 
-    reg_struct.range.start = (uintptr_t)host_addr;
-    reg_struct.range.len = length;
-    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
-
-    /* Now tell our userfault_fd that it's responsible for this area */
-    if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
-        error_report("%s userfault register: %s", __func__, strerror(errno));
-        return -1;
-    }
-
-    return 0;
+    return ufd_register_range(mis->userfault_fd, block_name, host_addr,
+                              length);
 }
 
 /*
  * Handle faults detected by the USERFAULT markings
  */
+/* Number of userfault messages read at once */
+#define POSTCOPY_FAULT_BATCH 16
+
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    struct uffd_msg msg;
-    int ret;
-    size_t hostpagesize = getpagesize();
+    struct uffd_msg msgs[POSTCOPY_FAULT_BATCH];
+    ram_addr_t offsets[POSTCOPY_FAULT_BATCH];
+    RAMBlock *blocks[POSTCOPY_FAULT_BATCH];
+    int ret, i, j, nr;
+    size_t hostpagesize;
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    /* End of the last prefetch window, to avoid asking twice for it */
+    RAMBlock *prefetch_rb = NULL;
+    ram_addr_t prefetch_start = 0, prefetch_end = 0;
+    bool error = false;
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
 
-    while (true) {
+    while (!error) {
         ram_addr_t rb_offset;
         ram_addr_t in_raspace;
         struct pollfd pfd[2];
+        size_t prefetch_len;
 
         /*
          * We're mainly waiting for the kernel to give us a faulting HVA,
@@ -432,9 +465,13 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        ret = read(mis->userfault_fd, &msg, sizeof(msg));
-        if (ret != sizeof(msg)) {
-            if (errno == EAGAIN) {
+        /*
+         * Several vcpus can fault at once; take all the pending faults so
+         * that their pages are requested before any prefetching.
+         */
+        ret = read(mis->userfault_fd, msgs, sizeof(msgs));
+        if (ret < 0 || ret % sizeof(msgs[0])) {
+            if (ret < 0 && errno == EAGAIN) {
                 /*
                  * if a wake up happens on the other thread just after
                  * the poll, there is nothing to read.
@@ -446,43 +483,98 @@ static void *postcopy_ram_fault_thread(void *opaque)
                              __func__, strerror(errno));
                 break;
             } else {
-                error_report("%s: Read %d bytes from userfaultfd expected %zd",
-                             __func__, ret, sizeof(msg));
+                error_report("%s: Read %d bytes from userfaultfd expected "
+                             "a multiple of %zd",
+                             __func__, ret, sizeof(msgs[0]));
                 break; /* Lost alignment, don't know what we'd read next */
             }
         }
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
-            error_report("%s: Read unexpected event %ud from userfaultfd",
-                         __func__, msg.event);
-            continue; /* It's not a page fault, shouldn't happen */
-        }
 
-        rb = qemu_ram_block_from_host(
-                 (void *)(uintptr_t)msg.arg.pagefault.address,
-                 true, &in_raspace, &rb_offset);
-        if (!rb) {
-            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                         PRIx64, (uint64_t)msg.arg.pagefault.address);
-            break;
-        }
+        nr = 0;
+        for (i = 0; i < ret / sizeof(msgs[0]); i++) {
+            struct uffd_msg *msg = &msgs[i];
 
-        rb_offset &= ~(hostpagesize - 1);
-        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset);
+            if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                error_report("%s: Read unexpected event %ud from userfaultfd",
+                             __func__, msg->event);
+                continue; /* It's not a page fault, shouldn't happen */
+            }
+
+            rb = qemu_ram_block_from_host(
+                     (void *)(uintptr_t)msg->arg.pagefault.address,
+                     true, &in_raspace, &rb_offset);
+            if (!rb) {
+                error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                             PRIx64, (uint64_t)msg->arg.pagefault.address);
+                error = true;
+                break;
+            }
+
+            /* Hugepages have to be asked for, and placed, as a whole */
+            hostpagesize = qemu_ram_pagesize(rb);
+            rb_offset &= ~(hostpagesize - 1);
+            trace_postcopy_ram_fault_thread_request(msg->arg.pagefault.address,
+                                                    qemu_ram_get_idstr(rb),
+                                                    rb_offset);
+
+            /* vcpus touching the same page only need one request */
+            for (j = 0; j < nr; j++) {
+                if (blocks[j] == rb && offsets[j] == rb_offset) {
+                    break;
+                }
+            }
+            if (j < nr) {
+                continue;
+            }
+            blocks[nr] = rb;
+            offsets[nr++] = rb_offset;
+
+            /*
+             * Send the request to the source - we want to request one
+             * of our host page sizes (which is >= TPS)
+             */
+            if (rb != last_rb) {
+                last_rb = rb;
+                migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
+                                         rb_offset, hostpagesize);
+            } else {
+                /* Save some space */
+                migrate_send_rp_req_pages(mis, NULL,
+                                         rb_offset, hostpagesize);
+            }
+        }
 
         /*
-         * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
+         * Guest accesses are mostly sequential, so ask for the pages after
+         * each fault too.  The source sends them when it has no fault to
+         * serve and skips those it has already sent; a fault inside the
+         * window we asked for last only extends it.
          */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
+        for (i = 0; migrate_postcopy_prefetch_pages() && i < nr; i++) {
+            ram_addr_t start, end;
+
+            hostpagesize = qemu_ram_pagesize(blocks[i]);
+            prefetch_len = migrate_postcopy_prefetch_pages() * hostpagesize;
+            start = offsets[i] + hostpagesize;
+            end = start + prefetch_len;
+
+            if (blocks[i] == prefetch_rb && offsets[i] >= prefetch_start &&
+                offsets[i] < prefetch_end) {
+                start = MAX(start, prefetch_end);
+            }
+            if (start >= end) {
+                continue;
+            }
+            /* Prefetch requests are relative to the last requested block */
+            if (blocks[i] != last_rb) {
+                last_rb = blocks[i];
+                migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(last_rb),
+                                         offsets[i], hostpagesize);
+            }
+            migrate_send_rp_prefetch_pages(mis, start, end - start);
+            prefetch_rb = blocks[i];
+            prefetch_start = offsets[i];
+            prefetch_end = end;
         }
     }
     trace_postcopy_ram_fault_thread_exit();
@@ -543,13 +635,14 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
  * Place a host page (from) at (host) atomically
  * returns 0 on success
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t pagesize)
 {
     struct uffdio_copy copy_struct;
 
     copy_struct.dst = (uint64_t)(uintptr_t)host;
     copy_struct.src = (uint64_t)(uintptr_t)from;
-    copy_struct.len = getpagesize();
+    copy_struct.len = pagesize;
     copy_struct.mode = 0;
 
     /* copy also acks to the kernel waking the stalled thread up
@@ -573,10 +666,29 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
  * Place a zero page at (host) atomically
  * returns 0 on success
  */
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t pagesize)
 {
     struct uffdio_zeropage zero_struct;
 
+    if (pagesize != getpagesize()) {
+        /* UFFDIO_ZEROPAGE doesn't work on hugetlbfs, copy zeroes instead */
+        if (!mis->postcopy_tmp_zero_page) {
+            void *zero_page = mmap(NULL, mis->postcopy_tmp_page_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (zero_page == MAP_FAILED) {
+                int e = errno;
+                error_report("%s: %s mapping zero page", __func__,
+                             strerror(e));
+                return -e;
+            }
+            mis->postcopy_tmp_zero_page = zero_page;
+        }
+        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
+                                   pagesize);
+    }
+
     zero_struct.range.start = (uint64_t)(uintptr_t)host;
     zero_struct.range.len = getpagesize();
     zero_struct.mode = 0;
@@ -604,18 +716,426 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
 void *postcopy_get_tmp_page(MigrationIncomingState *mis)
 {
     if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (!mis->postcopy_tmp_page) {
+        size_t size = qemu_ram_pagesize_largest();
+        void *tmp_page = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (tmp_page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_page = tmp_page;
+        mis->postcopy_tmp_page_size = size;
     }
 
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Lazy restore (x-lazy-restore) of the guest RAM saved in an x-mapped-ram
+ * file.  Rather than reading all of it before the guest starts, the blocks
+ * are registered with userfaultfd: a fault thread reads the pages that are
+ * touched from the file, while a prefetch thread fills in everything else,
+ * going on from the last fault.  When it is done, the blocks are
+ * unregistered and the file closed.
+ */
+
+/* Unit of the prefetch thread, rounded up to the page size of the block */
+#define LAZY_RESTORE_CHUNK (1024 * 1024)
+
+typedef struct LazyRestoreBlock {
+    RAMBlock *rb;
+    uint8_t *host;
+    size_t length;
+    size_t pagesize;
+    size_t chunk;
+    /* Target pages present in the file */
+    unsigned long *bitmap;
+    off_t pages_offset;
+    /* Chunks placed by the prefetch thread */
+    unsigned long *chunks_done;
+    unsigned long nr_chunks;
+} LazyRestoreBlock;
+
+static struct {
+    int fd;
+    int userfault_fd;
+    int quit_fd;
+    QemuThread fault_thread;
+    LazyRestoreBlock *blocks;
+    int nr_blocks;
+    QemuMutex hint_lock;
+    /* Block of the last fault, or -1, and its offset */
+    int hint_block;
+    size_t hint_offset;
+    int64_t start_time;
+} lazy_restore;
+
+void lazy_restore_add_block(RAMBlock *rb, void *host, size_t length,
+                            unsigned long *bitmap, off_t pages_offset)
+{
+    LazyRestoreBlock *lb;
+
+    lazy_restore.blocks = g_renew(LazyRestoreBlock, lazy_restore.blocks,
+                                  lazy_restore.nr_blocks + 1);
+    lb = &lazy_restore.blocks[lazy_restore.nr_blocks++];
+    lb->rb = rb;
+    lb->host = host;
+    lb->length = length;
+    lb->pagesize = qemu_ram_pagesize(rb);
+    lb->chunk = ROUND_UP(LAZY_RESTORE_CHUNK, lb->pagesize);
+    lb->bitmap = bitmap;
+    lb->pages_offset = pages_offset;
+    lb->nr_chunks = DIV_ROUND_UP(length, lb->chunk);
+    lb->chunks_done = bitmap_new(lb->nr_chunks);
+}
+
+/*
+ * Read [offset, offset + len) of @lb into @buf; pages that are not in the
+ * file are zero.
+ */
+static int lazy_restore_read(LazyRestoreBlock *lb, size_t offset, size_t len,
+                             uint8_t *buf)
+{
+    int bits = qemu_target_page_bits();
+    unsigned long page = offset >> bits;
+    unsigned long end = (offset + len) >> bits;
+
+    while (page < end) {
+        unsigned long first = find_next_bit(lb->bitmap, end, page);
+        unsigned long last = find_next_zero_bit(lb->bitmap, end, first);
+        size_t done = 0, size = (last - first) << bits;
+
+        memset(buf + ((page << bits) - offset), 0, (first - page) << bits);
+        while (done < size) {
+            ssize_t ret = pread(lazy_restore.fd,
+                                buf + ((first << bits) - offset) + done,
+                                size - done,
+                                lb->pages_offset + (first << bits) + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                error_report("%s: reading %s: %s", __func__,
+                             qemu_ram_get_idstr(lb->rb),
+                             ret ? strerror(errno) : "unexpected end of file");
+                return -1;
+            }
+            done += ret;
+        }
+        page = last;
+    }
+    return 0;
+}
+
+/*
+ * Place [offset, offset + len) of @lb from the file, skipping the pages that
+ * are already there; @buf must hold @len bytes.
+ */
+static int lazy_restore_place(LazyRestoreBlock *lb, size_t offset, size_t len,
+                              uint8_t *buf)
+{
+    int bits = qemu_target_page_bits();
+    unsigned long end = (offset + len) >> bits;
+    bool zero = find_next_bit(lb->bitmap, end, offset >> bits) >= end;
+    size_t done = 0;
+
+    if (zero && lb->pagesize != getpagesize()) {
+        /* UFFDIO_ZEROPAGE doesn't work on hugetlbfs */
+        memset(buf, 0, len);
+        zero = false;
+    } else if (!zero && lazy_restore_read(lb, offset, len, buf)) {
+        return -1;
+    }
+
+    while (done < len) {
+        int64_t placed;
+        int ret, e;
+
+        if (zero) {
+            struct uffdio_zeropage zero_struct;
+
+            zero_struct.range.start = (uintptr_t)lb->host + offset + done;
+            zero_struct.range.len = len - done;
+            zero_struct.mode = 0;
+            ret = ioctl(lazy_restore.userfault_fd, UFFDIO_ZEROPAGE,
+                        &zero_struct);
+            placed = zero_struct.zeropage;
+        } else {
+            struct uffdio_copy copy_struct;
+
+            copy_struct.dst = (uintptr_t)lb->host + offset + done;
+            copy_struct.src = (uintptr_t)buf + done;
+            copy_struct.len = len - done;
+            copy_struct.mode = 0;
+            ret = ioctl(lazy_restore.userfault_fd, UFFDIO_COPY, &copy_struct);
+            placed = copy_struct.copy;
+        }
+        if (!ret) {
+            break;
+        }
+        e = errno;
+        if (placed > 0) {
+            done += placed;
+        }
+        if (e == EEXIST) {
+            /* Placed by the other thread, or already in place */
+            done += lb->pagesize;
+        } else if (e != EAGAIN) {
+            error_report("%s: placing %s at %zx: %s", __func__,
+                         qemu_ram_get_idstr(lb->rb), offset + done,
+                         strerror(e));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static LazyRestoreBlock *lazy_restore_find_block(RAMBlock *rb)
+{
+    int i;
+
+    for (i = 0; i < lazy_restore.nr_blocks; i++) {
+        if (lazy_restore.blocks[i].rb == rb) {
+            return &lazy_restore.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static void *lazy_restore_fault_thread(void *opaque)
+{
+    struct uffd_msg msgs[POSTCOPY_FAULT_BATCH];
+    uint8_t *buf = g_malloc(qemu_ram_pagesize_largest());
+
+    for (;;) {
+        struct pollfd pfd[2];
+        int ret, i;
+
+        pfd[0].fd = lazy_restore.userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = lazy_restore.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(lazy_restore.userfault_fd, msgs, sizeof(msgs));
+        if (ret < 0 && errno == EAGAIN) {
+            continue;
+        }
+        if (ret < 0 || ret % sizeof(msgs[0])) {
+            error_report("%s: reading userfault messages: %s", __func__,
+                         ret < 0 ? strerror(errno) : "short read");
+            break;
+        }
+
+        for (i = 0; i < ret / sizeof(msgs[0]); i++) {
+            void *addr = (void *)(uintptr_t)msgs[i].arg.pagefault.address;
+            LazyRestoreBlock *lb;
+            ram_addr_t in_raspace, offset;
+            RAMBlock *rb;
+
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            rb = qemu_ram_block_from_host(addr, true, &in_raspace, &offset);
+            lb = rb ? lazy_restore_find_block(rb) : NULL;
+            if (!lb) {
+                error_report("%s: fault outside guest RAM: %p", __func__,
+                             addr);
+                continue;
+            }
+            offset &= ~(lb->pagesize - 1);
+            trace_lazy_restore_fault(addr, qemu_ram_get_idstr(rb), offset);
+
+            /*
+             * A failure leaves the vcpu stuck, but there is nothing
+             * better to do with a guest whose memory is gone.
+             */
+            lazy_restore_place(lb, offset, lb->pagesize, buf);
+
+            qemu_mutex_lock(&lazy_restore.hint_lock);
+            lazy_restore.hint_block = lb - lazy_restore.blocks;
+            lazy_restore.hint_offset = offset;
+            qemu_mutex_unlock(&lazy_restore.hint_lock);
+        }
+    }
+
+    g_free(buf);
+    return NULL;
+}
+
+static void lazy_restore_finish(void)
+{
+    uint64_t tmp64 = 1;
+    int i;
+
+    /* The fault thread uses the per-block state, stop it first */
+    if (write(lazy_restore.quit_fd, &tmp64, 8) == 8) {
+        qemu_thread_join(&lazy_restore.fault_thread);
+    } else {
+        error_report("%s: incrementing quit_fd: %s", __func__,
+                     strerror(errno));
+    }
+
+    for (i = 0; i < lazy_restore.nr_blocks; i++) {
+        LazyRestoreBlock *lb = &lazy_restore.blocks[i];
+        struct uffdio_range range_struct;
+
+        range_struct.start = (uintptr_t)lb->host;
+        range_struct.len = lb->length;
+        if (ioctl(lazy_restore.userfault_fd, UFFDIO_UNREGISTER,
+                  &range_struct)) {
+            error_report("%s: userfault unregister %s: %s", __func__,
+                         qemu_ram_get_idstr(lb->rb), strerror(errno));
+        }
+        g_free(lb->bitmap);
+        g_free(lb->chunks_done);
+    }
+
+    close(lazy_restore.userfault_fd);
+    close(lazy_restore.quit_fd);
+    close(lazy_restore.fd);
+    qemu_mutex_destroy(&lazy_restore.hint_lock);
+    g_free(lazy_restore.blocks);
+    lazy_restore.blocks = NULL;
+    lazy_restore.nr_blocks = 0;
+    qemu_balloon_inhibit(false);
+}
+
+static void *lazy_restore_prefetch_thread(void *opaque)
+{
+    uint8_t *buf;
+    size_t bufsize = 0;
+    int i, cur = 0;
+    unsigned long chunk = 0;
+    uint64_t done = 0, total = 0;
+
+    for (i = 0; i < lazy_restore.nr_blocks; i++) {
+        bufsize = MAX(bufsize, lazy_restore.blocks[i].chunk);
+        total += lazy_restore.blocks[i].nr_chunks;
+    }
+    buf = g_malloc(bufsize);
+
+    while (done < total) {
+        LazyRestoreBlock *lb;
+        size_t offset;
+
+        /* Guest accesses are mostly local, so follow the faults */
+        qemu_mutex_lock(&lazy_restore.hint_lock);
+        if (lazy_restore.hint_block >= 0) {
+            cur = lazy_restore.hint_block;
+            lb = &lazy_restore.blocks[cur];
+            chunk = lazy_restore.hint_offset / lb->chunk;
+            lazy_restore.hint_block = -1;
+        }
+        qemu_mutex_unlock(&lazy_restore.hint_lock);
+
+        /* Next chunk that isn't there yet, wrapping around */
+        lb = &lazy_restore.blocks[cur];
+        chunk = find_next_zero_bit(lb->chunks_done, lb->nr_chunks, chunk);
+        if (chunk >= lb->nr_chunks) {
+            cur = (cur + 1) % lazy_restore.nr_blocks;
+            chunk = 0;
+            continue;
+        }
+
+        offset = chunk * lb->chunk;
+        if (lazy_restore_place(lb, offset,
+                               MIN(lb->chunk, lb->length - offset), buf)) {
+            break;
+        }
+        set_bit(chunk, lb->chunks_done);
+        done++;
+    }
+
+    g_free(buf);
+    trace_lazy_restore_done(done, total,
+                            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                            lazy_restore.start_time);
+    if (done == total) {
+        lazy_restore_finish();
+    }
+    return NULL;
+}
+
+int lazy_restore_start(int fd)
+{
+    QemuThread thread;
+    int i;
+
+    if (!lazy_restore.nr_blocks) {
+        return 0;
+    }
+    lazy_restore.fd = -1;
+    lazy_restore.quit_fd = -1;
+
+    lazy_restore.userfault_fd = syscall(__NR_userfaultfd,
+                                        O_CLOEXEC | O_NONBLOCK);
+    if (lazy_restore.userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    if (!ufd_version_check(lazy_restore.userfault_fd)) {
+        close(lazy_restore.userfault_fd);
+        return -1;
+    }
+
+    /* The file is closed with the migration stream */
+    lazy_restore.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    lazy_restore.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (lazy_restore.fd == -1 || lazy_restore.quit_fd == -1) {
+        error_report("%s: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    for (i = 0; i < lazy_restore.nr_blocks; i++) {
+        LazyRestoreBlock *lb = &lazy_restore.blocks[i];
+        const char *name = qemu_ram_get_idstr(lb->rb);
+
+        /* Anything written into RAM so far (ROMs, ...) has to go */
+        if (ram_block_discard_range(lb->rb, 0, lb->length) ||
+            ufd_register_range(lazy_restore.userfault_fd, name, lb->host,
+                               lb->length)) {
+            goto fail;
+        }
+    }
+
+    qemu_mutex_init(&lazy_restore.hint_lock);
+    lazy_restore.hint_block = -1;
+    lazy_restore.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_balloon_inhibit(true);
+
+    qemu_thread_create(&lazy_restore.fault_thread, "lazyrestore/fault",
+                       lazy_restore_fault_thread, NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&thread, "lazyrestore", lazy_restore_prefetch_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    trace_lazy_restore_start(lazy_restore.nr_blocks);
+    return 0;
+
+fail:
+    close(lazy_restore.userfault_fd);
+    if (lazy_restore.quit_fd != -1) {
+        close(lazy_restore.quit_fd);
+    }
+    if (lazy_restore.fd != -1) {
+        close(lazy_restore.fd);
+    }
+    return -1;
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -636,8 +1156,8 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     return -1;
 }
 
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length)
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length)
 {
     assert(0);
     return -1;
@@ -655,13 +1175,15 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     return -1;
 }
 
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t pagesize)
 {
     assert(0);
     return -1;
 }
 
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t pagesize)
 {
     assert(0);
     return -1;
@@ -673,6 +1195,18 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+void lazy_restore_add_block(RAMBlock *rb, void *host, size_t length,
+                            unsigned long *bitmap, off_t pages_offset)
+{
+    assert(0);
+}
+
+int lazy_restore_start(int fd)
+{
+    assert(0);
+    return -1;
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -0,0 +1,172 @@
+/*
+ * QEMUFile backend for QIOChannel objects
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Used where the migration stream needs more than a raw fd, i.e. for
+ * TLS: each QEMUFile holds a reference on the channel, and all I/O goes
+ * through it.  A channel-backed file can be used both from a coroutine
+ * (the incoming side) and from a thread (the migration thread, x-multifd
+ * channels); it waits for the channel accordingly when it would block.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "qemu/coroutine.h"
+#include "io/channel-socket.h"
+#include "io/channel-tls.h"
+#include "migration/qemu-file.h"
+#include "migration/qemu-file-internal.h"
+
+typedef struct QEMUFileChannel {
+    QIOChannel *ioc;
+    QEMUFile *file;
+} QEMUFileChannel;
+
+static void channel_wait(QIOChannel *ioc, GIOCondition condition)
+{
+    if (qemu_in_coroutine()) {
+        qio_channel_yield(ioc, condition);
+    } else {
+        qio_channel_wait(ioc, condition);
+    }
+}
+
+static ssize_t channel_writev_buffer(void *opaque, struct iovec *iov,
+                                     int iovcnt, int64_t pos)
+{
+    QEMUFileChannel *s = opaque;
+    struct iovec *local_iov = g_new(struct iovec, iovcnt);
+    struct iovec *local_iov_head = local_iov;
+    unsigned int nlocal_iov = iovcnt;
+    ssize_t done = 0;
+
+    nlocal_iov = iov_copy(local_iov, nlocal_iov, iov, iovcnt,
+                          0, iov_size(iov, iovcnt));
+
+    while (nlocal_iov > 0) {
+        ssize_t len = qio_channel_writev(s->ioc, local_iov, nlocal_iov, NULL);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            channel_wait(s->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            done = -EIO;
+            break;
+        }
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        done += len;
+    }
+
+    g_free(local_iov_head);
+    return done;
+}
+
+static ssize_t channel_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                                  size_t size)
+{
+    QEMUFileChannel *s = opaque;
+    ssize_t len;
+
+    for (;;) {
+        len = qio_channel_read(s->ioc, (char *)buf, size, NULL);
+        if (len != QIO_CHANNEL_ERR_BLOCK) {
+            break;
+        }
+        channel_wait(s->ioc, G_IO_IN);
+    }
+
+    return len < 0 ? -EIO : len;
+}
+
+/* The fd is used to switch the socket between blocking and non-blocking */
+static int channel_get_fd(void *opaque)
+{
+    QEMUFileChannel *s = opaque;
+    QIOChannel *ioc = s->ioc;
+
+    if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS)) {
+        ioc = QIO_CHANNEL_TLS(ioc)->master;
+    }
+    if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET)) {
+        return QIO_CHANNEL_SOCKET(ioc)->fd;
+    }
+    return -1;
+}
+
+static int channel_close(void *opaque)
+{
+    QEMUFileChannel *s = opaque;
+
+    object_unref(OBJECT(s->ioc));
+    g_free(s);
+    return 0;
+}
+
+static int channel_shutdown(void *opaque, bool rd, bool wr)
+{
+    QEMUFileChannel *s = opaque;
+    QIOChannelShutdown mode;
+
+    if (rd && wr) {
+        mode = QIO_CHANNEL_SHUTDOWN_BOTH;
+    } else if (rd) {
+        mode = QIO_CHANNEL_SHUTDOWN_READ;
+    } else {
+        mode = QIO_CHANNEL_SHUTDOWN_WRITE;
+    }
+    if (qio_channel_shutdown(s->ioc, mode, NULL) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static QEMUFile *channel_get_return_path(void *opaque)
+{
+    QEMUFileChannel *s = opaque;
+
+    if (qemu_file_get_error(s->file)) {
+        return NULL;
+    }
+    return qemu_fopen_channel(s->ioc, s->file->ops->get_buffer ? "wb" : "rb");
+}
+
+static const QEMUFileOps channel_read_ops = {
+    .get_fd          = channel_get_fd,
+    .get_buffer      = channel_get_buffer,
+    .close           = channel_close,
+    .shut_down       = channel_shutdown,
+    .get_return_path = channel_get_return_path
+};
+
+static const QEMUFileOps channel_write_ops = {
+    .get_fd          = channel_get_fd,
+    .writev_buffer   = channel_writev_buffer,
+    .close           = channel_close,
+    .shut_down       = channel_shutdown,
+    .get_return_path = channel_get_return_path
+};
+
+QEMUFile *qemu_fopen_channel(QIOChannel *ioc, const char *mode)
+{
+    QEMUFileChannel *s;
+
+    if (qemu_file_mode_is_not_valid(mode)) {
+        return NULL;
+    }
+
+    s = g_new0(QEMUFileChannel, 1);
+    s->ioc = ioc;
+    object_ref(OBJECT(ioc));
+    if (mode[0] == 'w') {
+        s->file = qemu_fopen_ops(s, &channel_write_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &channel_read_ops);
+    }
+    return s->file;
+}
@@ -27,9 +27,12 @@
 
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 
 #define IO_BUF_SIZE 32768
+/* Default and largest number of iovecs gathered before writing them */
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define MAX_IOV_BATCH MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -37,6 +40,8 @@ struct QEMUFile {
 
     int64_t bytes_xfer;
     int64_t xfer_limit;
+    /* nanoseconds spent in the backend's write ops */
+    int64_t write_time;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
@@ -44,8 +49,12 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec iov[MAX_IOV_BATCH];
     unsigned int iovcnt;
+    unsigned int iov_batch;
+    /* iovecs pointing at memory queued by qemu_put_buffer_async */
+    DECLARE_BITMAP(iov_async, MAX_IOV_BATCH);
+    bool zerocopy;
 
     int last_error;
 };
@@ -29,10 +29,26 @@
 #include "qemu/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+
+typedef struct ZerocopyBounce ZerocopyBounce;
+#endif
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+#ifdef CONFIG_MSG_ZEROCOPY
+    /* SO_ZEROCOPY: 0 not tried yet, 1 enabled, -1 not supported */
+    int zc_enabled;
+    bool zc_copied;
+    /* Zero-copy sends made, and complete ones (all those below zc_done) */
+    uint32_t zc_sent;
+    uint32_t zc_done;
+    GSList *zc_ranges;
+    QSIMPLEQ_HEAD(, ZerocopyBounce) zc_bounces;
+#endif
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -79,6 +95,247 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     return offset;
 }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+/*
+ * MSG_ZEROCOPY: guest pages are sent straight from guest memory; the rest
+ * of each batch, which comes from the QEMUFile buffer and is reused right
+ * away, is first copied into a bounce buffer.  Every zero-copy sendmsg()
+ * gets an id, and the kernel reports ranges of ids whose memory it has
+ * released on the error queue of the socket; bounce buffers are freed once
+ * all the ids up to theirs have been reported.
+ */
+struct ZerocopyBounce {
+    uint32_t id;    /* complete once this many sends are */
+    uint8_t *buf;
+    QSIMPLEQ_ENTRY(ZerocopyBounce) next;
+};
+
+typedef struct ZerocopyRange {
+    uint32_t lo, hi;
+} ZerocopyRange;
+
+/* Record that sends lo..hi are complete */
+static void socket_zerocopy_complete(QEMUFileSocket *s, uint32_t lo,
+                                     uint32_t hi)
+{
+    GSList *l;
+    bool merged;
+
+    if (lo != s->zc_done) {
+        /* Out of order, keep it until the ones before it show up */
+        ZerocopyRange *r = g_new(ZerocopyRange, 1);
+
+        r->lo = lo;
+        r->hi = hi;
+        s->zc_ranges = g_slist_prepend(s->zc_ranges, r);
+        return;
+    }
+    s->zc_done = hi + 1;
+
+    do {
+        merged = false;
+        for (l = s->zc_ranges; l; l = l->next) {
+            ZerocopyRange *r = l->data;
+
+            if (r->lo == s->zc_done) {
+                s->zc_done = r->hi + 1;
+                s->zc_ranges = g_slist_delete_link(s->zc_ranges, l);
+                g_free(r);
+                merged = true;
+                break;
+            }
+        }
+    } while (merged);
+
+    while (!QSIMPLEQ_EMPTY(&s->zc_bounces)) {
+        ZerocopyBounce *b = QSIMPLEQ_FIRST(&s->zc_bounces);
+
+        if ((int32_t)(s->zc_done - b->id) < 0) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->zc_bounces, next);
+        g_free(b->buf);
+        g_free(b);
+    }
+}
+
+/*
+ * Read the completions the kernel has queued; with @wait, until all the
+ * zero-copy sends are complete.  Returns 0 or -errno.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    while (s->zc_done != s->zc_sent) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct sock_extended_err *serr;
+        struct cmsghdr *cm;
+
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            GPollFD pfd;
+
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            if (!wait) {
+                return 0;
+            }
+            /* The error queue being non-empty shows up as POLLERR */
+            pfd.fd = s->fd;
+            pfd.events = G_IO_ERR;
+            pfd.revents = 0;
+            g_poll(&pfd, 1, -1);
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) {
+            continue;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+        if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !s->zc_copied) {
+            /* e.g. loopback: the kernel had to copy after all */
+            s->zc_copied = true;
+            trace_qemu_file_zerocopy_copied(s->fd);
+        }
+        socket_zerocopy_complete(s, serr->ee_info, serr->ee_data);
+    }
+    return 0;
+}
+
+/* Send the whole of @iov, with @flags */
+static ssize_t socket_sendmsg_all(QEMUFileSocket *s, struct iovec *iov,
+                                  unsigned int iovcnt, int flags)
+{
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+
+    while (done < size) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovcnt,
+        };
+        ssize_t len = sendmsg(s->fd, &msg, flags);
+        GPollFD pfd;
+
+        if (len >= 0) {
+            if (flags & MSG_ZEROCOPY) {
+                s->zc_sent++;
+            }
+            done += len;
+            iov_discard_front(&iov, &iovcnt, len);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            /* Too much memory locked by sends in flight, wait for them */
+            int ret = socket_zerocopy_reap(s, true);
+
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_report("socket_writev_zerocopy: Got err=%d for (%zu/%zu)",
+                         errno, size - done, size);
+            return -errno;
+        }
+
+        /* Emulate blocking */
+        pfd.fd = s->fd;
+        pfd.events = G_IO_OUT | G_IO_ERR;
+        pfd.revents = 0;
+        g_poll(&pfd, 1, -1);
+    }
+    return done;
+}
+
+static ssize_t socket_writev_zerocopy(void *opaque, struct iovec *iov,
+                                      int iovcnt,
+                                      const unsigned long *zerocopy,
+                                      int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ZerocopyBounce *b;
+    size_t copied = 0;
+    ssize_t ret;
+    int i;
+
+    if (!s->zc_enabled) {
+        int one = 1;
+
+        QSIMPLEQ_INIT(&s->zc_bounces);
+        /* Only TCP (and UDP) sockets can do it */
+        s->zc_enabled = setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY,
+                                   &one, sizeof(one)) ? -1 : 1;
+        trace_qemu_file_zerocopy_enable(s->fd, s->zc_enabled > 0);
+    }
+    if (s->zc_enabled < 0) {
+        return socket_writev_buffer(opaque, iov, iovcnt, pos);
+    }
+
+    ret = socket_zerocopy_reap(s, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (!test_bit(i, zerocopy)) {
+            copied += iov[i].iov_len;
+        }
+    }
+    b = g_new(ZerocopyBounce, 1);
+    b->buf = g_malloc(copied);
+    copied = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (!test_bit(i, zerocopy)) {
+            memcpy(b->buf + copied, iov[i].iov_base, iov[i].iov_len);
+            iov[i].iov_base = b->buf + copied;
+            copied += iov[i].iov_len;
+        }
+    }
+
+    ret = socket_sendmsg_all(s, iov, iovcnt, MSG_ZEROCOPY);
+    b->id = s->zc_sent;
+    QSIMPLEQ_INSERT_TAIL(&s->zc_bounces, b, next);
+    return ret;
+}
+
+static int socket_zerocopy_flush(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+
+    return socket_zerocopy_reap(s, true);
+}
+
+/*
+ * Bounce buffers still in flight can't be freed, the kernel may be reading
+ * them; they are only leaked when the socket is closed under them.
+ */
+static void socket_zerocopy_cleanup(QEMUFileSocket *s)
+{
+    socket_zerocopy_reap(s, false);
+    g_slist_free_full(s->zc_ranges, g_free);
+}
+#else
+static void socket_zerocopy_cleanup(QEMUFileSocket *s)
+{
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -113,6 +370,8 @@ static ssize_t socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+    socket_zerocopy_cleanup(s);
     closesocket(s->fd);
     g_free(s);
     return 0;
@@ -300,7 +559,11 @@ static const QEMUFileOps socket_write_ops = {
     .writev_buffer   = socket_writev_buffer,
     .close           = socket_close,
     .shut_down       = socket_shutdown,
-    .get_return_path = socket_get_return_path
+    .get_return_path = socket_get_return_path,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .writev_zerocopy = socket_writev_zerocopy,
+    .zerocopy_flush  = socket_zerocopy_flush,
+#endif
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
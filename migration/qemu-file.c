@@ -28,6 +28,7 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
@@ -77,6 +78,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->iov_batch = MAX_IOV_SIZE;
     return f;
 }
 
@@ -113,20 +115,29 @@ bool qemu_file_is_writable(QEMUFile *f)
 void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
+    int64_t start;
 
     if (!qemu_file_is_writable(f)) {
         return;
     }
 
+    start = get_clock();
+
     if (f->ops->writev_buffer) {
-        if (f->iovcnt > 0) {
+        if (f->iovcnt > 0 && f->zerocopy) {
+            ret = f->ops->writev_zerocopy(f->opaque, f->iov, f->iovcnt,
+                                          f->iov_async, f->pos);
+            bitmap_zero(f->iov_async, f->iovcnt);
+        } else if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+            bitmap_zero(f->iov_async, f->iovcnt);
         }
     } else {
         if (f->buf_index > 0) {
             ret = f->ops->put_buffer(f->opaque, f->buf, f->pos, f->buf_index);
         }
     }
+    f->write_time += get_clock() - start;
     if (ret >= 0) {
         f->pos += ret;
     }
@@ -252,6 +263,169 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account @size bytes that were sent on behalf of @f through another
+ * channel, so that rate limiting covers them too.
+ */
+void qemu_file_update_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+}
+
+/*
+ * Gather up to @iovcnt buffers before writing them out; larger batches mean
+ * fewer system calls for the pages queued by qemu_put_buffer_async.
+ */
+void qemu_file_set_iov_batch(QEMUFile *f, unsigned int iovcnt)
+{
+    qemu_fflush(f);
+    f->iov_batch = MAX(1, MIN(iovcnt, MAX_IOV_BATCH));
+}
+
+/*
+ * Let the backend send the buffers queued by qemu_put_buffer_async without
+ * copying them, if it can.  The memory they point to must then stay mapped
+ * until qemu_file_zerocopy_flush; changes made to it in the meantime may
+ * or may not be sent.
+ */
+void qemu_file_set_zerocopy(QEMUFile *f, bool enable)
+{
+    qemu_fflush(f);
+    f->zerocopy = enable && f->ops->writev_zerocopy;
+}
+
+int qemu_file_zerocopy_flush(QEMUFile *f)
+{
+    int ret;
+
+    qemu_fflush(f);
+    if (!f->zerocopy || !f->ops->zerocopy_flush) {
+        return 0;
+    }
+    ret = f->ops->zerocopy_flush(f->opaque);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/*
+ * The following only work on a QEMUFile whose file descriptor is a regular
+ * file, and let the user lay out parts of the file by itself.
+ *
+ * qemu_get_offset: Returns the offset in the file of the current position
+ * of the stream, or a negative errno if it is not a seekable file.
+ */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    int fd = qemu_get_fd(f);
+    off_t offset;
+
+    if (fd < 0) {
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return -errno;
+    }
+    if (!qemu_file_is_writable(f)) {
+        /* What we have read ahead isn't consumed yet */
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+/*
+ * qemu_set_offset: Moves the stream to @offset of the file, dropping
+ * anything that was read ahead.
+ */
+int qemu_set_offset(QEMUFile *f, off_t offset)
+{
+    int fd = qemu_get_fd(f);
+
+    if (fd < 0) {
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        int ret = -errno;
+
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    return 0;
+}
+
+/*
+ * qemu_put_buffer_at: Writes @size bytes at @offset of the file, outside
+ * of the stream.  They are accounted as transferred all the same, both for
+ * rate limiting and for the bandwidth estimate.
+ */
+ssize_t qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                           off_t offset)
+{
+    int fd = qemu_get_fd(f);
+    size_t done = 0;
+
+    if (fd < 0) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+    while (done < size) {
+        ssize_t len = pwrite(fd, buf + done, size - done, offset + done);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_file_set_error(f, -errno);
+            return -errno;
+        }
+        done += len;
+    }
+    f->pos += size;
+    f->bytes_xfer += size;
+    return size;
+}
+
+/*
+ * qemu_get_buffer_at: Reads @size bytes at @offset of the file, outside
+ * of the stream.
+ */
+ssize_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                           off_t offset)
+{
+    int fd = qemu_get_fd(f);
+    size_t done = 0;
+
+    if (fd < 0) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+    while (done < size) {
+        ssize_t len = pread(fd, buf + done, size - done, offset + done);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_file_set_error(f, -errno);
+            return -errno;
+        }
+        if (len == 0) {
+            qemu_file_set_error(f, -EIO);
+            return -EIO;
+        }
+        done += len;
+    }
+    return size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -283,18 +457,23 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size)
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
+                         bool async)
 {
     /* check for adjacent buffer and coalesce them */
     if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
-        f->iov[f->iovcnt - 1].iov_len) {
+        f->iov[f->iovcnt - 1].iov_len &&
+        async == test_bit(f->iovcnt - 1, f->iov_async)) {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
+        if (async) {
+            set_bit(f->iovcnt, f->iov_async);
+        }
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_batch) {
         qemu_fflush(f);
     }
 }
@@ -311,7 +490,7 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size)
     }
 
     f->bytes_xfer += size;
-    add_to_iovec(f, buf, size);
+    add_to_iovec(f, buf, size, true);
 }
 
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
@@ -330,7 +509,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->bytes_xfer += l;
         if (f->ops->writev_buffer) {
-            add_to_iovec(f, f->buf + f->buf_index, l);
+            add_to_iovec(f, f->buf + f->buf_index, l, false);
         }
         f->buf_index += l;
         if (f->buf_index == IO_BUF_SIZE) {
@@ -353,7 +532,7 @@ void qemu_put_byte(QEMUFile *f, int v)
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
     if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, 1);
+        add_to_iovec(f, f->buf + f->buf_index, 1, false);
     }
     f->buf_index++;
     if (f->buf_index == IO_BUF_SIZE) {
@@ -535,6 +714,12 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/* Nanoseconds spent writing out the buffered data */
+int64_t qemu_file_get_write_time(QEMUFile *f)
+{
+    return f->write_time;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
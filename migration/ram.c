@@ -26,7 +26,14 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
+#include <math.h>
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
 #include "qapi-event.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -40,6 +47,7 @@
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -65,12 +73,13 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -149,8 +158,15 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    /* nanoseconds the migration thread spent in each phase */
+    int64_t bitmap_sync_time;
+    int64_t page_scan_time;
+    int64_t compress_time;
+    int64_t xbzrle_time;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -205,6 +221,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
@@ -215,6 +241,26 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+int64_t ram_bitmap_sync_time(void)
+{
+    return acct_info.bitmap_sync_time;
+}
+
+int64_t ram_page_scan_time(void)
+{
+    return acct_info.page_scan_time;
+}
+
+int64_t ram_compress_time(void)
+{
+    return acct_info.compress_time;
+}
+
+int64_t ram_xbzrle_time(void)
+{
+    return acct_info.xbzrle_time;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -249,14 +295,44 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
+/* Number of pages of the same block handed to a compression thread at once;
+ * batching amortizes the hand-off between the migration thread and the
+ * compression threads, which otherwise dominates with the faster codecs.
+ */
+#define COMPRESS_BATCH_PAGES 8
+
+/* The be32 length word of a RAM_SAVE_FLAG_COMPRESS_PAGE carries the
+ * compression method in its top byte.  zlib is method 0, so streams
+ * produced by older QEMUs are still understood.
+ */
+#define COMPRESS_METHOD_SHIFT     24
+#define COMPRESS_LEN_MASK         ((1U << COMPRESS_METHOD_SHIFT) - 1)
+
+struct CompressCodec {
+    MigrationCompressMethod method;
+    int level;
+    bool zstream_ready;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+typedef struct CompressCodec CompressCodec;
+
 struct CompressParam {
     bool start;
     bool done;
-    QEMUFile *file;
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
-    ram_addr_t offset;
+    /* Offsets inside @block, with RAM_SAVE_FLAG_CONTINUE in the low bits */
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    int nr_pages;
+    /* Compressed pages with their headers, ready to be put on the stream */
+    uint8_t *buf;
+    size_t buf_len;
+    CompressCodec codec;
 };
 typedef struct CompressParam CompressParam;
 
@@ -267,6 +343,8 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    MigrationCompressMethod method;
+    CompressCodec codec;
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -278,8 +356,12 @@ static QemuThread *compress_threads;
  */
 static QemuMutex *comp_done_lock;
 static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+/* Pages collected by the migration thread for the next batch */
+static struct {
+    RAMBlock *block;
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    int nr_pages;
+} comp_batch;
 
 static bool compression_switch;
 static bool quit_comp_thread;
@@ -289,6 +371,186 @@ static QemuThread *decompress_threads;
 
 static int do_compress_ram_page(CompressParam *param);
 
+bool migrate_compress_method_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* Largest compressed size of a page among the supported methods */
+static size_t compress_page_bound(void)
+{
+    size_t bound = compressBound(TARGET_PAGE_SIZE);
+
+#ifdef CONFIG_ZSTD
+    bound = MAX(bound, ZSTD_compressBound(TARGET_PAGE_SIZE));
+#endif
+#ifdef CONFIG_LZ4
+    bound = MAX(bound, LZ4_compressBound(TARGET_PAGE_SIZE));
+#endif
+    return bound;
+}
+
+/* Room needed in CompressParam.buf for one page: header with the longest
+ * block name, length word and compressed data.
+ */
+static size_t compress_page_buf_size(void)
+{
+    return 8 + 1 + 255 + 4 + compress_page_bound();
+}
+
+/* The codec state is kept for the whole migration, so that its allocation
+ * and initialization is not paid for each page.
+ */
+static void compress_codec_init(CompressCodec *codec,
+                                MigrationCompressMethod method,
+                                int level, bool decompress)
+{
+    int ret;
+
+    codec->method = method;
+    codec->level = level;
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        memset(&codec->zstream, 0, sizeof(codec->zstream));
+        ret = decompress ? inflateInit(&codec->zstream)
+                         : deflateInit(&codec->zstream, level);
+        codec->zstream_ready = (ret == Z_OK);
+        break;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        if (decompress) {
+            codec->zstd_dctx = ZSTD_createDCtx();
+        } else {
+            codec->zstd_cctx = ZSTD_createCCtx();
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+static void compress_codec_cleanup(CompressCodec *codec, bool decompress)
+{
+    if (codec->zstream_ready) {
+        if (decompress) {
+            inflateEnd(&codec->zstream);
+        } else {
+            deflateEnd(&codec->zstream);
+        }
+        codec->zstream_ready = false;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(codec->zstd_cctx);
+    ZSTD_freeDCtx(codec->zstd_dctx);
+    codec->zstd_cctx = NULL;
+    codec->zstd_dctx = NULL;
+#endif
+}
+
+/* Compress one page from @src into @dst.
+ * Returns the compressed size, or -1 on failure.
+ */
+static ssize_t compress_codec_page(CompressCodec *codec, uint8_t *dst,
+                                   size_t dst_len, const uint8_t *src)
+{
+    z_stream *zs = &codec->zstream;
+    int level = migrate_compress_level();
+
+    switch (codec->method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        if (!codec->zstream_ready || deflateReset(zs) != Z_OK) {
+            return -1;
+        }
+        if (level != codec->level) {
+            if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -1;
+            }
+            codec->level = level;
+        }
+        zs->next_in = (Bytef *)src;
+        zs->avail_in = TARGET_PAGE_SIZE;
+        zs->next_out = dst;
+        zs->avail_out = dst_len;
+        if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+            return -1;
+        }
+        return dst_len - zs->avail_out;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!codec->zstd_cctx) {
+            return -1;
+        }
+        ret = ZSTD_compressCCtx(codec->zstd_cctx, dst, dst_len,
+                                src, TARGET_PAGE_SIZE, level);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret = LZ4_compress_default((const char *)src, (char *)dst,
+                                       TARGET_PAGE_SIZE, dst_len);
+        return ret > 0 ? ret : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* Decompress @len bytes from @src into the page at @dst.
+ * Returns 0 on success, -1 on failure.
+ */
+static int decompress_codec_page(CompressCodec *codec,
+                                 MigrationCompressMethod method,
+                                 uint8_t *dst, const uint8_t *src, int len)
+{
+    z_stream *zs = &codec->zstream;
+
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        if (!codec->zstream_ready || inflateReset(zs) != Z_OK) {
+            return -1;
+        }
+        zs->next_in = (Bytef *)src;
+        zs->avail_in = len;
+        zs->next_out = dst;
+        zs->avail_out = TARGET_PAGE_SIZE;
+        return inflate(zs, Z_FINISH) == Z_STREAM_END ? 0 : -1;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        if (!codec->zstd_dctx) {
+            return -1;
+        }
+        return ZSTD_isError(ZSTD_decompressDCtx(codec->zstd_dctx, dst,
+                                                TARGET_PAGE_SIZE,
+                                                src, len)) ? -1 : 0;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_decompress_safe((const char *)src, (char *)dst, len,
+                                   TARGET_PAGE_SIZE) < 0 ? -1 : 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
@@ -343,7 +605,8 @@ void migrate_compress_threads_join(void)
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
+        compress_codec_cleanup(&comp_param[i].codec, false);
+        g_free(comp_param[i].buf);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -375,11 +638,12 @@ void migrate_compress_threads_create(void)
     comp_done_lock = g_new0(QemuMutex, 1);
     qemu_cond_init(comp_done_cond);
     qemu_mutex_init(comp_done_lock);
+    comp_batch.nr_pages = 0;
     for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].buf = g_malloc(COMPRESS_BATCH_PAGES *
+                                     compress_page_buf_size());
+        compress_codec_init(&comp_param[i].codec, migrate_compress_method(),
+                            migrate_compress_level(), false);
         comp_param[i].done = true;
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
@@ -389,6 +653,355 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple channel (x-multifd) RAM migration
+ *
+ * Each channel is a separate TCP connection served by its own thread.  The
+ * migration thread batches dirty pages and hands each batch to an idle
+ * channel, whose thread reads the guest memory and writes it out; zero
+ * pages and everything else still go through the main stream.
+ *
+ * A channel stream starts with MULTIFD_MAGIC, MULTIFD_VERSION and the
+ * channel id (all be32), followed by packets that begin with a be32 type:
+ *   MULTIFD_PACKET_PAGES: block id (length byte + string), be32 page count,
+ *                         be64 offset of each page, then the page data
+ *   MULTIFD_PACKET_SYNC:  barrier, matches RAM_SAVE_FLAG_MULTIFD_SYNC
+ *   MULTIFD_PACKET_END:   the source is done with the channel
+ *
+ * Pages of one dirty bitmap pass may be placed on the destination in any
+ * order, but a page sent again in a later pass must not be overtaken by its
+ * older copy.  So after each bitmap sync the source waits for all channels
+ * to drain, sends a SYNC packet on each of them and RAM_SAVE_FLAG_MULTIFD_SYNC
+ * on the main stream; the destination channels stop at the SYNC packet until
+ * the main stream reaches the flag.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+#define MULTIFD_PAGES_PER_PACKET 64
+
+#define MULTIFD_PACKET_PAGES 1
+#define MULTIFD_PACKET_SYNC  2
+#define MULTIFD_PACKET_END   3
+
+typedef struct {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* Kicks the thread when it has work or must quit */
+    QemuSemaphore sem;
+    /* Protects the fields below */
+    QemuMutex mutex;
+    bool quit;
+    bool sync;
+    /* The channel is busy while pages.num != 0 */
+    MultiFDPages pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* One token for each channel that can take a batch of pages */
+    QemuSemaphore channels_ready;
+    /* Posted by each channel once it has written its SYNC packet */
+    QemuSemaphore sem_sync;
+    int next_channel;
+    bool error;
+    /* The batch the migration thread is filling */
+    MultiFDPages pages;
+    /* bitmap_sync_count at the last SYNC */
+    uint64_t sync_count;
+} *multifd_send_state;
+
+static void multifd_send_set_error(void)
+{
+    atomic_set(&multifd_send_state->error, true);
+    /* Wake up the migration thread if it is waiting for us */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_sem_post(&multifd_send_state->sem_sync);
+}
+
+static void multifd_send_packet(QEMUFile *f, MultiFDPages *pages)
+{
+    size_t len = strlen(pages->block->idstr);
+    int i;
+
+    qemu_put_be32(f, MULTIFD_PACKET_PAGES);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+    qemu_put_be32(f, pages->num);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_buffer_async(f, pages->block->host + pages->offset[i],
+                              TARGET_PAGE_SIZE);
+    }
+    qemu_fflush(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_fflush(p->file);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (!qemu_file_get_error(p->file)) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            qemu_put_be32(p->file, MULTIFD_PACKET_END);
+            qemu_fflush(p->file);
+            break;
+        }
+        if (p->pages.num) {
+            qemu_mutex_unlock(&p->mutex);
+
+            rcu_read_lock();
+            multifd_send_packet(p->file, &p->pages);
+            rcu_read_unlock();
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages.num = 0;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->sync) {
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            qemu_put_be32(p->file, MULTIFD_PACKET_SYNC);
+            qemu_fflush(p->file);
+            qemu_sem_post(&multifd_send_state->sem_sync);
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+    if (qemu_file_get_error(p->file)) {
+        multifd_send_set_error();
+    }
+    return NULL;
+}
+
+/* Returns -1 if there was an error on any of the channels. */
+static int multifd_send_wait(QemuSemaphore *sem)
+{
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    qemu_sem_wait(sem);
+    return atomic_read(&multifd_send_state->error) ? -1 : 0;
+}
+
+/* Hand the pending batch of pages to the next idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    int i;
+
+    if (multifd_send_wait(&multifd_send_state->channels_ready) < 0) {
+        return -1;
+    }
+
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pages.num) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    p->pages = multifd_send_state->pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    multifd_send_state->pages.num = 0;
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = &multifd_send_state->pages;
+
+    if (pages->num && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+    }
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+static int multifd_flush_pages(void)
+{
+    if (!multifd_send_state || !multifd_send_state->pages.num) {
+        return 0;
+    }
+    return multifd_send_pages();
+}
+
+/* Put a barrier on all channels and the main stream @f, see above */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i, count;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+    if (multifd_flush_pages() < 0) {
+        return -1;
+    }
+
+    /* Take the tokens of all channels, once they are idle */
+    count = multifd_send_state->count;
+    for (i = 0; i < count; i++) {
+        if (multifd_send_wait(&multifd_send_state->channels_ready) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < count; i++) {
+        if (multifd_send_wait(&multifd_send_state->sem_sync) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+
+    multifd_send_state->sync_count = bitmap_sync_count;
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 0;
+}
+
+/* Sync the channels if the dirty bitmap was synced since the last time */
+static int multifd_send_sync_if_needed(QEMUFile *f)
+{
+    if (!multifd_send_state ||
+        multifd_send_state->sync_count == bitmap_sync_count) {
+        return 0;
+    }
+    return multifd_send_sync_main(f);
+}
+
+/* Called from the migration thread in ram_save_setup */
+static int multifd_send_threads_create(void)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    int i, count, fd;
+
+    if (!s->multifd_host_port) {
+        error_report("x-multifd is only supported by tcp: migration");
+        return -1;
+    }
+
+    count = migrate_multifd_channels();
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        fd = inet_connect(s->multifd_host_port, &local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+        p->id = i;
+        if (migrate_use_tls()) {
+            QIOChannelTLS *tioc = migration_tls_channel_new(fd, true,
+                                                            &local_err);
+
+            if (!tioc || migration_tls_handshake_sync(tioc, &local_err) < 0) {
+                error_report_err(local_err);
+                if (tioc) {
+                    object_unref(OBJECT(tioc));
+                }
+                return -1;
+            }
+            p->file = qemu_fopen_channel(QIO_CHANNEL(tioc), "wb");
+            object_unref(OBJECT(tioc));
+        } else {
+            p->file = qemu_fopen_socket(fd, "wb");
+        }
+        qemu_sem_init(&p->sem, 0);
+        qemu_mutex_init(&p->mutex);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        multifd_send_state->count++;
+    }
+    return 0;
+}
+
+/* Unblock channels that may be stuck sending to a dead destination */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_file_shutdown(multifd_send_state->params[i].file);
+    }
+}
+
+void multifd_send_threads_join(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    if (migration_has_failed(migrate_get_current())) {
+        multifd_send_shutdown();
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem);
+        qemu_mutex_destroy(&p->mutex);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -417,26 +1030,122 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
+static int mig_throttle_cmp(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+static bool mig_throttle_guest_down_per_cpu(double bytes_dirty, double budget)
+{
+    CPUState *cpu;
+    uint64_t attributed = 0;
+    double *rates, *sorted, cap = 0;
+    int i, n = 0;
+
+    CPU_FOREACH(cpu) {
+        attributed += atomic_read(&cpu->dirty_pages);
+        n++;
+    }
+    if (!attributed || n < 2) {
+        return false;
+    }
+
+    /* Unthrottled dirty rate of each vcpu */
+    rates = g_new(double, n);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        double pct = cpu_throttle_get_cpu_percentage(cpu) / 100.0;
+
+        rates[i++] = bytes_dirty * atomic_read(&cpu->dirty_pages) /
+                     attributed / (1 - pct);
+    }
+    sorted = g_memdup(rates, n * sizeof(*rates));
+    qsort(sorted, n, sizeof(*sorted), mig_throttle_cmp);
+    for (i = 0; i < n; i++) {
+        if (sorted[i] * (n - i) > budget) {
+            cap = budget / (n - i);
+            break;
+        }
+        budget -= sorted[i];
+    }
+    g_free(sorted);
+
+    /* Drop the uniform throttle, if any, in favour of per-vcpu ones.
+     * i == n means that nothing needs to be throttled, which only
+     * rounding can get us to.
+     */
+    cpu_throttle_stop();
+    if (i < n) {
+        i = 0;
+        CPU_FOREACH(cpu) {
+            double rate = rates[i++];
+
+            if (rate > cap) {
+                cpu_throttle_set_cpu(cpu, (int)ceil(100 * (1 - cap / rate)));
+            }
+        }
+    }
+    g_free(rates);
+    return true;
+}
+
 /* Reduce amount of guest cpu execution to hopefully slow down memory writes.
  * If guest dirty memory rate is reduced below the rate at which we can
  * transfer pages to the destination then we should be able to complete
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
+ *
+ * The throttle is computed so that the guest dirties at most half of what
+ * was transferred in the same period, which is the point below which
+ * auto-converge stops kicking in.  The rates measured are those of the
+ * throttled guest, so they are first scaled back to the unthrottled rate.
+ *
+ * When the vcpus account the pages they dirty (TCG), only the vcpus that
+ * dirty more than their fair share of the budget are throttled: the budget
+ * is water-filled over the vcpus, and those above the resulting cap are
+ * slowed down to it.  Otherwise all vcpus are throttled by the same amount.
+ *
+ * @bytes_dirty: bytes dirtied during the period
+ * @bytes_xfer: bytes transferred during the same period
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_down(uint64_t bytes_dirty, uint64_t bytes_xfer)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     uint64_t pct_icrement =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    double budget = bytes_xfer / 2.0;
+    double pct, target;
+
+    if (bytes_xfer && bytes_dirty &&
+        mig_throttle_guest_down_per_cpu(bytes_dirty, budget)) {
+        return;
+    }
+
+    pct = cpu_throttle_get_percentage() / 100.0;
+    target = bytes_dirty ? 100 * (1 - budget * (1 - pct) / bytes_dirty) : 0;
 
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
+        cpu_throttle_set(MAX(pct_initial, (int)ceil(target)));
     } else {
-        /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+        /* Throttling already on, increase the rate by at least the
+         * increment
+         */
+        cpu_throttle_set(MAX(cpu_throttle_get_percentage() + pct_icrement,
+                             (int)ceil(target)));
+    }
+}
+
+static void mig_throttle_reset_counts(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
     }
 }
 
@@ -454,8 +1163,10 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
+                     bitmap_sync_count) == 1) {
+        acct_info.xbzrle_cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -482,14 +1193,19 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    int ret;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               bitmap_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    acct_info.xbzrle_cache_evictions++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -497,46 +1213,145 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
+
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+
+    /* save current buffer into memory */
+    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+
+    /* XBZRLE encoding (if there is no overflow) */
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE);
+    if (encoded_len == 0) {
+        DPRINTF("Skipping unmodified page\n");
+        return 0;
+    } else if (encoded_len == -1) {
+        DPRINTF("Overflow\n");
+        acct_info.xbzrle_overflows++;
+        /* update data in the cache */
+        if (!last_stage) {
+            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
+            *current_data = prev_cached_page;
+        }
+        return -1;
+    }
+
+    /* we need to update the data in the cache, in order to get the same data */
+    if (!last_stage) {
+        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    }
+
+    /* Send XBZRLE based compressed page */
+    bytes_xbzrle = save_page_header(f, block, offset | RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    bytes_xbzrle += encoded_len + 1 + 2;
+    acct_info.xbzrle_pages++;
+    acct_info.xbzrle_bytes += bytes_xbzrle;
+    *bytes_transferred += bytes_xbzrle;
+
+    return 1;
+}
+
+/*
+ * With x-ignore-shared, RAM blocks mapped from a shared file are not sent:
+ * the destination maps the same file.
+ */
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block) &&
+           block->fd >= 0;
+}
+
+/* Set in the child process of a background snapshot, whose copy of guest
+ * RAM cannot change anymore: the pages left in the bitmap are all there is
+ * to send, and there is nothing to synchronize it with.
+ */
+static bool migration_bitmap_frozen;
+
+void ram_save_freeze_bitmap(void)
+{
+    migration_bitmap_frozen = true;
+}
+
+/*
+ * Guest RAM is normally left out of child processes (MADV_DONTFORK).  Let
+ * the child of a background snapshot inherit it; RAM shared with a file
+ * cannot be snapshotted that way, since the child would see the guest
+ * modify it.  Called with the iothread lock held.
+ */
+int ram_snapshot_fork_prepare(Error **errp)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->host || ramblock_is_ignored(block)) {
+            continue;
+        }
+        if (qemu_ram_is_shared(block)) {
+            error_setg(errp, "RAM block '%s' is shared, it cannot be part of "
+                       "a background snapshot", block->idstr);
+            ret = -EINVAL;
+            break;
+        }
+        if (qemu_madvise(block->host, block->max_length,
+                         QEMU_MADV_DOFORK) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Cannot let a child process "
+                             "inherit RAM block '%s'", block->idstr);
+            break;
+        }
+    }
+    rcu_read_unlock();
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (ret < 0) {
+        ram_snapshot_fork_cleanup();
+    }
+    return ret;
+}
 
-    /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+void ram_snapshot_fork_cleanup(void)
+{
+    RAMBlock *block;
 
-    /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
-                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
-                                       TARGET_PAGE_SIZE);
-    if (encoded_len == 0) {
-        DPRINTF("Skipping unmodified page\n");
-        return 0;
-    } else if (encoded_len == -1) {
-        DPRINTF("Overflow\n");
-        acct_info.xbzrle_overflows++;
-        /* update data in the cache */
-        if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->host) {
+            qemu_madvise(block->host, block->max_length, QEMU_MADV_DONTFORK);
         }
-        return -1;
     }
+    rcu_read_unlock();
+}
 
-    /* we need to update the data in the cache, in order to get the same data */
-    if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
-    }
+/* Called with rcu_read_lock() held.  Drops the dirty bits of the ignored
+ * blocks; only the words they share with a neighbour can have any.
+ */
+static void migration_bitmap_clear_ignored(unsigned long *bitmap)
+{
+    RAMBlock *block;
 
-    /* Send XBZRLE based compressed page */
-    bytes_xbzrle = save_page_header(f, block, offset | RAM_SAVE_FLAG_XBZRLE);
-    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
-    qemu_put_be16(f, encoded_len);
-    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
-    bytes_xbzrle += encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_xbzrle;
-    *bytes_transferred += bytes_xbzrle;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+        unsigned long page;
 
-    return 1;
+        if (!ramblock_is_ignored(block)) {
+            continue;
+        }
+        for (page = first;
+             page < MIN(last, QEMU_ALIGN_UP(first, BITS_PER_LONG)); page++) {
+            migration_dirty_pages -= test_and_clear_bit(page, bitmap);
+        }
+        for (page = MAX(first, QEMU_ALIGN_DOWN(last, BITS_PER_LONG));
+             page < last; page++) {
+            migration_dirty_pages -= test_and_clear_bit(page, bitmap);
+        }
+    }
 }
 
 /* Called with rcu_read_lock() to protect migration_bitmap
@@ -585,12 +1400,352 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/* Free page hints
+ *
+ * A guest can tell us which of its pages are free (virtio-balloon does,
+ * with VIRTIO_BALLOON_F_FREE_PAGE_HINT); those don't need to be sent,
+ * unless the guest uses them again.  A hint is only valid until the next
+ * bitmap sync: a page written after it was reported is in the dirty log,
+ * but once the log has been synced into the migration bitmap, clearing
+ * the page there would lose that write.  So the hints are queued by the
+ * reporter, applied by the migration thread, and all the pending ones are
+ * applied right before each sync; the precopy notifiers tell the reporter
+ * to stop before the sync and to start again, with a fresh request, after
+ * it.
+ *
+ * Postcopy relies on the bitmap to know what the destination still lacks,
+ * so none of this is done when it is enabled.
+ */
+typedef struct FreePageHint {
+    ram_addr_t start;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(FreePageHint) next;
+} FreePageHint;
+
+static QemuMutex free_page_hint_mutex;
+static QSIMPLEQ_HEAD(, FreePageHint) free_page_hints =
+    QSIMPLEQ_HEAD_INITIALIZER(free_page_hints);
+/* Set while a precopy migration can take hints; protected by the mutex */
+static bool free_page_hint_active;
+
+static NotifierList precopy_notifiers =
+    NOTIFIER_LIST_INITIALIZER(precopy_notifiers);
+
+/* The notifiers are called with the iothread lock held */
+void precopy_add_notifier(Notifier *n)
+{
+    notifier_list_add(&precopy_notifiers, n);
+}
+
+void precopy_remove_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
+static void precopy_notify(PrecopyNotifyReason reason)
+{
+    if (free_page_hint_active) {
+        notifier_list_notify(&precopy_notifiers, &reason);
+    }
+}
+
+/*
+ * Report that the guest isn't using the memory at host address @addr.
+ * Only whole target pages within a RAMBlock are taken into account; hints
+ * outside of a migration are ignored.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    RAMBlock *block;
+    ram_addr_t ram_addr, offset, start, end;
+    FreePageHint *hint;
+
+    qemu_mutex_lock(&free_page_hint_mutex);
+    if (!free_page_hint_active) {
+        goto out;
+    }
+    block = qemu_ram_block_from_host(addr, false, &ram_addr, &offset);
+    if (!block || offset >= block->used_length) {
+        goto out;
+    }
+    len = MIN(len, block->used_length - offset);
+    start = ROUND_UP(ram_addr, TARGET_PAGE_SIZE);
+    end = (ram_addr + len) & TARGET_PAGE_MASK;
+    if (end <= start) {
+        goto out;
+    }
+
+    hint = g_new(FreePageHint, 1);
+    hint->start = start;
+    hint->len = end - start;
+    QSIMPLEQ_INSERT_TAIL(&free_page_hints, hint, next);
+out:
+    qemu_mutex_unlock(&free_page_hint_mutex);
+}
+
+/* Called in the migration thread, with rcu_read_lock() held */
+static void free_page_hints_apply(void)
+{
+    struct BitmapRcu *bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    FreePageHint *hint;
+    uint64_t cleared = 0;
+
+    qemu_mutex_lock(&free_page_hint_mutex);
+    while ((hint = QSIMPLEQ_FIRST(&free_page_hints))) {
+        unsigned long page = hint->start >> TARGET_PAGE_BITS;
+        unsigned long end = (hint->start + hint->len) >> TARGET_PAGE_BITS;
+
+        QSIMPLEQ_REMOVE_HEAD(&free_page_hints, next);
+        for (; bitmap && page < end; page++) {
+            if (test_and_clear_bit(page, bitmap->bmap)) {
+                migration_dirty_pages--;
+                cleared++;
+            }
+        }
+        g_free(hint);
+    }
+    qemu_mutex_unlock(&free_page_hint_mutex);
+
+    if (cleared) {
+        trace_ram_free_page_hints_apply(cleared);
+    }
+}
+
+static void free_page_hints_start(void)
 {
+    qemu_mutex_lock(&free_page_hint_mutex);
+    free_page_hint_active = !migrate_postcopy_ram();
+    qemu_mutex_unlock(&free_page_hint_mutex);
+}
+
+static void free_page_hints_stop(void)
+{
+    FreePageHint *hint;
+
+    qemu_mutex_lock(&free_page_hint_mutex);
+    free_page_hint_active = false;
+    while ((hint = QSIMPLEQ_FIRST(&free_page_hints))) {
+        QSIMPLEQ_REMOVE_HEAD(&free_page_hints, next);
+        g_free(hint);
+    }
+    qemu_mutex_unlock(&free_page_hint_mutex);
+}
+
+/* Parallel dirty bitmap sync
+ *
+ * The sync walks the dirty log of every RAM block, which on guests with
+ * terabytes of RAM takes a good part of each iteration.  The RAM blocks are
+ * turned into ranges of migration bitmap words; ranges are split in chunks
+ * that the migration thread and a few helper threads pick up in turn.
+ * Each word of the bitmap belongs to exactly one chunk, so no locking is
+ * needed on the bitmap itself, and chunks starting on a word boundary
+ * always take the fast path of cpu_physical_memory_sync_dirty_bitmap.
+ */
+
+/* Words of the migration bitmap per chunk; 4 GiB with 4 KiB pages */
+#define BITMAP_SYNC_CHUNK_WORDS       ((1UL << 20) / BITS_PER_LONG)
+/* Guest RAM size per thread taking part in the sync */
+#define BITMAP_SYNC_BYTES_PER_THREAD  (128ULL << 30)
+#define BITMAP_SYNC_MAX_THREADS       8
+
+typedef struct BitmapSyncRange {
+    unsigned long start;  /* first word */
+    unsigned long end;    /* one past the last word */
+} BitmapSyncRange;
+
+static struct {
+    bool running;
+    QemuThread *threads;
+    int nr_threads;
+    QemuMutex lock;
+    /* Signalled when a new sync starts, or the threads must quit */
+    QemuCond work_cond;
+    /* Signalled when the last busy helper is done */
+    QemuCond done_cond;
+    unsigned generation;
+    bool quit;
+    int busy;
     unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    BitmapSyncRange *chunks;
+    int nr_chunks;
+    int next_chunk;
+    uint64_t num_dirty;
+} bitmap_sync;
+
+/* Called with bitmap_sync.lock held; processes chunks until none is left */
+static void bitmap_sync_do_chunks(void)
+{
+    while (bitmap_sync.next_chunk < bitmap_sync.nr_chunks) {
+        BitmapSyncRange *c = &bitmap_sync.chunks[bitmap_sync.next_chunk++];
+        uint64_t num_dirty;
+
+        qemu_mutex_unlock(&bitmap_sync.lock);
+        num_dirty = cpu_physical_memory_sync_dirty_bitmap(
+            bitmap_sync.bitmap,
+            (ram_addr_t)c->start * BITS_PER_LONG << TARGET_PAGE_BITS,
+            (ram_addr_t)(c->end - c->start) * BITS_PER_LONG
+                << TARGET_PAGE_BITS);
+        qemu_mutex_lock(&bitmap_sync.lock);
+        bitmap_sync.num_dirty += num_dirty;
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    unsigned generation = 0;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&bitmap_sync.lock);
+    while (true) {
+        while (!bitmap_sync.quit && bitmap_sync.generation == generation) {
+            qemu_cond_wait(&bitmap_sync.work_cond, &bitmap_sync.lock);
+        }
+        if (bitmap_sync.quit) {
+            break;
+        }
+        generation = bitmap_sync.generation;
+        bitmap_sync_do_chunks();
+        if (--bitmap_sync.busy == 0) {
+            qemu_cond_signal(&bitmap_sync.done_cond);
+        }
+    }
+    qemu_mutex_unlock(&bitmap_sync.lock);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void migration_bitmap_sync_threads_create(void)
+{
+    int i, nr_threads;
+
+    nr_threads = MIN(ram_bytes_total() / BITMAP_SYNC_BYTES_PER_THREAD,
+                     BITMAP_SYNC_MAX_THREADS);
+    /* The migration thread does its share of the work, too */
+    nr_threads = MAX(nr_threads - 1, 0);
+
+    qemu_mutex_init(&bitmap_sync.lock);
+    qemu_cond_init(&bitmap_sync.work_cond);
+    qemu_cond_init(&bitmap_sync.done_cond);
+    bitmap_sync.quit = false;
+    bitmap_sync.generation = 0;
+    bitmap_sync.busy = 0;
+    bitmap_sync.nr_threads = nr_threads;
+    bitmap_sync.threads = g_new0(QemuThread, nr_threads);
+    bitmap_sync.running = true;
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(bitmap_sync.threads + i, "bitmap sync",
+                           bitmap_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migration_bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!bitmap_sync.running) {
+        return;
+    }
+    qemu_mutex_lock(&bitmap_sync.lock);
+    bitmap_sync.quit = true;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.lock);
+    for (i = 0; i < bitmap_sync.nr_threads; i++) {
+        qemu_thread_join(bitmap_sync.threads + i);
+    }
+    qemu_cond_destroy(&bitmap_sync.done_cond);
+    qemu_cond_destroy(&bitmap_sync.work_cond);
+    qemu_mutex_destroy(&bitmap_sync.lock);
+    g_free(bitmap_sync.threads);
+    g_free(bitmap_sync.chunks);
+    bitmap_sync.threads = NULL;
+    bitmap_sync.chunks = NULL;
+    bitmap_sync.nr_chunks = 0;
+    bitmap_sync.running = false;
+}
+
+static int bitmap_sync_range_cmp(const void *a, const void *b)
+{
+    const BitmapSyncRange *ra = a, *rb = b;
+
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Called with rcu_read_lock() and migration_bitmap_mutex held.
+ * Builds the list of chunks covering all RAM blocks.
+ */
+static void bitmap_sync_build_chunks(void)
+{
+    BitmapSyncRange *ranges;
+    RAMBlock *block;
+    int i, n = 0, nr_chunks = 0, max_chunks = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n++;
+    }
+    ranges = g_new(BitmapSyncRange, n);
+    n = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!pages || ramblock_is_ignored(block)) {
+            continue;
+        }
+        ranges[n].start = BIT_WORD(first);
+        ranges[n].end = BIT_WORD(first + pages - 1) + 1;
+        n++;
+    }
+
+    /* The block list is sorted by size, and blocks that are not aligned
+     * to a word can share one with their neighbour: sort and merge.
+     */
+    qsort(ranges, n, sizeof(*ranges), bitmap_sync_range_cmp);
+    for (i = 0; i < n; i++) {
+        unsigned long start = ranges[i].start;
+        unsigned long end = ranges[i].end;
+
+        while (i + 1 < n && ranges[i + 1].start < end) {
+            end = MAX(end, ranges[++i].end);
+        }
+        for (; start < end; start += BITMAP_SYNC_CHUNK_WORDS) {
+            if (nr_chunks == max_chunks) {
+                max_chunks = MAX(max_chunks * 2, 16);
+                bitmap_sync.chunks = g_renew(BitmapSyncRange,
+                                             bitmap_sync.chunks, max_chunks);
+            }
+            bitmap_sync.chunks[nr_chunks].start = start;
+            bitmap_sync.chunks[nr_chunks].end =
+                MIN(start + BITMAP_SYNC_CHUNK_WORDS, end);
+            nr_chunks++;
+        }
+    }
+    bitmap_sync.nr_chunks = nr_chunks;
+    g_free(ranges);
+}
+
+/* Called with rcu_read_lock() and migration_bitmap_mutex held */
+static void migration_bitmap_sync_blocks(void)
+{
+    qemu_mutex_lock(&bitmap_sync.lock);
+    bitmap_sync_build_chunks();
+    bitmap_sync.bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    bitmap_sync.next_chunk = 0;
+    bitmap_sync.num_dirty = 0;
+    if (bitmap_sync.nr_threads && bitmap_sync.nr_chunks > 1) {
+        bitmap_sync.busy = bitmap_sync.nr_threads;
+        bitmap_sync.generation++;
+        qemu_cond_broadcast(&bitmap_sync.work_cond);
+    }
+    bitmap_sync_do_chunks();
+    while (bitmap_sync.busy) {
+        qemu_cond_wait(&bitmap_sync.done_cond, &bitmap_sync.lock);
+    }
+    migration_dirty_pages += bitmap_sync.num_dirty;
+    if (migrate_ignore_shared()) {
+        migration_bitmap_clear_ignored(bitmap_sync.bitmap);
+    }
+    qemu_mutex_unlock(&bitmap_sync.lock);
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -607,13 +1762,14 @@ static void migration_bitmap_sync_init(void)
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+    mig_throttle_reset_counts();
 }
 
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
+    int64_t sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int64_t end_time;
     int64_t bytes_xfer_now;
 
@@ -627,14 +1783,17 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
+    rcu_read_lock();
+    free_page_hints_apply();
+    rcu_read_unlock();
+    precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC);
+
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
-    }
+    migration_bitmap_sync_blocks();
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
@@ -659,9 +1818,12 @@ static void migration_bitmap_sync(void)
                (dirty_rate_high_cnt++ >= 2)) {
                     trace_migration_throttle();
                     dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    mig_throttle_guest_down(num_dirty_pages_period *
+                                            TARGET_PAGE_SIZE,
+                                            bytes_xfer_now - bytes_xfer_prev);
              }
              bytes_xfer_prev = bytes_xfer_now;
+             mig_throttle_reset_counts();
         }
 
         if (migrate_use_xbzrle()) {
@@ -684,6 +1846,9 @@ static void migration_bitmap_sync(void)
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
+    acct_info.bitmap_sync_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                  sync_start;
+    precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC);
 }
 
 /**
@@ -774,8 +1939,12 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
              */
             xbzrle_cache_zero_page(current_addr);
         } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
+            acct_info.xbzrle_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                     start;
             if (!last_stage) {
                 /* Can't send this cached data async, since the cache page
                  * might get updated before it gets to the wire
@@ -804,22 +1973,72 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
+/* Same as save_page_header, but into a memory buffer */
+static size_t save_page_header_buf(uint8_t *buf, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    size_t size, len;
+
+    stq_be_p(buf, offset);
+    size = 8;
+
+    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
+        len = strlen(block->idstr);
+        buf[size] = len;
+        memcpy(buf + size + 1, block->idstr, len);
+        size += 1 + len;
+    }
+    return size;
+}
+
+/* Compress the batch of pages in @param into param->buf.
+ * Returns the number of bytes now waiting in the buffer.
+ */
 static int do_compress_ram_page(CompressParam *param)
 {
-    int bytes_sent, blen;
-    uint8_t *p;
+    size_t buf_size = compress_page_buf_size();
+    uint8_t *out = param->buf;
     RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
+    ssize_t blen;
+    int i;
+
+    for (i = 0; i < param->nr_pages; i++) {
+        ram_addr_t offset = param->offset[i];
+        uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+        size_t hlen;
+
+        hlen = save_page_header_buf(out, block,
+                                    offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+        blen = compress_codec_page(&param->codec, out + hlen + 4,
+                                   buf_size - hlen - 4, p);
+        if (blen < 0) {
+            /* Send the page uncompressed; the header has the same size */
+            error_report("Compress Failed!");
+            save_page_header_buf(out, block, offset | RAM_SAVE_FLAG_PAGE);
+            memcpy(out + hlen, p, TARGET_PAGE_SIZE);
+            out += hlen + TARGET_PAGE_SIZE;
+            continue;
+        }
+        stl_be_p(out + hlen, ((uint32_t)param->codec.method <<
+                              COMPRESS_METHOD_SHIFT) | blen);
+        out += hlen + 4 + blen;
+    }
+    param->nr_pages = 0;
+    param->buf_len = out - param->buf;
 
-    p = block->host + (offset & TARGET_PAGE_MASK);
+    return param->buf_len;
+}
 
-    bytes_sent = save_page_header(param->file, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+/* Move the compressed data of @param to the stream */
+static int put_compressed_data(QEMUFile *f, CompressParam *param)
+{
+    int len = param->buf_len;
 
-    return bytes_sent;
+    if (len) {
+        qemu_put_buffer(f, param->buf, len);
+        param->buf_len = 0;
+    }
+    return len;
 }
 
 static inline void start_compression(CompressParam *param)
@@ -841,6 +2060,8 @@ static inline void start_decompression(DecompressParam *param)
 
 static uint64_t bytes_transferred;
 
+static void dispatch_compress_batch(QEMUFile *f, uint64_t *bytes_transferred);
+
 static void flush_compressed_data(QEMUFile *f)
 {
     int idx, len, thread_count;
@@ -848,6 +2069,9 @@ static void flush_compressed_data(QEMUFile *f)
     if (!migrate_use_compression()) {
         return;
     }
+    if (comp_batch.nr_pages) {
+        dispatch_compress_batch(f, &bytes_transferred);
+    }
     thread_count = migrate_compress_threads();
     for (idx = 0; idx < thread_count; idx++) {
         if (!comp_param[idx].done) {
@@ -858,7 +2082,7 @@ static void flush_compressed_data(QEMUFile *f)
             qemu_mutex_unlock(comp_done_lock);
         }
         if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
+            len = put_compressed_data(f, &comp_param[idx]);
             bytes_transferred += len;
         }
     }
@@ -868,38 +2092,100 @@ static inline void set_compress_params(CompressParam *param, RAMBlock *block,
                                        ram_addr_t offset)
 {
     param->block = block;
-    param->offset = offset;
+    param->offset[0] = offset;
+    param->nr_pages = 1;
 }
 
-static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
-                                           ram_addr_t offset,
-                                           uint64_t *bytes_transferred)
+/* Hand the pages collected in comp_batch to an idle compression thread,
+ * after putting the output of its previous batch on the stream.
+ */
+static void dispatch_compress_batch(QEMUFile *f, uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    int idx, thread_count;
+    CompressParam *param;
 
     thread_count = migrate_compress_threads();
     qemu_mutex_lock(comp_done_lock);
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
             if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
                 break;
             }
         }
-        if (pages > 0) {
+        if (idx < thread_count) {
             break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
         }
+        qemu_cond_wait(comp_done_cond, comp_done_lock);
     }
+    param = &comp_param[idx];
+    *bytes_transferred += put_compressed_data(f, param);
+    param->block = comp_batch.block;
+    memcpy(param->offset, comp_batch.offset,
+           comp_batch.nr_pages * sizeof(comp_batch.offset[0]));
+    param->nr_pages = comp_batch.nr_pages;
+    comp_batch.nr_pages = 0;
+    start_compression(param);
     qemu_mutex_unlock(comp_done_lock);
+}
 
-    return pages;
+/* Pages are only queued here; they reach the stream once the batch has
+ * been compressed, or at the latest on flush_compressed_data.  The caller
+ * makes sure all pages of a batch belong to the same block.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset,
+                                           uint64_t *bytes_transferred)
+{
+    assert(!comp_batch.nr_pages || comp_batch.block == block);
+    comp_batch.block = block;
+    comp_batch.offset[comp_batch.nr_pages++] = offset;
+    acct_info.norm_pages++;
+    if (comp_batch.nr_pages == COMPRESS_BATCH_PAGES) {
+        dispatch_compress_batch(f, bytes_transferred);
+    }
+
+    return 1;
+}
+
+/**
+ * ram_save_multifd_page: queue the given page for the x-multifd channels
+ *
+ * Zero pages are still sent on the main stream; this function updates
+ * last_sent_block for them, since queued pages never reach @f.
+ *
+ * Returns: Number of pages written, < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    pages = save_zero_page(f, block,
+                           block == last_sent_block ?
+                           offset | RAM_SAVE_FLAG_CONTINUE : offset,
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(block, offset) < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+    /* Charge the page to the main stream so that rate limiting and the
+     * statistics see it.
+     */
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
 }
 
 /**
@@ -961,7 +2247,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                  */
                 bytes_xmit = do_compress_ram_page(&comp_param[0]);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
+                put_compressed_data(f, &comp_param[0]);
                 *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
@@ -974,26 +2260,180 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
-    return pages;
+    return pages;
+}
+
+/*
+ * Find the next dirty page and update any state associated with
+ * the search process.
+ *
+ * Returns: True if a page is found
+ *
+ * @f: Current migration stream.
+ * @pss: Data about the state of the current dirty page scan.
+ * @*again: Set to false if the search has scanned the whole of RAM
+ * *ram_addr_abs: Pointer into which to store the address of the dirty page
+ *               within the global ram_addr space
+ */
+/*
+ * x-mapped-ram file layout: each entry of the RAM block list is followed by
+ * a header giving the offsets, in the file, of a bitmap of the pages that
+ * were written and of the pages themselves; the block's pages are stored
+ * at their offset within the block, starting on a MAPPED_RAM_ALIGN
+ * boundary so that they can be read with O_DIRECT or mmap()ed.  The stream
+ * carries on after the last page of the block.  Pages missing from the
+ * bitmap are zero.
+ */
+#define MAPPED_RAM_VERSION      1
+#define MAPPED_RAM_HEADER_SIZE  (4 + 8 + 8 + 8)
+#define MAPPED_RAM_ALIGN        0x100000
+/* Dirty pages that are contiguous are written together, up to this size */
+#define MAPPED_RAM_MAX_RUN      (4 * 1024 * 1024)
+
+static struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t len;
+} mapped_ram_run;
+
+/* The bitmap is stored as little endian 64-bit words */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64) / 8;
+}
+
+/* Converts between host and file bitmap order, in either direction */
+static void mapped_ram_bitmap_le(unsigned long *dst, const unsigned long *src,
+                                 size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(unsigned long); i++) {
+        if (sizeof(unsigned long) == 8) {
+            dst[i] = cpu_to_le64(src[i]);
+        } else {
+            dst[i] = cpu_to_le32(src[i]);
+        }
+    }
+}
+
+/* Called from the block list in ram_save_setup */
+static int mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    off_t offset = qemu_get_offset(f);
+
+    if (offset < 0) {
+        error_report("x-mapped-ram can only migrate to a regular file");
+        return -1;
+    }
+    block->file_bmap = g_malloc0(mapped_ram_bitmap_size(block));
+    block->bitmap_offset = offset + MAPPED_RAM_HEADER_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    return qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static int mapped_ram_flush(QEMUFile *f)
+{
+    RAMBlock *block = mapped_ram_run.block;
+    ssize_t ret;
+
+    if (!mapped_ram_run.len) {
+        return 0;
+    }
+    ret = qemu_put_buffer_at(f, block->host + mapped_ram_run.offset,
+                             mapped_ram_run.len,
+                             block->pages_offset + mapped_ram_run.offset);
+    mapped_ram_run.len = 0;
+    return ret < 0 ? ret : 0;
 }
 
-/*
- * Find the next dirty page and update any state associated with
- * the search process.
+/* Called with rcu_read_lock() held, once all pages have been written */
+static int mapped_ram_write_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        size_t size = mapped_ram_bitmap_size(block);
+        unsigned long *buf;
+        ssize_t ret;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        buf = g_malloc(size);
+        mapped_ram_bitmap_le(buf, block->file_bmap, size);
+        ret = qemu_put_buffer_at(f, (uint8_t *)buf, size,
+                                 block->bitmap_offset);
+        g_free(buf);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * ram_save_mapped_page: write a page at its place in the file
  *
- * Returns: True if a page is found
+ * Returns: 1, or a negative value on error
  *
- * @f: Current migration stream.
- * @pss: Data about the state of the current dirty page scan.
- * @*again: Set to false if the search has scanned the whole of RAM
- * *ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
+ * Zero pages are only cleared in the bitmap, so that the file stays sparse
+ * and a page that was written before and is now zero is not restored.
  */
+static int ram_save_mapped_page(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+
+    if (!block->file_bmap) {
+        error_report("RAM block %s was added during migration", block->idstr);
+        return -EINVAL;
+    }
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+
+    if (mapped_ram_run.len &&
+        (mapped_ram_run.block != block ||
+         mapped_ram_run.offset + mapped_ram_run.len != offset ||
+         mapped_ram_run.len >= MAPPED_RAM_MAX_RUN)) {
+        if (mapped_ram_flush(f) < 0) {
+            return -EIO;
+        }
+    }
+    if (!mapped_ram_run.len) {
+        mapped_ram_run.block = block;
+        mapped_ram_run.offset = offset;
+    }
+    mapped_ram_run.len += TARGET_PAGE_SIZE;
+
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
 static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
                              bool *again, ram_addr_t *ram_addr_abs)
 {
-    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
-                                              ram_addr_abs);
+    if (ramblock_is_ignored(pss->block)) {
+        pss->offset = pss->block->used_length;
+        *ram_addr_abs = pss->block->offset + pss->offset;
+    } else {
+        pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
+                                                  ram_addr_abs);
+    }
     if (pss->complete_round && pss->block == last_seen_block &&
         pss->offset >= last_offset) {
         /*
@@ -1040,15 +2480,29 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
  *
  * Returns:      block (or NULL if none available)
  */
+/* Prefetch requests beyond this are dropped, oldest first; by the time
+ * they would be served the guest has likely moved on.
+ */
+#define MAX_PREFETCH_REQUESTS 64
+
+/* Pages the guest is waiting for come first, prefetch requests are only
+ * served when there is none.
+ */
 static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
                               ram_addr_t *ram_addr_abs)
 {
     RAMBlock *block = NULL;
+    struct MigrationSrcPageRequest *entry = NULL;
+    bool prefetch = false;
 
     qemu_mutex_lock(&ms->src_page_req_mutex);
     if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+        entry = QSIMPLEQ_FIRST(&ms->src_page_requests);
+    } else if (!QSIMPLEQ_EMPTY(&ms->src_prefetch_requests)) {
+        entry = QSIMPLEQ_FIRST(&ms->src_prefetch_requests);
+        prefetch = true;
+    }
+    if (entry) {
         block = entry->rb;
         *offset = entry->offset;
         *ram_addr_abs = (entry->offset + entry->rb->offset) &
@@ -1059,7 +2513,12 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            if (prefetch) {
+                QSIMPLEQ_REMOVE_HEAD(&ms->src_prefetch_requests, next_req);
+                ms->src_prefetch_count--;
+            } else {
+                QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            }
             g_free(entry);
         }
     }
@@ -1152,6 +2611,13 @@ void flush_page_queue(MigrationState *ms)
         QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_prefetch_requests, next_req,
+                          next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_prefetch_requests, next_req);
+        g_free(mspr);
+    }
+    ms->src_prefetch_count = 0;
     rcu_read_unlock();
 }
 
@@ -1161,10 +2627,12 @@ void flush_page_queue(MigrationState *ms)
  *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
  *   start: Offset from the start of the RAMBlock
  *   len: Length (in bytes) to send
+ *   prefetch: The guest is not waiting for the pages yet; the request is
+ *             served after the others and clipped to the end of the block
  *   Return: 0 on success
  */
 int ram_save_queue_pages(MigrationState *ms, const char *rbname,
-                         ram_addr_t start, ram_addr_t len)
+                         ram_addr_t start, ram_addr_t len, bool prefetch)
 {
     RAMBlock *ramblock;
 
@@ -1192,6 +2660,9 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
         ms->last_req_rb = ramblock;
     }
     trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (prefetch && start < ramblock->used_length) {
+        len = MIN(len, ramblock->used_length - start);
+    }
     if (start+len > ramblock->used_length) {
         error_report("%s request overrun start=" RAM_ADDR_FMT " len="
                      RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
@@ -1207,7 +2678,21 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    if (prefetch) {
+        if (ms->src_prefetch_count == MAX_PREFETCH_REQUESTS) {
+            struct MigrationSrcPageRequest *old =
+                QSIMPLEQ_FIRST(&ms->src_prefetch_requests);
+
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_prefetch_requests, next_req);
+            memory_region_unref(old->rb->mr);
+            g_free(old);
+            ms->src_prefetch_count--;
+        }
+        QSIMPLEQ_INSERT_TAIL(&ms->src_prefetch_requests, new_entry, next_req);
+        ms->src_prefetch_count++;
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1243,9 +2728,17 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
         if (compression_switch && migrate_use_compression()) {
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+            acct_info.compress_time +=
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        } else if (multifd_send_state) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
+        } else if (migrate_mapped_ram()) {
+            res = ram_save_mapped_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1260,9 +2753,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  x-multifd takes care of it by itself, and
+         * x-mapped-ram doesn't use it.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd_send_state && !migrate_mapped_ram()) {
             last_sent_block = pss->block;
         }
     }
@@ -1276,6 +2770,9 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
  *                     offset to point into the middle of a host page
  *                     in which case the remainder of the hostpage is sent.
  *                     Only dirty target pages are sent.
+ *                     With postcopy the host page is the one of the
+ *                     block, which for hugetlbfs is bigger than
+ *                     qemu_host_page_size.
  *
  * Returns: Number of pages written.
  *
@@ -1294,6 +2791,9 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
                               ram_addr_t dirty_ram_abs)
 {
     int tmppages, pages = 0;
+    size_t pagesize = migrate_postcopy_ram() ? qemu_ram_pagesize(pss->block) :
+                                               qemu_host_page_size;
+
     do {
         tmppages = ram_save_target_page(ms, f, pss, last_stage,
                                         bytes_transferred, dirty_ram_abs);
@@ -1304,7 +2804,7 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
         pages += tmppages;
         pss->offset += TARGET_PAGE_SIZE;
         dirty_ram_abs += TARGET_PAGE_SIZE;
-    } while (pss->offset & (qemu_host_page_size - 1));
+    } while (pss->offset & (pagesize - 1));
 
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
@@ -1350,8 +2850,12 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
         found = get_queued_page(ms, &pss, &dirty_ram_abs);
 
         if (!found) {
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+            acct_info.page_scan_time +=
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
         }
 
         if (found) {
@@ -1425,11 +2929,15 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+
+    precopy_notify(PRECOPY_NOTIFY_CLEANUP);
+    free_page_hints_stop();
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
+    migration_bitmap_sync_threads_join();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
@@ -1441,6 +2949,18 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        rcu_read_unlock();
+        mapped_ram_run.len = 0;
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1465,7 +2985,7 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         bitmap->bmap = bitmap_new(new);
 
         /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
+         * by migration_bitmap_sync() at the same time.
          * it is safe to migration if migration_bitmap is cleared bit
          * at the same time.
          */
@@ -1619,7 +3139,7 @@ static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
 {
     unsigned long *bitmap;
     unsigned long *unsentmap;
-    unsigned int host_ratio = qemu_host_page_size / TARGET_PAGE_SIZE;
+    unsigned int host_ratio = qemu_ram_pagesize(block) / TARGET_PAGE_SIZE;
     unsigned long first = block->offset >> TARGET_PAGE_BITS;
     unsigned long len = block->used_length >> TARGET_PAGE_BITS;
     unsigned long last = first + (len - 1);
@@ -1736,8 +3256,8 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
 {
     struct RAMBlock *block;
 
-    if (qemu_host_page_size == TARGET_PAGE_SIZE) {
-        /* Easy case - TPS==HPS - nothing to be done */
+    if (qemu_ram_pagesize_largest() == TARGET_PAGE_SIZE) {
+        /* Easy case - TPS==HPS for all blocks - nothing to be done */
         return 0;
     }
 
@@ -1749,6 +3269,10 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         unsigned long first = block->offset >> TARGET_PAGE_BITS;
 
+        if (qemu_ram_pagesize(block) == TARGET_PAGE_SIZE) {
+            continue;
+        }
+
         PostcopyDiscardState *pds =
                          postcopy_discard_send_init(ms, first, block->idstr);
 
@@ -1846,8 +3370,9 @@ int ram_discard_range(MigrationIncomingState *mis,
     }
 
     uint8_t *host_startaddr = rb->host + start;
+    size_t pagesize = qemu_ram_pagesize(rb);
 
-    if ((uintptr_t)host_startaddr & (qemu_host_page_size - 1)) {
+    if ((uintptr_t)host_startaddr & (pagesize - 1)) {
         error_report("ram_discard_range: Unaligned start address: %p",
                      host_startaddr);
         goto err;
@@ -1855,12 +3380,12 @@ int ram_discard_range(MigrationIncomingState *mis,
 
     if ((start + length) <= rb->used_length) {
         uint8_t *host_endaddr = host_startaddr + length;
-        if ((uintptr_t)host_endaddr & (qemu_host_page_size - 1)) {
+        if ((uintptr_t)host_endaddr & (pagesize - 1)) {
             error_report("ram_discard_range: Unaligned end address: %p",
                          host_endaddr);
             goto err;
         }
-        ret = postcopy_ram_discard_range(mis, host_startaddr, length);
+        ret = postcopy_ram_discard_range(mis, rb, start, length);
     } else {
         error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
                      "/%zx/" RAM_ADDR_FMT")",
@@ -1920,6 +3445,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_multifd() && multifd_send_threads_create() < 0) {
+        return -1;
+    }
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
@@ -1928,6 +3457,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     bytes_transferred = 0;
     reset_ram_globals();
 
+    migration_bitmap_sync_threads_create();
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
     migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
@@ -1944,7 +3474,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    if (migrate_ignore_shared()) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (ramblock_is_ignored(block)) {
+                unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+                bitmap_clear(migration_bitmap_rcu->bmap,
+                             block->offset >> TARGET_PAGE_BITS, pages);
+                migration_dirty_pages -= pages;
+            }
+        }
+    }
+
     memory_global_dirty_log_start();
+    /* The first sync asks the guest for its free pages */
+    free_page_hints_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -1955,10 +3499,32 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        /*
+         * Postcopy places whole host pages, so both sides must back the
+         * block with the same page size; only hugepage blocks carry it,
+         * to keep the stream unchanged for everybody else.
+         */
+        if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
+            qemu_put_be64(f, block->page_size);
+        }
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
+        if (migrate_mapped_ram() && mapped_ram_setup_block(f, block) < 0) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
 
+    /* Keep the channels from placing pages before the destination has
+     * gone through the RAM block list.
+     */
+    if (multifd_send_sync_main(f) < 0) {
+        return -1;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1971,7 +3537,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
     int i;
-    int64_t t0;
+    int64_t t0, flush_start;
     int pages_sent = 0;
 
     rcu_read_lock();
@@ -1982,8 +3548,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     /* Read version before ram_list.blocks */
     smp_rmb();
 
+    if (multifd_send_sync_if_needed(f) < 0) {
+        rcu_read_unlock();
+        return -EIO;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (!migration_bitmap_frozen) {
+        free_page_hints_apply();
+    }
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2012,7 +3586,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    flush_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     flush_compressed_data(f);
+    acct_info.compress_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                               flush_start;
+    if (multifd_flush_pages() < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    mapped_ram_flush(f);
     rcu_read_unlock();
 
     /*
@@ -2035,10 +3616,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int64_t flush_start;
+
     rcu_read_lock();
 
-    if (!migration_in_postcopy(migrate_get_current())) {
-        migration_bitmap_sync();
+    if (!migration_bitmap_frozen) {
+        if (!migration_in_postcopy(migrate_get_current())) {
+            migration_bitmap_sync();
+        }
+        precopy_notify(PRECOPY_NOTIFY_COMPLETE);
+    }
+
+    if (multifd_send_sync_if_needed(f) < 0) {
+        qemu_file_set_error(f, -EIO);
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
@@ -2056,12 +3646,23 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    flush_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     flush_compressed_data(f);
+    acct_info.compress_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                               flush_start;
+    /* All pages must be in place before the device state is loaded */
+    if (multifd_send_sync_main(f) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    if (migrate_mapped_ram() && !mapped_ram_flush(f)) {
+        mapped_ram_write_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_file_zerocopy_flush(f);
 
     return 0;
 }
@@ -2076,6 +3677,8 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
+        /* Keep the memory locked by zero-copy sends to one round */
+        qemu_file_zerocopy_flush(f);
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
@@ -2186,21 +3789,19 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
 
     while (!quit_decomp_thread) {
         qemu_mutex_lock(&param->mutex);
         while (!param->start && !quit_decomp_thread) {
             qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
             if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
+                /* Decompression will fail in some case, especially
                  * when the page is dirted when doing the compression, it's
                  * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
+                 * and the failure won't break the data in other pages.
                  */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+                decompress_codec_page(&param->codec, param->method,
+                                      param->des, param->compbuf, param->len);
             }
             param->start = false;
         }
@@ -2221,7 +3822,13 @@ void migrate_decompress_threads_create(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(compress_page_bound());
+        /* Only zlib needs state set up in advance, zstd's is cheap enough */
+        compress_codec_init(&decomp_param[i].codec,
+                            MIGRATION_COMPRESS_METHOD_ZLIB, 0, true);
+#ifdef CONFIG_ZSTD
+        decomp_param[i].codec.zstd_dctx = ZSTD_createDCtx();
+#endif
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2243,6 +3850,7 @@ void migrate_decompress_threads_join(void)
         qemu_thread_join(decompress_threads + i);
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
+        compress_codec_cleanup(&decomp_param[i].codec, true);
         g_free(decomp_param[i].compbuf);
     }
     g_free(decompress_threads);
@@ -2251,8 +3859,273 @@ void migrate_decompress_threads_join(void)
     decomp_param = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+typedef struct {
+    QemuThread thread;
+    QEMUFile *file;
+    bool running;
+    /* Posted by the main stream to release the channel from a SYNC */
+    QemuSemaphore sem_go;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int listen_fd;
+    QemuThread accept_thread;
+    /* Posted by each channel when it reaches a SYNC packet */
+    QemuSemaphore sem_sync;
+    bool quit;
+    bool error;
+} *multifd_recv_state;
+
+static void multifd_recv_set_error(void)
+{
+    atomic_set(&multifd_recv_state->error, true);
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+}
+
+static int multifd_recv_pages(QEMUFile *f)
+{
+    RAMBlock *block;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    char id[256];
+    uint8_t len;
+    uint32_t num;
+    int i, ret = 0;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    num = qemu_get_be32(f);
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("x-multifd: invalid page count %" PRIu32, num);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("x-multifd: can't find block %s", id);
+        ret = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < num; i++) {
+        void *host = host_from_ram_block_offset(block, offset[i]);
+
+        if (!host) {
+            error_report("x-multifd: illegal RAM offset " RAM_ADDR_FMT,
+                         offset[i]);
+            ret = -EINVAL;
+            goto out;
+        }
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+    }
+    ret = qemu_file_get_error(f);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t type;
+    int ret = 0;
+
+    while (!ret) {
+        type = qemu_get_be32(p->file);
+        ret = qemu_file_get_error(p->file);
+        if (ret) {
+            break;
+        }
+
+        switch (type) {
+        case MULTIFD_PACKET_PAGES:
+            ret = multifd_recv_pages(p->file);
+            break;
+        case MULTIFD_PACKET_SYNC:
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_go);
+            if (atomic_read(&multifd_recv_state->quit)) {
+                return NULL;
+            }
+            break;
+        case MULTIFD_PACKET_END:
+            return NULL;
+        default:
+            error_report("x-multifd: unknown packet type %" PRIu32, type);
+            ret = -EINVAL;
+        }
+    }
+
+    if (!atomic_read(&multifd_recv_state->quit)) {
+        multifd_recv_set_error();
+    }
+    return NULL;
+}
+
+static int multifd_recv_new_channel(int fd)
+{
+    QEMUFile *f;
+    MultiFDRecvParams *p;
+    uint32_t magic, version, id;
+
+    if (migrate_use_tls()) {
+        Error *local_err = NULL;
+        QIOChannelTLS *tioc = migration_tls_channel_new(fd, false, &local_err);
+
+        if (!tioc || migration_tls_handshake_sync(tioc, &local_err) < 0) {
+            error_report_err(local_err);
+            if (tioc) {
+                object_unref(OBJECT(tioc));
+            }
+            return -1;
+        }
+        f = qemu_fopen_channel(QIO_CHANNEL(tioc), "rb");
+        object_unref(OBJECT(tioc));
+    } else {
+        f = qemu_fopen_socket(fd, "rb");
+    }
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    id = qemu_get_be32(f);
+    if (qemu_file_get_error(f) || magic != MULTIFD_MAGIC ||
+        version != MULTIFD_VERSION || id >= multifd_recv_state->count ||
+        multifd_recv_state->params[id].running) {
+        error_report("x-multifd: invalid channel header");
+        qemu_fclose(f);
+        return -1;
+    }
+
+    p = &multifd_recv_state->params[id];
+    p->file = f;
+    p->running = true;
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+static void *multifd_recv_accept_thread(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int i, c;
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        do {
+            addrlen = sizeof(addr);
+            c = qemu_accept(multifd_recv_state->listen_fd,
+                            (struct sockaddr *)&addr, &addrlen);
+        } while (c < 0 && errno == EINTR);
+
+        if (atomic_read(&multifd_recv_state->quit)) {
+            if (c >= 0) {
+                closesocket(c);
+            }
+            return NULL;
+        }
+        if (c < 0) {
+            error_report("could not accept x-multifd connection (%s)",
+                         strerror(errno));
+            break;
+        }
+        if (multifd_recv_new_channel(c) < 0) {
+            break;
+        }
+    }
+
+    if (i < multifd_recv_state->count) {
+        multifd_recv_set_error();
+    }
+    return NULL;
+}
+
+/*
+ * Called by the tcp transport once the main stream is connected; the RAM
+ * channels are accepted on the same listening socket, which is owned by
+ * the x-multifd code from now on.
+ */
+void multifd_recv_start(int listen_fd)
+{
+    int i, count;
+
+    count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    for (i = 0; i < count; i++) {
+        qemu_sem_init(&multifd_recv_state->params[i].sem_go, 0);
+    }
+
+    qemu_set_block(listen_fd);
+    qemu_thread_create(&multifd_recv_state->accept_thread, "multifd_accept",
+                       multifd_recv_accept_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* RAM_SAVE_FLAG_MULTIFD_SYNC: wait for all channels to reach their SYNC */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("x-multifd stream, but the capability is not enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        if (!atomic_read(&multifd_recv_state->error)) {
+            qemu_sem_wait(&multifd_recv_state->sem_sync);
+        }
+        if (atomic_read(&multifd_recv_state->error)) {
+            return -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_go);
+    }
+    return 0;
+}
+
+void multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    atomic_set(&multifd_recv_state->quit, true);
+    shutdown(multifd_recv_state->listen_fd, SHUT_RDWR);
+    qemu_thread_join(&multifd_recv_state->accept_thread);
+    closesocket(multifd_recv_state->listen_fd);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            qemu_file_shutdown(p->file);
+            qemu_sem_post(&p->sem_go);
+            qemu_thread_join(&p->thread);
+            qemu_fclose(p->file);
+        }
+        qemu_sem_destroy(&p->sem_go);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               MigrationCompressMethod method,
+                                               int len)
 {
     int idx, thread_count;
 
@@ -2263,6 +4136,7 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
                 qemu_get_buffer(f, decomp_param[idx].compbuf, len);
                 decomp_param[idx].des = host;
                 decomp_param[idx].len = len;
+                decomp_param[idx].method = method;
                 start_decompression(&decomp_param[idx]);
                 break;
             }
@@ -2292,12 +4166,17 @@ static int ram_load_postcopy(QEMUFile *f)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
-    bool matching_page_sizes = qemu_host_page_size == TARGET_PAGE_SIZE;
+    bool matching_page_sizes = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
     void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
+    size_t pagesize = qemu_host_page_size;
+
+    if (!postcopy_host_page) {
+        return -ENOMEM;
+    }
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -2321,7 +4200,8 @@ static int ram_load_postcopy(QEMUFile *f)
                 ret = -EINVAL;
                 break;
             }
-            page_buffer = host;
+            pagesize = qemu_ram_pagesize(block);
+            matching_page_sizes = pagesize == TARGET_PAGE_SIZE;
             /*
              * Postcopy requires that we place whole host pages atomically.
              * To make it atomic, the data is read into a temporary page
@@ -2331,9 +4211,9 @@ static int ram_load_postcopy(QEMUFile *f)
              * of a host page in order.
              */
             page_buffer = postcopy_host_page +
-                          ((uintptr_t)host & ~qemu_host_page_mask);
+                          ((uintptr_t)host & (pagesize - 1));
             /* If all TP are zero then we can optimise the place */
-            if (!((uintptr_t)host & ~qemu_host_page_mask)) {
+            if (!((uintptr_t)host & (pagesize - 1))) {
                 all_zero = true;
             } else {
                 /* not the 1st TP within the HP */
@@ -2351,7 +4231,7 @@ static int ram_load_postcopy(QEMUFile *f)
              * page
              */
             place_needed = (((uintptr_t)host + TARGET_PAGE_SIZE) &
-                                     ~qemu_host_page_mask) == 0;
+                                     (pagesize - 1)) == 0;
             place_source = postcopy_host_page;
         }
         last_host = host;
@@ -2389,14 +4269,13 @@ static int ram_load_postcopy(QEMUFile *f)
 
         if (place_needed) {
             /* This gets called at the last target page in the host page */
+            void *place_dest = host + TARGET_PAGE_SIZE - pagesize;
+
             if (all_zero) {
-                ret = postcopy_place_page_zero(mis,
-                                               host + TARGET_PAGE_SIZE -
-                                               qemu_host_page_size);
+                ret = postcopy_place_page_zero(mis, place_dest, pagesize);
             } else {
-                ret = postcopy_place_page(mis, host + TARGET_PAGE_SIZE -
-                                               qemu_host_page_size,
-                                               place_source);
+                ret = postcopy_place_page(mis, place_dest, place_source,
+                                          pagesize);
             }
         }
         if (!ret) {
@@ -2407,6 +4286,63 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/*
+ * Read the x-mapped-ram header of @block from the block list, and the
+ * pages of the block from where it points to; returns 0 or -errno.
+ */
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block, bool lazy)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t size = mapped_ram_bitmap_size(block);
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    unsigned long *bitmap;
+    unsigned long first, last;
+    int ret = 0;
+
+    if (version != MAPPED_RAM_VERSION || page_size != TARGET_PAGE_SIZE) {
+        error_report("Unsupported mapped RAM layout for %s (version %u, "
+                     "page size %" PRIu64 ")", block->idstr, version,
+                     page_size);
+        return -EINVAL;
+    }
+
+    bitmap = g_malloc(size);
+    if (qemu_get_buffer_at(f, (uint8_t *)bitmap, size, bitmap_offset) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+    mapped_ram_bitmap_le(bitmap, bitmap, size);
+
+    if (lazy) {
+        lazy_restore_add_block(block, block->host, block->used_length,
+                               bitmap, pages_offset);
+        bitmap = NULL;
+        goto skip;
+    }
+
+    /* Read each run of present pages at once */
+    for (first = find_first_bit(bitmap, pages); first < pages;
+         first = find_next_bit(bitmap, pages, last)) {
+        last = find_next_zero_bit(bitmap, pages, first);
+        if (qemu_get_buffer_at(f, block->host + (first << TARGET_PAGE_BITS),
+                               (last - first) << TARGET_PAGE_BITS,
+                               pages_offset +
+                               (first << TARGET_PAGE_BITS)) < 0) {
+            ret = -EIO;
+            goto out;
+        }
+    }
+skip:
+    ret = qemu_set_offset(f, pages_offset + block->used_length);
+
+out:
+    g_free(bitmap);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2417,6 +4353,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * be atomic
      */
     bool postcopy_running = postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING;
+    /* ADVISE is earlier, it shows the source can postcopy */
+    bool postcopy_advised = postcopy_state_get() >= POSTCOPY_INCOMING_ADVISE;
+    bool lazy = false;
 
     seq_iter++;
 
@@ -2460,6 +4399,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            if (migrate_mapped_ram() && migrate_lazy_restore()) {
+                lazy = postcopy_ram_supported_by_host();
+                if (!lazy) {
+                    error_report("x-lazy-restore is not supported here, "
+                                 "reading all of RAM");
+                }
+            }
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -2471,6 +4417,30 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 length = qemu_get_be64(f);
 
                 block = qemu_ram_block_by_name(id);
+                if (block && postcopy_advised &&
+                    block->page_size != qemu_host_page_size) {
+                    uint64_t remote_page_size = qemu_get_be64(f);
+
+                    if (remote_page_size != block->page_size) {
+                        error_report("Mismatched RAM page size %s "
+                                     "(local) %zd != %" PRId64,
+                                     id, block->page_size,
+                                     remote_page_size);
+                        ret = -EINVAL;
+                        break;
+                    }
+                }
+                if (migrate_ignore_shared()) {
+                    bool ignored = qemu_get_byte(f);
+
+                    if (block && ignored && !ramblock_is_ignored(block)) {
+                        error_report("RAM block %s is not sent by the "
+                                     "source, but its memory is not shared "
+                                     "with it here", id);
+                        ret = -EINVAL;
+                        break;
+                    }
+                }
                 if (block) {
                     if (length != block->used_length) {
                         Error *local_err = NULL;
@@ -2483,6 +4453,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = ram_load_mapped_block(f, block, lazy &&
+                                                    !ramblock_is_ignored(block));
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2491,6 +4465,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && lazy) {
+                ret = lazy_restore_start(qemu_get_fd(f));
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2502,15 +4479,26 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
-        case RAM_SAVE_FLAG_COMPRESS_PAGE:
-            len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+        case RAM_SAVE_FLAG_COMPRESS_PAGE: {
+            uint32_t word = qemu_get_be32(f);
+            MigrationCompressMethod method = word >> COMPRESS_METHOD_SHIFT;
+
+            if (method >= MIGRATION_COMPRESS_METHOD__MAX ||
+                !migrate_compress_method_supported(method)) {
+                error_report("Unsupported compression method: %u",
+                             word >> COMPRESS_METHOD_SHIFT);
+                ret = -EINVAL;
+                break;
+            }
+            len = word & COMPRESS_LEN_MASK;
+            if (len > compress_page_bound()) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            decompress_data_with_multi_threads(f, host, method, len);
             break;
+        }
 
         case RAM_SAVE_FLAG_XBZRLE:
             if (load_xbzrle(f, addr, host) < 0) {
@@ -2520,6 +4508,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2556,5 +4547,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&free_page_hint_mutex);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
@@ -44,7 +44,8 @@
 #define RDMA_MERGE_MAX (2 * 1024 * 1024)
 #define RDMA_SIGNALED_SEND_MAX (RDMA_MERGE_MAX / 4096)
 
-#define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
+#define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB, the default and smallest chunk */
+#define RDMA_REG_CHUNK_SHIFT_MAX 30 /* 1 GB */
 
 /*
  * This is only for non-live state being migrated.
@@ -65,12 +66,16 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* Chunks other than 1 MB; the top byte of the flags holds their shift */
+#define RDMA_CAPABILITY_CHUNK_SIZE 0x02
+#define RDMA_CAPABILITY_CHUNK_SHIFT(flags) ((flags) >> 24)
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_CHUNK_SIZE;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -212,6 +217,8 @@ static void network_to_caps(RDMACapabilities *cap)
  * because we're using a single IB message to transmit
  * the information. It's small anyway, so a list is overkill.
  */
+typedef struct RDMARegCacheEntry RDMARegCacheEntry;
+
 typedef struct RDMALocalBlock {
     char          *block_name;
     uint8_t       *local_host_addr; /* local virtual address */
@@ -228,8 +235,20 @@ typedef struct RDMALocalBlock {
     int            nb_chunks;
     unsigned long *transit_bitmap;
     unsigned long *unregister_bitmap;
+    RDMARegCacheEntry **reg_cache;  /* (Only used on source) */
 } RDMALocalBlock;
 
+/*
+ * A chunk registered on both sides, in the registration cache of the source.
+ * It is in the LRU list unless it has been picked for unregistration.
+ */
+struct RDMARegCacheEntry {
+    int index;
+    uint64_t chunk;
+    bool in_lru;
+    QTAILQ_ENTRY(RDMARegCacheEntry) next;
+};
+
 /*
  * Also represents a RAMblock, but only on the dest.
  * This gets transmitted by the dest during connection-time
@@ -370,6 +389,18 @@ typedef struct RDMAContext {
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
     GHashTable *blockmap;
+
+    /* log2 of the registration chunk size, agreed on at connection time */
+    unsigned int chunk_shift;
+
+    /*
+     * Registration cache of the source, when not pinning everything:
+     * registered chunks, least recently written first.  Beyond
+     * reg_cache_max chunks (0 for no limit) the oldest are unregistered.
+     */
+    QTAILQ_HEAD(, RDMARegCacheEntry) reg_cache_lru;
+    uint64_t reg_cache_nr;
+    uint64_t reg_cache_max;
 } RDMAContext;
 
 /*
@@ -505,24 +536,27 @@ static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
                                    int *resp_idx,
                                    int (*callback)(RDMAContext *rdma));
 
-static inline uint64_t ram_chunk_index(const uint8_t *start,
+static inline uint64_t ram_chunk_index(const RDMAContext *rdma,
+                                       const uint8_t *start,
                                        const uint8_t *host)
 {
-    return ((uintptr_t) host - (uintptr_t) start) >> RDMA_REG_CHUNK_SHIFT;
+    return ((uintptr_t) host - (uintptr_t) start) >> rdma->chunk_shift;
 }
 
-static inline uint8_t *ram_chunk_start(const RDMALocalBlock *rdma_ram_block,
+static inline uint8_t *ram_chunk_start(const RDMAContext *rdma,
+                                       const RDMALocalBlock *rdma_ram_block,
                                        uint64_t i)
 {
     return (uint8_t *)(uintptr_t)(rdma_ram_block->local_host_addr +
-                                  (i << RDMA_REG_CHUNK_SHIFT));
+                                  (i << rdma->chunk_shift));
 }
 
-static inline uint8_t *ram_chunk_end(const RDMALocalBlock *rdma_ram_block,
+static inline uint8_t *ram_chunk_end(const RDMAContext *rdma,
+                                     const RDMALocalBlock *rdma_ram_block,
                                      uint64_t i)
 {
-    uint8_t *result = ram_chunk_start(rdma_ram_block, i) +
-                                         (1UL << RDMA_REG_CHUNK_SHIFT);
+    uint8_t *result = ram_chunk_start(rdma, rdma_ram_block, i) +
+                                         (1UL << rdma->chunk_shift);
 
     if (result > (rdma_ram_block->local_host_addr + rdma_ram_block->length)) {
         result = rdma_ram_block->local_host_addr + rdma_ram_block->length;
@@ -565,7 +599,11 @@ static int rdma_add_block(RDMAContext *rdma, const char *block_name,
     block->length = length;
     block->index = local->nb_blocks;
     block->src_index = ~0U; /* Filled in by the receipt of the block list */
-    block->nb_chunks = ram_chunk_index(host_addr, host_addr + length) + 1UL;
+    /*
+     * Blocks are added before the chunk size is negotiated; size the
+     * per-chunk arrays for the smallest chunks, which covers any other.
+     */
+    block->nb_chunks = (length >> RDMA_REG_CHUNK_SHIFT) + 1UL;
     block->transit_bitmap = bitmap_new(block->nb_chunks);
     bitmap_clear(block->transit_bitmap, 0, block->nb_chunks);
     block->unregister_bitmap = bitmap_new(block->nb_chunks);
@@ -663,6 +701,22 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
     g_free(block->remote_keys);
     block->remote_keys = NULL;
 
+    if (block->reg_cache) {
+        int j;
+
+        for (j = 0; j < block->nb_chunks; j++) {
+            RDMARegCacheEntry *entry = block->reg_cache[j];
+
+            if (entry && entry->in_lru) {
+                QTAILQ_REMOVE(&rdma->reg_cache_lru, entry, next);
+                rdma->reg_cache_nr--;
+            }
+            g_free(entry);
+        }
+        g_free(block->reg_cache);
+        block->reg_cache = NULL;
+    }
+
     g_free(block->block_name);
     block->block_name = NULL;
 
@@ -1131,7 +1185,7 @@ static int qemu_rdma_search_ram_block(RDMAContext *rdma,
     assert((current_addr + length) <= (block->offset + block->length));
 
     *block_index = block->index;
-    *chunk_index = ram_chunk_index(block->local_host_addr,
+    *chunk_index = ram_chunk_index(rdma, block->local_host_addr,
                 block->local_host_addr + (current_addr - block->offset));
 
     return 0;
@@ -1232,36 +1286,82 @@ const char *print_wrid(int wrid)
  * RDMA requires memory registration (mlock/pinning), but this is not good for
  * overcommitment.
  *
- * In preparation for the future where LRU information or workload-specific
- * writable writable working set memory access behavior is available to QEMU
- * it would be nice to have in place the ability to UN-register/UN-pin
- * particular memory regions from the RDMA hardware when it is determine that
- * those regions of memory will likely not be accessed again in the near future.
- *
- * While we do not yet have such information right now, the following
- * compile-time option allows us to perform a non-optimized version of this
- * behavior.
+ * Unless 'rdma-pin-all' is set, chunks are registered when they are first
+ * written and kept in an LRU list, the registration cache.  When the cache
+ * holds more than x-rdma-reg-cache-size, the least recently written chunk
+ * is unregistered on both sides of the connection; it is registered again
+ * if it is written later.
  *
- * By uncommenting this option, you will cause *all* RDMA transfers to be
- * unregistered immediately after the transfer completes on both sides of the
- * connection. This has no effect in 'rdma-pin-all' mode, only regular mode.
- *
- * This will have a terrible impact on migration performance, so until future
- * workload information or LRU information is available, do not attempt to use
- * this feature except for basic testing.
+ * The following compile-time option instead causes *all* RDMA transfers to
+ * be unregistered immediately after the transfer completes.  This will have
+ * a terrible impact on migration performance, do not attempt to use it
+ * except for basic testing.
  */
 //#define RDMA_UNREGISTRATION_EXAMPLE
 
 /*
- * Perform a non-optimized memory unregistration after every transfer
- * for demonstration purposes, only if pin-all is not requested.
+ * Mark a chunk as the most recently written one, adding it to the
+ * registration cache if it was not in it, or had been picked for
+ * unregistration since.
+ */
+static void qemu_rdma_reg_cache_touch(RDMAContext *rdma,
+                                      RDMALocalBlock *block, uint64_t chunk)
+{
+    RDMARegCacheEntry *entry;
+
+    if (!block->reg_cache) {
+        block->reg_cache = g_new0(RDMARegCacheEntry *, block->nb_chunks);
+    }
+
+    entry = block->reg_cache[chunk];
+    if (!entry) {
+        entry = g_new0(RDMARegCacheEntry, 1);
+        entry->index = block->index;
+        entry->chunk = chunk;
+        block->reg_cache[chunk] = entry;
+    } else if (entry->in_lru) {
+        QTAILQ_REMOVE(&rdma->reg_cache_lru, entry, next);
+        rdma->reg_cache_nr--;
+    }
+
+    QTAILQ_INSERT_TAIL(&rdma->reg_cache_lru, entry, next);
+    entry->in_lru = true;
+    rdma->reg_cache_nr++;
+}
+
+static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
+                                        uint64_t chunk, uint64_t wr_id);
+
+/*
+ * Pick the least recently written chunks for unregistration until the
+ * registration cache is back within its limit.  Unregistration itself is
+ * done later by qemu_rdma_unregister_waiting().
+ */
+static void qemu_rdma_reg_cache_evict(RDMAContext *rdma)
+{
+    while (rdma->reg_cache_max && rdma->reg_cache_nr > rdma->reg_cache_max) {
+        RDMARegCacheEntry *entry = QTAILQ_FIRST(&rdma->reg_cache_lru);
+
+        trace_qemu_rdma_reg_cache_evict(entry->index, entry->chunk,
+                                        rdma->reg_cache_nr);
+        qemu_rdma_signal_unregister(rdma, entry->index, entry->chunk,
+                                    RDMA_WRID_RDMA_WRITE);
+        if (entry->in_lru) {
+            /* The unregistration queue is full, try again later */
+            break;
+        }
+    }
+}
+
+/*
+ * Unregister the chunks that were signalled for it, when pin-all is not
+ * requested.
  *
  * Potential optimizations:
  * 1. Start a new thread to run this function continuously
         - for bit clearing
         - and for receipt of unregister messages
- * 2. Use an LRU.
- * 3. Use workload hints.
+ * 2. Use workload hints.
  */
 static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 {
@@ -1304,6 +1404,23 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 
         if (test_bit(chunk, block->transit_bitmap)) {
             trace_qemu_rdma_unregister_waiting_inflight(chunk);
+            if (block->reg_cache && block->reg_cache[chunk]) {
+                /* In use after all, make it recent again */
+                qemu_rdma_reg_cache_touch(rdma, block, chunk);
+            }
+            continue;
+        }
+
+        if (block->reg_cache && block->reg_cache[chunk]) {
+            if (block->reg_cache[chunk]->in_lru) {
+                /* Written again since it was picked, keep it */
+                continue;
+            }
+            g_free(block->reg_cache[chunk]);
+            block->reg_cache[chunk] = NULL;
+        }
+
+        if (!block->pmr || !block->pmr[chunk]) {
             continue;
         }
 
@@ -1357,8 +1474,16 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
         RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
 
         if (!test_and_set_bit(chunk, block->unregister_bitmap)) {
+            RDMARegCacheEntry *entry =
+                block->reg_cache ? block->reg_cache[chunk] : NULL;
+
             trace_qemu_rdma_signal_unregister_append(chunk,
                                                      rdma->unregister_next);
+            if (entry && entry->in_lru) {
+                QTAILQ_REMOVE(&rdma->reg_cache_lru, entry, next);
+                entry->in_lru = false;
+                rdma->reg_cache_nr--;
+            }
 
             rdma->unregistrations[rdma->unregister_next++] =
                     qemu_rdma_make_wrid(wr_id, index, chunk);
@@ -1870,34 +1995,33 @@ retry:
                             (current_addr - block->offset));
     sge.length = length;
 
-    chunk = ram_chunk_index(block->local_host_addr,
+    chunk = ram_chunk_index(rdma, block->local_host_addr,
                             (uint8_t *)(uintptr_t)sge.addr);
-    chunk_start = ram_chunk_start(block, chunk);
+    chunk_start = ram_chunk_start(rdma, block, chunk);
 
     if (block->is_ram_block) {
-        chunks = length / (1UL << RDMA_REG_CHUNK_SHIFT);
+        chunks = length >> rdma->chunk_shift;
 
-        if (chunks && ((length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
+        if (chunks && ((length & ((1UL << rdma->chunk_shift) - 1)) == 0)) {
             chunks--;
         }
     } else {
-        chunks = block->length / (1UL << RDMA_REG_CHUNK_SHIFT);
+        chunks = block->length >> rdma->chunk_shift;
 
-        if (chunks && ((block->length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
+        if (chunks &&
+            ((block->length & ((1UL << rdma->chunk_shift) - 1)) == 0)) {
             chunks--;
         }
     }
 
     trace_qemu_rdma_write_one_top(chunks + 1,
-                                  (chunks + 1) *
-                                  (1UL << RDMA_REG_CHUNK_SHIFT) / 1024 / 1024);
+                                  ((chunks + 1) << rdma->chunk_shift) /
+                                  1024 / 1024);
 
-    chunk_end = ram_chunk_end(block, chunk + chunks);
+    chunk_end = ram_chunk_end(rdma, block, chunk + chunks);
 
     if (!rdma->pin_all) {
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
         qemu_rdma_unregister_waiting(rdma);
-#endif
     }
 
     while (test_bit(chunk, block->transit_bitmap)) {
@@ -1924,10 +2048,7 @@ retry:
              * memset() + madvise() the entire chunk without RDMA.
              */
 
-            if (can_use_buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                   length)
-                   && buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                    length) == length) {
+            if (buffer_is_zero((void *)(uintptr_t)sge.addr, length)) {
                 RDMACompress comp = {
                                         .offset = current_addr,
                                         .value = 0,
@@ -1993,6 +2114,9 @@ retry:
 
             block->remote_keys[chunk] = reg_result->rkey;
             block->remote_host_addr = reg_result->host_addr;
+
+            qemu_rdma_reg_cache_touch(rdma, block, chunk);
+            qemu_rdma_reg_cache_evict(rdma);
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
@@ -2001,6 +2125,7 @@ retry:
                 error_report("cannot get lkey!");
                 return -EINVAL;
             }
+            qemu_rdma_reg_cache_touch(rdma, block, chunk);
         }
 
         send_wr.wr.rdma.rkey = block->remote_keys[chunk];
@@ -2112,7 +2237,7 @@ static inline int qemu_rdma_buffer_mergable(RDMAContext *rdma,
 
     block = &(rdma->local_ram_blocks.block[rdma->current_index]);
     host_addr = block->local_host_addr + (offset - block->offset);
-    chunk_end = ram_chunk_end(block, rdma->current_chunk);
+    chunk_end = ram_chunk_end(rdma, block, rdma->current_chunk);
 
     if (rdma->current_length == 0) {
         return 0;
@@ -2349,6 +2474,9 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    if (rdma->chunk_shift != RDMA_REG_CHUNK_SHIFT) {
+        cap.flags |= RDMA_CAPABILITY_CHUNK_SIZE | (rdma->chunk_shift << 24);
+    }
 
     caps_to_network(&cap);
 
@@ -2390,6 +2518,15 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
+    if (rdma->chunk_shift != RDMA_REG_CHUNK_SHIFT &&
+        (!(cap.flags & RDMA_CAPABILITY_CHUNK_SIZE) ||
+         RDMA_CAPABILITY_CHUNK_SHIFT(cap.flags) != rdma->chunk_shift)) {
+        error_report("Server cannot use %lu MiB RDMA chunks, using 1 MiB",
+                     (1UL << rdma->chunk_shift) >> 20);
+        rdma->chunk_shift = RDMA_REG_CHUNK_SHIFT;
+    }
+    trace_qemu_rdma_connect_chunk_size(1UL << rdma->chunk_shift);
+
     rdma_ack_cm_event(cm_event);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -2494,6 +2631,8 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         rdma = g_new0(RDMAContext, 1);
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        rdma->chunk_shift = RDMA_REG_CHUNK_SHIFT;
+        QTAILQ_INIT(&rdma->reg_cache_lru);
 
         addr = inet_parse(host_port, NULL);
         if (addr != NULL) {
@@ -2821,6 +2960,15 @@ static int qemu_rdma_accept(RDMAContext *rdma)
             goto err_rdma_dest_wait;
     }
 
+    if (cap.flags & RDMA_CAPABILITY_CHUNK_SIZE) {
+        unsigned int chunk_shift = RDMA_CAPABILITY_CHUNK_SHIFT(cap.flags);
+
+        if (chunk_shift >= RDMA_REG_CHUNK_SHIFT &&
+            chunk_shift <= RDMA_REG_CHUNK_SHIFT_MAX) {
+            rdma->chunk_shift = chunk_shift;
+        }
+    }
+
     /*
      * Respond with only the capabilities this version of QEMU knows about.
      */
@@ -2833,6 +2981,11 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
+    if (rdma->chunk_shift != RDMA_REG_CHUNK_SHIFT) {
+        cap.flags |= rdma->chunk_shift << 24;
+    } else {
+        cap.flags &= ~RDMA_CAPABILITY_CHUNK_SIZE;
+    }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
@@ -3104,12 +3257,12 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                     }
                     host_addr = (block->local_host_addr +
                                 (reg->key.current_addr - block->offset));
-                    chunk = ram_chunk_index(block->local_host_addr,
+                    chunk = ram_chunk_index(rdma, block->local_host_addr,
                                             (uint8_t *) host_addr);
                 } else {
                     chunk = reg->key.chunk;
                     host_addr = block->local_host_addr +
-                        (reg->key.chunk * (1UL << RDMA_REG_CHUNK_SHIFT));
+                        (reg->key.chunk << rdma->chunk_shift);
                     /* Check for particularly bad chunk value */
                     if (host_addr < (void *)block->local_host_addr) {
                         error_report("rdma: bad chunk for block %s"
@@ -3119,8 +3272,8 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                         goto out;
                     }
                 }
-                chunk_start = ram_chunk_start(block, chunk);
-                chunk_end = ram_chunk_end(block, chunk + reg->chunks);
+                chunk_start = ram_chunk_start(rdma, block, chunk);
+                chunk_end = ram_chunk_end(rdma, block, chunk + reg->chunks);
                 if (qemu_rdma_register_and_get_keys(rdma, block,
                             (uintptr_t)host_addr, NULL, &reg_result->rkey,
                             chunk, chunk_start, chunk_end)) {
@@ -3481,6 +3634,7 @@ void rdma_start_outgoing_migration(void *opaque,
     MigrationState *s = opaque;
     Error *local_err = NULL, **temp = &local_err;
     RDMAContext *rdma = qemu_rdma_data_init(host_port, &local_err);
+    uint64_t cache_size;
     int ret = 0;
 
     if (rdma == NULL) {
@@ -3488,6 +3642,10 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    /* Asked for at connection time, the destination may refuse */
+    rdma->chunk_shift = RDMA_REG_CHUNK_SHIFT +
+        ctz32(s->parameters[MIGRATION_PARAMETER_X_RDMA_CHUNK_SIZE]);
+
     ret = qemu_rdma_source_init(rdma, &local_err,
         s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]);
 
@@ -3504,6 +3662,11 @@ void rdma_start_outgoing_migration(void *opaque,
 
     trace_rdma_start_outgoing_migration_after_rdma_connect();
 
+    cache_size = s->parameters[MIGRATION_PARAMETER_X_RDMA_REG_CACHE_SIZE];
+    if (cache_size) {
+        rdma->reg_cache_max = MAX(1, (cache_size << 20) >> rdma->chunk_shift);
+    }
+
     s->to_dst_file = qemu_fopen_rdma(rdma, "wb");
     migrate_fd_connect(s);
     return;
@@ -47,6 +47,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
@@ -270,6 +271,8 @@ typedef struct SaveState {
     bool skip_configuration;
     uint32_t len;
     const char *name;
+    /* Estimated size of the state only sent with the VM stopped */
+    uint64_t device_state_size;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -579,6 +582,209 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
     }
 }
 
+/*
+ * Iterative device buffers
+ *
+ * A device with a large internal memory that isn't a RAMBlock registers
+ * it here so that it's copied during the live phase like RAM, rather
+ * than all at once with the VM stopped.  The device reports its writes
+ * with savevm_iter_buffer_set_dirty(); only the pages dirtied since they
+ * were last sent are left for the stop-and-copy phase.  The rest of the
+ * device state stays in its vmsd.
+ *
+ * Each section is a series of be64 words holding a page offset ORed with
+ * SAVEVM_ITER_FLAG_*, a PAGE word being followed by the page contents
+ * (shorter for the last page of a buffer that isn't a multiple of the
+ * page size), terminated by an EOS word.
+ */
+#define SAVEVM_ITER_PAGE_BITS   12
+#define SAVEVM_ITER_PAGE_SIZE   (1ULL << SAVEVM_ITER_PAGE_BITS)
+
+#define SAVEVM_ITER_FLAG_PAGE   0x1
+#define SAVEVM_ITER_FLAG_EOS    0x2
+#define SAVEVM_ITER_FLAG_MASK   (SAVEVM_ITER_PAGE_SIZE - 1)
+
+struct SaveVMIterBuffer {
+    uint8_t *buf;
+    uint64_t size;
+    long nr_pages;
+    /* One bit per page; set by the device, cleared by the migration thread */
+    unsigned long *dirty;
+    /* Where the next iteration resumes its scan */
+    long cursor;
+};
+
+void savevm_iter_buffer_set_dirty(SaveVMIterBuffer *ib, uint64_t offset,
+                                  uint64_t len)
+{
+    long first, last;
+
+    if (!len) {
+        return;
+    }
+    assert(offset + len <= ib->size);
+    first = offset >> SAVEVM_ITER_PAGE_BITS;
+    last = (offset + len - 1) >> SAVEVM_ITER_PAGE_BITS;
+    bitmap_set_atomic(ib->dirty, first, last - first + 1);
+}
+
+static void iter_buffer_put_page(QEMUFile *f, SaveVMIterBuffer *ib, long page)
+{
+    uint64_t offset = (uint64_t)page << SAVEVM_ITER_PAGE_BITS;
+
+    qemu_put_be64(f, offset | SAVEVM_ITER_FLAG_PAGE);
+    qemu_put_buffer(f, ib->buf + offset,
+                    MIN(SAVEVM_ITER_PAGE_SIZE, ib->size - offset));
+}
+
+/*
+ * Send the dirty pages, starting from the cursor; with @rate_limited,
+ * stop once the rate limit is hit.  Returns the number of pages sent.
+ */
+static long iter_buffer_send_dirty(QEMUFile *f, SaveVMIterBuffer *ib,
+                                   bool rate_limited)
+{
+    long page = ib->cursor;
+    long scanned = 0, sent = 0;
+
+    while (scanned < ib->nr_pages) {
+        page = find_next_bit(ib->dirty, ib->nr_pages, page);
+        if (page >= ib->nr_pages) {
+            /* Wrap around to the start */
+            scanned += ib->nr_pages - ib->cursor;
+            ib->cursor = page = 0;
+            continue;
+        }
+        scanned += page - ib->cursor + 1;
+        ib->cursor = page + 1;
+        /* Clear before copying, so that a concurrent write is resent */
+        if (bitmap_test_and_clear_atomic(ib->dirty, page, 1)) {
+            iter_buffer_put_page(f, ib, page);
+            sent++;
+        }
+        page++;
+        if (rate_limited && qemu_file_rate_limit(f)) {
+            break;
+        }
+    }
+    return sent;
+}
+
+static int iter_buffer_save_setup(QEMUFile *f, void *opaque)
+{
+    SaveVMIterBuffer *ib = opaque;
+
+    /* Everything has to be sent at least once */
+    bitmap_set_atomic(ib->dirty, 0, ib->nr_pages);
+    ib->cursor = 0;
+    qemu_put_be64(f, SAVEVM_ITER_FLAG_EOS);
+    return 0;
+}
+
+static int iter_buffer_save_iterate(QEMUFile *f, void *opaque)
+{
+    SaveVMIterBuffer *ib = opaque;
+    long sent = iter_buffer_send_dirty(f, ib, true);
+
+    qemu_put_be64(f, SAVEVM_ITER_FLAG_EOS);
+    return sent ? 0 : 1;
+}
+
+static int iter_buffer_save_complete(QEMUFile *f, void *opaque)
+{
+    SaveVMIterBuffer *ib = opaque;
+
+    iter_buffer_send_dirty(f, ib, false);
+    qemu_put_be64(f, SAVEVM_ITER_FLAG_EOS);
+    return 0;
+}
+
+static void iter_buffer_save_pending(QEMUFile *f, void *opaque,
+                                     uint64_t max_size,
+                                     uint64_t *non_postcopiable_pending,
+                                     uint64_t *postcopiable_pending)
+{
+    SaveVMIterBuffer *ib = opaque;
+    long page = find_first_bit(ib->dirty, ib->nr_pages);
+    uint64_t dirty = 0;
+
+    while (page < ib->nr_pages) {
+        dirty++;
+        page = find_next_bit(ib->dirty, ib->nr_pages, page + 1);
+    }
+    *non_postcopiable_pending += dirty * SAVEVM_ITER_PAGE_SIZE;
+}
+
+static int iter_buffer_load(QEMUFile *f, void *opaque, int version_id)
+{
+    SaveVMIterBuffer *ib = opaque;
+    uint64_t header, offset, len;
+    int ret;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    for (;;) {
+        header = qemu_get_be64(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            return ret;
+        }
+        if (header & SAVEVM_ITER_FLAG_EOS) {
+            return 0;
+        }
+        offset = header & ~SAVEVM_ITER_FLAG_MASK;
+        if (!(header & SAVEVM_ITER_FLAG_PAGE) || offset >= ib->size) {
+            error_report("Bad iterative buffer record 0x%" PRIx64
+                         " (size 0x%" PRIx64 ")", header, ib->size);
+            return -EINVAL;
+        }
+        len = MIN(SAVEVM_ITER_PAGE_SIZE, ib->size - offset);
+        if (qemu_get_buffer(f, ib->buf + offset, len) != len) {
+            return -EIO;
+        }
+    }
+}
+
+static const SaveVMHandlers savevm_iter_buffer_handlers = {
+    .save_live_setup = iter_buffer_save_setup,
+    .save_live_iterate = iter_buffer_save_iterate,
+    .save_live_complete_precopy = iter_buffer_save_complete,
+    .save_live_pending = iter_buffer_save_pending,
+    .load_state = iter_buffer_load,
+};
+
+/*
+ * Register @size bytes at @buf for iterative migration.  The buffer must
+ * stay allocated, at the same size, until it is unregistered.
+ */
+SaveVMIterBuffer *register_savevm_iter_buffer(DeviceState *dev,
+                                              const char *idstr,
+                                              int instance_id,
+                                              void *buf, uint64_t size)
+{
+    SaveVMIterBuffer *ib = g_new0(SaveVMIterBuffer, 1);
+    /* unregister_savevm() frees the ops */
+    SaveVMHandlers *ops = g_memdup(&savevm_iter_buffer_handlers,
+                                   sizeof(*ops));
+
+    ib->buf = buf;
+    ib->size = size;
+    ib->nr_pages = DIV_ROUND_UP(size, SAVEVM_ITER_PAGE_SIZE);
+    ib->dirty = bitmap_new(ib->nr_pages);
+    register_savevm_live(dev, idstr, instance_id, 1, ops, ib);
+    return ib;
+}
+
+void unregister_savevm_iter_buffer(DeviceState *dev, const char *idstr,
+                                   SaveVMIterBuffer *ib)
+{
+    unregister_savevm(dev, idstr, ib);
+    g_free(ib->dirty);
+    g_free(ib);
+}
+
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
                                    void *opaque, int alias_id,
@@ -897,6 +1103,31 @@ void qemu_savevm_state_header(QEMUFile *f)
 
 }
 
+/*
+ * Estimate how much the non-iterative device state will take in the
+ * stop-and-copy phase.  Only vmsd based devices are counted; the size of
+ * the old style save_state handlers can't be known without running them.
+ * Called with the iothread lock held.
+ */
+static uint64_t qemu_savevm_estimate_device_state(void)
+{
+    SaveStateEntry *se;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->vmsd || !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        total += vmstate_estimate_size(se->vmsd, se->opaque);
+    }
+    return total;
+}
+
+uint64_t qemu_savevm_device_state_size(void)
+{
+    return savevm_state.device_state_size;
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
@@ -911,6 +1142,11 @@ void qemu_savevm_state_begin(QEMUFile *f,
         se->ops->set_params(params, se->opaque);
     }
 
+    qemu_mutex_lock_iothread();
+    savevm_state.device_state_size = qemu_savevm_estimate_device_state();
+    qemu_mutex_unlock_iothread();
+    trace_savevm_device_state_size(savevm_state.device_state_size);
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_live_setup) {
             continue;
@@ -1032,11 +1268,31 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/* Account the time taken to save @se with the guest stopped */
+static void savevm_record_section_time(SaveStateEntry *se, int64_t start)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationSectionTimeList *entry, **tail = &s->stop_copy_times;
+
+    entry = g_new0(MigrationSectionTimeList, 1);
+    entry->value = g_new0(MigrationSectionTime, 1);
+    entry->value->idstr = g_strdup(se->idstr);
+    entry->value->instance_id = se->instance_id;
+    entry->value->time = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) /
+                         1000;
+    trace_savevm_section_time(se->idstr, se->instance_id,
+                              entry->value->time);
+
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = entry;
+}
+
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
@@ -1058,12 +1314,14 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        savevm_record_section_time(se, start);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return;
@@ -1074,6 +1332,24 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
+    qemu_savevm_state_complete_devices(f);
+}
+
+/*
+ * Saves the devices without live state handlers and ends the stream.
+ * Normally the last part of qemu_savevm_state_complete_precopy(); a
+ * background snapshot saves it apart, at the start of the migration.
+ */
+void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int64_t start;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    cpu_synchronize_all_states();
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1088,6 +1364,7 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         }
 
         trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
@@ -1097,6 +1374,7 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         vmstate_save(f, se, vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        savevm_record_section_time(se, start);
 
         json_end_object(vmdesc);
     }
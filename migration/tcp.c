@@ -33,14 +33,45 @@
     do { } while (0)
 #endif
 
+static void tcp_tls_outgoing_handshake(Object *src, Error *err, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(src);
+
+    if (err) {
+        error_report("migration TLS handshake failed: %s",
+                     error_get_pretty(err));
+        s->to_dst_file = NULL;
+        migrate_fd_error(s);
+    } else {
+        DPRINTF("migrate TLS handshake complete\n");
+        qio_channel_set_blocking(ioc, true, NULL);
+        s->to_dst_file = qemu_fopen_channel(ioc, "wb");
+        migrate_fd_connect(s);
+    }
+    object_unref(OBJECT(ioc));
+}
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
     MigrationState *s = opaque;
+    QIOChannelTLS *tioc;
+    Error *local_err = NULL;
 
     if (fd < 0) {
         DPRINTF("migrate connect error: %s\n", error_get_pretty(err));
         s->to_dst_file = NULL;
         migrate_fd_error(s);
+    } else if (migrate_use_tls()) {
+        DPRINTF("migrate connect success, starting TLS\n");
+        tioc = migration_tls_channel_new(fd, true, &local_err);
+        if (!tioc) {
+            error_report_err(local_err);
+            s->to_dst_file = NULL;
+            migrate_fd_error(s);
+            return;
+        }
+        qio_channel_tls_handshake(tioc, tcp_tls_outgoing_handshake, s, NULL);
     } else {
         DPRINTF("migrate connect success\n");
         s->to_dst_file = qemu_fopen_socket(fd, "wb");
@@ -50,28 +81,68 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    /* The x-multifd channels connect to the same address later on */
+    s->multifd_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+static void tcp_tls_incoming_handshake(Object *src, Error *err, gpointer opaque)
+{
+    QIOChannel *ioc = QIO_CHANNEL(src);
+
+    if (err) {
+        error_report("migration TLS handshake failed: %s",
+                     error_get_pretty(err));
+    } else {
+        DPRINTF("incoming TLS handshake complete\n");
+        process_incoming_migration(qemu_fopen_channel(ioc, "rb"));
+    }
+    object_unref(OBJECT(ioc));
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
+    QIOChannelTLS *tioc;
+    Error *local_err = NULL;
     int c;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c < 0 && errno == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(errno));
+        closesocket(s);
+        return;
+    }
+
+    if (migrate_use_multifd()) {
+        /* The RAM channels connect to the same socket; they are accepted
+         * by a separate thread, which then closes it.
+         */
+        multifd_recv_start(s);
+    } else {
+        closesocket(s);
+    }
+
+    if (migrate_use_tls()) {
+        /* The handshake runs from the main loop */
+        qemu_set_nonblock(c);
+        tioc = migration_tls_channel_new(c, false, &local_err);
+        if (!tioc) {
+            error_report_err(local_err);
+            return;
+        }
+        qio_channel_tls_handshake(tioc, tcp_tls_incoming_handshake, NULL,
+                                  NULL);
         return;
     }
 
@@ -0,0 +1,141 @@
+/*
+ * QEMU migration TLS support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A TLS session encrypts its records strictly in sequence, so a single
+ * session can't be spread over several threads.  Encryption scales with
+ * x-multifd instead: every RAM channel runs its own session, encrypted
+ * by its sender thread and decrypted by its receiver thread, while the
+ * main stream only carries device state and the page headers.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/sockets.h"
+#include "crypto/tlscreds.h"
+#include "io/channel-socket.h"
+#include "migration/migration.h"
+#include "trace.h"
+
+static QCryptoTLSCreds *
+migration_tls_get_creds(MigrationState *s, QCryptoTLSCredsEndpoint endpoint,
+                        Error **errp)
+{
+    Object *obj;
+    QCryptoTLSCreds *creds;
+
+    obj = object_resolve_path_component(object_get_objects_root(),
+                                        s->tls_creds);
+    if (!obj) {
+        error_setg(errp, "No TLS credentials with id '%s'", s->tls_creds);
+        return NULL;
+    }
+    creds = (QCryptoTLSCreds *)object_dynamic_cast(obj,
+                                                   TYPE_QCRYPTO_TLS_CREDS);
+    if (!creds) {
+        error_setg(errp, "Object with id '%s' is not TLS credentials",
+                   s->tls_creds);
+        return NULL;
+    }
+    if (creds->endpoint != endpoint) {
+        error_setg(errp, "Expected TLS credentials for a %s endpoint",
+                   endpoint == QCRYPTO_TLS_CREDS_ENDPOINT_SERVER ?
+                   "server" : "client");
+        return NULL;
+    }
+    return creds;
+}
+
+/* The name the destination's certificate is checked against */
+static char *migration_tls_hostname(MigrationState *s, Error **errp)
+{
+    InetSocketAddress *addr;
+    char *hostname;
+
+    if (s->tls_hostname && *s->tls_hostname) {
+        return g_strdup(s->tls_hostname);
+    }
+    if (!s->multifd_host_port) {
+        error_setg(errp, "No hostname available for the TLS session, "
+                   "set tls-hostname");
+        return NULL;
+    }
+    addr = inet_parse(s->multifd_host_port, errp);
+    if (!addr) {
+        return NULL;
+    }
+    hostname = g_strdup(addr->host);
+    qapi_free_InetSocketAddress(addr);
+    return hostname;
+}
+
+/*
+ * Wrap the connected socket @fd in a TLS channel, the client side on the
+ * source and the server side on the destination.  The channel owns @fd
+ * from then on, even if this fails.
+ */
+QIOChannelTLS *migration_tls_channel_new(int fd, bool is_client, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    QIOChannelSocket *sioc;
+    QIOChannelTLS *tioc = NULL;
+    QCryptoTLSCreds *creds;
+    char *hostname = NULL;
+
+    sioc = qio_channel_socket_new_fd(fd, errp);
+    if (!sioc) {
+        closesocket(fd);
+        return NULL;
+    }
+
+    if (is_client) {
+        creds = migration_tls_get_creds(s, QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
+                                        errp);
+        hostname = creds ? migration_tls_hostname(s, errp) : NULL;
+        if (hostname) {
+            tioc = qio_channel_tls_new_client(QIO_CHANNEL(sioc), creds,
+                                              hostname, errp);
+        }
+    } else {
+        creds = migration_tls_get_creds(s, QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
+                                        errp);
+        if (creds) {
+            tioc = qio_channel_tls_new_server(QIO_CHANNEL(sioc), creds,
+                                              NULL, errp);
+        }
+    }
+    trace_migration_tls_channel_new(fd, is_client, hostname ? hostname : "");
+
+    g_free(hostname);
+    object_unref(OBJECT(sioc));
+    return tioc;
+}
+
+/*
+ * The x-multifd channels do their handshake in their own threads, where
+ * it is simpler to wait for the socket than to go through the main loop.
+ */
+int migration_tls_handshake_sync(QIOChannelTLS *tioc, Error **errp)
+{
+    QCryptoTLSSession *session = qio_channel_tls_get_session(tioc);
+    QCryptoTLSSessionHandshakeStatus status;
+
+    for (;;) {
+        if (qcrypto_tls_session_handshake(session, errp) < 0) {
+            return -1;
+        }
+        status = qcrypto_tls_session_get_handshake_status(session);
+        if (status == QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
+            break;
+        }
+        qio_channel_wait(tioc->master,
+                         status == QCRYPTO_TLS_HANDSHAKE_SENDING ?
+                         G_IO_OUT : G_IO_IN);
+    }
+    return qcrypto_tls_session_check_credentials(session, errp);
+}
@@ -50,6 +50,88 @@ static int vmstate_size(void *opaque, VMStateField *field)
     return size;
 }
 
+/*
+ * Arrays of plain integers are sent as one big-endian buffer, which is
+ * exactly what their VMStateInfo would put one element at a time.
+ * Returns the element width if @field can be copied that way, 0 if it
+ * has to go through its VMStateInfo.
+ */
+static int vmstate_bulk_width(VMStateField *field, int n_elems, int size)
+{
+    const VMStateInfo *info = field->info;
+    int width;
+
+    /* Dynamically existing fields are described element by element */
+    if (n_elems < 2 || field->field_exists ||
+        (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER))) {
+        return 0;
+    }
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+    return size == width ? width : 0;
+}
+
+static void vmstate_bulk_swap(void *p, int n_elems, int width)
+{
+    int i;
+
+    for (i = 0; i < n_elems; i++) {
+        switch (width) {
+        case 2:
+            be16_to_cpus((uint16_t *)p + i);
+            break;
+        case 4:
+            be32_to_cpus((uint32_t *)p + i);
+            break;
+        case 8:
+            be64_to_cpus((uint64_t *)p + i);
+            break;
+        }
+    }
+}
+
+static void vmstate_bulk_put(QEMUFile *f, void *base, int n_elems, int width)
+{
+    uint64_t tmp[64];
+    int chunk;
+
+    if (width == 1) {
+        qemu_put_buffer(f, base, n_elems);
+        return;
+    }
+    while (n_elems) {
+        chunk = MIN(n_elems, sizeof(tmp) / width);
+        memcpy(tmp, base, chunk * width);
+        /* the swap is its own inverse */
+        vmstate_bulk_swap(tmp, chunk, width);
+        qemu_put_buffer(f, (uint8_t *)tmp, chunk * width);
+        base += chunk * width;
+        n_elems -= chunk;
+    }
+}
+
+static int vmstate_bulk_get(QEMUFile *f, void *base, int n_elems, int width)
+{
+    size_t len = (size_t)n_elems * width;
+
+    if (qemu_get_buffer(f, base, len) != len) {
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    if (width > 1) {
+        vmstate_bulk_swap(base, n_elems, width);
+    }
+    return 0;
+}
+
 static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
 {
     void *base_addr = opaque + field->offset;
@@ -111,7 +193,17 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *base_addr = vmstate_base_addr(opaque, field, true);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int width = vmstate_bulk_width(field, n_elems, size);
 
+            if (width) {
+                ret = vmstate_bulk_get(f, base_addr, n_elems, width);
+                if (ret < 0) {
+                    qemu_file_set_error(f, ret);
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -291,6 +383,54 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
     return true;
 }
 
+/*
+ * Roughly how many bytes vmstate_save_state() would put for @opaque right
+ * now.  pre_save isn't run, so fields that it fills in are counted with
+ * whatever size they currently have; section and subsection headers
+ * aren't counted at all.  Good enough to tell a few hundred bytes of
+ * registers from megabytes of device memory.
+ */
+uint64_t vmstate_estimate_size(const VMStateDescription *vmsd, void *opaque)
+{
+    VMStateField *field = vmsd->fields;
+    const VMStateDescription **sub = vmsd->subsections;
+    uint64_t total = 0;
+
+    while (field->name) {
+        if (!field->field_exists ||
+            field->field_exists(opaque, vmsd->version_id)) {
+            void *base_addr = vmstate_base_addr(opaque, field, false);
+            int i, n_elems = vmstate_n_elems(opaque, field);
+            int size = vmstate_size(opaque, field);
+
+            if (!(field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER))) {
+                total += (uint64_t)n_elems * size;
+            } else {
+                for (i = 0; i < n_elems; i++) {
+                    void *addr = base_addr + size * i;
+
+                    if (field->flags & VMS_ARRAY_OF_POINTER) {
+                        addr = *(void **)addr;
+                    }
+                    if (!(field->flags & VMS_STRUCT)) {
+                        total += size;
+                    } else if (addr) {
+                        total += vmstate_estimate_size(field->vmsd, addr);
+                    }
+                }
+            }
+        }
+        field++;
+    }
+
+    while (sub && *sub && (*sub)->needed) {
+        if ((*sub)->needed(opaque)) {
+            total += vmstate_estimate_size(*sub, opaque);
+        }
+        sub++;
+    }
+    return total;
+}
 
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
@@ -313,9 +453,17 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *base_addr = vmstate_base_addr(opaque, field, false);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int width = vmstate_bulk_width(field, n_elems, size);
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
 
+            if (width) {
+                /* Described like a compressed array, by its first element */
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmstate_bulk_put(f, base_addr, n_elems, width);
+                vmsd_desc_field_end(vmsd, vmdesc, field, width, 0);
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
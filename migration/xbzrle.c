@@ -12,6 +12,8 @@
  */
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/host-cpuinfo.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,16 +26,24 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+/*
+ * The encoder only needs two primitives: find the end of a zero run (the
+ * first byte at or after @i that differs) and the end of a non-zero run
+ * (the first byte at or after @i that is unchanged).  They are provided
+ * in a portable word-at-a-time flavour and in vector flavours, selected
+ * at runtime; all of them produce exactly the same encoding.
+ */
+typedef int (*XbzrleScanFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen);
+
+static inline __attribute__((always_inline))
+int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen,
+                  XbzrleScanFn find_diff, XbzrleScanFn find_same)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, j;
 
     while (i < slen) {
         /* overflow */
@@ -41,28 +51,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        j = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
+        i = j;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,56 +67,342 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        j = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = j;
     }
 
     return d;
 }
 
+static inline int find_diff_int(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static inline int find_same_int(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+static int xbzrle_encode_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_diff_int, find_same_int);
+}
+
+/* Byte loops for the tails of the vector versions */
+static inline int find_diff_tail(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int find_same_tail(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+typedef struct XbzrleAccel {
+    unsigned flag;
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int);
+} XbzrleAccel;
+
+#if defined(__SSE2__) || defined(CPUINFO_AVX2_OPT)
+#ifdef CPUINFO_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static inline int find_diff_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(new_buf + i));
+        unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(new_buf + i));
+        unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_diff_sse2, find_same_sse2);
+}
+
+#ifdef CPUINFO_AVX2_OPT
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int find_diff_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_diff_avx2, find_same_avx2);
+}
+#pragma GCC pop_options
+#endif /* CPUINFO_AVX2_OPT */
+
+#define CACHE_SSE2    CPUINFO_SSE2
+#define CACHE_AVX2    CPUINFO_AVX2
+
+static unsigned get_cpuid_cache(void)
+{
+    return host_cpuinfo();
+}
+
+static const XbzrleAccel xbzrle_accel[] = {
+#ifdef CPUINFO_AVX2_OPT
+    { CACHE_AVX2, xbzrle_encode_avx2 },
+#endif
+    { CACHE_SSE2, xbzrle_encode_sse2 },
+};
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/*
+ * NEON has no movemask; narrowing the comparison result by 4 bits gives a
+ * 64-bit mask with a nibble per byte.
+ */
+static inline uint64_t neon_eq_mask(const uint8_t *a, const uint8_t *b)
+{
+    uint8x16_t eq = vceqq_u8(vld1q_u8(a), vld1q_u8(b));
+
+    return vget_lane_u64(vreinterpret_u64_u8(
+                         vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static inline int find_diff_neon(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint64_t eq = neon_eq_mask(old_buf + i, new_buf + i);
+
+        if (eq != ~0ULL) {
+            return i + ctz64(~eq) / 4;
+        }
+    }
+    return find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int find_same_neon(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint64_t eq = neon_eq_mask(old_buf + i, new_buf + i);
+
+        if (eq) {
+            return i + ctz64(eq) / 4;
+        }
+    }
+    return find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_neon(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_diff_neon, find_same_neon);
+}
+
+/* Advanced SIMD is mandatory on AArch64.  */
+#define CACHE_NEON    1
+
+static unsigned get_cpuid_cache(void)
+{
+    return CACHE_NEON;
+}
+
+static const XbzrleAccel xbzrle_accel[] = {
+    { CACHE_NEON, xbzrle_encode_neon },
+};
+#else
+static unsigned get_cpuid_cache(void)
+{
+    return 0;
+}
+
+static const XbzrleAccel xbzrle_accel[] = {
+    { 0, xbzrle_encode_int },
+};
+#endif
+
+static unsigned cpuid_cache;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = xbzrle_encode_int;
+
+static void init_accel(unsigned cache)
+{
+    int i;
+
+    xbzrle_encode_accel = xbzrle_encode_int;
+    for (i = 0; i < ARRAY_SIZE(xbzrle_accel); i++) {
+        if (cache & xbzrle_accel[i].flag) {
+            xbzrle_encode_accel = xbzrle_accel[i].fn;
+            break;
+        }
+    }
+}
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    cpuid_cache = get_cpuid_cache();
+    init_accel(cpuid_cache);
+}
+
+/*
+ * Lets tests/test-xbzrle cover every encoder: switches to the next slower
+ * one, or back to the best one (returning false) after the portable
+ * encoder.
+ */
+bool test_xbzrle_next_accel(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbzrle_accel); i++) {
+        if (cpuid_cache & xbzrle_accel[i].flag) {
+            cpuid_cache &= ~xbzrle_accel[i].flag;
+            init_accel(cpuid_cache);
+            return true;
+        }
+    }
+    init_xbzrle_accel();
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -334,11 +334,11 @@ void monitor_flush(Monitor *mon)
 }
 
 /* flush at every end of line */
-static void monitor_puts(Monitor *mon, const char *str)
+/* Called with mon->out_lock held.  */
+static void monitor_puts_locked(Monitor *mon, const char *str)
 {
     char c;
 
-    qemu_mutex_lock(&mon->out_lock);
     for(;;) {
         c = *str++;
         if (c == '\0')
@@ -351,6 +351,12 @@ static void monitor_puts(Monitor *mon, const char *str)
             monitor_flush_locked(mon);
         }
     }
+}
+
+static void monitor_puts(Monitor *mon, const char *str)
+{
+    qemu_mutex_lock(&mon->out_lock);
+    monitor_puts_locked(mon, str);
     qemu_mutex_unlock(&mon->out_lock);
 }
 
@@ -387,18 +393,27 @@ int monitor_fprintf(FILE *stream, const char *fmt, ...)
     return 0;
 }
 
-static void monitor_json_emitter(Monitor *mon, const QObject *data)
+/* Called with mon->out_lock held.  */
+static void monitor_json_flush(void *opaque, const char *str)
 {
-    QString *json;
-
-    json = mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
-                                             qobject_to_json(data);
-    assert(json != NULL);
+    Monitor *mon = opaque;
 
-    qstring_append_chr(json, '\n');
-    monitor_puts(mon, qstring_get_str(json));
+    monitor_puts_locked(mon, str);
+    monitor_flush_locked(mon);
+}
 
-    QDECREF(json);
+/* The reply is written to the output buffer as it is serialized, so that
+ * large replies need neither a second copy of the whole text nor a
+ * character by character copy of it.  out_lock is held throughout so that
+ * events from other threads cannot be interleaved with the reply.
+ */
+static void monitor_json_emitter(Monitor *mon, const QObject *data)
+{
+    qemu_mutex_lock(&mon->out_lock);
+    qobject_to_json_stream(data, mon->flags & MONITOR_USE_PRETTY,
+                           monitor_json_flush, mon);
+    monitor_puts_locked(mon, "\n");
+    qemu_mutex_unlock(&mon->out_lock);
 }
 
 static QDict *build_qmp_error_dict(Error *err)
@@ -902,9 +917,14 @@ static void hmp_trace_event(Monitor *mon, const QDict *qdict)
 {
     const char *tp_name = qdict_get_str(qdict, "name");
     bool new_state = qdict_get_bool(qdict, "option");
+    bool has_sample = qdict_haskey(qdict, "sample");
+    bool has_rate = qdict_haskey(qdict, "rate");
     Error *local_err = NULL;
 
-    qmp_trace_event_set_state(tp_name, new_state, true, true, &local_err);
+    qmp_trace_event_set_state(tp_name, new_state, true, true,
+                              has_sample, qdict_get_try_int(qdict, "sample", 0),
+                              has_rate, qdict_get_try_int(qdict, "rate", 0),
+                              &local_err);
     if (local_err) {
         error_report_err(local_err);
     }
@@ -988,7 +1008,14 @@ EventInfoList *qmp_query_events(Error **errp)
 static void qmp_query_qmp_schema(QDict *qdict, QObject **ret_data,
                                  Error **errp)
 {
-    *ret_data = qobject_from_json(qmp_schema_json);
+    static QObject *schema;
+
+    /* The schema never changes, so parse it only once */
+    if (!schema) {
+        schema = qobject_from_json(qmp_schema_json);
+    }
+    qobject_incref(schema);
+    *ret_data = schema;
 }
 
 /* set the current CPU defined by the user */
@@ -1488,7 +1515,9 @@ static void hmp_boot_set(Monitor *mon, const QDict *qdict)
 
 static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
 {
-    mtree_info((fprintf_function)monitor_printf, mon);
+    bool profile = qdict_get_try_bool(qdict, "profile", false);
+
+    mtree_info((fprintf_function)monitor_printf, mon, profile);
 }
 
 static void hmp_info_numa(Monitor *mon, const QDict *qdict)
@@ -250,6 +250,167 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     return 0;
 }
 
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const void *data,
+                                   Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t be_opt = cpu_to_be32(opt);
+    uint32_t be_len = cpu_to_be32(len);
+
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -1;
+    }
+    if (write_sync(ioc, &be_opt, sizeof(be_opt)) != sizeof(be_opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -1;
+    }
+    if (write_sync(ioc, &be_len, sizeof(be_len)) != sizeof(be_len)) {
+        error_setg(errp, "Failed to send option length");
+        return -1;
+    }
+    if (len && write_sync(ioc, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the header of the reply to option @opt.  The @len bytes of payload
+ * are left for the caller to read.
+ */
+static int nbd_receive_option_reply(QIOChannel *ioc, uint32_t opt,
+                                    uint32_t *type, uint32_t *len,
+                                    Error **errp)
+{
+    uint64_t magic;
+    uint32_t reply_opt;
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "failed to read option magic");
+        return -1;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &reply_opt, sizeof(reply_opt)) != sizeof(reply_opt)) {
+        error_setg(errp, "failed to read option");
+        return -1;
+    }
+    reply_opt = be32_to_cpu(reply_opt);
+    if (reply_opt != opt) {
+        error_setg(errp, "Unexpected option type %x expected %x",
+                   reply_opt, opt);
+        return -1;
+    }
+    if (read_sync(ioc, type, sizeof(*type)) != sizeof(*type)) {
+        error_setg(errp, "failed to read option type");
+        return -1;
+    }
+    *type = be32_to_cpu(*type);
+    if (read_sync(ioc, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask for structured replies and, if the server supports them, for the
+ * "base:allocation" metadata context of export @name.  Extensions that are
+ * not available are cleared in @ext.
+ */
+static int nbd_negotiate_extensions(QIOChannel *ioc, const char *name,
+                                    NBDExtensions *ext, Error **errp)
+{
+    uint32_t type, len;
+
+    if (ext->structured_reply) {
+        TRACE("Requesting structured replies");
+        if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                    errp) < 0 ||
+            nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY,
+                                     &type, &len, errp) < 0) {
+            return -1;
+        }
+        if (nbd_drop(ioc, len) != len) {
+            error_setg(errp, "failed to read option reply");
+            return -1;
+        }
+        ext->structured_reply = type == NBD_REP_ACK;
+    }
+
+    if (ext->base_allocation && ext->structured_reply) {
+        const char *query = NBD_META_BASE_ALLOCATION;
+        uint32_t name_len = strlen(name);
+        uint32_t query_len = strlen(query);
+        uint32_t data_len = 4 + name_len + 4 + 4 + query_len;
+        uint8_t *data = g_malloc(data_len);
+        int ret;
+
+        stl_be_p(data, name_len);
+        memcpy(data + 4, name, name_len);
+        stl_be_p(data + 4 + name_len, 1);
+        stl_be_p(data + 8 + name_len, query_len);
+        memcpy(data + 12 + name_len, query, query_len);
+
+        TRACE("Requesting metadata context '%s'", query);
+        ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT,
+                                      data_len, data, errp);
+        g_free(data);
+        if (ret < 0) {
+            return -1;
+        }
+
+        /* The server sends one NBD_REP_META_CONTEXT reply for each selected
+         * context, followed by NBD_REP_ACK; or a single error reply.
+         */
+        ext->base_allocation = false;
+        while (1) {
+            char *buf;
+
+            if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT,
+                                         &type, &len, errp) < 0) {
+                return -1;
+            }
+            if (type != NBD_REP_META_CONTEXT) {
+                if (nbd_drop(ioc, len) != len) {
+                    error_setg(errp, "failed to read option reply");
+                    return -1;
+                }
+                break;
+            }
+            if (len < 4 || len > 4 + 255) {
+                error_setg(errp, "Invalid metadata context reply length %u",
+                           len);
+                return -1;
+            }
+
+            buf = g_malloc(len + 1);
+            if (read_sync(ioc, buf, len) != len) {
+                error_setg(errp, "failed to read metadata context");
+                g_free(buf);
+                return -1;
+            }
+            buf[len] = '\0';
+            if (!strcmp(buf + 4, query)) {
+                ext->base_allocation = true;
+                ext->meta_context_id = ldl_be_p(buf);
+            }
+            g_free(buf);
+        }
+    } else {
+        ext->base_allocation = false;
+    }
+
+    TRACE("Structured replies %s, base:allocation %s",
+          ext->structured_reply ? "on" : "off",
+          ext->base_allocation ? "on" : "off");
+    return 0;
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -352,10 +513,11 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
+    NBDExtensions want = { 0 };
     int rc;
 
     TRACE("Receiving negotiation tlscreds=%p hostname=%s.",
@@ -370,6 +532,10 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
     }
+    if (ext) {
+        want = *ext;
+        memset(ext, 0, sizeof(*ext));
+    }
 
     if (read_sync(ioc, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -458,6 +624,12 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint32_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (ext) {
+                *ext = want;
+                if (nbd_negotiate_extensions(ioc, name, ext, errp) < 0) {
+                    goto fail;
+                }
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -649,33 +821,106 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
     return 0;
 }
 
+/* Read the payload of an error chunk, which is consumed here so that the
+ * caller only has to look at reply->error.
+ */
+static ssize_t nbd_receive_error_chunk(QIOChannel *ioc,
+                                       struct nbd_reply *reply)
+{
+    uint8_t buf[4 + 2];
+    uint32_t error;
+    ssize_t ret;
+
+    /* Error chunk
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length
+       [ 6 ..  xx]   message, followed by the offset for ERROR_OFFSET
+     */
+    if (reply->length < sizeof(buf)) {
+        LOG("invalid error chunk length %u", reply->length);
+        return -EINVAL;
+    }
+    if (read_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed");
+        return -EINVAL;
+    }
+    ret = nbd_drop(ioc, reply->length - sizeof(buf));
+    if (ret != reply->length - sizeof(buf)) {
+        return ret < 0 ? ret : -EINVAL;
+    }
+
+    error = nbd_errno_to_system_errno(ldl_be_p(buf));
+    reply->error = error ? error : EINVAL;
+    reply->length = 0;
+    return 0;
+}
+
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = be32_to_cpup((uint32_t*)buf);
+    reply->magic = magic;
+
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                        NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return ret < 0 ? ret : -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error = 0;
+        reply->flags = lduw_be_p(buf + 4);
+        reply->type = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got chunk: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64 ", "
+              ".length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+
+        if (reply->type & NBD_REPLY_TYPE_ERROR_BIT) {
+            return nbd_receive_error_chunk(ioc, reply);
+        }
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = be32_to_cpup((uint32_t*)buf);
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
     reply->error = nbd_errno_to_system_errno(reply->error);
+    reply->structured = false;
+    reply->flags = NBD_REPLY_FLAG_DONE;
+    reply->type = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
@@ -76,6 +76,26 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
     return done;
 }
 
+/* Discard @size bytes from the channel */
+ssize_t nbd_drop(QIOChannel *ioc, size_t size)
+{
+    ssize_t ret, dropped = size;
+    uint8_t *buffer = g_malloc(MIN(65536, size));
+
+    while (size > 0) {
+        ret = read_sync(ioc, buffer, MIN(65536, size));
+        if (ret <= 0) {
+            g_free(buffer);
+            return ret < 0 ? ret : -EIO;
+        }
+
+        assert(ret <= size);
+        size -= ret;
+    }
+
+    g_free(buffer);
+    return dropped;
+}
 
 void nbd_tls_handshake(Object *src,
                        Error *err,
@@ -19,6 +19,10 @@
 #include "qemu/osdep.h"
 #include "nbd-internal.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -88,6 +92,11 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;
+    /* Export for which "base:allocation" was selected */
+    char *meta_export;
+    bool base_allocation;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -189,12 +198,12 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%x type=%x", type, opt);
+    TRACE("Reply opt=%x type=%x len=%u", type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -211,7 +220,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -219,6 +228,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -282,6 +296,7 @@ static int nbd_negotiate_handle_list(NBDClient *client, uint32_t length)
 
 static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
 {
+    AioContext *ctx;
     int rc = -EINVAL;
     char name[256];
 
@@ -307,13 +322,173 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
         goto fail;
     }
 
+    /* The metadata context is only valid for the export it was set for */
+    if (client->base_allocation && strcmp(client->meta_export, name)) {
+        client->base_allocation = false;
+    }
+
+    ctx = blk_get_aio_context(client->exp->blk);
+    aio_context_acquire(ctx);
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
+    aio_context_release(ctx);
     rc = 0;
 fail:
     return rc;
 }
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Using structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+    uint32_t be_id = cpu_to_be32(id);
+
+    if (nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                   sizeof(be_id) + len) < 0) {
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, &be_id, sizeof(be_id)) != sizeof(be_id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The only
+ * context that we know about is "base:allocation", with id 0.
+ */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    char name[256], query[256];
+    uint32_t len, nb_queries, i;
+    bool base_allocation = false;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        for each query:
+        [ 0 ..   3]   query length
+        [ 4 ..  xx]   query
+     */
+    if (!client->structured_reply || length < 2 * sizeof(len)) {
+        goto invalid;
+    }
+
+    if (nbd_negotiate_read(client->ioc, &len, sizeof(len)) != sizeof(len)) {
+        LOG("read failed");
+        return -EIO;
+    }
+    length -= sizeof(len);
+    len = be32_to_cpu(len);
+    if (len > 255 || len > length - sizeof(nb_queries)) {
+        goto invalid;
+    }
+    if (nbd_negotiate_read(client->ioc, name, len) != len) {
+        LOG("read failed");
+        return -EIO;
+    }
+    length -= len;
+    name[len] = '\0';
+
+    if (nbd_negotiate_read(client->ioc, &nb_queries, sizeof(nb_queries)) !=
+        sizeof(nb_queries)) {
+        LOG("read failed");
+        return -EIO;
+    }
+    length -= sizeof(nb_queries);
+    nb_queries = be32_to_cpu(nb_queries);
+
+    for (i = 0; i < nb_queries; i++) {
+        if (length < sizeof(len)) {
+            goto invalid;
+        }
+        if (nbd_negotiate_read(client->ioc, &len, sizeof(len)) !=
+            sizeof(len)) {
+            LOG("read failed");
+            return -EIO;
+        }
+        length -= sizeof(len);
+        len = be32_to_cpu(len);
+        if (len > length) {
+            goto invalid;
+        }
+        if (len > 255) {
+            /* Longer than any context we know about */
+            if (nbd_negotiate_drop_sync(client->ioc, len) != len) {
+                return -EIO;
+            }
+            length -= len;
+            continue;
+        }
+        if (nbd_negotiate_read(client->ioc, query, len) != len) {
+            LOG("read failed");
+            return -EIO;
+        }
+        length -= len;
+        query[len] = '\0';
+
+        TRACE("Client queried metadata context '%s'", query);
+        if (!strcmp(query, NBD_META_BASE_ALLOCATION) ||
+            (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(query, "base:"))) {
+            base_allocation = true;
+        }
+    }
+    if (length) {
+        goto invalid;
+    }
+
+    /* Listing without queries returns all contexts */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && nb_queries == 0) {
+        base_allocation = true;
+    }
+
+    if (!nbd_export_find(name)) {
+        TRACE("Export '%s' not found", name);
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNKNOWN, opt);
+    }
+
+    if (base_allocation &&
+        nbd_negotiate_send_meta_context(client->ioc, opt, 0,
+                                        NBD_META_BASE_ALLOCATION) < 0) {
+        return -EINVAL;
+    }
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        g_free(client->meta_export);
+        client->meta_export = g_strdup(name);
+        client->base_allocation = base_allocation;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
 
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
@@ -465,6 +640,22 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_ABORT:
                 return -EINVAL;
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
@@ -512,8 +703,12 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush on one
+     * connection also covers the writes done on the others.
+     */
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -574,7 +769,8 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
 
         assert ((client->exp->nbdflags & ~65535) == 0);
         stq_be_p(buf + 18, client->exp->size);
-        stw_be_p(buf + 26, client->exp->nbdflags | myflags);
+        stw_be_p(buf + 26, client->exp->nbdflags | myflags |
+                 (client->structured_reply ? NBD_FLAG_SEND_DF : 0));
         if (nbd_negotiate_write(client->ioc, buf + 18, sizeof(buf) - 18) !=
             sizeof(buf) - 18) {
             LOG("write failed");
@@ -699,6 +895,7 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsaclname);
+        g_free(client->meta_export);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -952,6 +1149,369 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                               unsigned niov)
+{
+    size_t size = iov_size(iov, niov);
+    ssize_t ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    ret = nbd_wr_syncv(client->ioc, iov, niov, 0, size, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    if (ret >= 0 && ret != size) {
+        LOG("writing to socket failed");
+        ret = -EIO;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+/* Return the host file descriptor from which reads for @client can be sent
+ * without copying the data through a bounce buffer, or -1.  This needs the
+ * data to go to the socket unmodified, i.e. no TLS.
+ */
+static int nbd_client_host_fd(NBDClient *client)
+{
+    BlockDriverState *bs = blk_bs(client->exp->blk);
+    int fd;
+
+    if (client->ioc != QIO_CHANNEL(client->sioc) || !bs) {
+        return -1;
+    }
+    fd = bdrv_get_host_fd(bs);
+    return fd < 0 ? -1 : fd;
+}
+
+/* Send @hdr followed by @len bytes of @fd at @offset.  The data is sent with
+ * sendfile() if possible; otherwise, and for the part beyond the end of the
+ * file, it is read into @buf, which must have room for @len bytes.
+ */
+static ssize_t nbd_co_send_from_fd(NBDClient *client, void *hdr,
+                                   size_t hdr_len, int fd, off_t offset,
+                                   uint32_t len, uint8_t *buf)
+{
+    bool copy = false;
+    ssize_t ret = 0;
+    ssize_t n;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+    qio_channel_set_cork(client->ioc, true);
+
+    if (write_sync(client->ioc, hdr, hdr_len) != hdr_len) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (len > 0) {
+        if (!copy) {
+#ifdef CONFIG_SENDFILE
+            n = sendfile(client->sioc->fd, fd, &offset, len);
+#else
+            n = -1;
+            errno = ENOSYS;
+#endif
+            if (n > 0) {
+                len -= n;
+                continue;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                qemu_coroutine_yield();
+                continue;
+            }
+            /* End of file, or sendfile() does not work for this file */
+            copy = true;
+        }
+
+        n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            LOG("reading from file failed");
+            ret = -EIO;
+            goto out;
+        } else if (n == 0) {
+            /* Like the block layer, read zeroes after the end of the file */
+            memset(buf, 0, len);
+            n = len;
+        }
+        if (write_sync(client->ioc, buf, n) != n) {
+            ret = -EIO;
+            goto out;
+        }
+        offset += n;
+        len -= n;
+    }
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret;
+}
+
+static ssize_t nbd_co_send_simple_read_fd(NBDClient *client, uint64_t handle,
+                                          int fd, off_t offset, uint32_t len,
+                                          uint8_t *buf)
+{
+    uint8_t hdr[NBD_REPLY_SIZE];
+
+    stl_be_p(hdr, NBD_REPLY_MAGIC);
+    stl_be_p(hdr + 4, 0);
+    stq_be_p(hdr + 8, handle);
+    return nbd_co_send_from_fd(client, hdr, sizeof(hdr), fd, offset, len, buf);
+}
+
+static void nbd_set_chunk_header(uint8_t *buf, uint16_t flags, uint16_t type,
+                                 uint64_t handle, uint32_t length)
+{
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
+}
+
+static ssize_t nbd_co_send_structured_none(NBDClient *client, uint64_t handle)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    nbd_set_chunk_header(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                         handle, 0);
+    return nbd_co_send_iov(client, &iov, 1);
+}
+
+static ssize_t nbd_co_send_structured_error(NBDClient *client,
+                                            uint64_t handle, int error)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 4 + 2];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    nbd_set_chunk_header(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+                         handle, 4 + 2);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE,
+             system_errno_to_nbd_errno(error));
+    stw_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 4, 0);    /* no message */
+    return nbd_co_send_iov(client, &iov, 1);
+}
+
+static ssize_t nbd_co_send_structured_data(NBDClient *client, uint64_t handle,
+                                           uint64_t offset, void *data,
+                                           uint32_t len, bool final)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 8];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = data, .iov_len = len },
+    };
+
+    nbd_set_chunk_header(buf, final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_DATA, handle, 8 + len);
+    stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+    return nbd_co_send_iov(client, iov, 2);
+}
+
+static ssize_t nbd_co_send_structured_data_fd(NBDClient *client,
+                                              uint64_t handle, uint64_t offset,
+                                              int fd, off_t fd_offset,
+                                              uint32_t len, bool final,
+                                              uint8_t *buf)
+{
+    uint8_t hdr[NBD_STRUCTURED_REPLY_SIZE + 8];
+
+    nbd_set_chunk_header(hdr, final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_DATA, handle, 8 + len);
+    stq_be_p(hdr + NBD_STRUCTURED_REPLY_SIZE, offset);
+    return nbd_co_send_from_fd(client, hdr, sizeof(hdr), fd, fd_offset, len,
+                               buf);
+}
+
+static ssize_t nbd_co_send_structured_hole(NBDClient *client, uint64_t handle,
+                                           uint64_t offset, uint32_t len,
+                                           bool final)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 8 + 4];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    nbd_set_chunk_header(buf, final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_HOLE, handle, 8 + 4);
+    stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 8, len);
+    return nbd_co_send_iov(client, &iov, 1);
+}
+
+/* Reply to a read with a structured reply in which areas that read as zero
+ * are sent as holes, without reading them from the image.  Errors of the
+ * block layer are reported to the client; a negative return value means that
+ * the reply could not be sent.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    int fd = nbd_client_host_fd(client);
+    uint32_t offset = 0;
+    ssize_t ret;
+
+    while (nb_sectors > 0) {
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t len;
+        bool final;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum, &file);
+        if (status < 0 || pnum <= 0) {
+            /* Just read the rest */
+            status = BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+        len = pnum * BDRV_SECTOR_SIZE;
+        final = pnum == nb_sectors;
+
+        if (status & BDRV_BLOCK_ZERO) {
+            TRACE("Hole of %u byte(s)", len);
+            ret = nbd_co_send_structured_hole(client, request->handle,
+                                              request->from + offset, len,
+                                              final);
+        } else if (fd >= 0) {
+            TRACE("Sending %u byte(s) from the host file", len);
+            ret = nbd_co_send_structured_data_fd(client, request->handle,
+                                                 request->from + offset, fd,
+                                                 sector_num * BDRV_SECTOR_SIZE,
+                                                 len, final,
+                                                 req->data + offset);
+        } else {
+            ret = blk_read(exp->blk, sector_num, req->data + offset, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(client, request->handle,
+                                                    -ret);
+            }
+            TRACE("Read %u byte(s)", len);
+            ret = nbd_co_send_structured_data(client, request->handle,
+                                              request->from + offset,
+                                              req->data + offset, len, final);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+        offset += len;
+        if (final) {
+            return 0;
+        }
+    }
+
+    return nbd_co_send_structured_none(client, request->handle);
+}
+
+/* Maximum number of descriptors in a block status reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
+
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    unsigned max_extents, nb_extents = 0;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 4];
+    NBDExtent *extents;
+    struct iovec iov[2];
+    ssize_t ret;
+    unsigned i;
+
+    max_extents = (request->type & NBD_CMD_FLAG_REQ_ONE) ?
+                  1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    extents = g_new(NBDExtent, max_extents);
+
+    while (nb_sectors > 0) {
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum, &file);
+        if (status < 0) {
+            LOG("block status failed");
+            g_free(extents);
+            return nbd_co_send_structured_error(client, request->handle,
+                                                -status);
+        }
+        if (pnum <= 0) {
+            break;
+        }
+
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += pnum * BDRV_SECTOR_SIZE;
+        } else if (nb_extents < max_extents) {
+            extents[nb_extents].length = pnum * BDRV_SECTOR_SIZE;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        } else {
+            break;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    if (!nb_extents) {
+        g_free(extents);
+        return nbd_co_send_structured_error(client, request->handle, EINVAL);
+    }
+
+    for (i = 0; i < nb_extents; i++) {
+        extents[i].length = cpu_to_be32(extents[i].length);
+        extents[i].flags = cpu_to_be32(extents[i].flags);
+    }
+
+    nbd_set_chunk_header(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                         request->handle,
+                         4 + nb_extents * sizeof(NBDExtent));
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, 0);        /* context id */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = extents;
+    iov[1].iov_len = nb_extents * sizeof(NBDExtent);
+
+    ret = nbd_co_send_iov(client, iov, 2);
+    g_free(extents);
+    return ret;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1021,6 +1581,7 @@ static void nbd_trip(void *opaque)
     struct nbd_reply reply;
     ssize_t ret;
     uint32_t command;
+    int fd;
 
     TRACE("Reading request.");
     if (client->closing) {
@@ -1038,12 +1599,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1074,6 +1635,37 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply && !(request.type & NBD_CMD_FLAG_DF)) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        fd = nbd_client_host_fd(client);
+        if (fd >= 0) {
+            /* Zero-copy path, the data goes from the page cache right to
+             * the socket */
+            TRACE("Sending %u byte(s) from the host file", request.len);
+            if (client->structured_reply) {
+                ret = nbd_co_send_structured_data_fd(client, request.handle,
+                                                     request.from, fd,
+                                                     request.from +
+                                                     exp->dev_offset,
+                                                     request.len, true,
+                                                     req->data);
+            } else {
+                ret = nbd_co_send_simple_read_fd(client, request.handle, fd,
+                                                 request.from +
+                                                 exp->dev_offset,
+                                                 request.len, req->data);
+            }
+            if (ret < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1084,8 +1676,16 @@ static void nbd_trip(void *opaque)
         }
 
         TRACE("Read %u byte(s)", request.len);
-        if (nbd_co_send_reply(req, &reply, request.len) < 0)
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_data(client, request.handle,
+                                              request.from, req->data,
+                                              request.len, true);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, request.len);
+        }
+        if (ret < 0) {
             goto out;
+        }
         break;
     case NBD_CMD_WRITE:
         TRACE("Request type is WRITE");
@@ -1149,12 +1749,32 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation) {
+            TRACE("No metadata context selected");
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* Reads and block status queries must be answered with a structured
+         * reply once it has been negotiated.
+         */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(client, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1227,20 +1847,38 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     NBDClientNewData *data = opaque;
     NBDClient *client = data->client;
     NBDExport *exp = client->exp;
+    AioContext *ctx;
 
+    /* Negotiation runs in the main loop, but the export may be served by
+     * an IOThread: its clients and references are only touched with the
+     * export's AioContext held.
+     */
     if (exp) {
+        ctx = blk_get_aio_context(exp->blk);
+        aio_context_acquire(ctx);
         nbd_export_get(exp);
+        aio_context_release(ctx);
     }
     if (nbd_negotiate(data)) {
+        ctx = client->exp ? blk_get_aio_context(client->exp->blk) : NULL;
+        if (ctx) {
+            aio_context_acquire(ctx);
+        }
         client_close(client);
+        if (ctx) {
+            aio_context_release(ctx);
+        }
         goto out;
     }
     qemu_co_mutex_init(&client->send_lock);
-    nbd_set_handlers(client);
 
+    ctx = blk_get_aio_context(client->exp->blk);
+    aio_context_acquire(ctx);
+    nbd_set_handlers(client);
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
     }
+    aio_context_release(ctx);
 out:
     g_free(data);
 }
@@ -0,0 +1,557 @@
+/*
+ * AF_PACKET network backend using TPACKET_V3 mmap rings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The backend binds a packet socket to a host interface and maps its
+ * receive and transmit rings.  The kernel fills receive blocks with as
+ * many packets as fit and hands over whole blocks, so one wakeup passes
+ * a burst of packets to the peer without a syscall per packet.  Transmit
+ * frames are queued in the TX ring and the kernel is kicked once per
+ * batch of packets from the peer.
+ *
+ * With vnet_hdr=on every packet carries a struct virtio_net_hdr, so
+ * checksum and segmentation offloads pass between the guest and the
+ * host NIC as with tap.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#define AF_PACKET_DEFAULT_BLOCK_SIZE    (256 * 1024)
+#define AF_PACKET_DEFAULT_BLOCK_COUNT   16
+#define AF_PACKET_DEFAULT_FRAME_SIZE    2048
+#define AF_PACKET_RX_FRAME_SIZE         2048
+/* Retire partially filled receive blocks after this many milliseconds */
+#define AF_PACKET_RX_BLOCK_TIMEOUT      1
+
+/* Offset of the packet data in a transmit frame */
+#define AF_PACKET_TX_DATA_OFFSET \
+    (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct AFPacketState {
+    NetClientState nc;
+    int fd;
+    char ifname[IFNAMSIZ];
+    uint8_t *map;
+    size_t map_size;
+
+    /* Receive ring: whole blocks are owned by either side */
+    struct tpacket_req3 rx_req;
+    uint8_t *rx_ring;
+    unsigned int rx_block;          /* next block to read */
+    struct tpacket3_hdr *rx_pkt;    /* next packet in the current block */
+    unsigned int rx_pkts_left;      /* packets left in the current block */
+
+    /* Transmit ring: fixed size frames */
+    struct tpacket_req3 tx_req;
+    uint8_t *tx_ring;
+    unsigned int tx_frame;          /* next frame to fill */
+    int tx_batch;                   /* nesting of receive batches */
+    bool tx_pending;                /* frames queued but not kicked */
+
+    bool read_poll;
+    bool write_poll;
+    bool vnet_hdr;                  /* socket has PACKET_VNET_HDR */
+    bool using_vnet_hdr;            /* peer passes virtio-net headers */
+    NetOffloads offloads;           /* accepted by the peer */
+} AFPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AFPacketState *s)
+{
+    IOHandler *fd_read = s->read_poll ? af_packet_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_packet_writable : NULL;
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
+}
+
+static void af_packet_read_poll(AFPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AFPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, enable);
+    af_packet_write_poll(s, enable);
+}
+
+/* TX */
+
+static void af_packet_tx_kick(AFPacketState *s)
+{
+    s->tx_pending = false;
+    if (send(s->fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS) {
+        error_report("af-packet: send on %s failed: %s",
+                     s->ifname, strerror(errno));
+    }
+}
+
+static struct tpacket3_hdr *af_packet_tx_frame(AFPacketState *s)
+{
+    return (struct tpacket3_hdr *)(s->tx_ring +
+                                   s->tx_frame * s->tx_req.tp_frame_size);
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    struct tpacket3_hdr *hdr = af_packet_tx_frame(s);
+    size_t size = iov_size(iov, iovcnt);
+    size_t hdr_len = s->vnet_hdr && !s->using_vnet_hdr ?
+                     sizeof(struct virtio_net_hdr) : 0;
+    uint8_t *data = (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET;
+
+    if (hdr_len + size > s->tx_req.tp_frame_size - AF_PACKET_TX_DATA_OFFSET) {
+        /* Drop, it can't fit in a frame */
+        return size;
+    }
+
+    if (hdr->tp_status != TP_STATUS_AVAILABLE &&
+        hdr->tp_status != TP_STATUS_WRONG_FORMAT) {
+        /* The ring is full, wait for the kernel to free some frames */
+        af_packet_tx_kick(s);
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+
+    /* The peer doesn't know about offloads, send a plain header */
+    memset(data, 0, hdr_len);
+    iov_to_buf(iov, iovcnt, 0, data + hdr_len, size);
+    hdr->tp_len = hdr_len + size;
+    hdr->tp_next_offset = 0;
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    s->tx_frame = (s->tx_frame + 1) % s->tx_req.tp_frame_nr;
+
+    if (s->tx_batch) {
+        s->tx_pending = true;
+    } else {
+        af_packet_tx_kick(s);
+    }
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+/* Kick the kernel once per batch of packets from the peer */
+static void af_packet_receive_batch(NetClientState *nc, bool start)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    if (start) {
+        s->tx_batch++;
+        return;
+    }
+
+    assert(s->tx_batch > 0);
+    if (--s->tx_batch == 0 && s->tx_pending) {
+        af_packet_tx_kick(s);
+    }
+}
+
+/* RX */
+
+static struct tpacket_block_desc *af_packet_rx_block(AFPacketState *s)
+{
+    return (struct tpacket_block_desc *)(s->rx_ring +
+                                         s->rx_block * s->rx_req.tp_block_size);
+}
+
+/* Return the current block to the kernel and move to the next one */
+static void af_packet_rx_release_block(AFPacketState *s)
+{
+    struct tpacket_block_desc *desc = af_packet_rx_block(s);
+
+    smp_mb();
+    desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    s->rx_block = (s->rx_block + 1) % s->rx_req.tp_block_nr;
+    s->rx_pkt = NULL;
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+static void af_packet_send(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    qemu_receive_batch(s->nc.peer, true);
+    for (;;) {
+        struct tpacket3_hdr *pkt;
+        struct sockaddr_ll *sll;
+        uint8_t *data;
+        size_t len;
+        ssize_t ret;
+
+        if (!s->rx_pkt) {
+            struct tpacket_block_desc *desc = af_packet_rx_block(s);
+
+            if (!(desc->hdr.bh1.block_status & TP_STATUS_USER)) {
+                break;
+            }
+            smp_rmb();
+            s->rx_pkts_left = desc->hdr.bh1.num_pkts;
+            s->rx_pkt = (struct tpacket3_hdr *)
+                        ((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+        }
+
+        if (!s->rx_pkts_left) {
+            af_packet_rx_release_block(s);
+            continue;
+        }
+
+        pkt = s->rx_pkt;
+        s->rx_pkts_left--;
+        s->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)pkt +
+                                            pkt->tp_next_offset);
+
+        sll = (struct sockaddr_ll *)((uint8_t *)pkt +
+                                     TPACKET_ALIGN(sizeof(*pkt)));
+        if (sll->sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        data = (uint8_t *)pkt + pkt->tp_mac;
+        len = pkt->tp_snaplen;
+        if (s->vnet_hdr) {
+            struct virtio_net_hdr *vhdr =
+                (struct virtio_net_hdr *)(data - sizeof(*vhdr));
+
+            /* The kernel can hand us offloaded packets whatever the peer
+             * accepted, e.g. GRO aggregates.
+             */
+            if (!qemu_vnet_hdr_fixup(vhdr, data, len, s->using_vnet_hdr ?
+                                     &s->offloads : NULL)) {
+                continue;
+            }
+            if (s->using_vnet_hdr) {
+                data = (uint8_t *)vhdr;
+                len += sizeof(*vhdr);
+            }
+        }
+
+        /* A zero return means the packet was queued: it has been copied,
+         * but the peer wants no more until af_packet_send_completed().
+         */
+        ret = qemu_send_packet_async(&s->nc, data, len,
+                                     af_packet_send_completed);
+        if (ret == 0) {
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+    qemu_receive_batch(s->nc.peer, false);
+}
+
+/* Offloads */
+
+static bool af_packet_has_ufo(NetClientState *nc)
+{
+    return false;
+}
+
+static bool af_packet_has_vnet_hdr(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool af_packet_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    return s->vnet_hdr && len == sizeof(struct virtio_net_hdr);
+}
+
+static void af_packet_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    assert(!enable || s->vnet_hdr);
+    s->using_vnet_hdr = enable;
+}
+
+static void af_packet_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    assert(len == sizeof(struct virtio_net_hdr));
+}
+
+static void af_packet_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    s->offloads.csum = csum;
+    s->offloads.tso4 = tso4;
+    s->offloads.tso6 = tso6;
+    s->offloads.ecn = ecn;
+}
+
+static void af_packet_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    bool read_poll = s->read_poll, write_poll = s->write_poll;
+
+    s->read_poll = s->write_poll = false;
+    af_packet_update_fd_handler(s);
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    nc->ctx = ctx;
+    af_packet_update_fd_handler(s);
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->fd >= 0) {
+        af_packet_poll(nc, false);
+        if (s->map) {
+            munmap(s->map, s->map_size);
+            s->map = NULL;
+        }
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AFPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_batch = af_packet_receive_batch,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+    .has_ufo = af_packet_has_ufo,
+    .has_vnet_hdr = af_packet_has_vnet_hdr,
+    .has_vnet_hdr_len = af_packet_has_vnet_hdr_len,
+    .using_vnet_hdr = af_packet_using_vnet_hdr,
+    .set_offload = af_packet_set_offload,
+    .set_vnet_hdr_len = af_packet_set_vnet_hdr_len,
+    .set_aio_context = af_packet_set_aio_context,
+};
+
+static int af_packet_open(AFPacketState *s, const NetdevAFPacketOptions *opts,
+                          Error **errp)
+{
+    int version = TPACKET_V3;
+    int one = 1;
+    struct packet_mreq mreq;
+    struct sockaddr_ll sll;
+    unsigned int ifindex;
+    size_t rx_size, tx_size;
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "af-packet: no interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    s->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't create socket");
+        return -1;
+    }
+
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: TPACKET_V3 not supported");
+        return -1;
+    }
+    if (s->vnet_hdr && setsockopt(s->fd, SOL_PACKET, PACKET_VNET_HDR,
+                                  &one, sizeof(one)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: vnet_hdr not supported");
+        return -1;
+    }
+#ifdef PACKET_IGNORE_OUTGOING
+    /* Older kernels only get PACKET_OUTGOING filtered in af_packet_send() */
+    setsockopt(s->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+    s->rx_req.tp_block_size = s->tx_req.tp_block_size;
+    s->rx_req.tp_block_nr = s->tx_req.tp_block_nr;
+    s->rx_req.tp_frame_size = AF_PACKET_RX_FRAME_SIZE;
+    s->rx_req.tp_frame_nr = s->rx_req.tp_block_size /
+                            s->rx_req.tp_frame_size * s->rx_req.tp_block_nr;
+    s->rx_req.tp_retire_blk_tov = AF_PACKET_RX_BLOCK_TIMEOUT;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING,
+                   &s->rx_req, sizeof(s->rx_req)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't set up the RX ring");
+        return -1;
+    }
+
+    s->tx_req.tp_frame_nr = s->tx_req.tp_block_size /
+                            s->tx_req.tp_frame_size * s->tx_req.tp_block_nr;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_TX_RING,
+                   &s->tx_req, sizeof(s->tx_req)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't set up the TX ring");
+        return -1;
+    }
+
+    rx_size = (size_t)s->rx_req.tp_block_size * s->rx_req.tp_block_nr;
+    tx_size = (size_t)s->tx_req.tp_block_size * s->tx_req.tp_block_nr;
+    s->map_size = rx_size + tx_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        error_setg_errno(errp, errno, "af-packet: can't map the rings");
+        return -1;
+    }
+    s->rx_ring = s->map;
+    s->tx_ring = s->map + rx_size;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(s->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't bind to '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    /* The guest has its own MAC address */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(s->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't make '%s' promiscuous",
+                         opts->ifname);
+        return -1;
+    }
+
+    qemu_set_nonblock(s->fd);
+    return 0;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    const NetdevAFPacketOptions *af_packet = opts->u.af_packet;
+    NetClientState *nc;
+    AFPacketState *s;
+    long page_size = getpagesize();
+    uint64_t block_size = AF_PACKET_DEFAULT_BLOCK_SIZE;
+    uint32_t block_count = AF_PACKET_DEFAULT_BLOCK_COUNT;
+    bool vnet_hdr = af_packet->has_vnet_hdr && af_packet->vnet_hdr;
+    uint32_t frame_size;
+
+    if (af_packet->has_block_size) {
+        block_size = af_packet->block_size;
+    }
+    if (block_size < page_size || block_size % page_size ||
+        block_size > UINT32_MAX) {
+        error_setg(errp, "af-packet: block-size must be a multiple of %ld",
+                   page_size);
+        return -1;
+    }
+
+    if (af_packet->has_block_count) {
+        block_count = af_packet->block_count;
+    }
+    if (!block_count) {
+        error_setg(errp, "af-packet: block-count must be positive");
+        return -1;
+    }
+
+    /* A GSO frame from the peer can be up to 64 KiB */
+    frame_size = vnet_hdr ? ROUND_UP(AF_PACKET_TX_DATA_OFFSET +
+                                     sizeof(struct virtio_net_hdr) +
+                                     ETH_HLEN + 65536, TPACKET_ALIGNMENT)
+                          : AF_PACKET_DEFAULT_FRAME_SIZE;
+    if (af_packet->has_frame_size) {
+        frame_size = af_packet->frame_size;
+    }
+    if (frame_size <= AF_PACKET_TX_DATA_OFFSET ||
+        frame_size % TPACKET_ALIGNMENT || frame_size > block_size) {
+        error_setg(errp, "af-packet: frame-size must be a multiple of %d "
+                   "and fit in a block", TPACKET_ALIGNMENT);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    s = DO_UPCAST(AFPacketState, nc, nc);
+    s->fd = -1;
+    s->vnet_hdr = vnet_hdr;
+    s->tx_req.tp_block_size = block_size;
+    s->tx_req.tp_block_nr = block_count;
+    s->tx_req.tp_frame_size = frame_size;
+    pstrcpy(s->ifname, sizeof(s->ifname), af_packet->ifname);
+
+    if (af_packet_open(s, af_packet, errp) < 0) {
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s", s->ifname);
+    af_packet_read_poll(s, true);
+    return 0;
+}
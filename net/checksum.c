@@ -22,17 +22,58 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
+static inline uint32_t net_checksum_load32(const uint8_t *buf)
+{
+    uint32_t word;
+
+    memcpy(&word, buf, sizeof(word));
+    return word;
+}
+
+/*
+ * The ones' complement sum doesn't depend on byte order (RFC 1071), so
+ * add up host-endian 32-bit words in a 64-bit accumulator, which can't
+ * overflow for any buffer we will see, and only fold and byte swap the
+ * result at the end.
+ *
+ * The result is folded to 16 bits, which is equivalent to the plain sum
+ * of 16-bit words for net_checksum_finish() and the callers that fold it
+ * themselves, and leaves room for adding up many of them.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+    uint32_t tail = 0;
+
+    while (len >= 16) {
+        sum += (uint64_t)net_checksum_load32(buf) +
+               net_checksum_load32(buf + 4) +
+               net_checksum_load32(buf + 8) +
+               net_checksum_load32(buf + 12);
+        buf += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        sum += net_checksum_load32(buf);
+        buf += 4;
+        len -= 4;
+    }
+    if (len > 0) {
+        memcpy(&tail, buf, len);
+        sum += tail;
+    }
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
-        }
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    /* Stored in host order, sum reads as the big-endian checksum, in which
+     * buf[0] is a high byte only if seq is even.
+     */
+    sum = be16_to_cpu(sum);
+    if (seq & 1) {
+        sum = bswap16(sum);
     }
     return sum;
 }
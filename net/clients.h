@@ -59,6 +59,16 @@ int net_init_netmap(const NetClientOptions *opts, const char *name,
                     NetClientState *peer, Error **errp);
 #endif
 
+#ifdef CONFIG_AF_PACKET
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer, Error **errp);
+#endif
+
+#ifdef CONFIG_POSIX
+int net_init_ivshmem(const NetClientOptions *opts, const char *name,
+                     NetClientState *peer, Error **errp);
+#endif
+
 int net_init_vhost_user(const NetClientOptions *opts, const char *name,
                         NetClientState *peer, Error **errp);
 
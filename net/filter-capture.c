@@ -0,0 +1,434 @@
+/*
+ * Asynchronous packet capture filter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+/*
+ * filter-dump writes every packet with writev() from the packet path.
+ * filter-capture only copies the packet into a ring buffer and leaves
+ * the file I/O to a writer thread, so a slow disk costs dropped captures
+ * rather than guest throughput.
+ *
+ * The ring has one producer, the netdev's packet path, and one consumer,
+ * the writer thread.  Records are stored contiguously; a record that
+ * doesn't fit before the end of the ring is preceded by a padding record
+ * that sends the consumer back to the start.
+ */
+
+#include "qemu/osdep.h"
+#include "net/filter.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/visitor.h"
+#include "qom/object.h"
+
+#define TYPE_FILTER_CAPTURE "filter-capture"
+
+#define FILTER_CAPTURE(obj) \
+    OBJECT_CHECK(FilterCaptureState, (obj), TYPE_FILTER_CAPTURE)
+
+#define CAPTURE_DEFAULT_RING_SIZE   (4 * 1024 * 1024)
+#define CAPTURE_MIN_RING_SIZE       (64 * 1024)
+#define CAPTURE_WRITE_BATCH         64
+
+#define PCAP_MAGIC 0xa1b2c3d4
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_sf_pkthdr {
+    struct {
+        int32_t tv_sec;
+        int32_t tv_usec;
+    } ts;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+typedef struct CaptureRecord {
+    uint32_t size;                  /* whole record, 0 for padding */
+    uint32_t pad;
+    struct pcap_sf_pkthdr hdr;
+    uint8_t data[];
+} CaptureRecord;
+
+typedef struct FilterCaptureState {
+    NetFilterState parent_obj;
+
+    char *filename;
+    uint32_t snaplen;
+    uint32_t sample;
+    uint64_t ring_size;
+
+    int fd;
+    uint8_t *ring;
+    size_t mask;
+    size_t head;                    /* written by the packet path */
+    size_t tail;                    /* written by the writer thread */
+    QemuThread thread;
+    QemuEvent avail;
+    bool thread_started;
+    bool stopping;
+
+    uint32_t sample_count;
+    uint64_t captured;
+    uint64_t dropped;
+} FilterCaptureState;
+
+static inline CaptureRecord *capture_record(FilterCaptureState *s, size_t pos)
+{
+    return (CaptureRecord *)(s->ring + (pos & s->mask));
+}
+
+static ssize_t filter_capture_receive_iov(NetFilterState *nf,
+                                          NetClientState *sender,
+                                          unsigned flags,
+                                          const struct iovec *iov,
+                                          int iovcnt,
+                                          NetPacketSent *sent_cb)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(nf);
+    size_t size = iov_size(iov, iovcnt);
+    size_t caplen = MIN(size, s->snaplen);
+    size_t need = ROUND_UP(sizeof(CaptureRecord) + caplen, 8);
+    size_t head = s->head;
+    size_t room = (s->mask + 1) - (head & s->mask);
+    size_t total = need > room ? room + need : need;
+    CaptureRecord *rec;
+    int64_t ts;
+
+    if (s->sample > 1 && ++s->sample_count < s->sample) {
+        return 0;
+    }
+    s->sample_count = 0;
+
+    if (total > (s->mask + 1) - (head - atomic_read(&s->tail))) {
+        s->dropped++;
+        return 0;
+    }
+
+    if (need > room) {
+        capture_record(s, head)->size = 0;
+        head += room;
+    }
+
+    ts = g_get_real_time();
+    rec = capture_record(s, head);
+    rec->size = need;
+    rec->hdr.ts.tv_sec = ts / 1000000;
+    rec->hdr.ts.tv_usec = ts % 1000000;
+    rec->hdr.caplen = caplen;
+    rec->hdr.len = size;
+    iov_to_buf(iov, iovcnt, 0, rec->data, caplen);
+
+    /* Publish the record before the new head */
+    smp_wmb();
+    atomic_set(&s->head, head + need);
+    s->captured++;
+    qemu_event_set(&s->avail);
+
+    /* Capture only, the packet continues on its way */
+    return 0;
+}
+
+static void *filter_capture_thread(void *opaque)
+{
+    FilterCaptureState *s = opaque;
+    struct iovec iov[CAPTURE_WRITE_BATCH];
+    size_t tail = s->tail;
+    bool write_error = false;
+
+    for (;;) {
+        size_t head = atomic_read(&s->head);
+        size_t pos = tail;
+        ssize_t len = 0;
+        int cnt = 0;
+
+        if (head == tail) {
+            if (atomic_read(&s->stopping)) {
+                break;
+            }
+            qemu_event_reset(&s->avail);
+            smp_mb();
+            if (atomic_read(&s->head) == tail && !atomic_read(&s->stopping)) {
+                qemu_event_wait(&s->avail);
+            }
+            continue;
+        }
+
+        /* Read the records only after seeing the head */
+        smp_rmb();
+        while (pos != head && cnt < CAPTURE_WRITE_BATCH) {
+            CaptureRecord *rec = capture_record(s, pos);
+
+            if (!rec->size) {
+                pos += (s->mask + 1) - (pos & s->mask);
+                continue;
+            }
+            iov[cnt].iov_base = &rec->hdr;
+            iov[cnt].iov_len = sizeof(rec->hdr) + rec->hdr.caplen;
+            len += iov[cnt].iov_len;
+            cnt++;
+            pos += rec->size;
+        }
+
+        if (cnt && !write_error && writev(s->fd, iov, cnt) != len) {
+            error_report("filter-capture: write error on %s - stopping capture",
+                         s->filename);
+            write_error = true;
+        }
+
+        /* Done with the records, hand the space back */
+        smp_mb();
+        atomic_set(&s->tail, pos);
+        tail = pos;
+    }
+    return NULL;
+}
+
+static void filter_capture_cleanup(NetFilterState *nf)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(nf);
+
+    if (s->thread_started) {
+        atomic_set(&s->stopping, true);
+        qemu_event_set(&s->avail);
+        qemu_thread_join(&s->thread);
+        qemu_event_destroy(&s->avail);
+        s->thread_started = false;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    qemu_vfree(s->ring);
+    s->ring = NULL;
+}
+
+static void filter_capture_setup(NetFilterState *nf, Error **errp)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(nf);
+    struct pcap_file_hdr hdr;
+    size_t ring_size;
+
+    if (!s->filename) {
+        error_setg(errp, "capture filter needs 'file' property set!");
+        return;
+    }
+
+    ring_size = pow2ceil(MAX(s->ring_size, CAPTURE_MIN_RING_SIZE));
+    if (ring_size < ROUND_UP(sizeof(CaptureRecord) + s->snaplen, 8) * 2) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "ring-size",
+                   "at least twice snaplen");
+        return;
+    }
+
+    s->fd = qemu_open(s->filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY,
+                      0644);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "filter-capture: can't open %s",
+                         s->filename);
+        return;
+    }
+
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = s->snaplen;
+    hdr.linktype = 1;
+    if (write(s->fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+        error_setg_errno(errp, errno, "filter-capture write error");
+        close(s->fd);
+        s->fd = -1;
+        return;
+    }
+
+    s->ring = qemu_memalign(8, ring_size);
+    s->mask = ring_size - 1;
+    s->head = s->tail = 0;
+    s->stopping = false;
+    qemu_event_init(&s->avail, false);
+    qemu_thread_create(&s->thread, "filter-capture", filter_capture_thread,
+                       s, QEMU_THREAD_JOINABLE);
+    s->thread_started = true;
+}
+
+static void filter_capture_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    nfc->setup = filter_capture_setup;
+    nfc->cleanup = filter_capture_cleanup;
+    nfc->receive_iov = filter_capture_receive_iov;
+}
+
+static void filter_capture_get_uint32(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    uint32_t value = *(uint32_t *)opaque;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_capture_set_uint32(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    NetFilterState *nf = NETFILTER(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    if (nf->netdev) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the filter is set up", object_get_typename(obj), name);
+        goto out;
+    }
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value == 0) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%u'",
+                   object_get_typename(obj), name, value);
+        goto out;
+    }
+    *(uint32_t *)opaque = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void filter_capture_get_ring_size(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+
+    visit_type_size(v, name, &s->ring_size, errp);
+}
+
+static void filter_capture_set_ring_size(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    if (NETFILTER(obj)->netdev) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the filter is set up", object_get_typename(obj), name);
+        goto out;
+    }
+    visit_type_size(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value > SIZE_MAX / 2) {
+        error_setg(&local_err, "Property '%s.%s' is too large",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    s->ring_size = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void filter_capture_get_counter(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static char *filter_capture_get_filename(Object *obj, Error **errp)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+
+    return g_strdup(s->filename);
+}
+
+static void filter_capture_set_filename(Object *obj, const char *value,
+                                        Error **errp)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+
+    if (NETFILTER(obj)->netdev) {
+        error_setg(errp, "Property '%s.file' can't be changed once "
+                   "the filter is set up", object_get_typename(obj));
+        return;
+    }
+    g_free(s->filename);
+    s->filename = g_strdup(value);
+}
+
+static void filter_capture_init(Object *obj)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+
+    s->fd = -1;
+    s->snaplen = 65535;
+    s->sample = 1;
+    s->ring_size = CAPTURE_DEFAULT_RING_SIZE;
+
+    object_property_add_str(obj, "file", filter_capture_get_filename,
+                            filter_capture_set_filename, NULL);
+    object_property_add(obj, "snaplen", "int",
+                        filter_capture_get_uint32,
+                        filter_capture_set_uint32, NULL, &s->snaplen, NULL);
+    object_property_add(obj, "sample", "int",
+                        filter_capture_get_uint32,
+                        filter_capture_set_uint32, NULL, &s->sample, NULL);
+    object_property_add(obj, "ring-size", "size",
+                        filter_capture_get_ring_size,
+                        filter_capture_set_ring_size, NULL, NULL, NULL);
+    object_property_add(obj, "captured", "int",
+                        filter_capture_get_counter, NULL, NULL,
+                        &s->captured, NULL);
+    object_property_add(obj, "dropped", "int",
+                        filter_capture_get_counter, NULL, NULL,
+                        &s->dropped, NULL);
+}
+
+static void filter_capture_finalize(Object *obj)
+{
+    FilterCaptureState *s = FILTER_CAPTURE(obj);
+
+    g_free(s->filename);
+}
+
+static const TypeInfo filter_capture_info = {
+    .name = TYPE_FILTER_CAPTURE,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_capture_class_init,
+    .instance_init = filter_capture_init,
+    .instance_finalize = filter_capture_finalize,
+    .instance_size = sizeof(FilterCaptureState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_capture_info);
+}
+
+type_init(register_types);
@@ -0,0 +1,568 @@
+/*
+ * Network backend exchanging packets through ivshmem shared memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The backend is a client of an ivshmem server, like the ivshmem device,
+ * and links up with the one other client of the server.  Packets go
+ * through a ring in the shared memory for each direction, with the layout
+ * described in docs/specs/ivshmem-net.txt, so two co-located guests talk
+ * to each other with a single copy at each end and no host network stack
+ * in between.
+ *
+ * Doorbells are only rung when the other side has asked for one: a
+ * consumer that is processing packets, or busy-polling the ring with
+ * poll-us=N, keeps notifications suppressed.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "sysemu/char.h"
+#include "hw/misc/ivshmem.h"
+#include "qmp-commands.h"
+
+#define IVSHMEM_NET_SLOT_SIZE       2048
+#define IVSHMEM_NET_MIN_SLOTS       8
+
+typedef struct IvshmemNetRing {
+    /* written by the producer */
+    uint32_t prod;
+    uint32_t want_tx_kick;
+    uint8_t pad0[56];
+    /* written by the consumer */
+    uint32_t cons;
+    uint32_t want_rx_kick;
+    uint8_t pad1[56];
+} IvshmemNetRing;
+
+typedef struct IvshmemNetSlot {
+    uint32_t len;
+    uint32_t reserved;
+    uint8_t data[IVSHMEM_NET_SLOT_SIZE - 8];
+} IvshmemNetSlot;
+
+QEMU_BUILD_BUG_ON(sizeof(IvshmemNetRing) != 128);
+QEMU_BUILD_BUG_ON(sizeof(IvshmemNetSlot) != IVSHMEM_NET_SLOT_SIZE);
+
+#define IVSHMEM_NET_MIN_SHM_SIZE \
+    (2 * (sizeof(IvshmemNetRing) + \
+          IVSHMEM_NET_MIN_SLOTS * sizeof(IvshmemNetSlot)))
+
+typedef struct IvshmemNetState {
+    NetClientState nc;
+    CharDriverState *chr;
+
+    /* server messages are little endian int64 values */
+    uint8_t msg[sizeof(int64_t)];
+    int msg_len;
+    bool version_ok;
+
+    uint8_t *shm;
+    size_t shm_size;
+    int64_t id;                 /* ours, -1 until received */
+    int64_t peer_id;            /* -1 when there is no other client */
+    EventNotifier notifier;     /* our vector 0 */
+    bool has_notifier;
+    EventNotifier peer_notifier;
+    bool has_peer_notifier;
+    bool ignored_peers;
+
+    bool link_up;
+    IvshmemNetRing *tx, *rx;
+    IvshmemNetSlot *tx_slots, *rx_slots;
+    uint32_t nr_slots;
+
+    bool read_poll;             /* our peer accepts packets */
+    bool tx_wait;               /* the TX ring is full */
+    int tx_batch;               /* nesting of receive batches */
+    bool tx_pending;            /* packets produced but not notified */
+
+    int64_t poll_ns;
+    int64_t poll_deadline;
+    QEMUBH *rx_bh;
+} IvshmemNetState;
+
+static void ivshmem_net_kick(IvshmemNetState *s)
+{
+    if (s->has_peer_notifier) {
+        event_notifier_set(&s->peer_notifier);
+    }
+}
+
+/* TX */
+
+static void ivshmem_net_tx_notify(IvshmemNetState *s)
+{
+    s->tx_pending = false;
+    smp_mb();   /* prod update before want_rx_kick read */
+    if (atomic_read(&s->tx->want_rx_kick)) {
+        ivshmem_net_kick(s);
+    }
+}
+
+static bool ivshmem_net_tx_full(IvshmemNetState *s)
+{
+    return s->tx->prod - atomic_read(&s->tx->cons) >= s->nr_slots;
+}
+
+static ssize_t ivshmem_net_receive_iov(NetClientState *nc,
+                                       const struct iovec *iov, int iovcnt)
+{
+    IvshmemNetState *s = DO_UPCAST(IvshmemNetState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    IvshmemNetSlot *slot;
+    uint32_t prod;
+
+    if (!s->link_up || size > sizeof(slot->data)) {
+        return size;
+    }
+
+    if (ivshmem_net_tx_full(s)) {
+        atomic_set(&s->tx->want_tx_kick, 1);
+        smp_mb();   /* want_tx_kick update before cons read */
+        if (ivshmem_net_tx_full(s)) {
+            /* Wait for the consumer, it may need a kick to get there */
+            s->tx_wait = true;
+            if (s->tx_pending) {
+                ivshmem_net_tx_notify(s);
+            }
+            return 0;
+        }
+        atomic_set(&s->tx->want_tx_kick, 0);
+    }
+
+    prod = s->tx->prod;
+    slot = &s->tx_slots[prod & (s->nr_slots - 1)];
+    iov_to_buf(iov, iovcnt, 0, slot->data, size);
+    slot->len = size;
+    smp_wmb();  /* slot contents before prod update */
+    atomic_set(&s->tx->prod, prod + 1);
+
+    if (s->tx_batch) {
+        s->tx_pending = true;
+    } else {
+        ivshmem_net_tx_notify(s);
+    }
+    return size;
+}
+
+static ssize_t ivshmem_net_receive(NetClientState *nc,
+                                   const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return ivshmem_net_receive_iov(nc, &iov, 1);
+}
+
+/* Notify the consumer once per batch of packets from the peer */
+static void ivshmem_net_receive_batch(NetClientState *nc, bool start)
+{
+    IvshmemNetState *s = DO_UPCAST(IvshmemNetState, nc, nc);
+
+    if (start) {
+        s->tx_batch++;
+        return;
+    }
+
+    assert(s->tx_batch > 0);
+    if (--s->tx_batch == 0 && s->tx_pending) {
+        ivshmem_net_tx_notify(s);
+    }
+}
+
+/* RX */
+
+static void ivshmem_net_send(void *opaque);
+
+static void ivshmem_net_send_completed(NetClientState *nc, ssize_t len)
+{
+    IvshmemNetState *s = DO_UPCAST(IvshmemNetState, nc, nc);
+
+    s->read_poll = true;
+    ivshmem_net_send(s);
+}
+
+/* The RX ring is empty: keep polling it, or ask for a kick */
+static void ivshmem_net_rx_idle(IvshmemNetState *s, bool progress)
+{
+    IvshmemNetRing *rx = s->rx;
+
+    if (s->poll_ns) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        if (progress) {
+            s->poll_deadline = now + s->poll_ns;
+        }
+        if (now < s->poll_deadline) {
+            qemu_bh_schedule(s->rx_bh);
+            return;
+        }
+    }
+
+    atomic_set(&rx->want_rx_kick, 1);
+    smp_mb();   /* want_rx_kick update before prod read */
+    if (atomic_read(&rx->prod) != rx->cons) {
+        qemu_bh_schedule(s->rx_bh);
+    }
+}
+
+static void ivshmem_net_send(void *opaque)
+{
+    IvshmemNetState *s = opaque;
+    IvshmemNetRing *rx = s->rx;
+    unsigned int done = 0;
+
+    if (!s->link_up || !s->read_poll) {
+        return;
+    }
+
+    /* No kicks while we are looking at the ring anyway */
+    atomic_set(&rx->want_rx_kick, 0);
+
+    qemu_receive_batch(s->nc.peer, true);
+    /* At most a ring's worth, so that a bogus prod can't stall us */
+    while (done < s->nr_slots) {
+        uint32_t cons = rx->cons, len;
+        IvshmemNetSlot *slot;
+        ssize_t ret = 1;
+
+        if (atomic_read(&rx->prod) == cons) {
+            break;
+        }
+        smp_rmb();  /* prod read before slot contents */
+
+        slot = &s->rx_slots[cons & (s->nr_slots - 1)];
+        len = atomic_read(&slot->len);
+        if (len <= sizeof(slot->data)) {
+            /* A zero return means the packet was copied to a queue, but
+             * the peer wants no more until ivshmem_net_send_completed().
+             */
+            ret = qemu_send_packet_async(&s->nc, slot->data, len,
+                                         ivshmem_net_send_completed);
+        }
+        smp_mb();   /* done with the slot before cons update */
+        atomic_set(&rx->cons, cons + 1);
+        done++;
+
+        if (ret == 0) {
+            s->read_poll = false;
+            break;
+        }
+    }
+    qemu_receive_batch(s->nc.peer, false);
+
+    if (done) {
+        smp_mb();   /* cons update before want_tx_kick read */
+        if (atomic_read(&rx->want_tx_kick)) {
+            ivshmem_net_kick(s);
+        }
+    }
+    if (s->read_poll) {
+        ivshmem_net_rx_idle(s, done);
+    }
+}
+
+/* Our doorbell: new packets, or room in the TX ring */
+static void ivshmem_net_notify(EventNotifier *n)
+{
+    IvshmemNetState *s = container_of(n, IvshmemNetState, notifier);
+
+    event_notifier_test_and_clear(n);
+    if (!s->link_up) {
+        return;
+    }
+
+    ivshmem_net_send(s);
+    if (s->tx_wait && !ivshmem_net_tx_full(s)) {
+        s->tx_wait = false;
+        atomic_set(&s->tx->want_tx_kick, 0);
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+/* Link */
+
+static void ivshmem_net_set_link(IvshmemNetState *s, bool up)
+{
+    Error *err = NULL;
+
+    qmp_set_link(s->nc.name, up, &err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+static void ivshmem_net_update_link(IvshmemNetState *s)
+{
+    bool up = s->shm && s->id >= 0 && s->has_notifier && s->has_peer_notifier;
+    IvshmemNetRing *lower, *higher;
+
+    if (up == s->link_up) {
+        return;
+    }
+
+    if (!up) {
+        s->link_up = false;
+        s->tx_wait = false;
+        s->tx_pending = false;
+        qemu_bh_cancel(s->rx_bh);
+        ivshmem_net_set_link(s, false);
+        /* Drops what the peer queued for us */
+        qemu_flush_queued_packets(&s->nc);
+        return;
+    }
+
+    lower = (IvshmemNetRing *)s->shm;
+    higher = (IvshmemNetRing *)(s->shm + s->shm_size / 2);
+    s->tx = s->id < s->peer_id ? lower : higher;
+    s->rx = s->id < s->peer_id ? higher : lower;
+    s->tx_slots = (IvshmemNetSlot *)(s->tx + 1);
+    s->rx_slots = (IvshmemNetSlot *)(s->rx + 1);
+
+    /* The counters may be left over from an earlier link */
+    atomic_set(&s->rx->cons, atomic_read(&s->rx->prod));
+    atomic_set(&s->tx->want_tx_kick, 0);
+    smp_mb();   /* resynchronized before the peer is kicked */
+    s->link_up = true;
+    s->poll_deadline = 0;
+    ivshmem_net_kick(s);
+
+    ivshmem_net_set_link(s, true);
+    qemu_bh_schedule(s->rx_bh);
+}
+
+static void ivshmem_net_peer_gone(IvshmemNetState *s)
+{
+    if (s->has_peer_notifier) {
+        event_notifier_cleanup(&s->peer_notifier);
+        s->has_peer_notifier = false;
+    }
+    s->peer_id = -1;
+    ivshmem_net_update_link(s);
+}
+
+static void ivshmem_net_disconnect(IvshmemNetState *s)
+{
+    ivshmem_net_peer_gone(s);
+    if (s->has_notifier) {
+        event_notifier_set_handler(&s->notifier, NULL);
+        event_notifier_cleanup(&s->notifier);
+        s->has_notifier = false;
+    }
+    if (s->shm) {
+        munmap(s->shm, s->shm_size);
+        s->shm = NULL;
+    }
+    s->id = -1;
+    s->msg_len = 0;
+    s->version_ok = false;
+}
+
+static void ivshmem_net_map_shm(IvshmemNetState *s, int fd)
+{
+    struct stat st;
+    void *ptr;
+
+    if (s->shm) {
+        error_report("ivshmem netdev: shared memory already received");
+        close(fd);
+        return;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)IVSHMEM_NET_MIN_SHM_SIZE) {
+        error_report("ivshmem netdev: shared memory must be at least %zu "
+                     "bytes", (size_t)IVSHMEM_NET_MIN_SHM_SIZE);
+        close(fd);
+        return;
+    }
+
+    ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_report("ivshmem netdev: can't map shared memory: %s",
+                     strerror(errno));
+        return;
+    }
+
+    s->shm = ptr;
+    s->shm_size = st.st_size;
+    s->nr_slots = pow2floor((s->shm_size / 2 - sizeof(IvshmemNetRing)) /
+                            sizeof(IvshmemNetSlot));
+    ivshmem_net_update_link(s);
+}
+
+static void ivshmem_net_handle_msg(IvshmemNetState *s, int64_t val, int fd)
+{
+    if (!s->version_ok) {
+        if (fd != -1 || val != IVSHMEM_PROTOCOL_VERSION) {
+            error_report("ivshmem netdev: incompatible ivshmem server "
+                         "protocol");
+            if (fd != -1) {
+                close(fd);
+            }
+            return;
+        }
+        s->version_ok = true;
+        /* The NIC exists by now, it starts with the link down */
+        ivshmem_net_set_link(s, false);
+        return;
+    }
+
+    if (fd == -1) {
+        if (s->id == -1 && val >= 0) {
+            s->id = val;
+        } else if (val == s->peer_id) {
+            ivshmem_net_peer_gone(s);
+        }
+        return;
+    }
+
+    if (val == -1) {
+        ivshmem_net_map_shm(s, fd);
+        return;
+    }
+
+    /* Only vector 0 is used, further vectors are closed */
+    if (val == s->id) {
+        if (s->has_notifier) {
+            close(fd);
+            return;
+        }
+        event_notifier_init_fd(&s->notifier, fd);
+        qemu_set_nonblock(fd);
+        event_notifier_set_handler(&s->notifier, ivshmem_net_notify);
+        s->has_notifier = true;
+    } else {
+        if (s->peer_id == -1) {
+            s->peer_id = val;
+        }
+        if (val != s->peer_id || s->has_peer_notifier) {
+            if (val != s->peer_id && !s->ignored_peers) {
+                error_report("ivshmem netdev: more than two clients on the "
+                             "server, ignoring client %" PRId64, val);
+                s->ignored_peers = true;
+            }
+            close(fd);
+            return;
+        }
+        event_notifier_init_fd(&s->peer_notifier, fd);
+        s->has_peer_notifier = true;
+    }
+    ivshmem_net_update_link(s);
+}
+
+static int ivshmem_net_can_read(void *opaque)
+{
+    IvshmemNetState *s = opaque;
+
+    return sizeof(s->msg) - s->msg_len;
+}
+
+static void ivshmem_net_read(void *opaque, const uint8_t *buf, int size)
+{
+    IvshmemNetState *s = opaque;
+    int64_t val;
+
+    assert(size <= sizeof(s->msg) - s->msg_len);
+    memcpy(s->msg + s->msg_len, buf, size);
+    s->msg_len += size;
+    if (s->msg_len < sizeof(s->msg)) {
+        return;
+    }
+
+    s->msg_len = 0;
+    memcpy(&val, s->msg, sizeof(val));
+    ivshmem_net_handle_msg(s, le64_to_cpu(val), qemu_chr_fe_get_msgfd(s->chr));
+}
+
+static void ivshmem_net_event(void *opaque, int event)
+{
+    IvshmemNetState *s = opaque;
+
+    if (event == CHR_EVENT_CLOSED) {
+        ivshmem_net_disconnect(s);
+    }
+}
+
+static void ivshmem_net_cleanup(NetClientState *nc)
+{
+    IvshmemNetState *s = DO_UPCAST(IvshmemNetState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->chr) {
+        qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+        qemu_chr_fe_release(s->chr);
+        s->chr = NULL;
+    }
+    s->link_up = false;
+    ivshmem_net_disconnect(s);
+    if (s->rx_bh) {
+        qemu_bh_delete(s->rx_bh);
+        s->rx_bh = NULL;
+    }
+}
+
+static NetClientInfo net_ivshmem_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_IVSHMEM,
+    .size = sizeof(IvshmemNetState),
+    .receive = ivshmem_net_receive,
+    .receive_iov = ivshmem_net_receive_iov,
+    .receive_batch = ivshmem_net_receive_batch,
+    .cleanup = ivshmem_net_cleanup,
+};
+
+int net_init_ivshmem(const NetClientOptions *opts, const char *name,
+                     NetClientState *peer, Error **errp)
+{
+    const NetdevIvshmemOptions *ivshmem = opts->u.ivshmem;
+    CharDriverState *chr;
+    NetClientState *nc;
+    IvshmemNetState *s;
+
+    chr = qemu_chr_find(ivshmem->chardev);
+    if (!chr) {
+        error_setg(errp, "chardev \"%s\" not found", ivshmem->chardev);
+        return -1;
+    }
+    if (ivshmem->has_poll_us && ivshmem->poll_us > 1000000) {
+        error_setg(errp, "ivshmem: poll-us must be at most 1000000");
+        return -1;
+    }
+    qemu_chr_fe_claim_no_fail(chr);
+
+    nc = qemu_new_net_client(&net_ivshmem_info, peer, "ivshmem", name);
+    s = DO_UPCAST(IvshmemNetState, nc, nc);
+    s->chr = chr;
+    s->id = -1;
+    s->peer_id = -1;
+    s->read_poll = true;
+    s->poll_ns = ivshmem->has_poll_us ? (int64_t)ivshmem->poll_us * SCALE_US
+                                      : 0;
+    s->rx_bh = qemu_bh_new(ivshmem_net_send, s);
+    nc->link_down = true;
+
+    snprintf(nc->info_str, sizeof(nc->info_str), "chardev=%s",
+             ivshmem->chardev);
+    qemu_chr_add_handlers(chr, ivshmem_net_can_read, ivshmem_net_read,
+                          ivshmem_net_event, s);
+    return 0;
+}
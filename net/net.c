@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 
 #include "net/net.h"
+#include "net/checksum.h"
 #include "clients.h"
 #include "hub.h"
 #include "net/slirp.h"
@@ -45,6 +46,7 @@
 #include "sysemu/sysemu.h"
 #include "net/filter.h"
 #include "qapi/string-output-visitor.h"
+#include "standard-headers/linux/virtio_net.h"
 
 /* Net bridge is currently not supported for W32. */
 #if !defined(_WIN32)
@@ -64,6 +66,12 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet",
+#endif
+#ifdef CONFIG_POSIX
+    "ivshmem",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -522,6 +530,47 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * For backends that get virtio-net headers from outside QEMU (the host
+ * kernel, a remote QEMU), whatever offloads their peer accepted.  Complete
+ * partial checksums and reject GSO packets that @offloads doesn't cover;
+ * a NULL @offloads means the peer doesn't take virtio-net headers at all.
+ * @data and @len describe the frame that follows @vhdr.
+ *
+ * Returns false if the packet should be dropped.
+ */
+bool qemu_vnet_hdr_fixup(struct virtio_net_hdr *vhdr, uint8_t *data,
+                         size_t len, const NetOffloads *offloads)
+{
+    uint8_t gso_type = vhdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    if (gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        if (!offloads ||
+            (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && !offloads->tso4) ||
+            (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 && !offloads->tso6) ||
+            (gso_type != VIRTIO_NET_HDR_GSO_TCPV4 &&
+             gso_type != VIRTIO_NET_HDR_GSO_TCPV6) ||
+            ((vhdr->gso_type & VIRTIO_NET_HDR_GSO_ECN) && !offloads->ecn)) {
+            return false;
+        }
+    }
+
+    if ((vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        (!offloads || !offloads->csum)) {
+        uint16_t start = vhdr->csum_start;
+        uint16_t offset = vhdr->csum_offset;
+
+        if (start + offset + 2 > len) {
+            return false;
+        }
+        stw_be_p(data + start + offset,
+                 net_checksum_finish(net_checksum_add(len - start,
+                                                      data + start)));
+        vhdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+    return true;
+}
+
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 {
 #ifdef HOST_WORDS_BIGENDIAN
@@ -548,6 +597,30 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return !nc->peer || nc->peer->info->set_aio_context;
+}
+
+/*
+ * Move @nc and its peer to @ctx, or back to the main loop if @ctx is NULL.
+ * From then on packets between the two are passed in @ctx, and senders in
+ * other threads hold the AioContext lock.  The caller holds it too.
+ */
+int qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!qemu_can_set_aio_context(nc)) {
+        return -ENOSYS;
+    }
+
+    if (nc->peer) {
+        /* Moves the peer's fd handlers and updates nc->peer->ctx */
+        nc->peer->info->set_aio_context(nc->peer, ctx);
+    }
+    nc->ctx = ctx;
+    return 0;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -626,9 +699,23 @@ void qemu_purge_queued_packets(NetClientState *nc)
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
 }
 
+/*
+ * Tell @nc that the receive calls up to the next call with @start false
+ * come back to back, so that it can defer per-packet work such as guest
+ * notifications to the end of the batch.  Batches may nest.
+ */
+void qemu_receive_batch(NetClientState *nc, bool start)
+{
+    if (nc && nc->info->receive_batch) {
+        nc->info->receive_batch(nc, start);
+    }
+}
+
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_HUBPORT) {
@@ -636,7 +723,12 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+
+    qemu_receive_batch(nc, true);
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    qemu_receive_batch(nc, false);
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -669,22 +761,31 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    if (sender->ctx) {
+        aio_context_acquire(sender->ctx);
+    }
+
     /* Let filters handle the packet first */
     ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
                          sender, flags, buf, size, sent_cb);
     if (ret) {
-        return ret;
+        goto out;
     }
 
     ret = filter_receive(sender->peer, NET_FILTER_DIRECTION_RX,
                          sender, flags, buf, size, sent_cb);
     if (ret) {
-        return ret;
+        goto out;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
+    ret = qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
+out:
+    if (sender->ctx) {
+        aio_context_release(sender->ctx);
+    }
+    return ret;
 }
 
 ssize_t qemu_send_packet_async(NetClientState *sender,
@@ -758,9 +859,10 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_buf(NetClientState *sender,
+                                          const struct iovec *iov, int iovcnt,
+                                          NetPacketBuf **pbuf,
+                                          NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
@@ -769,24 +871,58 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
         return iov_size(iov, iovcnt);
     }
 
+    if (sender->ctx) {
+        aio_context_acquire(sender->ctx);
+    }
+
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
                              QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
     if (ret) {
-        return ret;
+        goto out;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
                              QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
     if (ret) {
-        return ret;
+        goto out;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
-                                   iov, iovcnt, sent_cb);
+    if (pbuf) {
+        ret = qemu_net_queue_send_buf(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      pbuf, iov, iovcnt, sent_cb);
+    } else {
+        ret = qemu_net_queue_send_iov(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, sent_cb);
+    }
+out:
+    if (sender->ctx) {
+        aio_context_release(sender->ctx);
+    }
+    return ret;
+}
+
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_buf(sender, iov, iovcnt, NULL, sent_cb);
+}
+
+/*
+ * Send the same packet from several clients in turn: receivers that have
+ * to queue it share *@pbuf, which is allocated the first time it is
+ * needed.  Release it with qemu_net_packet_buf_unref() after the last send.
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *nc,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketBuf **pbuf)
+{
+    return qemu_sendv_packet_async_buf(nc, iov, iovcnt, pbuf, NULL);
 }
 
 ssize_t
@@ -968,6 +1104,12 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
+#endif
+#ifdef CONFIG_POSIX
+        [NET_CLIENT_OPTIONS_KIND_IVSHMEM]   = net_init_ivshmem,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
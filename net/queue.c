@@ -25,6 +25,8 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -40,11 +42,32 @@
  * unbounded queueing.
  */
 
+/* Packets up to NET_QUEUE_POOL_PACKET_SIZE bytes, i.e. anything but GSO
+ * frames, are allocated at that size and recycled through a per-queue
+ * pool of at most NET_QUEUE_POOL_SIZE free packets, so that a burst of
+ * queued packets doesn't go through malloc for each of them.
+ */
+#define NET_QUEUE_POOL_SIZE         64
+#define NET_QUEUE_POOL_PACKET_SIZE  2048
+
+/* A packet payload that several queues hold references to, so that
+ * fanning a packet out to N receivers (e.g. the ports of a hub) copies
+ * it at most once rather than once per receiver that has to queue it.
+ * The payload is immutable once created.
+ */
+struct NetPacketBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    bool pooled;
+    NetPacketBuf *buf;
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
@@ -56,6 +79,8 @@ struct NetQueue {
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) pool;
+    uint32_t pool_count;
 
     unsigned delivering : 1;
 };
@@ -72,24 +97,92 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+NetPacketBuf *qemu_net_packet_buf_new(const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    NetPacketBuf *buf;
+
+    buf = g_malloc(sizeof(NetPacketBuf) + size);
+    buf->refcnt = 1;
+    buf->size = size;
+    iov_to_buf(iov, iovcnt, 0, buf->data, size);
+
+    return buf;
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (buf && atomic_fetch_dec(&buf->refcnt) == 1) {
+        g_free(buf);
+    }
+}
+
+static inline uint8_t *qemu_net_packet_data(NetPacket *packet)
+{
+    return packet->buf ? packet->buf->data : packet->data;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        qemu_net_packet_buf_unref(packet->buf);
+        g_free(packet);
+    }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
         g_free(packet);
     }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_QUEUE_POOL_PACKET_SIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pooled = false;
+        packet->buf = NULL;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + NET_QUEUE_POOL_PACKET_SIZE);
+        packet->pooled = true;
+        packet->buf = NULL;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->buf) {
+        qemu_net_packet_buf_unref(packet->buf);
+        packet->buf = NULL;
+    }
+    if (packet->pooled && queue->pool_count < NET_QUEUE_POOL_SIZE) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->pool_count++;
+    } else {
+        g_free(packet);
+    }
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -102,7 +195,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -131,7 +224,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -148,6 +241,36 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+/* Queue a reference to *@pbuf, creating it from @iov on first use */
+static void qemu_net_queue_append_buf(NetQueue *queue,
+                                      NetClientState *sender,
+                                      unsigned flags,
+                                      NetPacketBuf **pbuf,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+    if (!*pbuf) {
+        *pbuf = qemu_net_packet_buf_new(iov, iovcnt);
+    }
+
+    packet = qemu_net_queue_alloc_packet(queue, 0);
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags;
+    packet->size = (*pbuf)->size;
+    packet->buf = *pbuf;
+    atomic_inc(&(*pbuf)->refcnt);
+
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -232,6 +355,40 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Like qemu_net_queue_send_iov(), but if the packet has to be queued the
+ * queue takes a reference to *@pbuf instead of copying @iov.  *@pbuf is
+ * created on first use; the caller drops its own reference with
+ * qemu_net_packet_buf_unref() once it is done sending.
+ */
+ssize_t qemu_net_queue_send_buf(NetQueue *queue,
+                                NetClientState *sender,
+                                unsigned flags,
+                                NetPacketBuf **pbuf,
+                                const struct iovec *iov,
+                                int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_buf(queue, sender, flags, pbuf,
+                                  iov, iovcnt, sent_cb);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    if (ret == 0) {
+        qemu_net_queue_append_buf(queue, sender, flags, pbuf,
+                                  iov, iovcnt, sent_cb);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -243,7 +400,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -261,7 +418,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     qemu_net_packet_data(packet),
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
@@ -273,7 +430,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
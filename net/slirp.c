@@ -30,6 +30,7 @@
 #include <sys/wait.h>
 #endif
 #include "net/net.h"
+#include "net/checksum.h"
 #include "clients.h"
 #include "hub.h"
 #include "monitor/monitor.h"
@@ -38,6 +39,7 @@
 #include "slirp/libslirp.h"
 #include "slirp/ip6.h"
 #include "sysemu/char.h"
+#include "standard-headers/linux/virtio_net.h"
 
 static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 {
@@ -75,6 +77,9 @@ typedef struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
     Slirp *slirp;
+    bool vnet_hdr;              /* offer virtio-net headers to the peer */
+    bool using_vnet_hdr;        /* peer passes virtio-net headers */
+    bool tso4;                  /* peer segments large TCPv4 frames */
 #ifndef _WIN32
     char smb_dir[128];
 #endif
@@ -101,22 +106,141 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
+/*
+ * Slirp checks every checksum itself, so it only needs the guest to
+ * complete partial ones; segments of any size are fine.
+ */
+static const NetOffloads net_slirp_offloads = {
+    .tso4 = true,
+    .tso6 = true,
+    .ecn = true,
+};
+
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
     SlirpState *s = opaque;
+    struct virtio_net_hdr vhdr = {};
+    struct iovec iov[] = {
+        { .iov_base = &vhdr, .iov_len = sizeof(vhdr) },
+        { .iov_base = (uint8_t *)pkt, .iov_len = pkt_len },
+    };
+
+    if (s->using_vnet_hdr) {
+        qemu_sendv_packet(&s->nc, iov, ARRAY_SIZE(iov));
+    } else {
+        qemu_send_packet(&s->nc, pkt, pkt_len);
+    }
+}
+
+void slirp_output_gso(void *opaque, uint8_t *pkt, int pkt_len, int gso_size)
+{
+    SlirpState *s = opaque;
+    uint8_t *iph = pkt + ETH_HLEN;
+    int ihl = (iph[0] & 0xf) * 4;
+    uint8_t *th = iph + ihl;
+    int tcp_len = pkt_len - ETH_HLEN - ihl;
+    struct virtio_net_hdr vhdr = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = ETH_HLEN + ihl + (th[12] >> 4) * 4,
+        .gso_size = gso_size,
+        .csum_start = ETH_HLEN + ihl,
+        .csum_offset = 16,
+    };
+    struct iovec iov[] = {
+        { .iov_base = &vhdr, .iov_len = sizeof(vhdr) },
+        { .iov_base = pkt, .iov_len = pkt_len },
+    };
+    uint32_t sum;
+
+    /*
+     * The peer turned TSO off after slirp built this frame; drop it and
+     * let TCP retransmit at the normal segment size.
+     */
+    if (!s->using_vnet_hdr || !s->tso4) {
+        return;
+    }
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    /* Segmentation redoes the checksum, seeded with the pseudo-header */
+    sum = net_checksum_add(8, iph + 12) + IPPROTO_TCP + tcp_len;
+    stw_be_p(th + 16, (uint16_t)~net_checksum_finish(sum));
+
+    qemu_sendv_packet(&s->nc, iov, ARRAY_SIZE(iov));
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    struct virtio_net_hdr vhdr;
+    uint8_t *pkt;
+
+    if (!s->using_vnet_hdr) {
+        slirp_input(s->slirp, buf, size);
+        return size;
+    }
 
-    slirp_input(s->slirp, buf, size);
+    if (size < sizeof(vhdr)) {
+        return size;
+    }
+    memcpy(&vhdr, buf, sizeof(vhdr));
+    if (!vhdr.flags && vhdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        slirp_input(s->slirp, buf + sizeof(vhdr), size - sizeof(vhdr));
+        return size;
+    }
+
+    /* Completing the checksum writes to the frame */
+    pkt = g_memdup(buf + sizeof(vhdr), size - sizeof(vhdr));
+    if (qemu_vnet_hdr_fixup(&vhdr, pkt, size - sizeof(vhdr),
+                            &net_slirp_offloads)) {
+        slirp_input(s->slirp, pkt, size - sizeof(vhdr));
+    }
+    g_free(pkt);
 
     return size;
 }
 
+static bool net_slirp_has_ufo(NetClientState *nc)
+{
+    return false;
+}
+
+static bool net_slirp_has_vnet_hdr(NetClientState *nc)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool net_slirp_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    return s->vnet_hdr && len == sizeof(struct virtio_net_hdr);
+}
+
+static void net_slirp_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    assert(!enable || s->vnet_hdr);
+    s->using_vnet_hdr = enable;
+    slirp_set_tso(s->slirp, s->using_vnet_hdr && s->tso4);
+}
+
+static void net_slirp_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    assert(len == sizeof(struct virtio_net_hdr));
+}
+
+static void net_slirp_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    s->tso4 = csum && tso4;
+    slirp_set_tso(s->slirp, s->using_vnet_hdr && s->tso4);
+}
+
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
@@ -131,6 +255,12 @@ static NetClientInfo net_slirp_info = {
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
     .cleanup = net_slirp_cleanup,
+    .has_ufo = net_slirp_has_ufo,
+    .has_vnet_hdr = net_slirp_has_vnet_hdr,
+    .has_vnet_hdr_len = net_slirp_has_vnet_hdr_len,
+    .using_vnet_hdr = net_slirp_using_vnet_hdr,
+    .set_offload = net_slirp_set_offload,
+    .set_vnet_hdr_len = net_slirp_set_vnet_hdr_len,
 };
 
 static int net_slirp_init(NetClientState *peer, const char *model,
@@ -142,7 +272,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *vnameserver6,
                           const char *smb_export, const char *vsmbserver,
-                          const char **dnssearch)
+                          const char **dnssearch, bool vnet_hdr)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -307,6 +437,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
              restricted ? "on" : "off");
 
     s = DO_UPCAST(SlirpState, nc, nc);
+    s->vnet_hdr = vnet_hdr;
 
     s->slirp = slirp_init(restricted, net, mask, host,
                           ip6_prefix, vprefix6_len, ip6_host,
@@ -832,7 +963,8 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
                          user->ip6_host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart,
                          user->dns, user->ip6_dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch,
+                         user->has_vnet_hdr && user->vnet_hdr);
 
     while (slirp_configs) {
         config = slirp_configs;
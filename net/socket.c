@@ -32,6 +32,10 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "standard-headers/linux/virtio_net.h"
+
+/* Datagrams moved per recvmmsg()/sendmmsg() call */
+#define NET_SOCKET_MMSG_BATCH 16
 
 typedef struct NetSocketState {
     NetClientState nc;
@@ -46,6 +50,21 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    bool vnet_hdr;                /* frames carry a struct virtio_net_hdr */
+    bool using_vnet_hdr;          /* peer passes virtio-net headers */
+    NetOffloads offloads;         /* accepted by the peer */
+#ifdef CONFIG_MMSG
+    /* SOCK_DGRAM only: one buffer of NET_BUFSIZE bytes per message */
+    struct mmsghdr *rx_msgs;
+    struct iovec *rx_iov;
+    uint8_t *rx_bufs;
+    struct mmsghdr *tx_msgs;      /* ring of datagrams not sent yet */
+    struct iovec *tx_iov;
+    uint8_t *tx_bufs;
+    int tx_head;
+    int tx_count;
+    int tx_batch;                 /* nesting of receive batches */
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -53,10 +72,14 @@ static void net_socket_writable(void *opaque);
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? s->send_fn : NULL,
-                        s->write_poll ? net_socket_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll ? s->send_fn : NULL;
+    IOHandler *fd_write = s->write_poll ? net_socket_writable : NULL;
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void net_socket_read_poll(NetSocketState *s, bool enable)
@@ -71,33 +94,81 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+#ifdef CONFIG_MMSG
+/*
+ * Send the datagrams batched up by net_socket_receive_dgram_iov().  Returns
+ * false, with write polling enabled, if the socket can't take all of them.
+ */
+static bool net_socket_tx_flush(NetSocketState *s)
+{
+    while (s->tx_count) {
+        int count = MIN(s->tx_count, NET_SOCKET_MMSG_BATCH - s->tx_head);
+        int ret;
+
+        ret = sendmmsg(s->fd, s->tx_msgs + s->tx_head, count, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                net_socket_write_poll(s, true);
+                return false;
+            }
+            ret = 1; /* drop the datagram that failed, e.g. with EMSGSIZE */
+        }
+        s->tx_head = (s->tx_head + ret) % NET_SOCKET_MMSG_BATCH;
+        s->tx_count -= ret;
+    }
+    s->tx_head = 0;
+    return true;
+}
+#endif
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_MMSG
+    if (s->tx_count && !net_socket_tx_flush(s)) {
+        return;
+    }
+#endif
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Length of the header to add for a peer that doesn't pass one */
+static size_t net_socket_tx_hdr_len(NetSocketState *s)
+{
+    return s->vnet_hdr && !s->using_vnet_hdr ?
+           sizeof(struct virtio_net_hdr) : 0;
+}
+
+static ssize_t net_socket_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
-    uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
+    struct virtio_net_hdr vhdr = {};
+    size_t hdr_len = net_socket_tx_hdr_len(s);
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t len = htonl(hdr_len + size);
+    struct iovec *vec = alloca(sizeof(*vec) * (iovcnt + 2));
+    int cnt = 0;
     size_t remaining;
     ssize_t ret;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
+    vec[cnt].iov_base = &len;
+    vec[cnt++].iov_len = sizeof(len);
+    if (hdr_len) {
+        vec[cnt].iov_base = &vhdr;
+        vec[cnt++].iov_len = hdr_len;
+    }
+    memcpy(vec + cnt, iov, sizeof(*iov) * iovcnt);
+    cnt += iovcnt;
+
+    remaining = iov_size(vec, cnt) - s->send_index;
+    ret = iov_send(s->fd, vec, cnt, s->send_index, remaining);
 
     if (ret == -1 && errno == EAGAIN) {
         ret = 0; /* handled further down */
@@ -115,24 +186,121 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
-static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_iov(nc, &iov, 1);
+}
+
+static ssize_t net_socket_sendto_iov(NetSocketState *s,
+                                     const struct iovec *iov, int iovcnt)
 {
-    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
+#ifndef _WIN32
+    struct msghdr msg = {
+        .msg_name = &s->dgram_dst,
+        .msg_namelen = sizeof(s->dgram_dst),
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    do {
+        ret = sendmsg(s->fd, &msg, 0);
+    } while (ret == -1 && errno == EINTR);
+#else
+    uint8_t buf[NET_BUFSIZE];
+    size_t size = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
 
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
                           sizeof(s->dgram_dst));
     } while (ret == -1 && errno == EINTR);
+#endif
+    return ret;
+}
+
+static ssize_t net_socket_receive_dgram_iov(NetClientState *nc,
+                                            const struct iovec *iov,
+                                            int iovcnt)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct virtio_net_hdr vhdr = {};
+    size_t hdr_len = net_socket_tx_hdr_len(s);
+    size_t size = iov_size(iov, iovcnt);
+    struct iovec *vec;
+    int cnt = 0;
+    ssize_t ret;
 
+#ifdef CONFIG_MMSG
+    /* Within a batch, copy the datagram aside and send them all at once */
+    if (s->tx_batch && hdr_len + size <= NET_BUFSIZE) {
+        int slot;
+
+        if (s->tx_count == NET_SOCKET_MMSG_BATCH && !net_socket_tx_flush(s)) {
+            return 0;
+        }
+        slot = (s->tx_head + s->tx_count) % NET_SOCKET_MMSG_BATCH;
+        memset(s->tx_iov[slot].iov_base, 0, hdr_len);
+        iov_to_buf(iov, iovcnt, 0,
+                   (uint8_t *)s->tx_iov[slot].iov_base + hdr_len, size);
+        s->tx_iov[slot].iov_len = hdr_len + size;
+        s->tx_count++;
+        return size;
+    }
+    if (s->tx_count && !net_socket_tx_flush(s)) {
+        return 0;
+    }
+#endif
+
+    vec = alloca(sizeof(*vec) * (iovcnt + 1));
+    if (hdr_len) {
+        vec[cnt].iov_base = &vhdr;
+        vec[cnt++].iov_len = hdr_len;
+    }
+    memcpy(vec + cnt, iov, sizeof(*iov) * iovcnt);
+    cnt += iovcnt;
+
+    ret = net_socket_sendto_iov(s, vec, cnt);
     if (ret == -1 && errno == EAGAIN) {
         net_socket_write_poll(s, true);
         return 0;
     }
-    return ret;
+    return ret < 0 ? ret : size;
 }
 
+static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_dgram_iov(nc, &iov, 1);
+}
+
+#ifdef CONFIG_MMSG
+/* Send the datagrams from a batch of packets with a single sendmmsg() */
+static void net_socket_receive_batch(NetClientState *nc, bool start)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (start) {
+        s->tx_batch++;
+        return;
+    }
+
+    assert(s->tx_batch > 0);
+    if (--s->tx_batch == 0 && s->tx_count) {
+        net_socket_tx_flush(s);
+    }
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -142,6 +310,31 @@ static void net_socket_send_completed(NetClientState *nc, ssize_t len)
     }
 }
 
+/*
+ * Pass a frame from the network to the peer, after checking its virtio-net
+ * header against what the peer accepts and, if the peer doesn't take
+ * headers, stripping it.
+ */
+static ssize_t net_socket_deliver(NetSocketState *s, uint8_t *buf, size_t size)
+{
+    if (s->vnet_hdr) {
+        struct virtio_net_hdr *vhdr = (struct virtio_net_hdr *)buf;
+
+        if (size < sizeof(*vhdr) ||
+            !qemu_vnet_hdr_fixup(vhdr, buf + sizeof(*vhdr),
+                                 size - sizeof(*vhdr),
+                                 s->using_vnet_hdr ? &s->offloads : NULL)) {
+            return size;
+        }
+        if (!s->using_vnet_hdr) {
+            buf += sizeof(*vhdr);
+            size -= sizeof(*vhdr);
+        }
+    }
+    return qemu_send_packet_async(&s->nc, buf, size,
+                                  net_socket_send_completed);
+}
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -212,8 +405,7 @@ static void net_socket_send(void *opaque)
             if (s->index >= s->packet_len) {
                 s->index = 0;
                 s->state = 0;
-                if (qemu_send_packet_async(&s->nc, s->buf, s->packet_len,
-                                           net_socket_send_completed) == 0) {
+                if (net_socket_deliver(s, s->buf, s->packet_len) == 0) {
                     net_socket_read_poll(s, false);
                     break;
                 }
@@ -223,6 +415,64 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_MMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    bool queued = false;
+    int count, i;
+
+    do {
+        count = recvmmsg(s->fd, s->rx_msgs, NET_SOCKET_MMSG_BATCH,
+                         MSG_DONTWAIT, NULL);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        return;
+    }
+
+    /* Once the peer queues a packet, it queues the rest of the batch
+     * behind it, so they stay in order.
+     */
+    qemu_receive_batch(s->nc.peer, true);
+    for (i = 0; i < count; i++) {
+        if (s->rx_msgs[i].msg_len &&
+            net_socket_deliver(s, s->rx_iov[i].iov_base,
+                               s->rx_msgs[i].msg_len) == 0) {
+            queued = true;
+        }
+    }
+    qemu_receive_batch(s->nc.peer, false);
+
+    if (queued) {
+        net_socket_read_poll(s, false);
+    }
+}
+
+static void net_socket_mmsg_init(NetSocketState *s)
+{
+    int i;
+
+    s->rx_msgs = g_new0(struct mmsghdr, NET_SOCKET_MMSG_BATCH);
+    s->rx_iov = g_new(struct iovec, NET_SOCKET_MMSG_BATCH);
+    s->rx_bufs = g_malloc(NET_SOCKET_MMSG_BATCH * NET_BUFSIZE);
+    s->tx_msgs = g_new0(struct mmsghdr, NET_SOCKET_MMSG_BATCH);
+    s->tx_iov = g_new(struct iovec, NET_SOCKET_MMSG_BATCH);
+    s->tx_bufs = g_malloc(NET_SOCKET_MMSG_BATCH * NET_BUFSIZE);
+
+    for (i = 0; i < NET_SOCKET_MMSG_BATCH; i++) {
+        s->rx_iov[i].iov_base = s->rx_bufs + i * NET_BUFSIZE;
+        s->rx_iov[i].iov_len = NET_BUFSIZE;
+        s->rx_msgs[i].msg_hdr.msg_iov = &s->rx_iov[i];
+        s->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+
+        s->tx_iov[i].iov_base = s->tx_bufs + i * NET_BUFSIZE;
+        s->tx_msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+        s->tx_msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        s->tx_msgs[i].msg_hdr.msg_iov = &s->tx_iov[i];
+        s->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -237,11 +487,11 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_write_poll(s, false);
         return;
     }
-    if (qemu_send_packet_async(&s->nc, s->buf, size,
-                               net_socket_send_completed) == 0) {
+    if (net_socket_deliver(s, s->buf, size) == 0) {
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -342,19 +592,99 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_MMSG
+    g_free(s->rx_msgs);
+    g_free(s->rx_iov);
+    g_free(s->rx_bufs);
+    g_free(s->tx_msgs);
+    g_free(s->tx_iov);
+    g_free(s->tx_bufs);
+#endif
+}
+
+static bool net_socket_has_ufo(NetClientState *nc)
+{
+    return false;
+}
+
+static bool net_socket_has_vnet_hdr(NetClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    return s->vnet_hdr;
+}
+
+static bool net_socket_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    return s->vnet_hdr && len == sizeof(struct virtio_net_hdr);
+}
+
+static void net_socket_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    assert(!enable || s->vnet_hdr);
+    s->using_vnet_hdr = enable;
+}
+
+static void net_socket_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    assert(len == sizeof(struct virtio_net_hdr));
+}
+
+static void net_socket_set_offload(NetClientState *nc, int csum, int tso4,
+                                   int tso6, int ecn, int ufo)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    s->offloads.csum = csum;
+    s->offloads.tso4 = tso4;
+    s->offloads.tso6 = tso6;
+    s->offloads.ecn = ecn;
+}
+
+/*
+ * Only datagram sockets can move to an IOThread: stream sockets accept and
+ * reconnect from the main loop.
+ */
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    bool read_poll = s->read_poll, write_poll = s->write_poll;
+
+    s->read_poll = s->write_poll = false;
+    net_socket_update_fd_handler(s);
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    nc->ctx = ctx;
+    net_socket_update_fd_handler(s);
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+    .receive_iov = net_socket_receive_dgram_iov,
+#ifdef CONFIG_MMSG
+    .receive_batch = net_socket_receive_batch,
+#endif
     .cleanup = net_socket_cleanup,
+    .has_ufo = net_socket_has_ufo,
+    .has_vnet_hdr = net_socket_has_vnet_hdr,
+    .has_vnet_hdr_len = net_socket_has_vnet_hdr_len,
+    .using_vnet_hdr = net_socket_using_vnet_hdr,
+    .set_offload = net_socket_set_offload,
+    .set_vnet_hdr_len = net_socket_set_vnet_hdr_len,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
                                                 const char *model,
                                                 const char *name,
-                                                int fd, int is_connected)
+                                                int fd, int is_connected,
+                                                bool vnet_hdr)
 {
     struct sockaddr_in saddr;
     int newfd;
@@ -399,6 +729,10 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
 
     s->fd = fd;
     s->listen_fd = -1;
+    s->vnet_hdr = vnet_hdr;
+#ifdef CONFIG_MMSG
+    net_socket_mmsg_init(s);
+#endif
     s->send_fn = net_socket_send_dgram;
     net_socket_read_poll(s, true);
 
@@ -431,13 +765,21 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_iov = net_socket_receive_iov,
     .cleanup = net_socket_cleanup,
+    .has_ufo = net_socket_has_ufo,
+    .has_vnet_hdr = net_socket_has_vnet_hdr,
+    .has_vnet_hdr_len = net_socket_has_vnet_hdr_len,
+    .using_vnet_hdr = net_socket_using_vnet_hdr,
+    .set_offload = net_socket_set_offload,
+    .set_vnet_hdr_len = net_socket_set_vnet_hdr_len,
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
                                                  const char *model,
                                                  const char *name,
-                                                 int fd, int is_connected)
+                                                 int fd, int is_connected,
+                                                 bool vnet_hdr)
 {
     NetClientState *nc;
     NetSocketState *s;
@@ -450,6 +792,7 @@ static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
 
     s->fd = fd;
     s->listen_fd = -1;
+    s->vnet_hdr = vnet_hdr;
 
     /* Disable Nagle algorithm on TCP sockets to reduce latency */
     socket_set_nodelay(fd);
@@ -464,7 +807,8 @@ static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
 
 static NetSocketState *net_socket_fd_init(NetClientState *peer,
                                           const char *model, const char *name,
-                                          int fd, int is_connected)
+                                          int fd, int is_connected,
+                                          bool vnet_hdr)
 {
     int so_type = -1, optlen=sizeof(so_type);
 
@@ -477,13 +821,16 @@ static NetSocketState *net_socket_fd_init(NetClientState *peer,
     }
     switch(so_type) {
     case SOCK_DGRAM:
-        return net_socket_fd_init_dgram(peer, model, name, fd, is_connected);
+        return net_socket_fd_init_dgram(peer, model, name, fd, is_connected,
+                                        vnet_hdr);
     case SOCK_STREAM:
-        return net_socket_fd_init_stream(peer, model, name, fd, is_connected);
+        return net_socket_fd_init_stream(peer, model, name, fd, is_connected,
+                                         vnet_hdr);
     default:
         /* who knows ... this could be a eg. a pty, do warn and continue as stream */
         fprintf(stderr, "qemu: warning: socket type=%d for fd=%d is not SOCK_DGRAM or SOCK_STREAM\n", so_type, fd);
-        return net_socket_fd_init_stream(peer, model, name, fd, is_connected);
+        return net_socket_fd_init_stream(peer, model, name, fd, is_connected,
+                                         vnet_hdr);
     }
     return NULL;
 }
@@ -517,7 +864,8 @@ static void net_socket_accept(void *opaque)
 static int net_socket_listen_init(NetClientState *peer,
                                   const char *model,
                                   const char *name,
-                                  const char *host_str)
+                                  const char *host_str,
+                                  bool vnet_hdr)
 {
     NetClientState *nc;
     NetSocketState *s;
@@ -554,6 +902,7 @@ static int net_socket_listen_init(NetClientState *peer,
     s->fd = -1;
     s->listen_fd = fd;
     s->nc.link_down = true;
+    s->vnet_hdr = vnet_hdr;
 
     qemu_set_fd_handler(s->listen_fd, net_socket_accept, NULL, s);
     return 0;
@@ -562,7 +911,8 @@ static int net_socket_listen_init(NetClientState *peer,
 static int net_socket_connect_init(NetClientState *peer,
                                    const char *model,
                                    const char *name,
-                                   const char *host_str)
+                                   const char *host_str,
+                                   bool vnet_hdr)
 {
     NetSocketState *s;
     int fd, connected, ret;
@@ -598,7 +948,7 @@ static int net_socket_connect_init(NetClientState *peer,
             break;
         }
     }
-    s = net_socket_fd_init(peer, model, name, fd, connected);
+    s = net_socket_fd_init(peer, model, name, fd, connected, vnet_hdr);
     if (!s)
         return -1;
     snprintf(s->nc.info_str, sizeof(s->nc.info_str),
@@ -611,7 +961,8 @@ static int net_socket_mcast_init(NetClientState *peer,
                                  const char *model,
                                  const char *name,
                                  const char *host_str,
-                                 const char *localaddr_str)
+                                 const char *localaddr_str,
+                                 bool vnet_hdr)
 {
     NetSocketState *s;
     int fd;
@@ -633,7 +984,7 @@ static int net_socket_mcast_init(NetClientState *peer,
     if (fd < 0)
         return -1;
 
-    s = net_socket_fd_init(peer, model, name, fd, 0);
+    s = net_socket_fd_init(peer, model, name, fd, 0, vnet_hdr);
     if (!s)
         return -1;
 
@@ -650,7 +1001,8 @@ static int net_socket_udp_init(NetClientState *peer,
                                  const char *model,
                                  const char *name,
                                  const char *rhost,
-                                 const char *lhost)
+                                 const char *lhost,
+                                 bool vnet_hdr)
 {
     NetSocketState *s;
     int fd, ret;
@@ -683,7 +1035,7 @@ static int net_socket_udp_init(NetClientState *peer,
     }
     qemu_set_nonblock(fd);
 
-    s = net_socket_fd_init(peer, model, name, fd, 0);
+    s = net_socket_fd_init(peer, model, name, fd, 0, vnet_hdr);
     if (!s) {
         return -1;
     }
@@ -702,9 +1054,11 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
     /* FIXME error_setg(errp, ...) on failure */
     Error *err = NULL;
     const NetdevSocketOptions *sock;
+    bool vnet_hdr;
 
     assert(opts->type == NET_CLIENT_OPTIONS_KIND_SOCKET);
     sock = opts->u.socket;
+    vnet_hdr = sock->has_vnet_hdr && sock->vnet_hdr;
 
     if (sock->has_fd + sock->has_listen + sock->has_connect + sock->has_mcast +
         sock->has_udp != 1) {
@@ -727,22 +1081,23 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
             return -1;
         }
         qemu_set_nonblock(fd);
-        if (!net_socket_fd_init(peer, "socket", name, fd, 1)) {
+        if (!net_socket_fd_init(peer, "socket", name, fd, 1, vnet_hdr)) {
             return -1;
         }
         return 0;
     }
 
     if (sock->has_listen) {
-        if (net_socket_listen_init(peer, "socket", name, sock->listen) == -1) {
+        if (net_socket_listen_init(peer, "socket", name, sock->listen,
+                                   vnet_hdr) == -1) {
             return -1;
         }
         return 0;
     }
 
     if (sock->has_connect) {
-        if (net_socket_connect_init(peer, "socket", name, sock->connect) ==
-            -1) {
+        if (net_socket_connect_init(peer, "socket", name, sock->connect,
+                                    vnet_hdr) == -1) {
             return -1;
         }
         return 0;
@@ -752,7 +1107,7 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
         /* if sock->localaddr is missing, it has been initialized to "all bits
          * zero" */
         if (net_socket_mcast_init(peer, "socket", name, sock->mcast,
-            sock->localaddr) == -1) {
+            sock->localaddr, vnet_hdr) == -1) {
             return -1;
         }
         return 0;
@@ -763,8 +1118,8 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
         error_report("localaddr= is mandatory with udp=");
         return -1;
     }
-    if (net_socket_udp_init(peer, "socket", name, sock->udp, sock->localaddr) ==
-        -1) {
+    if (net_socket_udp_init(peer, "socket", name, sock->udp, sock->localaddr,
+                            vnet_hdr) == -1) {
         return -1;
     }
     return 0;
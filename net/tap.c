@@ -66,10 +66,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -182,6 +186,7 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    qemu_receive_batch(s->nc.peer, true);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -214,6 +219,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_receive_batch(s->nc.peer, false);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -322,6 +328,19 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool enabled = s->enabled;
+
+    /* Drop the handlers from the old context before moving the fd */
+    s->enabled = false;
+    tap_update_fd_handler(s);
+    s->enabled = enabled;
+    nc->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -347,6 +366,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
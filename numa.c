@@ -139,6 +139,78 @@ uint32_t numa_get_node(ram_addr_t addr, Error **errp)
     return -1;
 }
 
+/* Called right after the thread of @cpu has been created */
+void numa_cpu_set_affinity(CPUState *cpu)
+{
+    int i, ret;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(cpu->cpu_index, numa_info[i].node_cpu)) {
+            break;
+        }
+    }
+    if (i == nb_numa_nodes || !numa_info[i].has_host_cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(cpu->thread, numa_info[i].host_cpus,
+                                   QEMU_THREAD_MAX_CPUS);
+    if (ret < 0) {
+        error_report("Cannot set the host CPU affinity of VCPU %d: %s",
+                     cpu->cpu_index, strerror(-ret));
+    }
+}
+
+/*
+ * With both host-cpus and host-node, the VCPUs run on the CPUs of the host
+ * node that are also in host-cpus.
+ */
+static bool numa_node_parse_host_cpus(NumaNodeOptions *node, NodeInfo *info,
+                                      Error **errp)
+{
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_CPUS);
+    uint16List *cpus;
+    int ret;
+
+    if (!node->has_host_cpus && !node->has_host_node) {
+        return true;
+    }
+
+    bitmap_zero(info->host_cpus, QEMU_THREAD_MAX_CPUS);
+    for (cpus = node->host_cpus; cpus; cpus = cpus->next) {
+        if (cpus->value >= QEMU_THREAD_MAX_CPUS) {
+            error_setg(errp, "Host CPU index (%" PRIu16 ") should be smaller "
+                       "than %d", cpus->value, QEMU_THREAD_MAX_CPUS);
+            return false;
+        }
+        set_bit(cpus->value, info->host_cpus);
+    }
+
+    if (node->has_host_node) {
+        bitmap_zero(host_cpus, QEMU_THREAD_MAX_CPUS);
+        ret = qemu_host_node_get_cpus(node->host_node, host_cpus,
+                                      QEMU_THREAD_MAX_CPUS);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Cannot get the CPUs of host NUMA "
+                             "node %" PRIu16, node->host_node);
+            return false;
+        }
+        if (node->has_host_cpus) {
+            bitmap_and(info->host_cpus, info->host_cpus, host_cpus,
+                       QEMU_THREAD_MAX_CPUS);
+        } else {
+            bitmap_copy(info->host_cpus, host_cpus, QEMU_THREAD_MAX_CPUS);
+        }
+    }
+
+    if (bitmap_empty(info->host_cpus, QEMU_THREAD_MAX_CPUS)) {
+        error_setg(errp, "No host CPU left for the VCPUs of the NUMA node");
+        return false;
+    }
+    info->has_host_cpus = true;
+    return true;
+}
+
 static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
 {
     uint16_t nodenr;
@@ -207,6 +279,9 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         numa_info[nodenr].node_mem = object_property_get_int(o, "size", NULL);
         numa_info[nodenr].node_memdev = MEMORY_BACKEND(o);
     }
+    if (!numa_node_parse_host_cpus(node, &numa_info[nodenr], errp)) {
+        return;
+    }
     numa_info[nodenr].present = true;
     max_numa_nodeid = MAX(max_numa_nodeid, nodenr + 1);
 }
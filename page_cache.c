@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is N-way set associative, sets are selected by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,11 +29,18 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Number of ways per set; a page can live in any way of its set */
+#define CACHE_WAYS 8
+
+/* Hit counts saturate here, so that they can still be aged */
+#define CACHE_MAX_HITS 255
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
@@ -43,6 +50,9 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    /* max_num_items == num_sets * num_ways, both powers of 2 */
+    int64_t num_sets;
+    unsigned int num_ways;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,8 +81,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -86,6 +99,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -108,31 +122,76 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first way of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Choose the way of @set that receives a new page: a free way if there is
+ * one, otherwise the page with the fewest hits among those that were not
+ * used in the last CACHED_PAGE_LIFETIME generations, the least recently
+ * used one in case of a tie.  Returns NULL if all pages are fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, CacheItem *set,
+                                   uint64_t current_age)
+{
+    CacheItem *victim = NULL;
+    unsigned int i;
 
-    pos = cache_get_cache_pos(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
 
-    return &cache->page_cache[pos];
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim || it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+
+    if (victim) {
+        /* Age the hit counts, so that pages that used to be hot but aren't
+         * anymore eventually make room for others.
+         */
+        for (i = 0; i < cache->num_ways; i++) {
+            set[i].it_hits >>= 1;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -142,9 +201,12 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
@@ -155,15 +217,21 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 {
 
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set(cache, addr), current_age);
+        if (!it) {
+            return -1;
+        }
+        if (it->it_data) {
+            ret = 1;
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -179,15 +247,17 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     it->it_age = current_age;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
+    CacheItem *set, *new_it;
     int64_t i;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it;
 
     g_assert(cache);
 
@@ -210,28 +280,39 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+        if (!old_it->it_data) {
+            continue;
+        }
+
+        /* if the set is full, keep the MRU pages */
+        set = cache_get_set(new_cache, old_it->it_addr);
+        new_it = NULL;
+        for (j = 0; j < new_cache->num_ways; j++) {
+            if (!set[j].it_data) {
+                new_it = &set[j];
+                break;
+            }
+            if (!new_it || set[j].it_age < new_it->it_age) {
+                new_it = &set[j];
             }
         }
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        if (!new_it->it_data) {
+            new_cache->num_items++;
+        }
+        g_free(new_it->it_data);
+        *new_it = *old_it;
     }
 
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
 
     g_free(new_cache);
 
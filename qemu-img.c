@@ -36,6 +36,8 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include <getopt.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION QEMU_PKGVERSION \
@@ -51,6 +53,11 @@ enum {
     OPTION_BACKING_CHAIN = 257,
     OPTION_OBJECT = 258,
     OPTION_IMAGE_OPTS = 259,
+    OPTION_PATTERN = 260,
+    OPTION_FLUSH_INTERVAL = 261,
+    OPTION_NO_DRAIN = 262,
+    OPTION_RANDOM = 263,
+    OPTION_READ_PERCENT = 264,
 };
 
 typedef enum OutputFormat {
@@ -137,6 +144,11 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allows to write to the target out of order rather than sequential\n"
+           "  '-C' offloads copying to the host where possible (for example with\n"
+           "       copy_file_range), no sparse detection is done for the copied data\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1043,6 +1055,13 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
+    /* Most sectors usually match; a single memcmp() over the whole buffer
+     * is much faster than one call per sector */
+    if (!memcmp(buf1, buf2, n * 512)) {
+        *pnum = n;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
         buf1 += 512;
@@ -1418,6 +1437,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1425,24 +1446,37 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1451,7 +1485,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1503,30 +1537,33 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
-
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1539,15 +1576,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1556,16 +1596,28 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             break;
 
         case BLK_DATA:
-            /* We must always write compressed clusters as a whole, so don't
-             * try to find zeroed parts in the buffer. We can only save the
-             * write if the buffer is completely zeroed and we're allowed to
-             * keep the target sparse. */
+            /* We must always write compressed clusters as a whole, so only
+             * look for completely zeroed clusters, and only if we're allowed
+             * to keep the target sparse. Runs of data clusters are passed to
+             * the driver in one go, so that it can compress them in
+             * parallel. */
             if (s->compressed) {
-                if (s->has_zero_init && s->min_sparse &&
-                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
-                {
-                    assert(!s->target_has_backing);
-                    break;
+                if (s->has_zero_init && s->min_sparse) {
+                    int zero_sectors;
+
+                    n = MIN(n, s->cluster_sectors);
+                    if (buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
+                        assert(!s->target_has_backing);
+                        break;
+                    }
+                    while (n < nb_sectors) {
+                        zero_sectors = MIN(nb_sectors - n, s->cluster_sectors);
+                        if (buffer_is_zero(buf + n * BDRV_SECTOR_SIZE,
+                                           zero_sectors * BDRV_SECTOR_SIZE)) {
+                            break;
+                        }
+                        n += zero_sectors;
+                    }
                 }
 
                 ret = blk_write_compressed(s->target, sector_num, buf, n);
@@ -1581,7 +1633,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1593,7 +1649,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1608,11 +1664,154 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
 {
-    uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
+    int n;
     int ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(blk, sector_num - src_cur_offset,
+                                s->target, sector_num, n, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+        bool copy_range;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Save the current sector and allocation status, and advance the
+         * global position so that other coroutines can already continue
+         * reading beyond this request */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+retry:
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA && !copy_range) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS && copy_range) {
+            ret = convert_co_copy_range(s, sector_num, n);
+            if (ret < 0) {
+                /* Not supported by the images, or an I/O error that the
+                 * ordinary path will report; either way don't try again */
+                s->copy_range = false;
+                goto retry;
+            }
+        } else if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /*
+                     * A -> B -> A cannot occur because A has
+                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                     * B will never enter A during this time window.
+                     */
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1629,17 +1828,14 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* For compressed images, only whole clusters can be copied. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1647,8 +1843,7 @@ static int convert_do_copy(ImgConvertState *s)
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1657,54 +1852,33 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    while (s->running_coroutines) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
 
-        sector_num += n;
+    if (s->ret) {
+        return s->ret;
     }
 
     if (s->compressed) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return 0;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1731,6 +1905,9 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    bool copy_range = false;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1746,7 +1923,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:Cce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1765,6 +1942,9 @@ static int img_convert(int argc, char **argv)
         case 'B':
             out_baseimg = optarg;
             break;
+        case 'C':
+            copy_range = true;
+            break;
         case 'c':
             compress = 1;
             break;
@@ -1838,6 +2018,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1851,6 +2043,18 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
+    if (copy_range && compress) {
+        error_report("Copy offloading and compression are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, &local_err)) {
@@ -2101,6 +2305,10 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        /* Compressed clusters are appended to the image in write order */
+        .wr_in_order        = wr_in_order || compress,
+        .copy_range         = copy_range && !compress,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -2772,11 +2980,246 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+#define REBASE_COROUTINES 8
+
+typedef struct ImgRebaseState {
+    BlockBackend *blk;
+    BlockBackend *old_backing;
+    BlockBackend *new_backing;
+    /* the new backing file, if it is part of the old backing chain */
+    BlockDriverState *prefix_chain_bs;
+    int64_t num_sectors;
+    int64_t old_backing_num_sectors;
+    int64_t new_backing_num_sectors;
+    int64_t sector_num;
+    int64_t sectors_done;
+    int running_coroutines;
+    CoMutex lock;
+    int ret;
+} ImgRebaseState;
+
+/*
+ * Returns the image in the backing chain of @bs that @filename refers to and
+ * that is opened with the same driver as @new_backing, or NULL.
+ */
+static BlockDriverState *rebase_find_in_chain(BlockDriverState *bs,
+                                              const char *filename,
+                                              BlockBackend *new_backing)
+{
+    char filename_full[PATH_MAX], chain_full[PATH_MAX];
+    BlockDriverState *p;
+
+    if (path_has_protocol(filename) || !realpath(filename, filename_full)) {
+        return NULL;
+    }
+
+    for (p = backing_bs(bs); p; p = backing_bs(p)) {
+        if (p->drv != blk_bs(new_backing)->drv ||
+            path_has_protocol(p->filename)) {
+            continue;
+        }
+        if (realpath(p->filename, chain_full) &&
+            !strcmp(filename_full, chain_full)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns 1 if the sectors starting at @sector_num read as zeroes from @blk,
+ * 0 if they may not and -errno on error.  *@pnum is set to the number of
+ * sectors for which this holds.  Sectors beyond @blk_sectors, or all sectors
+ * if there is no @blk, read as zeroes.
+ */
+static int coroutine_fn rebase_co_is_zero(BlockBackend *blk,
+                                          int64_t blk_sectors,
+                                          int64_t sector_num, int nb_sectors,
+                                          int *pnum)
+{
+    BlockDriverState *file;
+    int64_t ret;
+
+    if (!blk || sector_num >= blk_sectors) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    nb_sectors = MIN(nb_sectors, blk_sectors - sector_num);
+    ret = bdrv_get_block_status_above(blk_bs(blk), NULL, sector_num,
+                                      nb_sectors, pnum, &file);
+    if (ret < 0) {
+        return ret;
+    }
+    return !!(ret & BDRV_BLOCK_ZERO);
+}
+
+/*
+ * Returns the number of sectors starting at @sector_num that can be handled
+ * together, and sets *@skip if they cannot differ between the old and the new
+ * backing file as seen through the image.
+ */
+static int coroutine_fn rebase_co_iteration(ImgRebaseState *s,
+                                            int64_t sector_num,
+                                            bool *old_zero, bool *new_zero,
+                                            bool *skip)
+{
+    BlockDriverState *bs = blk_bs(s->blk);
+    int n = MIN(s->num_sectors - sector_num, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+    int ret;
+
+    /* If the cluster is allocated, we don't need to take action */
+    ret = bdrv_is_allocated(bs, sector_num, n, &n);
+    if (ret < 0) {
+        return ret;
+    } else if (ret) {
+        *skip = true;
+        return n;
+    }
+
+    /* If the new backing file is part of the old backing chain, only the
+     * images between the two can make a difference */
+    if (s->prefix_chain_bs) {
+        ret = bdrv_is_allocated_above(backing_bs(bs), s->prefix_chain_bs,
+                                      sector_num, n, &n);
+        if (ret < 0) {
+            return ret;
+        } else if (!ret) {
+            *skip = true;
+            return n;
+        }
+    }
+
+    /* Zeroes on both sides need not be read to know they are the same */
+    ret = rebase_co_is_zero(s->old_backing, s->old_backing_num_sectors,
+                            sector_num, n, &n);
+    if (ret < 0) {
+        return ret;
+    }
+    *old_zero = ret;
+
+    ret = rebase_co_is_zero(s->new_backing, s->new_backing_num_sectors,
+                            sector_num, n, &n);
+    if (ret < 0) {
+        return ret;
+    }
+    *new_zero = ret;
+
+    *skip = *old_zero && *new_zero;
+    return n;
+}
+
+static int coroutine_fn rebase_co_read(BlockBackend *blk, int64_t sector_num,
+                                       int nb_sectors, uint8_t *buf, bool zero)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    if (zero) {
+        memset(buf, 0, nb_sectors * BDRV_SECTOR_SIZE);
+        return 0;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return blk_co_readv(blk, sector_num, nb_sectors, &qiov);
+}
+
+/*
+ * Any number of these run at the same time.  Each one takes the next range
+ * of the image, compares it between the old and the new backing file, and
+ * copies what differs into the image.  Ranges are independent of each other,
+ * so the writes need not be ordered.
+ */
+static void coroutine_fn rebase_co_do_compare(void *opaque)
+{
+    ImgRebaseState *s = opaque;
+    uint8_t *buf_old, *buf_new;
+    int ret;
+
+    s->running_coroutines++;
+    buf_old = blk_blockalign(s->blk, IO_BUF_SIZE);
+    buf_new = blk_blockalign(s->blk, IO_BUF_SIZE);
+
+    while (1) {
+        int64_t sector_num;
+        int n, written, pnum;
+        bool old_zero = false, new_zero = false, skip;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->num_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = rebase_co_iteration(s, s->sector_num, &old_zero, &new_zero, &skip);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading image metadata: %s",
+                         strerror(-n));
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (skip) {
+            goto done;
+        }
+
+        ret = rebase_co_read(s->old_backing, sector_num, n, buf_old, old_zero);
+        if (ret < 0) {
+            error_report("error while reading from old backing file");
+            s->ret = ret;
+            break;
+        }
+        ret = rebase_co_read(s->new_backing, sector_num, n, buf_new, new_zero);
+        if (ret < 0) {
+            error_report("error while reading from new backing file");
+            s->ret = ret;
+            break;
+        }
+
+        /* If they differ, we need to write to the COW file */
+        for (written = 0; written < n; written += pnum) {
+            if (compare_sectors(buf_old + written * BDRV_SECTOR_SIZE,
+                                buf_new + written * BDRV_SECTOR_SIZE,
+                                n - written, &pnum))
+            {
+                QEMUIOVector qiov;
+                struct iovec iov = {
+                    .iov_base = buf_old + written * BDRV_SECTOR_SIZE,
+                    .iov_len = pnum * BDRV_SECTOR_SIZE,
+                };
+
+                qemu_iovec_init_external(&qiov, &iov, 1);
+                ret = blk_co_writev(s->blk, sector_num + written, pnum, &qiov);
+                if (ret < 0) {
+                    error_report("Error while writing to COW image: %s",
+                                 strerror(-ret));
+                    s->ret = ret;
+                    break;
+                }
+            }
+        }
+
+done:
+        s->sectors_done += n;
+        qemu_progress_print(100.0 * s->sectors_done / s->num_sectors, 0);
+    }
+
+    qemu_vfree(buf_old);
+    qemu_vfree(buf_new);
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockBackend *blk = NULL, *blk_old_backing = NULL, *blk_new_backing = NULL;
-    uint8_t *buf_old = NULL;
-    uint8_t *buf_new = NULL;
     BlockDriverState *bs = NULL;
     char *filename;
     const char *fmt, *cache, *src_cache, *out_basefmt, *out_baseimg;
@@ -2954,121 +3397,57 @@ static int img_rebase(int argc, char **argv)
      * the image is the same as the original one at any time.
      */
     if (!unsafe) {
-        int64_t num_sectors;
-        int64_t old_backing_num_sectors;
-        int64_t new_backing_num_sectors = 0;
-        uint64_t sector;
-        int n;
-        float local_progress = 0;
-
-        buf_old = blk_blockalign(blk, IO_BUF_SIZE);
-        buf_new = blk_blockalign(blk, IO_BUF_SIZE);
+        ImgRebaseState s = {
+            .blk            = blk,
+            .old_backing    = blk_old_backing,
+            .new_backing    = blk_new_backing,
+            .ret            = -EINPROGRESS,
+        };
+        int i;
 
-        num_sectors = blk_nb_sectors(blk);
-        if (num_sectors < 0) {
+        s.num_sectors = blk_nb_sectors(blk);
+        if (s.num_sectors < 0) {
             error_report("Could not get size of '%s': %s",
-                         filename, strerror(-num_sectors));
+                         filename, strerror(-s.num_sectors));
             ret = -1;
             goto out;
         }
-        old_backing_num_sectors = blk_nb_sectors(blk_old_backing);
-        if (old_backing_num_sectors < 0) {
+        s.old_backing_num_sectors = blk_nb_sectors(blk_old_backing);
+        if (s.old_backing_num_sectors < 0) {
             char backing_name[PATH_MAX];
 
             bdrv_get_backing_filename(bs, backing_name, sizeof(backing_name));
             error_report("Could not get size of '%s': %s",
-                         backing_name, strerror(-old_backing_num_sectors));
+                         backing_name, strerror(-s.old_backing_num_sectors));
             ret = -1;
             goto out;
         }
         if (blk_new_backing) {
-            new_backing_num_sectors = blk_nb_sectors(blk_new_backing);
-            if (new_backing_num_sectors < 0) {
+            s.new_backing_num_sectors = blk_nb_sectors(blk_new_backing);
+            if (s.new_backing_num_sectors < 0) {
                 error_report("Could not get size of '%s': %s",
-                             out_baseimg, strerror(-new_backing_num_sectors));
+                             out_baseimg,
+                             strerror(-s.new_backing_num_sectors));
                 ret = -1;
                 goto out;
             }
+            s.prefix_chain_bs = rebase_find_in_chain(bs, out_baseimg,
+                                                     blk_new_backing);
         }
 
-        if (num_sectors != 0) {
-            local_progress = (float)100 /
-                (num_sectors / MIN(num_sectors, IO_BUF_SIZE / 512));
+        qemu_co_mutex_init(&s.lock);
+        for (i = 0; i < REBASE_COROUTINES; i++) {
+            Coroutine *co = qemu_coroutine_create(rebase_co_do_compare);
+            qemu_coroutine_enter(co, &s);
         }
 
-        for (sector = 0; sector < num_sectors; sector += n) {
-
-            /* How many sectors can we handle with the next read? */
-            if (sector + (IO_BUF_SIZE / 512) <= num_sectors) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = num_sectors - sector;
-            }
-
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
-            if (ret < 0) {
-                error_report("error while reading image metadata: %s",
-                             strerror(-ret));
-                goto out;
-            }
-            if (ret) {
-                continue;
-            }
-
-            /*
-             * Read old and new backing file and take into consideration that
-             * backing files may be smaller than the COW image.
-             */
-            if (sector >= old_backing_num_sectors) {
-                memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > old_backing_num_sectors) {
-                    n = old_backing_num_sectors - sector;
-                }
-
-                ret = blk_read(blk_old_backing, sector, buf_old, n);
-                if (ret < 0) {
-                    error_report("error while reading from old backing file");
-                    goto out;
-                }
-            }
-
-            if (sector >= new_backing_num_sectors || !blk_new_backing) {
-                memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > new_backing_num_sectors) {
-                    n = new_backing_num_sectors - sector;
-                }
-
-                ret = blk_read(blk_new_backing, sector, buf_new, n);
-                if (ret < 0) {
-                    error_report("error while reading from new backing file");
-                    goto out;
-                }
-            }
-
-            /* If they differ, we need to write to the COW file */
-            uint64_t written = 0;
-
-            while (written < n) {
-                int pnum;
-
-                if (compare_sectors(buf_old + written * 512,
-                    buf_new + written * 512, n - written, &pnum))
-                {
-                    ret = blk_write(blk, sector + written,
-                                    buf_old + written * 512, pnum);
-                    if (ret < 0) {
-                        error_report("Error while writing to COW image: %s",
-                            strerror(-ret));
-                        goto out;
-                    }
-                }
+        while (s.running_coroutines) {
+            aio_poll(qemu_get_aio_context(), true);
+        }
 
-                written += pnum;
-            }
-            qemu_progress_print(local_progress, 100);
+        if (s.ret < 0) {
+            ret = s.ret;
+            goto out;
         }
     }
 
@@ -3105,8 +3484,6 @@ out:
         blk_unref(blk_old_backing);
         blk_unref(blk_new_backing);
     }
-    qemu_vfree(buf_old);
-    qemu_vfree(buf_new);
 
     blk_unref(blk);
     if (ret) {
@@ -3444,6 +3821,463 @@ out_no_progress:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    int bufsize;
+    int step;
+    bool random;
+    int read_percent;
+    int nrreq;
+    int n;
+    int flush_interval;
+    bool drain_on_flush;
+    uint8_t *buf;
+    BenchRequest *reqs;
+    int *free_reqs;
+    int nr_free;
+    uint64_t offset;
+
+    int in_flight;
+    int flushes_in_flight;
+    int writes_since_flush;
+    int64_t *latencies;
+    int nr_done;
+};
+
+static void bench_submit(BenchData *b);
+
+static void bench_flush_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    b->flushes_in_flight--;
+    bench_submit(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *r = opaque;
+    BenchData *b = r->b;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    b->latencies[b->nr_done++] = get_clock() - r->start;
+    b->free_reqs[b->nr_free++] = r - b->reqs;
+    b->in_flight--;
+    bench_submit(b);
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    if (b->random) {
+        uint64_t nr_blocks = b->image_size / b->bufsize;
+        uint64_t rnd = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+        return (rnd % nr_blocks) * b->bufsize;
+    }
+
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = 0;
+    }
+    offset = b->offset;
+    b->offset += b->step;
+    return offset;
+}
+
+static void bench_submit(BenchData *b)
+{
+    while (b->n > 0 && b->in_flight < b->nrreq) {
+        BenchRequest *r;
+        BlockAIOCB *acb;
+        uint64_t offset;
+        bool is_write;
+
+        if (b->flush_interval && b->writes_since_flush >= b->flush_interval) {
+            /* By default the flush waits for all writes before it, and the
+             * next writes wait for the flush */
+            if (b->drain_on_flush &&
+                (b->in_flight > 0 || b->flushes_in_flight > 0)) {
+                return;
+            }
+            b->writes_since_flush = 0;
+            b->flushes_in_flight++;
+            acb = blk_aio_flush(b->blk, bench_flush_cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
+            }
+            if (b->drain_on_flush) {
+                return;
+            }
+        }
+        if (b->drain_on_flush && b->flushes_in_flight > 0) {
+            return;
+        }
+
+        is_write = b->read_percent < 100 &&
+                   (b->read_percent == 0 ||
+                    g_random_int_range(0, 100) >= b->read_percent);
+        offset = bench_next_offset(b);
+        r = &b->reqs[b->free_reqs[--b->nr_free]];
+        r->start = get_clock();
+
+        if (is_write) {
+            acb = blk_aio_writev(b->blk, offset >> BDRV_SECTOR_BITS, &r->qiov,
+                                 b->bufsize >> BDRV_SECTOR_BITS, bench_cb, r);
+            b->writes_since_flush++;
+        } else {
+            acb = blk_aio_readv(b->blk, offset >> BDRV_SECTOR_BITS, &r->qiov,
+                                b->bufsize >> BDRV_SECTOR_BITS, bench_cb, r);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+        b->n--;
+        b->in_flight++;
+    }
+}
+
+static int bench_compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* @permille of the sorted latencies, in microseconds */
+static double bench_percentile(BenchData *b, int permille)
+{
+    return b->latencies[(int64_t)(b->nr_done - 1) * permille / 1000] / 1000.0;
+}
+
+static int64_t cvtnum(const char *s)
+{
+    char *end;
+    int64_t ret;
+
+    ret = qemu_strtosz_suffix(s, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
+    if (*end != '\0') {
+        return -EINVAL;
+    }
+    return ret;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    bool quiet = false;
+    bool image_opts = false;
+    bool is_write = false;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    int64_t bufsize = 4096;
+    int pattern = 0;
+    int64_t step = 0;
+    int flush_interval = 0;
+    bool drain_on_flush = true;
+    bool random = false;
+    int read_percent = -1;
+    int64_t image_size;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    int flags = BDRV_O_FLAGS;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    Error *local_err = NULL;
+    int64_t start, elapsed;
+    double secs, sum = 0;
+    long val;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"read-percent", required_argument, 0, OPTION_READ_PERCENT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+            if (qemu_strtol(optarg, NULL, 0, &val) || val <= 0 ||
+                val > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = val;
+            break;
+        case 'd':
+            if (qemu_strtol(optarg, NULL, 0, &val) || val <= 0 ||
+                val > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = val;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'o':
+            offset = cvtnum(optarg);
+            if (offset < 0 || offset % BDRV_SECTOR_SIZE) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+            bufsize = cvtnum(optarg);
+            if (bufsize <= 0 || bufsize > INT_MAX ||
+                bufsize % BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            break;
+        case 'S':
+            step = cvtnum(optarg);
+            if (step < 0 || step > INT_MAX || step % BDRV_SECTOR_SIZE) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            is_write = true;
+            break;
+        case OPTION_PATTERN:
+            if (qemu_strtol(optarg, NULL, 0, &val) || val < 0 || val > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            pattern = val;
+            break;
+        case OPTION_FLUSH_INTERVAL:
+            if (qemu_strtol(optarg, NULL, 0, &val) || val < 0 ||
+                val > INT_MAX) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            flush_interval = val;
+            break;
+        case OPTION_NO_DRAIN:
+            drain_on_flush = false;
+            break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
+        case OPTION_READ_PERCENT:
+            if (qemu_strtol(optarg, NULL, 0, &val) || val < 0 || val > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            read_percent = val;
+            break;
+        case OPTION_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                return 1;
+            }
+        }   break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (read_percent < 0) {
+        read_percent = is_write ? 0 : 100;
+    } else if (is_write) {
+        error_report("-w and --read-percent are mutually exclusive");
+        return 1;
+    }
+    if (read_percent == 100 && (flush_interval || !drain_on_flush)) {
+        error_report("--flush-interval and --no-drain are only available "
+                     "in tests with writes");
+        return 1;
+    }
+    if (!drain_on_flush && !flush_interval) {
+        error_report("--no-drain requires --flush-interval");
+        return 1;
+    }
+    if (random && step) {
+        error_report("-S and --random are mutually exclusive");
+        return 1;
+    }
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          NULL, &local_err)) {
+        error_report_err(local_err);
+        return 1;
+    }
+
+    if (read_percent < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache mode");
+        return 1;
+    }
+
+    blk = img_open("image", image_opts, filename, fmt, flags, true, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = image_size;
+        goto out;
+    }
+    if (image_size < bufsize || offset > image_size - bufsize) {
+        error_report("Image is too small for the requested buffer size "
+                     "and offset");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .bufsize        = bufsize,
+        .step           = step ?: bufsize,
+        .random         = random,
+        .read_percent   = read_percent,
+        .nrreq          = depth,
+        .n              = count,
+        .offset         = offset,
+        .flush_interval = flush_interval,
+        .drain_on_flush = drain_on_flush,
+    };
+
+    if (!quiet) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel ",
+               count, read_percent == 100 ? "read" :
+                      read_percent == 0 ? "write" : "mixed",
+               data.bufsize, depth);
+        if (random) {
+            printf("(random offsets)\n");
+        } else {
+            printf("(starting at offset %" PRId64 ", step size %d)\n",
+                   offset, data.step);
+        }
+        if (read_percent > 0 && read_percent < 100) {
+            printf("Reads: %d%%\n", read_percent);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d write requests\n", flush_interval);
+        }
+    }
+
+    data.buf = blk_blockalign(blk, (size_t)depth * data.bufsize);
+    memset(data.buf, pattern, (size_t)depth * data.bufsize);
+
+    data.reqs = g_new0(BenchRequest, depth);
+    data.free_reqs = g_new(int, depth);
+    for (i = 0; i < depth; i++) {
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
+                       data.buf + (size_t)i * data.bufsize, data.bufsize);
+        data.free_reqs[i] = depth - 1 - i;
+    }
+    data.nr_free = depth;
+    data.latencies = g_new(int64_t, count);
+
+    start = get_clock();
+    bench_submit(&data);
+    while (data.n > 0 || data.in_flight > 0 || data.flushes_in_flight > 0) {
+        main_loop_wait(false);
+    }
+    elapsed = get_clock() - start;
+
+    secs = elapsed / 1e9;
+    for (i = 0; i < data.nr_done; i++) {
+        sum += data.latencies[i];
+    }
+    qsort(data.latencies, data.nr_done, sizeof(data.latencies[0]),
+          bench_compare_latency);
+
+    if (!quiet) {
+        printf("Run completed in %3.3f seconds.\n", secs);
+        printf("IOPS: %.0f, throughput: %.2f MiB/s\n", count / secs,
+               (double)count * data.bufsize / secs / (1 << 20));
+        printf("Latency (us): min %.1f, avg %.1f, max %.1f\n",
+               data.latencies[0] / 1000.0, sum / data.nr_done / 1000.0,
+               data.latencies[data.nr_done - 1] / 1000.0);
+        printf("Latency percentiles (us): 50%% %.1f, 90%% %.1f, "
+               "99%% %.1f, 99.9%% %.1f\n",
+               bench_percentile(&data, 500), bench_percentile(&data, 900),
+               bench_percentile(&data, 990), bench_percentile(&data, 999));
+    }
+
+    for (i = 0; i < depth; i++) {
+        qemu_iovec_destroy(&data.reqs[i].qiov);
+    }
+    g_free(data.latencies);
+    g_free(data.free_reqs);
+    g_free(data.reqs);
+    qemu_vfree(data.buf);
+
+out:
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -29,6 +29,7 @@
 #include "qapi/qmp/qstring.h"
 #include "qom/object_interfaces.h"
 #include "io/channel-socket.h"
+#include "sysemu/iothread.h"
 
 #include <getopt.h>
 #include <libgen.h>
@@ -42,6 +43,7 @@
 #define QEMU_NBD_OPT_OBJECT        260
 #define QEMU_NBD_OPT_TLSCREDS      261
 #define QEMU_NBD_OPT_IMAGE_OPTS    262
+#define QEMU_NBD_OPT_IOTHREAD      263
 
 static NBDExport *exp;
 static bool newproto;
@@ -51,7 +53,9 @@ static SocketAddress *saddr;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
+/* nb_fds and client_closed are also updated from the export's IOThread */
 static int nb_fds;
+static bool client_closed;
 static QIOChannelSocket *server_ioc;
 static int server_watch = -1;
 static QCryptoTLSCreds *tlscreds;
@@ -101,10 +105,12 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
+"      --iothread=ID         serve the export from the IOThread ID, created\n"
+"                            with --object iothread,id=ID\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
     , name, NBD_DEFAULT_PORT, "DEVICE");
@@ -254,7 +260,7 @@ static void *nbd_client_thread(void *arg)
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -305,24 +311,25 @@ out:
 
 static int nbd_can_accept(void)
 {
-    return nb_fds < shared;
+    return atomic_read(&nb_fds) < shared;
 }
 
+/* Called in the AioContext of the export */
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
-    state = TERMINATED;
+    atomic_set(&state, TERMINATED);
+    qemu_notify_event();
 }
 
 static void nbd_update_server_watch(void);
 
+/* Called in the AioContext of the export, the main loop takes it from here */
 static void nbd_client_closed(NBDClient *client)
 {
-    nb_fds--;
-    if (nb_fds == 0 && !persistent && state == RUNNING) {
-        state = TERMINATE;
-    }
-    nbd_update_server_watch();
+    atomic_dec(&nb_fds);
+    atomic_set(&client_closed, true);
+    qemu_notify_event();
     nbd_client_put(client);
 }
 
@@ -341,7 +348,7 @@ static gboolean nbd_accept(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
         return TRUE;
     }
 
-    nb_fds++;
+    atomic_inc(&nb_fds);
     nbd_update_server_watch();
     nbd_client_new(newproto ? NULL : exp, cioc,
                    tlscreds, NULL, nbd_client_closed);
@@ -488,6 +495,7 @@ int main(int argc, char **argv)
         { "export-name", required_argument, NULL, 'x' },
         { "tls-creds", required_argument, NULL, QEMU_NBD_OPT_TLSCREDS },
         { "image-opts", no_argument, NULL, QEMU_NBD_OPT_IMAGE_OPTS },
+        { "iothread", required_argument, NULL, QEMU_NBD_OPT_IOTHREAD },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -507,6 +515,8 @@ int main(int argc, char **argv)
     const char *export_name = NULL;
     const char *tlscredsid = NULL;
     bool imageOpts = false;
+    const char *iothread_id = NULL;
+    AioContext *ctx = qemu_get_aio_context();
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
      * handler ensures that "qemu-nbd -v -c" exits with a nice status code.
@@ -546,6 +556,8 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -689,6 +701,9 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_IMAGE_OPTS:
             imageOpts = true;
             break;
+        case QEMU_NBD_OPT_IOTHREAD:
+            iothread_id = optarg;
+            break;
         }
     }
 
@@ -878,6 +893,24 @@ int main(int argc, char **argv)
         }
     }
 
+    if (iothread_id) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    iothread_id);
+        IOThread *iothread = obj ? (IOThread *)
+                             object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+
+        if (!iothread) {
+            error_report("No IOThread with id '%s'", iothread_id);
+            exit(EXIT_FAILURE);
+        }
+        /* Requests are then processed, and the image format decoded, in
+         * the IOThread.  Connections are still accepted and negotiated in
+         * the main loop.
+         */
+        ctx = iothread_get_aio_context(iothread);
+        blk_set_aio_context(blk, ctx);
+    }
+
     exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          &local_err);
     if (!exp) {
@@ -922,14 +955,27 @@ int main(int argc, char **argv)
     state = RUNNING;
     do {
         main_loop_wait(false);
+        if (atomic_xchg(&client_closed, false)) {
+            if (atomic_read(&nb_fds) == 0 && !persistent && state == RUNNING) {
+                state = TERMINATE;
+            }
+            nbd_update_server_watch();
+        }
         if (state == TERMINATE) {
             state = TERMINATING;
+            aio_context_acquire(ctx);
             nbd_export_close(exp);
             nbd_export_put(exp);
+            aio_context_release(ctx);
             exp = NULL;
         }
-    } while (state != TERMINATED);
+    } while (atomic_read(&state) != TERMINATED);
 
+    if (ctx != qemu_get_aio_context()) {
+        aio_context_acquire(ctx);
+        blk_set_aio_context(blk, qemu_get_aio_context());
+        aio_context_release(ctx);
+    }
     blk_unref(blk);
     if (sockpath) {
         unlink(sockpath);
@@ -38,6 +38,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                share-rom=on|off maps firmware files instead of copying them (default: off)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
@@ -73,6 +74,12 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item share-rom=on|off
+Back the BIOS, PCI option ROMs and firmware passed through fw_cfg with
+copy-on-write mappings of their files instead of copies in anonymous
+memory, so that VMs using the same firmware share its pages in the host
+page cache.  ROM images cannot be resized on migration in this mode, so
+source and destination must use the same files.  The default is off.
 @item iommu=on|off
 Enables or disables emulated Intel IOMMU (VT-d) support. The default is off.
 @item aes-key-wrap=on|off
@@ -91,6 +98,25 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator ('-accel help for list')\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used. Supported
+accelerator properties are:
+@table @option
+@item thread=single|multi
+Controls number of TCG threads. When TCG is multi-threaded there will be one
+host thread per guest vCPU. This is only available for guest and host
+combinations whose memory models are compatible. The default is single.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -123,10 +149,12 @@ ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
     "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "                [,host-cpus=cpu[-cpu]][,host-node=node]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "                [,host-cpus=cpu[-cpu]][,host-node=node]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}][,host-node=@var{node}]
+@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}][,host-node=@var{node}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -138,6 +166,12 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-cpus} and @samp{host-node} restrict the threads of the node's
+VCPUs to the given host CPUs, or to the CPUs of the given host NUMA node.
+If both are given, only the CPUs of the host node that are also listed in
+@samp{host-cpus} are used.  This has no effect with single-threaded TCG,
+where all VCPUs share one thread.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -521,7 +555,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -529,7 +563,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
-    "       [[,group=g]]\n"
+    "       [[,group=g]][,weight=w][,latency_target=lt]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -564,7 +598,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -733,12 +767,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    " [,cache=none|loose]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,cache=@var{cache}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -779,6 +814,13 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item cache=@var{cache}
+This is an optional argument. "none", the default, looks up file attributes
+on the host for every request. "loose" caches the attributes of recently
+looked up files and only drops them when the guest itself changes a file,
+so it must only be used when nothing but the guest modifies the export.
+Even then, a file reached through several hard links may report stale
+attributes under its other names until the entry is evicted.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -795,12 +837,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    "        [,cache=none|loose]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,cache=@var{cache}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -842,6 +885,13 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item cache=@var{cache}
+This is an optional argument. "none", the default, looks up file attributes
+on the host for every request. "loose" caches the attributes of recently
+looked up files and only drops them when the guest itself changes a file,
+so it must only be used when nothing but the guest modifies the export.
+Even then, a file reached through several hard links may report stale
+attributes under its other names until the entry is evicted.
 @end table
 ETEXI
 
@@ -1563,7 +1613,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev user,id=str[,net=addr[/mask]][,host=addr][,ip6-net=addr[/int]]\n"
     "         [,ip6-host=addr][,restrict=on|off][,hostname=host][,dhcpstart=addr]\n"
     "         [,dns=addr][,ip6-dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule][,vnet_hdr=on|off]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1637,6 +1687,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
+    "                all socket backends take [,vnet_hdr=on|off] to carry virtio-net\n"
+    "                headers, and so offloads, to the other end\n"
 #ifdef CONFIG_VDE
     "-netdev vde,id=str[,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                configure a network backend to connect to port 'n' of a vde switch\n"
@@ -1649,6 +1701,21 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "-netdev af-packet,id=str,ifname=name[,vnet_hdr=on|off][,block-size=n]\n"
+    "         [,block-count=n][,frame-size=n]\n"
+    "                attach to the host network interface 'name' through the\n"
+    "                mmap rings of an AF_PACKET socket, each ring made of\n"
+    "                'block-count' blocks of 'block-size' bytes\n"
+    "                use vnet_hdr=on to pass checksum and segmentation offloads\n"
+#endif
+#ifdef CONFIG_POSIX
+    "-netdev ivshmem,id=str,chardev=dev[,poll-us=n]\n"
+    "                link up with the other client of the ivshmem server that\n"
+    "                chardev 'dev' is connected to, through rings in the shared\n"
+    "                memory; poll the rings for 'n' microseconds before waiting\n"
+    "                for a doorbell\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1850,6 +1917,12 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item vnet_hdr=on|off
+Exchange virtio-net headers with a virtio-net guest NIC.  The guest can then
+leave checksums and TCP segmentation to the user mode stack, and host-to-guest
+TCP traffic is delivered in frames of up to 64 KiB that the guest NIC splits
+up itself.  Defaults to off.
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -1995,6 +2068,11 @@ qemu-system-i386 linux.img \
                  -net socket,mcast=239.192.168.1:1102,localaddr=1.2.3.4
 @end example
 
+With @option{vnet_hdr=on}, which any of the socket backends above accept,
+every frame is preceded by a virtio-net header so that checksum and
+segmentation offloads reach the other end, e.g. between two virtio-net
+guests.  All ends of the connection must use the same setting.
+
 @item -netdev l2tpv3,id=@var{id},src=@var{srcaddr},dst=@var{dstaddr}[,srcport=@var{srcport}][,dstport=@var{dstport}],txsession=@var{txsession}[,rxsession=@var{rxsession}][,ipv6][,udp][,cookie64][,counter][,pincounter][,txcookie=@var{txcookie}][,rxcookie=@var{rxcookie}][,offset=@var{offset}]
 @itemx -net l2tpv3[,vlan=@var{n}][,name=@var{name}],src=@var{srcaddr},dst=@var{dstaddr}[,srcport=@var{srcport}][,dstport=@var{dstport}],txsession=@var{txsession}[,rxsession=@var{rxsession}][,ipv6][,udp][,cookie64][,counter][,pincounter][,txcookie=@var{txcookie}][,rxcookie=@var{rxcookie}][,offset=@var{offset}]
 Connect VLAN @var{n} to L2TPv3 pseudowire. L2TPv3 (RFC3391) is a popular
@@ -2070,6 +2148,57 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,vnet_hdr=on|off][,block-size=@var{size}][,block-count=@var{n}][,frame-size=@var{size}]
+Connect the host network interface @var{name} to the guest through an
+AF_PACKET socket.  Packets are exchanged through receive and transmit rings
+shared with the kernel, @var{n} blocks of @var{size} bytes each (by default
+16 blocks of 256 KiB), so bursts of packets cost a single wakeup.  The
+interface is put in promiscuous mode and QEMU needs CAP_NET_RAW.  This
+option is only available on Linux hosts with TPACKET_V3 support; the
+transmit ring needs Linux 4.11 or newer.
+
+With @option{vnet_hdr=on} every packet carries a virtio-net header, so that
+checksum and TCP segmentation offloads pass between a virtio-net guest and the
+host NIC.  This needs Linux 4.20 or newer.  Without it, disable GRO and LRO on
+the interface (@code{ethtool -K @var{name} gro off lro off}), since
+aggregated packets larger than the guest MTU are dropped.
+
+@option{frame-size} sets the size of a transmit frame, by default 2048 bytes,
+or enough for a 64 KiB segmentation offload frame with @option{vnet_hdr=on}.
+
+Example:
+@example
+qemu-system-x86_64 linux.img -netdev af-packet,id=n0,ifname=eth1,vnet_hdr=on \
+                   -device virtio-net-pci,netdev=n0
+@end example
+
+@item -netdev ivshmem,id=@var{id},chardev=@var{dev}[,poll-us=@var{n}]
+Connect to another QEMU process, or to a guest driver behind an ivshmem
+device, through the shared memory of an ivshmem server.  @var{dev} is a unix
+socket chardev connected to the server, which must have exactly two clients.
+Packets go through one ring in the shared memory for each direction, as
+described in @file{docs/specs/ivshmem-net.txt}, so they are copied once at
+each end and do not go through the host network stack.  The link is reported
+as down until the other client has connected.
+
+Doorbells are only rung when the other side is waiting for one.  With
+@option{poll-us}, QEMU keeps polling the receive ring for @var{n} microseconds
+after the last packet before it waits for a doorbell, trading CPU time for
+latency.  Frames larger than 2040 bytes are dropped.
+
+Example:
+@example
+# launch the ivshmem server
+ivshmem-server -S /tmp/ivshmem.sock -l 4M -n 1
+# launch two QEMU instances
+qemu-system-x86_64 vm1.img -chardev socket,id=ivs,path=/tmp/ivshmem.sock \
+                   -netdev ivshmem,id=n0,chardev=ivs \
+                   -device virtio-net-pci,netdev=n0
+qemu-system-x86_64 vm2.img -chardev socket,id=ivs,path=/tmp/ivshmem.sock \
+                   -netdev ivshmem,id=n0,chardev=ivs \
+                   -device virtio-net-pci,netdev=n0,mac=52:54:00:12:34:57
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -3199,6 +3328,10 @@ DEF("xen-attach", 0, QEMU_OPTION_xen_attach,
     "-xen-attach     attach to existing xen domain\n"
     "                xend will use this when starting QEMU\n",
     QEMU_ARCH_ALL)
+DEF("xen-mapcache-bucket-size", HAS_ARG, QEMU_OPTION_xen_mapcache_bucket_size,
+    "-xen-mapcache-bucket-size size\n"
+    "                set the size of guest memory mapped at a time\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -xen-domid @var{id}
 @findex -xen-domid
@@ -3211,6 +3344,12 @@ Warning: should not be used when xend is in use (XEN only).
 @findex -xen-attach
 Attach to existing xen domain.
 xend will use this when starting QEMU (XEN only).
+@item -xen-mapcache-bucket-size @var{size}
+@findex -xen-mapcache-bucket-size
+Map guest memory in chunks of @var{size} bytes, a power of two (XEN only).
+Smaller chunks use less address space and are faster to map on a miss,
+larger ones miss less often.  The default is 1M on 64-bit hosts and 64K
+on 32-bit hosts.
 ETEXI
 
 DEF("no-reboot", 0, QEMU_OPTION_no_reboot, \
@@ -3299,12 +3438,12 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>][,rrcompress=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename}]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename}][,rrcompress=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3336,7 +3475,8 @@ when the shift value is high (how high depends on the host machine).
 
 When @option{rr} option is specified deterministic record/replay is enabled.
 Replay log is written into @var{filename} file in record mode and
-read from this file in replay mode.
+read from this file in replay mode.  With @option{rrcompress=on} the log
+is compressed while recording; replay detects this by itself.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3617,7 +3757,7 @@ config files on @var{sysconfdir}, but won't make it skip the QEMU-provided confi
 files from @var{datadir}.
 ETEXI
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
-    "-trace [[enable=]<pattern>][,events=<file>][,file=<file>]\n"
+    "-trace [[enable=]<pattern>][,sample=<n>][,rate=<n>][,events=<file>][,file=<file>]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 STEXI
@@ -3639,6 +3779,15 @@ specify the @option{-trace} option multiple times.
 
 Use @code{-trace help} to print a list of names of trace points.
 
+@item sample=@var{n}
+Record only one in @var{n} occurrences of the events matching the
+@option{enable} pattern.
+
+@item rate=@var{n}
+Record at most @var{n} occurrences per second of each event matching the
+@option{enable} pattern.  Together with @option{sample}, this keeps hot
+events affordable while they stay enabled.
+
 @item events=@var{file}
 Immediately enable events listed in @var{file}.
 The file must contain one event name (as listed in the @file{trace-events} file)
@@ -3837,6 +3986,17 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+@item -object filter-capture,id=@var{id},netdev=@var{dev},file=@var{filename}[,snaplen=@var{len}][,sample=@var{n}][,ring-size=@var{size}]
+
+Capture the network traffic on netdev @var{dev} to the libpcap file
+@var{filename}, like @option{filter-dump} but without writing from the packet
+path: packets are copied into a ring buffer of @var{size} bytes (4M by
+default) that a separate thread writes out.  At most @var{len} bytes (65535 by
+default) per packet are stored, and with @option{sample} only one packet out
+of every @var{n} is captured.  Packets that arrive while the ring is full are
+not captured; the read-only @option{captured} and @option{dropped} properties
+count the packets that were and were not captured.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
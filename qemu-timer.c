@@ -67,7 +67,16 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+
+    /* Binary min-heap of the pending timers, ordered by expire time and
+     * then by arming order so that timers with the same deadline still
+     * fire in the order they were armed.  Protected by active_timers_lock.
+     */
+    QEMUTimer **active_timers;
+    size_t n_active_timers;
+    size_t active_timers_size;
+    uint64_t active_timers_seq;
+
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -94,6 +103,11 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static inline QEMUTimer *timerlist_head(QEMUTimerList *timer_list)
+{
+    return timer_list->n_active_timers ? timer_list->active_timers[0] : NULL;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -118,6 +132,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -174,7 +189,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return atomic_read(&timer_list->n_active_timers) != 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,11 +203,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_head(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -223,11 +238,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_head(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -352,43 +367,110 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static inline bool timer_heap_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->heap_seq < b->heap_seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timer_heap_set(QEMUTimerList *timer_list, size_t i,
+                                  QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerList *timer_list, size_t i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        QEMUTimer *p = timer_list->active_timers[parent];
+
+        if (!timer_heap_before(ts, p)) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, p);
+        i = parent;
     }
+    timer_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_down(QEMUTimerList *timer_list, size_t i)
 {
-    QEMUTimer **pt, *t;
+    size_t n = timer_list->n_active_timers;
+    QEMUTimer *ts = timer_list->active_timers[i];
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        size_t child = 2 * i + 1;
+        QEMUTimer *c;
+
+        if (child >= n) {
+            break;
+        }
+        c = timer_list->active_timers[child];
+        if (child + 1 < n &&
+            timer_heap_before(timer_list->active_timers[child + 1], c)) {
+            c = timer_list->active_timers[++child];
+        }
+        if (!timer_heap_before(c, ts)) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, c);
+        i = child;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    size_t i = ts->heap_index;
+    QEMUTimer *last;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    assert(i < timer_list->n_active_timers &&
+           timer_list->active_timers[i] == ts);
+    last = timer_list->active_timers[timer_list->n_active_timers - 1];
+    atomic_set(&timer_list->n_active_timers,
+               timer_list->n_active_timers - 1);
+    if (last == ts) {
+        return;
+    }
+
+    timer_heap_set(timer_list, i, last);
+    if (i > 0 &&
+        timer_heap_before(last, timer_list->active_timers[(i - 1) / 2])) {
+        timer_heap_up(timer_list, i);
+    } else {
+        timer_heap_down(timer_list, i);
     }
+}
+
+/* Returns true if @ts became the first timer to expire */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    size_t n = timer_list->n_active_timers;
+
+    if (n == timer_list->active_timers_size) {
+        timer_list->active_timers_size = MAX(16, n * 2);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->active_timers_size);
+    }
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->heap_seq = timer_list->active_timers_seq++;
+    timer_heap_set(timer_list, n, ts);
+    atomic_set(&timer_list->n_active_timers, n + 1);
+    timer_heap_up(timer_list, n);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -482,7 +564,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timerlist_has_timers(timer_list)) {
         goto out;
     }
 
@@ -510,16 +592,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timerlist_head(timer_list);
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -754,6 +754,58 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:l",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start estimating the rate at which the guest dirties its memory.  The
+measurement runs in the background; use query-dirty-rate for the result.
+
+Arguments:
+
+- "calc-time": duration of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last calc-dirty-rate.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "dirty-rate": estimated dirty rate in MiB/s, only present once
+                measured (json-int, optional)
+- "start-time": host time at which the measurement started, in seconds since
+                the epoch (json-int)
+- "calc-time": duration of the measurement in seconds (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "dirty-rate": 108,
+                 "start-time": 1457952355, "calc-time": 1 } }
+
 EQMP
 
     {
@@ -1079,7 +1131,8 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,"
+                      "max-in-flight:i?,adaptive:b?,on-error:s?",
         .mhandler.cmd_new = qmp_marshal_block_stream,
     },
 
@@ -1108,6 +1161,11 @@ Arguments:
                   string, to specify a valid filename or protocol.
                   (json-string, optional) (Since 2.1)
 - "speed":  the maximum speed, in bytes per second (json-int, optional)
+- "max-in-flight": the maximum number of chunks copied in parallel, between 1
+                   and 16 (json-int, optional, default 1) (Since 2.6)
+- "adaptive": copy fewer chunks in parallel, and eventually pause between
+              chunks, while guest I/O is slower than usual
+              (json-bool, optional, default false) (Since 2.6)
 - "on-error": the action to take on an error (default 'report').  'stop' and
               'enospc' can only be used if the block device supports io-status.
               (json-string, optional) (Since 2.1)
@@ -1186,7 +1244,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?,max-chunk:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1228,6 +1287,11 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests in flight, between 1
+                 and 64 (json-int, optional, default 1)
+- "max-chunk": the maximum size of a copy request in bytes, rounded down to
+               a multiple of the cluster size, at most 64 MiB
+               (json-int, optional, default is the cluster size)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1240,7 +1304,8 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?,max-chunk:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1269,6 +1334,11 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests in flight, between 1
+                 and 64 (json-int, optional, default 1)
+- "max-chunk": the maximum size of a copy request in bytes, rounded down to
+               a multiple of the cluster size, at most 64 MiB
+               (json-int, optional, default is the cluster size)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1400,7 +1470,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1417,6 +1487,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file when it is closed and load
+                it again when it is opened; qcow2 version 3 only
+                (json-bool, optional, default false)
 
 Example:
 
@@ -1632,7 +1705,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_drive_mirror,
     },
@@ -1674,6 +1747,8 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": when to copy data to the destination; "background" or
+  "write-blocking" (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1694,7 +1769,7 @@ EQMP
     {
         .name       = "blockdev-mirror",
         .args_type  = "sync:s,device:B,target:B,replaces:s?,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?,"
+                      "on-source-error:s?,on-target-error:s?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_mirror,
     },
@@ -1725,6 +1800,8 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": when to copy data to the destination; "background" or
+  "write-blocking" (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2029,11 +2106,48 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the latency histograms of a block device, which are reported
+by query-blockstats. The bins of a histogram are reset whenever its
+boundaries are set.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries for all histograms, in nanoseconds
+                (json-array of json-int, optional)
+- "boundaries-read": boundaries for the read histogram
+                     (json-array of json-int, optional)
+- "boundaries-write": boundaries for the write histogram
+                      (json-array of json-int, optional)
+- "boundaries-flush": boundaries for the flush histogram
+                      (json-array of json-int, optional)
+
+If no boundaries are given at all, the histograms are disabled.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,weight:l?,latency_target:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2066,6 +2180,8 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "weight": share of the throttle group, between 1 and 10000 (json-int, optional)
+- "latency_target": latency target within the throttle group, in milliseconds (json-int, optional)
 
 Example:
 
@@ -2497,6 +2613,9 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "weight": share of the throttle group (json-int, optional)
+         - "latency_target": latency target within the throttle group,
+                             in milliseconds (json-int, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "write_threshold": write offset threshold in bytes, a event will be
@@ -2721,6 +2840,18 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of read operations, if
+                              enabled with block-latency-histogram-set
+                              (json-object, optional), with the
+                              following members:
+        - "boundaries": boundaries between the bins, in nanoseconds
+                        (json-array of json-int)
+        - "bins": number of operations in each bin
+                  (json-array of json-int)
+    - "wr_latency_histogram": same for write operations
+                              (json-object, optional)
+    - "flush_latency_histogram": same for flush operations
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2902,6 +3033,13 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 if not configured (json-int)
+- "poll-shrink": polling time shrink factor, 0 if not configured (json-int)
+- "poll-hits": number of polls that saw an event in time (json-int)
+- "poll-misses": number of polls that timed out and blocked (json-int)
+- "thread-pool-min": thread pool workers kept alive when idle (json-int)
+- "thread-pool-max": maximum number of thread pool workers (json-int)
 
 Example:
 
@@ -2910,15 +3048,262 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":1804,
+            "poll-misses":97,
+            "thread-pool-min":0,
+            "thread-pool-max":64
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":0,
+            "poll-misses":0,
+            "thread-pool-min":0,
+            "thread-pool-max":64
          }
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-sync-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_sync_profile,
+    },
+
+SQMP
+query-sync-profile
+------------------
+
+Returns the lock contention statistics collected while lock profiling was
+enabled with "sync-profile".
+
+Return a json-array. Each call site that took a QemuMutex or the big QEMU
+lock is represented by a json-object, which contains:
+
+- "bql": true if the site takes the big QEMU lock (json-bool)
+- "file": source file of the call site (json-str)
+- "line": source line of the call site (json-int)
+- "acquisitions": number of times the lock was taken (json-int)
+- "contended": number of acquisitions that had to wait (json-int)
+- "wait-ns": total time spent waiting, in ns (json-int)
+- "max-wait-ns": longest single wait, in ns (json-int)
+- "hold-ns": total time the lock was held, in ns (json-int)
+
+Example:
+
+-> { "execute": "query-sync-profile" }
+<- {
+      "return":[
+         {
+            "bql":true,
+            "file":"cpus.c",
+            "line":1089,
+            "acquisitions":48211,
+            "contended":312,
+            "wait-ns":18310242,
+            "max-wait-ns":1034881,
+            "hold-ns":902311876
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "sync-profile",
+        .args_type  = "action:s",
+        .mhandler.cmd_new = qmp_marshal_sync_profile,
+    },
+
+SQMP
+sync-profile
+------------
+
+Control lock contention profiling.
+
+Arguments:
+
+- "action": "on" to start profiling, "off" to stop it or "reset" to clear
+            the statistics collected so far (json-string)
+
+Example:
+
+-> { "execute": "sync-profile", "arguments": { "action": "on" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-mtree-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_mtree_profile,
+    },
+
+SQMP
+query-mtree-profile
+-------------------
+
+Returns the accesses counted while memory region profiling was enabled with
+"mtree-profile".  Only accesses handled by the callbacks of a region are
+counted: RAM and, under KVM, ioeventfds are not.
+
+Return a json-array. Each region that was accessed is represented by a
+json-object, which contains:
+
+- "name": name of the region (json-str)
+- "owner": QOM path of the owner of the region, if any (json-str, optional)
+- "reads": number of reads (json-int)
+- "writes": number of writes (json-int)
+- "read-bytes": total size of the reads (json-int)
+- "write-bytes": total size of the writes (json-int)
+- "read-ns": total time spent handling the reads, in ns (json-int)
+- "write-ns": total time spent handling the writes, in ns (json-int)
+
+Example:
+
+-> { "execute": "query-mtree-profile" }
+<- {
+      "return":[
+         {
+            "name":"e1000-mmio",
+            "owner":"/machine/peripheral-anon/device[0]",
+            "reads":10234,
+            "writes":48211,
+            "read-bytes":40936,
+            "write-bytes":192844,
+            "read-ns":3821190,
+            "write-ns":25124315
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "mtree-profile",
+        .args_type  = "action:s",
+        .mhandler.cmd_new = qmp_marshal_mtree_profile,
+    },
+
+SQMP
+mtree-profile
+-------------
+
+Control memory region profiling.
+
+Arguments:
+
+- "action": "on" to start counting, "off" to stop it or "reset" to clear
+            the counts of all regions (json-string)
+
+Example:
+
+-> { "execute": "mtree-profile", "arguments": { "action": "on" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "stats-subscribe",
+        .args_type  = "interval:i,providers:q,devices:q?",
+        .mhandler.cmd_new = qmp_marshal_stats_subscribe,
+    },
+
+SQMP
+stats-subscribe
+---------------
+
+Emit a STATS event periodically, carrying the selected counters.  This
+replaces any previous subscription; there is a single subscription for the
+whole QEMU instance.  Collecting the counters does not interrupt the vCPUs.
+
+Arguments:
+
+- "interval": period of the event in milliseconds, at least 100 (json-int)
+- "providers": groups of counters to report, among "block", "migration"
+               and "cpus" (json-array of json-string)
+- "devices": only report these block devices (json-array of json-string,
+             optional)
+
+Example:
+
+-> { "execute": "stats-subscribe",
+     "arguments": { "interval": 1000, "providers": [ "block", "cpus" ] } }
+<- { "return": {} }
+<- { "event": "STATS",
+     "data": { "block": [ { "device": "drive0", "rd-bytes": 4812800,
+                            "wr-bytes": 1024, "rd-operations": 412,
+                            "wr-operations": 2, "flush-operations": 1,
+                            "rd-total-time-ns": 30712751,
+                            "wr-total-time-ns": 901223 } ],
+               "cpus": [ { "cpu-index": 0, "halted": false, "thread-id": 3134 } ] },
+     "timestamp": { "seconds": 1453201012, "microseconds": 312235 } }
+
+EQMP
+
+    {
+        .name       = "stats-unsubscribe",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_stats_unsubscribe,
+    },
+
+SQMP
+stats-unsubscribe
+-----------------
+
+Stop emitting the STATS event.
+
+Example:
+
+-> { "execute": "stats-unsubscribe" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-startup-phases",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_startup_phases,
+    },
+
+SQMP
+query-startup-phases
+--------------------
+
+Show where the time went during QEMU startup, up to the first reset of
+the machine.
+
+Return a json-array. Each phase is represented by a json-object, which
+contains:
+
+- "name": phase name (json-string)
+- "duration-ns": time spent in the phase, in ns (json-int)
+- "elapsed-ns": time from the start of QEMU to the end of the phase,
+                in ns (json-int)
+
+Example:
+
+-> { "execute": "query-startup-phases" }
+<- {
+      "return":[
+         { "name":"options", "duration-ns":1950312, "elapsed-ns":1950312 },
+         { "name":"objects", "duration-ns":301644, "elapsed-ns":2251956 },
+         { "name":"accelerator", "duration-ns":9155010,
+           "elapsed-ns":11406966 },
+         ...
+         { "name":"reset", "duration-ns":402113, "elapsed-ns":38514034 }
+      ]
+   }
+
 EQMP
 
     {
@@ -3168,6 +3553,87 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_kvm,
     },
 
+SQMP
+query-tcg
+---------
+
+Show statistics about the TCG translation buffer.
+
+Return a json-object with the following information:
+
+- "flush-count": number of full translation buffer flushes (json-int)
+- "region-evict-count": number of evictions of the oldest translation
+                        buffer region (json-int)
+- "code-gen-bytes": bytes of host code generated since the last full
+                    flush (json-int)
+- "code-gen-buffer-size": size of the translation buffer in bytes (json-int)
+- "regions": number of translation buffer regions (json-int)
+
+Example:
+
+-> { "execute": "query-tcg" }
+<- { "return": { "flush-count": 0, "region-evict-count": 3,
+                 "code-gen-bytes": 151853056,
+                 "code-gen-buffer-size": 33550336, "regions": 8 } }
+
+EQMP
+
+    {
+        .name       = "query-tcg",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_tcg,
+    },
+
+SQMP
+query-jit-stats
+---------------
+
+Show statistics about the TCG translator and the code it generated.  They
+are collected by every build, unlike the CONFIG_PROFILER counters.
+
+Return a json-object with the following information:
+
+- "tb-count": number of translation blocks in the translation buffer
+              (json-int)
+- "tb-gen-count": number of translation blocks translated since startup
+                  (json-int)
+- "code-bytes": bytes of host code in the translation buffer (json-int)
+- "flush-count": number of full translation buffer flushes (json-int)
+- "gen-time": nanoseconds spent translating since startup (json-int)
+- "helper-calls": helper calls in the code generated since startup
+                  (json-int)
+- "chained-jumps": direct jumps patched between translation blocks
+                   (json-int)
+- "unchained-exits": returns from generated code to the main loop, summed
+                     over all vCPUs (json-int)
+- "tlb-misses": softmmu TLB misses, summed over all vCPUs (json-int)
+- "tlb-victim-hits": TLB misses resolved from the victim TLB (json-int)
+- "smc-writes": guest writes to pages containing translated code (json-int)
+- "smc-writes-filtered": writes to code pages that did not overlap any
+                         translation block, as shown by the page's code
+                         bitmap (json-int)
+- "smc-invalidations": translation blocks invalidated by writes to their
+                       code (json-int)
+
+Example:
+
+-> { "execute": "query-jit-stats" }
+<- { "return": { "tb-count": 31324, "tb-gen-count": 184211,
+                 "code-bytes": 10281728, "flush-count": 0,
+                 "gen-time": 2218031411, "helper-calls": 1120297,
+                 "chained-jumps": 170343, "unchained-exits": 81620358,
+                 "tlb-misses": 4632287, "tlb-victim-hits": 1382707,
+                 "smc-writes": 90211, "smc-writes-filtered": 87345,
+                 "smc-invalidations": 3120 } }
+
+EQMP
+
+    {
+        .name       = "query-jit-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_jit_stats,
+    },
+
 SQMP
 query-status
 ------------
@@ -3549,10 +4015,26 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-evictions": number of pages evicted from the XBZRLE
+           page cache
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "x-timings": only present if "status" is "active", "postcopy-active" or
+  "completed", it is a json-object with the time the migration thread
+  spent in each phase, in microseconds:
+         - "bitmap-sync": synchronizing the dirty bitmap (json-int)
+         - "page-scan": searching for dirty pages (json-int)
+         - "compression": compressing pages (json-int)
+         - "xbzrle": XBZRLE encoding pages (json-int)
+         - "socket-write": writing the main stream; overlaps with
+           "compression" and "xbzrle" (json-int)
+         - "throttled": sleeping for the bandwidth limit (json-int)
+         - "stop-copy": only present once the guest has been stopped, a
+           json-array of json-objects with "idstr", "instance-id" and
+           "time" for each section saved with the guest stopped
 
 Examples:
 
@@ -3658,6 +4140,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
+            "cache-hit":10210,
+            "cache-evictions":1874,
             "overflow":34434
          }
       }
@@ -3684,6 +4168,12 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several connections
+- "x-ignore-shared": don't send RAM backed by shared files
+- "x-mapped-ram": write RAM pages at fixed offsets of a file
+- "x-lazy-restore": load RAM from a mapped RAM file on demand
+- "x-zerocopy-send": send guest pages without copying them
+- "x-background-snapshot": save RAM at one instant while the guest runs
 
 Arguments:
 
@@ -3714,6 +4204,12 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple RAM connections state (json-bool)
+         - "x-ignore-shared": shared file RAM skipping state (json-bool)
+         - "x-mapped-ram": fixed offset RAM file format state (json-bool)
+         - "x-lazy-restore": on demand RAM restore state (json-bool)
+         - "x-zerocopy-send": zero-copy sending state (json-bool)
+         - "x-background-snapshot": background snapshot state (json-bool)
 
 Arguments:
 
@@ -3727,7 +4223,13 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-ignore-shared"},
+     {"state": false, "capability": "x-mapped-ram"},
+     {"state": false, "capability": "x-lazy-restore"},
+     {"state": false, "capability": "x-zerocopy-send"},
+     {"state": false, "capability": "x-background-snapshot"}
    ]}
 
 EQMP
@@ -3751,6 +4253,24 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of additional RAM connections used
+                        by x-multifd (json-int)
+- "compress-method": set the compression algorithm, "zlib", "zstd" or "lz4"
+                     (json-string)
+- "x-postcopy-prefetch-pages": set the number of host pages the postcopy
+                               destination prefetches after each fault
+                               (json-int)
+- "x-rdma-chunk-size": set the RDMA registration chunk size in MiB (json-int)
+- "x-rdma-reg-cache-size": set the MiB of RAM RDMA migration keeps registered,
+                           0 for no limit (json-int)
+- "x-iov-batch": set the number of buffers gathered per write (json-int)
+- "tls-creds": set the ID of the TLS credentials of a tcp: migration, or ""
+               to disable TLS (json-string)
+- "tls-hostname": set the hostname the destination's certificate is checked
+                  against (json-string)
+- "x-block-chunk-size": set the block migration chunk size in KiB (json-int)
+- "x-block-inflight": set the number of chunk reads block migration keeps
+                      in flight per device (json-int)
 
 Arguments:
 
@@ -3764,7 +4284,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?,compress-method:s?,x-postcopy-prefetch-pages:i?,x-rdma-chunk-size:i?,x-rdma-reg-cache-size:i?,x-iov-batch:i?,x-block-chunk-size:i?,x-block-inflight:i?,tls-creds:s?,tls-hostname:s?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +4301,23 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of additional RAM connections
+                                  used by x-multifd (json-int)
+         - "compress-method" : compression algorithm (json-string)
+         - "x-postcopy-prefetch-pages" : host pages prefetched after each
+                                         postcopy fault (json-int)
+         - "x-rdma-chunk-size" : RDMA registration chunk size in MiB
+                                 (json-int)
+         - "x-rdma-reg-cache-size" : MiB of RAM kept registered by RDMA
+                                     migration (json-int)
+         - "x-iov-batch" : buffers gathered per write (json-int)
+         - "tls-creds" : ID of the TLS credentials, if set (json-string)
+         - "tls-hostname" : hostname checked against the destination's
+                            certificate, if set (json-string)
+         - "x-block-chunk-size" : block migration chunk size in KiB
+                                  (json-int)
+         - "x-block-inflight" : chunk reads in flight per device during
+                                block migration (json-int)
 
 Arguments:
 
@@ -3793,7 +4330,15 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "compress-method": "zlib",
+         "x-postcopy-prefetch-pages": 0,
+         "x-rdma-chunk-size": 1,
+         "x-rdma-reg-cache-size": 0,
+         "x-iov-batch": 64,
+         "x-block-chunk-size": 1024,
+         "x-block-inflight": 16
       }
    }
 
@@ -4636,12 +5181,13 @@ Query the state of events.
 Example:
 
 -> { "execute": "trace-event-get-state", "arguments": { "name": "qemu_memalign" } }
-<- { "return": [ { "name": "qemu_memalign", "state": "disabled" } ] }
+<- { "return": [ { "name": "qemu_memalign", "state": "disabled",
+                  "sample": 0, "rate": 0 } ] }
 EQMP
 
     {
         .name       = "trace-event-set-state",
-        .args_type  = "name:s,enable:b,ignore-unavailable:b?",
+        .args_type  = "name:s,enable:b,ignore-unavailable:b?,sample:i?,rate:i?",
         .mhandler.cmd_new = qmp_marshal_trace_event_set_state,
     },
 
@@ -4651,10 +5197,25 @@ trace-event-set-state
 
 Set the state of events.
 
+Arguments:
+
+- "name": event name pattern (json-string)
+- "enable": whether to enable tracing (json-bool)
+- "ignore-unavailable": do not match unavailable events (json-bool, optional)
+- "sample": record one in this many occurrences, 0 or 1 for all
+            (json-int, optional)
+- "rate": record at most this many occurrences per second, 0 for no limit
+          (json-int, optional)
+
 Example:
 
 -> { "execute": "trace-event-set-state", "arguments": { "name": "qemu_memalign", "enable": "true" } }
 <- { "return": {} }
+
+-> { "execute": "trace-event-set-state",
+     "arguments": { "name": "virtio_queue_notify", "enable": true,
+                    "sample": 100, "rate": 1000 } }
+<- { "return": {} }
 EQMP
 
     {
@@ -33,7 +33,11 @@
 #include "hw/boards.h"
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
+#include "exec/memory.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "migration/migration.h"
+#include "qemu/timer.h"
+#include "qapi-event.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -705,3 +709,291 @@ ACPIOSTInfoList *qmp_query_acpi_ospm_status(Error **errp)
 
     return head;
 }
+
+static void query_sync_profile_site(QemuLockSite *site, void *opaque)
+{
+    SyncProfileInfoList ***tail = opaque;
+    SyncProfileInfoList *entry = g_new0(SyncProfileInfoList, 1);
+    SyncProfileInfo *info = g_new0(SyncProfileInfo, 1);
+
+    info->bql = site->bql;
+    info->file = g_strdup(site->file);
+    info->line = site->line;
+    info->acquisitions = atomic_read(&site->acquisitions);
+    info->contended = atomic_read(&site->contended);
+    info->wait_ns = atomic_read(&site->wait_ns);
+    info->max_wait_ns = atomic_read(&site->wait_max_ns);
+    info->hold_ns = atomic_read(&site->hold_ns);
+
+    entry->value = info;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+SyncProfileInfoList *qmp_query_sync_profile(Error **errp)
+{
+    SyncProfileInfoList *head = NULL, **tail = &head;
+
+    qemu_sync_profile_foreach(query_sync_profile_site, &tail);
+    return head;
+}
+
+void qmp_sync_profile(SyncProfileAction action, Error **errp)
+{
+    switch (action) {
+    case SYNC_PROFILE_ACTION_ON:
+        qemu_sync_profile_enable(true);
+        break;
+    case SYNC_PROFILE_ACTION_OFF:
+        qemu_sync_profile_enable(false);
+        break;
+    case SYNC_PROFILE_ACTION_RESET:
+        qemu_sync_profile_reset();
+        break;
+    default:
+        abort();
+    }
+}
+
+static void query_mtree_profile_region(MemoryRegion *mr, void *opaque)
+{
+    MemoryRegionProfileInfoList ***tail = opaque;
+    MemoryRegionProfileInfoList *entry;
+    MemoryRegionProfileInfo *info;
+
+    entry = g_new0(MemoryRegionProfileInfoList, 1);
+    info = g_new0(MemoryRegionProfileInfo, 1);
+    info->name = g_strdup(memory_region_name(mr));
+    if (mr->owner) {
+        info->owner = object_get_canonical_path(mr->owner);
+        info->has_owner = info->owner != NULL;
+    }
+    info->reads = atomic_read(&mr->profile.reads);
+    info->writes = atomic_read(&mr->profile.writes);
+    info->read_bytes = atomic_read(&mr->profile.read_bytes);
+    info->write_bytes = atomic_read(&mr->profile.write_bytes);
+    info->read_ns = atomic_read(&mr->profile.read_ns);
+    info->write_ns = atomic_read(&mr->profile.write_ns);
+
+    entry->value = info;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+MemoryRegionProfileInfoList *qmp_query_mtree_profile(Error **errp)
+{
+    MemoryRegionProfileInfoList *head = NULL, **tail = &head;
+
+    memory_region_profile_foreach(query_mtree_profile_region, &tail);
+    return head;
+}
+
+void qmp_mtree_profile(MtreeProfileAction action, Error **errp)
+{
+    switch (action) {
+    case MTREE_PROFILE_ACTION_ON:
+        memory_region_profile_enable(true);
+        break;
+    case MTREE_PROFILE_ACTION_OFF:
+        memory_region_profile_enable(false);
+        break;
+    case MTREE_PROFILE_ACTION_RESET:
+        memory_region_profile_reset();
+        break;
+    default:
+        abort();
+    }
+}
+
+/* There is a single subscription, all monitors receive the events */
+typedef struct StatsSubscription {
+    QEMUTimer *timer;
+    int64_t interval_ms;
+    bool block;
+    bool migration;
+    bool cpus;
+    strList *devices;
+} StatsSubscription;
+
+static StatsSubscription stats_sub;
+
+static bool stats_want_device(const char *name)
+{
+    strList *dev;
+
+    if (!stats_sub.devices) {
+        return true;
+    }
+    for (dev = stats_sub.devices; dev; dev = dev->next) {
+        if (!strcmp(dev->value, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static BlockStatsSampleList *stats_sample_block(void)
+{
+    BlockStatsSampleList *head = NULL, **tail = &head;
+    BlockBackend *blk;
+
+    for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
+        AioContext *ctx = blk_get_aio_context(blk);
+        BlockStatsSampleList *entry;
+        BlockStatsSample *s;
+        BlockAcctStats *stats;
+
+        if (!stats_want_device(blk_name(blk))) {
+            continue;
+        }
+
+        s = g_new0(BlockStatsSample, 1);
+        s->device = g_strdup(blk_name(blk));
+
+        aio_context_acquire(ctx);
+        stats = blk_get_stats(blk);
+        s->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
+        s->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
+        s->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
+        s->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+        s->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
+        s->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
+        s->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
+        aio_context_release(ctx);
+
+        entry = g_new0(BlockStatsSampleList, 1);
+        entry->value = s;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+static MigrationStatsSample *stats_sample_migration(void)
+{
+    MigrationState *ms = migrate_get_current();
+    MigrationStatsSample *s;
+
+    if (ms->state == MIGRATION_STATUS_NONE) {
+        return NULL;
+    }
+
+    s = g_new0(MigrationStatsSample, 1);
+    s->status = ms->state;
+    s->transferred = ram_bytes_transferred();
+    s->remaining = ram_bytes_remaining();
+    s->dirty_pages_rate = ms->dirty_pages_rate;
+    return s;
+}
+
+/* Unlike qmp_query_cpus, only look at fields that are valid without
+ * cpu_synchronize_state, so that the vCPUs keep running.
+ */
+static CpuStatsSampleList *stats_sample_cpus(void)
+{
+    CpuStatsSampleList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        CpuStatsSampleList *entry = g_new0(CpuStatsSampleList, 1);
+        CpuStatsSample *s = g_new0(CpuStatsSample, 1);
+
+        s->cpu_index = cpu->cpu_index;
+        s->halted = atomic_read(&cpu->halted);
+        s->thread_id = cpu->thread_id;
+
+        entry->value = s;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+static void stats_timer_cb(void *opaque)
+{
+    BlockStatsSampleList *block = NULL;
+    MigrationStatsSample *migration = NULL;
+    CpuStatsSampleList *cpus = NULL;
+
+    if (stats_sub.block) {
+        block = stats_sample_block();
+    }
+    if (stats_sub.migration) {
+        migration = stats_sample_migration();
+    }
+    if (stats_sub.cpus) {
+        cpus = stats_sample_cpus();
+    }
+
+    qapi_event_send_stats(stats_sub.block, block, !!migration, migration,
+                          stats_sub.cpus, cpus, &error_abort);
+
+    qapi_free_BlockStatsSampleList(block);
+    qapi_free_MigrationStatsSample(migration);
+    qapi_free_CpuStatsSampleList(cpus);
+
+    timer_mod(stats_sub.timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + stats_sub.interval_ms);
+}
+
+void qmp_stats_subscribe(uint32_t interval, StatsProviderList *providers,
+                         bool has_devices, strList *devices, Error **errp)
+{
+    StatsProviderList *p;
+    strList *dev;
+
+    if (interval < 100) {
+        error_setg(errp, "The interval must be at least 100 milliseconds");
+        return;
+    }
+    for (dev = has_devices ? devices : NULL; dev; dev = dev->next) {
+        if (!blk_by_name(dev->value)) {
+            error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                      "Device '%s' not found", dev->value);
+            return;
+        }
+    }
+
+    qmp_stats_unsubscribe(NULL);
+
+    for (p = providers; p; p = p->next) {
+        switch (p->value) {
+        case STATS_PROVIDER_BLOCK:
+            stats_sub.block = true;
+            break;
+        case STATS_PROVIDER_MIGRATION:
+            stats_sub.migration = true;
+            break;
+        case STATS_PROVIDER_CPUS:
+            stats_sub.cpus = true;
+            break;
+        default:
+            abort();
+        }
+    }
+
+    if (has_devices) {
+        strList **tail = &stats_sub.devices;
+
+        for (dev = devices; dev; dev = dev->next) {
+            *tail = g_new0(strList, 1);
+            (*tail)->value = g_strdup(dev->value);
+            tail = &(*tail)->next;
+        }
+    }
+
+    stats_sub.interval_ms = interval;
+    stats_sub.timer = timer_new_ms(QEMU_CLOCK_REALTIME, stats_timer_cb, NULL);
+    timer_mod(stats_sub.timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + interval);
+}
+
+void qmp_stats_unsubscribe(Error **errp)
+{
+    if (stats_sub.timer) {
+        timer_del(stats_sub.timer);
+        timer_free(stats_sub.timer);
+    }
+    qapi_free_strList(stats_sub.devices);
+    memset(&stats_sub, 0, sizeof(stats_sub));
+}
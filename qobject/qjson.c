@@ -71,72 +71,99 @@ QObject *qobject_from_jsonf(const char *string, ...)
     return obj;
 }
 
+/* Output is accumulated in @str and, if @flush is not NULL, handed to
+ * it whenever more than QJSON_FLUSH_SIZE bytes have accumulated after an
+ * element of a dictionary or list.  @str is replaced after each flush, so
+ * it must not be cached across calls to to_json.
+ */
+#define QJSON_FLUSH_SIZE 4096
+
+typedef struct ToJsonOutput
+{
+    QString *str;
+    int pretty;
+    QJSONFlushFunc *flush;
+    void *opaque;
+} ToJsonOutput;
+
 typedef struct ToJsonIterState
 {
     int indent;
-    int pretty;
     int count;
-    QString *str;
+    ToJsonOutput *out;
 } ToJsonIterState;
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent);
+static void to_json(const QObject *obj, ToJsonOutput *out, int indent);
+
+static void to_json_maybe_flush(ToJsonOutput *out)
+{
+    if (out->flush && qstring_get_length(out->str) >= QJSON_FLUSH_SIZE) {
+        out->flush(out->opaque, qstring_get_str(out->str));
+        QDECREF(out->str);
+        out->str = qstring_new();
+    }
+}
 
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
+    ToJsonOutput *out = s->out;
     QString *qkey;
     int j;
 
     if (s->count) {
-        qstring_append(s->str, s->pretty ? "," : ", ");
+        qstring_append(out->str, out->pretty ? "," : ", ");
     }
 
-    if (s->pretty) {
-        qstring_append(s->str, "\n");
+    if (out->pretty) {
+        qstring_append(out->str, "\n");
         for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+            qstring_append(out->str, "    ");
     }
 
     qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
+    to_json(QOBJECT(qkey), out, s->indent);
     QDECREF(qkey);
 
-    qstring_append(s->str, ": ");
-    to_json(obj, s->str, s->pretty, s->indent);
+    qstring_append(out->str, ": ");
+    to_json(obj, out, s->indent);
     s->count++;
+    to_json_maybe_flush(out);
 }
 
 static void to_json_list_iter(QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
+    ToJsonOutput *out = s->out;
     int j;
 
     if (s->count) {
-        qstring_append(s->str, s->pretty ? "," : ", ");
+        qstring_append(out->str, out->pretty ? "," : ", ");
     }
 
-    if (s->pretty) {
-        qstring_append(s->str, "\n");
+    if (out->pretty) {
+        qstring_append(out->str, "\n");
         for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+            qstring_append(out->str, "    ");
     }
 
-    to_json(obj, s->str, s->pretty, s->indent);
+    to_json(obj, out, s->indent);
     s->count++;
+    to_json_maybe_flush(out);
 }
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent)
+static void to_json(const QObject *obj, ToJsonOutput *out, int indent)
 {
     switch (qobject_type(obj)) {
     case QTYPE_QNULL:
-        qstring_append(str, "null");
+        qstring_append(out->str, "null");
         break;
     case QTYPE_QINT: {
         QInt *val = qobject_to_qint(obj);
         char buffer[1024];
 
         snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
-        qstring_append(str, buffer);
+        qstring_append(out->str, buffer);
         break;
     }
     case QTYPE_QSTRING: {
@@ -147,31 +174,31 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         char *end;
 
         ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
+        qstring_append(out->str, "\"");
 
         for (; *ptr; ptr = end) {
             cp = mod_utf8_codepoint(ptr, 6, &end);
             switch (cp) {
             case '\"':
-                qstring_append(str, "\\\"");
+                qstring_append(out->str, "\\\"");
                 break;
             case '\\':
-                qstring_append(str, "\\\\");
+                qstring_append(out->str, "\\\\");
                 break;
             case '\b':
-                qstring_append(str, "\\b");
+                qstring_append(out->str, "\\b");
                 break;
             case '\f':
-                qstring_append(str, "\\f");
+                qstring_append(out->str, "\\f");
                 break;
             case '\n':
-                qstring_append(str, "\\n");
+                qstring_append(out->str, "\\n");
                 break;
             case '\r':
-                qstring_append(str, "\\r");
+                qstring_append(out->str, "\\r");
                 break;
             case '\t':
-                qstring_append(str, "\\t");
+                qstring_append(out->str, "\\t");
                 break;
             default:
                 if (cp < 0) {
@@ -188,11 +215,11 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
                     buf[0] = cp;
                     buf[1] = 0;
                 }
-                qstring_append(str, buf);
+                qstring_append(out->str, buf);
             }
         };
 
-        qstring_append(str, "\"");
+        qstring_append(out->str, "\"");
         break;
     }
     case QTYPE_QDICT: {
@@ -200,18 +227,17 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         QDict *val = qobject_to_qdict(obj);
 
         s.count = 0;
-        s.str = str;
+        s.out = out;
         s.indent = indent + 1;
-        s.pretty = pretty;
-        qstring_append(str, "{");
+        qstring_append(out->str, "{");
         qdict_iter(val, to_json_dict_iter, &s);
-        if (pretty) {
+        if (out->pretty) {
             int j;
-            qstring_append(str, "\n");
+            qstring_append(out->str, "\n");
             for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+                qstring_append(out->str, "    ");
         }
-        qstring_append(str, "}");
+        qstring_append(out->str, "}");
         break;
     }
     case QTYPE_QLIST: {
@@ -219,18 +245,17 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         QList *val = qobject_to_qlist(obj);
 
         s.count = 0;
-        s.str = str;
+        s.out = out;
         s.indent = indent + 1;
-        s.pretty = pretty;
-        qstring_append(str, "[");
+        qstring_append(out->str, "[");
         qlist_iter(val, (void *)to_json_list_iter, &s);
-        if (pretty) {
+        if (out->pretty) {
             int j;
-            qstring_append(str, "\n");
+            qstring_append(out->str, "\n");
             for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+                qstring_append(out->str, "    ");
         }
-        qstring_append(str, "]");
+        qstring_append(out->str, "]");
         break;
     }
     case QTYPE_QFLOAT: {
@@ -258,16 +283,16 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
             buffer[len] = 0;
         }
 
-        qstring_append(str, buffer);
+        qstring_append(out->str, buffer);
         break;
     }
     case QTYPE_QBOOL: {
         QBool *val = qobject_to_qbool(obj);
 
         if (qbool_get_bool(val)) {
-            qstring_append(str, "true");
+            qstring_append(out->str, "true");
         } else {
-            qstring_append(str, "false");
+            qstring_append(out->str, "false");
         }
         break;
     }
@@ -278,18 +303,35 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
 
 QString *qobject_to_json(const QObject *obj)
 {
-    QString *str = qstring_new();
+    ToJsonOutput out = { .str = qstring_new() };
 
-    to_json(obj, str, 0, 0);
+    to_json(obj, &out, 0);
 
-    return str;
+    return out.str;
 }
 
 QString *qobject_to_json_pretty(const QObject *obj)
 {
-    QString *str = qstring_new();
+    ToJsonOutput out = { .str = qstring_new(), .pretty = 1 };
 
-    to_json(obj, str, 1, 0);
+    to_json(obj, &out, 0);
 
-    return str;
+    return out.str;
+}
+
+void qobject_to_json_stream(const QObject *obj, bool pretty,
+                            QJSONFlushFunc *flush, void *opaque)
+{
+    ToJsonOutput out = {
+        .str = qstring_new(),
+        .pretty = pretty,
+        .flush = flush,
+        .opaque = opaque,
+    };
+
+    to_json(obj, &out, 0);
+    if (qstring_get_length(out.str)) {
+        flush(opaque, qstring_get_str(out.str));
+    }
+    QDECREF(out.str);
 }
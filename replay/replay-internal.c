@@ -16,6 +16,30 @@
 #include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
 
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/bswap.h"
+#include <zlib.h>
+
+/* The log is written as a sequence of chunks, each of them holding whole
+   events and optionally compressed on its own.  A chunk is closed before
+   the first event that starts after REPLAY_CHUNK_SIZE bytes, so the file
+   offset and instruction count of every chunk make a seek marker; the
+   list of markers is appended after the last chunk.
+   Every chunk is stored as dword raw size, dword stored size and the
+   data, which is compressed with zlib if the stored size is smaller.  */
+#define REPLAY_CHUNK_SIZE           (1 << 20)
+#define REPLAY_CHUNK_HEADER_SIZE    (2 * sizeof(uint32_t))
+/* Chunks waiting for the writer thread before recording blocks */
+#define REPLAY_CHUNK_QUEUE_MAX      8
+
+typedef struct ReplayChunk {
+    uint8_t *data;
+    size_t len;
+    uint64_t step;
+    QSIMPLEQ_ENTRY(ReplayChunk) next;
+} ReplayChunk;
+
 unsigned int replay_data_kind = -1;
 static unsigned int replay_has_unread_data;
 
@@ -29,16 +53,309 @@ static QemuMutex lock;
 /* File for replay writing */
 FILE *replay_file;
 
+/* The chunk being filled in record mode or consumed in play mode */
+static uint8_t *log_buf;
+static size_t log_len;
+static size_t log_pos;
+static size_t log_size;
+static uint64_t log_step;
+static bool log_eof;
+static bool log_error;
+
+/* Seek markers, in increasing order of step */
+static GArray *log_markers;
+/* End of the chunks in play mode, 0 if unknown */
+static int64_t log_end;
+
+/* The writer thread compresses and writes the chunks queued by
+   replay_log_submit() in record mode.  log_queue, log_queued and
+   log_stop are protected by log_queue_lock. */
+static bool log_compress;
+static QemuThread log_thread;
+static QemuMutex log_queue_lock;
+static QemuCond log_queue_cond;
+static QemuCond log_queue_free_cond;
+static QSIMPLEQ_HEAD(, ReplayChunk) log_queue =
+    QSIMPLEQ_HEAD_INITIALIZER(log_queue);
+static int log_queued;
+static bool log_stop;
+
+static void replay_log_write_chunk(ReplayChunk *chunk)
+{
+    uint8_t header[REPLAY_CHUNK_HEADER_SIZE];
+    uint8_t *data = chunk->data;
+    uLongf stored = chunk->len;
+    uint8_t *zbuf = NULL;
+    ReplayMarker marker;
+
+    if (log_compress) {
+        uLongf zlen = compressBound(chunk->len);
+
+        zbuf = g_malloc(zlen);
+        if (compress2(zbuf, &zlen, chunk->data, chunk->len,
+                      Z_BEST_SPEED) == Z_OK && zlen < chunk->len) {
+            data = zbuf;
+            stored = zlen;
+        }
+    }
+
+    marker.step = chunk->step;
+    marker.offset = ftello(replay_file);
+    g_array_append_val(log_markers, marker);
+
+    stl_be_p(header, chunk->len);
+    stl_be_p(header + sizeof(uint32_t), stored);
+    if (fwrite(header, 1, sizeof(header), replay_file) != sizeof(header) ||
+        fwrite(data, 1, stored, replay_file) != stored) {
+        if (!log_error) {
+            error_report("replay write error: %s", strerror(errno));
+        }
+        log_error = true;
+    }
+    g_free(zbuf);
+}
+
+static void *replay_log_thread(void *opaque)
+{
+    ReplayChunk *chunk;
+
+    qemu_mutex_lock(&log_queue_lock);
+    while (true) {
+        chunk = QSIMPLEQ_FIRST(&log_queue);
+        if (!chunk) {
+            if (log_stop) {
+                break;
+            }
+            qemu_cond_wait(&log_queue_cond, &log_queue_lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&log_queue, next);
+        qemu_mutex_unlock(&log_queue_lock);
+
+        replay_log_write_chunk(chunk);
+        g_free(chunk->data);
+        g_free(chunk);
+
+        qemu_mutex_lock(&log_queue_lock);
+        log_queued--;
+        qemu_cond_signal(&log_queue_free_cond);
+    }
+    qemu_mutex_unlock(&log_queue_lock);
+    return NULL;
+}
+
+/* Hands the current chunk over to the writer thread */
+static void replay_log_submit(void)
+{
+    ReplayChunk *chunk;
+
+    if (!log_len) {
+        return;
+    }
+
+    chunk = g_new(ReplayChunk, 1);
+    chunk->data = log_buf;
+    chunk->len = log_len;
+    chunk->step = log_step;
+
+    qemu_mutex_lock(&log_queue_lock);
+    while (log_queued >= REPLAY_CHUNK_QUEUE_MAX) {
+        qemu_cond_wait(&log_queue_free_cond, &log_queue_lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&log_queue, chunk, next);
+    log_queued++;
+    qemu_cond_signal(&log_queue_cond);
+    qemu_mutex_unlock(&log_queue_lock);
+
+    log_size = REPLAY_CHUNK_SIZE;
+    log_buf = g_malloc(log_size);
+    log_len = 0;
+    log_step = replay_state.current_step;
+}
+
+void replay_log_start_write(bool compress)
+{
+    log_compress = compress;
+    log_markers = g_array_new(false, false, sizeof(ReplayMarker));
+    log_size = REPLAY_CHUNK_SIZE;
+    log_buf = g_malloc(log_size);
+    log_len = 0;
+    log_step = 0;
+    log_stop = false;
+    qemu_mutex_init(&log_queue_lock);
+    qemu_cond_init(&log_queue_cond);
+    qemu_cond_init(&log_queue_free_cond);
+    qemu_thread_create(&log_thread, "replay-log", replay_log_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+int64_t replay_log_finish_write(void)
+{
+    uint8_t entry[2 * sizeof(uint64_t)];
+    int64_t offset;
+    guint i;
+
+    replay_log_submit();
+    qemu_mutex_lock(&log_queue_lock);
+    log_stop = true;
+    qemu_cond_signal(&log_queue_cond);
+    qemu_mutex_unlock(&log_queue_lock);
+    qemu_thread_join(&log_thread);
+
+    qemu_cond_destroy(&log_queue_free_cond);
+    qemu_cond_destroy(&log_queue_cond);
+    qemu_mutex_destroy(&log_queue_lock);
+
+    /* the marker list: qword count, then qword step and offset pairs */
+    offset = ftello(replay_file);
+    stq_be_p(entry, log_markers->len);
+    fwrite(entry, 1, sizeof(uint64_t), replay_file);
+    for (i = 0; i < log_markers->len; i++) {
+        ReplayMarker *marker = &g_array_index(log_markers, ReplayMarker, i);
+
+        stq_be_p(entry, marker->step);
+        stq_be_p(entry + sizeof(uint64_t), marker->offset);
+        fwrite(entry, 1, sizeof(entry), replay_file);
+    }
+    return offset;
+}
+
+/* Loads the chunk at the current file position, false at the end */
+static bool replay_log_read_chunk(void)
+{
+    uint8_t header[REPLAY_CHUNK_HEADER_SIZE];
+    uLongf raw, stored;
+    uint8_t *zbuf;
+
+    log_len = log_pos = 0;
+    if (log_end && ftello(replay_file) >= log_end) {
+        log_eof = true;
+        return false;
+    }
+    if (fread(header, 1, sizeof(header), replay_file) != sizeof(header)) {
+        log_eof = true;
+        return false;
+    }
+
+    raw = ldl_be_p(header);
+    stored = ldl_be_p(header + sizeof(uint32_t));
+    if (raw > log_size) {
+        log_size = raw;
+        log_buf = g_realloc(log_buf, log_size);
+    }
+
+    if (stored == raw) {
+        if (fread(log_buf, 1, raw, replay_file) != raw) {
+            log_error = true;
+            return false;
+        }
+    } else {
+        zbuf = g_malloc(stored);
+        if (fread(zbuf, 1, stored, replay_file) != stored ||
+            uncompress(log_buf, &raw, zbuf, stored) != Z_OK) {
+            g_free(zbuf);
+            log_error = true;
+            return false;
+        }
+        g_free(zbuf);
+    }
+    log_len = raw;
+    return true;
+}
+
+void replay_log_start_read(int64_t markers_offset)
+{
+    uint8_t entry[2 * sizeof(uint64_t)];
+    int64_t start = ftello(replay_file);
+    uint64_t count, i;
+
+    log_markers = g_array_new(false, false, sizeof(ReplayMarker));
+    log_size = REPLAY_CHUNK_SIZE;
+    log_buf = g_malloc(log_size);
+    log_end = markers_offset;
+
+    if (markers_offset) {
+        fseeko(replay_file, markers_offset, SEEK_SET);
+        if (fread(entry, 1, sizeof(uint64_t), replay_file) == sizeof(uint64_t)) {
+            count = ldq_be_p(entry);
+            for (i = 0; i < count; i++) {
+                ReplayMarker marker;
+
+                if (fread(entry, 1, sizeof(entry), replay_file)
+                    != sizeof(entry)) {
+                    break;
+                }
+                marker.step = ldq_be_p(entry);
+                marker.offset = ldq_be_p(entry + sizeof(uint64_t));
+                g_array_append_val(log_markers, marker);
+            }
+        }
+        fseeko(replay_file, start, SEEK_SET);
+    }
+    replay_log_read_chunk();
+}
+
+void replay_log_close(void)
+{
+    g_free(log_buf);
+    log_buf = NULL;
+    log_len = log_pos = log_size = 0;
+    log_eof = log_error = false;
+    log_end = 0;
+    if (log_markers) {
+        g_array_free(log_markers, true);
+        log_markers = NULL;
+    }
+}
+
+uint64_t replay_log_seek(uint64_t step)
+{
+    ReplayMarker *marker = NULL;
+    guint lo = 0, hi = log_markers->len;
+
+    /* find the last marker at or before step */
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index(log_markers, ReplayMarker, mid).step <= step) {
+            marker = &g_array_index(log_markers, ReplayMarker, mid);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!marker) {
+        return replay_state.current_step;
+    }
+
+    fseeko(replay_file, marker->offset, SEEK_SET);
+    log_eof = log_error = false;
+    replay_log_read_chunk();
+    replay_state.current_step = marker->step;
+    replay_state.instructions_count = 0;
+    replay_has_unread_data = 0;
+    replay_fetch_data_kind();
+    return marker->step;
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        if (log_len == log_size) {
+            log_size *= 2;
+            log_buf = g_realloc(log_buf, log_size);
+        }
+        log_buf[log_len++] = byte;
     }
 }
 
 void replay_put_event(uint8_t event)
 {
     assert(event < EVENT_COUNT);
+    /* async events belong to the checkpoint before them */
+    if (log_len >= REPLAY_CHUNK_SIZE && event != EVENT_ASYNC) {
+        replay_log_submit();
+    }
     replay_put_byte(event);
 }
 
@@ -61,11 +378,21 @@ void replay_put_qword(int64_t qword)
     replay_put_dword(qword);
 }
 
+static void replay_log_write(const uint8_t *buf, size_t size)
+{
+    if (log_len + size > log_size) {
+        log_size = MAX(log_size * 2, log_len + size);
+        log_buf = g_realloc(log_buf, log_size);
+    }
+    memcpy(log_buf + log_len, buf, size);
+    log_len += size;
+}
+
 void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        replay_log_write(buf, size);
     }
 }
 
@@ -73,7 +400,10 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (log_pos == log_len && !replay_log_read_chunk()) {
+            return 0;
+        }
+        byte = log_buf[log_pos++];
     }
     return byte;
 }
@@ -111,11 +441,23 @@ int64_t replay_get_qword(void)
     return qword;
 }
 
+/* Arrays never span chunks, except in logs cut short */
+static bool replay_log_read(uint8_t *buf, size_t size)
+{
+    if (log_len - log_pos < size) {
+        log_error = true;
+        return false;
+    }
+    memcpy(buf, log_buf + log_pos, size);
+    log_pos += size;
+    return true;
+}
+
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (!replay_log_read(buf, *size)) {
             error_report("replay read error");
         }
     }
@@ -126,7 +468,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (!replay_log_read(*buf, *size)) {
             error_report("replay read error");
         }
     }
@@ -135,7 +477,11 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (log_error) {
+            error_report("replay file is over or something goes wrong");
+            qemu_system_vmstop_request_prepare();
+            qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+        } else if (log_eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
@@ -69,6 +69,30 @@ extern unsigned int replay_data_kind;
 /* File for replay writing */
 extern FILE *replay_file;
 
+/*! Position in the log where the execution may be resumed */
+typedef struct ReplayMarker {
+    /*! Instructions executed before the marker */
+    uint64_t step;
+    /*! File offset of the log chunk starting at the marker */
+    uint64_t offset;
+} ReplayMarker;
+
+/*! Starts the log writer thread, the file must be positioned after
+    the header. */
+void replay_log_start_write(bool compress);
+/*! Writes the remaining events and the seek markers, stops the writer
+    thread and returns the file offset of the markers. */
+int64_t replay_log_finish_write(void);
+/*! Loads the seek markers stored at @markers_offset, if not zero, and
+    the first chunk of the log following the header. */
+void replay_log_start_read(int64_t markers_offset);
+/*! Frees the log buffers in either mode. */
+void replay_log_close(void);
+/*! Moves the log to the last seek marker at or before @step, fetches
+    its first event and returns the step of the marker.  The current
+    position is kept if there is no such marker. */
+uint64_t replay_log_seek(uint64_t step);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
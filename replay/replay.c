@@ -17,11 +17,12 @@
 #include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
+#include "qemu/bswap.h"
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02003
-/* Size of replay log header */
+#define REPLAY_VERSION              0xe02004
+/* Size of replay log header: version and offset of the seek markers */
 #define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
@@ -206,7 +207,7 @@ out:
     return res;
 }
 
-static void replay_enable(const char *fname, int mode)
+static void replay_enable(const char *fname, int mode, bool compress)
 {
     const char *fmode = NULL;
     assert(!replay_file);
@@ -243,14 +244,16 @@ static void replay_enable(const char *fname, int mode)
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_start_write(compress);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
+        uint8_t header[HEADER_SIZE];
+
+        if (fread(header, 1, HEADER_SIZE, replay_file) != HEADER_SIZE
+            || ldl_be_p(header) != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_start_read(ldq_be_p(header + sizeof(uint32_t)));
         replay_fetch_data_kind();
     }
 
@@ -290,7 +293,7 @@ void replay_configure(QemuOpts *opts)
         exit(1);
     }
 
-    replay_enable(fname, mode);
+    replay_enable(fname, mode, qemu_opt_get_bool(opts, "rrcompress", false));
 
     loc_pop(&loc);
 }
@@ -326,14 +329,19 @@ void replay_finish(void)
     /* finalize the file */
     if (replay_file) {
         if (replay_mode == REPLAY_MODE_RECORD) {
+            uint8_t header[HEADER_SIZE];
+
             /* write end event */
             replay_put_event(EVENT_END);
+            stq_be_p(header + sizeof(uint32_t), replay_log_finish_write());
 
             /* write header */
+            stl_be_p(header, REPLAY_VERSION);
             fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
+            fwrite(header, 1, HEADER_SIZE, replay_file);
         }
 
+        replay_log_close();
         fclose(replay_file);
         replay_file = NULL;
     }
@@ -24,6 +24,7 @@ def generate(events, backend):
         '',
         '#include "qemu-common.h"',
         '#include "qemu/typedefs.h"',
+        '#include "trace/control.h"',
         '')
 
     backend.generate_begin(events)
@@ -36,6 +37,11 @@ def generate(events, backend):
             args=e.args)
 
         if "disable" not in e.properties:
+            out('    if (trace_event_get_state(%(event_id)s) &&',
+                '        !trace_event_sample(%(event_id)s)) {',
+                '        return;',
+                '    }',
+                event_id="TRACE_" + e.name.upper())
             backend.generate(e)
 
         out('}')
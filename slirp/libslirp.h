@@ -26,6 +26,12 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* pkt is a TCP frame for the NIC to cut into gso_size byte segments;
+ * the callee may modify it. */
+void slirp_output_gso(void *opaque, uint8_t *pkt, int pkt_len, int gso_size);
+
+/* Tell slirp whether slirp_output_gso() may be used. */
+void slirp_set_tso(Slirp *slirp, bool tso4);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
@@ -18,7 +18,12 @@
 #include "qemu/osdep.h"
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/*
+ * Mbufs are recycled through m_freelist up to this many; a bulk TCP
+ * transfer keeps a window's worth of segments in flight, so keep
+ * enough around that steady state never goes back to malloc().
+ */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -94,6 +99,7 @@ m_get(Slirp *slirp)
         m->m_prevpkt = NULL;
         m->resolution_requested = false;
         m->expiration_date = (uint64_t)-1;
+        m->m_gso_size = 0;
 end_error:
 	DEBUG_ARG("m = %p", m);
 	return m;
@@ -81,6 +81,7 @@ struct mbuf {
 	Slirp *slirp;
 	bool	resolution_requested;
 	uint64_t expiration_date;
+	int	m_gso_size;		/* MSS the NIC segments this at, or 0 */
 	/* start of dynamic buffer area, must be last element */
 	union {
 		char	m_dat[1]; /* ANSI don't like 0 sized arrays */
@@ -882,7 +882,7 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
     const struct ip *iph = (const struct ip *)ifm->m_data;
     int ret;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (ifm->m_len + ETH_HLEN > sizeof(buf) && !ifm->m_gso_size) {
         return 1;
     }
 
@@ -913,11 +913,26 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
     DEBUG_ARGS((dfd, " dst = %02x:%02x:%02x:%02x:%02x:%02x\n",
                 eh->h_dest[0], eh->h_dest[1], eh->h_dest[2],
                 eh->h_dest[3], eh->h_dest[4], eh->h_dest[5]));
+    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+        uint8_t *pkt = g_malloc(ifm->m_len + ETH_HLEN);
+
+        memcpy(pkt, buf, ETH_HLEN);
+        memcpy(pkt + ETH_HLEN, ifm->m_data, ifm->m_len);
+        slirp_output_gso(slirp->opaque, pkt, ifm->m_len + ETH_HLEN,
+                         ifm->m_gso_size);
+        g_free(pkt);
+        return 1;
+    }
     memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
     slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
     return 1;
 }
 
+void slirp_set_tso(Slirp *slirp, bool tso4)
+{
+    slirp->tso4 = tso4;
+}
+
 /* Drop host forwarding rule, return 0 if found. */
 int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
                          int host_port)
@@ -195,6 +195,7 @@ struct Slirp {
 
     int restricted;
     struct ex_list *exec_list;
+    bool tso4;              /* guest NIC segments large TCPv4 frames */
 
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
@@ -67,6 +67,7 @@ tcp_output(struct tcpcb *tp)
 	u_char opt[MAX_TCPOPTLEN];
 	unsigned optlen, hdrlen;
 	int idle, sendalot;
+	long segmax;
 
 	DEBUG_CALL("tcp_output");
 	DEBUG_ARG("tp = %p", tp);
@@ -147,8 +148,18 @@ again:
 		}
 	}
 
-	if (len > tp->t_maxseg) {
-		len = tp->t_maxseg;
+	/*
+	 * If the guest NIC does TCP segmentation for us, hand it as many
+	 * whole segments as fit in one IP datagram; it cuts them back to
+	 * t_maxseg on the way in.
+	 */
+	segmax = tp->t_maxseg;
+	if (so->slirp->tso4 && so->so_ffamily == AF_INET) {
+		segmax *= (IP_MAXPACKET - sizeof(struct ip)
+		           - sizeof(struct tcphdr)) / tp->t_maxseg;
+	}
+	if (len > segmax) {
+		len = segmax;
 		sendalot = 1;
 	}
 	if (SEQ_LT(tp->snd_nxt + len, tp->snd_una + so->so_snd.sb_cc))
@@ -167,7 +178,7 @@ again:
 	 * to send into a small window), then must resend.
 	 */
 	if (len) {
-		if (len == tp->t_maxseg)
+		if (len >= tp->t_maxseg)
 			goto send;
 		if ((1 || idle || tp->t_flags & TF_NODELAY) &&
 		    len + off >= so->so_snd.sb_cc)
@@ -283,8 +294,8 @@ send:
 	 * Adjust data length if insertion of options will
 	 * bump the packet length beyond the t_maxseg length.
 	 */
-	 if (len > tp->t_maxseg - optlen) {
-		len = tp->t_maxseg - optlen;
+	 if (len > segmax - optlen) {
+		len = segmax - optlen;
 		sendalot = 1;
 	 }
 
@@ -299,6 +310,7 @@ send:
 			error = 1;
 			goto out;
 		}
+		m_inc(m, IF_MAXLINKHDR + hdrlen + len);
 		m->m_data += IF_MAXLINKHDR;
 		m->m_len = hdrlen;
 
@@ -460,6 +472,9 @@ send:
 	    ip = mtod(m, struct ip *);
 
 	    ip->ip_len = m->m_len;
+	    if (len > tp->t_maxseg) {
+	        m->m_gso_size = tp->t_maxseg;
+	    }
 	    ip->ip_dst = tcpiph_save.ti_dst;
 	    ip->ip_src = tcpiph_save.ti_src;
 	    ip->ip_p = tcpiph_save.ti_pr;
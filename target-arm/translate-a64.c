@@ -20,6 +20,7 @@
 
 #include "cpu.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -456,6 +457,15 @@ static inline int vec_reg_offset(DisasContext *s, int regno,
     return offs;
 }
 
+/* Return the offset into CPUARMState of the whole 128 bit vector
+ * register Qn, for use with the generic vector operations.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
 /* Return the offset into CPUARMState of a slice (from
  * the least significant end) of FP register Qn (ie
  * Dn, Sn, Hn or Bn).
@@ -1660,7 +1670,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
         return;
     }
 
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_INDIRECT_JUMP;
 }
 
 /* C3.2 Branches, exception generating and system instructions */
@@ -1703,9 +1713,8 @@ static void disas_b_exc_sys(DisasContext *s, uint32_t insn)
  * mandated semantics, but it works for typical guest code sequences
  * and avoids having to monitor regular stores.
  *
- * In system emulation mode only one CPU will be running at once, so
- * this sequence is effectively atomic.  In user emulation mode we
- * throw an exception and handle the atomic operation elsewhere.
+ * The store is a compare-and-swap, which makes it atomic with respect to
+ * other vCPUs running in parallel.
  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i64 addr, int size, bool is_pair)
@@ -1736,25 +1745,28 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     tcg_gen_mov_i64(cpu_exclusive_addr, addr);
 }
 
+/* There is no 128-bit compare-and-swap, so a store exclusive of a pair of
+ * 64-bit registers still uses the old mechanisms: an exception handled
+ * by the cpu loop in user mode, and a plain check-and-store sequence in
+ * system emulation.
+ */
 #ifdef CONFIG_USER_ONLY
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 addr, int size, int is_pair)
+static void gen_store_exclusive_pair128(DisasContext *s, int rd, int rt,
+                                        int rt2, TCGv_i64 addr)
 {
     tcg_gen_mov_i64(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | is_pair << 2 | (rd << 4) | (rt << 9) | (rt2 << 14));
+                     3 | 1 << 2 | (rd << 4) | (rt << 9) | (rt2 << 14));
     gen_exception_internal_insn(s, 4, EXCP_STREX);
 }
 #else
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 inaddr, int size, int is_pair)
+static void gen_store_exclusive_pair128(DisasContext *s, int rd, int rt,
+                                        int rt2, TCGv_i64 inaddr)
 {
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]
-     *     && (!is_pair || env->exclusive_high == [addr + datasize])) {
+     *     && env->exclusive_high == [addr + 8]) {
      *     [addr] = {Rt};
-     *     if (is_pair) {
-     *         [addr + datasize] = {Rt2};
-     *     }
+     *     [addr + 8] = {Rt2};
      *     {Rd} = 0;
      * } else {
      *     {Rd} = 1;
@@ -1764,7 +1776,7 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGLabel *fail_label = gen_new_label();
     TCGLabel *done_label = gen_new_label();
     TCGv_i64 addr = tcg_temp_local_new_i64();
-    TCGv_i64 tmp;
+    TCGv_i64 addrhi, tmp;
 
     /* Copy input into a local temp so it is not trashed when the
      * basic block ends at the branch insn.
@@ -1773,34 +1785,26 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
 
     tmp = tcg_temp_new_i64();
-    tcg_gen_qemu_ld_i64(tmp, addr, get_mem_index(s), s->be_data + size);
+    tcg_gen_qemu_ld_i64(tmp, addr, get_mem_index(s), s->be_data + MO_64);
     tcg_gen_brcond_i64(TCG_COND_NE, tmp, cpu_exclusive_val, fail_label);
     tcg_temp_free_i64(tmp);
 
-    if (is_pair) {
-        TCGv_i64 addrhi = tcg_temp_new_i64();
-        TCGv_i64 tmphi = tcg_temp_new_i64();
-
-        tcg_gen_addi_i64(addrhi, addr, 1 << size);
-        tcg_gen_qemu_ld_i64(tmphi, addrhi, get_mem_index(s),
-                            s->be_data + size);
-        tcg_gen_brcond_i64(TCG_COND_NE, tmphi, cpu_exclusive_high, fail_label);
-
-        tcg_temp_free_i64(tmphi);
-        tcg_temp_free_i64(addrhi);
-    }
+    addrhi = tcg_temp_new_i64();
+    tmp = tcg_temp_new_i64();
+    tcg_gen_addi_i64(addrhi, addr, 8);
+    tcg_gen_qemu_ld_i64(tmp, addrhi, get_mem_index(s), s->be_data + MO_64);
+    tcg_gen_brcond_i64(TCG_COND_NE, tmp, cpu_exclusive_high, fail_label);
+    tcg_temp_free_i64(tmp);
+    tcg_temp_free_i64(addrhi);
 
     /* We seem to still have the exclusive monitor, so do the store */
     tcg_gen_qemu_st_i64(cpu_reg(s, rt), addr, get_mem_index(s),
-                        s->be_data + size);
-    if (is_pair) {
-        TCGv_i64 addrhi = tcg_temp_new_i64();
-
-        tcg_gen_addi_i64(addrhi, addr, 1 << size);
-        tcg_gen_qemu_st_i64(cpu_reg(s, rt2), addrhi,
-                            get_mem_index(s), s->be_data + size);
-        tcg_temp_free_i64(addrhi);
-    }
+                        s->be_data + MO_64);
+    addrhi = tcg_temp_new_i64();
+    tcg_gen_addi_i64(addrhi, addr, 8);
+    tcg_gen_qemu_st_i64(cpu_reg(s, rt2), addrhi, get_mem_index(s),
+                        s->be_data + MO_64);
+    tcg_temp_free_i64(addrhi);
 
     tcg_temp_free_i64(addr);
 
@@ -1810,10 +1814,82 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_movi_i64(cpu_reg(s, rd), 1);
     gen_set_label(done_label);
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
-
 }
 #endif
 
+/* The store is a compare-and-swap against the value(s) remembered by
+ * the load exclusive:
+ *
+ * if (env->exclusive_addr == addr && env->exclusive_val == [addr]
+ *     && (!is_pair || env->exclusive_high == [addr + datasize])) {
+ *     [addr] = {Rt};
+ *     if (is_pair) {
+ *         [addr + datasize] = {Rt2};
+ *     }
+ *     {Rd} = 0;
+ * } else {
+ *     {Rd} = 1;
+ * }
+ * env->exclusive_addr = -1;
+ */
+static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
+                                TCGv_i64 inaddr, int size, int is_pair)
+{
+    TCGLabel *fail_label;
+    TCGLabel *done_label;
+    TCGv_i64 addr, tmp;
+
+    if (is_pair && size == 3) {
+        gen_store_exclusive_pair128(s, rd, rt, rt2, inaddr);
+        return;
+    }
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    addr = tcg_temp_local_new_i64();
+
+    /* Copy input into a local temp so it is not trashed when the
+     * basic block ends at the branch insn.
+     */
+    tcg_gen_mov_i64(addr, inaddr);
+    tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+
+    tmp = tcg_temp_new_i64();
+    if (is_pair) {
+        /* A pair of 32-bit registers is one 64-bit compare-and-swap.  */
+        TCGv_i64 cmp = tcg_temp_new_i64();
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        if (s->be_data == MO_LE) {
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_val, cpu_exclusive_high);
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt), cpu_reg(s, rt2));
+        } else {
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_high, cpu_exclusive_val);
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt2), cpu_reg(s, rt));
+        }
+        tcg_gen_atomic_cmpxchg_i64(cpu_env, tmp, addr, cmp, val,
+                                   get_mem_index(s),
+                                   MO_64 | MO_ALIGN | s->be_data);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cmp);
+        tcg_temp_free_i64(val);
+        tcg_temp_free_i64(cmp);
+    } else {
+        tcg_gen_atomic_cmpxchg_i64(cpu_env, tmp, addr, cpu_exclusive_val,
+                                   cpu_reg(s, rt), get_mem_index(s),
+                                   size | MO_ALIGN | s->be_data);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cpu_exclusive_val);
+    }
+    tcg_gen_mov_i64(cpu_reg(s, rd), tmp);
+    tcg_temp_free_i64(tmp);
+    tcg_temp_free_i64(addr);
+    tcg_gen_br(done_label);
+
+    gen_set_label(fail_label);
+    tcg_gen_movi_i64(cpu_reg(s, rd), 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+}
+
 /* C3.3.6 Load/store exclusive
  *
  *  31 30 29         24  23  22   21  20  16  15  14   10 9    5 4    0
@@ -8880,6 +8956,33 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         return;
     }
 
+    /* AND, BIC, ORR, ORN and EOR don't depend on the old value of Rd */
+    if (!is_u || size == 0) {
+        int d = vec_full_reg_offset(s, rd);
+        int n = vec_full_reg_offset(s, rn);
+        int m = vec_full_reg_offset(s, rm);
+        int oprsz = is_q ? 16 : 8;
+
+        switch ((is_u << 2) | size) {
+        case 0: /* AND */
+            tcg_gen_gvec_and(cpu_env, d, n, m, oprsz, 16);
+            break;
+        case 1: /* BIC */
+            tcg_gen_gvec_andc(cpu_env, d, n, m, oprsz, 16);
+            break;
+        case 2: /* ORR */
+            tcg_gen_gvec_or(cpu_env, d, n, m, oprsz, 16);
+            break;
+        case 3: /* ORN */
+            tcg_gen_gvec_orc(cpu_env, d, n, m, oprsz, 16);
+            break;
+        case 4: /* EOR */
+            tcg_gen_gvec_xor(cpu_env, d, n, m, oprsz, 16);
+            break;
+        }
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -8889,47 +8992,25 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         read_vec_element(s, tcg_op1, rn, pass, MO_64);
         read_vec_element(s, tcg_op2, rm, pass, MO_64);
 
-        if (!is_u) {
-            switch (size) {
-            case 0: /* AND */
-                tcg_gen_and_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BIC */
-                tcg_gen_andc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 2: /* ORR */
-                tcg_gen_or_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 3: /* ORN */
-                tcg_gen_orc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            }
-        } else {
-            if (size != 0) {
-                /* B* ops need res loaded to operate on */
-                read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
-            }
+        /* B* ops need res loaded to operate on */
+        read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
 
-            switch (size) {
-            case 0: /* EOR */
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BSL bitwise select */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
-                break;
-            case 2: /* BIT, bitwise insert if true */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            case 3: /* BIF, bitwise insert if false */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            }
+        switch (size) {
+        case 1: /* BSL bitwise select */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
+            break;
+        case 2: /* BIT, bitwise insert if true */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
+        case 3: /* BIF, bitwise insert if false */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
         }
     }
 
@@ -9193,6 +9274,45 @@ static void disas_simd_3same_float(DisasContext *s, uint32_t insn)
 }
 
 /* Integer op subgroup of C3.6.16. */
+/* Integer op subgroup of C3.6.16 for the operations that map directly
+ * onto generic vector operations; returns false for the others.
+ */
+static bool handle_3same_int_gvec(DisasContext *s, int opcode, bool u,
+                                  int size, bool is_q, int rd, int rn, int rm)
+{
+    int d = vec_full_reg_offset(s, rd);
+    int n = vec_full_reg_offset(s, rn);
+    int m = vec_full_reg_offset(s, rm);
+    int oprsz = is_q ? 16 : 8;
+    TCGCond cond;
+
+    switch (opcode) {
+    case 0x10: /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(cpu_env, size, d, n, m, oprsz, 16);
+        } else {
+            tcg_gen_gvec_add(cpu_env, size, d, n, m, oprsz, 16);
+        }
+        return true;
+    case 0x6: /* CMGT, CMHI */
+        cond = u ? TCG_COND_GTU : TCG_COND_GT;
+        break;
+    case 0x7: /* CMGE, CMHS */
+        cond = u ? TCG_COND_GEU : TCG_COND_GE;
+        break;
+    case 0x11: /* CMTST, CMEQ */
+        if (!u) {
+            return false;
+        }
+        cond = TCG_COND_EQ;
+        break;
+    default:
+        return false;
+    }
+    tcg_gen_gvec_cmp(cpu_env, cond, size, d, n, m, oprsz, 16);
+    return true;
+}
+
 static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
 {
     int is_q = extract32(insn, 30, 1);
@@ -9242,6 +9362,10 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (handle_3same_int_gvec(s, opcode, u, size, is_q, rd, rn, rm)) {
+        return;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -11174,7 +11298,7 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        if (dc->is_jmp != DISAS_JUMP && dc->is_jmp != DISAS_INDIRECT_JUMP) {
             gen_a64_set_pc_im(dc->pc);
         }
         if (cs->singlestep_enabled) {
@@ -11195,6 +11319,9 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_INDIRECT_JUMP:
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
@@ -24,6 +24,7 @@
 #include "internals.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "qemu/bitops.h"
 #include "arm_ldst.h"
@@ -880,7 +881,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_INDIRECT_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -917,6 +918,22 @@ static inline void store_reg_from_load(DisasContext *s, int reg, TCGv_i32 var)
 #define IS_USER_ONLY 0
 #endif
 
+/* Return the target address of an AArch32 access of size OPC to the
+ * 32-bit vaddr A32, for use with the tcg_gen_atomic_* functions.
+ * The caller must free the result.
+ */
+static TCGv gen_aa32_addr(DisasContext *s, TCGv_i32 a32, TCGMemOp opc)
+{
+    TCGv addr = tcg_temp_new();
+
+    tcg_gen_extu_i32_tl(addr, a32);
+    /* Not needed for user-mode BE32, where we use MO_BE instead.  */
+    if (!IS_USER_ONLY && s->sctlr_b && (opc & MO_SIZE) < MO_32) {
+        tcg_gen_xori_tl(addr, addr, 4 - (1 << (opc & MO_SIZE)));
+    }
+    return addr;
+}
+
 /* Abstractions of "generate code to do a guest load/store for
  * AArch32", where a vaddr is always 32 bits (and is zero
  * extended if we're a 64 bit core) and  data is also
@@ -5372,6 +5389,70 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Expand the three-register-same operations that map directly onto
+   generic vector operations, without a per-pass loop.  Returns false if
+   OP needs the general code below.  The encoding has already been
+   checked.  */
+static bool gen_neon_3same_gvec(int op, int u, int size, int q,
+                                int rd, int rn, int rm)
+{
+    int sz = q ? 16 : 8;
+    int d = offsetof(CPUARMState, vfp.regs[rd]);
+    int n = offsetof(CPUARMState, vfp.regs[rn]);
+    int m = offsetof(CPUARMState, vfp.regs[rm]);
+
+    switch (op) {
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_gvec_and(cpu_env, d, n, m, sz, sz);
+            break;
+        case 1: /* VBIC */
+            tcg_gen_gvec_andc(cpu_env, d, n, m, sz, sz);
+            break;
+        case 2: /* VORR, VMOV */
+            if (rn == rm) {
+                tcg_gen_gvec_mov(cpu_env, d, n, sz, sz);
+            } else {
+                tcg_gen_gvec_or(cpu_env, d, n, m, sz, sz);
+            }
+            break;
+        case 3: /* VORN */
+            tcg_gen_gvec_orc(cpu_env, d, n, m, sz, sz);
+            break;
+        case 4: /* VEOR */
+            tcg_gen_gvec_xor(cpu_env, d, n, m, sz, sz);
+            break;
+        default: /* VBSL, VBIT, VBIF */
+            return false;
+        }
+        return true;
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_gvec_sub(cpu_env, size, d, n, m, sz, sz);
+        } else {
+            tcg_gen_gvec_add(cpu_env, size, d, n, m, sz, sz);
+        }
+        return true;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, d, n, m, sz, sz);
+        return true;
+    case NEON_3R_VCGT:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GTU : TCG_COND_GT,
+                         size, d, n, m, sz, sz);
+        return true;
+    case NEON_3R_VCGE:
+        tcg_gen_gvec_cmp(cpu_env, u ? TCG_COND_GEU : TCG_COND_GE,
+                         size, d, n, m, sz, sz);
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -5466,6 +5547,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3same_gvec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7684,9 +7768,8 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   The store itself is a compare-and-swap against the value loaded, so
+   it is atomic with respect to other vCPUs running in parallel.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7731,21 +7814,13 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
-#ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
-}
-#else
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i32 addr, int size)
-{
-    TCGv_i32 tmp;
-    TCGv_i64 val64, extaddr;
+    TCGMemOp opc = size | MO_ALIGN | s->be_data;
+    TCGv_i32 t0, t1, t2;
+    TCGv_i64 extaddr;
+    TCGv taddr;
     TCGLabel *done_label;
     TCGLabel *fail_label;
 
@@ -7762,69 +7837,51 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
     tcg_temp_free_i64(extaddr);
 
-    tmp = tcg_temp_new_i32();
-    switch (size) {
-    case 0:
-        gen_aa32_ld8u(s, tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_ld16u(s, tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-
-    val64 = tcg_temp_new_i64();
+    taddr = gen_aa32_addr(s, addr, opc);
+    t0 = tcg_temp_new_i32();
+    t1 = load_reg(s, rt);
     if (size == 3) {
-        TCGv_i32 tmp2 = tcg_temp_new_i32();
-        TCGv_i32 tmp3 = tcg_temp_new_i32();
-        tcg_gen_addi_i32(tmp2, addr, 4);
-        gen_aa32_ld32u(s, tmp3, tmp2, get_mem_index(s));
-        tcg_temp_free_i32(tmp2);
-        tcg_gen_concat_i32_i64(val64, tmp, tmp3);
-        tcg_temp_free_i32(tmp3);
-    } else {
-        tcg_gen_extu_i32_i64(val64, tmp);
-    }
-    tcg_temp_free_i32(tmp);
+        /* exclusive_val holds the word at addr in its low half; a single
+           big-endian doubleword access has it in the high half.  */
+        TCGv_i64 c64 = tcg_temp_new_i64();
+        TCGv_i64 n64 = tcg_temp_new_i64();
+
+        t2 = load_reg(s, rt2);
+        if (s->be_data == MO_BE) {
+            tcg_gen_concat_i32_i64(n64, t2, t1);
+            tcg_gen_rotli_i64(c64, cpu_exclusive_val, 32);
+        } else {
+            tcg_gen_concat_i32_i64(n64, t1, t2);
+            tcg_gen_mov_i64(c64, cpu_exclusive_val);
+        }
+        tcg_temp_free_i32(t2);
 
-    tcg_gen_brcond_i64(TCG_COND_NE, val64, cpu_exclusive_val, fail_label);
-    tcg_temp_free_i64(val64);
+        tcg_gen_atomic_cmpxchg_i64(cpu_env, n64, taddr, c64, n64,
+                                   get_mem_index(s), opc);
+        tcg_gen_setcond_i64(TCG_COND_NE, n64, n64, c64);
+        tcg_gen_extrl_i64_i32(t0, n64);
 
-    tmp = load_reg(s, rt);
-    switch (size) {
-    case 0:
-        gen_aa32_st8(s, tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_st16(s, tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-    tcg_temp_free_i32(tmp);
-    if (size == 3) {
-        tcg_gen_addi_i32(addr, addr, 4);
-        tmp = load_reg(s, rt2);
-        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-        tcg_temp_free_i32(tmp);
+        tcg_temp_free_i64(n64);
+        tcg_temp_free_i64(c64);
+    } else {
+        t2 = tcg_temp_new_i32();
+        tcg_gen_extrl_i64_i32(t2, cpu_exclusive_val);
+        tcg_gen_atomic_cmpxchg_i32(cpu_env, t0, taddr, t2, t1,
+                                   get_mem_index(s), opc);
+        tcg_gen_setcond_i32(TCG_COND_NE, t0, t0, t2);
+        tcg_temp_free_i32(t2);
     }
-    tcg_gen_movi_i32(cpu_R[rd], 0);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free(taddr);
+    tcg_gen_mov_i32(cpu_R[rd], t0);
+    tcg_temp_free_i32(t0);
     tcg_gen_br(done_label);
+
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
-#endif
 
 /* gen_srs:
  * @env: CPUARMState
@@ -11919,6 +11976,9 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_INDIRECT_JUMP:
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
         case DISAS_TB_JUMP:
             /* nothing more to generate */
             break;
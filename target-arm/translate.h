@@ -120,6 +120,11 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* Plain branch to a computed PC that changes no other CPU state; the
+ * next TB is looked up from generated code without returning to the
+ * main loop.
+ */
+#define DISAS_INDIRECT_JUMP 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
@@ -21,56 +21,27 @@
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
-
-/* broken thread support */
-
-#if defined(CONFIG_USER_ONLY)
-QemuMutex global_cpu_lock;
-
-void helper_lock(void)
-{
-    qemu_mutex_lock(&global_cpu_lock);
-}
-
-void helper_unlock(void)
-{
-    qemu_mutex_unlock(&global_cpu_lock);
-}
-
-void helper_lock_init(void)
-{
-    qemu_mutex_init(&global_cpu_lock);
-}
-#else
-void helper_lock(void)
-{
-}
-
-void helper_unlock(void)
-{
-}
-
-void helper_lock_init(void)
-{
-}
-#endif
+#include "tcg.h"
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
-    uint64_t d;
+    uintptr_t ra = GETPC();
+    uint64_t oldv, cmpv, newv;
+    TCGMemOpIdx oi;
     int eflags;
 
     eflags = cpu_cc_compute_all(env, CC_OP);
-    d = cpu_ldq_data_ra(env, a0, GETPC());
-    if (d == (((uint64_t)env->regs[R_EDX] << 32) | (uint32_t)env->regs[R_EAX])) {
-        cpu_stq_data_ra(env, a0, ((uint64_t)env->regs[R_ECX] << 32)
-                                  | (uint32_t)env->regs[R_EBX], GETPC());
+
+    cmpv = deposit64(env->regs[R_EAX], 32, 32, env->regs[R_EDX]);
+    newv = deposit64(env->regs[R_EBX], 32, 32, env->regs[R_ECX]);
+    oi = make_memop_idx(MO_TEQ, cpu_mmu_index(env, false));
+    oldv = helper_atomic_cmpxchgq_le_mmu(env, a0, cmpv, newv, oi, ra);
+
+    if (oldv == cmpv) {
         eflags |= CC_Z;
     } else {
-        /* always do the store */
-        cpu_stq_data_ra(env, a0, d, GETPC());
-        env->regs[R_EDX] = (uint32_t)(d >> 32);
-        env->regs[R_EAX] = (uint32_t)d;
+        env->regs[R_EAX] = (uint32_t)oldv;
+        env->regs[R_EDX] = (uint32_t)(oldv >> 32);
         eflags &= ~CC_Z;
     }
     CC_SRC = eflags;
@@ -86,6 +57,11 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         raise_exception_ra(env, EXCP0D_GPF, GETPC());
     }
     eflags = cpu_cc_compute_all(env, CC_OP);
+    /* There are no 128-bit host atomics to map this onto; serialise it
+       against the slow path of the other atomic operations instead.  */
+    if (parallel_cpus) {
+        tcg_atomic_lock();
+    }
     d0 = cpu_ldq_data_ra(env, a0, GETPC());
     d1 = cpu_ldq_data_ra(env, a0 + 8, GETPC());
     if (d0 == env->regs[R_EAX] && d1 == env->regs[R_EDX]) {
@@ -100,10 +76,147 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         env->regs[R_EAX] = d0;
         eflags &= ~CC_Z;
     }
+    if (parallel_cpus) {
+        tcg_atomic_unlock();
+    }
     CC_SRC = eflags;
 }
 #endif
 
+#if !defined(CONFIG_USER_ONLY)
+static target_ulong aflag_mask(int aflag)
+{
+    switch (aflag) {
+    case MO_16:
+        return 0xffff;
+    case MO_32:
+        return 0xffffffff;
+    default:
+        return -1;
+    }
+}
+
+/* Update an index register for address size @aflag, like the translated
+   string instructions do.  */
+static void set_reg_aflag(CPUX86State *env, int reg, target_ulong val,
+                          int aflag)
+{
+    switch (aflag) {
+    case MO_16:
+        env->regs[reg] = (env->regs[reg] & ~0xffff) | (val & 0xffff);
+        break;
+    case MO_32:
+        env->regs[reg] = (uint32_t)val;
+        break;
+    default:
+        env->regs[reg] = val;
+        break;
+    }
+}
+
+/* Return how many elements of size 1 << @ot, at most ECX, a bulk string
+   operation can process at the linear address @addr, indexed by @reg:
+   neither the access nor the index register may wrap around, and the
+   access must stay within the page.  */
+static target_ulong rep_limit(CPUX86State *env, target_ulong count,
+                              target_ulong addr, int reg, int ot, int aflag)
+{
+    target_ulong mask = aflag_mask(aflag);
+    target_ulong left = mask - (env->regs[reg] & mask);
+    target_ulong room;
+
+    room = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+    if (left < room - 1) {
+        room = left + 1;
+    }
+    return MIN(count, room >> ot);
+}
+
+/* rep movs: copy the elements that lie in RAM pages already present in
+   the TLB with a single host memmove.  This stops at the first page
+   boundary; the translated loop then performs the next element with
+   ordinary accesses, which fills the TLB or raises the fault, and calls
+   back here.  Only ascending copies are handled.  */
+void helper_rep_movs(CPUX86State *env, target_ulong src, target_ulong dst,
+                     int ot, int aflag)
+{
+    int mmu_idx = cpu_mmu_index(env, false);
+    target_ulong count = env->regs[R_ECX] & aflag_mask(aflag);
+    target_ulong n, len;
+    uint8_t *src_p, *dst_p;
+
+    if (env->df != 1) {
+        return;
+    }
+    n = rep_limit(env, count, src, R_ESI, ot, aflag);
+    n = rep_limit(env, n, dst, R_EDI, ot, aflag);
+    if (n <= 1) {
+        return;
+    }
+    src_p = tlb_vaddr_to_host(env, src, MMU_DATA_LOAD, mmu_idx);
+    dst_p = tlb_vaddr_to_host(env, dst, MMU_DATA_STORE, mmu_idx);
+    if (!src_p || !dst_p) {
+        return;
+    }
+    len = n << ot;
+    /* An ascending copy onto the following bytes replicates the source,
+       which memmove would not do.  */
+    if (dst_p > src_p && dst_p < src_p + len) {
+        return;
+    }
+    memmove(dst_p, src_p, len);
+
+    set_reg_aflag(env, R_ESI, env->regs[R_ESI] + len, aflag);
+    set_reg_aflag(env, R_EDI, env->regs[R_EDI] + len, aflag);
+    set_reg_aflag(env, R_ECX, count - n, aflag);
+}
+
+/* rep stos: the same for filling memory with AL, AX, EAX or RAX.  */
+void helper_rep_stos(CPUX86State *env, target_ulong dst, int ot, int aflag)
+{
+    int mmu_idx = cpu_mmu_index(env, false);
+    target_ulong count = env->regs[R_ECX] & aflag_mask(aflag);
+    target_ulong val = env->regs[R_EAX];
+    target_ulong n, i;
+    uint8_t *dst_p;
+
+    if (env->df != 1) {
+        return;
+    }
+    n = rep_limit(env, count, dst, R_EDI, ot, aflag);
+    if (n <= 1) {
+        return;
+    }
+    dst_p = tlb_vaddr_to_host(env, dst, MMU_DATA_STORE, mmu_idx);
+    if (!dst_p) {
+        return;
+    }
+    switch (ot) {
+    case MO_8:
+        memset(dst_p, val, n);
+        break;
+    case MO_16:
+        for (i = 0; i < n; i++) {
+            stw_le_p(dst_p + i * 2, val);
+        }
+        break;
+    case MO_32:
+        for (i = 0; i < n; i++) {
+            stl_le_p(dst_p + i * 4, val);
+        }
+        break;
+    default:
+        for (i = 0; i < n; i++) {
+            stq_le_p(dst_p + i * 8, val);
+        }
+        break;
+    }
+
+    set_reg_aflag(env, R_EDI, env->regs[R_EDI] + (n << ot), aflag);
+    set_reg_aflag(env, R_ECX, count - n, aflag);
+}
+#endif
+
 void helper_boundw(CPUX86State *env, target_ulong a0, int v)
 {
     int low, high;
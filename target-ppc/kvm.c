@@ -2026,6 +2026,18 @@ void kvmppc_enable_set_mode_hcall(void)
     kvmppc_enable_hcall(kvm_state, H_SET_MODE);
 }
 
+void kvmppc_enable_multitce_hcalls(void)
+{
+    /*
+     * The kernel handles these for TCE tables it owns and passes the
+     * others, e.g. those of VFIO devices, on to us.
+     */
+    if (cap_spapr_multitce) {
+        kvmppc_enable_hcall(kvm_state, H_PUT_TCE_INDIRECT);
+        kvmppc_enable_hcall(kvm_state, H_STUFF_TCE);
+    }
+}
+
 void kvmppc_set_papr(PowerPCCPU *cpu)
 {
     CPUState *cs = CPU(cpu);
@@ -3343,15 +3343,16 @@ LARX(lharx, 2, ld16u);
 LARX(lwarx, 4, ld32u);
 
 
-#if defined(CONFIG_USER_ONLY)
-static void gen_conditional_store(DisasContext *ctx, TCGv EA,
-                                  int reg, int size)
+/* There is no 128-bit compare-and-swap: stqcx. still stops the cpu loop
+   in user mode and uses a plain check-and-store sequence otherwise.  */
+#if defined(TARGET_PPC64) && defined(CONFIG_USER_ONLY)
+static void gen_conditional_store_16(DisasContext *ctx, TCGv EA, int reg)
 {
     TCGv t0 = tcg_temp_new();
     uint32_t save_exception = ctx->exception;
 
     tcg_gen_st_tl(EA, cpu_env, offsetof(CPUPPCState, reserve_ea));
-    tcg_gen_movi_tl(t0, (size << 5) | reg);
+    tcg_gen_movi_tl(t0, (16 << 5) | reg);
     tcg_gen_st_tl(t0, cpu_env, offsetof(CPUPPCState, reserve_info));
     tcg_temp_free(t0);
     gen_update_nip(ctx, ctx->nip-4);
@@ -3359,48 +3360,87 @@ static void gen_conditional_store(DisasContext *ctx, TCGv EA,
     gen_exception(ctx, POWERPC_EXCP_STCX);
     ctx->exception = save_exception;
 }
-#else
-static void gen_conditional_store(DisasContext *ctx, TCGv EA,
-                                  int reg, int size)
+#elif defined(TARGET_PPC64)
+static void gen_conditional_store_16(DisasContext *ctx, TCGv EA, int reg)
 {
     TCGLabel *l1;
+    TCGv gpr1, gpr2, EA8;
 
     tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
     l1 = gen_new_label();
     tcg_gen_brcond_tl(TCG_COND_NE, EA, cpu_reserve, l1);
     tcg_gen_ori_i32(cpu_crf[0], cpu_crf[0], 1 << CRF_EQ);
+    if (unlikely(ctx->le_mode)) {
+        gpr1 = cpu_gpr[reg+1];
+        gpr2 = cpu_gpr[reg];
+    } else {
+        gpr1 = cpu_gpr[reg];
+        gpr2 = cpu_gpr[reg+1];
+    }
+    gen_qemu_st64(ctx, gpr1, EA);
+    EA8 = tcg_temp_local_new();
+    gen_addr_add(ctx, EA8, EA, 8);
+    gen_qemu_st64(ctx, gpr2, EA8);
+    tcg_temp_free(EA8);
+    gen_set_label(l1);
+    tcg_gen_movi_tl(cpu_reserve, -1);
+}
+#endif
+
+/* The store is a compare-and-swap against the value loaded by the
+   matching larx, so it is atomic with respect to other vCPUs.  */
+static void gen_conditional_store(DisasContext *ctx, TCGv EA,
+                                  int reg, int size)
+{
+    TCGLabel *l1, *l2;
+    TCGMemOp memop;
+    TCGv t0, t1;
+
 #if defined(TARGET_PPC64)
-    if (size == 8) {
-        gen_qemu_st64(ctx, cpu_gpr[reg], EA);
-    } else
-#endif
-    if (size == 4) {
-        gen_qemu_st32(ctx, cpu_gpr[reg], EA);
-    } else if (size == 2) {
-        gen_qemu_st16(ctx, cpu_gpr[reg], EA);
-#if defined(TARGET_PPC64)
-    } else if (size == 16) {
-        TCGv gpr1, gpr2 , EA8;
-        if (unlikely(ctx->le_mode)) {
-            gpr1 = cpu_gpr[reg+1];
-            gpr2 = cpu_gpr[reg];
-        } else {
-            gpr1 = cpu_gpr[reg];
-            gpr2 = cpu_gpr[reg+1];
-        }
-        gen_qemu_st64(ctx, gpr1, EA);
-        EA8 = tcg_temp_local_new();
-        gen_addr_add(ctx, EA8, EA, 8);
-        gen_qemu_st64(ctx, gpr2, EA8);
-        tcg_temp_free(EA8);
+    if (size == 16) {
+        gen_conditional_store_16(ctx, EA, reg);
+        return;
+    }
 #endif
-    } else {
-        gen_qemu_st8(ctx, cpu_gpr[reg], EA);
+
+    switch (size) {
+    case 1:
+        memop = MO_UB;
+        break;
+    case 2:
+        memop = MO_UW;
+        break;
+    case 4:
+        memop = MO_UL;
+        break;
+    default:
+        memop = MO_Q;
+        break;
     }
+    memop |= ctx->default_tcg_memop_mask | MO_ALIGN;
+
+    l1 = gen_new_label();
+    l2 = gen_new_label();
+    tcg_gen_brcond_tl(TCG_COND_NE, EA, cpu_reserve, l1);
+
+    t0 = tcg_temp_new();
+    t1 = tcg_temp_new();
+    tcg_gen_ld_tl(t1, cpu_env, offsetof(CPUPPCState, reserve_val));
+    tcg_gen_atomic_cmpxchg_tl(cpu_env, t0, cpu_reserve, t1, cpu_gpr[reg],
+                              ctx->mem_idx, memop);
+    tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, t1);
+    tcg_gen_shli_tl(t0, t0, CRF_EQ);
+    tcg_gen_or_tl(t0, t0, cpu_so);
+    tcg_gen_trunc_tl_i32(cpu_crf[0], t0);
+    tcg_temp_free(t1);
+    tcg_temp_free(t0);
+    tcg_gen_br(l2);
+
     gen_set_label(l1);
+    tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
+    gen_set_label(l2);
     tcg_gen_movi_tl(cpu_reserve, -1);
 }
-#endif
 
 #define STCX(name, len)                                   \
 static void gen_##name(DisasContext *ctx)                 \
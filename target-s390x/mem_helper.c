@@ -118,6 +118,44 @@ static void fast_memmove(CPUS390XState *env, uint64_t dest, uint64_t src,
     }
 }
 
+/* Exclusive-or the source into the destination and return whether the
+   result is non-zero.  The bytes are processed one at a time in ascending
+   order, so overlapping operands behave as XC requires.  */
+static uint32_t fast_xor(CPUS390XState *env, uint64_t dest, uint64_t src,
+                         uint32_t l)
+{
+    int mmu_idx = cpu_mmu_index(env, false);
+    uint8_t x = 0;
+
+    while (l > 0) {
+        uint8_t *src_p = tlb_vaddr_to_host(env, src, MMU_DATA_LOAD, mmu_idx);
+        uint8_t *dest_p = tlb_vaddr_to_host(env, dest, MMU_DATA_STORE,
+                                            mmu_idx);
+        if (src_p && dest_p
+            && tlb_vaddr_to_host(env, dest, MMU_DATA_LOAD, mmu_idx)) {
+            /* Access to both whole pages granted.  */
+            int i, l_adj = adj_len_to_page(l, src);
+            l_adj = adj_len_to_page(l_adj, dest);
+            for (i = 0; i < l_adj; i++) {
+                dest_p[i] ^= src_p[i];
+                x |= dest_p[i];
+            }
+            src += l_adj;
+            dest += l_adj;
+            l -= l_adj;
+        } else {
+            /* As in fast_memmove, one byte access fills the TLB.  */
+            uint8_t b = cpu_ldub_data(env, dest) ^ cpu_ldub_data(env, src);
+            cpu_stb_data(env, dest, b);
+            x |= b;
+            src++;
+            dest++;
+            l--;
+        }
+    }
+    return x != 0;
+}
+
 /* and on array */
 uint32_t HELPER(nc)(CPUS390XState *env, uint32_t l, uint64_t dest,
                     uint64_t src)
@@ -142,10 +180,6 @@ uint32_t HELPER(nc)(CPUS390XState *env, uint32_t l, uint64_t dest,
 uint32_t HELPER(xc)(CPUS390XState *env, uint32_t l, uint64_t dest,
                     uint64_t src)
 {
-    int i;
-    unsigned char x;
-    uint32_t cc = 0;
-
     HELPER_LOG("%s l %d dest %" PRIx64 " src %" PRIx64 "\n",
                __func__, l, dest, src);
 
@@ -155,14 +189,7 @@ uint32_t HELPER(xc)(CPUS390XState *env, uint32_t l, uint64_t dest,
         return 0;
     }
 
-    for (i = 0; i <= l; i++) {
-        x = cpu_ldub_data(env, dest + i) ^ cpu_ldub_data(env, src + i);
-        if (x) {
-            cc = 1;
-        }
-        cpu_stb_data(env, dest + i, x);
-    }
-    return cc;
+    return fast_xor(env, dest, src, l + 1);
 }
 
 /* or on array */
@@ -29,6 +29,8 @@
 
 #include "exec/helper-head.h"
 
+#define DEF_HELPER_FLAGS_1(name, flags, ret, t1) \
+  dh_ctype(ret) HELPER(name) (dh_ctype(t1));
 #define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
   dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
 
@@ -90,6 +90,7 @@ static inline void patch_reloc(tcg_insn_unit *code_ptr, int type,
         reloc_pc26(code_ptr, (tcg_insn_unit *)value);
         break;
     case R_AARCH64_CONDBR19:
+    case R_AARCH64_LD_PREL_LO19:
         reloc_pc19(code_ptr, (tcg_insn_unit *)value);
         break;
     default:
@@ -97,6 +98,8 @@ static inline void patch_reloc(tcg_insn_unit *code_ptr, int type,
     }
 }
 
+#include "tcg-be-pool.h"
+
 #define TCG_CT_CONST_AIMM 0x100
 #define TCG_CT_CONST_LIMM 0x200
 #define TCG_CT_CONST_ZERO 0x400
@@ -262,6 +265,9 @@ typedef enum {
     I3207_BLR       = 0xd63f0000,
     I3207_RET       = 0xd65f0000,
 
+    /* Load literal for loading the address at pc-relative offset */
+    I3305_LDR       = 0x58000000,
+
     /* Load/store register.  Described here as 3.3.12, but the helper
        that emits them can transform to 3.3.10 or 3.3.13.  */
     I3312_STRB      = 0x38000000 | LDST_ST << 22 | MO_8 << 30,
@@ -360,6 +366,12 @@ typedef enum {
     I3510_EOR       = 0x4a000000,
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
+
+    /* Logical shifted register instructions (with a shift).  */
+    I3502S_AND_LSR  = I3510_AND | (1 << 22),
+
+    /* System instructions.  */
+    NOP             = 0xd503201f,
 } AArch64Insn;
 
 static inline uint32_t tcg_in32(TCGContext *s)
@@ -394,6 +406,20 @@ static void tcg_out_insn_3207(TCGContext *s, AArch64Insn insn, TCGReg rn)
     tcg_out32(s, insn | rn << 5);
 }
 
+static void tcg_out_insn_3305(TCGContext *s, AArch64Insn insn,
+                              int imm19, TCGReg rt)
+{
+    tcg_out32(s, insn | (imm19 & 0x7ffff) << 5 | rt);
+}
+
+static void tcg_out_nop_fill(tcg_insn_unit *p, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        p[i] = NOP;
+    }
+}
+
 static void tcg_out_insn_3314(TCGContext *s, AArch64Insn insn,
                               TCGReg r1, TCGReg r2, TCGReg rn,
                               tcg_target_long ofs, bool pre, bool w)
@@ -565,7 +591,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type, TCGReg rd,
                          tcg_target_long value)
 {
     AArch64Insn insn;
-    int i, wantinv, shift;
+    int i, nzero, nones, shift;
     tcg_target_long svalue = value;
     tcg_target_long ivalue = ~value;
     tcg_target_long imask;
@@ -614,20 +640,29 @@ static void tcg_out_movi(TCGContext *s, TCGType type, TCGReg rd,
 
     /* Would it take fewer insns to begin with MOVN?  For the value and its
        inverse, count the number of 16-bit lanes that are 0.  */
-    for (i = wantinv = imask = 0; i < 64; i += 16) {
+    for (i = nzero = nones = imask = 0; i < 64; i += 16) {
         tcg_target_long mask = 0xffffull << i;
         if ((value & mask) == 0) {
-            wantinv -= 1;
+            nzero++;
         }
         if ((ivalue & mask) == 0) {
-            wantinv += 1;
+            nones++;
             imask |= mask;
         }
     }
 
+    /* Three or four insns would be needed.  Load the value from the
+       constant pool instead, which takes one insn and a data word that
+       is shared by all uses of the value within the TB.  */
+    if (type == TCG_TYPE_I64 && nzero < 2 && nones < 2) {
+        new_pool_label(s, value, R_AARCH64_LD_PREL_LO19, s->code_ptr, 0);
+        tcg_out_insn(s, 3305, LDR, 0, rd);
+        return;
+    }
+
     /* If we had more 0xffff than 0x0000, invert VALUE and use MOVN.  */
     insn = I3405_MOVZ;
-    if (wantinv > 0) {
+    if (nones > nzero) {
         value = ivalue;
         insn = I3405_MOVN;
     }
@@ -636,7 +671,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type, TCGReg rd,
     shift = ctz64(value) & (63 & -16);
     tcg_out_insn_3405(s, insn, type, rd, value >> shift, shift);
 
-    if (wantinv > 0) {
+    if (nones > nzero) {
         /* Re-invert the value, so MOVK sees non-inverted bits.  */
         value = ~value;
         /* Clear out all the 0xffff lanes.  */
@@ -1056,13 +1091,18 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp opc,
                              tcg_insn_unit **label_ptr, int mem_index,
                              bool is_read)
 {
-    int tlb_offset = is_read ?
-        offsetof(CPUArchState, tlb_table[mem_index][0].addr_read)
-        : offsetof(CPUArchState, tlb_table[mem_index][0].addr_write);
+    int mask_offset = offsetof(CPUArchState, tlb_mask[mem_index]);
+    int table_offset = offsetof(CPUArchState, tlb_table[mem_index]);
+    int cmp_offset = is_read ? offsetof(CPUTLBEntry, addr_read)
+                             : offsetof(CPUTLBEntry, addr_write);
     int s_mask = (1 << (opc & MO_SIZE)) - 1;
-    TCGReg base = TCG_AREG0, x3;
+    TCGReg x3;
     uint64_t tlb_mask;
 
+    /* Load the tlb mask into X0 and the tlb table pointer into X1.  */
+    tcg_out_ld(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0, mask_offset);
+    tcg_out_ld(s, TCG_TYPE_PTR, TCG_REG_X1, TCG_AREG0, table_offset);
+
     /* For aligned accesses, we check the first byte and include the alignment
        bits within the address.  For unaligned access, we check that we don't
        cross pages using the address of the last byte of the access.  */
@@ -1077,40 +1117,23 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp opc,
     }
 
     /* Extract the TLB index from the address into X0.
-       X0<CPU_TLB_BITS:0> =
-       addr_reg<TARGET_PAGE_BITS+CPU_TLB_BITS:TARGET_PAGE_BITS> */
-    tcg_out_ubfm(s, TARGET_LONG_BITS == 64, TCG_REG_X0, addr_reg,
-                 TARGET_PAGE_BITS, TARGET_PAGE_BITS + CPU_TLB_BITS);
+       X0 = (addr_reg >> (TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS)) & X0 */
+    tcg_out_insn(s, 3502S, AND_LSR, TARGET_LONG_BITS == 64, TCG_REG_X0,
+                 TCG_REG_X0, addr_reg, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
 
-    /* Store the page mask part of the address into X3.  */
-    tcg_out_logicali(s, I3404_ANDI, TARGET_LONG_BITS == 64,
-                     TCG_REG_X3, x3, tlb_mask);
+    /* Add the tlb table pointer, forming the CPUTLBEntry address in X2.  */
+    tcg_out_insn(s, 3502, ADD, TCG_TYPE_I64, TCG_REG_X2, TCG_REG_X1,
+                 TCG_REG_X0);
 
-    /* Add any "high bits" from the tlb offset to the env address into X2,
-       to take advantage of the LSL12 form of the ADDI instruction.
-       X2 = env + (tlb_offset & 0xfff000) */
-    if (tlb_offset & 0xfff000) {
-        tcg_out_insn(s, 3401, ADDI, TCG_TYPE_I64, TCG_REG_X2, base,
-                     tlb_offset & 0xfff000);
-        base = TCG_REG_X2;
-    }
-
-    /* Merge the tlb index contribution into X2.
-       X2 = X2 + (X0 << CPU_TLB_ENTRY_BITS) */
-    tcg_out_insn(s, 3502S, ADD_LSL, TCG_TYPE_I64, TCG_REG_X2, base,
-                 TCG_REG_X0, CPU_TLB_ENTRY_BITS);
-
-    /* Merge "low bits" from tlb offset, load the tlb comparator into X0.
-       X0 = load [X2 + (tlb_offset & 0x000fff)] */
+    /* Load the tlb comparator into X0, and the fast path addend into X1.  */
     tcg_out_ldst(s, TARGET_LONG_BITS == 32 ? I3312_LDRW : I3312_LDRX,
-                 TCG_REG_X0, TCG_REG_X2, tlb_offset & 0xfff);
-
-    /* Load the tlb addend. Do that early to avoid stalling.
-       X1 = load [X2 + (tlb_offset & 0xfff) + offsetof(addend)] */
+                 TCG_REG_X0, TCG_REG_X2, cmp_offset);
     tcg_out_ldst(s, I3312_LDRX, TCG_REG_X1, TCG_REG_X2,
-                 (tlb_offset & 0xfff) + (offsetof(CPUTLBEntry, addend)) -
-                 (is_read ? offsetof(CPUTLBEntry, addr_read)
-                  : offsetof(CPUTLBEntry, addr_write)));
+                 offsetof(CPUTLBEntry, addend));
+
+    /* Store the page mask part of the address into X3.  */
+    tcg_out_logicali(s, I3404_ANDI, TARGET_LONG_BITS == 64,
+                     TCG_REG_X3, x3, tlb_mask);
 
     /* Perform the address comparison. */
     tcg_out_cmp(s, (TARGET_LONG_BITS == 64), TCG_REG_X0, TCG_REG_X3, 0);
@@ -1302,6 +1325,10 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         s->tb_next_offset[a0] = tcg_current_code_size(s);
         break;
 
+    case INDEX_op_goto_ptr:
+        tcg_out_insn(s, 3207, BR, a0);
+        break;
+
     case INDEX_op_br:
         tcg_out_goto_label(s, arg_label(a0));
         break;
@@ -1639,6 +1666,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
 
     { INDEX_op_ld8u_i32, { "r", "r" } },
@@ -1828,6 +1856,13 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
     tcg_out_insn(s, 3207, BR, tcg_target_call_iarg_regs[1]);
 
+    /*
+     * Return path for goto_ptr. Set return value to 0, a-la exit_tb,
+     * and fall through to the rest of the epilogue.
+     */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_X0, 0);
+
     tb_ret_addr = s->code_ptr;
 
     /* Remove TCG locals stack space.  */
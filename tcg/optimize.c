@@ -38,7 +38,8 @@ struct tcg_temp_info {
     uint16_t prev_copy;
     uint16_t next_copy;
     tcg_target_ulong val;
-    tcg_target_ulong mask;
+    tcg_target_ulong mask;      /* bits that may be set */
+    tcg_target_ulong o_mask;    /* bits that are known to be set */
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
@@ -63,6 +64,7 @@ static void reset_temp(TCGArg temp)
     temps[temp].prev_copy = temp;
     temps[temp].is_const = false;
     temps[temp].mask = -1;
+    temps[temp].o_mask = 0;
 }
 
 /* Reset all temporaries, given that there are NB_TEMPS of them.  */
@@ -79,6 +81,7 @@ static void init_temp_info(TCGArg temp)
         temps[temp].prev_copy = temp;
         temps[temp].is_const = false;
         temps[temp].mask = -1;
+        temps[temp].o_mask = 0;
         set_bit(temp, temps_used.l);
     }
 }
@@ -210,9 +213,11 @@ static void tcg_opt_gen_movi(TCGContext *s, TCGOp *op, TCGArg *args,
     temps[dst].is_const = true;
     temps[dst].val = val;
     mask = val;
+    temps[dst].o_mask = val;
     if (TCG_TARGET_REG_BITS > 32 && new_op == INDEX_op_movi_i32) {
         /* High bits of the destination are now garbage.  */
         mask |= ~0xffffffffull;
+        temps[dst].o_mask &= 0xffffffffull;
     }
     temps[dst].mask = mask;
 
@@ -235,9 +240,11 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGOp *op, TCGArg *args,
 
     reset_temp(dst);
     mask = temps[src].mask;
+    temps[dst].o_mask = temps[src].o_mask;
     if (TCG_TARGET_REG_BITS > 32 && new_op == INDEX_op_mov_i32) {
         /* High bits of the destination are now garbage.  */
         mask |= ~0xffffffffull;
+        temps[dst].o_mask &= 0xffffffffull;
     }
     temps[dst].mask = mask;
 
@@ -475,6 +482,66 @@ static bool do_constant_folding_cond_eq(TCGCond c)
     }
 }
 
+/* Return 2 if comparing X against the constant C can't be decided from
+   the known-zero and known-one bits of X, and the result (0 or 1) if it
+   can.  X lies between its known-one bits and its possibly-set bits.  */
+static TCGArg do_constant_folding_cond_bits(TCGOpcode op, TCGArg x,
+                                            uint64_t c, TCGCond cond)
+{
+    uint64_t z = temps[x].mask;
+    uint64_t o = temps[x].o_mask;
+    uint64_t sign;
+
+    if (op_bits(op) == 32) {
+        z = (uint32_t)z;
+        o = (uint32_t)o;
+        c = (uint32_t)c;
+        sign = 0x80000000u;
+    } else {
+        sign = 1ull << 63;
+    }
+
+    switch (cond) {
+    case TCG_COND_LT:
+    case TCG_COND_GE:
+    case TCG_COND_LE:
+    case TCG_COND_GT:
+        if ((z & sign) == 0 || (o & sign) != 0) {
+            /* The sign of X is known.  If it matches the sign of C the
+               comparison is the same as an unsigned one.  Otherwise
+               X > C exactly when X is non-negative.  */
+            bool x_neg = (o & sign) != 0;
+
+            if (x_neg == ((c & sign) != 0)) {
+                return do_constant_folding_cond_bits(op, x, c,
+                                                     tcg_unsigned_cond(cond));
+            }
+            return (cond == TCG_COND_GE || cond == TCG_COND_GT) ^ x_neg;
+        }
+        return 2;
+    case TCG_COND_EQ:
+        if ((o & ~c) != 0 || (c & ~z) != 0) {
+            return 0;
+        }
+        return 2;
+    case TCG_COND_NE:
+        if ((o & ~c) != 0 || (c & ~z) != 0) {
+            return 1;
+        }
+        return 2;
+    case TCG_COND_LTU:
+        return z < c ? 1 : o >= c ? 0 : 2;
+    case TCG_COND_GEU:
+        return z < c ? 0 : o >= c ? 1 : 2;
+    case TCG_COND_LEU:
+        return z <= c ? 1 : o > c ? 0 : 2;
+    case TCG_COND_GTU:
+        return z <= c ? 0 : o > c ? 1 : 2;
+    default:
+        tcg_abort();
+    }
+}
+
 /* Return 2 if the condition can't be simplified, and the result
    of the condition (0 or 1) if it can */
 static TCGArg do_constant_folding_cond(TCGOpcode op, TCGArg x,
@@ -491,15 +558,8 @@ static TCGArg do_constant_folding_cond(TCGOpcode op, TCGArg x,
         }
     } else if (temps_are_copies(x, y)) {
         return do_constant_folding_cond_eq(c);
-    } else if (temp_is_const(y) && temps[y].val == 0) {
-        switch (c) {
-        case TCG_COND_LTU:
-            return 0;
-        case TCG_COND_GEU:
-            return 1;
-        default:
-            return 2;
-        }
+    } else if (temp_is_const(y)) {
+        return do_constant_folding_cond_bits(op, x, temps[y].val, c);
     } else {
         return 2;
     }
@@ -585,7 +645,7 @@ void tcg_optimize(TCGContext *s)
     reset_all_temps(nb_temps);
 
     for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
-        tcg_target_ulong mask, partmask, affected;
+        tcg_target_ulong mask, partmask, affected, omask;
         int nb_oargs, nb_iargs, i;
         TCGArg tmp;
 
@@ -804,13 +864,21 @@ void tcg_optimize(TCGContext *s)
             break;
         }
 
-        /* Simplify using known-zero bits. Currently only ops with a single
-           output argument is supported. */
+        /* Simplify using known-zero and known-one bits.  Currently only
+           ops with a single output argument are supported.  MASK is the
+           set of bits of the result that may be non-zero, OMASK the set of
+           bits known to be one, and AFFECTED the bits in which the result
+           may differ from args[1].  */
         mask = -1;
+        omask = 0;
         affected = -1;
         switch (opc) {
         CASE_OP_32_64(ext8s):
             if ((temps[args[1]].mask & 0x80) != 0) {
+                if ((temps[args[1]].o_mask & 0x80) != 0) {
+                    mask = ~(tcg_target_ulong)0xff;
+                    goto sext_one;
+                }
                 break;
             }
         CASE_OP_32_64(ext8u):
@@ -818,6 +886,10 @@ void tcg_optimize(TCGContext *s)
             goto and_const;
         CASE_OP_32_64(ext16s):
             if ((temps[args[1]].mask & 0x8000) != 0) {
+                if ((temps[args[1]].o_mask & 0x8000) != 0) {
+                    mask = ~(tcg_target_ulong)0xffff;
+                    goto sext_one;
+                }
                 break;
             }
         CASE_OP_32_64(ext16u):
@@ -825,18 +897,32 @@ void tcg_optimize(TCGContext *s)
             goto and_const;
         case INDEX_op_ext32s_i64:
             if ((temps[args[1]].mask & 0x80000000) != 0) {
+                if ((temps[args[1]].o_mask & 0x80000000) != 0) {
+                    mask = ~(tcg_target_ulong)0xffffffffU;
+                    goto sext_one;
+                }
                 break;
             }
         case INDEX_op_ext32u_i64:
             mask = 0xffffffffU;
             goto and_const;
 
+        sext_one:
+            /* The sign bit is known to be one, so the extension sets
+               all the bits in MASK.  */
+            affected = ~temps[args[1]].o_mask & mask;
+            omask = temps[args[1]].o_mask | mask;
+            mask |= temps[args[1]].mask;
+            break;
+
         CASE_OP_32_64(and):
-            mask = temps[args[2]].mask;
-            if (temp_is_const(args[2])) {
+            affected = temps[args[1]].mask & ~temps[args[2]].o_mask;
+            omask = temps[args[1]].o_mask & temps[args[2]].o_mask;
+            mask = temps[args[1]].mask & temps[args[2]].mask;
+            break;
         and_const:
-                affected = temps[args[1]].mask & ~mask;
-            }
+            affected = temps[args[1]].mask & ~mask;
+            omask = temps[args[1]].o_mask & mask;
             mask = temps[args[1]].mask & mask;
             break;
 
@@ -847,29 +933,34 @@ void tcg_optimize(TCGContext *s)
         case INDEX_op_extu_i32_i64:
             /* We do not compute affected as it is a size changing op.  */
             mask = (uint32_t)temps[args[1]].mask;
+            omask = (uint32_t)temps[args[1]].o_mask;
             break;
 
         CASE_OP_32_64(andc):
-            /* Known-zeros does not imply known-ones.  Therefore unless
-               args[2] is constant, we can't infer anything from it.  */
-            if (temp_is_const(args[2])) {
-                mask = ~temps[args[2]].mask;
-                goto and_const;
-            }
-            /* But we certainly know nothing outside args[1] may be set. */
-            mask = temps[args[1]].mask;
+            /* Bits known to be one in args[2] are cleared, bits that may
+               be set in args[2] may be cleared.  */
+            affected = temps[args[1]].mask & temps[args[2]].mask;
+            omask = temps[args[1]].o_mask & ~temps[args[2]].mask;
+            mask = temps[args[1]].mask & ~temps[args[2]].o_mask;
+            break;
+
+        CASE_OP_32_64(not):
+            mask = ~temps[args[1]].o_mask;
+            omask = ~temps[args[1]].mask;
             break;
 
         case INDEX_op_sar_i32:
             if (temp_is_const(args[2])) {
                 tmp = temps[args[2]].val & 31;
                 mask = (int32_t)temps[args[1]].mask >> tmp;
+                omask = (int32_t)temps[args[1]].o_mask >> tmp;
             }
             break;
         case INDEX_op_sar_i64:
             if (temp_is_const(args[2])) {
                 tmp = temps[args[2]].val & 63;
                 mask = (int64_t)temps[args[1]].mask >> tmp;
+                omask = (int64_t)temps[args[1]].o_mask >> tmp;
             }
             break;
 
@@ -877,26 +968,31 @@ void tcg_optimize(TCGContext *s)
             if (temp_is_const(args[2])) {
                 tmp = temps[args[2]].val & 31;
                 mask = (uint32_t)temps[args[1]].mask >> tmp;
+                omask = (uint32_t)temps[args[1]].o_mask >> tmp;
             }
             break;
         case INDEX_op_shr_i64:
             if (temp_is_const(args[2])) {
                 tmp = temps[args[2]].val & 63;
                 mask = (uint64_t)temps[args[1]].mask >> tmp;
+                omask = (uint64_t)temps[args[1]].o_mask >> tmp;
             }
             break;
 
         case INDEX_op_extrl_i64_i32:
             mask = (uint32_t)temps[args[1]].mask;
+            omask = (uint32_t)temps[args[1]].o_mask;
             break;
         case INDEX_op_extrh_i64_i32:
             mask = (uint64_t)temps[args[1]].mask >> 32;
+            omask = (uint64_t)temps[args[1]].o_mask >> 32;
             break;
 
         CASE_OP_32_64(shl):
             if (temp_is_const(args[2])) {
                 tmp = temps[args[2]].val & (TCG_TARGET_REG_BITS - 1);
                 mask = temps[args[1]].mask << tmp;
+                omask = temps[args[1]].o_mask << tmp;
             }
             break;
 
@@ -908,11 +1004,20 @@ void tcg_optimize(TCGContext *s)
         CASE_OP_32_64(deposit):
             mask = deposit64(temps[args[1]].mask, args[3], args[4],
                              temps[args[2]].mask);
+            omask = deposit64(temps[args[1]].o_mask, args[3], args[4],
+                              temps[args[2]].o_mask);
             break;
 
         CASE_OP_32_64(or):
+            affected = temps[args[2]].mask & ~temps[args[1]].o_mask;
+            mask = temps[args[1]].mask | temps[args[2]].mask;
+            omask = temps[args[1]].o_mask | temps[args[2]].o_mask;
+            break;
         CASE_OP_32_64(xor):
+            affected = temps[args[2]].mask;
             mask = temps[args[1]].mask | temps[args[2]].mask;
+            omask = (temps[args[1]].o_mask & ~temps[args[2]].mask)
+                    | (temps[args[2]].o_mask & ~temps[args[1]].mask);
             break;
 
         CASE_OP_32_64(setcond):
@@ -922,6 +1027,7 @@ void tcg_optimize(TCGContext *s)
 
         CASE_OP_32_64(movcond):
             mask = temps[args[3]].mask | temps[args[4]].mask;
+            omask = temps[args[3]].o_mask & temps[args[4]].o_mask;
             break;
 
         CASE_OP_32_64(ld8u):
@@ -948,19 +1054,25 @@ void tcg_optimize(TCGContext *s)
             break;
         }
 
-        /* 32-bit ops generate 32-bit results.  For the result is zero test
-           below, we can ignore high bits, but for further optimizations we
-           need to record that the high bits contain garbage.  */
+        /* 32-bit ops generate 32-bit results.  For the result is known
+           tests below, we can ignore high bits, but for further
+           optimizations we need to record that the high bits contain
+           garbage.  */
         partmask = mask;
         if (!(def->flags & TCG_OPF_64BIT)) {
             mask |= ~(tcg_target_ulong)0xffffffffu;
             partmask &= 0xffffffffu;
             affected &= 0xffffffffu;
+            omask &= 0xffffffffu;
         }
 
-        if (partmask == 0) {
+        if (partmask == omask) {
+            /* Every bit of the result is known.  */
             assert(nb_oargs == 1);
-            tcg_opt_gen_movi(s, op, args, args[0], 0);
+            if (!(def->flags & TCG_OPF_64BIT)) {
+                omask = (int32_t)omask;
+            }
+            tcg_opt_gen_movi(s, op, args, args[0], omask);
             continue;
         }
         if (affected == 0) {
@@ -1318,10 +1430,12 @@ void tcg_optimize(TCGContext *s)
         do_reset_output:
                 for (i = 0; i < nb_oargs; i++) {
                     reset_temp(args[i]);
-                    /* Save the corresponding known-zero bits mask for the
-                       first output argument (only one supported so far). */
+                    /* Save the corresponding known-zero and known-one
+                       bits masks for the first output argument (only one
+                       supported so far). */
                     if (i == 0) {
                         temps[args[i]].mask = mask;
+                        temps[args[i]].o_mask = omask;
                     }
                 }
             }
@@ -0,0 +1,99 @@
+/*
+ * TCG Backend Data: constant pool.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Constants that are expensive to build with immediate instructions are
+ * loaded pc-relative from a pool emitted after the code of the TB.  Each
+ * distinct value is stored once per TB, however many loads reference it.
+ * A backend using this must define TCG_TARGET_NEED_POOL_LABELS in its
+ * tcg-target.h and provide tcg_out_nop_fill().
+ */
+
+typedef struct TCGLabelPoolData {
+    struct TCGLabelPoolData *next;
+    tcg_target_ulong data;
+    tcg_insn_unit *label;       /* insn to be patched with the slot address */
+    intptr_t addend;
+    int type;                   /* relocation type passed to patch_reloc */
+} TCGLabelPoolData;
+
+/*
+ * Fill COUNT insn units at P with no-ops, used to align the pool.
+ */
+
+static void tcg_out_nop_fill(tcg_insn_unit *p, int count);
+
+/*
+ * Allocate a new pool entry for the insn at LABEL that loads D.
+ */
+
+static void new_pool_label(TCGContext *s, tcg_target_ulong d, int type,
+                           tcg_insn_unit *label, intptr_t addend)
+{
+    TCGLabelPoolData *n = tcg_malloc(sizeof(*n));
+    TCGLabelPoolData *i, **pp;
+
+    n->data = d;
+    n->label = label;
+    n->addend = addend;
+    n->type = type;
+
+    /* Keep the list sorted by value, so that duplicates are adjacent
+       and end up sharing a single slot.  */
+    for (pp = &s->pool_labels; (i = *pp) != NULL && i->data < d;
+         pp = &i->next) {
+        continue;
+    }
+    n->next = *pp;
+    *pp = n;
+}
+
+/*
+ * Emit the pool at the end of the TB and resolve the loads from it.
+ */
+
+static bool tcg_out_pool_finalize(TCGContext *s)
+{
+    TCGLabelPoolData *p = s->pool_labels;
+    tcg_target_ulong *a, *slot = NULL;
+
+    if (p == NULL) {
+        return true;
+    }
+
+    a = (void *)ROUND_UP((uintptr_t)s->code_ptr, sizeof(tcg_target_ulong));
+    tcg_out_nop_fill(s->code_ptr, (tcg_insn_unit *)a - s->code_ptr);
+
+    for (; p != NULL; p = p->next) {
+        if (slot == NULL || *slot != p->data) {
+            slot = slot ? slot + 1 : a;
+            if (unlikely((void *)slot > s->code_gen_highwater)) {
+                return false;
+            }
+            *slot = p->data;
+        }
+        patch_reloc(p->label, p->type, (intptr_t)slot, p->addend);
+    }
+
+    s->code_ptr = (tcg_insn_unit *)(slot + 1);
+    return true;
+}
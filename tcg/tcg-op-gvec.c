@@ -0,0 +1,594 @@
+/*
+ * Generic vector operation expansion
+ *
+ * Copyright (c) 2016 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+typedef void GVecGen2Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a);
+typedef void GVecGen2iFn(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c);
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+/* All bits of an element narrower than 64 bits.  */
+static inline uint64_t elt_mask(unsigned vece)
+{
+    return (1ull << (8 << vece)) - 1;
+}
+
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= maxsz);
+    tcg_debug_assert((oprsz | maxsz | ofs) % 8 == 0);
+}
+
+/* Clear the bytes of the destination between OPRSZ and MAXSZ.  */
+static void expand_clr(TCGv_ptr env, uint32_t dofs,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 zero;
+    uint32_t i;
+
+    if (oprsz == maxsz) {
+        return;
+    }
+    zero = tcg_const_i64(0);
+    for (i = oprsz; i < maxsz; i += 8) {
+        tcg_gen_st_i64(zero, env, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+static void expand_2(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                     uint32_t aofs, uint32_t oprsz, uint32_t maxsz,
+                     GVecGen2Fn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        fn(vece, t1, t0);
+        tcg_gen_st_i64(t1, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+static void expand_2i(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, unsigned c, uint32_t oprsz,
+                      uint32_t maxsz, GVecGen2iFn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        fn(vece, t1, t0, c);
+        tcg_gen_st_i64(t1, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+static void expand_3(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                     uint32_t maxsz, GVecGen3Fn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, env, aofs + i);
+        tcg_gen_ld_i64(t1, env, bofs + i);
+        fn(vece, t2, t0, t1);
+        tcg_gen_st_i64(t2, env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+/* Lane-parallel addition for elements narrower than 32 bits.  M has the
+   most significant bit of each element set.  The low bits are added with
+   the top bits cleared so that no carry crosses an element boundary; the
+   top bit is then a ^ b ^ carry-in.  */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* As above, but setting the top bit of each element of the minuend
+   absorbs any borrow before it can leave the element.  */
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_add(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2;
+
+    switch (vece) {
+    case MO_8:
+    case MO_16:
+        t1 = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+        gen_addv_mask(d, a, b, t1);
+        tcg_temp_free_i64(t1);
+        break;
+    case MO_32:
+        t1 = tcg_temp_new_i64();
+        t2 = tcg_temp_new_i64();
+        tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+        tcg_gen_add_i64(t2, a, b);
+        tcg_gen_add_i64(t1, a, t1);
+        tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t2);
+        break;
+    default:
+        tcg_gen_add_i64(d, a, b);
+        break;
+    }
+}
+
+static void gen_sub(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2;
+
+    switch (vece) {
+    case MO_8:
+    case MO_16:
+        t1 = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+        gen_subv_mask(d, a, b, t1);
+        tcg_temp_free_i64(t1);
+        break;
+    case MO_32:
+        t1 = tcg_temp_new_i64();
+        t2 = tcg_temp_new_i64();
+        tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+        tcg_gen_sub_i64(t2, a, b);
+        tcg_gen_sub_i64(t1, a, t1);
+        tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t2);
+        break;
+    default:
+        tcg_gen_sub_i64(d, a, b);
+        break;
+    }
+}
+
+static void gen_neg(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    TCGv_i64 zero = tcg_const_i64(0);
+    gen_sub(vece, d, zero, a);
+    tcg_temp_free_i64(zero);
+}
+
+static void gen_not(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_not_i64(d, a);
+}
+
+static void gen_mov(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_mov_i64(d, a);
+}
+
+static void gen_and(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+static void gen_shli(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    tcg_gen_shli_i64(d, a, c);
+    if (vece != MO_64) {
+        /* drop the bits shifted in from the element below */
+        tcg_gen_andi_i64(d, d, dup_const(vece, elt_mask(vece) << c));
+    }
+}
+
+static void gen_shri(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    tcg_gen_shri_i64(d, a, c);
+    if (vece != MO_64) {
+        /* drop the bits shifted in from the element above */
+        tcg_gen_andi_i64(d, d, dup_const(vece, elt_mask(vece) >> c));
+    }
+}
+
+static void gen_sari(unsigned vece, TCGv_i64 d, TCGv_i64 a, unsigned c)
+{
+    uint64_t bits = 8 << vece;
+    uint64_t s_mask, c_mask;
+    TCGv_i64 s;
+
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, c);
+        return;
+    }
+    if (c == 0) {
+        tcg_gen_mov_i64(d, a);
+        return;
+    }
+    s_mask = dup_const(vece, (1ull << (bits - 1)) >> c);
+    c_mask = dup_const(vece, elt_mask(vece) >> c);
+    s = tcg_temp_new_i64();
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(s, d, s_mask);           /* isolate shifted sign bits */
+    tcg_gen_muli_i64(s, s, (2ull << c) - 2);  /* replicate them upwards */
+    tcg_gen_andi_i64(d, d, c_mask);           /* drop bits from above */
+    tcg_gen_or_i64(d, d, s);
+
+    tcg_temp_free_i64(s);
+}
+
+/* Set each element of D to -1 if the element of A ^ B is zero (EQ), or
+   non-zero (NE), and to 0 otherwise.  */
+static void gen_cmp_eq_ne(unsigned vece, bool ne, TCGv_i64 d,
+                          TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t bits = 8 << vece;
+    uint64_t m = dup_const(vece, 1ull << (bits - 1));
+    TCGv_i64 x = tcg_temp_new_i64();
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(x, a, b);
+    /* The top bit of each element of T is set iff the element is
+       non-zero; adding ~M to the low bits cannot carry out of it.  */
+    tcg_gen_andi_i64(t, x, ~m);
+    tcg_gen_addi_i64(t, t, ~m);
+    tcg_gen_or_i64(t, t, x);
+    if (!ne) {
+        tcg_gen_not_i64(t, t);
+    }
+    tcg_gen_andi_i64(t, t, m);
+    /* Spread the top bit over the element.  */
+    tcg_gen_shri_i64(t, t, bits - 1);
+    tcg_gen_muli_i64(d, t, elt_mask(vece));
+
+    tcg_temp_free_i64(x);
+    tcg_temp_free_i64(t);
+}
+
+static void gen_cmp_eq(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_cmp_eq_ne(vece, false, d, a, b);
+}
+
+static void gen_cmp_ne(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_cmp_eq_ne(vece, true, d, a, b);
+}
+
+void tcg_gen_gvec_mov(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    if (dofs == aofs) {
+        check_size_align(oprsz, maxsz, dofs);
+        expand_clr(env, dofs, oprsz, maxsz);
+    } else {
+        expand_2(env, MO_64, dofs, aofs, oprsz, maxsz, gen_mov);
+    }
+}
+
+void tcg_gen_gvec_not(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2(env, MO_64, dofs, aofs, oprsz, maxsz, gen_not);
+}
+
+void tcg_gen_gvec_neg(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2(env, vece, dofs, aofs, oprsz, maxsz, gen_neg);
+}
+
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, vece, dofs, aofs, bofs, oprsz, maxsz, gen_add);
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, vece, dofs, aofs, bofs, oprsz, maxsz, gen_sub);
+}
+
+void tcg_gen_gvec_and(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, MO_64, dofs, aofs, bofs, oprsz, maxsz, gen_and);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, MO_64, dofs, aofs, bofs, oprsz, maxsz, gen_or);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    if (aofs == bofs) {
+        /* the common idiom for clearing a register */
+        tcg_gen_gvec_dupi(env, MO_64, dofs, oprsz, maxsz, 0);
+        return;
+    }
+    expand_3(env, MO_64, dofs, aofs, bofs, oprsz, maxsz, gen_xor);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, MO_64, dofs, aofs, bofs, oprsz, maxsz, gen_andc);
+}
+
+void tcg_gen_gvec_orc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3(env, MO_64, dofs, aofs, bofs, oprsz, maxsz, gen_orc);
+}
+
+void tcg_gen_gvec_shli(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    tcg_debug_assert(shift < (8 << vece));
+    expand_2i(env, vece, dofs, aofs, shift, oprsz, maxsz, gen_shli);
+}
+
+void tcg_gen_gvec_shri(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    tcg_debug_assert(shift < (8 << vece));
+    expand_2i(env, vece, dofs, aofs, shift, oprsz, maxsz, gen_shri);
+}
+
+void tcg_gen_gvec_sari(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz)
+{
+    tcg_debug_assert(shift < (8 << vece));
+    expand_2i(env, vece, dofs, aofs, shift, oprsz, maxsz, gen_sari);
+}
+
+static void gen_ld_elt(TCGv_i64 ret, TCGv_ptr env, uint32_t ofs,
+                       unsigned vece, bool sign)
+{
+    switch (vece) {
+    case MO_8:
+        if (sign) {
+            tcg_gen_ld8s_i64(ret, env, ofs);
+        } else {
+            tcg_gen_ld8u_i64(ret, env, ofs);
+        }
+        break;
+    case MO_16:
+        if (sign) {
+            tcg_gen_ld16s_i64(ret, env, ofs);
+        } else {
+            tcg_gen_ld16u_i64(ret, env, ofs);
+        }
+        break;
+    case MO_32:
+        if (sign) {
+            tcg_gen_ld32s_i64(ret, env, ofs);
+        } else {
+            tcg_gen_ld32u_i64(ret, env, ofs);
+        }
+        break;
+    default:
+        tcg_gen_ld_i64(ret, env, ofs);
+        break;
+    }
+}
+
+static void gen_st_elt(TCGv_i64 val, TCGv_ptr env, uint32_t ofs,
+                       unsigned vece)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_st8_i64(val, env, ofs);
+        break;
+    case MO_16:
+        tcg_gen_st16_i64(val, env, ofs);
+        break;
+    case MO_32:
+        tcg_gen_st32_i64(val, env, ofs);
+        break;
+    default:
+        tcg_gen_st_i64(val, env, ofs);
+        break;
+    }
+}
+
+void tcg_gen_gvec_cmp(TCGv_ptr env, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 t0, t1;
+    bool sign;
+    uint32_t i;
+
+    switch (cond) {
+    case TCG_COND_NEVER:
+    case TCG_COND_ALWAYS:
+        tcg_gen_gvec_dupi(env, MO_64, dofs, oprsz, maxsz,
+                          cond == TCG_COND_ALWAYS ? -1 : 0);
+        return;
+    case TCG_COND_EQ:
+    case TCG_COND_NE:
+        if (vece != MO_64) {
+            /* handle all the elements of a 64-bit chunk at once */
+            if (cond == TCG_COND_EQ) {
+                expand_3(env, vece, dofs, aofs, bofs, oprsz, maxsz,
+                         gen_cmp_eq);
+            } else {
+                expand_3(env, vece, dofs, aofs, bofs, oprsz, maxsz,
+                         gen_cmp_ne);
+            }
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    sign = (cond == TCG_COND_LT || cond == TCG_COND_GE ||
+            cond == TCG_COND_LE || cond == TCG_COND_GT);
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 1 << vece) {
+        gen_ld_elt(t0, env, aofs + i, vece, sign);
+        gen_ld_elt(t1, env, bofs + i, vece, sign);
+        tcg_gen_setcond_i64(cond, t0, t0, t1);
+        tcg_gen_neg_i64(t0, t0);
+        gen_st_elt(t0, env, dofs + i, vece);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_i64(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs);
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(t, in);
+        tcg_gen_muli_i64(t, t, dup_const(MO_8, 1));
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(t, in);
+        tcg_gen_muli_i64(t, t, dup_const(MO_16, 1));
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(t, in, in, 32, 32);
+        break;
+    default:
+        tcg_gen_mov_i64(t, in);
+        break;
+    }
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+    expand_clr(env, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_i32(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i32 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_debug_assert(vece <= MO_32);
+    tcg_gen_extu_i32_i64(t, in);
+    tcg_gen_gvec_dup_i64(env, vece, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dupi(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint32_t maxsz, uint64_t x)
+{
+    TCGv_i64 t = tcg_const_i64(dup_const(vece, x));
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs);
+    for (i = 0; i < maxsz; i += 8) {
+        if (i == oprsz) {
+            tcg_gen_movi_i64(t, 0);
+        }
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+}
@@ -0,0 +1,114 @@
+/*
+ * Generic vector operation expansion
+ *
+ * Copyright (c) 2016 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef TCG_OP_GVEC_H
+#define TCG_OP_GVEC_H
+
+/*
+ * "Generic" vector operations work on guest vector registers that live in
+ * the CPU state, addressed by their offset from @env.  Every operation
+ * takes the offset of the destination and of each source, the element
+ * size @vece (MO_8 .. MO_64) and the number of bytes to operate on,
+ * @oprsz: 8 for a 64-bit, 16 for a 128-bit and 32 for a 256-bit vector.
+ * The bytes between @oprsz and @maxsz are cleared in the destination,
+ * which is what e.g. AArch64 requires for 64-bit vector operations.
+ *
+ * Both sizes must be multiples of 8 and the vectors must be 8-byte
+ * aligned within the CPU state.  Destination and sources may be the same
+ * register, but must not otherwise overlap.
+ *
+ * The operations are expanded inline into 64-bit integer TCG ops, so no
+ * helper is called and no per-element loop is run at execution time;
+ * elements no wider than 32 bits are handled in parallel within each
+ * 64-bit chunk.
+ */
+
+static inline uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        tcg_abort();
+    }
+}
+
+void tcg_gen_gvec_mov(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_not(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_neg(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+
+void tcg_gen_gvec_and(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_or(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_xor(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+/* d = a & ~b */
+void tcg_gen_gvec_andc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+/* d = a | ~b */
+void tcg_gen_gvec_orc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz);
+
+/* Shifts by an immediate; @shift must be less than the element width.  */
+void tcg_gen_gvec_shli(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_shri(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_sari(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift,
+                       uint32_t oprsz, uint32_t maxsz);
+
+/* Set each element of d to -1 if "a cond b" holds for it, 0 otherwise.  */
+void tcg_gen_gvec_cmp(TCGv_ptr env, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+
+/* Replicate the low @vece bits of a scalar into every element of d.  */
+void tcg_gen_gvec_dup_i32(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i32 in);
+void tcg_gen_gvec_dup_i64(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in);
+void tcg_gen_gvec_dupi(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t oprsz, uint32_t maxsz, uint64_t x);
+
+#endif /* TCG_OP_GVEC_H */
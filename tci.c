@@ -19,9 +19,12 @@
 
 #include "qemu/osdep.h"
 
-/* Defining NDEBUG disables assertions (which makes the code faster). */
-#if !defined(CONFIG_DEBUG_TCG) && !defined(NDEBUG)
-# define NDEBUG
+/* Assertions are only checked with --enable-debug-tcg, NDEBUG cannot be
+   used because osdep.h has already included assert.h.  */
+#if defined(CONFIG_DEBUG_TCG)
+# define tci_assert(cond) assert(cond)
+#else
+# define tci_assert(cond) ((void)0)
 #endif
 
 #include "qemu-common.h"
@@ -56,7 +59,7 @@ static tcg_target_ulong tci_reg[TCG_TARGET_NB_REGS];
 
 static tcg_target_ulong tci_read_reg(TCGReg index)
 {
-    assert(index < ARRAY_SIZE(tci_reg));
+    tci_assert(index < ARRAY_SIZE(tci_reg));
     return tci_reg[index];
 }
 
@@ -105,9 +108,9 @@ static uint64_t tci_read_reg64(TCGReg index)
 
 static void tci_write_reg(TCGReg index, tcg_target_ulong value)
 {
-    assert(index < ARRAY_SIZE(tci_reg));
-    assert(index != TCG_AREG0);
-    assert(index != TCG_REG_CALL_STACK);
+    tci_assert(index < ARRAY_SIZE(tci_reg));
+    tci_assert(index != TCG_AREG0);
+    tci_assert(index != TCG_REG_CALL_STACK);
     tci_reg[index] = value;
 }
 
@@ -325,7 +328,7 @@ static uint64_t tci_read_ri64(uint8_t **tb_ptr)
 static tcg_target_ulong tci_read_label(uint8_t **tb_ptr)
 {
     tcg_target_ulong label = tci_read_i(tb_ptr);
-    assert(label != 0);
+    tci_assert(label != 0);
     return label;
 }
 
@@ -459,22 +462,232 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 # define qemu_st_beq(X)  stq_be_p(g2h(taddr), X)
 #endif
 
+/* Decode the opcode and size entry of the instruction at tb_ptr. */
+#if !defined(CONFIG_DEBUG_TCG)
+# define FETCH() \
+    do { \
+        opc = tb_ptr[0]; \
+        tb_ptr += 2; \
+    } while (0)
+#else
+# define FETCH() \
+    do { \
+        opc = tb_ptr[0]; \
+        op_size = tb_ptr[1]; \
+        old_code_ptr = tb_ptr; \
+        tb_ptr += 2; \
+    } while (0)
+#endif
+
+/*
+ * With labels as values, every handler fetches the next instruction and
+ * jumps straight to its handler (threaded code) instead of going back to
+ * a single switch.  This gives the host one indirect branch per handler,
+ * which it predicts much better, and avoids the range check of the switch.
+ * Otherwise CASE, NEXT and DISPATCH fall back to the switch statement.
+ *
+ * NEXT() ends a handler that continues with the following instruction,
+ * DISPATCH() one that has set tb_ptr to the instruction to run next.
+ */
+#if defined(__GNUC__)
+# define TCI_THREADED
+# define CASE(name)     case INDEX_op_##name: op_##name
+# define DEFAULT        default: op_default
+# define DISPATCH() \
+    do { \
+        FETCH(); \
+        goto *dispatch_table[opc]; \
+    } while (0)
+# define NEXT() \
+    do { \
+        tci_assert(tb_ptr == old_code_ptr + op_size); \
+        DISPATCH(); \
+    } while (0)
+#else
+# define CASE(name)     case INDEX_op_##name
+# define DEFAULT        default
+# define DISPATCH()     continue
+# define NEXT()         break
+#endif
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
+#if defined(TCI_THREADED)
+    /* One entry for each CASE() below, with the same conditions.  */
+    static const void *const dispatch_table[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&op_default,
+        [INDEX_op_call] = &&op_call,
+        [INDEX_op_br] = &&op_br,
+        [INDEX_op_setcond_i32] = &&op_setcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_setcond2_i32] = &&op_setcond2_i32,
+#elif TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&op_setcond_i64,
+#endif
+        [INDEX_op_mov_i32] = &&op_mov_i32,
+        [INDEX_op_movi_i32] = &&op_movi_i32,
+        [INDEX_op_ld8u_i32] = &&op_ld8u_i32,
+        [INDEX_op_ld8s_i32] = &&op_ld8s_i32,
+        [INDEX_op_ld16u_i32] = &&op_ld16u_i32,
+        [INDEX_op_ld16s_i32] = &&op_ld16s_i32,
+        [INDEX_op_ld_i32] = &&op_ld_i32,
+        [INDEX_op_st8_i32] = &&op_st8_i32,
+        [INDEX_op_st16_i32] = &&op_st16_i32,
+        [INDEX_op_st_i32] = &&op_st_i32,
+        [INDEX_op_add_i32] = &&op_add_i32,
+        [INDEX_op_sub_i32] = &&op_sub_i32,
+        [INDEX_op_mul_i32] = &&op_mul_i32,
+#if TCG_TARGET_HAS_div_i32
+        [INDEX_op_div_i32] = &&op_div_i32,
+        [INDEX_op_divu_i32] = &&op_divu_i32,
+        [INDEX_op_rem_i32] = &&op_rem_i32,
+        [INDEX_op_remu_i32] = &&op_remu_i32,
+#elif TCG_TARGET_HAS_div2_i32
+        [INDEX_op_div2_i32] = &&op_div2_i32,
+        [INDEX_op_divu2_i32] = &&op_divu2_i32,
+#endif
+        [INDEX_op_and_i32] = &&op_and_i32,
+        [INDEX_op_or_i32] = &&op_or_i32,
+        [INDEX_op_xor_i32] = &&op_xor_i32,
+        [INDEX_op_shl_i32] = &&op_shl_i32,
+        [INDEX_op_shr_i32] = &&op_shr_i32,
+        [INDEX_op_sar_i32] = &&op_sar_i32,
+#if TCG_TARGET_HAS_rot_i32
+        [INDEX_op_rotl_i32] = &&op_rotl_i32,
+        [INDEX_op_rotr_i32] = &&op_rotr_i32,
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        [INDEX_op_deposit_i32] = &&op_deposit_i32,
+#endif
+        [INDEX_op_brcond_i32] = &&op_brcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_add2_i32] = &&op_add2_i32,
+        [INDEX_op_sub2_i32] = &&op_sub2_i32,
+        [INDEX_op_brcond2_i32] = &&op_brcond2_i32,
+        [INDEX_op_mulu2_i32] = &&op_mulu2_i32,
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        [INDEX_op_ext8s_i32] = &&op_ext8s_i32,
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        [INDEX_op_ext16s_i32] = &&op_ext16s_i32,
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        [INDEX_op_ext8u_i32] = &&op_ext8u_i32,
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        [INDEX_op_ext16u_i32] = &&op_ext16u_i32,
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        [INDEX_op_bswap16_i32] = &&op_bswap16_i32,
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        [INDEX_op_bswap32_i32] = &&op_bswap32_i32,
+#endif
+#if TCG_TARGET_HAS_not_i32
+        [INDEX_op_not_i32] = &&op_not_i32,
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        [INDEX_op_neg_i32] = &&op_neg_i32,
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_mov_i64] = &&op_mov_i64,
+        [INDEX_op_movi_i64] = &&op_movi_i64,
+        [INDEX_op_ld8u_i64] = &&op_ld8u_i64,
+        [INDEX_op_ld8s_i64] = &&op_ld8s_i64,
+        [INDEX_op_ld16u_i64] = &&op_ld16u_i64,
+        [INDEX_op_ld16s_i64] = &&op_ld16s_i64,
+        [INDEX_op_ld32u_i64] = &&op_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&op_ld32s_i64,
+        [INDEX_op_ld_i64] = &&op_ld_i64,
+        [INDEX_op_st8_i64] = &&op_st8_i64,
+        [INDEX_op_st16_i64] = &&op_st16_i64,
+        [INDEX_op_st32_i64] = &&op_st32_i64,
+        [INDEX_op_st_i64] = &&op_st_i64,
+        [INDEX_op_add_i64] = &&op_add_i64,
+        [INDEX_op_sub_i64] = &&op_sub_i64,
+        [INDEX_op_mul_i64] = &&op_mul_i64,
+#if TCG_TARGET_HAS_div_i64
+        [INDEX_op_div_i64] = &&op_div_i64,
+        [INDEX_op_divu_i64] = &&op_divu_i64,
+        [INDEX_op_rem_i64] = &&op_rem_i64,
+        [INDEX_op_remu_i64] = &&op_remu_i64,
+#elif TCG_TARGET_HAS_div2_i64
+        [INDEX_op_div2_i64] = &&op_div2_i64,
+        [INDEX_op_divu2_i64] = &&op_divu2_i64,
+#endif
+        [INDEX_op_and_i64] = &&op_and_i64,
+        [INDEX_op_or_i64] = &&op_or_i64,
+        [INDEX_op_xor_i64] = &&op_xor_i64,
+        [INDEX_op_shl_i64] = &&op_shl_i64,
+        [INDEX_op_shr_i64] = &&op_shr_i64,
+        [INDEX_op_sar_i64] = &&op_sar_i64,
+#if TCG_TARGET_HAS_rot_i64
+        [INDEX_op_rotl_i64] = &&op_rotl_i64,
+        [INDEX_op_rotr_i64] = &&op_rotr_i64,
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        [INDEX_op_deposit_i64] = &&op_deposit_i64,
+#endif
+        [INDEX_op_brcond_i64] = &&op_brcond_i64,
+#if TCG_TARGET_HAS_ext8u_i64
+        [INDEX_op_ext8u_i64] = &&op_ext8u_i64,
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        [INDEX_op_ext8s_i64] = &&op_ext8s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        [INDEX_op_ext16s_i64] = &&op_ext16s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        [INDEX_op_ext16u_i64] = &&op_ext16u_i64,
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        [INDEX_op_ext32s_i64] = &&op_ext32s_i64,
+#endif
+        [INDEX_op_ext_i32_i64] = &&op_ext_i32_i64,
+#if TCG_TARGET_HAS_ext32u_i64
+        [INDEX_op_ext32u_i64] = &&op_ext32u_i64,
+#endif
+        [INDEX_op_extu_i32_i64] = &&op_extu_i32_i64,
+#if TCG_TARGET_HAS_bswap16_i64
+        [INDEX_op_bswap16_i64] = &&op_bswap16_i64,
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        [INDEX_op_bswap32_i64] = &&op_bswap32_i64,
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        [INDEX_op_bswap64_i64] = &&op_bswap64_i64,
+#endif
+#if TCG_TARGET_HAS_not_i64
+        [INDEX_op_not_i64] = &&op_not_i64,
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        [INDEX_op_neg_i64] = &&op_neg_i64,
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        [INDEX_op_exit_tb] = &&op_exit_tb,
+        [INDEX_op_goto_tb] = &&op_goto_tb,
+        [INDEX_op_qemu_ld_i32] = &&op_qemu_ld_i32,
+        [INDEX_op_qemu_ld_i64] = &&op_qemu_ld_i64,
+        [INDEX_op_qemu_st_i32] = &&op_qemu_st_i32,
+        [INDEX_op_qemu_st_i64] = &&op_qemu_st_i64,
+    };
+#endif
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
     uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
     uintptr_t next_tb = 0;
 
     tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
     tci_reg[TCG_REG_CALL_STACK] = sp_value;
-    assert(tb_ptr);
+    tci_assert(tb_ptr);
 
     for (;;) {
-        TCGOpcode opc = tb_ptr[0];
-#if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
+        TCGOpcode opc;
+#if defined(CONFIG_DEBUG_TCG)
+        uint8_t op_size;
+        uint8_t *old_code_ptr;
 #endif
         tcg_target_ulong t0;
         tcg_target_ulong t1;
@@ -491,15 +704,13 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 #endif
         TCGMemOpIdx oi;
 
+        FETCH();
+        switch (opc) {
+        CASE(call):
 #if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
+            /* Only helpers need the return address (see GETRA).  */
+            tci_tb_ptr = (uintptr_t)(tb_ptr - 2);
 #endif
-
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
-
-        switch (opc) {
-        case INDEX_op_call:
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -522,194 +733,194 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R5));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_br:
+            NEXT();
+        CASE(br):
             label = tci_read_label(&tb_ptr);
-            assert(tb_ptr == old_code_ptr + op_size);
+            tci_assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
+            DISPATCH();
+        CASE(setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        CASE(setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+            NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        CASE(setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+            NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        CASE(mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            NEXT();
+        CASE(movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        CASE(ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+            NEXT();
+        CASE(ld8s_i32):
+        CASE(ld16u_i32):
             TODO();
-            break;
-        case INDEX_op_ld16s_i32:
+            NEXT();
+        CASE(ld16s_i32):
             TODO();
-            break;
-        case INDEX_op_ld_i32:
+            NEXT();
+        CASE(ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
+            NEXT();
+        CASE(st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
+            NEXT();
+        CASE(st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
+            NEXT();
+        CASE(st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
-            assert(t1 != sp_value || (int32_t)t2 < 0);
+            tci_assert(t1 != sp_value || (int32_t)t2 < 0);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
+            NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        CASE(add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
+            NEXT();
+        CASE(sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
+            NEXT();
+        CASE(mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        CASE(div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
+            NEXT();
+        CASE(divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
+            NEXT();
+        CASE(rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
+            NEXT();
+        CASE(remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 % t2);
-            break;
+            NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        CASE(div2_i32):
+        CASE(divu2_i32):
             TODO();
-            break;
+            NEXT();
 #endif
-        case INDEX_op_and_i32:
+        CASE(and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
+            NEXT();
+        CASE(or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
+            NEXT();
+        CASE(xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 ^ t2);
-            break;
+            NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        CASE(shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << (t2 & 31));
-            break;
-        case INDEX_op_shr_i32:
+            NEXT();
+        CASE(shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> (t2 & 31));
-            break;
-        case INDEX_op_sar_i32:
+            NEXT();
+        CASE(sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        CASE(rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, rol32(t1, t2 & 31));
-            break;
-        case INDEX_op_rotr_i32:
+            NEXT();
+        CASE(rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ror32(t1, t2 & 31));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
+        CASE(deposit_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_r32(&tb_ptr);
@@ -717,266 +928,266 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp32 = (((1 << tmp8) - 1) << tmp16);
             tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
-            break;
+            NEXT();
 #endif
-        case INDEX_op_brcond_i32:
+        CASE(brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             label = tci_read_label(&tb_ptr);
             if (tci_compare32(t0, t1, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
+                tci_assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                DISPATCH();
             }
-            break;
+            NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        CASE(add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
+            NEXT();
+        CASE(sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
+            NEXT();
+        CASE(brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             label = tci_read_label(&tb_ptr);
             if (tci_compare64(tmp64, v64, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
+                tci_assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                DISPATCH();
             }
-            break;
-        case INDEX_op_mulu2_i32:
+            NEXT();
+        CASE(mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
             tmp64 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+            NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        CASE(ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        CASE(ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        CASE(ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        CASE(ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        CASE(bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        CASE(bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        CASE(not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        CASE(neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        CASE(mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            NEXT();
+        CASE(movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        CASE(ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+            NEXT();
+        CASE(ld8s_i64):
+        CASE(ld16u_i64):
+        CASE(ld16s_i64):
             TODO();
-            break;
-        case INDEX_op_ld32u_i64:
+            NEXT();
+        CASE(ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            NEXT();
+        CASE(ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
+            NEXT();
+        CASE(ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
+            NEXT();
+        CASE(st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
+            NEXT();
+        CASE(st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
+            NEXT();
+        CASE(st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
+            NEXT();
+        CASE(st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
-            assert(t1 != sp_value || (int32_t)t2 < 0);
+            tci_assert(t1 != sp_value || (int32_t)t2 < 0);
             *(uint64_t *)(t1 + t2) = t0;
-            break;
+            NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        CASE(add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
+            NEXT();
+        CASE(sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
+            NEXT();
+        CASE(mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        CASE(div_i64):
+        CASE(divu_i64):
+        CASE(rem_i64):
+        CASE(remu_i64):
             TODO();
-            break;
+            NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        CASE(div2_i64):
+        CASE(divu2_i64):
             TODO();
-            break;
+            NEXT();
 #endif
-        case INDEX_op_and_i64:
+        CASE(and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
+            NEXT();
+        CASE(or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
+            NEXT();
+        CASE(xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 ^ t2);
-            break;
+            NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        CASE(shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << (t2 & 63));
-            break;
-        case INDEX_op_shr_i64:
+            NEXT();
+        CASE(shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> (t2 & 63));
-            break;
-        case INDEX_op_sar_i64:
+            NEXT();
+        CASE(sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
+        CASE(rotl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, rol64(t1, t2 & 63));
-            break;
-        case INDEX_op_rotr_i64:
+            NEXT();
+        CASE(rotr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ror64(t1, t2 & 63));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
+        CASE(deposit_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_r64(&tb_ptr);
@@ -984,113 +1195,112 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp64 = (((1ULL << tmp8) - 1) << tmp16);
             tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
-            break;
+            NEXT();
 #endif
-        case INDEX_op_brcond_i64:
+        CASE(brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             label = tci_read_label(&tb_ptr);
             if (tci_compare64(t0, t1, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
+                tci_assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                DISPATCH();
             }
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        CASE(ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        CASE(ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        CASE(ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        CASE(ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        CASE(ext32s_i64):
 #endif
-        case INDEX_op_ext_i32_i64:
+        CASE(ext_i32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        CASE(ext32u_i64):
 #endif
-        case INDEX_op_extu_i32_i64:
+        CASE(extu_i32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            NEXT();
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        CASE(bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, bswap16(t1));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        CASE(bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        CASE(bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        CASE(not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
-            break;
+            NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        CASE(neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
-            break;
+            NEXT();
 #endif
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
             /* QEMU specific operations. */
 
-        case INDEX_op_exit_tb:
+        CASE(exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
-            break;
-        case INDEX_op_goto_tb:
+        CASE(goto_tb):
             t0 = tci_read_i32(&tb_ptr);
-            assert(tb_ptr == old_code_ptr + op_size);
+            tci_assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld_i32:
+            DISPATCH();
+        CASE(qemu_ld_i32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1123,8 +1333,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tcg_abort();
             }
             tci_write_reg(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld_i64:
+            NEXT();
+        CASE(qemu_ld_i64):
             t0 = *tb_ptr++;
             if (TCG_TARGET_REG_BITS == 32) {
                 t1 = *tb_ptr++;
@@ -1175,8 +1385,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             if (TCG_TARGET_REG_BITS == 32) {
                 tci_write_reg(t1, tmp64 >> 32);
             }
-            break;
-        case INDEX_op_qemu_st_i32:
+            NEXT();
+        CASE(qemu_st_i32):
             t0 = tci_read_r(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1199,8 +1409,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             default:
                 tcg_abort();
             }
-            break;
-        case INDEX_op_qemu_st_i64:
+            NEXT();
+        CASE(qemu_st_i64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1229,12 +1439,12 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             default:
                 tcg_abort();
             }
-            break;
-        default:
+            NEXT();
+        DEFAULT:
             TODO();
-            break;
+            NEXT();
         }
-        assert(tb_ptr == old_code_ptr + op_size);
+        tci_assert(tb_ptr == old_code_ptr + op_size);
     }
 exit:
     return next_tb;
@@ -1411,6 +1411,29 @@ static void test_ncq_simple(void)
     ahci_shutdown(ahci);
 }
 
+/**
+ * Process the command lists in an IOThread instead of the main loop.
+ */
+static void test_io_iothread(void)
+{
+    AHCIQState *ahci;
+
+    ahci = ahci_boot_and_enable("-object iothread,id=iothread0 "
+                                "-drive if=none,id=drive0,file=%s,"
+                                "cache=writeback,format=%s "
+                                "-M q35 "
+                                "-global ich9-ahci.iothread=iothread0 "
+                                "-device ide-hd,drive=drive0 ",
+                                tmp_path, imgfmt);
+    ahci_test_io_rw_simple(ahci, 4096, 0,
+                           CMD_READ_DMA,
+                           CMD_WRITE_DMA);
+    ahci_test_io_rw_simple(ahci, 4096, 0,
+                           READ_FPDMA_QUEUED,
+                           WRITE_FPDMA_QUEUED);
+    ahci_shutdown(ahci);
+}
+
 static int prepare_iso(size_t size, unsigned char **buf, char **name)
 {
     char cdrom_path[] = "/tmp/qtest.iso.XXXXXX";
@@ -1786,6 +1809,7 @@ int main(int argc, char **argv)
     qtest_add_func("/ahci/migrate/ncq/simple", test_migrate_ncq);
     qtest_add_func("/ahci/io/ncq/retry", test_halted_ncq);
     qtest_add_func("/ahci/migrate/ncq/halted", test_migrate_halted_ncq);
+    qtest_add_func("/ahci/io/iothread", test_io_iothread);
 
     qtest_add_func("/ahci/cdrom/dma/single", test_cdrom_dma);
     qtest_add_func("/ahci/cdrom/dma/multi", test_cdrom_dma_multi);
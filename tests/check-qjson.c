@@ -1261,6 +1261,40 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+static void stream_flush(void *opaque, const char *str)
+{
+    GString *gstr = opaque;
+
+    g_assert(*str);
+    g_string_append(gstr, str);
+}
+
+static void stream_large_dict(void)
+{
+    GString *gstr = g_string_new("");
+    GString *out = g_string_new("");
+    QObject *obj;
+    QString *str;
+    int pretty;
+
+    gen_test_json(gstr, 10, 100);
+    obj = qobject_from_json(gstr->str);
+    g_assert(obj != NULL);
+
+    /* Streaming must produce the same text, whatever the chunking */
+    for (pretty = 0; pretty < 2; pretty++) {
+        str = pretty ? qobject_to_json_pretty(obj) : qobject_to_json(obj);
+        g_string_truncate(out, 0);
+        qobject_to_json_stream(obj, pretty, stream_flush, out);
+        g_assert_cmpstr(out->str, ==, qstring_get_str(str));
+        QDECREF(str);
+    }
+
+    qobject_decref(obj);
+    g_string_free(out, true);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -1527,6 +1561,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/dicts/stream_large_dict", stream_large_dict);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
@@ -0,0 +1,236 @@
+/*
+ * QTest testcase for the Cirrus VGA bitblt engine
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+
+#define CIRRUS_VENDOR_ID        0x1013
+#define CIRRUS_DEVICE_ID        0x00b8
+
+#define BLTMODE_TRANSPARENTCOMP 0x08
+#define BLTMODE_PATTERNCOPY     0x40
+#define BLTMODE_COLOREXPAND     0x80
+#define BLTMODEEXT_SOLIDFILL    0x04
+#define BLT_START               0x02
+#define ROP_SRC                 0x0d
+
+#define SRC_ADDR                0x10000
+#define DST_ADDR                0x80000
+#define PITCH                   128
+
+static QPCIBus *pcibus;
+static uint64_t fb;
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
+}
+
+static void cirrus_start(void)
+{
+    QPCIDevice *dev = NULL;
+
+    qtest_start("-vga none -device cirrus-vga");
+    pcibus = qpci_init_pc();
+    qpci_device_foreach(pcibus, CIRRUS_VENDOR_ID, CIRRUS_DEVICE_ID,
+                        save_fn, &dev);
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    fb = (uintptr_t) qpci_iomap(dev, 0, NULL);
+    g_free(dev);
+
+    /* Unlock the extensions and switch to 8bpp SVGA */
+    outb(0x3c4, 0x06);
+    outb(0x3c5, 0x12);
+    outb(0x3c4, 0x07);
+    outb(0x3c5, 0x01);
+}
+
+static void cirrus_stop(void)
+{
+    qpci_free_pc(pcibus);
+    qtest_end();
+}
+
+static void gr_write(uint8_t index, uint8_t val)
+{
+    outb(0x3ce, index);
+    outb(0x3cf, val);
+}
+
+static void gr_write16(uint8_t index, uint16_t val)
+{
+    gr_write(index, val);
+    gr_write(index + 1, val >> 8);
+}
+
+static void blt(uint32_t dst, uint32_t src, int width, int height,
+                int dst_pitch, int src_pitch, uint8_t mode, uint8_t modeext)
+{
+    gr_write16(0x20, width - 1);
+    gr_write16(0x22, height - 1);
+    gr_write16(0x24, dst_pitch);
+    gr_write16(0x26, src_pitch);
+    gr_write16(0x28, dst);
+    gr_write(0x2a, dst >> 16);
+    gr_write16(0x2c, src);
+    gr_write(0x2e, src >> 16);
+    gr_write(0x30, mode);
+    gr_write(0x32, ROP_SRC);
+    gr_write(0x33, modeext);
+    gr_write(0x31, BLT_START);
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, unsigned seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (i * 7 + seed) ^ (i >> 5);
+    }
+}
+
+static void test_copy(void)
+{
+    const int w = 101, h = 3, pitch = PITCH;
+    uint8_t src[3 * PITCH], dst[3 * PITCH], out[3 * PITCH];
+    int y;
+
+    cirrus_start();
+    fill_pattern(src, sizeof(src), 1);
+    fill_pattern(dst, sizeof(dst), 2);
+    memwrite(fb + SRC_ADDR, src, sizeof(src));
+    memwrite(fb + DST_ADDR, dst, sizeof(dst));
+
+    blt(DST_ADDR, SRC_ADDR, w, h, pitch, pitch, 0, 0);
+
+    for (y = 0; y < h; y++) {
+        memcpy(dst + y * pitch, src + y * pitch, w);
+    }
+    memread(fb + DST_ADDR, out, sizeof(out));
+    g_assert(memcmp(out, dst, sizeof(out)) == 0);
+    cirrus_stop();
+}
+
+/* A forward copy onto itself repeats the first bytes, as it would on
+ * hardware; copying a word at a time must not change that.
+ */
+static void test_copy_overlap(void)
+{
+    const int w = 64, shift = 3;
+    uint8_t buf[64 + 3], out[64 + 3];
+    int x;
+
+    cirrus_start();
+    fill_pattern(buf, sizeof(buf), 3);
+    memwrite(fb + SRC_ADDR, buf, sizeof(buf));
+
+    blt(SRC_ADDR + shift, SRC_ADDR, w, 1, w + shift, w + shift, 0, 0);
+
+    for (x = 0; x < w; x++) {
+        buf[x + shift] = buf[x];
+    }
+    memread(fb + SRC_ADDR, out, sizeof(out));
+    g_assert(memcmp(out, buf, sizeof(out)) == 0);
+    cirrus_stop();
+}
+
+static void test_transparent(void)
+{
+    const int w = 77, pitch = PITCH;
+    const uint8_t key = 0x11;
+    uint8_t src[PITCH], dst[PITCH], out[PITCH];
+    int x;
+
+    cirrus_start();
+    fill_pattern(src, sizeof(src), 4);
+    for (x = 0; x < w; x += 3) {
+        src[x] = key;
+    }
+    memset(dst, 0xaa, sizeof(dst));
+    memwrite(fb + SRC_ADDR, src, sizeof(src));
+    memwrite(fb + DST_ADDR, dst, sizeof(dst));
+
+    gr_write16(0x34, key);
+    blt(DST_ADDR, SRC_ADDR, w, 1, pitch, pitch, BLTMODE_TRANSPARENTCOMP, 0);
+
+    for (x = 0; x < w; x++) {
+        if (src[x] != key) {
+            dst[x] = src[x];
+        }
+    }
+    memread(fb + DST_ADDR, out, sizeof(out));
+    g_assert(memcmp(out, dst, sizeof(out)) == 0);
+    cirrus_stop();
+}
+
+static void test_solid_fill(void)
+{
+    const int w = 93, h = 4, pitch = PITCH;
+    const uint8_t col = 0x5a;
+    uint8_t dst[4 * PITCH], out[4 * PITCH];
+    int y;
+
+    cirrus_start();
+    fill_pattern(dst, sizeof(dst), 5);
+    memwrite(fb + DST_ADDR, dst, sizeof(dst));
+
+    gr_write(0x01, col);
+    blt(DST_ADDR, 0, w, h, pitch, pitch,
+        BLTMODE_PATTERNCOPY | BLTMODE_COLOREXPAND, BLTMODEEXT_SOLIDFILL);
+
+    for (y = 0; y < h; y++) {
+        memset(dst + y * pitch, col, w);
+    }
+    memread(fb + DST_ADDR, out, sizeof(out));
+    g_assert(memcmp(out, dst, sizeof(out)) == 0);
+    cirrus_stop();
+}
+
+static void perf_blt(const char *name, uint8_t mode, uint8_t modeext)
+{
+    const int w = 1024, h = 256, count = 1000;
+    double duration;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < count; i++) {
+        blt(DST_ADDR, SRC_ADDR, w, h, w, w, mode, modeext);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("%s: %d %dx%d blits in %f s (%f MB/s)", name, count, w, h,
+                   duration, (double)count * w * h / duration / 1e6);
+}
+
+static void perf_blits(void)
+{
+    cirrus_start();
+    perf_blt("copy", 0, 0);
+    perf_blt("transparent copy", BLTMODE_TRANSPARENTCOMP, 0);
+    perf_blt("solid fill", BLTMODE_PATTERNCOPY | BLTMODE_COLOREXPAND,
+             BLTMODEEXT_SOLIDFILL);
+    cirrus_stop();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/cirrus-vga/bitblt/copy", test_copy);
+    qtest_add_func("/cirrus-vga/bitblt/copy-overlap", test_copy_overlap);
+    qtest_add_func("/cirrus-vga/bitblt/transparent", test_transparent);
+    qtest_add_func("/cirrus-vga/bitblt/solid-fill", test_solid_fill);
+    if (g_test_perf()) {
+        qtest_add_func("/cirrus-vga/perf/bitblt", perf_blits);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,535 @@
+/*
+ * QTest microbenchmarks for device emulation paths
+ *
+ * Each benchmark fills a device's request ring once, then repeatedly
+ * hands a batch of requests to the device and waits for all of them to
+ * complete.  Only the submission and the completion polling are timed,
+ * so the figures mostly reflect the cost of the emulated request path
+ * (plus one qtest round trip per batch and per poll).  The backends are
+ * null-co:// drives and NICs without a peer, so no host I/O is involved.
+ *
+ * The benchmarks only run in perf mode: gtester -m perf, or
+ * "tests/device-bench -m perf".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/ahci.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+
+#define BENCH_ROUNDS            500
+#define BENCH_TIMEOUT_US        (30 * 1000 * 1000)
+#define BENCH_PCI_SLOT          0x04
+
+typedef struct QBench {
+    const char *name;
+    uint64_t requests;
+    int64_t us;
+    uint64_t ticks;
+    int64_t start_us;
+    uint64_t start_ticks;
+} QBench;
+
+static void bench_start(QBench *b)
+{
+    b->start_us = g_get_monotonic_time();
+    b->start_ticks = cpu_get_host_ticks();
+}
+
+static void bench_stop(QBench *b, unsigned requests)
+{
+    b->ticks += cpu_get_host_ticks() - b->start_ticks;
+    b->us += g_get_monotonic_time() - b->start_us;
+    b->requests += requests;
+}
+
+static void bench_check_timeout(QBench *b)
+{
+    g_assert(g_get_monotonic_time() - b->start_us <= BENCH_TIMEOUT_US);
+}
+
+static void bench_report(QBench *b)
+{
+    g_assert(b->requests && b->us);
+    g_test_message("%s: %" PRIu64 " requests in %.3f s, %.0f requests/s, "
+                   "%" PRIu64 " host cycles/request",
+                   b->name, b->requests, b->us / 1e6,
+                   b->requests * 1e6 / b->us, b->ticks / b->requests);
+}
+
+/*** virtio ***/
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_BATCH        32
+#define VIRTIO_NET_BATCH        64
+#define VIRTIO_NET_PKT_SIZE     64
+
+static QVirtioPCIDevice *virtio_bench_init(QPCIBus *bus, uint16_t type)
+{
+    QVirtioPCIDevice *dev;
+    uint32_t features;
+
+    dev = qvirtio_pci_device_find(bus, type);
+    g_assert(dev != NULL);
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE | QVIRTIO_F_RING_INDIRECT_DESC |
+                  QVIRTIO_F_RING_EVENT_IDX);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    return dev;
+}
+
+/* Submits the same @n chains for every round and waits for all of them */
+static void virtio_bench_run(QBench *b, QVirtioPCIDevice *dev,
+                             QVirtQueue *vq, const uint32_t *heads,
+                             unsigned n)
+{
+    uint16_t start;
+    int i;
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        bench_start(b);
+        start = qvirtqueue_get_used_idx(vq);
+        qvirtqueue_kick_batch(&qvirtio_pci, &dev->vdev, vq, heads, n);
+        while ((uint16_t)(qvirtqueue_get_used_idx(vq) - start) < n) {
+            bench_check_timeout(b);
+        }
+        bench_stop(b, n);
+    }
+}
+
+static void bench_virtio_blk(void)
+{
+    QBench b = { .name = "virtio-blk 4k reads" };
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueuePCI *vqpci;
+    uint32_t heads[VIRTIO_BLK_BATCH];
+    uint64_t hdr, data, status;
+    struct {
+        uint32_t type;
+        uint32_t ioprio;
+        uint64_t sector;
+    } req;
+    int i;
+
+    qtest_start("-drive if=none,id=drive0,file=null-co://,format=raw "
+                "-device virtio-blk-pci,drive=drive0,addr=04.0");
+    bus = qpci_init_pc();
+    dev = virtio_bench_init(bus, QVIRTIO_BLK_DEVICE_ID);
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Header, data and status in three descriptors, as Linux does */
+    g_assert_cmpint(vqpci->vq.size, >=, 3 * VIRTIO_BLK_BATCH);
+    data = guest_alloc(alloc, 4096);
+    for (i = 0; i < VIRTIO_BLK_BATCH; i++) {
+        hdr = guest_alloc(alloc, sizeof(req));
+        status = guest_alloc(alloc, 1);
+        req.type = cpu_to_le32(VIRTIO_BLK_T_IN);
+        req.ioprio = 0;
+        req.sector = cpu_to_le64(i * 8);
+        memwrite(hdr, &req, sizeof(req));
+
+        heads[i] = qvirtqueue_add(&vqpci->vq, hdr, sizeof(req), false, true);
+        qvirtqueue_add(&vqpci->vq, data, 4096, true, true);
+        qvirtqueue_add(&vqpci->vq, status, 1, true, false);
+    }
+
+    virtio_bench_run(&b, dev, &vqpci->vq, heads, VIRTIO_BLK_BATCH);
+    bench_report(&b);
+
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+static void bench_virtio_net(void)
+{
+    QBench b = { .name = "virtio-net 64 byte transmits" };
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueuePCI *vqpci;
+    uint32_t heads[VIRTIO_NET_BATCH];
+    uint64_t pkt;
+    int i;
+
+    /* Without a peer, transmitted packets are dropped by the net layer */
+    qtest_start("-device virtio-net-pci,tx=bh,mrg_rxbuf=off,addr=04.0");
+    bus = qpci_init_pc();
+    dev = virtio_bench_init(bus, QVIRTIO_NET_DEVICE_ID);
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 1);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* The zeroed virtio-net header precedes the frame */
+    g_assert_cmpint(vqpci->vq.size, >=, VIRTIO_NET_BATCH);
+    pkt = guest_alloc(alloc, VIRTIO_NET_PKT_SIZE);
+    qmemset(pkt, 0, VIRTIO_NET_PKT_SIZE);
+    for (i = 0; i < VIRTIO_NET_BATCH; i++) {
+        heads[i] = qvirtqueue_add(&vqpci->vq, pkt, VIRTIO_NET_PKT_SIZE,
+                                  false, false);
+    }
+
+    virtio_bench_run(&b, dev, &vqpci->vq, heads, VIRTIO_NET_BATCH);
+    bench_report(&b);
+
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/*** e1000 ***/
+
+#define E1000_TCTL              0x00400
+#define E1000_TDBAL             0x03800
+#define E1000_TDBAH             0x03804
+#define E1000_TDLEN             0x03808
+#define E1000_TDH               0x03810
+#define E1000_TDT               0x03818
+#define E1000_TCTL_EN           0x00000002
+#define E1000_TXD_CMD_EOP       0x01000000
+#define E1000_TXD_CMD_RS        0x08000000
+#define E1000_RING_SIZE         64
+#define E1000_BATCH             32
+#define E1000_PKT_SIZE          64
+
+static void bench_e1000(void)
+{
+    QBench b = { .name = "e1000 64 byte transmits" };
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    QGuestAllocator *alloc;
+    uint64_t bar, ring, pkt;
+    struct {
+        uint64_t buffer_addr;
+        uint32_t lower;
+        uint32_t upper;
+    } desc[E1000_RING_SIZE];
+    uint32_t tdt = 0;
+    int i;
+
+    qtest_start("-device e1000,addr=04.0");
+    bus = qpci_init_pc();
+    dev = qpci_device_find(bus, QPCI_DEVFN(BENCH_PCI_SLOT, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    bar = (uintptr_t)qpci_iomap(dev, 0, NULL);
+    alloc = pc_alloc_init();
+
+    /* Legacy descriptors, all pointing to the same frame */
+    pkt = guest_alloc(alloc, E1000_PKT_SIZE);
+    qmemset(pkt, 0, E1000_PKT_SIZE);
+    for (i = 0; i < E1000_RING_SIZE; i++) {
+        desc[i].buffer_addr = cpu_to_le64(pkt);
+        desc[i].lower = cpu_to_le32(E1000_PKT_SIZE | E1000_TXD_CMD_EOP |
+                                    E1000_TXD_CMD_RS);
+        desc[i].upper = 0;
+    }
+    ring = guest_alloc(alloc, sizeof(desc));
+    memwrite(ring, desc, sizeof(desc));
+
+    writel(bar + E1000_TDBAL, (uint32_t)ring);
+    writel(bar + E1000_TDBAH, ring >> 32);
+    writel(bar + E1000_TDLEN, sizeof(desc));
+    writel(bar + E1000_TDH, 0);
+    writel(bar + E1000_TDT, 0);
+    writel(bar + E1000_TCTL, E1000_TCTL_EN);
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        bench_start(&b);
+        tdt = (tdt + E1000_BATCH) % E1000_RING_SIZE;
+        writel(bar + E1000_TDT, tdt);
+        while (readl(bar + E1000_TDH) != tdt) {
+            bench_check_timeout(&b);
+        }
+        bench_stop(&b, E1000_BATCH);
+    }
+    bench_report(&b);
+
+    pc_alloc_uninit(alloc);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/*** NVMe ***/
+
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1c
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28
+#define NVME_REG_ACQ            0x30
+#define NVME_REG_DBS            0x1000
+#define NVME_CC_EN              (1 << 0)
+#define NVME_CC_IOSQES          (6 << 16)
+#define NVME_CC_IOCQES          (4 << 20)
+#define NVME_CSTS_RDY           (1 << 0)
+#define NVME_ADM_CREATE_SQ      0x01
+#define NVME_ADM_CREATE_CQ      0x05
+#define NVME_CMD_READ           0x02
+#define NVME_QUEUE_SIZE         64
+#define NVME_BATCH              32
+
+typedef struct NvmeBenchCmd {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t res1;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} NvmeBenchCmd;
+
+typedef struct NvmeBenchQueue {
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t qid;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} NvmeBenchQueue;
+
+static void nvme_bench_ring_sq(uint64_t bar, NvmeBenchQueue *q)
+{
+    writel(bar + NVME_REG_DBS + 8 * q->qid, q->sq_tail);
+}
+
+/* Tells whether the completion at @head has been posted, status in @sf */
+static bool nvme_bench_cqe_ready(NvmeBenchQueue *q, uint16_t head,
+                                 uint16_t *sf)
+{
+    uint32_t dw3 = le32_to_cpu(readl(q->cq + head * 16 + 12));
+    uint16_t phase = q->phase;
+
+    if (head < q->cq_head) {
+        phase = !phase;
+    }
+    *sf = dw3 >> 16;
+    return (*sf & 1) == phase;
+}
+
+/* Consumes @n completions, which must all be posted, and acks them */
+static void nvme_bench_consume(uint64_t bar, NvmeBenchQueue *q, unsigned n)
+{
+    if (q->cq_head + n >= NVME_QUEUE_SIZE) {
+        q->phase = !q->phase;
+    }
+    q->cq_head = (q->cq_head + n) % NVME_QUEUE_SIZE;
+    writel(bar + NVME_REG_DBS + 8 * q->qid + 4, q->cq_head);
+}
+
+static void nvme_bench_admin(uint64_t bar, NvmeBenchQueue *adm,
+                             NvmeBenchCmd *cmd)
+{
+    int64_t start = g_get_monotonic_time();
+    uint16_t sf;
+
+    cmd->cid = adm->sq_tail;
+    memwrite(adm->sq + adm->sq_tail * sizeof(*cmd), cmd, sizeof(*cmd));
+    adm->sq_tail = (adm->sq_tail + 1) % NVME_QUEUE_SIZE;
+    nvme_bench_ring_sq(bar, adm);
+
+    /* The controller processes queues from virtual clock timers */
+    while (!nvme_bench_cqe_ready(adm, adm->cq_head, &sf)) {
+        clock_step(1000);
+        g_assert(g_get_monotonic_time() - start <= BENCH_TIMEOUT_US);
+    }
+    g_assert_cmphex(sf >> 1, ==, 0);
+    nvme_bench_consume(bar, adm, 1);
+}
+
+static void bench_nvme(void)
+{
+    QBench b = { .name = "nvme 4k reads" };
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    QGuestAllocator *alloc;
+    NvmeBenchQueue adm = { .qid = 0, .phase = 1 };
+    NvmeBenchQueue io = { .qid = 1, .phase = 1 };
+    NvmeBenchCmd cmd;
+    uint64_t bar, data;
+    uint16_t last, sf;
+    int i;
+
+    qtest_start("-drive if=none,id=drive0,file=null-co://,format=raw "
+                "-device nvme,drive=drive0,serial=bench,addr=04.0");
+    bus = qpci_init_pc();
+    dev = qpci_device_find(bus, QPCI_DEVFN(BENCH_PCI_SLOT, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    bar = (uintptr_t)qpci_iomap(dev, 0, NULL);
+    alloc = pc_alloc_init();
+
+    /* Queues are page aligned, every queue fits in one page */
+    adm.sq = guest_alloc(alloc, 4096);
+    adm.cq = guest_alloc(alloc, 4096);
+    io.sq = guest_alloc(alloc, 4096);
+    io.cq = guest_alloc(alloc, 4096);
+    data = guest_alloc(alloc, 4096);
+    qmemset(adm.cq, 0, 4096);
+    qmemset(io.cq, 0, 4096);
+
+    writel(bar + NVME_REG_CC, 0);
+    writel(bar + NVME_REG_AQA,
+           (NVME_QUEUE_SIZE - 1) << 16 | (NVME_QUEUE_SIZE - 1));
+    writel(bar + NVME_REG_ASQ, (uint32_t)adm.sq);
+    writel(bar + NVME_REG_ASQ + 4, adm.sq >> 32);
+    writel(bar + NVME_REG_ACQ, (uint32_t)adm.cq);
+    writel(bar + NVME_REG_ACQ + 4, adm.cq >> 32);
+    writel(bar + NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    g_assert(readl(bar + NVME_REG_CSTS) & NVME_CSTS_RDY);
+
+    /* Polled I/O queue pair: physically contiguous, interrupts off */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CREATE_CQ;
+    cmd.prp1 = cpu_to_le64(io.cq);
+    cmd.cdw10 = cpu_to_le32((NVME_QUEUE_SIZE - 1) << 16 | io.qid);
+    cmd.cdw11 = cpu_to_le32(1);
+    nvme_bench_admin(bar, &adm, &cmd);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CREATE_SQ;
+    cmd.prp1 = cpu_to_le64(io.sq);
+    cmd.cdw10 = cpu_to_le32((NVME_QUEUE_SIZE - 1) << 16 | io.qid);
+    cmd.cdw11 = cpu_to_le32(io.qid << 16 | 1);
+    nvme_bench_admin(bar, &adm, &cmd);
+
+    /* Every submission queue entry reads 4k into the same buffer */
+    for (i = 0; i < NVME_QUEUE_SIZE; i++) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_READ;
+        cmd.cid = cpu_to_le16(i);
+        cmd.nsid = cpu_to_le32(1);
+        cmd.prp1 = cpu_to_le64(data);
+        cmd.cdw10 = cpu_to_le32(i * 8);
+        cmd.cdw12 = cpu_to_le32(7);
+        memwrite(io.sq + i * sizeof(cmd), &cmd, sizeof(cmd));
+    }
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        bench_start(&b);
+        io.sq_tail = (io.sq_tail + NVME_BATCH) % NVME_QUEUE_SIZE;
+        nvme_bench_ring_sq(bar, &io);
+        last = (io.cq_head + NVME_BATCH - 1) % NVME_QUEUE_SIZE;
+        while (!nvme_bench_cqe_ready(&io, last, &sf)) {
+            clock_step(1000);
+            bench_check_timeout(&b);
+        }
+        nvme_bench_consume(bar, &io, NVME_BATCH);
+        bench_stop(&b, NVME_BATCH);
+    }
+    bench_report(&b);
+
+    pc_alloc_uninit(alloc);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/*** AHCI ***/
+
+#define AHCI_BATCH              32
+
+static void bench_ahci(void)
+{
+    QBench b = { .name = "ahci 4k NCQ reads" };
+    AHCIQState *ahci;
+    AHCICommand *cmds[AHCI_BATCH];
+    uint16_t identify[256];
+    uint64_t data;
+    uint8_t port;
+    int i;
+
+    ahci = g_malloc0(sizeof(AHCIQState));
+    ahci->parent = qtest_pc_boot("-drive if=none,id=drive0,"
+                                 "file=null-co://,format=raw -M q35 "
+                                 "-device ide-hd,drive=drive0");
+    ahci->dev = get_ahci_device(&ahci->fingerprint);
+    ahci_pci_enable(ahci);
+    ahci_hba_enable(ahci);
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ahci_io(ahci, port, CMD_IDENTIFY, identify, sizeof(identify), 0);
+
+    /* One queued read per command slot, all issued at once */
+    data = ahci_alloc(ahci, 4096);
+    for (i = 0; i < AHCI_BATCH; i++) {
+        cmds[i] = ahci_command_create(READ_FPDMA_QUEUED);
+        ahci_command_set_buffer(cmds[i], data);
+        ahci_command_set_size(cmds[i], 4096);
+        ahci_command_set_offset(cmds[i], i * 8);
+        ahci_command_commit(ahci, cmds[i], port);
+    }
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        bench_start(&b);
+        ahci_px_wreg(ahci, port, AHCI_PX_SACT, 0xffffffff);
+        ahci_px_wreg(ahci, port, AHCI_PX_CI, 0xffffffff);
+        while (ahci_px_rreg(ahci, port, AHCI_PX_SACT) ||
+               ahci_px_rreg(ahci, port, AHCI_PX_CI)) {
+            bench_check_timeout(&b);
+        }
+        ahci_px_wreg(ahci, port, AHCI_PX_IS,
+                     ahci_px_rreg(ahci, port, AHCI_PX_IS));
+        bench_stop(&b, AHCI_BATCH);
+    }
+    ahci_port_check_error(ahci, port);
+    bench_report(&b);
+
+    for (i = 0; i < AHCI_BATCH; i++) {
+        ahci_command_free(cmds[i]);
+    }
+    ahci_free(ahci, data);
+    ahci_clean_mem(ahci);
+    free_ahci_device(ahci->dev);
+    qtest_shutdown(ahci->parent);
+    g_free(ahci);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (g_test_perf()) {
+        qtest_add_func("/device-bench/virtio-blk", bench_virtio_blk);
+        qtest_add_func("/device-bench/virtio-net", bench_virtio_net);
+        qtest_add_func("/device-bench/e1000", bench_e1000);
+        qtest_add_func("/device-bench/nvme", bench_nvme);
+        qtest_add_func("/device-bench/ahci", bench_ahci);
+    }
+
+    return g_test_run();
+}
@@ -273,6 +273,38 @@ void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d, QVirtQueue *vq,
     }
 }
 
+/* Makes the @n chains in @heads available with a single notification, as
+ * a driver that queues several requests before kicking does.  Event index
+ * must not have been negotiated.
+ */
+void qvirtqueue_kick_batch(const QVirtioBus *bus, QVirtioDevice *d,
+                           QVirtQueue *vq, const uint32_t *heads, unsigned n)
+{
+    /* vq->avail->idx */
+    uint16_t idx = readw(vq->avail + 2);
+    unsigned i;
+
+    g_assert(!vq->event);
+
+    for (i = 0; i < n; i++) {
+        /* vq->avail->ring[(idx + i) % vq->size] */
+        writew(vq->avail + 4 + (2 * ((idx + i) % vq->size)), heads[i]);
+    }
+    /* vq->avail->idx */
+    writew(vq->avail + 2, idx + n);
+
+    /* vq->used->flags, must read after idx is updated */
+    if ((readw(vq->used) & QVRING_USED_F_NO_NOTIFY) == 0) {
+        bus->virtqueue_kick(d, vq);
+    }
+}
+
+uint16_t qvirtqueue_get_used_idx(QVirtQueue *vq)
+{
+    /* vq->used->idx */
+    return readw(vq->used + 2);
+}
+
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
 {
     g_assert(vq->event);
@@ -189,5 +189,8 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect);
 void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d, QVirtQueue *vq,
                                                             uint32_t free_head);
 
+void qvirtqueue_kick_batch(const QVirtioBus *bus, QVirtioDevice *d,
+                           QVirtQueue *vq, const uint32_t *heads, unsigned n);
+uint16_t qvirtqueue_get_used_idx(QVirtQueue *vq);
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx);
 #endif
@@ -27,9 +27,11 @@ sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts', '
 import qmp
 import qtest
 import struct
+import time
+import json
 
 __all__ = ['imgfmt', 'imgproto', 'test_dir' 'qemu_img', 'qemu_io',
-           'VM', 'QMPTestCase', 'notrun', 'main']
+           'VM', 'QMPTestCase', 'PerfTestCase', 'notrun', 'main']
 
 # This will not work if arguments contain spaces but is necessary if we
 # want to support the override options that ./check supports.
@@ -54,6 +56,12 @@ qemu_default_machine = os.environ.get('QEMU_DEFAULT_MACHINE')
 
 socket_scm_helper = os.environ.get('SOCKET_SCM_HELPER', 'socket_scm_helper')
 
+perf_enabled = os.environ.get('IOTESTS_PERF') == 'y'
+perf_baseline = os.environ.get('IOTESTS_PERF_BASELINE')
+perf_tolerance = float(os.environ.get('IOTESTS_PERF_TOLERANCE') or 10)
+perf_save = os.environ.get('IOTESTS_PERF_SAVE') == 'y'
+perf_results = {}
+
 def qemu_img(*args):
     '''Run qemu-img and return the exit code'''
     devnull = open('/dev/null', 'r+')
@@ -382,6 +390,60 @@ class QMPTestCase(unittest.TestCase):
         event = self.wait_until_completed(drive=drive)
         self.assert_qmp(event, 'data/type', 'mirror')
 
+class PerfTestCase(QMPTestCase):
+    '''Abstract base class for performance scenarios'''
+
+    def assert_perf(self, name, func, repeat=3):
+        '''Time func() and fail if it regressed against the baseline
+
+        The fastest of @repeat runs is recorded as scenario @name, keyed
+        by image format and test number in the baseline file.'''
+        best = None
+        for i in range(repeat):
+            start = time.time()
+            func()
+            elapsed = time.time() - start
+            if best is None or elapsed < best:
+                best = elapsed
+
+        key = '%s/%s/%s' % (imgfmt, os.path.basename(sys.argv[0]), name)
+        perf_results[key] = best
+        if perf_save:
+            return
+
+        baseline = perf_load_baseline().get(key)
+        if baseline and best > baseline * (1 + perf_tolerance / 100):
+            self.fail('%s took %.3fs, baseline is %.3fs (tolerance %g%%)' %
+                      (key, best, baseline, perf_tolerance))
+
+def perf_load_baseline():
+    '''Return the baseline timings, or an empty dict if there are none'''
+    if not perf_baseline or not os.path.exists(perf_baseline):
+        return {}
+    return json.load(open(perf_baseline))
+
+def perf_write_results():
+    '''Report this test's timings and store them if asked to'''
+    if not perf_results:
+        return
+
+    seq = os.path.basename(sys.argv[0])
+    baseline = perf_load_baseline()
+    report = open('%s/%s.perf' % (output_dir, seq), 'w')
+    for key in sorted(perf_results):
+        if key in baseline:
+            report.write('%s: %.3fs (baseline %.3fs)\n' %
+                         (key, perf_results[key], baseline[key]))
+        else:
+            report.write('%s: %.3fs\n' % (key, perf_results[key]))
+    report.close()
+
+    if perf_save and perf_baseline:
+        baseline.update(perf_results)
+        out = open(perf_baseline, 'w')
+        json.dump(baseline, out, indent=4, sort_keys=True)
+        out.close()
+
 def notrun(reason):
     '''Skip this test suite'''
     # Each test in qemu-iotests has a number ("seq")
@@ -391,11 +453,14 @@ def notrun(reason):
     print '%s not run: %s' % (seq, reason)
     sys.exit(0)
 
-def main(supported_fmts=[], supported_oses=['linux']):
+def main(supported_fmts=[], supported_oses=['linux'], perf=False):
     '''Run tests'''
 
     debug = '-d' in sys.argv
     verbosity = 1
+    if perf and not perf_enabled:
+        notrun('performance scenario, run with ./check -perf')
+
     if supported_fmts and (imgfmt not in supported_fmts):
         notrun('not suitable for this image format: %s' % imgfmt)
 
@@ -420,5 +485,6 @@ def main(supported_fmts=[], supported_oses=['linux']):
     try:
         unittest.main(testRunner=MyTestRunner)
     finally:
+        perf_write_results()
         if not debug:
             sys.stderr.write(re.sub(r'Ran (\d+) tests? in [\d.]+s', r'Ran \1 tests', output.getvalue()))
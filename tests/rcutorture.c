@@ -313,7 +313,11 @@ static void *rcu_update_stress_test(void *arg)
                 rcu_stress_array[i].pipe_count++;
             }
         }
-        synchronize_rcu();
+        if (n_updates & 1) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
         n_updates++;
     }
 
@@ -370,6 +374,7 @@ static void stresstest(int nreaders, int duration)
 
 static void gtest_stress(int nreaders, int duration)
 {
+    RCUStats stats;
     int i;
 
     rcu_stress_current = &rcu_stress_array[0];
@@ -390,6 +395,11 @@ static void gtest_stress(int nreaders, int duration)
     for (i = 2; i <= RCU_STRESS_PIPE_LEN; i++) {
         g_assert_cmpint(rcu_stress_count[i], ==, 0);
     }
+
+    rcu_get_stats(&stats);
+    g_assert_cmpint(stats.gp_count, >=, n_updates);
+    g_assert_cmpint(stats.gp_expedited, >=, n_updates / 2);
+    g_assert_cmpint(stats.gp_max_ns, <=, stats.gp_total_ns);
 }
 
 static void gtest_stress_1_1(void)
@@ -16,6 +16,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -399,6 +400,85 @@ static void test_aio_external_client(void)
     }
 }
 
+typedef struct {
+    EventNotifierTestData data;
+    bool work;
+    int polled;
+    int begun;
+    int ended;
+} PollTestData;
+
+static void poll_test_begin(EventNotifier *e)
+{
+    PollTestData *poll = container_of(e, PollTestData, data.e);
+
+    g_assert_cmpint(poll->begun, ==, poll->ended);
+    poll->begun++;
+}
+
+static void poll_test_end(EventNotifier *e)
+{
+    PollTestData *poll = container_of(e, PollTestData, data.e);
+
+    poll->ended++;
+    g_assert_cmpint(poll->begun, ==, poll->ended);
+}
+
+static bool poll_test_cb(void *opaque)
+{
+    PollTestData *poll = container_of(opaque, PollTestData, data.e);
+
+    if (!poll->work) {
+        return false;
+    }
+    poll->work = false;
+    poll->polled++;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData poll = { .data = { .n = 0, .active = 1 } };
+    Error *local_err = NULL;
+
+    aio_context_set_poll_params(ctx, NANOSECONDS_PER_SECOND, 0, 0,
+                                &local_err);
+    if (local_err) {
+        /* Polling is not supported on this host */
+        error_free(local_err);
+        return;
+    }
+
+    event_notifier_init(&poll.data.e, false);
+    set_event_notifier(ctx, &poll.data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &poll.data.e, poll_test_cb);
+    aio_set_event_notifier_poll_hooks(ctx, &poll.data.e,
+                                      poll_test_begin, poll_test_end);
+    while (aio_poll(ctx, false));
+
+    /* The first wakeup comes through the event notifier and enables polling */
+    event_notifier_set(&poll.data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll.data.n, ==, 1);
+    g_assert_cmpint(poll.polled, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Now work is found without signaling the event notifier */
+    poll.work = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll.data.n, ==, 1);
+    g_assert_cmpint(poll.polled, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(poll.begun, >, 0);
+    g_assert_cmpint(poll.begun, ==, poll.ended);
+
+    set_event_notifier(ctx, &poll.data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&poll.data.e);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -855,6 +935,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
@@ -314,6 +314,43 @@ static void perf_yield(void)
         maxcycles, duration);
 }
 
+static void coroutine_fn switch_inner(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while ((*counter) > 0) {
+        qemu_coroutine_yield();
+    }
+}
+
+static void coroutine_fn switch_outer(void *opaque)
+{
+    unsigned int *counter = opaque;
+    Coroutine *inner = qemu_coroutine_create(switch_inner);
+
+    /* Both sides run on coroutine stacks */
+    while ((*counter) > 0) {
+        (*counter)--;
+        qemu_coroutine_enter(inner, counter);
+    }
+}
+
+static void perf_switch(void)
+{
+    unsigned int i, maxcycles;
+    double duration;
+
+    maxcycles = 10000000;
+    i = maxcycles;
+
+    g_test_timer_start();
+    qemu_coroutine_enter(qemu_coroutine_create(switch_outer), &i);
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Switch %u iterations: %f s, %f ns per switch\n",
+        maxcycles, duration, duration * 1e9 / (2.0 * maxcycles));
+}
+
 static __attribute__((noinline)) void dummy(unsigned *i)
 {
     (*i)--;
@@ -380,6 +417,7 @@ int main(int argc, char **argv)
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
         g_test_add_func("/perf/yield", perf_yield);
+        g_test_add_func("/perf/switch", perf_switch);
         g_test_add_func("/perf/function-call", perf_baseline);
         g_test_add_func("/perf/cost", perf_cost);
     }
@@ -165,6 +165,39 @@ static QCryptoCipherTestData test_data[] = {
             "ffd29f1bb5596ad94ea2d8e6196b7f09"
             "30d8ed0bf2773af36dd82a6280c20926",
     },
+    {
+        /* Vectors 1 and 2 from IEEE 1619-2007 appendix B */
+        .path = "/crypto/cipher/aes-xts-128-1",
+        .alg = QCRYPTO_CIPHER_ALG_AES_128,
+        .mode = QCRYPTO_CIPHER_MODE_XTS,
+        .key =
+            "00000000000000000000000000000000"
+            "00000000000000000000000000000000",
+        .iv =
+            "00000000000000000000000000000000",
+        .plaintext =
+            "00000000000000000000000000000000"
+            "00000000000000000000000000000000",
+        .ciphertext =
+            "917cf69ebd68b2ec9b9fe9a3eadda692"
+            "cd43d2f59598ed858c02c2652fbf922e",
+    },
+    {
+        .path = "/crypto/cipher/aes-xts-128-2",
+        .alg = QCRYPTO_CIPHER_ALG_AES_128,
+        .mode = QCRYPTO_CIPHER_MODE_XTS,
+        .key =
+            "11111111111111111111111111111111"
+            "22222222222222222222222222222222",
+        .iv =
+            "33333333330000000000000000000000",
+        .plaintext =
+            "44444444444444444444444444444444"
+            "44444444444444444444444444444444",
+        .ciphertext =
+            "c454185e6a16936e39334038acef838b"
+            "fb186fff7480adc4289382ecd6d394f0",
+    },
 };
 
 
@@ -251,7 +284,11 @@ static void test_cipher(const void *opaque)
     blocksize = qcrypto_cipher_get_block_len(data->alg);
     ivsize = qcrypto_cipher_get_iv_len(data->alg, data->mode);
 
-    g_assert_cmpint(keysize, ==, nkey);
+    if (data->mode == QCRYPTO_CIPHER_MODE_XTS) {
+        g_assert_cmpint(keysize * 2, ==, nkey);
+    } else {
+        g_assert_cmpint(keysize, ==, nkey);
+    }
     g_assert_cmpint(ivsize, ==, niv);
     if (niv) {
         g_assert_cmpint(blocksize, ==, niv);
@@ -371,6 +408,124 @@ static void test_cipher_short_plaintext(void)
     qcrypto_cipher_free(cipher);
 }
 
+static void test_cipher_sectors_mode(QCryptoCipherMode mode)
+{
+    QCryptoCipher *cipher;
+    uint8_t key[32], iv[16];
+    uint8_t *plaintext, *ciphertext, *expected;
+    const size_t nsectors = 8, sector_size = 512;
+    const uint64_t first = 0x123456789ULL;
+    size_t i, len = nsectors * sector_size;
+
+    for (i = 0; i < sizeof(key); i++) {
+        key[i] = i * 3 + 1;
+    }
+    plaintext = g_new(uint8_t, len);
+    ciphertext = g_new(uint8_t, len);
+    expected = g_new(uint8_t, len);
+    for (i = 0; i < len; i++) {
+        plaintext[i] = i ^ (i >> 9);
+    }
+
+    cipher = qcrypto_cipher_new(
+        QCRYPTO_CIPHER_ALG_AES_128, mode,
+        key, mode == QCRYPTO_CIPHER_MODE_XTS ? 32 : 16,
+        &error_abort);
+
+    /* Same result as one IV and one encryption per sector */
+    memset(iv, 0, sizeof(iv));
+    for (i = 0; i < nsectors; i++) {
+        stq_le_p(iv, first + i);
+        g_assert(qcrypto_cipher_setiv(cipher, iv, sizeof(iv),
+                                      &error_abort) == 0);
+        g_assert(qcrypto_cipher_encrypt(cipher,
+                                        plaintext + i * sector_size,
+                                        expected + i * sector_size,
+                                        sector_size, &error_abort) == 0);
+    }
+
+    g_assert(qcrypto_cipher_encrypt_sectors(cipher, first, sector_size,
+                                            plaintext, ciphertext, len,
+                                            &error_abort) == 0);
+    g_assert(memcmp(ciphertext, expected, len) == 0);
+
+    /* In place decryption gives back the plain text */
+    g_assert(qcrypto_cipher_decrypt_sectors(cipher, first, sector_size,
+                                            ciphertext, ciphertext, len,
+                                            &error_abort) == 0);
+    g_assert(memcmp(ciphertext, plaintext, len) == 0);
+
+    qcrypto_cipher_free(cipher);
+    g_free(plaintext);
+    g_free(ciphertext);
+    g_free(expected);
+}
+
+static void test_cipher_sectors(void)
+{
+    test_cipher_sectors_mode(QCRYPTO_CIPHER_MODE_CBC);
+    test_cipher_sectors_mode(QCRYPTO_CIPHER_MODE_XTS);
+}
+
+static void test_cipher_sectors_ecb(void)
+{
+    Error *err = NULL;
+    QCryptoCipher *cipher;
+    uint8_t key[16] = { 0 };
+    uint8_t buf[512] = { 0 };
+
+    cipher = qcrypto_cipher_new(
+        QCRYPTO_CIPHER_ALG_AES_128,
+        QCRYPTO_CIPHER_MODE_ECB,
+        key, sizeof(key),
+        &error_abort);
+
+    /* ECB has no IV to carry the sector number */
+    g_assert(qcrypto_cipher_encrypt_sectors(cipher, 0, sizeof(buf),
+                                            buf, buf, sizeof(buf),
+                                            &err) == -1);
+    g_assert(err != NULL);
+
+    error_free(err);
+    qcrypto_cipher_free(cipher);
+}
+
+static void perf_cipher_sectors_mode(const char *name,
+                                     QCryptoCipherMode mode, size_t nkey)
+{
+    QCryptoCipher *cipher;
+    uint8_t key[32] = { 0 };
+    const size_t len = 1024 * 1024;
+    uint8_t *buf = g_malloc0(len);
+    double duration;
+    int i, count = 64;
+
+    cipher = qcrypto_cipher_new(
+        QCRYPTO_CIPHER_ALG_AES_128, mode,
+        key, nkey,
+        &error_abort);
+
+    g_test_timer_start();
+    for (i = 0; i < count; i++) {
+        qcrypto_cipher_encrypt_sectors(cipher, i * (len / 512), 512,
+                                       buf, buf, len, &error_abort);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("%s: %d MiB in %f s (%f MB/s)", name, count,
+                   duration, (double)count * len / duration / 1e6);
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+}
+
+static void perf_cipher_sectors(void)
+{
+    perf_cipher_sectors_mode("aes-128-cbc-plain64",
+                             QCRYPTO_CIPHER_MODE_CBC, 16);
+    perf_cipher_sectors_mode("aes-128-xts-plain64",
+                             QCRYPTO_CIPHER_MODE_XTS, 32);
+}
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -389,5 +544,16 @@ int main(int argc, char **argv)
     g_test_add_func("/crypto/cipher/short-plaintext",
                     test_cipher_short_plaintext);
 
+    g_test_add_func("/crypto/cipher/sectors",
+                    test_cipher_sectors);
+
+    g_test_add_func("/crypto/cipher/sectors-ecb",
+                    test_cipher_sectors_ecb);
+
+    if (g_test_perf()) {
+        g_test_add_func("/crypto/cipher/perf/sectors",
+                        perf_cipher_sectors);
+    }
+
     return g_test_run();
 }
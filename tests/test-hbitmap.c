@@ -635,6 +635,159 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+/* Serialize the bitmap in chunks and load it back into a fresh HBitmap,
+ * which then replaces the original one in @data.
+ */
+static void hbitmap_test_serialize_roundtrip(TestHBitmapData *data,
+                                             uint64_t chunk)
+{
+    HBitmap *copy = hbitmap_alloc(data->size, data->granularity);
+    uint64_t start, count;
+    uint8_t *buf;
+
+    buf = g_malloc0(hbitmap_serialization_size(data->hb, 0, data->size));
+    for (start = 0; start < data->size; start += count) {
+        count = MIN(chunk, data->size - start);
+        hbitmap_serialize_part(data->hb, buf, start, count);
+        hbitmap_deserialize_part(copy, buf, start, count, false);
+    }
+    hbitmap_deserialize_finish(copy);
+    g_free(buf);
+
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_serialize_basic(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t gran;
+    uint8_t buf[16];
+
+    hbitmap_test_init(data, L2 + 37, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(gran, ==, 64);
+
+    /* The format is a little endian bit stream, whatever the host */
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 9, 1);
+    hbitmap_test_set(data, 127, 1);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 128), ==, 16);
+    hbitmap_serialize_part(data->hb, buf, 0, 128);
+    g_assert_cmpint(buf[0], ==, 0x01);
+    g_assert_cmpint(buf[1], ==, 0x02);
+    g_assert_cmpint(buf[15], ==, 0x80);
+
+    hbitmap_test_set(data, 1000, 300);
+    hbitmap_test_set(data, L2, 37);
+    hbitmap_test_serialize_roundtrip(data, gran);
+    hbitmap_test_serialize_roundtrip(data, gran * 7);
+    hbitmap_test_serialize_roundtrip(data, data->size);
+}
+
+static void test_hbitmap_serialize_ones(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L1 * 3 + 5, 1);
+    gran = hbitmap_serialization_granularity(data->hb);
+
+    /* The tail past the end of the bitmap must not be counted */
+    hbitmap_deserialize_ones(data->hb, 0, data->size, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size + 1);
+
+    hbitmap_deserialize_zeroes(data->hb, 0, gran, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size + 1 - gran);
+    g_assert(!hbitmap_get(data->hb, gran - 1));
+    g_assert(hbitmap_get(data->hb, gran));
+}
+
+static void test_hbitmap_serialize_zero(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L2 + 37, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert(hbitmap_is_serialized_zero(data->hb, 0, data->size));
+
+    hbitmap_test_set(data, 2 * gran + 2, 1);
+    g_assert(hbitmap_is_serialized_zero(data->hb, 0, 2 * gran));
+    g_assert(!hbitmap_is_serialized_zero(data->hb, 2 * gran, gran));
+    g_assert(!hbitmap_is_serialized_zero(data->hb, 0, data->size));
+    g_assert(hbitmap_is_serialized_zero(data->hb, 3 * gran,
+                                        data->size - 3 * gran));
+
+    /* The last chunk is not aligned */
+    hbitmap_test_set(data, data->size - 1, 1);
+    g_assert(!hbitmap_is_serialized_zero(data->hb, L2, data->size - L2));
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L2 * 2 + 17, 0);
+    b = hbitmap_alloc(data->size, 0);
+    hbitmap_test_set(data, 10, 100);
+
+    /* A partial overlap, then a run covering a whole upper level word */
+    hbitmap_set(b, 50, 100);
+    hbitmap_set(b, L2, L2);
+    hbitmap_set(b, data->size - 1, 1);
+    g_assert(hbitmap_merge(data->hb, b));
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 100 + 40 + L2 + 1);
+    g_assert_cmpint(hbitmap_count(b), ==, 100 + L2 + 1);
+
+    hbitmap_test_set(data, 50, 100);
+    hbitmap_test_set(data, L2, L2);
+    hbitmap_test_set(data, data->size - 1, 1);
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+
+    /* Bitmaps of different sizes are not merged */
+    b = hbitmap_alloc(data->size + 1, 0);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L2 + 5, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 4), ==, L2 + 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 5), ==, -1);
+
+    hbitmap_test_set(data, 0, L1 * 3 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, L1 * 3 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 * 3 + 4), ==, L1 * 3 + 4);
+
+    hbitmap_test_set(data, 0, data->size);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, -1);
+    hbitmap_test_reset(data, L2 + 4, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 5), ==, L2 + 4);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L1 * 2, 2);
+    hbitmap_test_set(data, 0, 16);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 16);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 17), ==, 17);
+
+    /* Returns @start, not the first bit of its group */
+    hbitmap_test_set(data, 16, L1 * 2 - 16);
+    hbitmap_test_reset(data, 20, 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 20);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 22), ==, 22);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 24), ==, -1);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -684,6 +837,18 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/basic",
+                     test_hbitmap_serialize_basic);
+    hbitmap_test_add("/hbitmap/serialize/ones",
+                     test_hbitmap_serialize_ones);
+    hbitmap_test_add("/hbitmap/serialize/zero",
+                     test_hbitmap_serialize_zero);
+
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/next-zero/general", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next-zero/granularity",
+                     test_hbitmap_next_zero_granularity);
     g_test_run();
 
     return 0;
@@ -0,0 +1,169 @@
+/*
+ * Test the interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu/interval-tree.h"
+
+#define NUM_NODES   1000
+#define RANGE       10000
+
+typedef struct TestNode {
+    IntervalTreeNode node;
+    bool in_tree;
+    bool seen;
+} TestNode;
+
+static TestNode nodes[NUM_NODES];
+
+static bool overlaps(IntervalTreeNode *node, uint64_t start, uint64_t last)
+{
+    return node->start <= last && node->last >= start;
+}
+
+/* Collect all nodes, returning them in order of increasing start */
+static uint64_t prev_start;
+
+static bool mark_seen(IntervalTreeNode *node, void *opaque)
+{
+    TestNode *t = container_of(node, TestNode, node);
+
+    g_assert(t->in_tree);
+    g_assert(!t->seen);
+    g_assert_cmpint(node->start, >=, prev_start);
+    prev_start = node->start;
+    t->seen = true;
+    (*(int *)opaque)++;
+    return false;
+}
+
+static void check_range(IntervalTreeRoot *root, uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *first;
+    int count = 0;
+    int expected = 0;
+    int i;
+
+    for (i = 0; i < NUM_NODES; i++) {
+        nodes[i].seen = false;
+    }
+
+    prev_start = 0;
+    g_assert(interval_tree_find(root, start, last, mark_seen, &count) == NULL);
+    first = interval_tree_find(root, start, last, NULL, NULL);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        bool expect = nodes[i].in_tree &&
+                      overlaps(&nodes[i].node, start, last);
+
+        g_assert_cmpint(nodes[i].seen, ==, expect);
+        if (expect) {
+            expected++;
+            g_assert(first && first->start <= nodes[i].node.start);
+        }
+    }
+    g_assert_cmpint(count, ==, expected);
+    g_assert(!first == !expected);
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root = { NULL };
+    int i, j;
+
+    for (i = 0; i < NUM_NODES; i++) {
+        uint64_t start = g_test_rand_int_range(0, RANGE);
+
+        nodes[i].node.start = start;
+        nodes[i].node.last = start + g_test_rand_int_range(0, RANGE / 50);
+        nodes[i].in_tree = false;
+    }
+
+    for (j = 0; j < 20 * NUM_NODES; j++) {
+        TestNode *t = &nodes[g_test_rand_int_range(0, NUM_NODES)];
+
+        if (t->in_tree) {
+            interval_tree_remove(&root, &t->node);
+        } else {
+            interval_tree_insert(&root, &t->node);
+        }
+        t->in_tree = !t->in_tree;
+
+        if (j % 100 == 0) {
+            uint64_t start = g_test_rand_int_range(0, RANGE);
+            check_range(&root, start,
+                        start + g_test_rand_int_range(0, RANGE / 10));
+        }
+    }
+
+    check_range(&root, 0, UINT64_MAX);
+    for (i = 0; i < NUM_NODES; i++) {
+        if (nodes[i].in_tree) {
+            interval_tree_remove(&root, &nodes[i].node);
+        }
+    }
+    g_assert(root.root == NULL);
+}
+
+static void test_same_interval(void)
+{
+    IntervalTreeRoot root = { NULL };
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        nodes[i].node.start = 42;
+        nodes[i].node.last = 42;
+        nodes[i].in_tree = true;
+        interval_tree_insert(&root, &nodes[i].node);
+    }
+    for (; i < NUM_NODES; i++) {
+        nodes[i].in_tree = false;
+    }
+
+    check_range(&root, 42, 42);
+    check_range(&root, 0, 41);
+    check_range(&root, 43, 100);
+
+    for (i = 0; i < 100; i += 2) {
+        interval_tree_remove(&root, &nodes[i].node);
+        nodes[i].in_tree = false;
+    }
+    check_range(&root, 0, 100);
+}
+
+static bool match_node(IntervalTreeNode *node, void *opaque)
+{
+    return node == opaque;
+}
+
+static void test_match(void)
+{
+    IntervalTreeRoot root = { NULL };
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        nodes[i].node.start = i * 10;
+        nodes[i].node.last = i * 10 + 15;
+        interval_tree_insert(&root, &nodes[i].node);
+    }
+
+    g_assert(interval_tree_find(&root, 0, 100, match_node, &nodes[5].node) ==
+             &nodes[5].node);
+    g_assert(interval_tree_find(&root, 0, 20, match_node, &nodes[5].node) ==
+             NULL);
+    g_assert(interval_tree_find(&root, 25, 25, NULL, NULL) == &nodes[1].node);
+    g_assert(interval_tree_find(&root, 200, 300, NULL, NULL) == NULL);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/random", test_random);
+    g_test_add_func("/interval-tree/same-interval", test_same_interval);
+    g_test_add_func("/interval-tree/match", test_match);
+    return g_test_run();
+}
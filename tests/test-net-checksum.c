@@ -0,0 +1,153 @@
+/*
+ * Internet checksum unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE 65536
+
+/* Byte at a time, as in RFC 1071 */
+static uint32_t ref_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        if (i & 1) {
+            sum += (uint32_t)buf[i - seq];
+        } else {
+            sum += (uint32_t)buf[i - seq] << 8;
+        }
+    }
+    return sum;
+}
+
+static uint8_t *random_buf(size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = g_test_rand_int();
+    }
+    return buf;
+}
+
+static void test_checksum_add(void)
+{
+    uint8_t *buf = random_buf(BUF_SIZE + 8);
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        int len = g_test_rand_int_range(0, i < 1000 ? 64 : BUF_SIZE);
+        int off = g_test_rand_int_range(0, 8);
+        int seq = g_test_rand_int_range(0, 4);
+
+        g_assert_cmpint(net_checksum_finish(
+                            net_checksum_add_cont(len, buf + off, seq)), ==,
+                        net_checksum_finish(
+                            ref_checksum_add_cont(len, buf + off, seq)));
+    }
+    g_free(buf);
+}
+
+static void test_checksum_extremes(void)
+{
+    uint8_t *buf = g_malloc(BUF_SIZE);
+
+    memset(buf, 0, BUF_SIZE);
+    g_assert_cmpint(net_checksum_add(BUF_SIZE, buf), ==, 0);
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(BUF_SIZE, buf)), ==,
+                    0xffff);
+
+    memset(buf, 0xff, BUF_SIZE);
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(BUF_SIZE, buf)), ==,
+                    net_checksum_finish(ref_checksum_add_cont(BUF_SIZE, buf,
+                                                              0)));
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(BUF_SIZE - 1, buf)),
+                    ==,
+                    net_checksum_finish(ref_checksum_add_cont(BUF_SIZE - 1,
+                                                              buf, 0)));
+    g_free(buf);
+}
+
+static void test_checksum_add_iov(void)
+{
+    uint8_t *buf = random_buf(BUF_SIZE);
+    struct iovec iov[8];
+    int i, j;
+
+    for (i = 0; i < 200; i++) {
+        size_t off = 0;
+        uint32_t start, size;
+
+        /* Split the buffer at random, odd lengths included */
+        for (j = 0; j < ARRAY_SIZE(iov); j++) {
+            size_t len = j == ARRAY_SIZE(iov) - 1 ? BUF_SIZE - off :
+                         g_test_rand_int_range(0, (BUF_SIZE - off) / 4 + 1);
+
+            iov[j].iov_base = buf + off;
+            iov[j].iov_len = len;
+            off += len;
+        }
+        start = g_test_rand_int_range(0, BUF_SIZE);
+        size = g_test_rand_int_range(0, BUF_SIZE - start + 1);
+
+        g_assert_cmpint(net_checksum_finish(
+                            net_checksum_add_iov(iov, ARRAY_SIZE(iov),
+                                                 start, size)), ==,
+                        net_checksum_finish(
+                            ref_checksum_add_cont(size, buf + start, 0)));
+    }
+    g_free(buf);
+}
+
+static void perf_checksum(uint32_t (*fn)(int, uint8_t *, int), int len)
+{
+    uint8_t *buf = random_buf(len);
+    uint32_t sum = 0;
+    long i, iterations = (256 << 20) / len;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        sum += fn(len, buf, 0);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d byte buffers: %f s for 256 MiB, %.0f MB/s (sum %x)",
+                   len, duration, 256 * 1.048576 / duration, sum);
+    g_free(buf);
+}
+
+static void perf_checksum_add(void)
+{
+    perf_checksum(net_checksum_add_cont, 64);
+    perf_checksum(net_checksum_add_cont, 1500);
+    perf_checksum(net_checksum_add_cont, 65536);
+}
+
+static void perf_checksum_ref(void)
+{
+    perf_checksum(ref_checksum_add_cont, 64);
+    perf_checksum(ref_checksum_add_cont, 1500);
+    perf_checksum(ref_checksum_add_cont, 65536);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/add", test_checksum_add);
+    g_test_add_func("/net/checksum/extremes", test_checksum_extremes);
+    g_test_add_func("/net/checksum/add_iov", test_checksum_add_iov);
+    if (g_test_perf()) {
+        g_test_add_func("/net/checksum/perf/add", perf_checksum_add);
+        g_test_add_func("/net/checksum/perf/bytewise", perf_checksum_ref);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,394 @@
+/*
+ * Test the host FPU fast path of softfloat against the software path
+ *
+ * The fast path is only taken once the inexact flag has been raised, so
+ * every operation is computed twice: with inexact set on entry, which may
+ * use the host FPU, and with inexact clear, which always goes through
+ * softfloat.  Apart from inexact itself, results and flags must be equal.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "fpu/softfloat.h"
+
+static float32 f32_sqrt(float32 a, float32 b, float_status *s)
+{
+    return float32_sqrt(a, s);
+}
+
+static float64 f64_sqrt(float64 a, float64 b, float_status *s)
+{
+    return float64_sqrt(a, s);
+}
+
+static const struct {
+    const char *name;
+    float32 (*f32)(float32, float32, float_status *);
+    float64 (*f64)(float64, float64, float_status *);
+} ops[] = {
+    { "add", float32_add, float64_add },
+    { "sub", float32_sub, float64_sub },
+    { "mul", float32_mul, float64_mul },
+    { "div", float32_div, float64_div },
+    { "sqrt", f32_sqrt, f64_sqrt },
+};
+
+static const uint32_t f32_special[] = {
+    0x00000000, 0x80000000,             /* zeroes */
+    0x00000001, 0x807fffff, 0x00400000, /* denormals */
+    0x00800000, 0x80800001, 0x00ffffff, /* smallest normals */
+    0x01000000, 0x1f800000, 0x20000001, /* 2^-125, 2^-64, 2^-63 */
+    0x3f800000, 0xbf800000, 0x3fc00000, /* 1, -1, 1.5 */
+    0x3eaaaaab, 0x40490fdb, 0x3f800001, /* 1/3, pi, 1 + ulp */
+    0x5f800000, 0x5f7fffff, 0x7f000000, /* 2^64, below 2^64, 2^127 */
+    0x7f7fffff, 0xff7fffff,             /* largest normals */
+    0x7f800000, 0xff800000,             /* infinities */
+    0x7fc00000, 0xffc01234,             /* quiet NaNs */
+    0x7f800001, 0xff812345,             /* signaling NaNs */
+};
+
+static const uint64_t f64_special[] = {
+    0x0000000000000000ULL, 0x8000000000000000ULL,
+    0x0000000000000001ULL, 0x800fffffffffffffULL, 0x0008000000000000ULL,
+    0x0010000000000000ULL, 0x8010000000000001ULL, 0x001fffffffffffffULL,
+    0x0020000000000000ULL, 0x1ff0000000000000ULL, 0x2000000000000001ULL,
+    0x3ff0000000000000ULL, 0xbff0000000000000ULL, 0x3ff8000000000000ULL,
+    0x3fd5555555555555ULL, 0x400921fb54442d18ULL, 0x3ff0000000000001ULL,
+    0x5ff0000000000000ULL, 0x5fefffffffffffffULL, 0x7fe0000000000000ULL,
+    0x7fefffffffffffffULL, 0xffefffffffffffffULL,
+    0x7ff0000000000000ULL, 0xfff0000000000000ULL,
+    0x7ff8000000000000ULL, 0xfff8000000001234ULL,
+    0x7ff0000000000001ULL, 0xfff0000000012345ULL,
+};
+
+static const int rounding_modes[] = {
+    float_round_nearest_even,
+    float_round_down,
+    float_round_up,
+    float_round_to_zero,
+    float_round_ties_away,
+};
+
+/* Read the flags back without the sign extension of the signed char */
+static uint8_t get_flags(float_status *s)
+{
+    return (uint8_t)get_float_exception_flags(s);
+}
+
+static void check_f32(int op, float32 a, float32 b, float_status *st)
+{
+    float_status fast = *st, soft = *st;
+    float32 r, ref;
+    uint8_t flags, ref_flags;
+
+    set_float_exception_flags(get_flags(st) | float_flag_inexact, &fast);
+    set_float_exception_flags(get_flags(st) & ~float_flag_inexact, &soft);
+    r = ops[op].f32(a, b, &fast);
+    ref = ops[op].f32(a, b, &soft);
+    flags = get_flags(&fast);
+    ref_flags = get_flags(&soft) | float_flag_inexact;
+
+    if (float32_val(r) != float32_val(ref) || flags != ref_flags) {
+        g_test_message("float32_%s(%#010x, %#010x) rounding %d, tininess %d, "
+                       "ftz %d/%d, default NaN %d",
+                       ops[op].name, float32_val(a), float32_val(b),
+                       st->float_rounding_mode, st->float_detect_tininess,
+                       st->flush_to_zero, st->flush_inputs_to_zero,
+                       st->default_nan_mode);
+    }
+    g_assert_cmphex(float32_val(r), ==, float32_val(ref));
+    g_assert_cmphex(flags, ==, ref_flags);
+}
+
+static void check_f64(int op, float64 a, float64 b, float_status *st)
+{
+    float_status fast = *st, soft = *st;
+    float64 r, ref;
+    uint8_t flags, ref_flags;
+
+    set_float_exception_flags(get_flags(st) | float_flag_inexact, &fast);
+    set_float_exception_flags(get_flags(st) & ~float_flag_inexact, &soft);
+    r = ops[op].f64(a, b, &fast);
+    ref = ops[op].f64(a, b, &soft);
+    flags = get_flags(&fast);
+    ref_flags = get_flags(&soft) | float_flag_inexact;
+
+    if (float64_val(r) != float64_val(ref) || flags != ref_flags) {
+        g_test_message("float64_%s(%#018" PRIx64 ", %#018" PRIx64 ") "
+                       "rounding %d, tininess %d, ftz %d/%d, default NaN %d",
+                       ops[op].name, float64_val(a), float64_val(b),
+                       st->float_rounding_mode, st->float_detect_tininess,
+                       st->flush_to_zero, st->flush_inputs_to_zero,
+                       st->default_nan_mode);
+    }
+    g_assert_cmphex(float64_val(r), ==, float64_val(ref));
+    g_assert_cmphex(flags, ==, ref_flags);
+}
+
+/*
+ * Random operands, half of them with an exponent close to the limits of
+ * the format or to zero, where results overflow, underflow or cancel.
+ */
+static uint32_t rand_f32(void)
+{
+    uint32_t sign = g_test_rand_int() & 0x80000000;
+    uint32_t frac = g_test_rand_int() & 0x007fffff;
+    int32_t exp;
+
+    switch (g_test_rand_int_range(0, 4)) {
+    case 0:
+        exp = g_test_rand_int_range(0, 0x100);
+        break;
+    case 1:
+        exp = g_test_rand_int_range(0, 4);
+        break;
+    case 2:
+        exp = g_test_rand_int_range(0xfb, 0x100);
+        break;
+    default:
+        exp = g_test_rand_int_range(0x7f - 24, 0x7f + 24);
+        break;
+    }
+    return sign | (exp << 23) | frac;
+}
+
+static uint64_t rand_f64(void)
+{
+    uint64_t sign = (uint64_t)(g_test_rand_int() & 0x80000000) << 32;
+    uint64_t frac = ((uint64_t)g_test_rand_int() << 32 | g_test_rand_int())
+                    & 0x000fffffffffffffULL;
+    uint64_t exp;
+
+    switch (g_test_rand_int_range(0, 4)) {
+    case 0:
+        exp = g_test_rand_int_range(0, 0x800);
+        break;
+    case 1:
+        exp = g_test_rand_int_range(0, 4);
+        break;
+    case 2:
+        exp = g_test_rand_int_range(0x7fb, 0x800);
+        break;
+    default:
+        exp = g_test_rand_int_range(0x3ff - 53, 0x3ff + 53);
+        break;
+    }
+    return sign | (exp << 52) | frac;
+}
+
+/*
+ * Call @fn for every combination of rounding mode, tininess detection,
+ * flush-to-zero of inputs and outputs, default NaN mode and of the
+ * flags that are already raised.
+ */
+static void for_each_status(void (*fn)(float_status *st))
+{
+    int mode, tininess, ftz, dnan, flags;
+    float_status st;
+
+    for (mode = 0; mode < ARRAY_SIZE(rounding_modes); mode++) {
+        for (tininess = 0; tininess < 2; tininess++) {
+            for (ftz = 0; ftz < 4; ftz++) {
+                for (dnan = 0; dnan < 2; dnan++) {
+                    for (flags = 0; flags < 2; flags++) {
+                        memset(&st, 0, sizeof(st));
+                        set_float_rounding_mode(rounding_modes[mode], &st);
+                        set_float_detect_tininess(tininess, &st);
+                        set_flush_to_zero(ftz & 1, &st);
+                        set_flush_inputs_to_zero(ftz >> 1, &st);
+                        set_default_nan_mode(dnan, &st);
+                        set_float_exception_flags(flags ?
+                                                  float_flag_overflow |
+                                                  float_flag_underflow : 0,
+                                                  &st);
+                        fn(&st);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void special_f32(float_status *st)
+{
+    int op, i, j;
+
+    for (op = 0; op < ARRAY_SIZE(ops); op++) {
+        for (i = 0; i < ARRAY_SIZE(f32_special); i++) {
+            for (j = 0; j < ARRAY_SIZE(f32_special); j++) {
+                check_f32(op, make_float32(f32_special[i]),
+                          make_float32(f32_special[j]), st);
+            }
+        }
+    }
+}
+
+static void special_f64(float_status *st)
+{
+    int op, i, j;
+
+    for (op = 0; op < ARRAY_SIZE(ops); op++) {
+        for (i = 0; i < ARRAY_SIZE(f64_special); i++) {
+            for (j = 0; j < ARRAY_SIZE(f64_special); j++) {
+                check_f64(op, make_float64(f64_special[i]),
+                          make_float64(f64_special[j]), st);
+            }
+        }
+    }
+}
+
+static void random_f32(float_status *st)
+{
+    int op, i;
+
+    for (op = 0; op < ARRAY_SIZE(ops); op++) {
+        for (i = 0; i < 500; i++) {
+            check_f32(op, make_float32(rand_f32()),
+                      make_float32(rand_f32()), st);
+        }
+    }
+}
+
+static void random_f64(float_status *st)
+{
+    int op, i;
+
+    for (op = 0; op < ARRAY_SIZE(ops); op++) {
+        for (i = 0; i < 500; i++) {
+            check_f64(op, make_float64(rand_f64()),
+                      make_float64(rand_f64()), st);
+        }
+    }
+}
+
+static void test_special_f32(void)
+{
+    for_each_status(special_f32);
+}
+
+static void test_special_f64(void)
+{
+    for_each_status(special_f64);
+}
+
+static void test_random_f32(void)
+{
+    for_each_status(random_f32);
+}
+
+static void test_random_f64(void)
+{
+    for_each_status(random_f64);
+}
+
+/*
+ * Expected results for operands that the fast path has to hand back to
+ * softfloat, starting with inexact raised so that it is considered.
+ */
+static void test_fallback(void)
+{
+    float_status st;
+
+#define CHECK(op, a, b, mode, ftz, dnan, r, f)                          \
+    do {                                                                \
+        memset(&st, 0, sizeof(st));                                     \
+        set_float_rounding_mode(mode, &st);                             \
+        set_flush_to_zero((ftz) & 1, &st);                              \
+        set_flush_inputs_to_zero((ftz) >> 1, &st);                      \
+        set_default_nan_mode(dnan, &st);                                \
+        set_float_exception_flags(float_flag_inexact, &st);             \
+        g_assert_cmphex(float_val(op(make_float(a), make_float(b), &st)), \
+                        ==, r);                                         \
+        g_assert_cmphex(get_flags(&st), ==, float_flag_inexact | (f));  \
+    } while (0)
+
+#define float_val float32_val
+#define make_float make_float32
+    /* Overflow */
+    CHECK(float32_mul, 0x7f7fffff, 0x40000000, float_round_nearest_even,
+          0, 0, 0x7f800000, float_flag_overflow);
+    CHECK(float32_add, 0xff7fffff, 0xff7fffff, float_round_nearest_even,
+          0, 0, 0xff800000, float_flag_overflow);
+    /* Underflow, and the same result flushed to zero */
+    CHECK(float32_mul, 0x00800003, 0x3f000000, float_round_nearest_even,
+          0, 0, 0x00400002, float_flag_underflow);
+    CHECK(float32_mul, 0x00800003, 0x3f000000, float_round_nearest_even,
+          1, 0, 0x00000000, float_flag_output_denormal);
+    /* Exact denormal result */
+    CHECK(float32_sub, 0x00800001, 0x00800000, float_round_nearest_even,
+          0, 0, 0x00000001, 0);
+    /* Denormal input, as is and flushed to zero */
+    CHECK(float32_add, 0x00000001, 0x3f800000, float_round_nearest_even,
+          0, 0, 0x3f800000, 0);
+    CHECK(float32_mul, 0x00000001, 0x3f800000, float_round_nearest_even,
+          2, 0, 0x00000000, float_flag_input_denormal);
+    /* Exact zero results take the sign from the rounding mode */
+    CHECK(float32_sub, 0x3f800000, 0x3f800000, float_round_nearest_even,
+          0, 0, 0x00000000, 0);
+    CHECK(float32_sub, 0x3f800000, 0x3f800000, float_round_down,
+          0, 0, 0x80000000, 0);
+    /* Directed rounding */
+    CHECK(float32_add, 0x3f800000, 0x30800000, float_round_nearest_even,
+          0, 0, 0x3f800000, 0);
+    CHECK(float32_add, 0x3f800000, 0x30800000, float_round_up,
+          0, 0, 0x3f800001, 0);
+    CHECK(f32_sqrt, 0x40000000, 0, float_round_nearest_even,
+          0, 0, 0x3fb504f3, 0);
+    CHECK(f32_sqrt, 0x40000000, 0, float_round_up,
+          0, 0, 0x3fb504f4, 0);
+    /* Division by zero and invalid operations */
+    CHECK(float32_div, 0x3f800000, 0x00000000, float_round_nearest_even,
+          0, 0, 0x7f800000, float_flag_divbyzero);
+    CHECK(f32_sqrt, 0xbf800000, 0, float_round_nearest_even,
+          0, 0, float32_val(float32_default_nan), float_flag_invalid);
+    /* NaN propagation */
+    CHECK(float32_add, 0x7fc01234, 0x3f800000, float_round_nearest_even,
+          0, 0, 0x7fc01234, 0);
+    CHECK(float32_mul, 0x3f800000, 0x7f801234, float_round_nearest_even,
+          0, 0, 0x7fc01234, float_flag_invalid);
+    CHECK(float32_add, 0x7fc01234, 0x3f800000, float_round_nearest_even,
+          0, 1, float32_val(float32_default_nan), 0);
+#undef float_val
+#undef make_float
+
+#define float_val float64_val
+#define make_float make_float64
+    CHECK(float64_mul, 0x7fefffffffffffffULL, 0x4000000000000000ULL,
+          float_round_nearest_even, 0, 0, 0x7ff0000000000000ULL,
+          float_flag_overflow);
+    CHECK(float64_mul, 0x0010000000000003ULL, 0x3fe0000000000000ULL,
+          float_round_nearest_even, 0, 0, 0x0008000000000002ULL,
+          float_flag_underflow);
+    CHECK(float64_mul, 0x0010000000000003ULL, 0x3fe0000000000000ULL,
+          float_round_nearest_even, 1, 0, 0, float_flag_output_denormal);
+    CHECK(float64_add, 0x0000000000000001ULL, 0x3ff0000000000000ULL,
+          float_round_nearest_even, 2, 0, 0x3ff0000000000000ULL,
+          float_flag_input_denormal);
+    CHECK(float64_add, 0x3ff0000000000000ULL, 0x3c00000000000000ULL,
+          float_round_up, 0, 0, 0x3ff0000000000001ULL, 0);
+    CHECK(float64_div, 0xbff0000000000000ULL, 0, float_round_nearest_even,
+          0, 0, 0xfff0000000000000ULL, float_flag_divbyzero);
+    CHECK(float64_sub, 0x7ff0000000000000ULL, 0x7ff0000000000000ULL,
+          float_round_nearest_even, 0, 0,
+          float64_val(float64_default_nan), float_flag_invalid);
+    CHECK(float64_add, 0x3ff0000000000000ULL, 0x7ff0000000001234ULL,
+          float_round_nearest_even, 0, 0, 0x7ff8000000001234ULL,
+          float_flag_invalid);
+#undef float_val
+#undef make_float
+#undef CHECK
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/softfloat/fallback", test_fallback);
+    g_test_add_func("/softfloat/special/float32", test_special_f32);
+    g_test_add_func("/softfloat/special/float64", test_special_f64);
+    g_test_add_func("/softfloat/random/float32", test_random_f32);
+    g_test_add_func("/softfloat/random/float64", test_random_f64);
+    return g_test_run();
+}
@@ -626,6 +626,43 @@ static void test_groups(void)
     g_assert(bdrv3->throttle_state == NULL);
 }
 
+static void test_group_shares(void)
+{
+    BlockDriverState *bdrv1, *bdrv2;
+    unsigned weight;
+    int64_t latency_target_ns;
+
+    bdrv1 = bdrv_new();
+    bdrv2 = bdrv_new();
+
+    throttle_group_register_bs(bdrv1, "bar");
+    throttle_group_register_bs(bdrv2, "bar");
+
+    /* Members start with the default weight and no latency target */
+    throttle_group_get_share(bdrv1, &weight, &latency_target_ns);
+    g_assert_cmpint(weight, ==, THROTTLE_GROUP_WEIGHT_DEFAULT);
+    g_assert_cmpint(latency_target_ns, ==, 0);
+
+    /* The share is per member, not per group */
+    throttle_group_set_share(bdrv1, 300, 5 * SCALE_MS);
+    throttle_group_get_share(bdrv1, &weight, &latency_target_ns);
+    g_assert_cmpint(weight, ==, 300);
+    g_assert_cmpint(latency_target_ns, ==, 5 * SCALE_MS);
+    throttle_group_get_share(bdrv2, &weight, &latency_target_ns);
+    g_assert_cmpint(weight, ==, THROTTLE_GROUP_WEIGHT_DEFAULT);
+    g_assert_cmpint(latency_target_ns, ==, 0);
+
+    /* It is kept when moving to another group */
+    throttle_group_unregister_bs(bdrv1);
+    throttle_group_register_bs(bdrv1, "foo");
+    throttle_group_get_share(bdrv1, &weight, &latency_target_ns);
+    g_assert_cmpint(weight, ==, 300);
+    g_assert_cmpint(latency_target_ns, ==, 5 * SCALE_MS);
+
+    throttle_group_unregister_bs(bdrv1);
+    throttle_group_unregister_bs(bdrv2);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -649,6 +686,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/group_shares",       test_group_shares);
     return g_test_run();
 }
 
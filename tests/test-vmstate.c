@@ -483,6 +483,86 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+typedef struct TestArray {
+    uint8_t  u8[5];
+    uint16_t u16[3];
+    uint32_t u32[2];
+    int32_t  i32[2];
+    uint64_t u64[2];
+} TestArray;
+
+static const VMStateDescription vmstate_array = {
+    .name = "test/array",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArray, 5),
+        VMSTATE_UINT16_ARRAY(u16, TestArray, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArray, 2),
+        VMSTATE_INT32_ARRAY(i32, TestArray, 2),
+        VMSTATE_UINT64_ARRAY(u64, TestArray, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static uint8_t wire_array[] = {
+    1, 2, 3, 4, 5,                                  /* u8 */
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06,             /* u16 */
+    0x00, 0x01, 0x11, 0x70, 0xde, 0xad, 0xbe, 0xef, /* u32 */
+    0xff, 0xfe, 0xee, 0x90, 0x00, 0x00, 0x00, 0x07, /* i32 */
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, /* u64 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0xf4, 0x7c,
+};
+
+static void test_save_array(void)
+{
+    QEMUFile *fsave = qemu_bufopen("w", NULL);
+    TestArray obj = {
+        .u8 = { 1, 2, 3, 4, 5 },
+        .u16 = { 0x0102, 0x0304, 0x0506 },
+        .u32 = { 70000, 0xdeadbeef },
+        .i32 = { -70000, 7 },
+        .u64 = { 0x0102030405060708ULL, 12121212 },
+    };
+
+    vmstate_save_state(fsave, &vmstate_array, &obj, NULL);
+    g_assert(!qemu_file_get_error(fsave));
+    check_mem_file(fsave, wire_array, sizeof(wire_array));
+    qemu_fclose(fsave);
+}
+
+static void test_load_array(void)
+{
+    QEMUSizedBuffer *qsb = qsb_create(wire_array, sizeof(wire_array));
+    QEMUFile *loading;
+    TestArray obj;
+
+    g_assert(qsb);
+    loading = qemu_bufopen("r", qsb);
+    memset(&obj, 0, sizeof(obj));
+    SUCCESS(vmstate_load_state(loading, &vmstate_array, &obj, 1));
+    g_assert(!qemu_file_get_error(loading));
+    g_assert_cmpint(obj.u8[0], ==, 1);
+    g_assert_cmpint(obj.u8[4], ==, 5);
+    g_assert_cmpint(obj.u16[0], ==, 0x0102);
+    g_assert_cmpint(obj.u16[2], ==, 0x0506);
+    g_assert_cmpint(obj.u32[0], ==, 70000);
+    g_assert_cmpint(obj.u32[1], ==, 0xdeadbeef);
+    g_assert_cmpint(obj.i32[0], ==, -70000);
+    g_assert_cmpint(obj.i32[1], ==, 7);
+    g_assert_cmpint(obj.u64[0], ==, 0x0102030405060708ULL);
+    g_assert_cmpint(obj.u64[1], ==, 12121212);
+    qemu_fclose(loading);
+    qsb_free(qsb);
+
+    /* A truncated array must fail */
+    qsb = qsb_create(wire_array, sizeof(wire_array) - 3);
+    loading = qemu_bufopen("r", qsb);
+    FAILURE(vmstate_load_state(loading, &vmstate_array, &obj, 1));
+    qemu_fclose(loading);
+    qsb_free(qsb);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -495,6 +575,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/array/save", test_save_array);
+    g_test_add_func("/vmstate/array/load", test_load_array);
     g_test_run();
 
     close(temp_fd);
@@ -173,6 +173,114 @@ static void test_encode_decode(void)
     }
 }
 
+#define NR_PAGES 64
+
+/* Fill @old_page and @new_page with pages that differ in @nr_runs runs */
+static void make_page_pair(uint8_t *old_page, uint8_t *new_page, int nr_runs)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_page[i] = g_test_rand_int();
+    }
+    memcpy(new_page, old_page, PAGE_SIZE);
+
+    for (i = 0; i < nr_runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, 80);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new_page[j] = old_page[j] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/* All implementations of the encoder must produce the same output */
+static void test_encode_accel(void)
+{
+    uint8_t *old_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int ref_len[NR_PAGES];
+    bool first = true;
+    int i, dlen, rc;
+
+    for (i = 0; i < NR_PAGES; i++) {
+        make_page_pair(old_pages + i * PAGE_SIZE, new_pages + i * PAGE_SIZE,
+                       i);
+    }
+
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            uint8_t *old_page = old_pages + i * PAGE_SIZE;
+            uint8_t *new_page = new_pages + i * PAGE_SIZE;
+
+            dlen = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                        compressed, PAGE_SIZE);
+            if (first) {
+                ref_len[i] = dlen;
+                if (dlen > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, dlen);
+                }
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                g_assert(dlen <= 0 ||
+                         memcmp(ref + i * PAGE_SIZE, compressed, dlen) == 0);
+            }
+
+            if (dlen > 0) {
+                memcpy(test, old_page, PAGE_SIZE);
+                rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+                g_assert(rc <= PAGE_SIZE);
+                g_assert(memcmp(test, new_page, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_next_accel());
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(ref);
+    g_free(compressed);
+    g_free(test);
+}
+
+/* Encoding throughput of each implementation, the portable one is last */
+static void perf_encode(void)
+{
+    uint8_t *old_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    const int iterations = 20000;
+    int i, j, variant = 0;
+    double duration;
+
+    for (i = 0; i < NR_PAGES; i++) {
+        make_page_pair(old_pages + i * PAGE_SIZE, new_pages + i * PAGE_SIZE,
+                       i % 8);
+    }
+
+    do {
+        g_test_timer_start();
+        for (j = 0; j < iterations; j++) {
+            for (i = 0; i < NR_PAGES; i++) {
+                xbzrle_encode_buffer(old_pages + i * PAGE_SIZE,
+                                     new_pages + i * PAGE_SIZE, PAGE_SIZE,
+                                     compressed, PAGE_SIZE);
+            }
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("Encoder variant %d: %f MB/s\n", variant++,
+                       (double)iterations * NR_PAGES * PAGE_SIZE /
+                       duration / (1024 * 1024));
+    } while (test_xbzrle_next_accel());
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +293,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", perf_encode);
+    }
 
     return g_test_run();
 }
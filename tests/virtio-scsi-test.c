@@ -12,6 +12,7 @@
 #include <glib.h>
 #include "libqtest.h"
 #include "block/scsi.h"
+#include "qemu/bswap.h"
 #include "libqos/virtio.h"
 #include "libqos/virtio-pci.h"
 #include "libqos/pci-pc.h"
@@ -259,6 +260,51 @@ static void test_unaligned_write_same(void)
     qvirtio_scsi_stop();
 }
 
+static void unmap_add_desc(uint8_t *param, int i, uint64_t lba,
+                           uint32_t nb_blocks)
+{
+    stq_be_p(&param[8 + i * 16], lba);
+    stl_be_p(&param[8 + i * 16 + 8], nb_blocks);
+}
+
+/* Test UNMAP with overlapping, adjacent and out of range descriptors */
+static void test_unmap(void)
+{
+    QVirtIOSCSI *vs;
+    QVirtIOSCSICmdResp resp;
+    uint8_t param[8 + 4 * 16] = { 0 };
+    const uint8_t unmap_cdb[CDB_SIZE] = { 0x42, 0x00, 0x00, 0x00, 0x00,
+                                          0x00, 0x00, 0x00, sizeof(param),
+                                          0x00 };
+
+    qvirtio_scsi_start("-drive file=null-co://,if=none,id=dr1,format=raw "
+                       "-device scsi-disk,drive=dr1,lun=0,scsi-id=1");
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+
+    stw_be_p(&param[0], sizeof(param) - 2);
+    stw_be_p(&param[2], sizeof(param) - 8);
+    unmap_add_desc(param, 0, 4096, 256);
+    unmap_add_desc(param, 1, 0, 128);
+    unmap_add_desc(param, 2, 128, 64);
+    unmap_add_desc(param, 3, 4200, 1024);
+    g_assert_cmphex(0, ==,
+        virtio_scsi_do_command(vs, unmap_cdb, NULL, 0, param, sizeof(param),
+                               &resp));
+    g_assert_cmpint(resp.status, ==, GOOD);
+
+    /* one bad descriptor fails the whole command */
+    unmap_add_desc(param, 2, 0x7fffffff, 8);
+    g_assert_cmphex(0, ==,
+        virtio_scsi_do_command(vs, unmap_cdb, NULL, 0, param, sizeof(param),
+                               &resp));
+    g_assert_cmpint(resp.status, ==, CHECK_CONDITION);
+    g_assert_cmpint(resp.sense[2], ==, ILLEGAL_REQUEST);
+    g_assert_cmpint(resp.sense[12], ==, 0x21); /* LBA OUT OF RANGE */
+
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -268,6 +314,7 @@ int main(int argc, char **argv)
     qtest_add_func("/virtio/scsi/pci/hotplug", hotplug);
     qtest_add_func("/virtio/scsi/pci/scsi-disk/unaligned-write-same",
                    test_unaligned_write_same);
+    qtest_add_func("/virtio/scsi/pci/scsi-disk/unmap", test_unmap);
 
     ret = g_test_run();
 
@@ -49,6 +49,9 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Pushed without the lock, see thread_pool_submit_aio().  */
+    QSLIST_ENTRY(ThreadPoolElement) submit;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -59,14 +62,22 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* Requests are pushed here by the submitting thread without taking
+     * lock; workers move them to request_list in submission order.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) submit_list;
+
+    /* The following variables are protected by lock.  cur_threads and
+     * idle_threads are also read without it when submitting requests.
+     */
+    QTAILQ_HEAD(ThreadPoolElementHead, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
@@ -74,6 +85,36 @@ struct ThreadPool {
     bool stopping;
 };
 
+/* Move lock-free submissions to the tail of request_list.  Runs with
+ * lock taken.
+ */
+static void thread_pool_take_submitted(ThreadPool *pool)
+{
+    QSLIST_HEAD(, ThreadPoolElement) submitted;
+    ThreadPoolElement *req, *last;
+
+    QSLIST_MOVE_ATOMIC(&submitted, &pool->submit_list);
+
+    /* The list is newest first, inserting each one right after the old
+     * tail puts them back in submission order.
+     */
+    last = QTAILQ_LAST(&pool->request_list, ThreadPoolElementHead);
+    while ((req = QSLIST_FIRST(&submitted))) {
+        QSLIST_REMOVE_HEAD(&submitted, submit);
+        if (last) {
+            QTAILQ_INSERT_AFTER(&pool->request_list, last, req, reqs);
+        } else {
+            QTAILQ_INSERT_HEAD(&pool->request_list, req, reqs);
+        }
+    }
+}
+
+static bool thread_pool_has_requests(ThreadPool *pool)
+{
+    return !QTAILQ_EMPTY(&pool->request_list) ||
+           atomic_read(&pool->submit_list.slh_first) != NULL;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -87,16 +128,22 @@ static void *worker_thread(void *opaque)
         int ret;
 
         do {
-            pool->idle_threads++;
+            atomic_inc(&pool->idle_threads);
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+            /* Pairs with the barrier in QSLIST_INSERT_HEAD_ATOMIC: either
+             * the submitter sees fewer idle threads and spawns one, or we
+             * see its request and keep running.
+             */
+            atomic_dec(&pool->idle_threads);
+        } while (ret == -1 && (thread_pool_has_requests(pool) ||
+                               pool->cur_threads <= pool->min_threads));
         if (ret == -1 || pool->stopping) {
             break;
         }
 
+        thread_pool_take_submitted(pool);
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
@@ -114,7 +161,7 @@ static void *worker_thread(void *opaque)
         qemu_bh_schedule(pool->completion_bh);
     }
 
-    pool->cur_threads--;
+    atomic_dec(&pool->cur_threads);
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
     return NULL;
@@ -146,7 +193,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    atomic_inc(&pool->cur_threads);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -201,6 +248,7 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
+    thread_pool_take_submitted(pool);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -247,12 +295,17 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->submit_list, req, submit);
+
+    /* Only take the lock when it looks like a new worker is needed */
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        atomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -285,6 +338,23 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    qemu_mutex_lock(&pool->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+
+    /* Start the minimum number of workers right away.  Workers beyond a
+     * lowered maximum leave once they run out of work.
+     */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+
+    qemu_mutex_unlock(&pool->lock);
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -297,11 +367,13 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->submit_list);
     QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -318,6 +390,7 @@ void thread_pool_free(ThreadPool *pool)
     }
 
     assert(QLIST_EMPTY(&pool->head));
+    assert(QSLIST_EMPTY(&pool->submit_list));
 
     qemu_mutex_lock(&pool->lock);
 
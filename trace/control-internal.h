@@ -15,6 +15,9 @@
 extern TraceEvent trace_events[];
 extern bool trace_events_dstate[];
 extern int trace_events_enabled_count;
+extern bool trace_events_limited[];
+
+bool trace_event_sample_slow(TraceEventID id);
 
 
 static inline TraceEventID trace_event_count(void)
@@ -72,4 +75,9 @@ static inline void trace_event_set_state_dynamic(TraceEvent *ev, bool state)
     trace_events_dstate[id] = state;
 }
 
+static inline bool trace_event_sample(TraceEventID id)
+{
+    return likely(!trace_events_limited[id]) || trace_event_sample_slow(id);
+}
+
 #endif  /* TRACE__CONTROL_INTERNAL_H */
@@ -19,10 +19,76 @@
 #include "qemu/log.h"
 #endif
 #include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 
 int trace_events_enabled_count;
 bool trace_events_dstate[TRACE_EVENT_COUNT];
 
+/*
+ * Sampling and rate limits.  The counters are updated without locking by
+ * all threads that hit the event; an occasional extra or missing record
+ * around a change of the one second window is harmless.
+ */
+typedef struct TraceEventLimit {
+    uint32_t sample;            /* record 1 in @sample occurrences */
+    uint32_t rate;              /* records per second, 0 for no limit */
+    uint32_t count;             /* occurrences seen */
+    uint32_t window_count;      /* records in the current window */
+    int64_t window_start;       /* in nanoseconds */
+} TraceEventLimit;
+
+bool trace_events_limited[TRACE_EVENT_COUNT];
+static TraceEventLimit trace_events_limit[TRACE_EVENT_COUNT];
+
+void trace_event_set_limits(TraceEvent *ev, uint32_t sample, uint32_t rate)
+{
+    TraceEventID id = trace_event_get_id(ev);
+    TraceEventLimit *l = &trace_events_limit[id];
+
+    atomic_set(&trace_events_limited[id], false);
+    smp_mb();
+    l->sample = sample > 1 ? sample : 0;
+    l->rate = rate;
+    l->count = 0;
+    l->window_count = 0;
+    l->window_start = 0;
+    smp_wmb();
+    atomic_set(&trace_events_limited[id], l->sample || l->rate);
+}
+
+void trace_event_get_limits(TraceEvent *ev, uint32_t *sample, uint32_t *rate)
+{
+    TraceEventLimit *l = &trace_events_limit[trace_event_get_id(ev)];
+
+    *sample = l->sample;
+    *rate = l->rate;
+}
+
+bool trace_event_sample_slow(TraceEventID id)
+{
+    TraceEventLimit *l = &trace_events_limit[id];
+
+    smp_rmb();
+    if (l->sample && atomic_fetch_inc(&l->count) % l->sample) {
+        return false;
+    }
+
+    if (l->rate) {
+        int64_t now = get_clock();
+        int64_t start = atomic_read(&l->window_start);
+
+        if (now - start >= NANOSECONDS_PER_SECOND &&
+            atomic_cmpxchg(&l->window_start, start, now) == start) {
+            atomic_set(&l->window_count, 0);
+        }
+        if (atomic_fetch_inc(&l->window_count) >= l->rate) {
+            return false;
+        }
+    }
+    return true;
+}
+
 TraceEvent *trace_event_name(const char *name)
 {
     assert(name != NULL);
@@ -127,6 +193,20 @@ static void do_trace_enable_events(const char *line_buf)
     }
 }
 
+void trace_limit_events(const char *pattern, uint32_t sample, uint32_t rate)
+{
+    TraceEvent *ev = NULL;
+    bool found = false;
+
+    while ((ev = trace_event_pattern(pattern, ev)) != NULL) {
+        trace_event_set_limits(ev, sample, rate);
+        found = true;
+    }
+    if (!found && !trace_event_is_pattern(pattern)) {
+        error_report("WARNING: trace event '%s' does not exist", pattern);
+    }
+}
+
 void trace_enable_events(const char *line_buf)
 {
     if (is_help_option(line_buf)) {
@@ -147,6 +147,34 @@ static bool trace_event_get_state_dynamic(TraceEvent *ev);
  */
 static void trace_event_set_state_dynamic(TraceEvent *ev, bool state);
 
+/**
+ * trace_event_set_limits:
+ * @ev: Event.
+ * @sample: Record one in @sample occurrences; 0 or 1 records all of them.
+ * @rate: Record at most @rate occurrences per second; 0 means no limit.
+ *
+ * Limit the number of records produced by an enabled event.
+ */
+void trace_event_set_limits(TraceEvent *ev, uint32_t sample, uint32_t rate);
+
+/**
+ * trace_event_get_limits:
+ *
+ * Get the limits set with trace_event_set_limits().
+ */
+void trace_event_get_limits(TraceEvent *ev, uint32_t *sample, uint32_t *rate);
+
+/**
+ * trace_event_sample:
+ * @id: Event identifier.
+ *
+ * Apply the limits of an enabled event to one of its occurrences.  This is
+ * a single load for events without limits.
+ *
+ * Returns: Whether the occurrence must be recorded.
+ */
+static bool trace_event_sample(TraceEventID id);
+
 
 
 /**
@@ -198,6 +226,16 @@ void trace_list_events(void);
  */
 void trace_enable_events(const char *line_buf);
 
+/**
+ * trace_limit_events:
+ * @pattern: A glob pattern of events.
+ * @sample: See trace_event_set_limits().
+ * @rate: See trace_event_set_limits().
+ *
+ * Set the sampling rate and rate limit of matching events.
+ */
+void trace_limit_events(const char *pattern, uint32_t sample, uint32_t rate);
+
 
 #include "trace/control-internal.h"
 
@@ -31,6 +31,7 @@ TraceEventInfoList *qmp_trace_event_get_state(const char *name, Error **errp)
         } else {
             elem->value->state = TRACE_EVENT_STATE_ENABLED;
         }
+        trace_event_get_limits(ev, &elem->value->sample, &elem->value->rate);
         elem->next = events;
         events = elem;
         found = true;
@@ -45,7 +46,9 @@ TraceEventInfoList *qmp_trace_event_get_state(const char *name, Error **errp)
 
 void qmp_trace_event_set_state(const char *name, bool enable,
                                bool has_ignore_unavailable,
-                               bool ignore_unavailable, Error **errp)
+                               bool ignore_unavailable,
+                               bool has_sample, uint32_t sample,
+                               bool has_rate, uint32_t rate, Error **errp)
 {
     bool found = false;
     TraceEvent *ev;
@@ -70,6 +73,13 @@ void qmp_trace_event_set_state(const char *name, bool enable,
     ev = NULL;
     while ((ev = trace_event_pattern(name, ev)) != NULL) {
         if (trace_event_get_state_static(ev)) {
+            if (has_sample || has_rate) {
+                uint32_t cur_sample, cur_rate;
+
+                trace_event_get_limits(ev, &cur_sample, &cur_rate);
+                trace_event_set_limits(ev, has_sample ? sample : cur_sample,
+                                       has_rate ? rate : cur_rate);
+            }
             trace_event_set_state_dynamic(ev, enable);
         }
     }
@@ -44,14 +44,37 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Each thread that emits events records them in a buffer of its own, so
+ * that vCPU threads and IOThreads do not contend on the reservation index
+ * and on the cache lines of a shared buffer.  The writeout thread merges
+ * the buffers by timestamp.  A buffer is only ever written by one thread at
+ * a time; it goes back to the pool when its thread exits and is never
+ * freed, so the writeout thread can walk the list without locking.
+ */
+struct TraceThreadBuffer {
+    uint8_t buf[TRACE_BUF_LEN];
+    volatile gint trace_idx;        /* reservation index */
+    volatile gint writeout_idx;     /* advanced by the writeout thread */
+    volatile gint dropped_events;
+    volatile gint in_use;           /* owned by a live thread */
+    TraceThreadBuffer *next;
+};
+
+static TraceThreadBuffer *trace_buffers;
+static __thread TraceThreadBuffer *thread_buffer;
+#ifndef _WIN32
+static pthread_key_t thread_buffer_key;
+#endif
+
+/* Events dropped because no buffer could be allocated */
 static volatile gint dropped_events;
+static uint64_t dropped_events_total;
+
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -72,34 +95,65 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void clear_buffer_range(TraceThreadBuffer *tb, unsigned int idx,
+                               size_t len)
 {
     uint32_t num = 0;
     while (num < len) {
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = 0;
+        tb->buf[idx++] = 0;
         num++;
     }
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Peek at the next trace record of a thread buffer
  *
- * @idx         Trace buffer index
+ * @tb          Thread buffer
+ * @timestamp   Filled with the timestamp of the record
+ *
+ * Returns false if the next record is not valid yet.
+ */
+static bool peek_trace_record(TraceThreadBuffer *tb, uint64_t *timestamp)
+{
+    unsigned int idx = (unsigned int)g_atomic_int_get(&tb->writeout_idx) %
+                       TRACE_BUF_LEN;
+    TraceRecord record;
+
+    read_from_buffer(tb, idx, &record, sizeof(record.event));
+    if (!(record.event & TRACE_RECORD_VALID)) {
+        return false;
+    }
+
+    smp_rmb(); /* read memory barrier before accessing record */
+    read_from_buffer(tb, idx, &record, sizeof(TraceRecord));
+    *timestamp = record.timestamp_ns;
+    return true;
+}
+
+/**
+ * Read a trace record from a thread buffer
+ *
+ * @tb          Thread buffer
  * @record      Trace record to fill
  *
  * Returns false if the record is not valid.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool get_trace_record(TraceThreadBuffer *tb, TraceRecord **recordptr)
 {
+    unsigned int writeout_idx = g_atomic_int_get(&tb->writeout_idx);
+    unsigned int idx = writeout_idx % TRACE_BUF_LEN;
     uint64_t event_flag = 0;
     TraceRecord record;
     /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    read_from_buffer(tb, idx, &record, sizeof(event_flag));
 
     if (!(record.event & TRACE_RECORD_VALID)) {
         return false;
@@ -107,20 +161,63 @@ static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
 
     smp_rmb(); /* read memory barrier before accessing record */
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tb, idx, &record, sizeof(TraceRecord));
     *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
+    read_from_buffer(tb, idx, *recordptr, record.length);
     smp_rmb(); /* memory barrier before clearing valid flag */
     (*recordptr)->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
+    clear_buffer_range(tb, idx, record.length);
+
+    /* hand the space back to the producer */
+    g_atomic_int_set(&tb->writeout_idx, writeout_idx + record.length);
     return true;
 }
 
+/**
+ * Find the thread buffer whose next record is the oldest
+ *
+ * Returns NULL if no buffer has a valid record.
+ */
+static TraceThreadBuffer *next_trace_buffer(void)
+{
+    TraceThreadBuffer *tb, *oldest = NULL;
+    uint64_t timestamp, oldest_timestamp = 0;
+
+    for (tb = g_atomic_pointer_get(&trace_buffers); tb; tb = tb->next) {
+        if (peek_trace_record(tb, &timestamp) &&
+            (!oldest || timestamp < oldest_timestamp)) {
+            oldest = tb;
+            oldest_timestamp = timestamp;
+        }
+    }
+    return oldest;
+}
+
+/* Collect and reset the drop counters of all buffers */
+static unsigned int take_dropped_events(void)
+{
+    TraceThreadBuffer *tb;
+    unsigned int count = 0;
+    int n;
+
+    for (tb = g_atomic_pointer_get(&trace_buffers); tb; tb = tb->next) {
+        do {
+            n = g_atomic_int_get(&tb->dropped_events);
+        } while (!g_atomic_int_compare_and_exchange(&tb->dropped_events,
+                                                    n, 0));
+        count += n;
+    }
+    do {
+        n = g_atomic_int_get(&dropped_events);
+    } while (!g_atomic_int_compare_and_exchange(&dropped_events, n, 0));
+    return count + n;
+}
+
 /**
  * Kick writeout thread
  *
@@ -152,36 +249,33 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
+    TraceThreadBuffer *tb;
     TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    unsigned int dropped_count;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
 
-        if (g_atomic_int_get(&dropped_events)) {
+        dropped_count = take_dropped_events();
+        if (dropped_count) {
             dropped.rec.event = DROPPED_EVENT_ID,
             dropped.rec.timestamp_ns = get_clock();
             dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
             dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
             dropped.rec.arguments[0] = dropped_count;
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+            dropped_events_total += dropped_count;
         }
 
-        while (get_trace_record(idx, &recordptr)) {
+        while ((tb = next_trace_buffer()) &&
+               get_trace_record(tb, &recordptr)) {
             unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
             free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
         }
 
         fflush(trace_fp);
@@ -189,52 +283,110 @@ static gpointer writeout_thread(gpointer opaque)
     return NULL;
 }
 
+#ifndef _WIN32
+static void thread_buffer_release(void *opaque)
+{
+    TraceThreadBuffer *tb = opaque;
+
+    /* Records still in the buffer are written out as usual */
+    g_atomic_int_set(&tb->in_use, 0);
+}
+#endif
+
+/* Take a buffer left by an exited thread, or allocate a new one */
+static TraceThreadBuffer *thread_buffer_get(void)
+{
+    TraceThreadBuffer *tb, *head;
+
+    for (tb = g_atomic_pointer_get(&trace_buffers); tb; tb = tb->next) {
+        if (g_atomic_int_compare_and_exchange(&tb->in_use, 0, 1)) {
+            goto out;
+        }
+    }
+
+    tb = calloc(1, sizeof(*tb)); /* dont use g_malloc, can deadlock when traced */
+    if (!tb) {
+        return NULL;
+    }
+    tb->in_use = 1;
+    do {
+        head = g_atomic_pointer_get(&trace_buffers);
+        tb->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&trace_buffers,
+                                                    head, tb));
+
+out:
+#ifndef _WIN32
+    pthread_setspecific(thread_buffer_key, tb);
+#endif
+    thread_buffer = tb;
+    return tb;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
+    TraceThreadBuffer *tb = thread_buffer;
     unsigned int idx, rec_off, old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
+    if (unlikely(!tb)) {
+        tb = thread_buffer_get();
+        if (!tb) {
+            g_atomic_int_inc(&dropped_events);
+            return -ENOSPC;
+        }
+    }
+
+    /* Only a signal handler can race with us here, the compare and
+     * exchange is uncontended otherwise.
+     */
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
+        old_idx = g_atomic_int_get(&tb->trace_idx);
         smp_rmb();
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - (unsigned int)g_atomic_int_get(&tb->writeout_idx) >
+            TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+            g_atomic_int_inc(&tb->dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    } while (!g_atomic_int_compare_and_exchange(&tb->trace_idx,
+                                                old_idx, new_idx));
 
     idx = old_idx % TRACE_BUF_LEN;
 
     rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    rec_off = write_to_buffer(tb, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(tb, rec_off, &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(tb, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(tb, rec_off, &trace_pid, sizeof(trace_pid));
 
+    rec->tbuf = tb;
     rec->tbuf_idx = idx;
     rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -242,11 +394,12 @@ static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tb->buf[idx++];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -254,20 +407,22 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        tb->buf[idx++] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceThreadBuffer *tb = rec->tbuf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
     smp_wmb(); /* write barrier before marking as valid */
     record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    write_to_buffer(tb, rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
+    if (((unsigned int)g_atomic_int_get(&tb->trace_idx) -
+         (unsigned int)g_atomic_int_get(&tb->writeout_idx))
         > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
@@ -338,6 +493,8 @@ void st_print_trace_file_status(FILE *stream, int (*stream_printf)(FILE *stream,
 {
     stream_printf(stream, "Trace file \"%s\" %s.\n",
                   trace_file_name, trace_fp ? "on" : "off");
+    stream_printf(stream, "%" PRIu64 " events dropped.\n",
+                  dropped_events_total);
 }
 
 void st_flush_trace_buffer(void)
@@ -374,6 +531,9 @@ bool st_init(void)
     GThread *thread;
 
     trace_pid = getpid();
+#ifndef _WIN32
+    pthread_key_create(&thread_buffer_key, thread_buffer_release);
+#endif
 
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
@@ -21,7 +21,10 @@ void st_set_trace_file(const char *file);
 bool st_init(void);
 void st_flush_trace_buffer(void);
 
+typedef struct TraceThreadBuffer TraceThreadBuffer;
+
 typedef struct {
+    TraceThreadBuffer *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
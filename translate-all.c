@@ -31,6 +31,7 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #if defined(CONFIG_USER_ONLY)
+#include <sched.h>
 #include "qemu.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/param.h>
@@ -48,6 +49,7 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "qmp-commands.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -75,7 +77,12 @@ typedef struct PageDesc {
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
+    /* once built, the bitmap covers at least the bytes of all TBs in the
+       page: TBs added later set their bits, the bits of invalidated TBs
+       are only cleared when the bitmap is rebuilt */
     unsigned long *code_bitmap;
+    /* TBs invalidated by writes to this page since the last flush */
+    unsigned int smc_invalidate_count;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -118,39 +125,63 @@ intptr_t qemu_host_page_mask;
 static void *l1_map[V_L1_SIZE];
 
 /* code generation context */
-TCGContext tcg_ctx;
+TCGContext tcg_init_ctx;
+__thread TCGContext *tcg_ctx = &tcg_init_ctx;
+
+/* translation blocks and the code buffer, shared by all the contexts */
+TBContext tb_ctx;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
-    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    qemu_mutex_lock(&tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
-    qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
+    qemu_mutex_unlock(&tb_ctx.tb_lock);
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
-        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+        qemu_mutex_unlock(&tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
+}
+
+bool parallel_cpus;
+
+static QemuMutex tcg_atomic_mutex;
+static __thread bool have_tcg_atomic_lock;
+
+void tcg_atomic_lock(void)
+{
+    assert(!have_tcg_atomic_lock);
+    qemu_mutex_lock(&tcg_atomic_mutex);
+    have_tcg_atomic_lock = true;
+}
+
+void tcg_atomic_unlock(void)
+{
+    assert(have_tcg_atomic_lock);
+    have_tcg_atomic_lock = false;
+    qemu_mutex_unlock(&tcg_atomic_mutex);
+}
+
+/* Called when an exception longjmps out of a locked operation.  */
+void tcg_atomic_lock_reset(void)
+{
+    if (have_tcg_atomic_lock) {
+        have_tcg_atomic_lock = false;
+        qemu_mutex_unlock(&tcg_atomic_mutex);
+    }
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -159,7 +190,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void cpu_gen_init(void)
 {
-    tcg_context_init(&tcg_ctx); 
+    tcg_context_init(&tcg_init_ctx);
 }
 
 /* Encode VAL as a signed leb128 sequence at P.
@@ -217,7 +248,7 @@ static target_long decode_sleb128(uint8_t **pp)
 
 static int encode_search(TranslationBlock *tb, uint8_t *block)
 {
-    uint8_t *highwater = tcg_ctx.code_gen_highwater;
+    uint8_t *highwater = tcg_ctx->code_gen_highwater;
     uint8_t *p = block;
     int i, j, n;
 
@@ -230,12 +261,12 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
             if (i == 0) {
                 prev = (j == 0 ? tb->pc : 0);
             } else {
-                prev = tcg_ctx.gen_insn_data[i - 1][j];
+                prev = tcg_ctx->gen_insn_data[i - 1][j];
             }
-            p = encode_sleb128(p, tcg_ctx.gen_insn_data[i][j] - prev);
+            p = encode_sleb128(p, tcg_ctx->gen_insn_data[i][j] - prev);
         }
-        prev = (i == 0 ? 0 : tcg_ctx.gen_insn_end_off[i - 1]);
-        p = encode_sleb128(p, tcg_ctx.gen_insn_end_off[i] - prev);
+        prev = (i == 0 ? 0 : tcg_ctx->gen_insn_end_off[i - 1]);
+        p = encode_sleb128(p, tcg_ctx->gen_insn_end_off[i] - prev);
 
         /* Test for (pending) buffer overflow.  The assumption is that any
            one row beginning below the high water mark cannot overrun
@@ -291,8 +322,8 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     restore_state_to_opc(env, tb, data);
 
 #ifdef CONFIG_PROFILER
-    tcg_ctx.restore_time += profile_getclock() - ti;
-    tcg_ctx.restore_count++;
+    tcg_ctx->restore_time += profile_getclock() - ti;
+    tcg_ctx->restore_count++;
 #endif
     return 0;
 }
@@ -505,7 +536,7 @@ static inline size_t size_code_gen_buffer(size_t tb_size)
     if (tb_size > MAX_CODE_GEN_BUFFER_SIZE) {
         tb_size = MAX_CODE_GEN_BUFFER_SIZE;
     }
-    tcg_ctx.code_gen_buffer_size = tb_size;
+    tcg_ctx->code_gen_buffer_size = tb_size;
     return tb_size;
 }
 
@@ -531,7 +562,7 @@ static inline void *split_cross_256mb(void *buf1, size_t size1)
         buf1 = buf2;
     }
 
-    tcg_ctx.code_gen_buffer_size = size1;
+    tcg_ctx->code_gen_buffer_size = size1;
     return buf1;
 }
 #endif
@@ -594,16 +625,16 @@ static inline void *alloc_code_gen_buffer(void)
     size = full_size - qemu_real_host_page_size;
 
     /* Honor a command-line option limiting the size of the buffer.  */
-    if (size > tcg_ctx.code_gen_buffer_size) {
-        size = (((uintptr_t)buf + tcg_ctx.code_gen_buffer_size)
+    if (size > tcg_ctx->code_gen_buffer_size) {
+        size = (((uintptr_t)buf + tcg_ctx->code_gen_buffer_size)
                 & qemu_real_host_page_mask) - (uintptr_t)buf;
     }
-    tcg_ctx.code_gen_buffer_size = size;
+    tcg_ctx->code_gen_buffer_size = size;
 
 #ifdef __mips__
     if (cross_256mb(buf, size)) {
         buf = split_cross_256mb(buf, size);
-        size = tcg_ctx.code_gen_buffer_size;
+        size = tcg_ctx->code_gen_buffer_size;
     }
 #endif
 
@@ -616,7 +647,7 @@ static inline void *alloc_code_gen_buffer(void)
 #elif defined(_WIN32)
 static inline void *alloc_code_gen_buffer(void)
 {
-    size_t size = tcg_ctx.code_gen_buffer_size;
+    size_t size = tcg_ctx->code_gen_buffer_size;
     void *buf1, *buf2;
 
     /* Perform the allocation in two steps, so that the guard page
@@ -635,7 +666,7 @@ static inline void *alloc_code_gen_buffer(void)
 {
     int flags = MAP_PRIVATE | MAP_ANONYMOUS;
     uintptr_t start = 0;
-    size_t size = tcg_ctx.code_gen_buffer_size;
+    size_t size = tcg_ctx->code_gen_buffer_size;
     void *buf;
 
     /* Constrain the position of the buffer based on the host cpu.
@@ -652,7 +683,7 @@ static inline void *alloc_code_gen_buffer(void)
     flags |= MAP_32BIT;
     /* Cannot expect to map more than 800MB in low memory.  */
     if (size > 800u * 1024 * 1024) {
-        tcg_ctx.code_gen_buffer_size = size = 800u * 1024 * 1024;
+        tcg_ctx->code_gen_buffer_size = size = 800u * 1024 * 1024;
     }
 # elif defined(__sparc__)
     start = 0x40000000ul;
@@ -692,7 +723,7 @@ static inline void *alloc_code_gen_buffer(void)
         default:
             /* Split the original buffer.  Free the smaller half.  */
             buf2 = split_cross_256mb(buf, size);
-            size2 = tcg_ctx.code_gen_buffer_size;
+            size2 = tcg_ctx->code_gen_buffer_size;
             if (buf == buf2) {
                 munmap(buf + size2 + qemu_real_host_page_size, size - size2);
             } else {
@@ -718,9 +749,9 @@ static inline void *alloc_code_gen_buffer(void)
 
 static inline void code_gen_alloc(size_t tb_size)
 {
-    tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
-    tcg_ctx.code_gen_buffer = alloc_code_gen_buffer();
-    if (tcg_ctx.code_gen_buffer == NULL) {
+    tcg_ctx->code_gen_buffer_size = size_code_gen_buffer(tb_size);
+    tcg_ctx->code_gen_buffer = alloc_code_gen_buffer();
+    if (tcg_ctx->code_gen_buffer == NULL) {
         fprintf(stderr, "Could not allocate dynamic translator buffer\n");
         exit(1);
     }
@@ -728,11 +759,11 @@ static inline void code_gen_alloc(size_t tb_size)
     /* Estimate a good size for the number of TBs we can support.  We
        still haven't deducted the prologue from the buffer size here,
        but that's minimal and won't affect the estimate much.  */
-    tcg_ctx.code_gen_max_blocks
-        = tcg_ctx.code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs = g_new(TranslationBlock, tcg_ctx.code_gen_max_blocks);
+    tcg_ctx->code_gen_max_blocks
+        = tcg_ctx->code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+    tb_ctx.tbs = g_new(TranslationBlock, tcg_ctx->code_gen_max_blocks);
 
-    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
+    qemu_mutex_init(&tb_ctx.tb_lock);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -743,42 +774,163 @@ void tcg_exec_init(unsigned long tb_size)
     cpu_gen_init();
     page_init();
     code_gen_alloc(tb_size);
+    qht_init(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
+    qemu_mutex_init(&tcg_atomic_mutex);
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
-    tcg_prologue_init(&tcg_ctx);
+    tcg_prologue_init(tcg_ctx);
 #endif
 }
 
 bool tcg_enabled(void)
 {
-    return tcg_ctx.code_gen_buffer != NULL;
+    return tcg_ctx->code_gen_buffer != NULL;
+}
+
+/* Return the region the current context generates code into, or NULL if
+   it has none: it has not translated anything yet, or the region was
+   flushed or handed over to another context meanwhile.  */
+static TBRegion *tb_region_current(void)
+{
+    int i = tcg_ctx->code_gen_region;
+
+    if (i < 0 || tb_ctx.regions[i].owner != tcg_ctx) {
+        return NULL;
+    }
+    return &tb_ctx.regions[i];
+}
+
+static void tb_region_enter(int i)
+{
+    TBRegion *r = &tb_ctx.regions[i];
+
+    r->owner = tcg_ctx;
+    tb_ctx.cur_region = i;
+    tcg_ctx->code_gen_region = i;
+}
+
+/* Find the region the current context should move to next, starting
+   after the one entered last, so that the oldest translations go first.
+   Regions that no other context owns come first; failing that, one can
+   be taken over from an idle owner.  With 'empty', only unowned regions
+   without TBs qualify.  Return -1 if there is none.  */
+static int tb_region_find(bool empty)
+{
+    TBContext *tbc = &tb_ctx;
+    int i, n, idle = -1;
+
+    for (n = 1; n <= tbc->nb_regions; n++) {
+        TBRegion *r;
+
+        i = (tbc->cur_region + n) % tbc->nb_regions;
+        r = &tbc->regions[i];
+        if (r->translating) {
+            continue;
+        }
+        if (empty) {
+            if (!r->owner && r->nb_tbs == 0) {
+                return i;
+            }
+        } else if (!r->owner || r->owner == tcg_ctx) {
+            return i;
+        } else if (idle < 0) {
+            idle = i;
+        }
+    }
+    return idle;
+}
+
+/* Split the code buffer and the TB array into regions, all of them empty.
+   This must not be done before the prologue has been carved out of the
+   code buffer, so the first TB allocation does it rather than
+   tcg_exec_init().  A region that code is being generated into stays
+   with its owner, which notices the flush and starts over.  */
+static void tb_regions_init(void)
+{
+    TBContext *tbc = &tb_ctx;
+    size_t size = tcg_ctx->code_gen_buffer_size;
+    int i, n;
+
+    n = size / CODE_GEN_MIN_REGION_SIZE;
+    n = MAX(1, MIN(n, CODE_GEN_MAX_REGIONS));
+    tbc->nb_regions = n;
+    tbc->region_size = (size / n) & ~(size_t)(CODE_GEN_ALIGN - 1);
+    tbc->region_max_tbs = tcg_ctx->code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &tbc->regions[i];
+
+        r->start = tcg_ctx->code_gen_buffer + i * tbc->region_size;
+        r->end = r->start + tbc->region_size;
+        r->ptr = r->start;
+        r->tbs = tbc->tbs + i * tbc->region_max_tbs;
+        r->nb_tbs = 0;
+        if (!r->translating) {
+            r->owner = NULL;
+        }
+    }
+    /* the last region also gets whatever is left over by the rounding */
+    tbc->regions[n - 1].end = tcg_ctx->code_gen_buffer + size;
+    tbc->nb_tbs = 0;
+    tbc->cur_region = n - 1;
+}
+
+static void *tb_region_code_end(int i)
+{
+    return tb_ctx.regions[i].ptr;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the region of the current context,
+   and point code_gen_ptr at the end of the region's code.  Return NULL if
+   the region has run out of translation blocks, or if the context has no
+   region and none is left empty; the caller then moves on to the next
+   region.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *tbc = &tb_ctx;
     TranslationBlock *tb;
+    TBRegion *r;
+
+    if (unlikely(tbc->nb_regions == 0)) {
+        tb_regions_init();
+    }
+    r = tb_region_current();
+    if (unlikely(!r)) {
+        int i = tb_region_find(true);
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+        if (i < 0) {
+            return NULL;
+        }
+        tb_region_enter(i);
+        r = &tbc->regions[i];
+    }
+    if (r->nb_tbs >= tbc->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tcg_ctx->code_gen_ptr = r->ptr;
+    tcg_ctx->code_gen_highwater = r->end - TCG_HIGHWATER;
+    tb = &r->tbs[r->nb_tbs++];
+    tbc->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = tb_region_current();
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
-        tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+    if (r && r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        tcg_ctx->code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
+        tb_ctx.nb_tbs--;
     }
 }
 
@@ -802,6 +954,7 @@ static void page_flush_tb_1(int level, void **lp)
 
         for (i = 0; i < V_L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
+            pd[i].smc_invalidate_count = 0;
             invalidate_page_bitmap(pd + i);
         }
     } else {
@@ -822,90 +975,242 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(void *data)
 {
+    CPUState *cpu;
+    int tb_flush_req = (int)(uintptr_t)data;
+
+    /* If the flush has already been done on behalf of another vCPU,
+       there is nothing left to do.  */
+    if (tb_ctx.tb_flush_count != tb_flush_req) {
+        return;
+    }
+
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+           (unsigned long)tb_ctx.code_gen_bytes,
+           tb_ctx.nb_tbs, tb_ctx.nb_tbs > 0 ?
+           (unsigned long)tb_ctx.code_gen_bytes /
+           tb_ctx.nb_tbs : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(cpu, "Internal error: code buffer overflow\n");
-    }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
+    tb_ctx.code_gen_bytes = 0;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tb_ctx.tb_flush_count,
+                  tb_ctx.tb_flush_count + 1);
 }
 
-#ifdef DEBUG_TB_CHECK
+/* flush all the translation blocks.  With multi-threaded TCG other
+   vCPUs may still be executing from the code buffer, so the flush is
+   deferred until all of them have left cpu_exec().  In user mode other
+   threads may be translating, so tb_lock is needed.  */
+void tb_flush(CPUState *cpu)
+{
+    int tb_flush_req = atomic_mb_read(&tb_ctx.tb_flush_count);
 
-static void tb_invalidate_check(target_ulong address)
+    if ((unsigned long)(tcg_ctx->code_gen_ptr - tcg_ctx->code_gen_buffer)
+        > tcg_ctx->code_gen_buffer_size) {
+        cpu_abort(cpu, "Internal error: code buffer overflow\n");
+    }
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        async_safe_run_on_cpu(cpu, do_tb_flush,
+                              (void *)(uintptr_t)tb_flush_req);
+        return;
+    }
+    do_tb_flush((void *)(uintptr_t)tb_flush_req);
+#else
+    tb_lock();
+    do_tb_flush((void *)(uintptr_t)tb_flush_req);
+    tb_unlock();
+#endif
+}
+
+static int tb_region_index(TBRegion *r)
 {
-    TranslationBlock *tb;
-    int i;
+    return r ? r - tb_ctx.regions : -1;
+}
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+/* Move the current context from region 'data', which must still be its
+   current one (-1 for none), to the region tb_region_find() picks.  That
+   holds the oldest translations; only its TBs are invalidated.  If every
+   region is being translated into, the context stays where it is.  */
+static void do_tb_region_evict(void *data)
+{
+    TBContext *tbc = &tb_ctx;
+    int req = (int)(intptr_t)data;
+    TBRegion *r;
+    int i, next;
+
+    /* Another vCPU may already have moved on to a new region.  */
+    if (tb_region_index(tb_region_current()) != req) {
+        return;
+    }
+
+    next = tb_region_find(false);
+    if (next < 0) {
+        return;
+    }
+    if (req >= 0) {
+        tbc->regions[req].owner = NULL;
+    }
+    r = &tbc->regions[next];
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        /* TBs whose code was overwritten are already invalid */
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
         }
     }
+    tbc->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+    tb_region_enter(next);
+    tbc->tb_region_evict_count++;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* The current region is full.  Like tb_flush(), the eviction must be
+   deferred in multi-threaded mode because other vCPUs may be executing
+   code that lives in the evicted region.  */
+static void tb_region_full(CPUState *cpu)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+    int req = tb_region_index(tb_region_current());
+
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        async_safe_run_on_cpu(cpu, do_tb_region_evict,
+                              (void *)(intptr_t)req);
+        return;
+    }
+#endif
+    do_tb_region_evict((void *)(intptr_t)req);
+}
+
+#ifdef CONFIG_USER_ONLY
+/* Give the calling thread a translation context of its own, so that it
+   can generate code while other threads do the same; see tb_gen_code().
+   The context is a copy of tcg_init_ctx, which already holds the TCG
+   globals of the frontend, and gets a region of the code buffer on its
+   first TB allocation.  */
+void tcg_register_thread(void)
+{
+    TCGContext *s = g_new(TCGContext, 1);
+    int i;
+
+    *s = tcg_init_ctx;
+    /* the globals' memory bases point into tcg_init_ctx */
+    for (i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+
+        if (ts->mem_base) {
+            ts->mem_base = &s->temps[ts->mem_base - tcg_init_ctx.temps];
         }
     }
+    if (s->frame_temp) {
+        s->frame_temp = &s->temps[s->frame_temp - tcg_init_ctx.temps];
+    }
+    s->pool_cur = s->pool_end = NULL;
+    s->pool_first = s->pool_current = s->pool_first_large = NULL;
+    s->helper_call_count = 0;
+    s->code_gen_region = -1;
+    tcg_ctx = s;
 }
 
-#endif
+/* Drop the context of an exiting thread, and let other threads have its
+   region.  */
+void tcg_unregister_thread(void)
+{
+    TCGContext *s = tcg_ctx;
+    TCGPool *p, *next;
+    TBRegion *r;
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+    if (s == &tcg_init_ctx) {
+        return;
+    }
+    tb_lock();
+    r = tb_region_current();
+    if (r) {
+        r->owner = NULL;
+        r->translating = false;
+    }
+    tb_unlock();
+    tcg_ctx = &tcg_init_ctx;
+    tcg_pool_reset(s);
+    for (p = s->pool_first; p; p = next) {
+        next = p->next;
+        g_free(p);
+    }
+    g_free(s);
+}
+
+/* Only the calling thread is left in the child of fork(); the regions of
+   the other threads' contexts are free again.  */
+void tcg_fork_child(void)
 {
-    TranslationBlock *tb1;
+    int i;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
+    for (i = 0; i < tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tb_ctx.regions[i];
+
+        if (r->owner != tcg_ctx) {
+            r->owner = NULL;
+            r->translating = false;
         }
-        ptb = &tb1->phys_hash_next;
     }
 }
+#endif
+
+#ifdef DEBUG_TB_CHECK
+
+static void
+do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
+
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
+    }
+}
+
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void
+do_tb_page_check(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
+    }
+}
+
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
@@ -965,34 +1270,41 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int n1;
+    uint32_t h;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
+    /* remove the TB from the hash table; lock-free lookups that already
+       found it check tb->invalid before chaining to it */
+    atomic_set(&tb->invalid, true);
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_remove(&tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        if (!p->first_tb) {
+            invalidate_page_bitmap(p);
+        }
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        if (!p->first_tb) {
+            invalidate_page_bitmap(p);
+        }
     }
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+    tb_ctx.tb_invalidated_flag = 1;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1015,49 +1327,73 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
-    tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
+    tb_ctx.tb_phys_invalidate_count++;
+}
+
+/* Mark the bytes of the n-th page of tb in the code bitmap of that page.  */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
 }
 
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    if (p->code_bitmap) {
+        bitmap_zero(p->code_bitmap, TARGET_PAGE_SIZE);
+    } else {
+        p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
 
-/* Called with mmap_lock held for user mode emulation.  */
+/* Called with mmap_lock held for reading or writing for user mode
+   emulation.  In user mode every thread has a translation context and a
+   region of its own, so if the caller holds tb_lock, it is dropped while
+   the code is generated.  Another thread may then translate the same
+   block meanwhile, in which case its TB is returned.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
 {
     CPUArchState *env = cpu->env_ptr;
     TranslationBlock *tb;
+    TBRegion *r;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int64_t gen_start;
+#ifdef CONFIG_USER_ONLY
+    /* single use TBs are not looked up, so there is no point */
+    bool parallel = have_tb_lock && !(cflags & CF_NOCACHE);
+    TranslationBlock *existing;
+    int flush_count = 0;
+#endif
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1067,31 +1403,62 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         cflags |= CF_USE_ICOUNT;
     }
 
+#ifdef CONFIG_USER_ONLY
+ restart:
+#endif
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* move on to the next region, evicting its TBs */
+        tb_region_full(cpu);
+#ifndef CONFIG_USER_ONLY
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction only happens once every vCPU has left the
+               code buffer; leave cpu_exec() so that it can run.  */
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
+#else
+        tb = tb_alloc(pc);
+        while (unlikely(!tb)) {
+            /* other threads are translating into all the other regions;
+               wait for one of them to be done */
+            tb_unlock();
+            sched_yield();
+            tb_lock();
+            tb_region_full(cpu);
+            tb = tb_alloc(pc);
+        }
+#endif
         /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+        tb_ctx.tb_invalidated_flag = 1;
     }
+    r = tb_region_current();
 
-    gen_code_buf = tcg_ctx.code_gen_ptr;
+    gen_code_buf = tcg_ctx->code_gen_ptr;
     tb->tc_ptr = gen_code_buf;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
 
+#ifdef CONFIG_USER_ONLY
+    if (parallel) {
+        r->translating = true;
+        flush_count = tb_ctx.tb_flush_count;
+        tb_unlock();
+    }
+#endif
+
+    gen_start = get_clock();
 #ifdef CONFIG_PROFILER
-    tcg_ctx.tb_count1++; /* includes aborted translations because of
+    tcg_ctx->tb_count1++; /* includes aborted translations because of
                        exceptions */
     ti = profile_getclock();
 #endif
 
-    tcg_func_start(&tcg_ctx);
+    tcg_func_start(tcg_ctx);
 
     gen_intermediate_code(env, tb);
 
@@ -1100,19 +1467,19 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     /* generate machine code */
     tb->tb_next_offset[0] = 0xffff;
     tb->tb_next_offset[1] = 0xffff;
-    tcg_ctx.tb_next_offset = tb->tb_next_offset;
+    tcg_ctx->tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
-    tcg_ctx.tb_jmp_offset = tb->tb_jmp_offset;
-    tcg_ctx.tb_next = NULL;
+    tcg_ctx->tb_jmp_offset = tb->tb_jmp_offset;
+    tcg_ctx->tb_next = NULL;
 #else
-    tcg_ctx.tb_jmp_offset = NULL;
-    tcg_ctx.tb_next = tb->tb_next;
+    tcg_ctx->tb_jmp_offset = NULL;
+    tcg_ctx->tb_next = tb->tb_next;
 #endif
 
 #ifdef CONFIG_PROFILER
-    tcg_ctx.tb_count++;
-    tcg_ctx.interm_time += profile_getclock() - ti;
-    tcg_ctx.code_time -= profile_getclock();
+    tcg_ctx->tb_count++;
+    tcg_ctx->interm_time += profile_getclock() - ti;
+    tcg_ctx->code_time -= profile_getclock();
 #endif
 
     /* ??? Overflow could be handled better here.  In particular, we
@@ -1120,20 +1487,37 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
        the tcg optimization currently hidden inside tcg_gen_code.  All
        that should be required is to flush the TBs, allocate a new TB,
        re-initialize it per above, and re-do the actual code generation.  */
-    gen_code_size = tcg_gen_code(&tcg_ctx, gen_code_buf);
-    if (unlikely(gen_code_size < 0)) {
-        goto buffer_overflow;
+    gen_code_size = tcg_gen_code(tcg_ctx, gen_code_buf);
+    search_size = -1;
+    if (likely(gen_code_size >= 0)) {
+        search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
     }
-    search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
-    if (unlikely(search_size < 0)) {
+
+#ifdef CONFIG_USER_ONLY
+    if (parallel) {
+        tb_lock();
+        r->translating = false;
+        if (unlikely(tb_ctx.tb_flush_count != flush_count)) {
+            /* the flush took 'tb' along; the region is still ours */
+            goto restart;
+        }
+        existing = tb_htable_lookup(cpu, pc, cs_base, flags);
+        if (unlikely(existing)) {
+            tb_free(tb);
+            return existing;
+        }
+    }
+#endif
+    if (unlikely(gen_code_size < 0 || search_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
 
 #ifdef CONFIG_PROFILER
-    tcg_ctx.code_time += profile_getclock();
-    tcg_ctx.code_in_len += tb->size;
-    tcg_ctx.code_out_len += gen_code_size;
-    tcg_ctx.search_out_len += search_size;
+    tcg_ctx->code_time += profile_getclock();
+    tcg_ctx->code_in_len += tb->size;
+    tcg_ctx->code_out_len += gen_code_size;
+    tcg_ctx->search_out_len += search_size;
 #endif
 
 #ifdef DEBUG_DISAS
@@ -1145,9 +1529,15 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
-    tcg_ctx.code_gen_ptr = (void *)
+    tcg_ctx->code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
+    r->ptr = tcg_ctx->code_gen_ptr;
+    tb_ctx.code_gen_bytes += gen_code_size + search_size;
+    tb_ctx.helper_call_count += tcg_ctx->helper_call_count;
+    tcg_ctx->helper_call_count = 0;
+    tb_ctx.tb_gen_count++;
+    tb_ctx.tb_gen_time += get_clock() - gen_start;
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1196,7 +1586,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
     tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
-    int n;
+    int n, invalidated = 0;
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -1272,14 +1662,21 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                     cpu_interrupt(cpu, cpu->interrupt_request);
                 }
             }
+            invalidated++;
         }
         tb = tb_next;
     }
+    p->smc_invalidate_count += invalidated;
+    tb_ctx.smc_invalidate_count += invalidated;
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
         invalidate_page_bitmap(p);
         tlb_unprotect_code(start);
+    } else if (p->code_bitmap && invalidated) {
+        /* drop the bytes of the TBs just invalidated, the list of
+           remaining TBs has just been walked anyway */
+        build_page_bitmap(p);
     }
 #endif
 #ifdef TARGET_HAS_PRECISE_SMC
@@ -1312,6 +1709,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
+    tb_ctx.smc_write_count++;
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
         /* build code bitmap */
@@ -1326,6 +1724,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
         if (b & ((1 << len) - 1)) {
             goto do_invalidate;
         }
+        tb_ctx.smc_write_skip_count++;
     } else {
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
@@ -1356,6 +1755,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
     if (!p) {
         return;
     }
+    tb_ctx.smc_write_count++;
     tb = p->first_tb;
 #ifdef TARGET_HAS_PRECISE_SMC
     if (tb && pc != 0) {
@@ -1384,6 +1784,8 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         }
 #endif /* TARGET_HAS_PRECISE_SMC */
         tb_phys_invalidate(tb, addr);
+        p->smc_invalidate_count++;
+        tb_ctx.smc_invalidate_count++;
         tb = tb->page_next[n];
     }
     p->first_tb = NULL;
@@ -1422,7 +1824,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1469,14 +1873,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    uint32_t h;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1498,6 +1895,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last, so that lock-free lookups only ever
+       see fully initialized TBs */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tb_ctx.htable, tb, h);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1507,23 +1909,32 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *tbc = &tb_ctx;
+    int i, m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tbc->nb_tbs <= 0) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    if (tc_ptr < (uintptr_t)tcg_ctx->code_gen_buffer) {
+        return NULL;
+    }
+    i = (tc_ptr - (uintptr_t)tcg_ctx->code_gen_buffer) / tbc->region_size;
+    if (i >= tbc->nb_regions) {
+        i = tbc->nb_regions - 1;
+    }
+    r = &tbc->regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_code_end(i)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1533,7 +1944,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1552,7 +1963,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1667,66 +2080,205 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+/* Number of bytes of the code buffer that hold generated code */
+static size_t tb_code_gen_size(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tb_ctx.nb_regions; i++) {
+        size += tb_region_code_end(i) - tb_ctx.regions[i].start;
+    }
+    return size;
+}
+
+/* The pages with the most TBs invalidated by writes, for "info jit".  */
+#define SMC_TOP_PAGES 4
+
+typedef struct SMCPageCount {
+    tb_page_addr_t index;
+    unsigned int count;
+} SMCPageCount;
+
+static void page_smc_top_1(SMCPageCount *top, tb_page_addr_t index,
+                           int level, void **lp)
+{
+    int i, j;
+
+    if (*lp == NULL) {
+        return;
+    }
+    if (level == 0) {
+        PageDesc *pd = *lp;
+
+        for (i = 0; i < V_L2_SIZE; ++i) {
+            unsigned int count = pd[i].smc_invalidate_count;
+
+            if (count <= top[SMC_TOP_PAGES - 1].count) {
+                continue;
+            }
+            for (j = SMC_TOP_PAGES - 1; j > 0 && top[j - 1].count < count;
+                 j--) {
+                top[j] = top[j - 1];
+            }
+            top[j].index = (index << V_L2_BITS) | i;
+            top[j].count = count;
+        }
+    } else {
+        void **pp = *lp;
+
+        for (i = 0; i < V_L2_SIZE; ++i) {
+            page_smc_top_1(top, (index << V_L2_BITS) | i, level - 1, pp + i);
+        }
+    }
+}
+
+static void page_smc_top(SMCPageCount *top)
+{
+    int i;
+
+    memset(top, 0, sizeof(*top) * SMC_TOP_PAGES);
+    tb_lock();
+    for (i = 0; i < V_L1_SIZE; i++) {
+        page_smc_top_1(top, i, V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
+    }
+    tb_unlock();
+}
+
+/* The per-vCPU counters are written without synchronization by the
+   thread running each vCPU; the sums are only approximate while they
+   run.  */
+static void jit_stats_collect(JitStats *stats)
+{
+    CPUState *cpu;
+
+    tb_lock();
+    stats->tb_count = tb_ctx.nb_tbs;
+    stats->tb_gen_count = tb_ctx.tb_gen_count;
+    stats->code_bytes = tb_code_gen_size();
+    stats->flush_count = tb_ctx.tb_flush_count;
+    stats->gen_time = tb_ctx.tb_gen_time;
+    stats->helper_calls = tb_ctx.helper_call_count;
+    stats->chained_jumps = tb_ctx.tb_chain_count;
+    stats->smc_writes = tb_ctx.smc_write_count;
+    stats->smc_writes_filtered = tb_ctx.smc_write_skip_count;
+    stats->smc_invalidations = tb_ctx.smc_invalidate_count;
+    tb_unlock();
+
+    stats->unchained_exits = 0;
+    stats->tlb_misses = 0;
+    stats->tlb_victim_hits = 0;
+    CPU_FOREACH(cpu) {
+        stats->unchained_exits += cpu->tb_exit_count;
+        stats->tlb_misses += cpu->tlb_miss_count;
+        stats->tlb_victim_hits += cpu->tlb_victim_hit_count;
+    }
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
     TranslationBlock *tb;
+    struct qht_stats hst;
+    size_t code_size = tb_code_gen_size();
+    SMCPageCount smc_top[SMC_TOP_PAGES];
+    JitStats js;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (i = 0; i < tb_ctx.nb_regions; i++) {
+        for (j = 0; j < tb_ctx.regions[i].nb_tbs; j++) {
+            tb = &tb_ctx.regions[i].tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx->code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                tb_ctx.nb_regions, tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+            tb_ctx.nb_tbs, tcg_ctx->code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
-            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
-                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            tb_ctx.nb_tbs ? target_code_size /
+                    tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tb_ctx.nb_tbs ? code_size / tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
-            tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
-                                    tcg_ctx.tb_ctx.nb_tbs : 0);
+            tb_ctx.nb_tbs ? (cross_page * 100) /
+                                    tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
                 direct_jmp_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0,
+                tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
+                        tb_ctx.nb_tbs : 0,
                 direct_jmp2_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0);
+                tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
+                        tb_ctx.nb_tbs : 0);
+
+    qht_statistics_init(&tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.2f%% avg chain occ.\n",
+                hst.avg_occupancy * 100);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets (max %zu)\n",
+                hst.avg_chain, hst.max_chain);
+
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB flush count      %d\n", tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tb_ctx.tb_region_evict_count);
+    cpu_fprintf(f, "code since flush    %" PRIu64 " bytes\n",
+            tb_ctx.code_gen_bytes);
     cpu_fprintf(f, "TB invalidate count %d\n",
-            tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+            tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hot retranslations %d\n",
+            tb_ctx.tb_hot_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB remote flushes  %u\n",
+                atomic_read(&tlb_flush_remote_count));
+    cpu_fprintf(f, "TLB flush batches   %u (%u full)\n",
+                atomic_read(&tlb_flush_batch_count),
+                atomic_read(&tlb_flush_batch_full_count));
+
+    jit_stats_collect(&js);
+    cpu_fprintf(f, "TBs translated      %" PRId64 " in %0.3f s\n",
+                js.tb_gen_count, js.gen_time / 1e9);
+    cpu_fprintf(f, "helper calls        %" PRId64 "\n", js.helper_calls);
+    cpu_fprintf(f, "chained jumps       %" PRId64 "\n", js.chained_jumps);
+    cpu_fprintf(f, "unchained exits     %" PRId64 "\n", js.unchained_exits);
+    cpu_fprintf(f, "TLB misses          %" PRId64 " (%" PRId64
+                " from victim TLB)\n", js.tlb_misses, js.tlb_victim_hits);
+    cpu_fprintf(f, "code page writes    %" PRId64 " (%" PRId64
+                " filtered by bitmap)\n", js.smc_writes,
+                js.smc_writes_filtered);
+    cpu_fprintf(f, "SMC invalidations   %" PRId64 "\n", js.smc_invalidations);
+    page_smc_top(smc_top);
+    for (i = 0; i < SMC_TOP_PAGES && smc_top[i].count; i++) {
+        cpu_fprintf(f, "  page 0x%" PRIx64 " %u TBs\n",
+                    (uint64_t)smc_top[i].index << TARGET_PAGE_BITS,
+                    smc_top[i].count);
+    }
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -1735,6 +2287,41 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+TcgInfo *qmp_query_tcg(Error **errp)
+{
+    TcgInfo *info;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TCG is not enabled");
+        return NULL;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    tb_lock();
+    info->flush_count = tb_ctx.tb_flush_count;
+    info->region_evict_count = tb_ctx.tb_region_evict_count;
+    info->code_gen_bytes = tb_ctx.code_gen_bytes;
+    info->code_gen_buffer_size = tcg_ctx->code_gen_buffer_size;
+    info->regions = tb_ctx.nb_regions;
+    tb_unlock();
+
+    return info;
+}
+
+JitStats *qmp_query_jit_stats(Error **errp)
+{
+    JitStats *stats;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TCG is not enabled");
+        return NULL;
+    }
+
+    stats = g_malloc0(sizeof(*stats));
+    jit_stats_collect(stats);
+    return stats;
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -1871,7 +2458,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong addr, len, n, i;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1888,25 +2475,36 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL, false);
+    /* Walk the page table once for each block of V_L2_SIZE descriptors.
+       Blocks that are not allocated have all flags clear and no code, so
+       there is no need to allocate them for clearing the flags.  */
+    for (addr = start, len = end - start; len != 0; len -= n) {
+        target_ulong index = addr >> TARGET_PAGE_BITS;
+        PageDesc *p = page_find_alloc(index, flags != 0);
+
+        n = MIN(len, (V_L2_SIZE - (index & (V_L2_SIZE - 1)))
+                     << TARGET_PAGE_BITS);
+        if (!p) {
+            addr += n;
+            continue;
+        }
+        for (i = 0; i < n; i += TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE,
+                 p++) {
+            /* If the write protection bit is set, then we invalidate
+               the code inside.  */
+            if (!(p->flags & PAGE_WRITE) &&
+                (flags & PAGE_WRITE) &&
+                p->first_tb) {
+                tb_invalidate_phys_page(addr, 0, NULL, false);
+            }
+            p->flags = flags;
         }
-        p->flags = flags;
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
+    PageDesc *p = NULL;
     target_ulong end;
     target_ulong addr;
 
@@ -1931,10 +2529,14 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
 
     for (addr = start, len = end - start;
          len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
+         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE, p++) {
+        /* the descriptors of a block are contiguous, only walk the page
+           table when entering a new one */
+        if (!p || ((addr >> TARGET_PAGE_BITS) & (V_L2_SIZE - 1)) == 0) {
+            p = page_find(addr >> TARGET_PAGE_BITS);
+            if (!p) {
+                return -1;
+            }
         }
         if (!(p->flags & PAGE_VALID)) {
             return -1;
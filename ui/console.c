@@ -1708,6 +1708,32 @@ void dpy_gl_update(QemuConsole *con,
     con->gl->ops->dpy_gl_update(con->gl, x, y, w, h);
 }
 
+bool dpy_gl_has_dmabuf(QemuConsole *con)
+{
+    return con->gl && con->gl->ops->dpy_gl_scanout_dmabuf;
+}
+
+/*
+ * Scan out a buffer the device exported, instead of a texture of the
+ * shared GL context.  The UI imports it without any copy.  The buffer
+ * stays valid until dpy_gl_release_dmabuf().
+ */
+bool dpy_gl_scanout_dmabuf(QemuConsole *con, QemuDmaBuf *dmabuf)
+{
+    if (!dpy_gl_has_dmabuf(con)) {
+        return false;
+    }
+    return con->gl->ops->dpy_gl_scanout_dmabuf(con->gl, dmabuf);
+}
+
+void dpy_gl_release_dmabuf(QemuConsole *con, QemuDmaBuf *dmabuf)
+{
+    assert(con->gl);
+    if (con->gl->ops->dpy_gl_release_dmabuf) {
+        con->gl->ops->dpy_gl_release_dmabuf(con->gl, dmabuf);
+    }
+}
+
 /***********************************************************/
 /* register display */
 
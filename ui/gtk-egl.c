@@ -202,6 +202,45 @@ void gd_egl_scanout(DisplayChangeListener *dcl,
                               GL_TEXTURE_2D, vc->gfx.tex_id, 0);
 }
 
+#ifdef CONFIG_OPENGL_DMABUF
+
+bool gd_egl_scanout_dmabuf(DisplayChangeListener *dcl,
+                           QemuDmaBuf *dmabuf)
+{
+    VirtualConsole *vc = container_of(dcl, VirtualConsole, gfx.dcl);
+
+    eglMakeCurrent(qemu_egl_display, vc->gfx.esurface,
+                   vc->gfx.esurface, vc->gfx.ectx);
+
+    egl_dmabuf_import_texture(dmabuf);
+    if (!dmabuf->texture) {
+        return false;
+    }
+
+    gd_egl_scanout(dcl, dmabuf->texture, dmabuf->y0_top,
+                   0, 0, dmabuf->width, dmabuf->height);
+    return true;
+}
+
+void gd_egl_release_dmabuf(DisplayChangeListener *dcl,
+                           QemuDmaBuf *dmabuf)
+{
+    VirtualConsole *vc = container_of(dcl, VirtualConsole, gfx.dcl);
+
+    if (!dmabuf->texture) {
+        return;
+    }
+    if (vc->gfx.tex_id == dmabuf->texture) {
+        gd_egl_scanout(dcl, 0, false, 0, 0, 0, 0);
+    }
+
+    eglMakeCurrent(qemu_egl_display, vc->gfx.esurface,
+                   vc->gfx.esurface, vc->gfx.ectx);
+    egl_dmabuf_release_texture(dmabuf);
+}
+
+#endif
+
 void gd_egl_scanout_flush(DisplayChangeListener *dcl,
                           uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
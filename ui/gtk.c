@@ -650,6 +650,10 @@ static const DisplayChangeListenerOps dcl_egl_ops = {
     .dpy_gl_ctx_get_current  = qemu_egl_get_current_context,
     .dpy_gl_scanout          = gd_egl_scanout,
     .dpy_gl_update           = gd_egl_scanout_flush,
+#ifdef CONFIG_OPENGL_DMABUF
+    .dpy_gl_scanout_dmabuf   = gd_egl_scanout_dmabuf,
+    .dpy_gl_release_dmabuf   = gd_egl_release_dmabuf,
+#endif
 };
 
 #endif /* CONFIG_GTK_GL */
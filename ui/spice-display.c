@@ -860,6 +860,26 @@ static void qemu_spice_gl_scanout(DisplayChangeListener *dcl,
                          stride, fourcc, y_0_top);
 }
 
+static bool qemu_spice_gl_scanout_dmabuf(DisplayChangeListener *dcl,
+                                         QemuDmaBuf *dmabuf)
+{
+    SimpleSpiceDisplay *ssd = container_of(dcl, SimpleSpiceDisplay, dcl);
+    int fd;
+
+    /* The device keeps its own fd until it releases the buffer */
+    fd = dup(dmabuf->fd);
+    if (fd < 0) {
+        return false;
+    }
+    dprint(1, "%s: %dx%d (stride %d, fourcc 0x%x)\n", __func__,
+           dmabuf->width, dmabuf->height, dmabuf->stride, dmabuf->fourcc);
+
+    /* note: spice server will close the fd */
+    spice_qxl_gl_scanout(&ssd->qxl, fd, dmabuf->width, dmabuf->height,
+                         dmabuf->stride, dmabuf->fourcc, dmabuf->y0_top);
+    return true;
+}
+
 static void qemu_spice_gl_update(DisplayChangeListener *dcl,
                                  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
@@ -888,6 +908,7 @@ static const DisplayChangeListenerOps display_listener_gl_ops = {
 
     .dpy_gl_scanout          = qemu_spice_gl_scanout,
     .dpy_gl_update           = qemu_spice_gl_update,
+    .dpy_gl_scanout_dmabuf   = qemu_spice_gl_scanout_dmabuf,
 };
 
 #endif /* HAVE_SPICE_GL */
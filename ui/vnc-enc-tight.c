@@ -1175,15 +1175,24 @@ static void jpeg_term_destination(j_compress_ptr cinfo)
     buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
 }
 
-static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
+/* Rows converted and handed to the JPEG library at once, one MCU row */
+#define VNC_TIGHT_JPEG_ROWS 16
+
+/*
+ * @motion is set for areas that are updated at video rate: they use the
+ * faster integer DCT, as the loss in precision is not visible on content
+ * that is replaced a few frames later.
+ */
+static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h,
+                          int quality, bool motion)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_destination_mgr manager;
-    pixman_image_t *linebuf;
-    JSAMPROW row[1];
+    pixman_image_t *rowbuf;
+    JSAMPROW rows[VNC_TIGHT_JPEG_ROWS];
     uint8_t *buf;
-    int dy;
+    int stride, dy, i, n;
 
     if (surface_bytes_per_pixel(vs->vd->ds) == 1) {
         return send_full_color_rect(vs, x, y, w, h);
@@ -1202,6 +1211,9 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, true);
+    if (motion) {
+        cinfo.dct_method = JDCT_IFAST;
+    }
 
     manager.init_destination = jpeg_init_destination;
     manager.empty_output_buffer = jpeg_empty_output_buffer;
@@ -1210,14 +1222,21 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_start_compress(&cinfo, true);
 
-    linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, w);
-    buf = (uint8_t *)pixman_image_get_data(linebuf);
-    row[0] = buf;
-    for (dy = 0; dy < h; dy++) {
-        qemu_pixman_linebuf_fill(linebuf, vs->vd->server, w, x, y + dy);
-        jpeg_write_scanlines(&cinfo, row, 1);
+    rowbuf = pixman_image_create_bits(PIXMAN_BE_r8g8b8, w,
+                                      MIN(h, VNC_TIGHT_JPEG_ROWS), NULL, 0);
+    assert(rowbuf != NULL);
+    buf = (uint8_t *)pixman_image_get_data(rowbuf);
+    stride = pixman_image_get_stride(rowbuf);
+    for (i = 0; i < MIN(h, VNC_TIGHT_JPEG_ROWS); i++) {
+        rows[i] = buf + i * stride;
     }
-    qemu_pixman_image_unref(linebuf);
+    for (dy = 0; dy < h; dy += n) {
+        n = MIN(h - dy, VNC_TIGHT_JPEG_ROWS);
+        pixman_image_composite(PIXMAN_OP_SRC, vs->vd->server, NULL, rowbuf,
+                               x, y + dy, 0, 0, 0, 0, w, n);
+        jpeg_write_scanlines(&cinfo, rows, n);
+    }
+    qemu_pixman_image_unref(rowbuf);
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
@@ -1432,7 +1451,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_full_color_rect(vs, x, y, w, h);
         }
@@ -1446,7 +1465,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_palette_rect(vs, x, y, w, h, palette);
         }
@@ -50,24 +50,32 @@
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Jobs are encoded by a pool of worker threads.  The encoders keep state
+ * across updates (zlib streams, tight and zrle contexts), so the jobs of one
+ * client are encoded in order and by a single worker at a time, tracked by
+ * VncState::job_running; the jobs of different clients run in parallel.
  */
 
+/* Upper bound of the worker pool, more are started as the load requires */
+#define VNC_WORKER_THREADS_MAX 8
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    int n_threads;
+    int n_idle;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
-/*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
- */
+/* We use a single global queue shared by all displays */
 static VncJobQueue *queue;
 
+static void vnc_start_worker_thread_locked(VncJobQueue *queue);
+
 static void vnc_lock_queue(VncJobQueue *queue)
 {
     qemu_mutex_lock(&queue->mutex);
@@ -111,6 +119,10 @@ void vnc_job_push(VncJob *job)
         g_free(job);
     } else {
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        if (!queue->n_idle && !job->vs->job_running &&
+            queue->n_threads < VNC_WORKER_THREADS_MAX) {
+            vnc_start_worker_thread_locked(queue);
+        }
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
@@ -144,7 +156,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* A job that is being encoded is removed by its worker */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -215,6 +228,19 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->lossy_rect = local->lossy_rect;
 }
 
+/* The oldest job of a client that no other worker is encoding for */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (!job->vs->job_running) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
@@ -224,16 +250,19 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    queue->n_idle++;
+    while (!(job = vnc_next_job_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
+    queue->n_idle--;
 
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->running = true;
+    job->vs->job_running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->ioc == NULL || job->vs->abort == true) {
@@ -302,6 +331,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
 disconnected:
     vnc_lock_queue(queue);
     QTAILQ_REMOVE(&queue->jobs, job, next);
+    job->vs->job_running = false;
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
     g_free(job);
@@ -329,14 +359,28 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
-
-    qemu_thread_get_self(&queue->thread);
+    bool last;
 
     while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+
+    vnc_lock_queue(queue);
+    last = --queue->n_threads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static void vnc_start_worker_thread_locked(VncJobQueue *queue)
+{
+    QemuThread thread;
+
+    queue->n_threads++;
+    qemu_thread_create(&thread, "vnc_worker", vnc_worker_thread, queue,
+                       QEMU_THREAD_DETACHED);
+}
+
 static bool vnc_worker_thread_running(void)
 {
     return queue; /* Check global queue */
@@ -350,7 +394,8 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    vnc_lock_queue(q);
+    vnc_start_worker_thread_locked(q);
+    vnc_unlock_queue(q);
     queue = q; /* Set global queue */
 }
@@ -44,6 +44,9 @@
 #include "crypto/tlscredsanon.h"
 #include "crypto/tlscredsx509.h"
 #include "qom/object_interfaces.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
 #define VNC_REFRESH_INTERVAL_INC  50
@@ -615,6 +618,14 @@ static void vnc_dpy_update(DisplayChangeListener *dcl,
     struct VncSurface *s = &vd->guest;
 
     vnc_set_area_dirty(s->dirty, vd, x, y, w, h);
+
+    /* The refresh interval grows while the screen is idle; a device that
+     * reports damage on its own pulls the next refresh in, so the idle
+     * interval can be long without delaying the first update.
+     */
+    if (vd->dcl.update_interval > VNC_REFRESH_INTERVAL_BASE) {
+        update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_BASE);
+    }
 }
 
 void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
@@ -684,10 +695,24 @@ void *vnc_server_fb_ptr(VncDisplay *vd, int x, int y)
     return ptr;
 }
 
+static void vnc_rect_cache_flush(VncRectCache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->n_entries; i++) {
+        g_free(cache->entries[i].data);
+    }
+    cache->n_entries = 0;
+    cache->bytes = 0;
+}
+
+/* Called when no worker is encoding for this display */
 static void vnc_update_server_surface(VncDisplay *vd)
 {
     qemu_pixman_image_unref(vd->server);
     vd->server = NULL;
+    vd->server_gen++;
+    vnc_rect_cache_flush(&vd->rect_cache);
 
     if (QTAILQ_EMPTY(&vd->clients)) {
         return;
@@ -816,11 +841,98 @@ int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return 1;
 }
 
+static bool vnc_rect_cacheable(VncState *vs)
+{
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        /* the output depends on the client's compression state */
+        return false;
+    default:
+        return atomic_read(&vs->vd->num_shared) > 1;
+    }
+}
+
+static bool vnc_rect_cache_match(VncRectCacheEntry *e, VncState *vs,
+                                 int x, int y, int w, int h)
+{
+    return e->x == x && e->y == y && e->w == w && e->h == h &&
+        e->encoding == vs->vnc_encoding && e->be == vs->client_be &&
+        e->pf.bits_per_pixel == vs->client_pf.bits_per_pixel &&
+        e->pf.depth == vs->client_pf.depth &&
+        e->pf.rmax == vs->client_pf.rmax &&
+        e->pf.gmax == vs->client_pf.gmax &&
+        e->pf.bmax == vs->client_pf.bmax &&
+        e->pf.rshift == vs->client_pf.rshift &&
+        e->pf.gshift == vs->client_pf.gshift &&
+        e->pf.bshift == vs->client_pf.bshift;
+}
+
+/* Called with the display lock held */
+static VncRectCacheEntry *vnc_rect_cache_find(VncState *vs,
+                                              int x, int y, int w, int h)
+{
+    VncRectCache *cache = &vs->vd->rect_cache;
+    int i;
+
+    if (cache->gen != vs->vd->server_gen) {
+        vnc_rect_cache_flush(cache);
+        cache->gen = vs->vd->server_gen;
+        return NULL;
+    }
+    for (i = 0; i < cache->n_entries; i++) {
+        if (vnc_rect_cache_match(&cache->entries[i], vs, x, y, w, h)) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Called with the display lock held, after vnc_rect_cache_find() */
+static void vnc_rect_cache_add(VncState *vs, int x, int y, int w, int h,
+                               size_t offset, int n)
+{
+    VncRectCache *cache = &vs->vd->rect_cache;
+    size_t size = vs->output.offset - offset;
+    VncRectCacheEntry *e;
+
+    if (cache->n_entries == VNC_RECT_CACHE_ENTRIES ||
+        cache->bytes + size > VNC_RECT_CACHE_BYTES) {
+        return;
+    }
+
+    e = &cache->entries[cache->n_entries++];
+    e->x = x;
+    e->y = y;
+    e->w = w;
+    e->h = h;
+    e->encoding = vs->vnc_encoding;
+    e->pf = vs->client_pf;
+    e->be = vs->client_be;
+    e->n = n;
+    e->size = size;
+    e->data = g_memdup(vs->output.buffer + offset, size);
+    cache->bytes += size;
+}
+
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
     int n = 0;
     bool encode_raw = false;
     size_t saved_offs = vs->output.offset;
+    bool cache = vnc_rect_cacheable(vs);
+
+    if (cache) {
+        VncRectCacheEntry *e = vnc_rect_cache_find(vs, x, y, w, h);
+
+        if (e) {
+            vnc_write(vs, e->data, e->size);
+            return e->n;
+        }
+    }
 
     switch(vs->vnc_encoding) {
         case VNC_ENCODING_ZLIB:
@@ -861,6 +973,9 @@ int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
         n = vnc_raw_send_framebuffer_update(vs, x, y, w, h);
     }
 
+    if (cache) {
+        vnc_rect_cache_add(vs, x, y, w, h, saved_offs, n);
+    }
     return n;
 }
 
@@ -904,6 +1019,7 @@ static void vnc_dpy_copy(DisplayChangeListener *dcl,
     }
 
     /* do bitblit op on the local surface too */
+    vd->server_gen++;
     pitch = vnc_server_fb_stride(vd);
     src_row = vnc_server_fb_ptr(vd, src_x, src_y);
     dst_row = vnc_server_fb_ptr(vd, dst_x, dst_y);
@@ -2789,6 +2905,53 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/* Bytes of the server surface covered by one dirty bit */
+#define VNC_DIRTY_TILE_BYTES (VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES)
+
+/*
+ * Copy a tile from the guest surface to the server surface if it changed.
+ * The guest data is loaded once, compared, and stored from the same
+ * registers, instead of going through memcmp() and then memcpy().
+ */
+static inline bool vnc_tile_update(uint8_t *server, const uint8_t *guest)
+{
+#ifdef __SSE2__
+    __m128i g0, g1, g2, g3, d;
+
+    QEMU_BUILD_BUG_ON(VNC_DIRTY_TILE_BYTES != 4 * sizeof(__m128i));
+    g0 = _mm_loadu_si128((const __m128i *)guest);
+    g1 = _mm_loadu_si128((const __m128i *)guest + 1);
+    g2 = _mm_loadu_si128((const __m128i *)guest + 2);
+    g3 = _mm_loadu_si128((const __m128i *)guest + 3);
+    d = _mm_or_si128(
+        _mm_or_si128(_mm_xor_si128(g0, _mm_loadu_si128((__m128i *)server)),
+                     _mm_xor_si128(g1, _mm_loadu_si128((__m128i *)server + 1))),
+        _mm_or_si128(_mm_xor_si128(g2, _mm_loadu_si128((__m128i *)server + 2)),
+                     _mm_xor_si128(g3, _mm_loadu_si128((__m128i *)server + 3))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) == 0xFFFF) {
+        return false;
+    }
+    _mm_storeu_si128((__m128i *)server, g0);
+    _mm_storeu_si128((__m128i *)server + 1, g1);
+    _mm_storeu_si128((__m128i *)server + 2, g2);
+    _mm_storeu_si128((__m128i *)server + 3, g3);
+    return true;
+#else
+    uint64_t g[VNC_DIRTY_TILE_BYTES / 8], d = 0;
+    int i;
+
+    memcpy(g, guest, sizeof(g));
+    for (i = 0; i < ARRAY_SIZE(g); i++) {
+        d |= g[i] ^ ldq_he_p(server + i * 8);
+    }
+    if (!d) {
+        return false;
+    }
+    memcpy(server, g, sizeof(g));
+    return true;
+#endif
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2799,6 +2962,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
     int has_dirty = 0;
+    bool changed = false;
     pixman_image_t *tmpbuf = NULL;
 
     struct timeval tv = { 0, 0 };
@@ -2863,10 +3027,17 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
+            if (_cmp_bytes == VNC_DIRTY_TILE_BYTES) {
+                if (!vnc_tile_update(server_ptr, guest_ptr)) {
+                    continue;
+                }
+            } else {
+                /* partial tile at the right edge */
+                if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+                    continue;
+                }
+                memcpy(server_ptr, guest_ptr, _cmp_bytes);
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -2874,12 +3045,16 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             QTAILQ_FOREACH(vs, &vd->clients, next) {
                 set_bit(x, vs->dirty[y]);
             }
+            changed = true;
             has_dirty++;
         }
 
         y++;
     }
     qemu_pixman_image_unref(tmpbuf);
+    if (changed) {
+        vd->server_gen++;
+    }
     return has_dirty;
 }
 
@@ -125,6 +125,33 @@ struct VncSurface
     pixman_format_code_t format;
 };
 
+/*
+ * Encoded rectangles shared by the clients of a display.  Raw and hextile
+ * output depends only on the server surface and on the client pixel format,
+ * so when several clients use them the first one to need a rectangle
+ * encodes it and the others copy its output.  Entries are only valid for
+ * the server surface generation they were encoded from.
+ */
+#define VNC_RECT_CACHE_ENTRIES  256
+#define VNC_RECT_CACHE_BYTES    (32 * 1024 * 1024)
+
+typedef struct VncRectCacheEntry {
+    int x, y, w, h;
+    int encoding;
+    PixelFormat pf;
+    bool be;
+    int n;              /* rectangles in data */
+    size_t size;
+    uint8_t *data;
+} VncRectCacheEntry;
+
+typedef struct VncRectCache {
+    uint64_t gen;       /* VncDisplay::server_gen of the entries */
+    int n_entries;
+    size_t bytes;
+    VncRectCacheEntry entries[VNC_RECT_CACHE_ENTRIES];
+} VncRectCache;
+
 typedef enum VncShareMode {
     VNC_SHARE_MODE_CONNECTING = 1,
     VNC_SHARE_MODE_SHARED,
@@ -163,6 +190,8 @@ struct VncDisplay
 
     struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
     pixman_image_t *server;    /* vnc server surface */
+    uint64_t server_gen;       /* bumped whenever the server surface changes */
+    VncRectCache rect_cache;   /* protected by mutex */
 
     const char *id;
     QTAILQ_ENTRY(VncDisplay) next;
@@ -244,6 +273,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;       /* taken by a worker, under the queue lock */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -312,6 +342,7 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    bool job_running;   /* a worker is encoding for us, under the queue lock */
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
 #include "translate-all.h"
 
 #undef EAX
@@ -675,3 +676,94 @@ int cpu_signal_handler(int host_signum, void *pinfo,
 #error host CPU specific signal handler needed
 
 #endif
+
+/* The guest memory is directly accessible, so only unaligned accesses,
+   which the host may not perform atomically, need special care: with
+   other threads running they are emulated with those stopped, see
+   EXCP_ATOMIC, otherwise they take the slow path.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    int size = 1 << (get_memop(oi) & MO_SIZE);
+
+    if (unlikely(addr & (size - 1))) {
+        if (parallel_cpus) {
+            cpu_loop_exit_atomic(ENV_GET_CPU(env), retaddr - GETPC_ADJ);
+        }
+        return NULL;
+    }
+    return g2h(addr);
+}
+
+static uint64_t atomic_slow_ld(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    void *haddr = g2h(addr);
+
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        return ldub_p(haddr);
+    case MO_LEUW:
+        return lduw_le_p(haddr);
+    case MO_LEUL:
+        return ldl_le_p(haddr);
+    case MO_LEQ:
+        return ldq_le_p(haddr);
+    case MO_BEUW:
+        return lduw_be_p(haddr);
+    case MO_BEUL:
+        return ldl_be_p(haddr);
+    case MO_BEQ:
+        return ldq_be_p(haddr);
+    default:
+        tcg_abort();
+    }
+}
+
+static void atomic_slow_st(CPUArchState *env, target_ulong addr,
+                           uint64_t val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    void *haddr = g2h(addr);
+
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        stb_p(haddr, val);
+        break;
+    case MO_LEUW:
+        stw_le_p(haddr, val);
+        break;
+    case MO_LEUL:
+        stl_le_p(haddr, val);
+        break;
+    case MO_LEQ:
+        stq_le_p(haddr, val);
+        break;
+    case MO_BEUW:
+        stw_be_p(haddr, val);
+        break;
+    case MO_BEUL:
+        stl_be_p(haddr, val);
+        break;
+    case MO_BEQ:
+        stq_be_p(haddr, val);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+#define ATOMIC_MMU_LOOKUP  atomic_mmu_lookup(env, addr, oi, retaddr)
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+
+#undef ATOMIC_MMU_LOOKUP
@@ -0,0 +1,288 @@
+/*
+ * Simple C functions to supplement the C library
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/host-cpuinfo.h"
+
+/*
+ * All implementations accept any alignment of @buf and any @len.  The
+ * unaligned head and tail of the buffer are covered by unaligned loads
+ * that may overlap the aligned middle part, which is harmless since we
+ * only OR the data together.
+ */
+
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    if (unlikely(len < 8)) {
+        /* For a very small buffer, simply accumulate all the bytes.  */
+        const unsigned char *p = buf;
+        const unsigned char *e = buf + len;
+        unsigned char t = 0;
+
+        do {
+            t |= *p++;
+        } while (p < e);
+
+        return t == 0;
+    } else {
+        uint64_t t = ldq_he_p(buf);
+        const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 8) & -8);
+        const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -8);
+
+        /* Check the data accumulated so far before each block of 64 bytes,
+         * so that a non-zero buffer is usually detected early.
+         */
+        for (; p + 8 <= e; p += 8) {
+            __builtin_prefetch(p + 8);
+            if (t) {
+                return false;
+            }
+            t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        }
+        while (p < e) {
+            t |= *p++;
+        }
+        t |= ldq_he_p(buf + len - 8);
+
+        return t == 0;
+    }
+}
+
+typedef struct BufferZeroAccel {
+    unsigned flag;
+    bool (*fn)(const void *, size_t);
+    size_t min_len;
+} BufferZeroAccel;
+
+#if defined(__SSE2__) || defined(CPUINFO_AVX2_OPT)
+#ifdef CPUINFO_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Needs @len >= 64.  */
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    __m128i t = _mm_loadu_si128(buf);
+    __m128i *p = (__m128i *)(((uintptr_t)buf + 5 * 16) & -16);
+    __m128i *e = (__m128i *)(((uintptr_t)buf + len) & -16);
+    __m128i zero = _mm_setzero_si128();
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        t = _mm_cmpeq_epi8(t, zero);
+        if (unlikely(_mm_movemask_epi8(t) != 0xFFFF)) {
+            return false;
+        }
+        t = _mm_or_si128(_mm_or_si128(p[-4], p[-3]),
+                         _mm_or_si128(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the aligned tail.  */
+    t = _mm_or_si128(t, e[-3]);
+    t = _mm_or_si128(t, e[-2]);
+    t = _mm_or_si128(t, e[-1]);
+
+    /* Finish the unaligned tail.  */
+    t = _mm_or_si128(t, _mm_loadu_si128(buf + len - 16));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xFFFF;
+}
+
+#ifdef CPUINFO_AVX2_OPT
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Needs @len >= 128.  */
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    __m256i t = _mm256_loadu_si256(buf);
+    __m256i *p = (__m256i *)(((uintptr_t)buf + 5 * 32) & -32);
+    __m256i *e = (__m256i *)(((uintptr_t)buf + len) & -32);
+
+    /* Loop over 32-byte aligned blocks of 128.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            return false;
+        }
+        t = _mm256_or_si256(_mm256_or_si256(p[-4], p[-3]),
+                            _mm256_or_si256(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the last block of 128 unaligned.  */
+    t = _mm256_or_si256(t, _mm256_loadu_si256(buf + len - 4 * 32));
+    t = _mm256_or_si256(t, _mm256_loadu_si256(buf + len - 3 * 32));
+    t = _mm256_or_si256(t, _mm256_loadu_si256(buf + len - 2 * 32));
+    t = _mm256_or_si256(t, _mm256_loadu_si256(buf + len - 1 * 32));
+
+    return _mm256_testz_si256(t, t);
+}
+#pragma GCC pop_options
+#endif /* CPUINFO_AVX2_OPT */
+
+#define CACHE_SSE2    CPUINFO_SSE2
+#define CACHE_AVX2    CPUINFO_AVX2
+
+static unsigned cpuid_cache;
+
+static unsigned get_cpuid_cache(void)
+{
+    return host_cpuinfo();
+}
+
+static const BufferZeroAccel buffer_zero_accel[] = {
+#ifdef CPUINFO_AVX2_OPT
+    { CACHE_AVX2, buffer_zero_avx2, 128 },
+#endif
+    { CACHE_SSE2, buffer_zero_sse2, 64 },
+};
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/* Needs @len >= 64.  */
+static bool buffer_zero_neon(const void *buf, size_t len)
+{
+    uint64x2_t t = vreinterpretq_u64_u8(vld1q_u8(buf));
+    const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 5 * 16) & -16);
+    const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -16);
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1))) {
+            return false;
+        }
+        t = vorrq_u64(vorrq_u64(vld1q_u64(p - 8), vld1q_u64(p - 6)),
+                      vorrq_u64(vld1q_u64(p - 4), vld1q_u64(p - 2)));
+        p += 8;
+    }
+
+    /* Finish the aligned tail.  */
+    t = vorrq_u64(t, vld1q_u64(e - 6));
+    t = vorrq_u64(t, vld1q_u64(e - 4));
+    t = vorrq_u64(t, vld1q_u64(e - 2));
+
+    /* Finish the unaligned tail.  */
+    t = vorrq_u64(t, vreinterpretq_u64_u8(vld1q_u8(buf + len - 16)));
+
+    return !(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1));
+}
+
+/* Advanced SIMD is mandatory on AArch64.  */
+#define CACHE_NEON    1
+
+static unsigned cpuid_cache;
+
+static unsigned get_cpuid_cache(void)
+{
+    return CACHE_NEON;
+}
+
+static const BufferZeroAccel buffer_zero_accel[] = {
+    { CACHE_NEON, buffer_zero_neon, 64 },
+};
+#else
+static unsigned cpuid_cache;
+
+static unsigned get_cpuid_cache(void)
+{
+    return 0;
+}
+
+static const BufferZeroAccel buffer_zero_accel[] = {
+    { 0, buffer_zero_int, SIZE_MAX },
+};
+#endif
+
+/* Buffers shorter than length_to_accel always use buffer_zero_int.  */
+static bool (*buffer_accel)(const void *, size_t) = buffer_zero_int;
+static size_t length_to_accel = SIZE_MAX;
+
+static void init_accel(unsigned cache)
+{
+    int i;
+
+    buffer_accel = buffer_zero_int;
+    length_to_accel = SIZE_MAX;
+    for (i = 0; i < ARRAY_SIZE(buffer_zero_accel); i++) {
+        if (cache & buffer_zero_accel[i].flag) {
+            buffer_accel = buffer_zero_accel[i].fn;
+            length_to_accel = buffer_zero_accel[i].min_len;
+            break;
+        }
+    }
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    cpuid_cache = get_cpuid_cache();
+    init_accel(cpuid_cache);
+}
+
+/*
+ * For the unit tests: disable the fastest implementation that is still in
+ * use, so that the next call to buffer_is_zero uses the next best one.
+ * Returns false once only buffer_zero_int is left.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(buffer_zero_accel); i++) {
+        if (cpuid_cache & buffer_zero_accel[i].flag) {
+            cpuid_cache &= ~buffer_zero_accel[i].flag;
+            init_accel(cpuid_cache);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * There are no restrictions on the alignment of @buf or on @len.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    if (unlikely(len == 0)) {
+        return true;
+    }
+
+    /* Fetch the beginning of the buffer while we select the accelerator.  */
+    __builtin_prefetch(buf);
+
+    if (likely(len >= length_to_accel)) {
+        return buffer_accel(buf, len);
+    }
+    return buffer_zero_int(buf, len);
+}
@@ -0,0 +1,219 @@
+/*
+ * Host-specific assembly coroutine switch
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2011  Kevin Wolf <kwolf@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+typedef struct {
+    Coroutine base;
+    void *sp;           /* saved stack pointer while switched out */
+    void *stack;
+    bool used;          /* false until the first switch to the coroutine */
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+
+} CoroutineAsm;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+/* Each CO_SWITCH saves the few registers the compiler cannot be told about
+ * (the frame pointer and a resume address) on the current stack, stores
+ * the stack pointer in @from and loads the one of @to.  All other registers
+ * are listed as clobbered, so the compiler spills only what is live across
+ * the switch; callee-saved registers are thus preserved without saving the
+ * whole register file or the signal mask.
+ *
+ * CO_SWITCH_NEW starts @to on its fresh stack in coroutine_trampoline(),
+ * CO_SWITCH_RET resumes it where it last switched away, returning @action
+ * as the result of that switch.
+ */
+#if defined(__x86_64__)
+
+#define CO_SWITCH(from, to, action, jump) ({                                  \
+    int action_ = action;                                                     \
+    void *from_ = from;                                                       \
+    void *to_ = to;                                                           \
+    asm volatile(                                                             \
+        "leaq -128(%%rsp), %%rsp\n\t" /* skip the red zone */                 \
+        "pushq %%rbp\n\t"           /* save frame pointer on source stack */  \
+        "call 1f\n\t"               /* push the resume address (label 2) */   \
+        "jmp 2f\n"                                                            \
+        "1:\n\t"                                                              \
+        "movq %%rsp, %c[SP](%[FROM])\n\t"                                     \
+        "movq %c[SP](%[TO]), %%rsp\n\t"                                       \
+        jump "\n"                                                             \
+        "2:\n\t"                                                              \
+        "popq %%rbp\n\t"                                                      \
+        "leaq 128(%%rsp), %%rsp\n\t"                                          \
+        : "+a" (action_), [FROM] "+b" (from_), [TO] "+D" (to_)                \
+        : [SP] "i" (offsetof(CoroutineAsm, sp))                               \
+        : "rcx", "rdx", "rsi", "r8", "r9", "r10", "r11", "r12", "r13",        \
+          "r14", "r15", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",       \
+          "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12",          \
+          "xmm13", "xmm14", "xmm15", "cc", "memory");                         \
+    action_;                                                                  \
+})
+
+/* "call" keeps the new stack aligned as the ABI expects at function entry;
+ * %rdi already holds @to, the trampoline's argument.
+ */
+#define CO_SWITCH_NEW(from, to) \
+    CO_SWITCH(from, to, 0, "call coroutine_trampoline")
+#define CO_SWITCH_RET(from, to, action) \
+    CO_SWITCH(from, to, action, "ret")
+
+#elif defined(__aarch64__)
+
+#define CO_SWITCH(from, to, action, jump) ({                                  \
+    register uintptr_t action_ asm("x0") = action;                            \
+    register void *from_ asm("x1") = from;                                    \
+    register void *to_ asm("x2") = to;                                        \
+    asm volatile(                                                             \
+        "adr x30, 1f\n\t"           /* resume address */                      \
+        "stp x29, x30, [sp, #-16]!\n\t"                                       \
+        "mov x3, sp\n\t"                                                      \
+        "str x3, [%[FROM], %[SP]]\n\t"                                        \
+        "ldr x3, [%[TO], %[SP]]\n\t"                                          \
+        "mov sp, x3\n\t"                                                      \
+        jump "\n"                                                             \
+        "1:\n\t"                                                              \
+        : "+r" (action_), [FROM] "+r" (from_), [TO] "+r" (to_)                \
+        : [SP] "i" (offsetof(CoroutineAsm, sp))                               \
+        : "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",      \
+          "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20", "x21",      \
+          "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x30",             \
+          "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "v8", "v9",         \
+          "v10", "v11", "v12", "v13", "v14", "v15", "v16", "v17", "v18",      \
+          "v19", "v20", "v21", "v22", "v23", "v24", "v25", "v26", "v27",      \
+          "v28", "v29", "v30", "v31", "cc", "memory");                        \
+    action_;                                                                  \
+})
+
+/* The new stack is 16-byte aligned; a null frame pointer ends backtraces */
+#define CO_SWITCH_NEW(from, to) \
+    CO_SWITCH(from, to, (uintptr_t)to, \
+              "mov x29, xzr\n\tbl coroutine_trampoline")
+#define CO_SWITCH_RET(from, to, action) \
+    CO_SWITCH(from, to, action, "ldp x29, x30, [sp], #16\n\tret")
+
+#else
+#error coroutine-asm does not support this host, use another backend
+#endif
+
+static void __attribute__((used, noreturn, noinline))
+coroutine_trampoline(CoroutineAsm *self)
+{
+    Coroutine *co = &self->base;
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    const size_t stack_size = 1 << 20;
+    CoroutineAsm *co;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = g_malloc(stack_size);
+    co->sp = (void *)((uintptr_t)(co->stack + stack_size) & ~(uintptr_t)15);
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + stack_size);
+#endif
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    g_free(co->stack);
+    g_free(co);
+}
+
+/* This function is marked noinline for the same reason as in
+ * coroutine-ucontext.c: the switch may return in a different thread, so
+ * the address of the TLS variable "current" must not be cached across it.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+
+    current = to_;
+
+    if (to->used) {
+        return CO_SWITCH_RET(from, to, action);
+    }
+    to->used = true;
+    return CO_SWITCH_NEW(from, to);
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        /* The leader runs on the thread's own stack */
+        leader.used = true;
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
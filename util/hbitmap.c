@@ -13,6 +13,7 @@
 #include <glib.h>
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -385,6 +386,166 @@ void hbitmap_free(HBitmap *hb)
     g_free(hb);
 }
 
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Require at least 64 bit granularity to be safe on both 64 bit and 32 bit
+     * hosts.
+     */
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Start should be aligned to serialization granularity, chunk size should be
+ * aligned to serialization granularity too, except for last chunk.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+static void hbitmap_deserialize_fill(HBitmap *hb, uint64_t start,
+                                     uint64_t count, int c, bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, c, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    hbitmap_deserialize_fill(hb, start, count, 0, finish);
+}
+
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool finish)
+{
+    hbitmap_deserialize_fill(hb, start, count, 0xff, finish);
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    uint64_t i, size, prev_size;
+    int lev;
+
+    /* Bits past the end of the bitmap may have come in with the data; they
+     * must stay clear for hbitmap_count() and the iterators.
+     */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        hb->levels[HBITMAP_LEVELS - 1][hb->size >> BITS_PER_LEVEL] &=
+            (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    /* Restore levels starting from penultimate to zero level, assuming
+     * that the last level is ok.
+     */
+    size = MAX((hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(hb->levels[lev], 0, size * sizeof(unsigned long));
+
+        for (i = 0; i < prev_size; ++i) {
+            if (hb->levels[lev + 1][i]) {
+                hb->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = hb->size ? hb_count_between(hb, 0, hb->size - 1) : 0;
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
@@ -468,7 +629,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
-    int i;
+    unsigned long *dst;
+    const unsigned long *src;
+    uint64_t added = 0;
+    int i, last;
     uint64_t j;
 
     if ((a->size != b->size) || (a->granularity != b->granularity)) {
@@ -479,15 +643,96 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* The last level holds almost all of the data, so only visit the words
+     * of @b that the level above marks as non-zero.  Fully populated runs
+     * are OR-ed in a plain loop the compiler can vectorize, while sparse
+     * maps skip their clear areas entirely.  The upper levels are smaller
+     * by a factor of BITS_PER_LONG each and are simply OR-ed as a whole.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    last = HBITMAP_LEVELS - 1;
+    dst = a->levels[last];
+    src = b->levels[last];
+    for (j = 0; j < b->sizes[last - 1]; j++) {
+        unsigned long cur = b->levels[last - 1][j];
+        uint64_t base = j << BITS_PER_LEVEL;
+
+        if (cur == ~0UL) {
+            uint64_t end = MIN(base + BITS_PER_LONG, b->sizes[last]);
+            uint64_t k;
+
+            for (k = base; k < end; k++) {
+                added += ctpopl(src[k] & ~dst[k]);
+                dst[k] |= src[k];
+            }
+            continue;
+        }
+        while (cur) {
+            uint64_t k = base + ctzl(cur);
+
+            cur &= cur - 1;
+            added += ctpopl(src[k] & ~dst[k]);
+            dst[k] |= src[k];
+        }
+    }
+
+    for (i = last - 1; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
     }
 
+    a->count += added;
     return true;
 }
+
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t sz = hb->sizes[HBITMAP_LEVELS - 1];
+    uint64_t pos = start >> hb->granularity;
+    uint64_t i;
+    unsigned long cur;
+    int64_t res;
+
+    if (pos >= hb->size) {
+        return -1;
+    }
+
+    /* Fully set words are skipped a whole word at a time */
+    i = pos >> BITS_PER_LEVEL;
+    cur = ~last_lev[i] & (~0UL << (pos & (BITS_PER_LONG - 1)));
+    while (!cur) {
+        if (++i >= sz) {
+            return -1;
+        }
+        cur = ~last_lev[i];
+    }
+
+    /* Bits past the end of the bitmap are clear, so check the size */
+    res = (i << BITS_PER_LEVEL) + ctzl(cur);
+    if (res >= hb->size) {
+        return -1;
+    }
+    res <<= hb->granularity;
+    return MAX(res, (int64_t)start);
+}
+
+bool hbitmap_is_serialized_zero(const HBitmap *hb,
+                                uint64_t start, uint64_t count)
+{
+    unsigned long *el;
+    uint64_t el_count;
+    HBitmapIter hbi;
+    int64_t next;
+
+    if (!count) {
+        return true;
+    }
+
+    /* Only to validate the chunk; the upper levels tell the answer */
+    serialization_chunk(hb, start, count, &el, &el_count);
+
+    hbitmap_iter_init(&hbi, hb, start);
+    next = hbitmap_iter_next(&hbi);
+    return next < 0 || (uint64_t)next >= start + count;
+}
@@ -0,0 +1,47 @@
+/*
+ * Host CPU features for selecting accelerated code at run time
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/host-cpuinfo.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+
+unsigned host_cpuinfo(void)
+{
+    unsigned info = 0;
+    unsigned max, a, b, c = 0, d;
+
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            info |= CPUINFO_SSE2;
+        }
+    }
+#ifdef CPUINFO_AVX2_OPT
+    /* We must check that AVX is not just available, but usable,
+     * i.e. that the OS saves the YMM registers.
+     */
+    if (max >= 7 && (c & bit_OSXSAVE) && (c & bit_AVX)) {
+        int bv;
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((bv & 6) == 6 && (b & bit_AVX2)) {
+            info |= CPUINFO_AVX2;
+        }
+    }
+#endif
+    return info;
+}
+#else
+unsigned host_cpuinfo(void)
+{
+    return 0;
+}
+#endif
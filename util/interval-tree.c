@@ -0,0 +1,187 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+static void node_update(IntervalTreeNode *node)
+{
+    node->height = 1 + MAX(node_height(node->left), node_height(node->right));
+
+    node->subtree_last = node->last;
+    if (node->left && node->left->subtree_last > node->subtree_last) {
+        node->subtree_last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > node->subtree_last) {
+        node->subtree_last = node->right->subtree_last;
+    }
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *node)
+{
+    IntervalTreeNode *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *node)
+{
+    IntervalTreeNode *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+/* Update @node after one of its subtrees changed and restore the AVL
+ * invariant; returns the new root of the subtree. */
+static IntervalTreeNode *rebalance(IntervalTreeNode *node)
+{
+    int balance;
+
+    node_update(node);
+    balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    } else if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+/* Nodes are ordered by start; the address breaks ties, so that every node
+ * has a unique position and can be found again for removal. */
+static int node_cmp(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start ? -1 : 1;
+    }
+    if (a != b) {
+        return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+    }
+    return 0;
+}
+
+static IntervalTreeNode *insert_node(IntervalTreeNode *tree,
+                                     IntervalTreeNode *node)
+{
+    if (!tree) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+
+    if (node_cmp(node, tree) < 0) {
+        tree->left = insert_node(tree->left, node);
+    } else {
+        tree->right = insert_node(tree->right, node);
+    }
+    return rebalance(tree);
+}
+
+static IntervalTreeNode *remove_min(IntervalTreeNode *tree,
+                                    IntervalTreeNode **min)
+{
+    if (!tree->left) {
+        *min = tree;
+        return tree->right;
+    }
+    tree->left = remove_min(tree->left, min);
+    return rebalance(tree);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *tree,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *min, *right;
+    int cmp;
+
+    assert(tree);
+    cmp = node_cmp(node, tree);
+    if (cmp < 0) {
+        tree->left = remove_node(tree->left, node);
+    } else if (cmp > 0) {
+        tree->right = remove_node(tree->right, node);
+    } else {
+        if (!tree->right) {
+            return tree->left;
+        }
+        right = remove_min(tree->right, &min);
+        min->left = tree->left;
+        min->right = right;
+        return rebalance(min);
+    }
+    return rebalance(tree);
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    assert(node->start <= node->last);
+    root->root = insert_node(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = remove_node(root->root, node);
+}
+
+static IntervalTreeNode *find_node(IntervalTreeNode *tree,
+                                   uint64_t start, uint64_t last,
+                                   bool (*match)(IntervalTreeNode *node,
+                                                 void *opaque),
+                                   void *opaque)
+{
+    IntervalTreeNode *found;
+
+    /* Nothing in this subtree ends at or after @start */
+    if (!tree || tree->subtree_last < start) {
+        return NULL;
+    }
+
+    found = find_node(tree->left, start, last, match, opaque);
+    if (found) {
+        return found;
+    }
+
+    /* This node and the right subtree start after @last */
+    if (tree->start > last) {
+        return NULL;
+    }
+
+    if (tree->last >= start && (!match || match(tree, opaque))) {
+        return tree;
+    }
+
+    return find_node(tree->right, start, last, match, opaque);
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     bool (*match)(IntervalTreeNode *node,
+                                                   void *opaque),
+                                     void *opaque)
+{
+    return find_node(root->root, start, last, match, opaque);
+}
@@ -47,6 +47,8 @@
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -321,58 +323,197 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Preallocation is spread over at most this many threads; beyond that
+ * the memory bandwidth, not the page fault rate, is the bottleneck.
+ */
+#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    QemuThread pgthread;
+} MemsetThread;
+
+typedef struct MemsetContext {
+    MemsetThread *threads;
+    int num_threads;
+    QSLIST_ENTRY(MemsetContext) next;
+} MemsetContext;
+
+/* Set while a thread touches pages, so that SIGBUS can bail out of it */
+static __thread sigjmp_buf *memset_env;
+static bool memset_thread_failed;
+
+/* Preallocations started by os_mem_prealloc() while deferred, and the
+ * SIGBUS handler that is restored once all of them are done.
+ */
+static bool memset_deferred;
+static QSLIST_HEAD(, MemsetContext) memset_pending =
+    QSLIST_HEAD_INITIALIZER(memset_pending);
+static bool memset_handler_installed;
+static struct sigaction memset_oldact;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    if (memset_env) {
+        siglongjmp(*memset_env, 1);
+    }
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+static void *do_touch_pages(void *arg)
 {
-    int ret;
-    struct sigaction act, oldact;
+    MemsetThread *memset_args = arg;
+    char *addr = memset_args->addr;
     sigset_t set, oldset;
-
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = &sigbus_handler;
-    act.sa_flags = 0;
-
-    ret = sigaction(SIGBUS, &act, &oldact);
-    if (ret) {
-        perror("os_mem_prealloc: failed to install signal handler");
-        exit(1);
-    }
+    sigjmp_buf env;
+    size_t i;
 
     /* unblock SIGBUS */
     sigemptyset(&set);
     sigaddset(&set, SIGBUS);
     pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (sigsetjmp(env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        memset_env = &env;
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            /*
+             * Keep the contents: the file may already hold guest RAM,
+             * for example one shared with another QEMU process.
+             */
+            *(volatile char *)addr = *addr;
+            addr += memset_args->hpagesize;
+        }
+    }
+    memset_env = NULL;
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+static int get_memset_num_threads(size_t numpages)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = 1;
+
+    if (host_procs > 0) {
+        ret = MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT);
+    }
+    return MIN(ret, numpages);
+}
+
+/* Start touching every page of @area, splitting the work evenly between
+ * threads.  Any NUMA policy has already been applied to the range by the
+ * caller, so the pages end up on the right node whichever thread faults
+ * them in.
+ */
+static MemsetContext *touch_all_pages(char *area, size_t hpagesize,
+                                      size_t numpages)
+{
+    MemsetContext *ctx = g_new0(MemsetContext, 1);
+    size_t numpages_per_thread, leftover;
+    char *addr = area;
+    int i;
+
+    ctx->num_threads = get_memset_num_threads(numpages);
+    ctx->threads = g_new0(MemsetThread, ctx->num_threads);
+    numpages_per_thread = numpages / ctx->num_threads;
+    leftover = numpages % ctx->num_threads;
+    for (i = 0; i < ctx->num_threads; i++) {
+        ctx->threads[i].addr = addr;
+        ctx->threads[i].numpages = numpages_per_thread + (i < leftover);
+        ctx->threads[i].hpagesize = hpagesize;
+        qemu_thread_create(&ctx->threads[i].pgthread, "touch_pages",
+                           do_touch_pages, &ctx->threads[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += ctx->threads[i].numpages * hpagesize;
+    }
+    return ctx;
+}
+
+static void touch_all_pages_wait(MemsetContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_threads; i++) {
+        qemu_thread_join(&ctx->threads[i].pgthread);
+    }
+    g_free(ctx->threads);
+    g_free(ctx);
+}
+
+/* Join all preallocation threads and restore the SIGBUS handler */
+static void memset_finish(void)
+{
+    MemsetContext *ctx;
+    int ret;
+
+    while ((ctx = QSLIST_FIRST(&memset_pending))) {
+        QSLIST_REMOVE_HEAD(&memset_pending, next);
+        touch_all_pages_wait(ctx);
+    }
+
+    if (memset_thread_failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    }
 
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
+    if (memset_handler_installed) {
+        memset_handler_installed = false;
+        ret = sigaction(SIGBUS, &memset_oldact, NULL);
+        if (ret) {
+            perror("os_mem_prealloc: failed to reinstall signal handler");
+            exit(1);
         }
+    }
+}
 
-        ret = sigaction(SIGBUS, &oldact, NULL);
+void os_mem_prealloc(int fd, char *area, size_t memory)
+{
+    int ret;
+    struct sigaction act;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    MemsetContext *ctx;
+
+    if (!numpages) {
+        return;
+    }
+
+    if (!memset_handler_installed) {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &sigbus_handler;
+        act.sa_flags = 0;
+
+        ret = sigaction(SIGBUS, &act, &memset_oldact);
         if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
+            perror("os_mem_prealloc: failed to install signal handler");
             exit(1);
         }
+        memset_handler_installed = true;
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ctx = touch_all_pages(area, hpagesize, numpages);
+    QSLIST_INSERT_HEAD(&memset_pending, ctx, next);
+    if (!memset_deferred) {
+        memset_finish();
     }
 }
 
+void os_mem_prealloc_defer(void)
+{
+    memset_deferred = true;
+}
+
+void os_mem_prealloc_wait(void)
+{
+    memset_deferred = false;
+    memset_finish();
+}
+
 
 static struct termios oldtty;
 
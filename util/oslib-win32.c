@@ -549,6 +549,14 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
     }
 }
 
+void os_mem_prealloc_defer(void)
+{
+}
+
+void os_mem_prealloc_wait(void)
+{
+}
+
 
 /* XXX: put correct support for win32 */
 int qemu_read_password(char *buf, int buf_size)
@@ -11,6 +11,7 @@
  *
  */
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #ifdef __linux__
 #include <sys/syscall.h>
 #include <linux/futex.h>
@@ -18,6 +19,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitmap.h"
 
 static bool name_threads;
 
@@ -43,6 +45,7 @@ void qemu_mutex_init(QemuMutex *mutex)
 {
     int err;
 
+    mutex->site = NULL;
     err = pthread_mutex_init(&mutex->lock, NULL);
     if (err)
         error_exit(err, __func__);
@@ -57,24 +60,67 @@ void qemu_mutex_destroy(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
-void qemu_mutex_lock(QemuMutex *mutex)
+static void qemu_mutex_lock_profiled(QemuMutex *mutex, QemuLockSite *site)
 {
+    int64_t wait_ns = 0;
     int err;
 
+    err = pthread_mutex_trylock(&mutex->lock);
+    if (err == EBUSY) {
+        int64_t start = qemu_sync_profile_clock();
+
+        err = pthread_mutex_lock(&mutex->lock);
+        wait_ns = MAX(qemu_sync_profile_clock() - start, 1);
+    }
+    if (err)
+        error_exit(err, __func__);
+
+    qemu_sync_profile_acquired(site, wait_ns);
+    mutex->site = site;
+    mutex->locked_ns = qemu_sync_profile_clock();
+}
+
+void qemu_mutex_lock_impl(QemuMutex *mutex, QemuLockSite *site)
+{
+    int err;
+
+    if (unlikely(atomic_read(&qemu_sync_profile_enabled))) {
+        qemu_mutex_lock_profiled(mutex, site);
+        return;
+    }
+
     err = pthread_mutex_lock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
 }
 
-int qemu_mutex_trylock(QemuMutex *mutex)
+int qemu_mutex_trylock_impl(QemuMutex *mutex, QemuLockSite *site)
+{
+    int err;
+
+    err = pthread_mutex_trylock(&mutex->lock);
+    if (err == 0 && unlikely(atomic_read(&qemu_sync_profile_enabled))) {
+        qemu_sync_profile_acquired(site, 0);
+        mutex->site = site;
+        mutex->locked_ns = qemu_sync_profile_clock();
+    }
+    return err;
+}
+
+static void qemu_mutex_profile_release(QemuMutex *mutex)
 {
-    return pthread_mutex_trylock(&mutex->lock);
+    qemu_sync_profile_released(mutex->site,
+                               qemu_sync_profile_clock() - mutex->locked_ns);
+    mutex->site = NULL;
 }
 
 void qemu_mutex_unlock(QemuMutex *mutex)
 {
     int err;
 
+    if (unlikely(mutex->site)) {
+        qemu_mutex_profile_release(mutex);
+    }
     err = pthread_mutex_unlock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
@@ -118,11 +164,20 @@ void qemu_cond_broadcast(QemuCond *cond)
 
 void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
 {
+    QemuLockSite *site = mutex->site;
     int err;
 
+    /* The time spent waiting on the condition does not count as held */
+    if (unlikely(site)) {
+        qemu_mutex_profile_release(mutex);
+    }
     err = pthread_cond_wait(&cond->cond, &mutex->lock);
     if (err)
         error_exit(err, __func__);
+    if (unlikely(site)) {
+        mutex->site = site;
+        mutex->locked_ns = qemu_sync_profile_clock();
+    }
 }
 
 void qemu_sem_init(QemuSemaphore *sem, int init)
@@ -491,6 +546,82 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef __linux__
+    size_t setsize = CPU_ALLOC_SIZE(nbits);
+    cpu_set_t *cpuset;
+    unsigned long cpu;
+    int err;
+
+    cpuset = CPU_ALLOC(nbits);
+    if (!cpuset) {
+        return -ENOMEM;
+    }
+    CPU_ZERO_S(setsize, cpuset);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        CPU_SET_S(cpu, setsize, cpuset);
+    }
+
+    err = pthread_setaffinity_np(thread->thread, setsize, cpuset);
+    CPU_FREE(cpuset);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int qemu_host_node_get_cpus(unsigned int node, unsigned long *host_cpus,
+                            unsigned long nbits)
+{
+#ifdef __linux__
+    char *path, *contents;
+    const char *p;
+    int ret = 0;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%u/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return -ENOENT;
+    }
+    g_free(path);
+
+    /* e.g. "0-7,16-23\n" */
+    p = contents;
+    while (*p && *p != '\n') {
+        unsigned long first, last;
+        const char *end;
+
+        if (qemu_strtoul(p, &end, 10, &first) < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            if (qemu_strtoul(p, &end, 10, &last) < 0 || last < first) {
+                ret = -EINVAL;
+                break;
+            }
+        }
+        if (last >= nbits) {
+            ret = -ERANGE;
+            break;
+        }
+        bitmap_set(host_cpus, first, last - first + 1);
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    g_free(contents);
+    return ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitops.h"
 #include <process.h>
 
 static bool name_threads;
@@ -40,6 +42,7 @@ static void error_exit(int err, const char *msg)
 void qemu_mutex_init(QemuMutex *mutex)
 {
     mutex->owner = 0;
+    mutex->site = NULL;
     InitializeCriticalSection(&mutex->lock);
 }
 
@@ -49,18 +52,39 @@ void qemu_mutex_destroy(QemuMutex *mutex)
     DeleteCriticalSection(&mutex->lock);
 }
 
-void qemu_mutex_lock(QemuMutex *mutex)
+static void qemu_mutex_enter(QemuMutex *mutex, QemuLockSite *site)
 {
-    EnterCriticalSection(&mutex->lock);
+    int64_t wait_ns = 0;
+    bool profile = atomic_read(&qemu_sync_profile_enabled);
+
+    if (!profile) {
+        EnterCriticalSection(&mutex->lock);
+    } else if (!TryEnterCriticalSection(&mutex->lock)) {
+        int64_t start = qemu_sync_profile_clock();
+
+        EnterCriticalSection(&mutex->lock);
+        wait_ns = MAX(qemu_sync_profile_clock() - start, 1);
+    }
 
     /* Win32 CRITICAL_SECTIONs are recursive.  Assert that we're not
      * using them as such.
      */
     assert(mutex->owner == 0);
     mutex->owner = GetCurrentThreadId();
+
+    if (profile && site) {
+        qemu_sync_profile_acquired(site, wait_ns);
+        mutex->site = site;
+        mutex->locked_ns = qemu_sync_profile_clock();
+    }
 }
 
-int qemu_mutex_trylock(QemuMutex *mutex)
+void qemu_mutex_lock_impl(QemuMutex *mutex, QemuLockSite *site)
+{
+    qemu_mutex_enter(mutex, site);
+}
+
+int qemu_mutex_trylock_impl(QemuMutex *mutex, QemuLockSite *site)
 {
     int owned;
 
@@ -68,6 +92,11 @@ int qemu_mutex_trylock(QemuMutex *mutex)
     if (owned) {
         assert(mutex->owner == 0);
         mutex->owner = GetCurrentThreadId();
+        if (atomic_read(&qemu_sync_profile_enabled)) {
+            qemu_sync_profile_acquired(site, 0);
+            mutex->site = site;
+            mutex->locked_ns = qemu_sync_profile_clock();
+        }
     }
     return !owned;
 }
@@ -75,6 +104,11 @@ int qemu_mutex_trylock(QemuMutex *mutex)
 void qemu_mutex_unlock(QemuMutex *mutex)
 {
     assert(mutex->owner == GetCurrentThreadId());
+    if (mutex->site) {
+        qemu_sync_profile_released(mutex->site,
+                                   qemu_sync_profile_clock() - mutex->locked_ns);
+        mutex->site = NULL;
+    }
     mutex->owner = 0;
     LeaveCriticalSection(&mutex->lock);
 }
@@ -168,6 +202,8 @@ void qemu_cond_broadcast(QemuCond *cond)
 
 void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
 {
+    QemuLockSite *site = mutex->site;
+
     /*
      * This access is protected under the mutex.
      */
@@ -199,7 +235,14 @@ void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
         SetEvent(cond->continue_event);
     }
 
-    qemu_mutex_lock(mutex);
+    /* Keep accounting the hold time to the site that took the mutex,
+     * the time spent waiting on the condition is not counted.
+     */
+    qemu_mutex_enter(mutex, NULL);
+    if (site) {
+        mutex->site = site;
+        mutex->locked_ns = qemu_sync_profile_clock();
+    }
 }
 
 void qemu_sem_init(QemuSemaphore *sem, int init)
@@ -476,3 +519,36 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+    DWORD_PTR mask = 0;
+    unsigned long cpu;
+    HANDLE handle;
+    BOOL ok;
+
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        if (cpu >= sizeof(mask) * BITS_PER_BYTE) {
+            /* processor groups are not supported */
+            return -EINVAL;
+        }
+        mask |= (DWORD_PTR)1 << cpu;
+    }
+
+    handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION,
+                        FALSE, thread->tid);
+    if (!handle) {
+        return -ESRCH;
+    }
+    ok = SetThreadAffinityMask(handle, mask) != 0;
+    CloseHandle(handle);
+    return ok ? 0 : -EINVAL;
+}
+
+int qemu_host_node_get_cpus(unsigned int node, unsigned long *host_cpus,
+                            unsigned long nbits)
+{
+    return -ENOSYS;
+}
@@ -32,6 +32,7 @@
 #include "qemu/atomic.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 /*
  * Global grace period counter.  Bit 0 is always one in rcu_gp_ctr.
@@ -46,6 +47,16 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Protected by rcu_sync_lock, except callbacks which is only written by
+ * call_rcu_thread.
+ */
+static RCUStats rcu_stats;
+
+/* How many times an expedited grace period rescans the readers before it
+ * goes to sleep like a normal one.
+ */
+#define RCU_EXPEDITED_SPINS     1000
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -68,10 +79,11 @@ typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
 static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
 
 /* Wait for previous parity/grace period to be empty of readers.  */
-static void wait_for_readers(void)
+static void wait_for_readers(bool expedited)
 {
     ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
     struct rcu_reader_data *index, *tmp;
+    int spins = expedited ? RCU_EXPEDITED_SPINS : 0;
 
     for (;;) {
         /* We want to be notified of changes made to rcu_gp_ongoing
@@ -111,6 +123,13 @@ static void wait_for_readers(void)
             break;
         }
 
+        /* Readers are usually out of their critical section within a few
+         * microseconds, rescanning is cheaper than a futex round trip.
+         */
+        if (spins-- > 0) {
+            continue;
+        }
+
         /* Wait for one thread to report a quiescent state and try again.
          * Release rcu_registry_lock, so rcu_(un)register_thread() doesn't
          * wait too much time.
@@ -137,11 +156,14 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
-void synchronize_rcu(void)
+static void do_synchronize_rcu(bool expedited)
 {
+    int64_t start, ns;
+
     qemu_mutex_lock(&rcu_sync_lock);
     qemu_mutex_lock(&rcu_registry_lock);
 
+    start = get_clock();
     if (!QLIST_EMPTY(&registry)) {
         /* In either case, the atomic_mb_set below blocks stores that free
          * old RCU-protected pointers.
@@ -153,60 +175,108 @@ void synchronize_rcu(void)
              * Switch parity: 0 -> 1, 1 -> 0.
              */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
-            wait_for_readers();
+            wait_for_readers(expedited);
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
         } else {
             /* Increment current grace period.  */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
         }
 
-        wait_for_readers();
+        wait_for_readers(expedited);
     }
 
     qemu_mutex_unlock(&rcu_registry_lock);
+
+    ns = get_clock() - start;
+    rcu_stats.gp_count++;
+    rcu_stats.gp_expedited += expedited;
+    rcu_stats.gp_total_ns += ns;
+    if (ns > rcu_stats.gp_max_ns) {
+        rcu_stats.gp_max_ns = ns;
+    }
+    qemu_mutex_unlock(&rcu_sync_lock);
+}
+
+void synchronize_rcu(void)
+{
+    do_synchronize_rcu(false);
+}
+
+void synchronize_rcu_expedited(void)
+{
+    do_synchronize_rcu(true);
+}
+
+void rcu_get_stats(RCUStats *stats)
+{
+    qemu_mutex_lock(&rcu_sync_lock);
+    *stats = rcu_stats;
+    stats->callbacks = atomic_read(&rcu_stats.callbacks);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
 
 
 #define RCU_CALL_MIN_SIZE        30
 
+/* A backlog this large is worth an expedited grace period */
+#define RCU_CALL_EXPEDITE_SIZE   1000
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
+ *
+ * Each registered thread queues its callbacks on its own queue, so that
+ * call_rcu1() only touches cache lines owned by the calling thread.  The
+ * consumer is call_rcu_thread, or rcu_unregister_thread() handing the
+ * leftovers of an exiting thread to global_queue; both run under
+ * rcu_registry_lock.  Unregistered threads use global_queue directly.
  */
-static struct rcu_head dummy;
-static struct rcu_head *head = &dummy, **tail = &dummy.next;
-static int rcu_call_count;
+struct rcu_cb_queue {
+    struct rcu_head dummy;
+    struct rcu_head *head, **tail;
+    int count;                  /* callbacks not taken by the consumer */
+};
+
+static struct rcu_cb_queue global_queue;
+static __thread struct rcu_cb_queue thread_queue;
 static QemuEvent rcu_call_ready_event;
 
-static void enqueue(struct rcu_head *node)
+static void queue_init(struct rcu_cb_queue *q)
+{
+    q->dummy.next = NULL;
+    q->head = &q->dummy;
+    q->tail = &q->dummy.next;
+    q->count = 0;
+}
+
+static void enqueue(struct rcu_cb_queue *q, struct rcu_head *node)
 {
     struct rcu_head **old_tail;
 
     node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
+    old_tail = atomic_xchg(&q->tail, &node->next);
     atomic_mb_set(old_tail, node);
 }
 
-static struct rcu_head *try_dequeue(void)
+static struct rcu_head *try_dequeue(struct rcu_cb_queue *q)
 {
     struct rcu_head *node, *next;
 
 retry:
-    /* Test for an empty list, which we do not expect.  Note that for
-     * the consumer head and tail are always consistent.  The head
-     * is consistent because only the consumer reads/writes it.
-     * The tail, because it is the first step in the enqueuing.
-     * It is only the next pointers that might be inconsistent.
+    /* Test for an empty list.  Note that for the consumer head and tail
+     * are always consistent.  The head is consistent because only the
+     * consumer reads/writes it.  The tail, because it is the first step
+     * in the enqueuing.  It is only the next pointers that might be
+     * inconsistent.
      */
-    if (head == &dummy && atomic_mb_read(&tail) == &dummy.next) {
-        abort();
+    if (q->head == &q->dummy && atomic_mb_read(&q->tail) == &q->dummy.next) {
+        return NULL;
     }
 
     /* If the head node has NULL in its next pointer, the value is
      * wrong and we need to wait until its enqueuer finishes the update.
      */
-    node = head;
-    next = atomic_mb_read(&head->next);
+    node = q->head;
+    next = atomic_mb_read(&q->head->next);
     if (!next) {
         return NULL;
     }
@@ -216,87 +286,152 @@ retry:
      * dummy node, and the one being removed.  So we do not need to update
      * the tail pointer.
      */
-    head = next;
+    q->head = next;
 
     /* If we dequeued the dummy node, add it back at the end and retry.  */
-    if (node == &dummy) {
-        enqueue(node);
+    if (node == &q->dummy) {
+        enqueue(q, node);
         goto retry;
     }
 
     return node;
 }
 
-static void *call_rcu_thread(void *opaque)
+/* Move whatever can be dequeued from @q to the list ending at *@last.
+ * Returns the number of callbacks moved.
+ */
+static int queue_collect(struct rcu_cb_queue *q, struct rcu_head ***last)
 {
     struct rcu_head *node;
+    int n = 0;
+
+    while ((node = try_dequeue(q))) {
+        node->next = NULL;
+        **last = node;
+        *last = &node->next;
+        n++;
+    }
+    atomic_sub(&q->count, n);
+    return n;
+}
+
+/* Number of callbacks that call_rcu_thread has not taken yet */
+static int rcu_call_count(void)
+{
+    struct rcu_reader_data *index;
+    int n;
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    n = atomic_read(&global_queue.count);
+    QLIST_FOREACH(index, &registry, node) {
+        n += atomic_read(&index->cb_queue->count);
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+    return n;
+}
+
+/* Take all callbacks queued so far, from every thread */
+static struct rcu_head *rcu_collect_callbacks(int *count)
+{
+    struct rcu_head *list = NULL, **last = &list;
+    struct rcu_reader_data *index;
+    int n;
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    n = queue_collect(&global_queue, &last);
+    QLIST_FOREACH(index, &registry, node) {
+        n += queue_collect(index->cb_queue, &last);
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    *count = n;
+    return list;
+}
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *node, *next;
 
     rcu_register_thread();
 
     for (;;) {
         int tries = 0;
-        int n = atomic_read(&rcu_call_count);
+        int n = rcu_call_count();
 
         /* Heuristically wait for a decent number of callbacks to pile up.
-         * Fetch rcu_call_count now, we only must process elements that were
-         * added before synchronize_rcu() starts.
+         * Only callbacks that are collected before synchronize_rcu()
+         * starts may be processed after it.
          */
         while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
-                n = atomic_read(&rcu_call_count);
+                n = rcu_call_count();
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
             }
-            n = atomic_read(&rcu_call_count);
+            n = rcu_call_count();
         }
 
-        atomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
-        qemu_mutex_lock_iothread();
-        while (n > 0) {
-            node = try_dequeue();
-            while (!node) {
-                qemu_mutex_unlock_iothread();
-                qemu_event_reset(&rcu_call_ready_event);
-                node = try_dequeue();
-                if (!node) {
-                    qemu_event_wait(&rcu_call_ready_event);
-                    node = try_dequeue();
-                }
-                qemu_mutex_lock_iothread();
-            }
+        node = rcu_collect_callbacks(&n);
+        if (!node) {
+            /* Enqueuers have not finished linking their nodes yet */
+            continue;
+        }
 
-            n--;
+        if (n >= RCU_CALL_EXPEDITE_SIZE) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
+
+        qemu_mutex_lock_iothread();
+        for (; node; node = next) {
+            next = node->next;
             node->func(node);
         }
         qemu_mutex_unlock_iothread();
+        atomic_add(&rcu_stats.callbacks, n);
     }
     abort();
 }
 
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+    struct rcu_cb_queue *q = rcu_reader.cb_queue ?: &global_queue;
+
     node->func = func;
-    enqueue(node);
-    atomic_inc(&rcu_call_count);
+    enqueue(q, node);
+    atomic_inc(&q->count);
     qemu_event_set(&rcu_call_ready_event);
 }
 
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
+    queue_init(&thread_queue);
     qemu_mutex_lock(&rcu_registry_lock);
+    rcu_reader.cb_queue = &thread_queue;
     QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
 void rcu_unregister_thread(void)
 {
+    struct rcu_head *node;
+
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_REMOVE(&rcu_reader, node);
+
+    /* The queue goes away with the thread, hand its callbacks over.  We
+     * are its only producer, so every node can be dequeued.
+     */
+    while ((node = try_dequeue(&thread_queue))) {
+        enqueue(&global_queue, node);
+        atomic_inc(&global_queue.count);
+    }
+    rcu_reader.cb_queue = NULL;
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
@@ -335,6 +470,19 @@ static void rcu_init_unlock(void)
 
 void rcu_after_fork(void)
 {
+    struct rcu_reader_data *index;
+    struct rcu_head *node;
+
+    /* Only the forking thread survives, but the queues of the others are
+     * still mapped: keep their callbacks so that they eventually run.
+     */
+    QLIST_FOREACH(index, &registry, node) {
+        while ((node = try_dequeue(index->cb_queue))) {
+            enqueue(&global_queue, node);
+            global_queue.count++;
+        }
+        index->cb_queue = NULL;
+    }
     memset(&registry, 0, sizeof(registry));
     rcu_init_complete();
 }
@@ -344,5 +492,6 @@ static void __attribute__((__constructor__)) rcu_init(void)
 #ifdef CONFIG_POSIX
     pthread_atfork(rcu_init_lock, rcu_init_unlock, rcu_init_unlock);
 #endif
+    queue_init(&global_queue);
     rcu_init_complete();
 }
@@ -0,0 +1,104 @@
+/*
+ * Lock contention profiling
+ *
+ * Copyright (c) 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+
+bool qemu_sync_profile_enabled;
+
+/* Sites are added on their first profiled acquisition and never removed,
+ * since they are static variables of the code that takes the lock.
+ */
+static QemuLockSite *sync_profile_sites;
+
+void qemu_sync_profile_enable(bool enable)
+{
+    atomic_set(&qemu_sync_profile_enabled, enable);
+}
+
+void qemu_sync_profile_reset(void)
+{
+    QemuLockSite *site;
+
+    for (site = atomic_rcu_read(&sync_profile_sites); site;
+         site = atomic_rcu_read(&site->next)) {
+        atomic_set(&site->acquisitions, 0);
+        atomic_set(&site->contended, 0);
+        atomic_set(&site->wait_ns, 0);
+        atomic_set(&site->wait_max_ns, 0);
+        atomic_set(&site->hold_ns, 0);
+    }
+}
+
+void qemu_sync_profile_foreach(void (*fn)(QemuLockSite *site, void *opaque),
+                               void *opaque)
+{
+    QemuLockSite *site;
+
+    for (site = atomic_rcu_read(&sync_profile_sites); site;
+         site = atomic_rcu_read(&site->next)) {
+        fn(site, opaque);
+    }
+}
+
+static void sync_profile_register(QemuLockSite *site)
+{
+    QemuLockSite *old, *head;
+
+    if (atomic_cmpxchg(&site->registered, false, true)) {
+        return;
+    }
+
+    head = atomic_read(&sync_profile_sites);
+    do {
+        old = head;
+        site->next = old;
+        head = atomic_cmpxchg(&sync_profile_sites, old, site);
+    } while (head != old);
+}
+
+/* Called with the lock held, @wait_ns is 0 if it was free */
+void qemu_sync_profile_acquired(QemuLockSite *site, int64_t wait_ns)
+{
+    uint64_t max;
+
+    if (unlikely(!atomic_read(&site->registered))) {
+        sync_profile_register(site);
+    }
+
+    atomic_inc(&site->acquisitions);
+    if (wait_ns == 0) {
+        return;
+    }
+
+    atomic_inc(&site->contended);
+    atomic_add(&site->wait_ns, wait_ns);
+    max = atomic_read(&site->wait_max_ns);
+    while (max < wait_ns) {
+        uint64_t old = max;
+        max = atomic_cmpxchg(&site->wait_max_ns, old, wait_ns);
+        if (max == old) {
+            break;
+        }
+    }
+}
+
+/* Called with the lock still held, just before releasing it */
+void qemu_sync_profile_released(QemuLockSite *site, int64_t hold_ns)
+{
+    atomic_add(&site->hold_ns, hold_ns);
+}
+
+int64_t qemu_sync_profile_clock(void)
+{
+    return get_clock();
+}
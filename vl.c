@@ -197,6 +197,7 @@ static NotifierList machine_init_done_notifiers =
 bool xen_allowed;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
+uint64_t xen_mapcache_bucket_size;
 
 static int has_defaults = 1;
 static int default_serial = 1;
@@ -277,6 +278,12 @@ static QemuOptsList qemu_trace_opts = {
         },{
             .name = "file",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "sample",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "rate",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -458,6 +465,25 @@ static QemuOptsList qemu_mem_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .merge_lists = true,
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Enable/disable multi-threaded TCG",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_icount_opts = {
     .name = "icount",
     .implied_opt_name = "shift",
@@ -479,6 +505,9 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrfile",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrcompress",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -723,6 +752,53 @@ StatusInfo *qmp_query_status(Error **errp)
     return info;
 }
 
+/* Startup phase timing, reported by query-startup-phases */
+typedef struct StartupPhase {
+    const char *name;
+    int64_t duration_ns;
+    int64_t elapsed_ns;
+} StartupPhase;
+
+#define MAX_STARTUP_PHASES 16
+
+static StartupPhase startup_phases[MAX_STARTUP_PHASES];
+static int startup_nb_phases;
+static int64_t startup_start_ns, startup_last_ns;
+
+/* The phase @name began where the previous one ended */
+static void startup_phase_done(const char *name)
+{
+    int64_t now = get_clock();
+    StartupPhase *phase;
+
+    assert(startup_nb_phases < MAX_STARTUP_PHASES);
+    phase = &startup_phases[startup_nb_phases++];
+    phase->name = name;
+    phase->duration_ns = now - startup_last_ns;
+    phase->elapsed_ns = now - startup_start_ns;
+    startup_last_ns = now;
+    trace_vl_startup_phase(name, phase->duration_ns, phase->elapsed_ns);
+}
+
+StartupPhaseInfoList *qmp_query_startup_phases(Error **errp)
+{
+    StartupPhaseInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < startup_nb_phases; i++) {
+        StartupPhaseInfoList *entry = g_new0(StartupPhaseInfoList, 1);
+        StartupPhaseInfo *info = g_new0(StartupPhaseInfo, 1);
+
+        info->name = g_strdup(startup_phases[i].name);
+        info->duration_ns = startup_phases[i].duration_ns;
+        info->elapsed_ns = startup_phases[i].elapsed_ns;
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 static bool qemu_vmstop_requested(RunState *r)
 {
     qemu_mutex_lock(&vmstop_lock);
@@ -2959,6 +3035,7 @@ int main(int argc, char **argv, char **envp)
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
+    QemuOpts *accel_opts = NULL;
     QemuOptsList *olist;
     int optind;
     const char *optarg;
@@ -2984,6 +3061,8 @@ int main(int argc, char **argv, char **envp)
     Error *main_loop_err = NULL;
     Error *err = NULL;
 
+    startup_start_ns = startup_last_ns = get_clock();
+
     qemu_init_cpu_loop();
     qemu_mutex_lock_iothread();
 
@@ -3019,6 +3098,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_accel_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
     qemu_add_opts(&qemu_fw_cfg_opts);
 
@@ -3470,7 +3550,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *cache, *sock_fd, *socket;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3506,6 +3586,10 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
 #endif
                 }
+                cache = qemu_opt_get(opts, "cache");
+                if (cache) {
+                    qemu_opt_set(fsdev, "cache", cache, &error_abort);
+                }
                 qemu_opt_set(fsdev, "fsdriver",
                              qemu_opt_get(opts, "fsdriver"), &error_abort);
                 qemu_opt_set(fsdev, "path", qemu_opt_get(opts, "path"),
@@ -3662,6 +3746,28 @@ int main(int argc, char **argv, char **envp)
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse_noisily(olist, "accel=kvm", false);
                 break;
+            case QEMU_OPTION_accel:
+                accel_opts = qemu_opts_parse_noisily(qemu_find_opts("accel"),
+                                                     optarg, true);
+                if (!accel_opts) {
+                    exit(1);
+                }
+                optarg = qemu_opt_get(accel_opts, "accel");
+                olist = qemu_find_opts("machine");
+                if (optarg && strcmp("kvm", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=kvm", false);
+                } else if (optarg && strcmp("xen", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=xen", false);
+                } else if (optarg && strcmp("tcg", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=tcg", false);
+                } else {
+                    if (optarg && !is_help_option(optarg)) {
+                        error_printf("Unknown accelerator: %s\n", optarg);
+                    }
+                    error_printf("Supported accelerators: kvm, xen, tcg\n");
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_M:
             case QEMU_OPTION_machine:
                 olist = qemu_find_opts("machine");
@@ -3897,6 +4003,23 @@ int main(int argc, char **argv, char **envp)
                 }
                 xen_mode = XEN_ATTACH;
                 break;
+            case QEMU_OPTION_xen_mapcache_bucket_size:
+            {
+                int64_t sz;
+                char *end;
+
+                if (!(xen_available())) {
+                    printf("Option %s not supported for this target\n", popt->name);
+                    exit(1);
+                }
+                sz = qemu_strtosz(optarg, &end);
+                if (sz <= 0 || *end || !is_power_of_2(sz)) {
+                    error_report("invalid mapcache bucket size: %s", optarg);
+                    exit(1);
+                }
+                xen_mapcache_bucket_size = sz;
+                break;
+            }
             case QEMU_OPTION_trace:
             {
                 opts = qemu_opts_parse_noisily(qemu_find_opts("trace"),
@@ -3905,7 +4028,18 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 if (qemu_opt_get(opts, "enable")) {
-                    trace_enable_events(qemu_opt_get(opts, "enable"));
+                    const char *pattern = qemu_opt_get(opts, "enable");
+
+                    trace_enable_events(pattern);
+                    if (qemu_opt_get(opts, "sample") ||
+                        qemu_opt_get(opts, "rate")) {
+                        if (pattern[0] == '-') {
+                            pattern++;
+                        }
+                        trace_limit_events(pattern,
+                                           qemu_opt_get_number(opts, "sample", 0),
+                                           qemu_opt_get_number(opts, "rate", 0));
+                    }
                 }
                 trace_init_events(qemu_opt_get(opts, "events"));
                 if (trace_file) {
@@ -4284,6 +4418,12 @@ int main(int argc, char **argv, char **envp)
 
     page_size_init();
     socket_init();
+    startup_phase_done("options");
+
+    /* Let memory backends touch their pages while the other backends are
+     * set up; os_mem_prealloc_wait() joins them before machine init.
+     */
+    os_mem_prealloc_defer();
 
     if (qemu_opts_foreach(qemu_find_opts("object"),
                           user_creatable_add_opts_foreach,
@@ -4321,7 +4461,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_phase_done("objects");
     configure_accelerator(current_machine);
+    startup_phase_done("accelerator");
 
     if (qtest_chrdev) {
         qtest_init(qtest_chrdev, qtest_log, &error_fatal);
@@ -4397,6 +4539,10 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (accel_opts && tcg_enabled()) {
+        qemu_tcg_configure(accel_opts, &error_fatal);
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4510,6 +4656,10 @@ int main(int argc, char **argv, char **envp)
     current_machine->boot_order = boot_order;
     current_machine->cpu_model = cpu_model;
 
+    startup_phase_done("backends");
+    os_mem_prealloc_wait();
+    startup_phase_done("prealloc");
+
     machine_class->init(current_machine);
 
     realtime_init();
@@ -4534,6 +4684,8 @@ int main(int argc, char **argv, char **envp)
     /* Check if IGD GFX passthrough. */
     igd_gfx_passthru();
 
+    startup_phase_done("machine");
+
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"),
                           device_init_func, NULL, NULL)) {
@@ -4550,6 +4702,8 @@ int main(int argc, char **argv, char **envp)
         qemu_register_reset(restore_boot_order, g_strdup(boot_order));
     }
 
+    startup_phase_done("devices");
+
     ds = init_displaystate();
 
     /* init local displays */
@@ -4607,6 +4761,8 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_phase_done("frontends");
+
     qdev_machine_creation_done();
 
     /* TODO: once all bus devices are qdevified, this should be done
@@ -4619,6 +4775,8 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_phase_done("machine-done");
+
     replay_start();
 
     /* This checkpoint is required by replay to separate prior clock
@@ -4632,6 +4790,7 @@ int main(int argc, char **argv, char **envp)
             autostart = 0;
         }
     }
+    startup_phase_done("reset");
 
     qdev_prop_check_globals();
     if (vmstate_dump_file) {
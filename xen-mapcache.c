@@ -15,6 +15,10 @@
 #include "hw/xen/xen_backend.h"
 #include "sysemu/blockdev.h"
 #include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 
 #include <xen/hvm/params.h>
 #include <sys/mman.h>
@@ -40,7 +44,7 @@
 #  define MCACHE_BUCKET_SHIFT 20
 #  define MCACHE_MAX_SIZE     (1UL<<35) /* 32GB Cap */
 #endif
-#define MCACHE_BUCKET_SIZE (1UL << MCACHE_BUCKET_SHIFT)
+#define MCACHE_BUCKET_SIZE (1UL << mapcache->mcache_bucket_shift)
 
 /* This is the size of the virtual address space reserve to QEMU that will not
  * be use by MapCache.
@@ -50,6 +54,7 @@
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
 typedef struct MapCacheEntry {
+    struct rcu_head rcu;
     hwaddr paddr_index;
     uint8_t *vaddr_base;
     unsigned long *valid_mapping;
@@ -58,6 +63,24 @@ typedef struct MapCacheEntry {
     struct MapCacheEntry *next;
 } MapCacheEntry;
 
+/* A mapping that was replaced, unmapped once no reader can still use it */
+typedef struct MapCacheStale {
+    struct rcu_head rcu;
+    uint8_t *vaddr_base;
+    hwaddr size;
+    unsigned long *valid_mapping;
+} MapCacheStale;
+
+/* The last unlocked mapping each vCPU or iothread looked up, valid for as
+ * long as the mapcache sequence count did not change.
+ */
+typedef struct MapCacheRecent {
+    unsigned sequence;
+    hwaddr paddr_index;
+    uint8_t *vaddr_base;
+    unsigned long *valid_mapping;
+} MapCacheRecent;
+
 typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
@@ -70,17 +93,21 @@ typedef struct MapCache {
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
 
-    /* For most cases (>99.9%), the page address is the same. */
-    MapCacheEntry *last_entry;
     unsigned long max_mcache_size;
     unsigned int mcache_bucket_shift;
 
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     QemuMutex lock;
+    /* Bumped around every change to the entries, under @lock.  Unlocked
+     * lookups walk the buckets without taking @lock and retry if it moved;
+     * entries and mappings they may see are only freed after a grace period.
+     */
+    QemuSeqLock seqlock;
     void *opaque;
 } MapCache;
 
 static MapCache *mapcache;
+static __thread MapCacheRecent mapcache_recent;
 
 static inline void mapcache_lock(void)
 {
@@ -101,6 +128,34 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
         return 0;
 }
 
+static void xen_map_cache_stale_free(MapCacheStale *stale)
+{
+    if (munmap(stale->vaddr_base, stale->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    g_free(stale->valid_mapping);
+    g_free(stale);
+}
+
+/* Called with the seqlock held for writing */
+static void xen_map_cache_retire(MapCacheEntry *entry)
+{
+    MapCacheStale *stale;
+
+    if (entry->vaddr_base == NULL) {
+        g_free(entry->valid_mapping);
+    } else {
+        stale = g_new0(MapCacheStale, 1);
+        stale->vaddr_base = entry->vaddr_base;
+        stale->size = entry->size;
+        stale->valid_mapping = entry->valid_mapping;
+        call_rcu(stale, xen_map_cache_stale_free, rcu);
+    }
+    entry->vaddr_base = NULL;
+    entry->valid_mapping = NULL;
+}
+
 void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 {
     unsigned long size;
@@ -111,6 +166,19 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->phys_offset_to_gaddr = f;
     mapcache->opaque = opaque;
     qemu_mutex_init(&mapcache->lock);
+    seqlock_init(&mapcache->seqlock, NULL);
+
+    mapcache->mcache_bucket_shift = MCACHE_BUCKET_SHIFT;
+    if (xen_mapcache_bucket_size) {
+        if (xen_mapcache_bucket_size < XC_PAGE_SIZE ||
+            xen_mapcache_bucket_size > MCACHE_MAX_SIZE ||
+            !is_power_of_2(xen_mapcache_bucket_size)) {
+            error_report("xen: invalid mapcache bucket size %" PRIu64,
+                         xen_mapcache_bucket_size);
+            exit(1);
+        }
+        mapcache->mcache_bucket_shift = ctz64(xen_mapcache_bucket_size);
+    }
 
     QTAILQ_INIT(&mapcache->locked_entries);
 
@@ -138,8 +206,8 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
-          (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
-         (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT));
+          (1UL << (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) - 1) >>
+         (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT));
 
     size = mapcache->nr_buckets * sizeof (MapCacheEntry);
     size = (size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
@@ -163,19 +231,12 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     pfns = g_malloc0(nb_pfn * sizeof (xen_pfn_t));
     err = g_malloc0(nb_pfn * sizeof (int));
 
-    if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    g_free(entry->valid_mapping);
-    entry->valid_mapping = NULL;
-
     for (i = 0; i < nb_pfn; i++) {
-        pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
+        pfns[i] = (address_index << (mapcache->mcache_bucket_shift -
+                                     XC_PAGE_SHIFT)) + i;
     }
 
+    /* Map the new range first, the old one may still be in use */
     vaddr_base = xenforeignmemory_map(xen_fmem, xen_domid, PROT_READ|PROT_WRITE,
                                       nb_pfn, pfns, err);
     if (vaddr_base == NULL) {
@@ -183,6 +244,9 @@ static void xen_remap_bucket(MapCacheEntry *entry,
         exit(-1);
     }
 
+    seqlock_write_lock(&mapcache->seqlock);
+    xen_map_cache_retire(entry);
+
     entry->vaddr_base = vaddr_base;
     entry->paddr_index = address_index;
     entry->size = size;
@@ -195,11 +259,61 @@ static void xen_remap_bucket(MapCacheEntry *entry,
             bitmap_set(entry->valid_mapping, i, 1);
         }
     }
+    seqlock_write_unlock(&mapcache->seqlock);
 
     g_free(pfns);
     g_free(err);
 }
 
+/* Look up an existing unlocked mapping of the page at @phys_addr without
+ * taking the mapcache lock.  The result stays valid until the caller
+ * leaves its RCU critical section.
+ */
+static uint8_t *xen_map_cache_lookup_rcu(hwaddr phys_addr)
+{
+    MapCacheRecent *recent = &mapcache_recent;
+    hwaddr address_index = phys_addr >> mapcache->mcache_bucket_shift;
+    hwaddr address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
+    unsigned long page = address_offset >> XC_PAGE_SHIFT;
+    MapCacheEntry *entry;
+    unsigned long *valid_mapping;
+    uint8_t *vaddr_base;
+    unsigned start;
+
+    start = seqlock_read_begin(&mapcache->seqlock);
+    if (recent->sequence == start && recent->vaddr_base &&
+        recent->paddr_index == address_index &&
+        test_bit(page, recent->valid_mapping) &&
+        !seqlock_read_retry(&mapcache->seqlock, start)) {
+        return recent->vaddr_base + address_offset;
+    }
+
+    do {
+        start = seqlock_read_begin(&mapcache->seqlock);
+        vaddr_base = NULL;
+        valid_mapping = NULL;
+        for (entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+             entry; entry = atomic_rcu_read(&entry->next)) {
+            if (entry->vaddr_base && entry->paddr_index == address_index &&
+                test_bit(page, entry->valid_mapping)) {
+                vaddr_base = entry->vaddr_base;
+                valid_mapping = entry->valid_mapping;
+                break;
+            }
+        }
+    } while (seqlock_read_retry(&mapcache->seqlock, start));
+
+    if (!vaddr_base) {
+        return NULL;
+    }
+
+    recent->sequence = start;
+    recent->paddr_index = address_index;
+    recent->vaddr_base = vaddr_base;
+    recent->valid_mapping = valid_mapping;
+    return vaddr_base + address_offset;
+}
+
 static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
                                        uint8_t lock)
 {
@@ -211,7 +325,7 @@ static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
     bool translated = false;
 
 tryagain:
-    address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
+    address_index  = phys_addr >> mapcache->mcache_bucket_shift;
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
     trace_xen_map_cache(phys_addr);
@@ -227,16 +341,6 @@ tryagain:
         test_bit_size = XC_PAGE_SIZE;
     }
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == address_index &&
-        !lock && !size &&
-        test_bits(address_offset >> XC_PAGE_SHIFT,
-                  test_bit_size >> XC_PAGE_SHIFT,
-                  mapcache->last_entry->valid_mapping)) {
-        trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-        return mapcache->last_entry->vaddr_base + address_offset;
-    }
-
     /* size is always a multiple of MCACHE_BUCKET_SIZE */
     if (size) {
         cache_size = size + address_offset;
@@ -259,8 +363,8 @@ tryagain:
     }
     if (!entry) {
         entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
         xen_remap_bucket(entry, cache_size, address_index);
+        atomic_rcu_set(&pentry->next, entry);
     } else if (!entry->lock) {
         if (!entry->vaddr_base || entry->paddr_index != address_index ||
                 entry->size != cache_size ||
@@ -274,7 +378,6 @@ tryagain:
     if(!test_bits(address_offset >> XC_PAGE_SHIFT,
                 test_bit_size >> XC_PAGE_SHIFT,
                 entry->valid_mapping)) {
-        mapcache->last_entry = NULL;
         if (!translated && mapcache->phys_offset_to_gaddr) {
             phys_addr = mapcache->phys_offset_to_gaddr(phys_addr, size, mapcache->opaque);
             translated = true;
@@ -284,18 +387,17 @@ tryagain:
         return NULL;
     }
 
-    mapcache->last_entry = entry;
     if (lock) {
         MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
         entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
+        reventry->vaddr_req = entry->vaddr_base + address_offset;
+        reventry->paddr_index = entry->paddr_index;
         reventry->size = entry->size;
         QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
     }
 
-    trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-    return mapcache->last_entry->vaddr_base + address_offset;
+    trace_xen_map_cache_return(entry->vaddr_base + address_offset);
+    return entry->vaddr_base + address_offset;
 }
 
 uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
@@ -303,6 +405,19 @@ uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
 {
     uint8_t *p;
 
+    /* Unlocked single page mappings are by far the most common, and are
+     * usually found in the cache already.
+     */
+    if (!lock && !size) {
+        rcu_read_lock();
+        p = xen_map_cache_lookup_rcu(phys_addr);
+        rcu_read_unlock();
+        if (p) {
+            trace_xen_map_cache_return(p);
+            return p;
+        }
+    }
+
     mapcache_lock();
     p = xen_map_cache_unlocked(phys_addr, size, lock);
     mapcache_unlock();
@@ -345,7 +460,7 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
         DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
         raddr = 0;
     } else {
-        raddr = (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
+        raddr = (reventry->paddr_index << mapcache->mcache_bucket_shift) +
              ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
     }
     mapcache_unlock();
@@ -378,11 +493,6 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
     g_free(reventry);
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == paddr_index) {
-        mapcache->last_entry = NULL;
-    }
-
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
     while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
         pentry = entry;
@@ -397,13 +507,11 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
         return;
     }
 
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
-    }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+    seqlock_write_lock(&mapcache->seqlock);
+    atomic_rcu_set(&pentry->next, entry->next);
+    xen_map_cache_retire(entry);
+    seqlock_write_unlock(&mapcache->seqlock);
+    g_free_rcu(entry, rcu);
 }
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
@@ -429,6 +537,7 @@ void xen_invalidate_map_cache(void)
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
+    seqlock_write_lock(&mapcache->seqlock);
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];
 
@@ -439,19 +548,11 @@ void xen_invalidate_map_cache(void)
             continue;
         }
 
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
+        xen_map_cache_retire(entry);
         entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
         entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
     }
-
-    mapcache->last_entry = NULL;
+    seqlock_write_unlock(&mapcache->seqlock);
 
     mapcache_unlock();
 }